@@ -10,9 +10,12 @@
 
 #include "RepRapFirmware.h"
 #include "RTOSIface/RTOSIface.h"
+#include <atomic>
 
 // Class to perform averaging of values read from the ADC
 // numAveraged should be a power of 2 for best efficiency
+// There must be only one producer calling ProcessReading. It doesn't lock anything: the sum is a single 32-bit word so readers of it always see a consistent value,
+// and a sequence counter lets code that needs the readings and the sum to agree detect that an update happened while it was looking at them.
 template<size_t numAveraged> class AdcAveragingFilter
 {
 public:
@@ -25,34 +28,96 @@ public:
 	{
 		TaskCriticalSectionLocker lock;
 
+		++sequence;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
 		sum = (uint32_t)val * (uint32_t)numAveraged;
 		index = 0;
 		isValid = false;
+		windowShift = smoothingShift = 0;
 		for (size_t i = 0; i < numAveraged; ++i)
 		{
 			readings[i] = val;
 		}
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		++sequence;
 	}
 
-	// Call this to put a new reading into the filter
+	// Call this to put a new reading into the filter. The sequence number is odd while the update is in progress.
 	void ProcessReading(uint16_t r) noexcept
 	{
-		TaskCriticalSectionLocker lock;
-
-		sum = sum - readings[index] + r;
-		readings[index] = r;
-		++index;
-		if (index == numAveraged)
+		++sequence;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		const size_t locIndex = index;
+		sum = sum - readings[locIndex] + r;
+		if (windowShift != 0)
+		{
+			const size_t window = numAveraged >> windowShift;
+			shortSum = shortSum - readings[(locIndex >= window) ? locIndex - window : locIndex + numAveraged - window] + r;
+		}
+		if (smoothingShift != 0)
+		{
+			smoothedSum = smoothedSum + sum - (smoothedSum >> smoothingShift);
+		}
+		readings[locIndex] = r;
+		if (locIndex + 1 == numAveraged)
 		{
 			index = 0;
 			isValid = true;
 		}
+		else
+		{
+			index = locIndex + 1;
+		}
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		++sequence;
 	}
 
-	// Return the raw sum
+	// Return the raw sum, or if the filter length has been changed then the equivalent sum of numAveraged readings
 	uint32_t GetSum() const volatile noexcept
 	{
-		return sum;
+		if (smoothingShift != 0)
+		{
+			return smoothedSum >> smoothingShift;
+		}
+		return (windowShift != 0) ? shortSum << windowShift : sum;
+	}
+
+	// Set the length of the filter in readings, rounded to a power of 2. A length shorter than numAveraged averages only the most recent readings, for less delay.
+	// A longer length adds exponential smoothing with that time constant after the average over numAveraged readings. Return the length actually used.
+	uint32_t SetLength(uint32_t length) noexcept
+	{
+		static_assert((numAveraged & (numAveraged - 1)) == 0);
+		unsigned int newWindowShift = 0, newSmoothingShift = 0;
+		while (newWindowShift < MaxWindowShift && (numAveraged >> (newWindowShift + 1)) >= max<uint32_t>(length, 1))
+		{
+			++newWindowShift;
+		}
+		while (newSmoothingShift < MaxSmoothingShift && ((uint32_t)numAveraged << (newSmoothingShift + 1)) <= length)
+		{
+			++newSmoothingShift;
+		}
+
+		TaskCriticalSectionLocker lock;
+		++sequence;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		windowShift = newWindowShift;
+		smoothingShift = newSmoothingShift;
+		shortSum = 0;
+		const size_t window = numAveraged >> newWindowShift;
+		for (size_t i = 0; i < window; ++i)
+		{
+			shortSum += readings[(index > i) ? index - 1 - i : index + numAveraged - 1 - i];
+		}
+		smoothedSum = sum << newSmoothingShift;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		++sequence;
+		return GetLength();
+	}
+
+	// Get the length of the filter in readings
+	uint32_t GetLength() const noexcept
+	{
+		return ((uint32_t)numAveraged << smoothingShift) >> windowShift;
 	}
 
 	// Return true if we have a valid average
@@ -80,7 +145,16 @@ private:
 	uint16_t readings[numAveraged];
 	size_t index;
 	uint32_t sum;
+	uint32_t sequence = 0;				// incremented before and after each update
 	bool isValid;
+
+	// Shorter or longer filter lengths. The sum of the full set of readings is still maintained so that we can check it.
+	static constexpr unsigned int MaxWindowShift = 6;		// we can average as few as numAveraged/64 readings
+	static constexpr unsigned int MaxSmoothingShift = 8;	// we can smooth over as many as numAveraged * 256 readings
+	uint8_t windowShift = 0;			// we average the most recent numAveraged >> windowShift readings
+	uint8_t smoothingShift = 0;			// exponential smoothing time constant is 2^smoothingShift times numAveraged readings, or none if zero
+	uint32_t shortSum = 0;				// the sum of the most recent numAveraged >> windowShift readings
+	uint32_t smoothedSum = 0;			// the smoothed sum multiplied by 2^smoothingShift
 	//invariant(sum == + over readings)
 	//invariant(index < numAveraged)
 };
@@ -91,10 +165,35 @@ template<size_t numAveraged> void AdcAveragingFilter<numAveraged>::CallbackFeedI
 	static_cast<AdcAveragingFilter<numAveraged>*>(cp.vp)->ProcessReading(val);
 }
 
+// Check that the sum agrees with the readings. If the producer updates the filter while we are adding up the readings then we try again.
 template<size_t numAveraged> bool AdcAveragingFilter<numAveraged>::CheckIntegrity() const noexcept
 {
-	AtomicCriticalSectionLocker lock;
+	constexpr unsigned int MaxAttempts = 4;
+	for (unsigned int attempt = 0; attempt < MaxAttempts; ++attempt)
+	{
+		const uint32_t startSequence = *static_cast<const volatile uint32_t*>(&sequence);
+		if ((startSequence & 1u) != 0)
+		{
+			continue;						// an update is in progress
+		}
+		std::atomic_signal_fence(std::memory_order_seq_cst);
 
+		uint32_t locSum = 0;
+		for (size_t i = 0; i < numAveraged; ++i)
+		{
+			locSum += *static_cast<const volatile uint16_t*>(&readings[i]);
+		}
+		const uint32_t locStoredSum = *static_cast<const volatile uint32_t*>(&sum);
+
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		if (*static_cast<const volatile uint32_t*>(&sequence) == startSequence)
+		{
+			return locSum == locStoredSum;
+		}
+	}
+
+	// The filter is being updated so often that we can't get a consistent view of it, so check it with the producer locked out
+	AtomicCriticalSectionLocker lock;
 	uint32_t locSum = 0;
 	for (size_t i = 0; i < numAveraged; ++i)
 	{
@@ -6,23 +6,26 @@
  */
 
 #include "CanInterface.h"
-#include "CanMessageQueue.h"
+#include "CanMessageRing.h"
 
 #include <CanSettings.h>
 #include <CanMessageFormats.h>
 #include <CanMessageBuffer.h>
 #include <Platform.h>
 #include <TaskPriorities.h>
+#include <TaskStackSizes.h>
 #include <Movement/StepTimer.h>
 #include <RTOSIface/RTOSIface.h>
 #include <InputMonitors/InputMonitor.h>
 #include <Movement/Move.h>
 #include <General/SafeVsnprintf.h>
+#include <Tasks.h>
 
 #define SUPPORT_CAN		1				// needed by CanDriver.h
 #include <CanDevice.h>
 #include <Hardware/IoPorts.h>
 #include <Version.h>
+#include <CommandProcessing/CompactDiagnostics.h>
 #include <hpl_user_area.h>
 
 #define OOS_DEBUG		0				// debug for out-of-sequence errors
@@ -35,6 +38,33 @@ constexpr uint32_t CanUserAreaDataOffset = 256 - sizeof(CanUserAreaData);
 
 constexpr unsigned int NumCanBuffers = 40;
 
+// Buffers reserved for each class of user. A class may only take a buffer from the shared pool if enough free buffers remain to give every other class
+// what is left of its reservation. Motion has the largest reservation, because if the CanMotion task can't get a buffer then moves are delayed.
+constexpr unsigned int ReservedCanBuffers[(unsigned int)CanBufferClass::numClasses] =
+{
+#if SUPPORT_DRIVERS
+	4,			// motion
+#else
+	0,			// motion
+#endif
+	2,			// command
+	0,			// queuedSend
+	0			// inputChange, which allocates its only buffer at startup
+};
+
+static_assert(ReservedCanBuffers[0] + ReservedCanBuffers[1] + ReservedCanBuffers[2] + ReservedCanBuffers[3] < NumCanBuffers);
+
+static const char * const CanBufferClassNames[(unsigned int)CanBufferClass::numClasses] = { "motion", "command", "queued", "input" };
+
+struct CanBufferClassStats
+{
+	unsigned int inUse;							// protected by a task critical section
+	unsigned int highWater;
+	unsigned int denied;						// how many allocation attempts for this class failed
+};
+
+static CanBufferClassStats canBufferStats[(unsigned int)CanBufferClass::numClasses] = { };
+
 static CanDevice *can0dev = nullptr;
 static CanUserAreaData canConfigData;
 static CanAddress boardAddress;
@@ -45,20 +75,67 @@ static CanAddress currentMasterAddress =
 										CanId::MasterAddress;
 #endif
 
+#if SUPPORT_DRIVERS
+constexpr unsigned int FirstGeneralFilterElement = 3;			// the motion message filters come first
+#else
+constexpr unsigned int FirstGeneralFilterElement = 0;
+#endif
+constexpr unsigned int SensorReportsFilterElement = FirstGeneralFilterElement + 4;
+
+static bool sensorReportsWanted = false;						// true if a local heater or fan uses a sensor on another board
+
 static unsigned int txTimeouts = 0;
 static uint32_t lastCancelledId = 0;
 static bool enabled = false;
 
+// Bus error monitoring. The CAN error logging counter in the error register is cleared when the register is read, so we read it only in SampleErrorCounters and accumulate it.
+constexpr uint32_t ErrorSampleIntervalMillis = 100;			// how often we sample the error register
+constexpr uint32_t ErrorRegTecMask = 0xFF;					// transmit error count
+constexpr unsigned int ErrorRegRecShift = 8;
+constexpr uint32_t ErrorRegRecMask = 0x7F << ErrorRegRecShift;	// receive error count
+constexpr unsigned int ErrorRegCelShift = 16;
+constexpr uint32_t ErrorRegCelMask = 0xFF << ErrorRegCelShift;	// error logging counter, cleared on read
+
+static uint32_t whenErrorsLastSampled = 0;
+static uint32_t lastErrorRegister = 0;
+static uint32_t numBusErrors = 0;							// the total of the error logging counter
+static uint32_t maxTxErrorCount = 0, maxRxErrorCount = 0;
+
+// Trial CAN-FD data phase timing. The main board can ask all boards to switch to a faster data phase rate, then switch itself. Each board reverts to its previous data phase timing
+// unless the main board confirms the new one before the trial period ends, or if bus errors start to rise first. So if the new rate doesn't work, the bus comes back at the old rate
+// without anyone having to talk over it. The nominal (arbitration) bit rate is never changed by a trial.
+constexpr uint32_t DefaultTrialTimingMillis = 2000;
+constexpr uint32_t MaxTrialTimingMillis = 30000;
+constexpr uint32_t MaxTrialTimingBusErrors = 8;				// revert the trial timing if we see more than this many bus errors during the trial
+constexpr uint32_t MaxTrialTimingTxErrorCount = 96;			// revert the trial timing if the transmit error count reaches the error warning level
+constexpr uint32_t TrialTimingSwitchDelayMillis = 20;		// how long we wait after accepting a trial before switching, so that our reply goes out at the old rate
+
+static volatile bool trialTimingPending = false;			// true if we have accepted a trial but not yet switched to it
+static bool trialTimingActive = false;
+static uint32_t previousDataTiming;							// the DBTP register value to go back to if the trial fails
+static uint32_t trialDataTiming;							// the DBTP register value to try
+static uint32_t whenTrialTimingStarted;
+static uint32_t trialTimingMillis;
+static uint32_t trialBusErrors;								// bus errors since the trial started, counted separately because M122 clears numBusErrors
+static unsigned int numTrialTimingsReverted = 0;
+
 constexpr CanDevice::Config Can0Config =
 {
 	.dataSize = 64,									// must be one of: 8, 12, 16, 20, 24, 32, 48, 64
 	.numTxBuffers = 2,
 	.txFifoSize = 10,								// enough to send a 512-byte response broken into 60-byte fragments
 	.numRxBuffers = 1,								// we use a dedicated buffer for the clock sync messages
+#if SUPPORT_DRIVERS
+	.rxFifo0Size = 20,
+	.rxFifo1Size = 12,								// we use FIFO 1 for motion messages so that they don't get delayed behind other commands
+	.numShortFilterElements = 0,
+	.numExtendedFilterElements = 8,
+#else
 	.rxFifo0Size = 32,
 	.rxFifo1Size = 0,								// we don't use FIFO 1
 	.numShortFilterElements = 0,
-	.numExtendedFilterElements = 3,
+	.numExtendedFilterElements = 5,
+#endif
 	.txEventFifoSize = 2
 };
 
@@ -68,17 +145,35 @@ static_assert(Can0Config.IsValid());
 static uint32_t can0Memory[Can0Config.GetMemorySize()] __attribute__ ((section (".CanMessage")));
 
 // CanClock task
-constexpr size_t CanClockTaskStackWords = 130;
 static Task<CanClockTaskStackWords> canClockTask;
 
 // CanReceiver management task
-constexpr size_t CanReceiverTaskStackWords = 120;
 static Task<CanReceiverTaskStackWords> canReceiverTask;
 
+#if SUPPORT_DRIVERS
+// CanMotionReceiver task. This needs as much stack as the CanReceiver task, because both prepare moves.
+static Task<CanReceiverTaskStackWords> canMotionReceiverTask;
+#endif
+
 // Async sender task
-constexpr size_t CanAsyncSenderTaskStackWords = 100;
 static Task<CanAsyncSenderTaskStackWords> canAsyncSenderTask;
 
+// Queued sender task
+static Task<CanSenderTaskStackWords> canSenderTask;
+
+// Queue of messages waiting for the CanSend task to send them. It is short so that queued messages can't use up the message buffers that received messages need.
+struct QueuedSend
+{
+	CanMessageBuffer *buf;
+	TaskBase *taskToWake;						// task to wake up when the message has been put in the transmit FIFO, or nullptr
+};
+
+constexpr size_t MaxQueuedSends = 8;
+static QueuedSend queuedSends[MaxQueuedSends];
+static size_t queuedSendsGetIndex = 0;
+static volatile size_t numQueuedSends = 0;		// protected by a task critical section
+static unsigned int queuedSendsDone = 0, maxQueuedSends = 0, queuedSendsWaits = 0;
+
 static bool mainBoardAcknowledgedAnnounce = false;	// true after the main board has acknowledged our announcement
 static bool isProgrammed = false;					// true after the main board has sent us any configuration commands
 
@@ -105,11 +200,90 @@ uint8_t expectedSeq = 0xFF;
 //DEBUG
 //static int32_t accumulatedMotion = 0;
 
-static CanMessageQueue PendingMoves;
-static CanMessageQueue PendingCommands;
+// Each of these has a single producer (CanMotion or CanRecv task) and a single consumer (Move or main task)
+static CanMessageRing<NumCanBuffers + 1> PendingMoves;
+static CanMessageRing<NumCanBuffers + 1> PendingCommands;
 
 static Mutex txFifoMutex;
 
+// Traffic statistics per message type, so that we can see which traffic is loading the bus
+struct MessageTypeStats
+{
+	CanMessageType type;
+	uint32_t rxFrames, rxBytes, txFrames, txBytes;
+	uint32_t totalRxDelay, maxRxDelay;							// how long received messages waited before we processed them, in step clocks
+};
+
+constexpr size_t MaxTrackedMessageTypes = 12;					// enough for the reports to fit in one reply
+constexpr uint32_t FrameOverheadBits = 67;						// bits in an extended frame with no data, not counting stuff bits
+constexpr uint32_t SlowSendThreshold = StepTimer::StepClockRate/20000;	// a send that takes longer than 50us must have waited for room in the transmit FIFO
+
+static MessageTypeStats messageTypeStats[MaxTrackedMessageTypes];
+static MessageTypeStats otherMessageTypeStats;					// totals for message types that didn't fit in messageTypeStats
+static size_t numTrackedMessageTypes = 0;
+static uint32_t trafficBits = 0;								// how many bits we have sent and received, at the normal bit rate
+static uint32_t whenTrafficStatsCleared = 0;
+static uint32_t maxSendTime = 0;								// in step clocks
+static unsigned int slowSends = 0;
+
+// Get the statistics entry for a message type. Call this in a task critical section.
+static MessageTypeStats& GetMessageTypeStats(CanMessageType type) noexcept
+{
+	for (size_t i = 0; i < numTrackedMessageTypes; ++i)
+	{
+		if (messageTypeStats[i].type == type)
+		{
+			return messageTypeStats[i];
+		}
+	}
+
+	if (numTrackedMessageTypes < MaxTrackedMessageTypes)
+	{
+		MessageTypeStats& stats = messageTypeStats[numTrackedMessageTypes++];
+		memset(&stats, 0, sizeof(stats));
+		stats.type = type;
+		return stats;
+	}
+	return otherMessageTypeStats;
+}
+
+// Record a message that we have received and are about to process
+static void RecordReceivedMessage(const CanMessageBuffer& buf) noexcept
+{
+	// The time stamp counter runs at the CAN normal bit rate, but the step clock runs at 48MHz/64. Calculate the delay to in step clocks.
+	const uint32_t timeStampDelay = ((uint32_t)((CanInterface::GetTimeStampCounter() - buf.timeStamp) & 0xFFFF) * CanInterface::GetTimeStampPeriod()) >> 6;	// timestamp counter is 16 bits
+	TaskCriticalSectionLocker lock;
+
+	MessageTypeStats& stats = GetMessageTypeStats(buf.id.MsgType());
+	++stats.rxFrames;
+	stats.rxBytes += buf.dataLength;
+	stats.totalRxDelay += timeStampDelay;
+	if (timeStampDelay > stats.maxRxDelay)
+	{
+		stats.maxRxDelay = timeStampDelay;
+	}
+	trafficBits += FrameOverheadBits + 8 * buf.dataLength;
+}
+
+// Record a message that we have sent and how long it took to put it in the transmit FIFO
+static void RecordSentMessage(const CanMessageBuffer& buf, uint32_t sendTime) noexcept
+{
+	TaskCriticalSectionLocker lock;
+
+	MessageTypeStats& stats = GetMessageTypeStats(buf.id.MsgType());
+	++stats.txFrames;
+	stats.txBytes += buf.dataLength;
+	trafficBits += FrameOverheadBits + 8 * buf.dataLength;
+	if (sendTime > maxSendTime)
+	{
+		maxSendTime = sendTime;
+	}
+	if (sendTime > SlowSendThreshold)
+	{
+		++slowSends;
+	}
+}
+
 #if OOS_DEBUG
 
 struct OosInfo
@@ -126,13 +300,30 @@ size_t oosCount = 0;
 
 extern "C" [[noreturn]] void CanClockLoop(void *) noexcept;
 extern "C" [[noreturn]] void CanReceiverLoop(void *) noexcept;
+#if SUPPORT_DRIVERS
+extern "C" [[noreturn]] void CanMotionReceiverLoop(void *) noexcept;
+#endif
 extern "C" [[noreturn]] void CanAsyncSenderLoop(void *) noexcept;
+extern "C" [[noreturn]] void CanSenderLoop(void *) noexcept;
+
+static void SetSensorReportsFilterElement() noexcept;
 
 namespace CanInterface
 {
 	CanMessageBuffer *ProcessReceivedMessage(CanMessageBuffer *buf) noexcept;
 }
 
+namespace CanInterface
+{
+	uint32_t SampleErrorCounters() noexcept;
+	GCodeResult WriteUserArea(const StringRef& reply) noexcept;
+	void AppendTiming(const StringRef& reply) noexcept;
+	Can *GetCanHardware() noexcept;
+	void SetDataPhaseTiming(uint32_t dbtp) noexcept;
+}
+
+static unsigned int canPort;								// which CAN peripheral we use
+
 // Initialise this module and the CAN hardware
 void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, bool full) noexcept
 {
@@ -175,6 +366,7 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 #endif
 
 	// Initialise the CAN hardware, using the timing data if it was valid
+	canPort = whichPort;
 	can0dev = CanDevice::Init(0, whichPort, Can0Config, can0Memory, timing, nullptr);
 
 #ifdef SAMMYC21
@@ -183,23 +375,46 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 
 	boardAddress = canConfigData.GetCanAddress(defaultBoardAddress);
 
-	// Set up CAN receiver filtering
-	// Set up a CAN receive filter to receive all messages addressed to us in FIFO 0
-	can0dev->SetExtendedFilterElement(0, CanDevice::RxBufferNumber::fifo0,
+	// Set up CAN receiver filtering. The first filter element that matches a message determines where it goes.
+#if SUPPORT_DRIVERS
+	if (full)
+	{
+		// Set up CAN receive filters to receive motion messages addressed to us in FIFO 1. These must come before the filter for all messages addressed to us.
+		// Revert position messages must stay in sequence with movement messages, so they go in FIFO 1 too.
+		constexpr uint32_t MotionMessageMask = 0x1FFFFFFF & ~(CanId::BoardAddressMask << CanId::SrcAddressShift);	// match everything except the source address
+		unsigned int filterNumber = 0;
+		for (CanMessageType mt : { CanMessageType::movementLinear, CanMessageType::stopMovement, CanMessageType::revertPosition })
+		{
+			can0dev->SetExtendedFilterElement(filterNumber++, CanDevice::RxBufferNumber::fifo1,
+												((uint32_t)mt << CanId::MessageTypeShift) | ((uint32_t)boardAddress << CanId::DstAddressShift),
+												MotionMessageMask);
+		}
+	}
+#endif
+
+	// Set up a CAN receive filter to receive all other messages addressed to us in FIFO 0
+	can0dev->SetExtendedFilterElement(FirstGeneralFilterElement, CanDevice::RxBufferNumber::fifo0,
 										(uint32_t)boardAddress << CanId::DstAddressShift,
 										CanId::BoardAddressMask << CanId::DstAddressShift);
 
 	if (full)
 	{
 		// Set up a CAN receive filter to receive clock sync messages in buffer 0
-		can0dev->SetExtendedFilterElement(1, CanDevice::RxBufferNumber::buffer0,
+		can0dev->SetExtendedFilterElement(FirstGeneralFilterElement + 1, CanDevice::RxBufferNumber::buffer0,
 											((uint32_t)CanMessageType::timeSync << CanId::MessageTypeShift) | ((uint32_t)CanId::BroadcastAddress << CanId::DstAddressShift),
 											1);					// mask is unused when using a dedicated Rx buffer, but must be nonzero to enable the element
 
-		// Set up a filter for all other broadcast messages in FIFO 0
-		can0dev->SetExtendedFilterElement(2, CanDevice::RxBufferNumber::fifo0,
-											(uint32_t)CanId::BroadcastAddress << CanId::DstAddressShift,
-											CanId::BoardAddressMask << CanId::DstAddressShift);
+		// Set up filters for all other broadcast messages from the main board and the ATE master in FIFO 0. We ignore broadcasts from other sources except sensor reports.
+		unsigned int filterNumber = FirstGeneralFilterElement + 2;
+		for (CanAddress master : { CanId::MasterAddress, CanId::ATEMasterAddress })
+		{
+			can0dev->SetExtendedFilterElement(filterNumber++, CanDevice::RxBufferNumber::fifo0,
+												((uint32_t)CanId::BroadcastAddress << CanId::DstAddressShift) | ((uint32_t)master << CanId::SrcAddressShift),
+												(CanId::BoardAddressMask << CanId::DstAddressShift) | (CanId::BoardAddressMask << CanId::SrcAddressShift));
+		}
+
+		// Sensor temperature broadcasts from other boards are only accepted when a local heater or fan uses a sensor on another board
+		SetSensorReportsFilterElement();
 	}
 
 	// For receiving into a dedicated buffer, the mask is ignored and only the extended ID mask is applied. We need to ignore the source address.
@@ -218,13 +433,22 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 		// Create the task that receives CAN messages
 		canReceiverTask.Create(CanReceiverLoop, "CanRecv", nullptr, TaskPriority::CanReceiverPriority);
 
+#if SUPPORT_DRIVERS
+		// Create the task that receives CAN motion messages
+		canMotionReceiverTask.Create(CanMotionReceiverLoop, "CanMotion", nullptr, TaskPriority::CanMotionReceiverPriority);
+#endif
+
 		// Create the task that send endstop etc. updates
 		canAsyncSenderTask.Create(CanAsyncSenderLoop, "CanAsync", nullptr, TaskPriority::CanAsyncSenderPriority);
+
+		// Create the task that sends queued messages
+		canSenderTask.Create(CanSenderLoop, "CanSend", nullptr, TaskPriority::CanSenderPriority);
 	}
 
 #if SUPPORT_DRIVERS
 	ResetAdvance();
 #endif
+	whenTrafficStatsCleared = millis();
 }
 
 // Shutdown is called when we are asked to update the firmware.
@@ -239,7 +463,11 @@ void CanInterface::Shutdown() noexcept
 
 	// It's safe to terminate the tasks even if they haven't been created
 	canReceiverTask.TerminateAndUnlink();
+#if SUPPORT_DRIVERS
+	canMotionReceiverTask.TerminateAndUnlink();
+#endif
 	canAsyncSenderTask.TerminateAndUnlink();
+	canSenderTask.TerminateAndUnlink();
 }
 
 CanAddress CanInterface::GetCanAddress() noexcept
@@ -258,7 +486,9 @@ bool CanInterface::Send(CanMessageBuffer *buf) noexcept
 {
 	//TODO option to not force sending, and return true only if successful?
 	MutexLocker lock(txFifoMutex);
+	const uint32_t startTime = StepTimer::GetTimerTicks();
 	const uint32_t cancelledId = can0dev->SendMessage(CanDevice::TxBufferNumber::fifo, 1000, buf);
+	RecordSentMessage(*buf, StepTimer::GetTimerTicks() - startTime);
 	if (cancelledId != 0)
 	{
 		lastCancelledId = cancelledId;
@@ -267,19 +497,127 @@ bool CanInterface::Send(CanMessageBuffer *buf) noexcept
 	return true;
 }
 
+// A burst holds the transmit mutex, which is recursive, so that the messages in it go into the transmit FIFO back to back
+CanInterface::TxBurst::TxBurst() noexcept
+{
+	txFifoMutex.Take();
+}
+
+CanInterface::TxBurst::~TxBurst() noexcept
+{
+	txFifoMutex.Release();
+}
+
 bool CanInterface::SendAsync(CanMessageBuffer *buf) noexcept
 {
 	//TODO use a dedicated buffer to send these high-priority messages
 	return Send(buf);
 }
 
-bool CanInterface::SendAndFree(CanMessageBuffer *buf) noexcept
+bool CanInterface::SendAndFree(CanMessageBuffer *buf, CanBufferClass cls) noexcept
 {
 	const bool ok = Send(buf);
-	CanMessageBuffer::Free(buf);
+	FreeBuffer(buf, cls);
 	return ok;
 }
 
+// Allocate a message buffer for a class of user, unless that would leave too few free buffers to meet the reservations of the other classes
+CanMessageBuffer *CanInterface::AllocateBuffer(CanBufferClass cls) noexcept
+{
+	TaskCriticalSectionLocker lock;
+
+	unsigned int neededByOthers = 0;
+	for (unsigned int i = 0; i < (unsigned int)CanBufferClass::numClasses; ++i)
+	{
+		if (i != (unsigned int)cls && canBufferStats[i].inUse < ReservedCanBuffers[i])
+		{
+			neededByOthers += ReservedCanBuffers[i] - canBufferStats[i].inUse;
+		}
+	}
+
+	CanBufferClassStats& stats = canBufferStats[(unsigned int)cls];
+	CanMessageBuffer * const buf = (CanMessageBuffer::GetFreeBuffers() > neededByOthers) ? CanMessageBuffer::Allocate() : nullptr;
+	if (buf == nullptr)
+	{
+		++stats.denied;
+	}
+	else
+	{
+		++stats.inUse;
+		if (stats.inUse > stats.highWater)
+		{
+			stats.highWater = stats.inUse;
+		}
+	}
+	return buf;
+}
+
+CanMessageBuffer *CanInterface::BlockingAllocateBuffer(CanBufferClass cls) noexcept
+{
+	CanMessageBuffer *buf;
+	while ((buf = AllocateBuffer(cls)) == nullptr)
+	{
+		delay(1);
+	}
+	return buf;
+}
+
+void CanInterface::FreeBuffer(CanMessageBuffer *buf, CanBufferClass cls) noexcept
+{
+	TaskCriticalSectionLocker lock;
+	CanMessageBuffer::Free(buf);
+	--canBufferStats[(unsigned int)cls].inUse;
+}
+
+// Queue a copy of a message for the CanSend task to send, and return without waiting for room in the transmit FIFO.
+// If taskToWake is not null, give it a notification when the message has been put in the transmit FIFO.
+// If the queue is full or there is no free message buffer, wait for room rather than sending the message directly, so that messages are never reordered.
+// If CAN has been shut down then the message is discarded.
+void CanInterface::SendQueued(const CanMessageBuffer& buf, TaskBase *taskToWake) noexcept
+{
+	while (enabled)
+	{
+		CanMessageBuffer * const qbuf = (numQueuedSends < MaxQueuedSends) ? AllocateBuffer(CanBufferClass::queuedSend) : nullptr;
+		if (qbuf != nullptr)
+		{
+			*qbuf = buf;
+			TaskCriticalSectionLocker lock;
+
+			const size_t n = numQueuedSends;
+			if (n < MaxQueuedSends)
+			{
+				QueuedSend& qs = queuedSends[(queuedSendsGetIndex + n) % MaxQueuedSends];
+				qs.buf = qbuf;
+				qs.taskToWake = taskToWake;
+				numQueuedSends = n + 1;
+				if (n + 1 > maxQueuedSends)
+				{
+					maxQueuedSends = n + 1;
+				}
+				if (n == 0)
+				{
+					canSenderTask.Give();
+				}
+				return;
+			}
+			FreeBuffer(qbuf, CanBufferClass::queuedSend);	// another task filled the queue after we checked it
+		}
+		++queuedSendsWaits;
+		delay(1);
+	}
+
+	if (taskToWake != nullptr)
+	{
+		taskToWake->Give();
+	}
+}
+
+// Return how many more messages SendQueued can queue, so that tasks sending low-priority data can back off when the bus is busy
+unsigned int CanInterface::GetNumFreeQueuedSends() noexcept
+{
+	return MaxQueuedSends - numQueuedSends;
+}
+
 // Return a move message, if there is one. Caller must free the message buffer.
 CanMessageBuffer * CanInterface::GetCanMove(uint32_t timeout) noexcept
 {
@@ -291,6 +629,23 @@ CanMessageBuffer *CanInterface::GetCanCommand(uint32_t timeout) noexcept
 	return PendingCommands.GetMessage(timeout);
 }
 
+#if SUPPORT_DRIVERS
+
+// Prepare a received move straight from the buffer it arrived in if we can, otherwise queue it for the move task.
+// Return the buffer if it is free for re-use, else nullptr. This stops moves tying up buffers when the move task keeps up.
+static CanMessageBuffer *AddMove(CanMessageBuffer *buf) noexcept
+{
+	Platform::OnProcessingCanMessage();
+	if (moveInstance->TryPrepareMoveDirect(buf->msg.moveLinear))
+	{
+		return buf;
+	}
+	PendingMoves.AddMessage(buf);
+	return nullptr;
+}
+
+#endif
+
 // Process a received message. Return the buffer it arrived in if it is free for re-use, else nullptr.
 CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) noexcept
 {
@@ -413,9 +768,7 @@ CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) no
 			//DEBUG
 			//accumulatedMotion +=buf->msg.moveLinear.perDrive[0].steps;
 			//END
-			PendingMoves.AddMessage(buf);
-			Platform::OnProcessingCanMessage();
-			return nullptr;
+			return AddMove(buf);
 
 		case CanMessageType::stopMovement:
 			moveInstance->StopDrivers(buf->msg.stopMovement.whichDrives);
@@ -449,6 +802,9 @@ CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) no
 					stepsToTake[driver] = steps;
 				}
 
+# if SUPPORT_MICROSTEP_REDUCTION
+				moveInstance->ClearMicrostepResidues(buf->msg.revertPosition.whichDrives);
+# endif
 				if (!needSteps)
 				{
 					break;
@@ -474,9 +830,7 @@ CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) no
 				msg->seq = 0;
 				msg->initialSpeedFraction = msg->finalSpeedFraction = 0.0;
 			}
-			PendingMoves.AddMessage(buf);
-			Platform::OnProcessingCanMessage();
-			return nullptr;
+			return AddMove(buf);
 #endif
 
 		case CanMessageType::emergencyStop:
@@ -529,8 +883,22 @@ void CanInterface::Diagnostics(const StringRef& reply) noexcept
 	unsigned int messagesQueuedForSending, messagesReceived, messagesLost, busOffCount;
 	can0dev->GetAndClearStats(messagesQueuedForSending, messagesReceived, messagesLost, busOffCount);
 	reply.lcatf("CAN messages queued %u, send timeouts %u, received %u, lost %u, free buffers %u, min %u, error reg %" PRIx32,
-					messagesQueuedForSending, txTimeouts, messagesReceived, messagesLost, CanMessageBuffer::GetFreeBuffers(), CanMessageBuffer::GetAndClearMinFreeBuffers(), can0dev->GetErrorRegister());
+					messagesQueuedForSending, txTimeouts, messagesReceived, messagesLost, CanMessageBuffer::GetFreeBuffers(), CanMessageBuffer::GetAndClearMinFreeBuffers(), SampleErrorCounters());
 	txTimeouts = 0;
+	reply.lcatf("Bus errors %" PRIu32 ", max error counts tx %" PRIu32 " rx %" PRIu32 ", trial timings reverted %u", numBusErrors, maxTxErrorCount, maxRxErrorCount, numTrialTimingsReverted);
+	numBusErrors = 0;
+	maxTxErrorCount = lastErrorRegister & ErrorRegTecMask;
+	maxRxErrorCount = (lastErrorRegister & ErrorRegRecMask) >> ErrorRegRecShift;
+	reply.lcatf("Queued sends %u, max queued %u, waits for room %u", queuedSendsDone, maxQueuedSends, queuedSendsWaits);
+	queuedSendsDone = maxQueuedSends = queuedSendsWaits = 0;
+	reply.lcat("Buffers in use/max/denied:");
+	for (unsigned int i = 0; i < (unsigned int)CanBufferClass::numClasses; ++i)
+	{
+		CanBufferClassStats& stats = canBufferStats[i];
+		reply.catf(" %s %u/%u/%u", CanBufferClassNames[i], stats.inUse, stats.highWater, stats.denied);
+		stats.highWater = stats.inUse;
+		stats.denied = 0;
+	}
 	if (lastCancelledId != 0)
 	{
 		CanId id;
@@ -551,6 +919,89 @@ void CanInterface::Diagnostics(const StringRef& reply) noexcept
 #endif
 }
 
+#if SUPPORT_DRIVERS
+
+// Get the minimum and maximum times in step clocks between receiving a move and its start time, since M122 last reported them
+bool CanInterface::GetMotionAdvance(int32_t& minAdv, int32_t& maxAdv) noexcept
+{
+	minAdv = minAdvance;
+	maxAdv = maxAdvance;
+	return minAdv <= maxAdv;
+}
+
+#endif
+
+// Append the CAN figures to the compact diagnostics. Unlike Diagnostics, this doesn't clear them, except that the hardware statistics can only be read by clearing them.
+// So we don't report those here, because it would disturb M122.
+void CanInterface::AppendCompactDiagnostics(CompactDiagnostics& diags) noexcept
+{
+	diags.StartSection('C');
+	diags.Add((uint32_t)txTimeouts);
+	diags.Add((uint32_t)CanMessageBuffer::GetFreeBuffers());
+	diags.Add(SampleErrorCounters());
+	diags.Add((uint32_t)queuedSendsDone);
+	diags.Add((uint32_t)maxQueuedSends);
+	diags.Add((uint32_t)queuedSendsWaits);
+#if SUPPORT_DRIVERS
+	diags.Add((uint32_t)duplicateMotionMessages);
+	diags.Add((uint32_t)(oosMessages1Ahead + oosMessages2Ahead + oosMessages2Behind + oosMessagesOther));
+	diags.Add((uint32_t)badMoveCommands);
+	diags.Add(maxMotionProcessingDelay);
+#endif
+	diags.Add(StepTimer::GetHoldoverMillis());				// how long our clock can run without a time sync message, so the main board can reduce the sync rate
+}
+
+// Report the traffic statistics by message type and clear them. The bus load is only what we sent and received ourselves,
+// counted at the normal bit rate, so it overestimates the time taken by CAN-FD frames sent with bit rate switching.
+void CanInterface::TrafficDiagnostics(const StringRef& reply) noexcept
+{
+	MessageTypeStats stats[MaxTrackedMessageTypes + 1];
+	size_t numStats;
+	uint32_t bits, locMaxSendTime;
+	unsigned int locSlowSends;
+	const uint32_t now = millis();
+	uint32_t interval;
+	{
+		TaskCriticalSectionLocker lock;
+		numStats = numTrackedMessageTypes;
+		memcpy(stats, messageTypeStats, numStats * sizeof(MessageTypeStats));
+		stats[numStats++] = otherMessageTypeStats;
+		numTrackedMessageTypes = 0;
+		memset(&otherMessageTypeStats, 0, sizeof(otherMessageTypeStats));
+		bits = trafficBits;
+		locMaxSendTime = maxSendTime;
+		locSlowSends = slowSends;
+		trafficBits = maxSendTime = 0;
+		slowSends = 0;
+		interval = now - whenTrafficStatsCleared;
+		whenTrafficStatsCleared = now;
+	}
+
+	const uint32_t bitRate = 48000000u/GetTimeStampPeriod();		// the time stamp counter runs at the normal bit rate, and its period is in 48MHz clocks
+	const float busLoad = (interval == 0) ? 0.0 : ((float)bits * 100.0 * (float)SecondsToMillis)/((float)bitRate * (float)interval);
+	reply.printf("CAN traffic over %.1fs: own bus load %.1f%%, max send time %" PRIu32 "us, slow sends %u",
+					(double)((float)interval * MillisToSeconds), (double)busLoad, StepTimer::TicksToIntegerMicroseconds(locMaxSendTime), locSlowSends);
+	for (size_t i = 0; i < numStats; ++i)
+	{
+		const MessageTypeStats& s = stats[i];
+		if (s.rxFrames + s.txFrames != 0)
+		{
+			if (i + 1 == numStats)
+			{
+				reply.lcat("other:");
+			}
+			else
+			{
+				reply.lcatf("%u:", (unsigned int)s.type);
+			}
+			reply.catf(" rx %" PRIu32 "/%" PRIu32 "b wait %" PRIu32 "/%" PRIu32 "us, tx %" PRIu32 "/%" PRIu32 "b",
+						s.rxFrames, s.rxBytes,
+						(s.rxFrames == 0) ? 0 : StepTimer::TicksToIntegerMicroseconds(s.totalRxDelay/s.rxFrames), StepTimer::TicksToIntegerMicroseconds(s.maxRxDelay),
+						s.txFrames, s.txBytes);
+		}
+	}
+}
+
 // Send an announcement message if we need to, returning true if we sent one. On return the buffer is available to use again.
 bool CanInterface::SendAnnounce(CanMessageBuffer *buf) noexcept
 {
@@ -572,11 +1023,439 @@ bool CanInterface::SendAnnounce(CanMessageBuffer *buf) noexcept
 	return true;
 }
 
+// Set up the filter element for sensor temperature broadcasts from other boards. Rejecting them in the CAN hardware saves us from waking up and allocating a buffer for each one.
+static void SetSensorReportsFilterElement() noexcept
+{
+	// To reject them we point the filter element at messages addressed to us, which an earlier filter element has already accepted
+	can0dev->SetExtendedFilterElement(SensorReportsFilterElement, CanDevice::RxBufferNumber::fifo0,
+										(sensorReportsWanted)
+											? ((uint32_t)CanMessageType::sensorTemperaturesReport << CanId::MessageTypeShift) | ((uint32_t)CanId::BroadcastAddress << CanId::DstAddressShift)
+											: (uint32_t)boardAddress << CanId::DstAddressShift,
+										0x1FFFFFFF & ~(CanId::BoardAddressMask << CanId::SrcAddressShift));
+}
+
+// Accept or reject sensor temperature broadcasts from other boards
+void CanInterface::SetSensorReportsWanted(bool wanted) noexcept
+{
+	if (wanted != sensorReportsWanted && can0dev != nullptr)
+	{
+		sensorReportsWanted = wanted;
+		SetSensorReportsFilterElement();
+	}
+}
+
 void CanInterface::WakeAsyncSenderFromIsr() noexcept
 {
 	canAsyncSenderTask.GiveFromISR();
 }
 
+// Read the error register and update the error statistics. Return the value read, but with the error logging counter we accumulated since the last call.
+uint32_t CanInterface::SampleErrorCounters() noexcept
+{
+	TaskCriticalSectionLocker lock;									// this is called by more than one task
+
+	const uint32_t errorRegister = can0dev->GetErrorRegister();
+	const uint32_t newBusErrors = (errorRegister & ErrorRegCelMask) >> ErrorRegCelShift;
+	numBusErrors += newBusErrors;
+	if (trialTimingActive)
+	{
+		trialBusErrors += newBusErrors;
+	}
+	maxTxErrorCount = max<uint32_t>(maxTxErrorCount, errorRegister & ErrorRegTecMask);
+	maxRxErrorCount = max<uint32_t>(maxRxErrorCount, (errorRegister & ErrorRegRecMask) >> ErrorRegRecShift);
+	lastErrorRegister = errorRegister;
+	return errorRegister;
+}
+
+#if SUPPORT_CAN_RECORDER
+
+// Recording and replay of received movement messages, so that a motion workload captured on a machine can be replayed on a bench board to benchmark new firmware.
+// Only moves are recorded: replaying commands would re-run configuration and diagnostics and send replies to requests that are long gone, and replaying time sync
+// messages would upset our clock. Moves are recorded with their start times relative to when they were received, and on replay they are given start times relative
+// to when they are replayed.
+namespace CanRecorder
+{
+	enum class Mode : uint8_t { idle = 0, recording, replaying };
+
+	struct RecordedMessage
+	{
+		uint32_t whenReceived;								// step clock when we received it
+		CanId id;
+		uint8_t dataLength;
+		alignas(4) uint8_t data[64];
+	};
+
+	constexpr size_t MaxRecordedMessages = 256;
+	constexpr uint32_t ReplayLateThreshold = (2 * StepTimer::StepClockRate)/1000;	// how late a replayed message must be fed in for us to count it
+
+	static RecordedMessage recordedMessages[MaxRecordedMessages];
+	static volatile size_t numRecorded = 0;
+	static volatile Mode mode = Mode::idle;
+	static uint32_t messagesNotRecorded;
+
+	// Replay state and results
+	static size_t nextToReplay;
+	static uint32_t replayStartTime;						// step clock when we started replaying
+	static uint32_t replayEndTime;
+	static uint32_t numLateReplays, maxReplayLateness;
+	static uint32_t startStepErrors, startHiccups;
+	static uint32_t stepErrors, hiccups;
+	static unsigned int maxStepIsrPermille;
+	static bool haveReplayResults = false;
+
+	static void Record(const CanMessageBuffer& buf) noexcept;
+	static void SpinReplay() noexcept;
+	static void FinishReplay() noexcept;
+}
+
+// Record a received message if it is a move. Called by both receiver tasks.
+void CanRecorder::Record(const CanMessageBuffer& buf) noexcept
+{
+	if (buf.id.MsgType() != CanMessageType::movementLinear)
+	{
+		return;
+	}
+
+	const uint32_t now = StepTimer::GetTimerTicks();
+	size_t slot;
+	{
+		TaskCriticalSectionLocker lock;
+		slot = numRecorded;
+		if (slot == MaxRecordedMessages)
+		{
+			++messagesNotRecorded;
+			return;
+		}
+		numRecorded = slot + 1;
+	}
+
+	RecordedMessage& rec = recordedMessages[slot];
+	rec.whenReceived = now;
+	rec.id = buf.id;
+	rec.dataLength = min<uint8_t>(buf.dataLength, sizeof(rec.data));
+	memcpy(rec.data, &buf.msg, rec.dataLength);
+
+	// Store how far in advance of the time we received it the move was due to start
+	reinterpret_cast<CanMessageMovementLinear*>(rec.data)->whenToExecute = buf.msg.moveLinear.whenToExecute + StepTimer::GetLocalTimeOffset() - now;
+}
+
+// Feed in the recorded messages that are due, and when they have all been processed, collect the results
+void CanRecorder::SpinReplay() noexcept
+{
+	if (mode != Mode::replaying)
+	{
+		return;
+	}
+
+	const unsigned int isrLoad = Tasks::GetStepIsrCpuPermille(0);
+	if (isrLoad > maxStepIsrPermille)
+	{
+		maxStepIsrPermille = isrLoad;
+	}
+
+	while (nextToReplay < numRecorded)
+	{
+		const RecordedMessage& rec = recordedMessages[nextToReplay];
+		const uint32_t now = StepTimer::GetTimerTicks();
+		const int32_t lateness = (int32_t)(now - (replayStartTime + (rec.whenReceived - recordedMessages[0].whenReceived)));
+		if (lateness < 0)
+		{
+			return;											// not due yet
+		}
+
+		CanMessageBuffer *buf = CanInterface::AllocateBuffer(CanBufferClass::motion);
+		if (buf == nullptr)
+		{
+			return;											// try again next time, and count it as late then
+		}
+
+		if ((uint32_t)lateness >= ReplayLateThreshold)
+		{
+			++numLateReplays;
+		}
+		if ((uint32_t)lateness > maxReplayLateness)
+		{
+			maxReplayLateness = (uint32_t)lateness;
+		}
+
+		buf->id = rec.id;
+		buf->dataLength = rec.dataLength;
+		buf->timeStamp = CanInterface::GetTimeStampCounter();
+		memcpy(&buf->msg, rec.data, rec.dataLength);
+		buf->msg.moveLinear.whenToExecute = now + buf->msg.moveLinear.whenToExecute - StepTimer::GetLocalTimeOffset();
+		++nextToReplay;
+		buf = CanInterface::ProcessReceivedMessage(buf);
+		if (buf != nullptr)
+		{
+			CanInterface::FreeBuffer(buf, CanBufferClass::motion);
+		}
+	}
+
+	if (moveInstance->IsIdle())
+	{
+		FinishReplay();
+	}
+}
+
+void CanRecorder::FinishReplay() noexcept
+{
+	replayEndTime = StepTimer::GetTimerTicks();
+
+	// M122 clears these counters, so if it was run during the replay we only see the counts since then
+	const uint32_t nowStepErrors = DDA::GetStepErrors();
+	const uint32_t nowHiccups = moveInstance->GetNumHiccups();
+	stepErrors = (nowStepErrors >= startStepErrors) ? nowStepErrors - startStepErrors : nowStepErrors;
+	hiccups = (nowHiccups >= startHiccups) ? nowHiccups - startHiccups : nowHiccups;
+	haveReplayResults = true;
+	mode = Mode::idle;
+}
+
+bool CanInterface::IsReplaying() noexcept
+{
+	return CanRecorder::mode == CanRecorder::Mode::replaying;
+}
+
+// Start recording received messages (mode 1), replay the recording (mode 2), or stop and report the recording and the last replay results (mode 0)
+GCodeResult CanInterface::ConfigureRecorder(uint32_t newMode, const StringRef& reply) noexcept
+{
+	using namespace CanRecorder;
+
+	switch (newMode)
+	{
+	case 0:
+		if (mode == Mode::replaying)
+		{
+			nextToReplay = numRecorded;						// abandon the rest of the replay
+			FinishReplay();
+		}
+		mode = Mode::idle;
+		reply.printf("CAN recorder idle, %u moves recorded", numRecorded);
+		if (messagesNotRecorded != 0)
+		{
+			reply.catf(", %" PRIu32 " not recorded because the buffer was full", messagesNotRecorded);
+		}
+		if (numRecorded != 0)
+		{
+			reply.catf(", duration %" PRIu32 "ms", (recordedMessages[numRecorded - 1].whenReceived - recordedMessages[0].whenReceived)/(StepTimer::StepClockRate/1000));
+		}
+		if (haveReplayResults)
+		{
+			reply.lcatf("Last replay: %u moves in %" PRIu32 "ms, %" PRIu32 " late, max late %" PRIu32 "us, step errors %" PRIu32 ", hiccups %" PRIu32 ", max step ISR load %u.%u%%",
+						nextToReplay, (replayEndTime - replayStartTime)/(StepTimer::StepClockRate/1000), numLateReplays,
+						StepTimer::TicksToIntegerMicroseconds(maxReplayLateness), stepErrors, hiccups, maxStepIsrPermille/10, maxStepIsrPermille % 10);
+		}
+		return GCodeResult::ok;
+
+	case 1:
+		if (mode == Mode::replaying)
+		{
+			reply.copy("Cannot record while replaying");
+			return GCodeResult::error;
+		}
+		mode = Mode::idle;
+		numRecorded = 0;
+		messagesNotRecorded = 0;
+		mode = Mode::recording;
+		reply.printf("Recording up to %u received moves", MaxRecordedMessages);
+		return GCodeResult::ok;
+
+	case 2:
+		if (mode != Mode::idle)
+		{
+			reply.copy("Stop recording or replaying first");
+			return GCodeResult::error;
+		}
+		if (numRecorded == 0)
+		{
+			reply.copy("Nothing has been recorded");
+			return GCodeResult::error;
+		}
+		if (!moveInstance->IsIdle())
+		{
+			reply.copy("Cannot replay while moves are pending");
+			return GCodeResult::error;
+		}
+		expectedSeq = 0xFF;									// the recorded moves don't follow on from the last one we received
+		startStepErrors = DDA::GetStepErrors();
+		startHiccups = moveInstance->GetNumHiccups();
+		nextToReplay = 0;
+		numLateReplays = maxReplayLateness = 0;
+		stepErrors = hiccups = 0;
+		maxStepIsrPermille = 0;
+		haveReplayResults = false;
+		replayStartTime = StepTimer::GetTimerTicks();
+		mode = Mode::replaying;
+		reply.printf("Replaying %u moves", numRecorded);
+		return GCodeResult::ok;
+
+	default:
+		reply.copy("Recorder mode must be 0 (stop), 1 (record) or 2 (replay)");
+		return GCodeResult::error;
+	}
+}
+
+#endif
+
+// Sample the error counters from time to time, and end a trial of new bit timing if it has failed or hasn't been confirmed in time. Called by the main task.
+void CanInterface::Spin() noexcept
+{
+#if SUPPORT_CAN_RECORDER
+	CanRecorder::SpinReplay();
+#endif
+
+	const uint32_t now = millis();
+	if (trialTimingPending && now - whenTrialTimingStarted >= TrialTimingSwitchDelayMillis)
+	{
+		// Our reply to the trial request has had time to go out at the old rate, so switch now and time the trial from here
+		(void)SampleErrorCounters();
+		trialBusErrors = 0;
+		whenTrialTimingStarted = now;
+		trialTimingActive = true;
+		trialTimingPending = false;
+		SetDataPhaseTiming(trialDataTiming);
+	}
+
+	if (now - whenErrorsLastSampled >= ErrorSampleIntervalMillis)
+	{
+		whenErrorsLastSampled = now;
+		const uint32_t errorRegister = SampleErrorCounters();
+		if (   trialTimingActive
+			&& (   trialBusErrors > MaxTrialTimingBusErrors
+				|| (errorRegister & ErrorRegTecMask) >= MaxTrialTimingTxErrorCount
+				|| now - whenTrialTimingStarted >= trialTimingMillis
+			   )
+		   )
+		{
+			SetDataPhaseTiming(previousDataTiming);
+			trialTimingActive = false;
+			++numTrialTimingsReverted;
+		}
+	}
+}
+
+Can *CanInterface::GetCanHardware() noexcept
+{
+#if SAME5x
+	return (canPort == 0) ? CAN0 : CAN1;
+#else
+	return CAN0;
+#endif
+}
+
+// Change the data phase bit timing of the CAN peripheral. The register is only writable while the peripheral is in configuration mode, so we are off the bus briefly.
+void CanInterface::SetDataPhaseTiming(uint32_t dbtp) noexcept
+{
+	Can * const hw = GetCanHardware();
+	hw->CCCR.reg |= CAN_CCCR_INIT;
+	while ((hw->CCCR.reg & CAN_CCCR_INIT) == 0) { }
+	hw->CCCR.reg |= CAN_CCCR_CCE;
+	hw->DBTP.reg = dbtp;
+	hw->CCCR.reg &= ~(CAN_CCCR_CCE | CAN_CCCR_INIT);
+	while ((hw->CCCR.reg & CAN_CCCR_INIT) != 0) { }
+}
+
+void CanInterface::AppendTiming(const StringRef& reply) noexcept
+{
+	CanTiming timing;
+	can0dev->GetLocalCanTiming(timing);
+	reply.catf("CAN bus speed %.1fkbps, tseg1 %.2f, jump width %.2f",
+					(double)((float)CanTiming::ClockFrequency/(1000 * timing.period)),
+					(double)((float)timing.tseg1/(float)timing.period),
+					(double)((float)timing.jumpWidth/(float)timing.period));
+
+	const uint32_t dbtp = GetCanHardware()->DBTP.reg;
+	const uint32_t prescaler = ((dbtp & CAN_DBTP_DBRP_Msk) >> CAN_DBTP_DBRP_Pos) + 1;
+	const uint32_t tseg1 = ((dbtp & CAN_DBTP_DTSEG1_Msk) >> CAN_DBTP_DTSEG1_Pos) + 2;		// including the sync segment
+	const uint32_t quanta = tseg1 + ((dbtp & CAN_DBTP_DTSEG2_Msk) >> CAN_DBTP_DTSEG2_Pos) + 1;
+	reply.catf(", data phase %.1fkbps, sample point %.2f", (double)((float)CanTiming::ClockFrequency/(1000 * prescaler * quanta)), (double)((float)tseg1/(float)quanta));
+}
+
+// Switch to a trial CAN-FD data phase bit rate, keeping the same data phase sample point and jump width as fractions of the bit time.
+// We switch a little after returning, so that the reply reaches the main board at the old rate.
+// If the rate is zero, report the timing and bus error statistics instead so that the main board can decide whether to try a faster rate.
+GCodeResult CanInterface::TrialTiming(uint32_t kbps, uint32_t millisToConfirm, const StringRef& reply) noexcept
+{
+	if (kbps == 0)
+	{
+		(void)SampleErrorCounters();
+		AppendTiming(reply);
+		reply.catf(", bus errors %" PRIu32 ", error counts tx %" PRIu32 " rx %" PRIu32 " (max %" PRIu32 "/%" PRIu32 "), trial timings reverted %u%s",
+					numBusErrors, lastErrorRegister & ErrorRegTecMask, (lastErrorRegister & ErrorRegRecMask) >> ErrorRegRecShift,
+					maxTxErrorCount, maxRxErrorCount, numTrialTimingsReverted, (trialTimingActive) ? ", trial in progress" : "");
+		return GCodeResult::ok;
+	}
+
+	if (trialTimingActive || trialTimingPending)
+	{
+		reply.copy("A CAN timing trial is already in progress");
+		return GCodeResult::error;
+	}
+
+	// Find the smallest prescaler that lets us divide the bit time into no more quanta than the data phase segments allow
+	constexpr uint32_t MaxDataQuanta = 1 + 32 + 16;							// sync segment + max DTSEG1 + max DTSEG2
+	const uint32_t newPeriod = CanTiming::ClockFrequency/(kbps * 1000);
+	uint32_t prescaler = 1;
+	while (prescaler <= 32 && (newPeriod % prescaler != 0 || newPeriod/prescaler > MaxDataQuanta))
+	{
+		++prescaler;
+	}
+	const uint32_t quanta = newPeriod/prescaler;
+	if (newPeriod * kbps * 1000 != CanTiming::ClockFrequency || prescaler > 32 || quanta < 5)
+	{
+		reply.printf("Cannot use CAN data phase speed %" PRIu32 "kbps", kbps);
+		return GCodeResult::error;
+	}
+
+	// Keep the sample point and jump width of the current data phase timing as fractions of the bit time
+	previousDataTiming = GetCanHardware()->DBTP.reg;
+	const uint32_t oldTseg1 = ((previousDataTiming & CAN_DBTP_DTSEG1_Msk) >> CAN_DBTP_DTSEG1_Pos) + 2;		// including the sync segment
+	const uint32_t oldQuanta = oldTseg1 + ((previousDataTiming & CAN_DBTP_DTSEG2_Msk) >> CAN_DBTP_DTSEG2_Pos) + 1;
+	const uint32_t oldJumpWidth = ((previousDataTiming & CAN_DBTP_DSJW_Msk) >> CAN_DBTP_DSJW_Pos) + 1;
+	const uint32_t tseg1 = constrain<uint32_t>((oldTseg1 * quanta + oldQuanta/2)/oldQuanta, max<uint32_t>(quanta, 18) - 16, min<uint32_t>(quanta - 1, 33));
+	const uint32_t jumpWidth = constrain<uint32_t>((oldJumpWidth * quanta + oldQuanta/2)/oldQuanta, 1, min<uint32_t>(quanta - tseg1, 16));
+	trialDataTiming = (previousDataTiming & CAN_DBTP_TDC)
+					| CAN_DBTP_DBRP(prescaler - 1) | CAN_DBTP_DTSEG1(tseg1 - 2) | CAN_DBTP_DTSEG2(quanta - tseg1 - 1) | CAN_DBTP_DSJW(jumpWidth - 1);
+
+	trialTimingMillis = (millisToConfirm == 0) ? DefaultTrialTimingMillis : min<uint32_t>(millisToConfirm, MaxTrialTimingMillis);
+	whenTrialTimingStarted = millis();
+	trialTimingPending = true;												// Spin switches to the new timing after the reply has gone
+
+	reply.printf("Trying CAN data phase speed %" PRIu32 "kbps in %" PRIu32 "ms, confirm within %" PRIu32 "ms after that", kbps, TrialTimingSwitchDelayMillis, trialTimingMillis);
+	return GCodeResult::ok;
+}
+
+// Keep the trial data phase timing until reset. The user area only has room for the nominal timing, so the main board must negotiate the data phase rate again after a reset.
+GCodeResult CanInterface::ConfirmTrialTiming(bool save, const StringRef& reply) noexcept
+{
+	if (!trialTimingActive)
+	{
+		reply.copy("No CAN timing trial is in progress");
+		return GCodeResult::error;
+	}
+
+	trialTimingActive = false;
+	reply.copy("Using ");
+	AppendTiming(reply);
+	reply.cat(" until reset");
+	if (save)
+	{
+		reply.cat(", data phase timing can't be saved");
+		return GCodeResult::warning;
+	}
+	return GCodeResult::ok;
+}
+
+GCodeResult CanInterface::WriteUserArea(const StringRef& reply) noexcept
+{
+	const int32_t rc = _user_area_write(reinterpret_cast<void*>(NVMCTRL_USER), CanUserAreaDataOffset, reinterpret_cast<const uint8_t*>(&canConfigData), sizeof(canConfigData));
+	if (rc != 0)
+	{
+		reply.printf("Failed to write NVM user area, code %" PRIi32, rc);
+		return GCodeResult::error;
+	}
+	return GCodeResult::ok;
+}
+
 GCodeResult CanInterface::ChangeAddressAndDataRate(const CanMessageSetAddressAndNormalTiming &msg, const StringRef &reply) noexcept
 {
 	if (msg.oldAddress == boardAddress)
@@ -599,22 +1478,10 @@ GCodeResult CanInterface::ChangeAddressAndDataRate(const CanMessageSetAddressAnd
 
 		if (seen)
 		{
-			const int32_t rc = _user_area_write(reinterpret_cast<void*>(NVMCTRL_USER), CanUserAreaDataOffset, reinterpret_cast<const uint8_t*>(&canConfigData), sizeof(canConfigData));
-			if (rc != 0)
-			{
-				reply.printf("Failed to write NVM user area, code %" PRIi32, rc);
-				return GCodeResult::error;
-			}
-		}
-		else
-		{
-			CanTiming timing;
-			can0dev->GetLocalCanTiming(timing);
-			reply.printf("CAN bus speed %.1fkbps, tseg1 %.2f, jump width %.2f",
-							(double)((float)CanTiming::ClockFrequency/(1000 * timing.period)),
-							(double)((float)timing.tseg1/(float)timing.period),
-							(double)((float)timing.jumpWidth/(float)timing.period));
+			return WriteUserArea(reply);
 		}
+
+		AppendTiming(reply);
 		return GCodeResult::ok;
 	}
 
@@ -657,8 +1524,11 @@ extern "C" [[noreturn]] void CanClockLoop(void *) noexcept
 	for (;;)
 	{
 		CanMessageBuffer buf(nullptr);
-		can0dev->ReceiveMessage(CanDevice::RxBufferNumber::buffer0, TaskBase::TimeoutUnlimited, &buf);
-		if (buf.id.MsgType() == CanMessageType::timeSync
+		if (!can0dev->ReceiveMessage(CanDevice::RxBufferNumber::buffer0, StepTimer::HoldoverUpdateInterval, &buf))
+		{
+			StepTimer::ExtrapolateOffset();							// keep the offset following the master clock while we wait for the next sync message
+		}
+		else if (buf.id.MsgType() == CanMessageType::timeSync
 #if defined(ATEIO) || defined(ATECM)
 			&& (buf.id.Src() == CanId::ATEMasterAddress))			// ATE boards only respond to the ATE master, because a main board under test may also transmit when it starts up
 #else
@@ -667,11 +1537,13 @@ extern "C" [[noreturn]] void CanClockLoop(void *) noexcept
 		{
 			currentMasterAddress = buf.id.Src();
 			StepTimer::ProcessTimeSyncMessage(buf.msg.sync, buf.dataLength, buf.timeStamp);
+			RecordReceivedMessage(buf);
 		}
 	}
 }
 
-extern "C" [[noreturn]] void CanReceiverLoop(void *) noexcept
+// Receive messages from the specified FIFO and process them. Buffers that are handed on stay in the same class until they are freed.
+[[noreturn]] static void ReceiveMessages(CanDevice::RxBufferNumber whichFifo, CanBufferClass cls) noexcept
 {
 	CanMessageBuffer *buf = nullptr;
 	for (;;)
@@ -685,11 +1557,18 @@ extern "C" [[noreturn]] void CanReceiverLoop(void *) noexcept
 			// Get a buffer
 			if (buf == nullptr)
 			{
-				buf = CanMessageBuffer::BlockingAllocate();
+				buf = CanInterface::BlockingAllocateBuffer(cls);
 			}
 
-			if (can0dev->ReceiveMessage(CanDevice::RxBufferNumber::fifo0, TaskBase::TimeoutUnlimited, buf))
+			if (can0dev->ReceiveMessage(whichFifo, TaskBase::TimeoutUnlimited, buf))
 			{
+				RecordReceivedMessage(*buf);
+#if SUPPORT_CAN_RECORDER
+				if (CanRecorder::mode == CanRecorder::Mode::recording)
+				{
+					CanRecorder::Record(*buf);
+				}
+#endif
 				buf = CanInterface::ProcessReceivedMessage(buf);
 			}
 			else
@@ -700,13 +1579,61 @@ extern "C" [[noreturn]] void CanReceiverLoop(void *) noexcept
 	}
 }
 
-extern "C" [[noreturn]] void CanAsyncSenderLoop(void *) noexcept
+extern "C" [[noreturn]] void CanReceiverLoop(void *) noexcept
 {
-	CanMessageBuffer *buf;
-	while ((buf = CanMessageBuffer::Allocate()) == nullptr)
+	ReceiveMessages(CanDevice::RxBufferNumber::fifo0, CanBufferClass::command);
+}
+
+#if SUPPORT_DRIVERS
+
+// Motion messages have their own FIFO and a higher priority task, so that they don't get held up behind slow commands such as M308 and M950
+extern "C" [[noreturn]] void CanMotionReceiverLoop(void *) noexcept
+{
+	ReceiveMessages(CanDevice::RxBufferNumber::fifo1, CanBufferClass::motion);
+}
+
+#endif
+
+// Each time we are woken up, send all the messages that SendQueued has queued as one burst
+extern "C" [[noreturn]] void CanSenderLoop(void *) noexcept
+{
+	for (;;)
 	{
-		delay(1);
+		TaskBase::Take();								// wait until a message is queued
+		CanInterface::TxBurst burst;
+		for (;;)
+		{
+			QueuedSend qs;
+			{
+				TaskCriticalSectionLocker lock;
+				if (numQueuedSends == 0)
+				{
+					break;
+				}
+				qs = queuedSends[queuedSendsGetIndex];
+			}
+
+			CanInterface::Send(qs.buf);
+			CanInterface::FreeBuffer(qs.buf, CanBufferClass::queuedSend);
+			if (qs.taskToWake != nullptr)
+			{
+				qs.taskToWake->Give();
+			}
+
+			{
+				TaskCriticalSectionLocker lock;
+				queuedSendsGetIndex = (queuedSendsGetIndex + 1) % MaxQueuedSends;
+				numQueuedSends = numQueuedSends - 1;
+				++queuedSendsDone;
+			}
+		}
 	}
+}
+
+extern "C" [[noreturn]] void CanAsyncSenderLoop(void *) noexcept
+{
+	CanMessageBuffer *buf;
+	buf = CanInterface::BlockingAllocateBuffer(CanBufferClass::inputChange);
 
 	for (;;)
 	{
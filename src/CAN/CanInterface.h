@@ -13,33 +13,75 @@
 #include <CanMessageFormats.h>
 
 struct CanMessageMovement;
+class CompactDiagnostics;
 class CanMessageBuffer;
 
+// The users of CAN message buffers. Each class has some buffers reserved for it, so that a burst of one kind of traffic can't starve the others.
+enum class CanBufferClass : uint8_t
+{
+	motion = 0,				// received motion messages, held by the CanMotion task or queued for the Move task
+	command,				// received commands, held by the CanRecv task or queued for the main task, and the replies built in them
+	queuedSend,				// copies of messages queued by SendQueued, e.g. accelerometer and closed loop data
+	inputChange,			// the message used by the async sender task to report input changes
+	numClasses
+};
+
 namespace CanInterface
 {
 	void Init(CanAddress defaultBoardAddress, bool useAlternatePins, bool full) noexcept;
 	void Shutdown() noexcept;
 	void Diagnostics(const StringRef& reply) noexcept;
+	void TrafficDiagnostics(const StringRef& reply) noexcept;
+	void AppendCompactDiagnostics(CompactDiagnostics& diags) noexcept;
+	void Spin() noexcept;
 
 	CanAddress GetCanAddress() noexcept;
 	CanAddress GetCurrentMasterAddress() noexcept;
 	GCodeResult ChangeAddressAndDataRate(const CanMessageSetAddressAndNormalTiming& msg, const StringRef& reply) noexcept;
+	GCodeResult TrialTiming(uint32_t kbps, uint32_t millisToConfirm, const StringRef& reply) noexcept;
+	GCodeResult ConfirmTrialTiming(bool save, const StringRef& reply) noexcept;
 	bool GetCanMessage(CanMessageBuffer *buf) noexcept;
 	CanMessageBuffer *GetCanMove(uint32_t timeout) noexcept;
 	bool Send(CanMessageBuffer *buf) noexcept;
 	bool SendAsync(CanMessageBuffer *buf) noexcept;
-	bool SendAndFree(CanMessageBuffer *buf) noexcept;
+	bool SendAndFree(CanMessageBuffer *buf, CanBufferClass cls) noexcept;
+	void SendQueued(const CanMessageBuffer& buf, TaskBase *taskToWake = nullptr) noexcept;
+	unsigned int GetNumFreeQueuedSends() noexcept;				// Return how many more messages SendQueued can queue without waiting
 	CanMessageBuffer *GetCanCommand(uint32_t timeout) noexcept;
 
+	CanMessageBuffer *AllocateBuffer(CanBufferClass cls) noexcept;			// Allocate a buffer unless that would eat into the buffers reserved for other classes
+	CanMessageBuffer *BlockingAllocateBuffer(CanBufferClass cls) noexcept;	// Allocate a buffer, waiting until one is available to this class
+	void FreeBuffer(CanMessageBuffer *buf, CanBufferClass cls) noexcept;
+
 #if !SAME70
 	uint16_t GetTimeStampCounter() noexcept;
 	uint16_t GetTimeStampPeriod() noexcept;
 #endif
 
 	bool SendAnnounce(CanMessageBuffer *buf) noexcept;
+#if SUPPORT_DRIVERS
+	bool GetMotionAdvance(int32_t& minAdv, int32_t& maxAdv) noexcept;	// Get how far in advance we were given moves since M122 last reported it, returning false if we haven't had any
+#endif
 	void RaiseEvent(EventType type, uint16_t param, uint8_t device, const char *format, va_list vargs) noexcept;
 
+#if SUPPORT_CAN_RECORDER
+	GCodeResult ConfigureRecorder(uint32_t mode, const StringRef& reply) noexcept;	// Record received messages, replay them, or stop and report
+	bool IsReplaying() noexcept;
+#endif
+
 	void WakeAsyncSenderFromIsr() noexcept;
+	void SetSensorReportsWanted(bool wanted) noexcept;			// Accept or reject sensor temperature broadcasts from other boards in the CAN hardware
+
+	// While one of these exists, messages sent by other tasks can't get between the messages sent by the task that created it.
+	// The CanSend task uses one to send all the messages that SendQueued has queued as a single burst.
+	class TxBurst
+	{
+	public:
+		TxBurst() noexcept;
+		~TxBurst() noexcept;
+
+		TxBurst(const TxBurst&) = delete;
+	};
 }
 
 #endif /* SRC_CAN_CANINTERFACE_H_ */
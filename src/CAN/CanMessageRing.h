@@ -0,0 +1,75 @@
+/*
+ * CanMessageRing.h
+ */
+
+#ifndef SRC_CAN_CANMESSAGERING_H_
+#define SRC_CAN_CANMESSAGERING_H_
+
+#include "CanMessageBuffer.h"
+#include <RTOSIface/RTOSIface.h>
+
+// Queue of received CAN messages for use when there is a single task adding messages and a single other task fetching them.
+// Unlike CanMessageQueue this needs no critical sections. Capacity must be greater than the number of message buffers, so that adding a message never fails.
+template<size_t Capacity> class CanMessageRing
+{
+public:
+	CanMessageRing() noexcept : putIndex(0), getIndex(0), consumerTask(nullptr) { }
+
+	void AddMessage(CanMessageBuffer *buf) noexcept;
+	CanMessageBuffer *GetMessage(uint32_t timeout) noexcept;
+
+private:
+	static size_t Next(size_t index) noexcept { return (index + 1 == Capacity) ? 0 : index + 1; }
+
+	CanMessageBuffer * volatile messages[Capacity];
+	volatile size_t putIndex;							// only written by the task adding messages
+	volatile size_t getIndex;							// only written by the task fetching messages
+	TaskBase * volatile consumerTask;					// the task fetching messages, once it has needed to wait for one
+};
+
+// Add a message. Only wake up the task fetching messages if it may have found the ring empty, so it is not woken for every message.
+template<size_t Capacity> void CanMessageRing<Capacity>::AddMessage(CanMessageBuffer *buf) noexcept
+{
+	const size_t oldPutIndex = putIndex;
+	messages[oldPutIndex] = buf;
+	putIndex = Next(oldPutIndex);						// publish the message
+	if (getIndex == oldPutIndex)						// if the consumer has fetched all earlier messages it may be waiting or about to wait
+	{
+		TaskBase * const waitingTask = consumerTask;
+		if (waitingTask != nullptr)
+		{
+			waitingTask->Give();
+		}
+	}
+}
+
+// Fetch a message from the ring, optionally waiting if necessary
+template<size_t Capacity> CanMessageBuffer *CanMessageRing<Capacity>::GetMessage(uint32_t timeout) noexcept
+{
+	while (true)
+	{
+		const size_t locGetIndex = getIndex;
+		if (locGetIndex != putIndex)
+		{
+			CanMessageBuffer * const buf = messages[locGetIndex];
+			getIndex = Next(locGetIndex);
+			return buf;
+		}
+
+		if (timeout == 0)
+		{
+			return nullptr;
+		}
+
+		if (consumerTask == nullptr)
+		{
+			consumerTask = TaskBase::GetCallerTaskHandle();	// register as the consumer, then check again in case a message was added before AddMessage could see us
+		}
+		else if (!TaskBase::Take(timeout))
+		{
+			return nullptr;
+		}
+	}
+}
+
+#endif /* SRC_CAN_CANMESSAGERING_H_ */
@@ -0,0 +1,173 @@
+/*
+ * MotionLoadGenerator.cpp
+ */
+
+#include "MotionLoadGenerator.h"
+#include "CanInterface.h"
+#include <CanMessageBuffer.h>
+#include <CanMessageFormats.h>
+#include <Movement/StepTimer.h>
+
+namespace MotionLoadGenerator
+{
+	constexpr size_t DriversPerMove = 3;											// make the messages as long as those for a 3-driver board
+	constexpr uint32_t MinSegmentMillis = 1;
+	constexpr uint32_t MaxSegmentMillis = 1000;
+	constexpr uint32_t MoveAdvanceTicks = (100 * StepTimer::StepClockRate)/1000;	// how far ahead of their start times we send moves
+	constexpr uint32_t SyncIntervalTicks = (100 * StepTimer::StepClockRate)/1000;	// how often we send time sync messages
+
+	static bool running = false;
+	static uint32_t targetBoards;													// bit n set means send to CAN address n
+	static uint32_t segmentTicks;
+	static int32_t steps;
+	static uint32_t nextMoveStartTime;
+	static uint32_t lastSyncTime;
+	static uint32_t lastSyncTimeSent;
+	static uint8_t seq[32];
+
+	// Statistics since we started
+	static uint32_t startMillis;
+	static uint32_t stopMillis;
+	static uint32_t movesSent;
+	static uint32_t syncsSent;
+	static int32_t minAdvanceWhenSent;
+
+	static void SendSync(uint32_t now) noexcept;
+	static void SendMoves() noexcept;
+	static void AppendStats(const StringRef& reply) noexcept;
+}
+
+bool MotionLoadGenerator::IsRunning() noexcept
+{
+	return running;
+}
+
+GCodeResult MotionLoadGenerator::Configure(uint32_t segmentMillis, uint32_t targets, int32_t stepsPerSegment, const StringRef& reply) noexcept
+{
+	if (segmentMillis == 0)
+	{
+		if (running)
+		{
+			running = false;
+			stopMillis = millis();
+		}
+		reply.copy("Motion load generator stopped");
+		if (movesSent != 0)
+		{
+			AppendStats(reply);
+		}
+		return GCodeResult::ok;
+	}
+
+	if (segmentMillis < MinSegmentMillis || segmentMillis > MaxSegmentMillis)
+	{
+		reply.printf("Segment length must be between %" PRIu32 " and %" PRIu32 "ms", MinSegmentMillis, MaxSegmentMillis);
+		return GCodeResult::error;
+	}
+	targets &= ~1u;																	// don't send to the main board address
+	if (CanInterface::GetCanAddress() < 32)
+	{
+		targets &= ~(1u << CanInterface::GetCanAddress());							// or to ourselves
+	}
+	if (targets == 0)
+	{
+		reply.copy("No target boards");
+		return GCodeResult::error;
+	}
+
+	targetBoards = targets;
+	segmentTicks = segmentMillis * (StepTimer::StepClockRate/1000);
+	steps = stepsPerSegment;
+	for (uint8_t& s : seq)
+	{
+		s = 0;
+	}
+	movesSent = syncsSent = 0;
+	minAdvanceWhenSent = std::numeric_limits<int32_t>::max();
+	startMillis = millis();
+
+	const uint32_t now = StepTimer::GetTimerTicks();
+	nextMoveStartTime = now + MoveAdvanceTicks;
+	lastSyncTimeSent = 0;
+	SendSync(now);
+	running = true;
+	reply.printf("Sending %" PRIu32 "ms segments of %" PRIi32 " steps to boards %08" PRIx32 ", %" PRIu32 " moves/sec per board",
+					segmentMillis, steps, targetBoards, 1000/segmentMillis);
+	return GCodeResult::ok;
+}
+
+void MotionLoadGenerator::Spin() noexcept
+{
+	if (running)
+	{
+		const uint32_t now = StepTimer::GetTimerTicks();
+		if (now - lastSyncTime >= SyncIntervalTicks)
+		{
+			SendSync(now);
+		}
+		SendMoves();
+	}
+}
+
+// Send a time sync message giving our step clock as the master time. We don't measure our transmit delay, so the targets get no acknowledge delay.
+void MotionLoadGenerator::SendSync(uint32_t now) noexcept
+{
+	CanMessageBuffer buf(nullptr);
+	auto msg = buf.SetupStatusMessage<CanMessageTimeSync>(CanId::ATEMasterAddress, CanId::BroadcastAddress);
+	memset(msg, 0, sizeof(*msg));
+	msg->timeSent = now;
+	msg->lastTimeSent = lastSyncTimeSent;
+	msg->lastTimeAcknowledgeDelay = 0;
+	buf.dataLength = sizeof(CanMessageTimeSync);
+	CanInterface::Send(&buf);
+	lastSyncTime = lastSyncTimeSent = now;
+	++syncsSent;
+}
+
+// Send the same segment to every target for each segment that is due to be sent. Alternate the direction so that any motors connected stay in place.
+void MotionLoadGenerator::SendMoves() noexcept
+{
+	while ((int32_t)(nextMoveStartTime - StepTimer::GetTimerTicks()) <= (int32_t)MoveAdvanceTicks)
+	{
+		CanInterface::TxBurst burst;
+		for (unsigned int address = 1; address < 32; ++address)
+		{
+			if (targetBoards & (1u << address))
+			{
+				CanMessageBuffer buf(nullptr);
+				auto msg = buf.SetupRequestMessage<CanMessageMovementLinear>(0, CanId::ATEMasterAddress, address);
+				msg->whenToExecute = nextMoveStartTime;
+				msg->accelerationClocks = msg->decelClocks = segmentTicks/4;
+				msg->steadyClocks = segmentTicks - 2 * (segmentTicks/4);
+				msg->initialSpeedFraction = msg->finalSpeedFraction = 0.0;
+				msg->numDrivers = DriversPerMove;
+				msg->pressureAdvanceDrives = 0;
+				msg->seq = seq[address];
+				seq[address] = (seq[address] + 1) & 0x7F;
+				for (size_t driver = 0; driver < DriversPerMove; ++driver)
+				{
+					msg->perDrive[driver].steps = (movesSent & 1) ? -steps : steps;
+				}
+				buf.dataLength = msg->GetActualDataLength();
+
+				const int32_t advance = (int32_t)(nextMoveStartTime - StepTimer::GetTimerTicks());
+				if (advance < minAdvanceWhenSent)
+				{
+					minAdvanceWhenSent = advance;
+				}
+				CanInterface::Send(&buf);
+			}
+		}
+		++movesSent;
+		nextMoveStartTime += segmentTicks;
+	}
+}
+
+void MotionLoadGenerator::AppendStats(const StringRef& reply) noexcept
+{
+	const uint32_t elapsed = ((running) ? millis() : stopMillis) - startMillis;
+	reply.catf(", %" PRIu32 " segments and %" PRIu32 " syncs sent in %" PRIu32 "ms, min advance when sent %" PRIi32 "us",
+				movesSent, syncsSent, elapsed, (int32_t)((minAdvanceWhenSent * 1000)/(int32_t)(StepTimer::StepClockRate/1000)));
+}
+
+// End
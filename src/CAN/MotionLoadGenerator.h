@@ -0,0 +1,24 @@
+/*
+ * MotionLoadGenerator.h
+ *
+ *  Generates a stream of movement and time sync messages to other boards, posing as the ATE master, so that a spare board on a test bus
+ *  can measure how much motion traffic the bus and the target boards can handle. The targets report the effect in their own diagnostics.
+ */
+
+#ifndef SRC_CAN_MOTIONLOADGENERATOR_H_
+#define SRC_CAN_MOTIONLOADGENERATOR_H_
+
+#include <RepRapFirmware.h>
+
+namespace MotionLoadGenerator
+{
+	// Start generating segments of the given length to each board in the target bitmap, or stop and report if segmentMillis is zero
+	GCodeResult Configure(uint32_t segmentMillis, uint32_t targets, int32_t stepsPerSegment, const StringRef& reply) noexcept;
+
+	// Send the messages that are due. Called from Platform::Spin.
+	void Spin() noexcept;
+
+	bool IsRunning() noexcept;
+}
+
+#endif /* SRC_CAN_MOTIONLOADGENERATOR_H_ */
@@ -11,6 +11,7 @@
 
 #include <Hardware/IoPorts.h>
 #include <ClosedLoop/ClosedLoop.h>
+#include <Movement/StepTimer.h>
 
 constexpr uint16_t AS5047RegNop = 0x0000;
 constexpr uint16_t AS5047RegErrfl = 0x0001;
@@ -32,6 +33,8 @@ static inline constexpr uint32_t NanoSecondsToClocks(uint32_t ns) noexcept
 
 constexpr uint32_t Clocks350ns = NanoSecondsToClocks(350);
 constexpr uint32_t ClocksHalfSclk = SystemCoreClockFreq/(2 * AS5047ClockFrequency);
+constexpr StepTimer::Ticks MaxPipelineWaitTicks = StepTimer::StepClockRate/10000;	// two frames take about 7us at 5MHz, so if the background reading takes longer than 100us something is wrong
+constexpr uint32_t MaxPipelinePauseMillis = 10;									// how long another task waits for the closed loop task to stop background reading
 
 // Adjust the top bit of a 16-bit word to make it even parity
 static inline constexpr uint16_t AddParityBit(uint16_t w) noexcept
@@ -113,41 +116,160 @@ void AS5047D::Enable() noexcept
 {
 	IoPort::SetPinMode(csPin, OUTPUT_HIGH);
 	ClosedLoop::EnableEncodersSpi();
+	ResumePipeline();			// let the closed loop task read the encoder in the background again
 }
 
+// Stop background reading and release the SPI. If another task calls this, the closed loop task releases the SPI when it next collects the reading in progress.
 void AS5047D::Disable() noexcept
 {
+	if (pipelineTask == nullptr || TaskBase::GetCallerTaskHandle() == pipelineTask)
+	{
+		pipelinePaused = true;
+		if (pipelineState != PipelineState::idle)
+		{
+			uint16_t response;
+			(void)FinishPipelinedReading(response);	// we own the SPI, so release it
+		}
+	}
+	else
+	{
+		(void)PausePipeline();		// make sure that the closed loop task isn't reading the encoder in the background
+	}
 	IoPort::SetPinMode(csPin, OUTPUT_HIGH);
 	ClosedLoop::DisableEncodersSpi();
 }
 
 uint32_t AS5047D::GetAbsolutePosition(bool& error) noexcept
 {
-	if (spi.Select(0))			// get the mutex and set the clock rate
+	const bool otherTask = (pipelineTask != nullptr && TaskBase::GetCallerTaskHandle() != pipelineTask);
+	const bool wasPaused = pipelinePaused;
+	const bool spiAvailable = !otherTask || PausePipeline();	// if the closed loop task owns the SPI, ask it to stop reading in the background
+
+	uint16_t response;
+	bool ok;
+	if (!otherTask && pipelineState != PipelineState::idle)
 	{
-		uint16_t response;
-		const bool ok = DoSpiTransaction(AddParityBit(AS5047ReadCommand | AS5047RegAngleCom), response)
+		ok = FinishPipelinedReading(response);		// collect the result of the reading we started at the end of the previous control loop iteration
+	}
+	else if (spiAvailable && spi.Select(0))		// get the mutex and set the clock rate
+	{
+		ok = DoSpiTransaction(AddParityBit(AS5047ReadCommand | AS5047RegAngleCom), response)
 					 && (DelayCycles(GetCurrentCycles(), Clocks350ns), 				// need at least 350ns CS high time
 						 DoSpiTransaction(AddParityBit(AS5047ReadCommand | AS5047RegNop), response));
 		spi.Deselect();			// release the mutex
-		if (ok && CheckResponse(response))
-		{
-			response &= 0x3FFF;
-			error = false;
-			return ((response & 0x2000) ? response | 0xFFFFC000 : response) + AS5047D_ABS_READING_OFFSET;
-		}
+	}
+	else
+	{
+		ok = false;
+	}
+
+	if (otherTask && !wasPaused)
+	{
+		ResumePipeline();
+	}
+
+	if (ok && CheckResponse(response))
+	{
+		response &= 0x3FFF;
+		error = false;
+		return ((response & 0x2000) ? response | 0xFFFFC000 : response) + AS5047D_ABS_READING_OFFSET;
 	}
 
 	error = true;
 	return 0;
 }
 
+// Start reading the angle using DMA, so that the result is ready the next time the control loop calls GetReading.
+// Only the closed loop task calls this. It keeps ownership of the SPI until it collects the result.
+void AS5047D::StartNextReading() noexcept
+{
+	if (pipelineState == PipelineState::idle && !pipelinePaused && spi.Select(0))
+	{
+		pipelineTask = TaskBase::GetCallerTaskHandle();
+		pipelineState = PipelineState::firstFrame;
+		StartPipelineFrame(AddParityBit(AS5047ReadCommand | AS5047RegAngleCom));
+	}
+}
+
+// Send one 16-bit frame of a background reading
+void AS5047D::StartPipelineFrame(uint16_t command) noexcept
+{
+	pipelineTxBuffer[0] = (uint8_t)(command >> 8);
+	pipelineTxBuffer[1] = (uint8_t)(command & 0xFF);
+	fastDigitalWriteLow(csPin);
+	spi.StartDmaTransfer(pipelineTxBuffer, pipelineRxBuffer, 2, DmaCompleteCallback, CallbackParameter(this));
+}
+
+/*static*/ void AS5047D::DmaCompleteCallback(CallbackParameter cbp, DmaCallbackReason reason) noexcept
+{
+	static_cast<AS5047D*>(cbp.vp)->OnDmaComplete(reason);
+}
+
+// Called from the DMA interrupt when a frame has been sent
+void AS5047D::OnDmaComplete(DmaCallbackReason reason) noexcept
+{
+	fastDigitalWriteHigh(csPin);
+	if (reason != DmaCallbackReason::complete)
+	{
+		pipelineState = PipelineState::failed;
+	}
+	else if (pipelineState == PipelineState::firstFrame)
+	{
+		DelayCycles(GetCurrentCycles(), Clocks350ns);				// need at least 350ns CS high time
+		pipelineState = PipelineState::secondFrame;
+		StartPipelineFrame(AddParityBit(AS5047ReadCommand | AS5047RegNop));
+	}
+	else
+	{
+		pipelineState = PipelineState::complete;
+	}
+}
+
+// Collect the result of a background reading and release the SPI. Called only by the task that started the reading.
+bool AS5047D::FinishPipelinedReading(uint16_t& response) noexcept
+{
+	// The reading normally finished long ago, but the control loop may have run early
+	const StepTimer::Ticks startedWaiting = StepTimer::GetTimerTicks();
+	while (pipelineState == PipelineState::firstFrame || pipelineState == PipelineState::secondFrame)
+	{
+		if (StepTimer::GetTimerTicks() - startedWaiting > MaxPipelineWaitTicks)
+		{
+			spi.StopDmaTransfer();
+			pipelineState = PipelineState::failed;
+			break;
+		}
+	}
+
+	const bool ok = (pipelineState == PipelineState::complete);
+	response = ((uint16_t)pipelineRxBuffer[0]) << 8 | pipelineRxBuffer[1];
+	spi.Deselect();				// release the mutex
+	pipelineState = PipelineState::idle;
+	return ok;
+}
+
+// Stop the closed loop task from starting any more background readings, and wait for it to collect the one in progress. Called by other tasks before they use the SPI.
+// Return false if it didn't collect it in time, in which case it still owns the SPI and the caller must not try to use it.
+bool AS5047D::PausePipeline() noexcept
+{
+	pipelinePaused = true;
+	for (uint32_t i = 0; i < MaxPipelinePauseMillis && pipelineState != PipelineState::idle; ++i)
+	{
+		delay(1);
+	}
+	return pipelineState == PipelineState::idle;
+}
+
 // Get the diagnostic register and the error flags register
 bool AS5047D::GetDiagnosticRegisters(DiagnosticRegisters& regs) noexcept
 {
-	if (spi.Select(0))			// get the mutex and set the clock rate
+	const bool otherTask = (pipelineTask != nullptr && TaskBase::GetCallerTaskHandle() != pipelineTask);
+	const bool wasPaused = pipelinePaused;
+	const bool spiAvailable = !otherTask || PausePipeline();
+
+	bool ok = false;
+	if (spiAvailable && spi.Select(0))			// get the mutex and set the clock rate
 	{
-		const bool ok = DoSpiTransaction(AddParityBit(AS5047ReadCommand | AS5047RegDiag), regs.diag)
+		ok = DoSpiTransaction(AddParityBit(AS5047ReadCommand | AS5047RegDiag), regs.diag)
 					 && (DelayCycles(GetCurrentCycles(), Clocks350ns), 				// need at least 350ns CS high time
 						 DoSpiTransaction(AddParityBit(AS5047ReadCommand | AS5047RegMag), regs.diag))
 					 && (DelayCycles(GetCurrentCycles(), Clocks350ns), 				// need at least 350ns CS high time
@@ -155,10 +277,13 @@ bool AS5047D::GetDiagnosticRegisters(DiagnosticRegisters& regs) noexcept
 					 && (DelayCycles(GetCurrentCycles(), Clocks350ns), 				// need at least 350ns CS high time
 						 DoSpiTransaction(AddParityBit(AS5047ReadCommand | AS5047RegNop), regs.errFlags));
 		spi.Deselect();			// release the mutex
-		return ok;
 	}
 
-	return false;
+	if (otherTask && !wasPaused)
+	{
+		ResumePipeline();
+	}
+	return ok;
 }
 
 // Get diagnostic information and append it to a string
@@ -166,7 +291,7 @@ void AS5047D::AppendDiagnostics(const StringRef &reply) noexcept
 {
 	reply.catf(", encoder full rotations %d", (int) fullRotations);
 	reply.catf(", encoder last angle %d", (int) lastAngle);
-	reply.catf(", zero crossing index=%d, zero crossing offset=%d, minCorrection=%.1f, maxCorrection=%.1f", zeroCrossingIndex, zeroCrossingOffset, (double)minCorrection, (double)maxCorrection);
+	reply.catf(", minCorrection=%.1f, maxCorrection=%.1f", (double)minCorrection, (double)maxCorrection);
 	DiagnosticRegisters regs;
 	if (GetDiagnosticRegisters(regs))
 	{
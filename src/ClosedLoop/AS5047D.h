@@ -32,6 +32,7 @@ public:
 	void Enable() noexcept override;
 	void Disable() noexcept override;
 	uint32_t GetAbsolutePosition(bool& error) noexcept;
+	void StartNextReading() noexcept override;
 	void AppendDiagnostics(const StringRef& reply) noexcept override;
 	void AppendStatus(const StringRef& reply) noexcept override;
 
@@ -43,8 +44,30 @@ private:
 		uint16_t errFlags;
 	};
 
+	// States of a reading done in the background using DMA
+	enum class PipelineState : uint8_t
+	{
+		idle = 0,						// no reading in progress, the SPI is not owned by the closed loop task
+		firstFrame,						// sending the read angle command
+		secondFrame,					// sending the NOP command that returns the angle
+		complete,						// the response is in pipelineRxBuffer
+		failed							// the DMA transfer failed
+	};
+
 	bool DoSpiTransaction(uint16_t command, uint16_t& response) noexcept;
 	bool GetDiagnosticRegisters(DiagnosticRegisters& regs) noexcept;
+	void StartPipelineFrame(uint16_t command) noexcept;
+	bool FinishPipelinedReading(uint16_t& response) noexcept;
+	bool PausePipeline() noexcept;
+	void ResumePipeline() noexcept { pipelinePaused = false; }
+	void OnDmaComplete(DmaCallbackReason reason) noexcept;
+	static void DmaCompleteCallback(CallbackParameter cbp, DmaCallbackReason reason) noexcept;
+
+	uint8_t pipelineTxBuffer[2];
+	uint8_t pipelineRxBuffer[2];
+	TaskBase *pipelineTask = nullptr;				// the task that started the background reading, which owns the SPI until it collects the result
+	volatile PipelineState pipelineState = PipelineState::idle;
+	volatile bool pipelinePaused = false;			// set by other tasks that want to use the SPI
 };
 
 #endif
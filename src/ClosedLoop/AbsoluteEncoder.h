@@ -38,10 +38,9 @@ public:
 
 	// Lookup table (LUT) management
 	bool LoadLUT() noexcept;
-	void StoreLUT() noexcept;
+	bool StoreHarmonics(const float sinCoefficients[NUM_HARMONICS], const float cosCoefficients[NUM_HARMONICS]) noexcept;
 	void ClearLUT() noexcept;
 	void ScrubLUT() noexcept;
-	void StoreLUTValueForPosition(int16_t encoder_reading, float real_world_position) noexcept;
 
 	// Constants
 	static constexpr unsigned int GetMaxValue() noexcept { return MAX; }
@@ -57,9 +56,9 @@ protected:
 	int32_t fullRotations;
 
 	// LUT vars
+	// The LUT holds the corrected reading at the start of each window of LUT_RESOLUTION raw readings, calculated from the stored harmonics when it is loaded.
+	// With a 14-bit encoder and LUT_RESOLUTION = 16 it uses 4kb of RAM, and we interpolate between entries so a larger window would not cost much accuracy.
 	bool LUTLoaded;
-	int zeroCrossingIndex;
-	int zeroCrossingOffset;
 	float minCorrection = 0.0, maxCorrection = 0.0;
 	float correctionLUT[MAX / LUT_RESOLUTION];
 };
@@ -77,20 +76,23 @@ int32_t AbsoluteEncoder<MAX, LUT_RESOLUTION>::GetReading() noexcept {
 		return fullRotations * MAX + lastAngle;
 	}
 
-	// Apply LUT correction (if the LUT is loaded)
+	// Apply LUT correction (if the LUT is loaded), interpolating between the entries at the start and end of the window
 	// (These divisions should be efficient because LUT_RESOLUTION is a power of 2)
 	if (LUTLoaded) {
-		int windowStartIndex = currentAngle / LUT_RESOLUTION;
-		float windowStart = correctionLUT[windowStartIndex];
-		int windowOffset = currentAngle % LUT_RESOLUTION;
+		constexpr unsigned int LUTLength = MAX / LUT_RESOLUTION;
+		const unsigned int windowStartIndex = (unsigned int)currentAngle / LUT_RESOLUTION;
+		const float windowStart = correctionLUT[windowStartIndex];
+		const float windowEnd = (windowStartIndex + 1 < LUTLength) ? correctionLUT[windowStartIndex + 1] : correctionLUT[0] + (float)MAX;
+		float windowSize = windowEnd - windowStart;
 
 		// Handle the zero-crossing
-		if (windowStartIndex == zeroCrossingIndex && zeroCrossingOffset >= windowOffset) {
-			windowStart = 0;
-			windowOffset -= zeroCrossingOffset;
+		if (windowSize > (float)MAX/2) {
+			windowSize -= (float)MAX;
+		} else if (windowSize < -(float)MAX/2) {
+			windowSize += (float)MAX;
 		}
 
-		currentAngle = windowStart + windowOffset;
+		currentAngle = lrintf(windowStart + windowSize * (float)(currentAngle % LUT_RESOLUTION) * (1.0/LUT_RESOLUTION));
 	}
 
 	// Accumulate the full rotations if one has occurred
@@ -125,44 +127,23 @@ bool AbsoluteEncoder<MAX, LUT_RESOLUTION>::LoadLUT() noexcept {
 		else if (correction > maxCorrection) { maxCorrection = correction; }
 	}
 
-	// Find the zero-crossing index and offset
-	float prevVal = correctionLUT[0];
-	for (unsigned int i = 1; i<(MAX/LUT_RESOLUTION); i++) {
-		float curVal = correctionLUT[i];
-		if (abs(prevVal - curVal) > MAX/2) {
-			zeroCrossingIndex = i-1;
-			zeroCrossingOffset = round(MAX - prevVal);
-			break;
-		}
-		prevVal = curVal;
-	}
-
 	// Mark the LUT as loaded (and return true)
 	return LUTLoaded = true;
 }
 
+// Store the harmonics of the correction measured by calibration, then load the LUT from them.
+// The correction at encoder angle theta is the sum over the harmonics h of sinCoefficients[h] * sin(h * theta) + cosCoefficients[h] * cos(h * theta).
 template<unsigned int MAX, unsigned int LUT_RESOLUTION>
-void AbsoluteEncoder<MAX, LUT_RESOLUTION>::StoreLUT() noexcept {
-	// TODO: Verify all LUT values are present
-
-	// Store LUT to NVRAM (as Fourier transform)
+bool AbsoluteEncoder<MAX, LUT_RESOLUTION>::StoreHarmonics(const float sinCoefficients[NUM_HARMONICS], const float cosCoefficients[NUM_HARMONICS]) noexcept {
 	NonVolatileMemory mem(NvmPage::closedLoop);
 	for (size_t harmonic = 0; harmonic < NUM_HARMONICS; harmonic++) {
-		float sum1 = 0.0, sum2 = 0.0;
-		const size_t LUTLength = MAX / LUT_RESOLUTION;
-		for (size_t i = 0; i < LUTLength; ++i)
-		{
-			const float offset = i * LUT_RESOLUTION - correctionLUT[i];
-			sum1 += offset * sinf(harmonic * i * TwoPi/LUTLength);
-			sum2 += offset * cosf(harmonic * i * TwoPi/LUTLength);
-		}
-		mem.SetClosedLoopLUTHarmonicAngle(harmonic, atan2f(sum2, sum1));
-		mem.SetClosedLoopLUTHarmonicMagnitude(harmonic, sqrtf(fsquare(sum1) + fsquare(sum2)) / (harmonic == 0 ? LUTLength : (LUTLength/2)));
+		mem.SetClosedLoopLUTHarmonicAngle(harmonic, atan2f(cosCoefficients[harmonic], sinCoefficients[harmonic]));
+		mem.SetClosedLoopLUTHarmonicMagnitude(harmonic, sqrtf(fsquare(sinCoefficients[harmonic]) + fsquare(cosCoefficients[harmonic])));
 	}
 	mem.EnsureWritten();
 
 	// Read back the LUT (Ensures that the Fourier transformed version is used)
-	LoadLUT();
+	return LoadLUT();
 }
 
 template<unsigned int MAX, unsigned int LUT_RESOLUTION>
@@ -177,11 +158,6 @@ void AbsoluteEncoder<MAX, LUT_RESOLUTION>::ScrubLUT() noexcept {
 	ClearLUT();
 }
 
-template<unsigned int MAX, unsigned int LUT_RESOLUTION>
-void AbsoluteEncoder<MAX, LUT_RESOLUTION>::StoreLUTValueForPosition(int16_t encoder_reading, float real_world_position) noexcept {
-	correctionLUT[encoder_reading / LUT_RESOLUTION] = real_world_position;
-}
-
 # endif
 
 #endif /* SRC_CLOSEDLOOP_ABSOLUTEENCODER_H_ */
@@ -24,9 +24,11 @@
 
 static constexpr uint32_t Attiny44aSignature = 0x1E9207;
 static constexpr uint32_t Attiny44aPageSize = 64;				// flash page size in bytes (32 words)
+static constexpr uint8_t ChecksumEepromAddress = 0;				// where in the attiny EEPROM we store the checksum of the program and fuses (2 bytes). Chip erase clears it.
+static constexpr size_t MaxQuadsPerBurst = 16;						// how many 4-byte commands we send in a single SPI transfer
 
 //TODO use the attiny watchdog
-static const uint8_t AttinyProgram[] =
+static constexpr uint8_t AttinyProgram[] =
 {
 	// 0x0000 Interrupt vectors (RJMP instructions). First one jumps to CRT start, others jump to dummy ISR.
 	0x10, 0xC0, 0x22, 0xC0, 0x21, 0xC0, 0x20, 0xC0, 0x1F, 0xC0, 0x1E, 0xC0, 0x1D, 0xC0, 0x1C, 0xC0,
@@ -57,13 +59,39 @@ static const uint8_t AttinyProgram[] =
 	0x8A, 0x9A, 0xAA, 0x8A, 0xAA, 0xCA, 0xCA, 0x9A, 0x9A, 0xCA, 0xCA, 0xAA, 0x8A, 0xAA, 0x9A, 0x8A
 };
 
-static const uint8_t AttinyFuses[3] =
+static constexpr uint8_t AttinyFuses[3] =
 {
 	0x80,			// low fuse: external clock, not divided by 8
 	0xDF,			// high fuse: serial programming enabled
 	0xFF			// extended fuse: self programming disabled
 };
 
+// Calculate the CRC-CCITT of the program and fuses. We store this in the attiny EEPROM after programming and verifying it,
+// so that we don't have to read back the whole program to check that it is current.
+static constexpr uint16_t CalcProgramChecksum() noexcept
+{
+	uint16_t crc = 0xFFFF;
+	auto addByte = [&crc](uint8_t b) constexpr
+	{
+		crc ^= (uint16_t)b << 8;
+		for (unsigned int i = 0; i < 8; ++i)
+		{
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	};
+	for (uint8_t b : AttinyProgram)
+	{
+		addByte(b);
+	}
+	for (uint8_t b : AttinyFuses)
+	{
+		addByte(b);
+	}
+	return crc;
+}
+
+static constexpr uint16_t AttinyProgramChecksum = CalcProgramChecksum();
+
 AttinyProgrammer::AttinyProgrammer(SharedSpiDevice& spiDev) noexcept : spi(spiDev, 125000, SpiMode::mode0, false), programStatus(AttinyProgErrorCode::notChecked)
 {
 }
@@ -77,6 +105,33 @@ uint8_t AttinyProgrammer::SendSpiQuad(uint8_t b1, uint8_t b2, uint8_t b3, uint8_
 	return (b1 == 0xAC && b2 == 0x53) ? reply[2] : reply[3];
 }
 
+// Send a burst of 4-byte commands to the attiny in a single transfer. The reply to each command is in the last byte of the corresponding 4 bytes of 'replies'.
+void AttinyProgrammer::SendSpiQuads(const uint8_t *commands, uint8_t *replies, size_t numQuads) noexcept
+{
+	spi.TransceivePacket(commands, replies, 4 * numQuads);
+}
+
+// Return true if the checksum stored in the attiny EEPROM matches the current program. This is all we need to check when the attiny has already been programmed.
+bool AttinyProgrammer::ChecksumMatches() noexcept
+{
+	const uint8_t commands[8] = { 0xA0, 0x00, ChecksumEepromAddress, 0x00, 0xA0, 0x00, ChecksumEepromAddress + 1, 0x00 };
+	uint8_t replies[8];
+	SendSpiQuads(commands, replies, 2);
+	return (((uint16_t)replies[3] << 8) | replies[7]) == AttinyProgramChecksum;
+}
+
+// Store the checksum of the program in the attiny EEPROM, returning true if successful
+bool AttinyProgrammer::WriteChecksum() noexcept
+{
+	SendSpiQuad(0xC0, 0x00, ChecksumEepromAddress, (uint8_t)(AttinyProgramChecksum >> 8));
+	if (!WaitUntilAttinyReady())
+	{
+		return false;
+	}
+	SendSpiQuad(0xC0, 0x00, ChecksumEepromAddress + 1, (uint8_t)AttinyProgramChecksum);
+	return WaitUntilAttinyReady() && ChecksumMatches();
+}
+
 // Set up the SPI channel and put the attiny in programming mode, returning true if successful
 AttinyProgErrorCode AttinyProgrammer::SetupForProgramming() noexcept
 {
@@ -143,16 +198,30 @@ void AttinyProgrammer::TurnAttinyOff() noexcept
 	delayMicroseconds(100);										// give the attiny time to read the error out pin and go into a loop doing nothing
 }
 
-// Verify the programming of the attiny
+// Verify the programming of the attiny, reading the program in bursts
 AttinyProgErrorCode AttinyProgrammer::DoVerify() noexcept
 {
 	AttinyProgErrorCode ret = AttinyProgErrorCode::good;
-	for (size_t addr = 0; ret == AttinyProgErrorCode::good && addr < ARRAY_SIZE(AttinyProgram); ++addr)
+	for (size_t startAddr = 0; ret == AttinyProgErrorCode::good && startAddr < ARRAY_SIZE(AttinyProgram); startAddr += MaxQuadsPerBurst)
 	{
-		const uint8_t progByte = SendSpiQuad(0x20 | ((addr & 1u) << 3), addr >> 9, addr >> 1, 0);
-		if (progByte != AttinyProgram[addr])
+		const size_t numQuads = min<size_t>(MaxQuadsPerBurst, ARRAY_SIZE(AttinyProgram) - startAddr);
+		uint8_t commands[4 * MaxQuadsPerBurst];
+		uint8_t replies[4 * MaxQuadsPerBurst];
+		for (size_t i = 0; i < numQuads; ++i)
+		{
+			const size_t addr = startAddr + i;
+			commands[4 * i] = 0x20 | ((addr & 1u) << 3);
+			commands[4 * i + 1] = addr >> 9;
+			commands[4 * i + 2] = addr >> 1;
+			commands[4 * i + 3] = 0;
+		}
+		SendSpiQuads(commands, replies, numQuads);
+		for (size_t i = 0; i < numQuads; ++i)
 		{
-			ret = AttinyProgErrorCode::verifyFailed;
+			if (replies[4 * i + 3] != AttinyProgram[startAddr + i])
+			{
+				ret = AttinyProgErrorCode::verifyFailed;
+			}
 		}
 	}
 
@@ -174,9 +243,13 @@ AttinyProgErrorCode AttinyProgrammer::DoVerify() noexcept
 AttinyProgErrorCode AttinyProgrammer::CheckProgram() noexcept
 {
 	AttinyProgErrorCode ret = SetupForProgramming();
-	if (ret == AttinyProgErrorCode::good)
+	if (ret == AttinyProgErrorCode::good && !ChecksumMatches())
 	{
-		ret = DoVerify();
+		ret = DoVerify();						// the checksum isn't there if the attiny was programmed by older firmware, so check the program itself
+		if (ret == AttinyProgErrorCode::good && !WriteChecksum())
+		{
+			ret = AttinyProgErrorCode::writeTimeout;
+		}
 	}
 
 	EndProgramming();
@@ -210,22 +283,30 @@ AttinyProgErrorCode AttinyProgrammer::Program() noexcept
 	}
 
 	// We must program the flash one page at a time. Page size is 2K words on the attiny44a (1K words on attiny24a)
-	bool finished = false;
-	size_t addr = 0;
-	size_t pageStartAddress = 0;
-	while (ret == AttinyProgErrorCode::good && !finished)
+	// Load the page buffer in bursts, then write the page.
+	for (size_t pageStartAddress = 0; ret == AttinyProgErrorCode::good && pageStartAddress < ARRAY_SIZE(AttinyProgram); pageStartAddress += Attiny44aPageSize)
 	{
-		SendSpiQuad(0x40 | ((addr & 1u) << 3), addr >> 9, addr >> 1, AttinyProgram[addr]);
-		++addr;
-		finished = (addr == ARRAY_SIZE(AttinyProgram));
-		if (finished || (addr & (Attiny44aPageSize - 1)) == 0)
+		const size_t pageEndAddress = min<size_t>(pageStartAddress + Attiny44aPageSize, ARRAY_SIZE(AttinyProgram));
+		for (size_t startAddr = pageStartAddress; startAddr < pageEndAddress; startAddr += MaxQuadsPerBurst)
 		{
-			SendSpiQuad(0x4c, pageStartAddress >> 9, pageStartAddress >> 1, 0x00);
-			pageStartAddress = addr;
-			if (!WaitUntilAttinyReady())
+			const size_t numQuads = min<size_t>(MaxQuadsPerBurst, pageEndAddress - startAddr);
+			uint8_t commands[4 * MaxQuadsPerBurst];
+			uint8_t replies[4 * MaxQuadsPerBurst];
+			for (size_t i = 0; i < numQuads; ++i)
 			{
-				ret = AttinyProgErrorCode::writeTimeout;
+				const size_t addr = startAddr + i;
+				commands[4 * i] = 0x40 | ((addr & 1u) << 3);
+				commands[4 * i + 1] = addr >> 9;
+				commands[4 * i + 2] = addr >> 1;
+				commands[4 * i + 3] = AttinyProgram[addr];
 			}
+			SendSpiQuads(commands, replies, numQuads);
+		}
+
+		SendSpiQuad(0x4c, pageStartAddress >> 9, pageStartAddress >> 1, 0x00);
+		if (!WaitUntilAttinyReady())
+		{
+			ret = AttinyProgErrorCode::writeTimeout;
 		}
 	}
 
@@ -253,6 +334,11 @@ AttinyProgErrorCode AttinyProgrammer::Program() noexcept
 		ret = DoVerify();
 	}
 
+	if (ret == AttinyProgErrorCode::good && !WriteChecksum())
+	{
+		ret = AttinyProgErrorCode::writeTimeout;
+	}
+
 	EndProgramming();
 	return ret;
 }
@@ -42,6 +42,9 @@ private:
 	AttinyProgErrorCode DoVerify() noexcept;
 
 	uint8_t SendSpiQuad(uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4) noexcept;
+	void SendSpiQuads(const uint8_t *commands, uint8_t *replies, size_t numQuads) noexcept;
+	bool ChecksumMatches() noexcept;
+	bool WriteChecksum() noexcept;
 	AttinyProgErrorCode SetupForProgramming() noexcept;
 	void EndProgramming() noexcept;
 	bool WaitUntilAttinyReady() noexcept;
@@ -16,11 +16,15 @@ using std::numeric_limits;
 # include "TLI5012B.h"
 # include "SpiEncoder.h"
 # include <ClosedLoop/DerivativeAveragingFilter.h>
+# include <ClosedLoop/VelocityEstimators.h>
 
 # include <math.h>
 # include <Platform.h>
+# include <Movement/Move.h>
 # include <General/Bitmap.h>
 # include <TaskPriorities.h>
+# include <TaskStackSizes.h>
+# include <Tasks.h>
 # include <CAN/CanInterface.h>
 # include <CanMessageBuffer.h>
 # include <CanMessageFormats.h>
@@ -51,10 +55,8 @@ float 		ClosedLoop::encoderPulsePerStep;			// How many encoder readings do we ge
 namespace ClosedLoop
 {
 	// Constants private to this module
-	constexpr size_t TaskStackWords = 200;				// Size of the stack for all closed loop tasks
 	constexpr unsigned int derivativeFilterSize = 8;	// The range of the derivative filter (use a power of 2 for efficiency)
-	constexpr unsigned int DataBufferSize = 2000 * 14;	// When collecting samples we can accommodate 2000 readings of up to 13 variables + timestamp
-	constexpr unsigned int tuningStepsPerSecond = 2000;	// the rate at which we send 1/256 microsteps during tuning, slow enough for high-inertia motors
+	constexpr unsigned int DataBufferSize = 2000 * 14 * 2;	// When collecting samples we can accommodate 2000 readings of up to 13 variables + timestamp, in 16-bit units
 	constexpr StepTimer::Ticks stepTicksPerTuningStep = StepTimer::StepClockRate/tuningStepsPerSecond;
 	constexpr StepTimer::Ticks stepTicksBeforeTuning = StepTimer::StepClockRate/10;
 														// 1/10 sec delay between enabling the driver and starting tuning, to allow for brake release and current buildup
@@ -70,17 +72,48 @@ namespace ClosedLoop
 
 	constexpr float PIDIlimit = 80.0;
 
+	// Positions in the ReadState pipeline are fixed point numbers of full steps with this many fraction bits.
+	// 10 of them give the step phase, where 1024 is one full step, and the remainder keep the precision of high resolution and interpolated encoder readings.
+	constexpr unsigned int PositionFractionBits = 26;
+	constexpr unsigned int PhaseFractionBits = PositionFractionBits - 10;
+	constexpr float PositionFixedToSteps = 1.0/(float)(1ul << PositionFractionBits);
+
 	// Enumeration of closed loop recording modes
 	enum RecordingMode : uint8_t
 	{
 		None = 0,			// not collecting data
 		Immediate,			// collecting data now
 		OnNextMove,			// collect data when the next movement command starts executing
-		SendingData			// finished collecting data but still sending it to the main board
+		SendingData,		// finished collecting data but still sending it to the main board
+		Continuous,			// streaming data to the main board until told to stop
+		Triggered			// keeping a history of recent samples until the capture trigger fires, then collecting data as in Immediate mode
 	};
 
+	// Conditions that can end the pre-trigger history of a triggered data collection
+	enum class CaptureTrigger : uint8_t
+	{
+		none = 0,			// triggered data collection is not configured
+		error,				// the error exceeds a threshold
+		stall,				// the motor has stalled
+		preStall,			// the error exceeds the pre-stall threshold
+		moveNumber			// the number of moves completed reaches a value
+	};
+
+	static const char *const CaptureTriggerNames[] = { "none", "error", "stall", "pre-stall", "move number" };
+
+	constexpr uint8_t ContinuousModeParameter = 2;		// the M569.5 A parameter value that requests continuous streaming
+	constexpr uint8_t TriggeredModeParameter = 3;		// the M569.5 A parameter value that requests data collection when the capture trigger fires
+	constexpr unsigned int MinFreeQueuedSendsForStreaming = 4;	// when streaming, wait until the CAN send queue has this much room so that other messages aren't delayed
+	constexpr uint32_t StreamingBackoffMillis = 2;		// how long to wait before checking the CAN send queue again
+
+	constexpr uint32_t DefaultStallRecoveryMillis = 200;	// how long we may spend recovering from a stall locally before reporting it to the main board
+	constexpr float DefaultStallRecoveryAcceleration = 20000.0;	// the acceleration in full steps/sec^2 at which we catch up with the target after a stall
+	constexpr float StallRecoveryEnvelopeFraction = 0.5;	// during stall recovery, the error the controller sees is limited to this fraction of the stall threshold
+	constexpr float StallRecoveryCurrentRampTime = 0.005;	// the time in seconds over which we ramp the minimum current up to full current during stall recovery
+
 	// Variables private to this module
 	float	recipEncoderPulsesPerStep;					// Reciprocal of the encoder pulses per step, to avoid FP division when calculating the error
+	int32_t	positionFixedPerCount = 0;					// The same in fixed point with PositionFractionBits fraction bits
 
 	// Control variables, set by the user to determine how the closed loop controller works
 	bool 	closedLoopEnabled = false;					// Has closed loop been enabled by the user?
@@ -96,11 +129,22 @@ namespace ClosedLoop
 	float 	Kp = 100;									// The proportional constant for the PID controller
 	float 	Ki = 0;										// The proportional constant for the PID controller
 	float 	Kd = 0;										// The proportional constant for the PID controller
+	float	Kv = 0;										// The velocity feed-forward constant, in control signal units per full step/sec
+	float	Ka = 0;										// The acceleration feed-forward constant, in control signal units per full step/sec^2
+
+	// Cascaded control. When positionLoopDivider is nonzero, an outer position loop sets the speed demand for an inner velocity loop instead of using the single PID controller.
+	unsigned int positionLoopDivider = 0;				// Run the position loop once every this many control loop iterations, or 0 to use the single PID controller
+	float	Kpp = 0;									// The position loop gain, in full steps/sec of speed demand per full step of error
+	float	maxSpeedCorrection = 0;						// The most the position loop may add to the target speed, in full steps/sec
+	float	Kvp = 0;									// The velocity loop proportional constant, in control signal units per full step/sec of speed error
+	float	Kvi = 0;									// The velocity loop integral constant
+	float	velocityIlimit = PIDIlimit;					// The limit on the velocity loop integral term
 
 	float 	errorThresholds[2];							// The error thresholds. [0] is pre-stall, [1] is stall
 
 	float 	ultimateGain = 0;							// The ultimate gain of the controller (used for tuning)
-	float 	oscillationPeriod = 0;						// The oscillation period when Kp = ultimate gain
+	float 	oscillationPeriod = 0;						// The oscillation period when Kp = ultimate gain, in seconds
+	float	relayAmplitude = 0;							// If nonzero, the control signal is this in the direction of the error instead of the PID output (used for tuning)
 
 	// Data collection variables
 	// Input variables
@@ -108,9 +152,16 @@ namespace ClosedLoop
 	uint8_t 	movementRequested;						// Which calibration movement did they request? 0=none, 1=polarity, 2=continuous
 	uint16_t	filterRequested;						// What filter did they request?
 	volatile uint16_t samplesRequested;
+	CaptureTrigger captureTrigger = CaptureTrigger::none;	// What ends the pre-trigger history in triggered mode?
+	float	captureErrorThreshold;						// The error in full steps that fires the error trigger
+	uint32_t captureMoveNumber;							// The completed move count that fires the move number trigger
+	uint16_t preTriggerSamples = 0;						// How many samples from before the trigger we keep
 
 	// Derived variables
 	volatile unsigned int variableCount;
+	unsigned int sampleSize;							// how many 16-bit buffer entries each sample occupies
+	unsigned int samplesPerMessage;						// how many samples fit in one CAN message, which is how many we wait for before waking the transmission task
+	bool	packedSamples;								// true if we are storing variables that allow it as 16-bit fixed point
 	volatile uint16_t samplesCollected = 0;
 	volatile uint16_t samplesSent = 0;;
 	StepTimer::Ticks dataCollectionStartTicks;			// At what tick did data collection start?
@@ -118,26 +169,40 @@ namespace ClosedLoop
 	StepTimer::Ticks whenNextSampleDue;					// when it will be time to take the next sample
 
 	// Data collection buffer and related variables
-	float 	sampleBuffer[DataBufferSize];				// Ring buffer to store the samples in
-	volatile size_t sampleBufferReadPointer = 0;		// Send this sample next to the main board
-	volatile size_t sampleBufferWritePointer = 0;		// Store the next sample at this point in the buffer
-	volatile size_t	sampleBufferLimit;					// the limit for the read/write pointers, to avoid wrapping within a single set of sampled variables
+	uint16_t *sampleBuffer = nullptr;					// Ring buffer of DataBufferSize entries to store the samples in, allocated when data is first collected. Each variable takes two entries, or one if it is packed.
+	volatile size_t sampleBufferReadPointer = 0;		// Send the sample at this index next to the main board
+	volatile size_t sampleBufferWritePointer = 0;		// Store the next sample at this index in the buffer
+	volatile size_t	sampleBufferLimit;					// the limit for the read/write pointers, a whole number of messages so that messages don't wrap unless the triggered mode discarded samples
 	volatile bool	sampleBufferOverflowed;				// true if we collected data faster than we could send it
 
 	// Working variables
 	// These variables are all used to calculate the required motor currents. They are declared here so they can be reported on by the data collection task
 	bool 	stepDirection = true;						// The direction the motor is attempting to take steps in
 	float	targetMotorSteps;							// The number of steps the motor should have taken relative to it's zero position
-	float	currentMotorSteps;							// The number of steps the motor has taken relative to it's zero position
+	float	lastMotionPosition = 0.0;					// The position reported by the movement system the last time the control loop ran, in full steps
+	float	targetSpeed = 0.0;							// The speed the motor should be moving at in full steps/sec, with the same sign convention as targetMotorSteps
+	float	targetAcceleration = 0.0;					// The acceleration in full steps/sec^2, with the same sign convention as targetMotorSteps
+	float	currentMotorSteps;							// The number of steps the motor has taken relative to it's zero position, including any interpolation between encoder counts
+	float	encoderCountsPerSecond;						// The speed measured by the encoder from its edge times, if encoderSpeedValid is true
+	bool	encoderSpeedValid = false;					// True if the encoder measures the speed itself
 	int32_t targetEncoderReading;						// The encoder reading we want, calculated from targetMotorSteps
+	int64_t	currentPositionFixed;						// currentMotorSteps in fixed point with PositionFractionBits fraction bits
 	float 	currentError;								// The current error
 
 	DerivativeAveragingFilter<derivativeFilterSize> derivativeFilter;	// An averaging filter to smooth the derivative of the error
+	FixedPointDerivativeFilter<derivativeFilterSize> fixedPointFilter;	// The alternative velocity estimators, see VelocityEstimators.h
+	AlphaBetaVelocityObserver alphaBetaObserver;
+	EdgeTimingVelocityEstimator edgeTimingEstimator;
+	VelocityEstimator velocityEstimator = VelocityEstimator::errorAveraging;	// Which of the above we use to calculate the D term
 
 	float 	PIDPTerm;									// Proportional term
 	float 	PIDITerm = 0.0;								// Integral accumulator
 	float 	PIDDTerm;									// Derivative term
+	float	measuredStepPhaseFine;						// The measured position of the motor including the fractional part, 0 to 4096
+	float	feedForwardTerm;							// Velocity and acceleration feed-forward term
 	float	PIDControlSignal;							// The overall signal from the PID controller
+	float	speedDemand;								// In cascaded control, the speed requested by the position loop in full steps/sec
+	unsigned int positionLoopCountdown = 0;				// In cascaded control, how many more iterations until the position loop runs again
 
 	float	phaseShift;									// The desired shift in the position of the motor, where 1024 = 1 full step
 
@@ -147,6 +212,18 @@ namespace ClosedLoop
 	bool 	stall = false;								// Has the closed loop error threshold been exceeded?
 	bool 	preStall = false;							// Has the closed loop warning threshold been exceeded?
 
+	// Stall recovery variables
+	StepTimer::Ticks stallRecoveryTicks = DefaultStallRecoveryMillis * (StepTimer::StepClockRate/1000);	// how long we may try to recover from a stall locally, 0 to report stalls at once
+	float	stallRecoveryAcceleration = DefaultStallRecoveryAcceleration;	// the acceleration we use to catch up with the target during stall recovery
+	bool	recoveringFromStall = false;				// True if the error exceeded the stall threshold and we are trying to catch up with the target
+	StepTimer::Ticks whenStallRecoveryStarted;
+	float	recoveryLag;								// How far the target the controller is working towards lags the real target during stall recovery, in full steps
+	float	recoverySpeed;								// How fast we are reducing recoveryLag, in full steps/sec
+	float	recoveryCurrentFraction;					// The minimum current fraction during stall recovery, ramped up to 1.0
+	float	controlError;								// The error that the controller works on, which is currentError less recoveryLag
+	uint32_t numStallRecoveries = 0;					// How many times we started local stall recovery
+	uint32_t numFailedStallRecoveries = 0;				// How many times local stall recovery timed out and we reported a stall
+
 	// Tuning variables
 	struct TuningResults
 	{
@@ -154,6 +231,7 @@ namespace ClosedLoop
 		float origin;
 		float xMean;
 		float revisedOrigin;
+		unsigned int numSamples;
 
 		// Calculate the revised origin based on a different slope, using the mid point of the move as the reference point
 		void CalcRevisedOrigin(float slopeToUse) noexcept
@@ -164,7 +242,7 @@ namespace ClosedLoop
 		// Print the values - used for debugging only
 		void Print(const char *s, const StringRef& reply) const noexcept
 		{
-			reply.catf("%s: slope %.4f meanX %.1f origin %.2f revised origin %.2f\n", s, (double)slope, (double)xMean, (double)origin, (double)revisedOrigin);
+			reply.catf("%s: slope %.4f meanX %.1f origin %.2f revised origin %.2f samples %u\n", s, (double)slope, (double)xMean, (double)origin, (double)revisedOrigin, numSamples);
 		}
 	};
 
@@ -217,7 +295,13 @@ namespace ClosedLoop
 	// Return true if we are currently collecting data or primed to collect data or finishing sending data
 	inline bool CollectingData() noexcept { return samplingMode != RecordingMode::None; }
 
+	// Return true if the control loop is currently taking samples
+	inline bool TakingSamples() noexcept { return samplingMode == RecordingMode::Immediate || samplingMode == RecordingMode::Continuous; }
+
+	void CheckCaptureTrigger() noexcept;
+
 	void ReadState() noexcept;
+	void CheckForStall(StepTimer::Ticks loopCallTime) noexcept;
 	void CollectSample() noexcept;
 	void ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept;
 	void StartTuning(uint8_t tuningType) noexcept;
@@ -228,12 +312,57 @@ namespace ClosedLoop
 }	// end namespace
 
 // Tasks and task loops
-static Task<ClosedLoop::TaskStackWords> *dataTransmissionTask;		// Data transmission task - handles sending back the buffered sample data
+static Task<ClosedLoopTaskStackWords> *dataTransmissionTask;		// Data transmission task - handles sending back the buffered sample data
+
+// Scaling factors for the variables that we can pack into 16-bit fixed point
+constexpr float PackedErrorScale = 256.0;						// +/- 128 full steps
+constexpr float PackedControlSignalScale = 64.0;				// +/- 512, the control signal is clamped to +/- 256
+constexpr float PackedPhaseShiftScale = 16.0;					// +/- 2048, the phase shift is at most +/- 1024
+constexpr float PackedIntegerScale = 1.0;						// the phases are 0 .. 4095 and the coil currents are already 16-bit integers
+
+// The variables we can collect, in the order in which we store and send them, and the scaling factor we use when storing each one as 16-bit fixed point.
+// A scaling factor of zero means that the variable's range doesn't allow it to be packed, so it is always stored as a float.
+struct RecordedVariable
+{
+	uint16_t flag;
+	float packedScale;
+};
+
+static constexpr RecordedVariable RecordedVariables[] =
+{
+	{ CL_RECORD_RAW_ENCODER_READING,	0.0 },
+	{ CL_RECORD_CURRENT_MOTOR_STEPS,	0.0 },
+	{ CL_RECORD_TARGET_MOTOR_STEPS,		0.0 },
+	{ CL_RECORD_CURRENT_ERROR,			PackedErrorScale },
+	{ CL_RECORD_PID_CONTROL_SIGNAL,		PackedControlSignalScale },
+	{ CL_RECORD_PID_P_TERM,				PackedControlSignalScale },
+	{ CL_RECORD_PID_I_TERM,				PackedControlSignalScale },
+	{ CL_RECORD_PID_D_TERM,				PackedControlSignalScale },
+	{ CL_RECORD_STEP_PHASE,				PackedIntegerScale },
+	{ CL_RECORD_DESIRED_STEP_PHASE,		PackedIntegerScale },
+	{ CL_RECORD_PHASE_SHIFT,			PackedPhaseShiftScale },
+	{ CL_RECORD_COIL_A_CURRENT,			PackedIntegerScale },
+	{ CL_RECORD_COIL_B_CURRENT,			PackedIntegerScale },
+};
 
 // Helper function to count the number of variables being collected by a given filter
 static inline unsigned int CountVariablesCollected(uint16_t filter)
 {
-	return (new Bitmap<uint16_t>(filter))->CountSetBits() + 1;
+	return Bitmap<uint16_t>(filter).CountSetBits() + 1;
+}
+
+// Helper function to count the number of 16-bit buffer entries needed to store one sample using a given filter
+static unsigned int GetSampleSize(uint16_t filter, bool packed) noexcept
+{
+	unsigned int size = 2;										// the timestamp is always stored as a float
+	for (const RecordedVariable& v : RecordedVariables)
+	{
+		if (filter & v.flag)
+		{
+			size += (packed && v.packedScale != 0.0) ? 1 : 2;
+		}
+	}
+	return size;
 }
 
 // Helper function to convert a time period (expressed in StepTimer::Ticks) to ms
@@ -292,20 +421,66 @@ void ClosedLoop::ReportTuningErrors(uint8_t tuningErrorBitmask, const StringRef
 	if (tuningErrorBitmask & TUNE_ERR_TOO_MUCH_MOTION)		{ reply.catf(" The measured motion was more than expected; counts/step is about %.2f.", (double)(measuredCountsPerStep * 0.25)); }
 }
 
+// Helper function to reset all the velocity estimators
+static void ResetVelocityEstimators() noexcept
+{
+	ClosedLoop::derivativeFilter.Reset();
+	ClosedLoop::fixedPointFilter.Reset();
+	ClosedLoop::alphaBetaObserver.Reset();
+	ClosedLoop::edgeTimingEstimator.Reset();
+}
+
+// Helper function to get the rate of change of the error in full steps per second.
+// The alternative estimators measure the motor speed, so we subtract that from the speed of the target. That also stops the D term kicking when the target is changed suddenly.
+static float GetErrorDerivative() noexcept
+{
+	switch (ClosedLoop::velocityEstimator)
+	{
+	case VelocityEstimator::errorAveraging:
+	default:
+		return ClosedLoop::derivativeFilter.GetDerivative();
+
+	case VelocityEstimator::fixedPoint:
+		return ClosedLoop::targetSpeed - ClosedLoop::fixedPointFilter.GetVelocity() * ClosedLoop::recipEncoderPulsesPerStep;
+
+	case VelocityEstimator::alphaBeta:
+		return ClosedLoop::targetSpeed - ClosedLoop::alphaBetaObserver.GetVelocity() * ClosedLoop::recipEncoderPulsesPerStep;
+
+	case VelocityEstimator::edgeTiming:
+		// If the encoder times its own edges then use its speed, else estimate it from the times at which the reading changed
+		return ClosedLoop::targetSpeed - ((ClosedLoop::encoderSpeedValid) ? ClosedLoop::encoderCountsPerSecond : ClosedLoop::edgeTimingEstimator.GetVelocity())
+											* ClosedLoop::recipEncoderPulsesPerStep;
+	}
+}
+
+// Helper function to set the coil currents
+static void SetMotorCurrents(float sine, float cosine, float magnitude) noexcept
+{
+	ClosedLoop::coilA = (int16_t)lrintf(cosine * magnitude);
+	ClosedLoop::coilB = (int16_t)lrintf(sine * magnitude);
+
+# if SUPPORT_TMC2160 && SINGLE_DRIVER
+	SmartDrivers::SetRegister(0, SmartDriverRegister::xDirect, (((uint32_t)(uint16_t)ClosedLoop::coilB << 16) | (uint32_t)(uint16_t)ClosedLoop::coilA) & 0x01FF01FF);
+# else
+#  error Cannot support closed loop with the specified hardware
+# endif
+}
+
 // Helper function to set the motor to a given phase and magnitude
 // The phase is normally in the range 0 to 4095 but when tuning it can be 0 to somewhat over 8192. We must take it modulo 4096 when computing the currents.
 void ClosedLoop::SetMotorPhase(uint16_t phase, float magnitude) noexcept
 {
 	float sine, cosine;
 	Trigonometry::FastSinCos(phase, sine, cosine);
-	coilA = (int16_t)lrintf(cosine * magnitude);
-	coilB = (int16_t)lrintf(sine * magnitude);
+	SetMotorCurrents(sine, cosine, magnitude);
+}
 
-# if SUPPORT_TMC2160 && SINGLE_DRIVER
-	SmartDrivers::SetRegister(0, SmartDriverRegister::xDirect, (((uint32_t)(uint16_t)coilB << 16) | (uint32_t)(uint16_t)coilA) & 0x01FF01FF);
-# else
-#  error Cannot support closed loop with the specified hardware
-# endif
+// As SetMotorPhase but the phase can have a fractional part, so that the coil currents change smoothly at low speeds
+void ClosedLoop::SetMotorPhaseInterpolated(float phase, float magnitude) noexcept
+{
+	float sine, cosine;
+	Trigonometry::FastSinCosInterpolated(phase, sine, cosine);
+	SetMotorCurrents(sine, cosine, magnitude);
 }
 
 static void GenerateTmcClock()
@@ -329,11 +504,8 @@ void ClosedLoop::Init() noexcept
 	// Initialise the monitoring variables
 	ResetMonitoringVariables();
 
-	derivativeFilter.Reset();
+	ResetVelocityEstimators();
 
-	// Set up the data transmission task
-	dataTransmissionTask = new Task<ClosedLoop::TaskStackWords>;
-	dataTransmissionTask->Create(DataTransmissionLoop, "CLSend", nullptr, TaskPriority::ClosedLoopDataTransmission);
 }
 
 GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const StringRef &reply) noexcept
@@ -374,7 +546,13 @@ GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const St
 		{
 			encoder->AppendStatus(reply);
 		}
-		reply.catf(", PID parameters P=%.3f I=%.3f D=%.3f, min. current %.1f%%", (double) Kp, (double) Ki, (double) Kd, (double)(holdCurrentFraction * 100.0));
+		reply.catf(", PID parameters P=%.3f I=%.3f D=%.3f, feed-forward V=%.4f A=%.6f, min. current %.1f%%",
+					(double) Kp, (double) Ki, (double) Kd, (double) Kv, (double) Ka, (double)(holdCurrentFraction * 100.0));
+		if (positionLoopDivider != 0)
+		{
+			reply.catf(", cascaded control: position P=%.3f every %u loops limit %.0f steps/sec, velocity P=%.4f I=%.4f I limit %.0f",
+						(double)Kpp, positionLoopDivider, (double)maxSpeedCorrection, (double)Kvp, (double)Kvi, (double)velocityIlimit);
+		}
 		return GCodeResult::ok;
 	}
 
@@ -403,6 +581,7 @@ GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const St
 		// Convert external units to internal units
 		encoderPulsePerStep = ExternalUnitsToPulsePerStep(tempCPR, tempEncoderType);
 		recipEncoderPulsesPerStep = 1.0/encoderPulsePerStep;
+		positionFixedPerCount = lrintf(recipEncoderPulsesPerStep * (float)(1ul << PositionFractionBits));
 	}
 
 	Kp = tempKp;
@@ -439,6 +618,10 @@ GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const St
 		}
 		else
 		{
+			if (encoder != nullptr)
+			{
+				encoder->Disable();							// so that the old encoder releases the SPI if it is reading it in the background
+			}
 			DeleteObject(encoder);
 			switch (tempEncoderType)
 			{
@@ -489,6 +672,22 @@ GCodeResult ClosedLoop::ProcessM569Point5(const CanMessageStartClosedLoopDataCol
 		return GCodeResult::error;
 	}
 
+	if (samplingMode == RecordingMode::Continuous)
+	{
+		samplingMode = RecordingMode::SendingData;				// stop streaming, the transmission task will send what is left in the buffer
+		dataTransmissionTask->Give();							// it may be waiting for a full message
+		reply.copy("Stopped streaming data");
+		return GCodeResult::ok;
+	}
+
+	if (samplingMode == RecordingMode::Triggered)
+	{
+		samplingMode = RecordingMode::SendingData;				// give up waiting for the trigger, the transmission task will send the history we have
+		dataTransmissionTask->Give();
+		reply.copy("Stopped waiting for the capture trigger");
+		return GCodeResult::ok;
+	}
+
 	if (CollectingData())
 	{
 		reply.copy("Driver is already collecting data");
@@ -502,12 +701,21 @@ GCodeResult ClosedLoop::ProcessM569Point5(const CanMessageStartClosedLoopDataCol
 	}
 	else
 	{
-		requestedMode = msg.mode + 1;							// the A parameter is out of step with the enumeration by 1
-		if (requestedMode != (uint8_t)RecordingMode::Immediate && requestedMode != (uint8_t)RecordingMode::OnNextMove)
+		requestedMode = (msg.mode == ContinuousModeParameter) ? (uint8_t)RecordingMode::Continuous
+						: (msg.mode == TriggeredModeParameter) ? (uint8_t)RecordingMode::Triggered
+							: msg.mode + 1;						// the A parameter is out of step with the enumeration by 1
+		if (   requestedMode != (uint8_t)RecordingMode::Immediate && requestedMode != (uint8_t)RecordingMode::OnNextMove
+			&& requestedMode != (uint8_t)RecordingMode::Continuous && requestedMode != (uint8_t)RecordingMode::Triggered
+		   )
 		{
 			reply.copy("Invalid recording mode");
 			return GCodeResult::error;
 		}
+		if (requestedMode == (uint8_t)RecordingMode::Triggered && captureTrigger == CaptureTrigger::none)
+		{
+			reply.copy("No capture trigger has been configured");
+			return GCodeResult::error;
+		}
 	}
 
 	if (msg.movement != 0 && tuning != 0)
@@ -516,10 +724,35 @@ GCodeResult ClosedLoop::ProcessM569Point5(const CanMessageStartClosedLoopDataCol
 		return GCodeResult::error;
 	}
 
-	// Calculate how many samples will fit in the buffer
+	// Boards that never collect data don't need the sample buffer or the task that sends it, so leave their RAM free for the DDA ring until now
+	if (sampleBuffer == nullptr)
+	{
+		if (!Tasks::CanAllocate(DataBufferSize * sizeof(uint16_t)))
+		{
+			reply.printf("Not enough free RAM for the %u byte data collection buffer", DataBufferSize * sizeof(uint16_t));
+			return GCodeResult::error;
+		}
+		sampleBuffer = new uint16_t[DataBufferSize];
+		dataTransmissionTask = new Task<ClosedLoopTaskStackWords>;
+		dataTransmissionTask->Create(DataTransmissionLoop, "CLSend", nullptr, TaskPriority::ClosedLoopDataTransmission);
+	}
+
+	// Calculate how many samples will fit in the buffer. If they don't all fit then we may overflow it, so store the variables that allow it in packed form.
 	variableCount = CountVariablesCollected(msg.filter);
-	const unsigned int samplesPerBuffer =  ARRAY_SIZE(sampleBuffer) / variableCount;
-	sampleBufferLimit = samplesPerBuffer * variableCount;		// wrap the read/write pointers round when they reach this value
+	sampleSize = GetSampleSize(msg.filter, false);
+	packedSamples = (requestedMode == (uint8_t)RecordingMode::Continuous || msg.numSamples > DataBufferSize / sampleSize);
+	if (packedSamples)
+	{
+		sampleSize = GetSampleSize(msg.filter, true);
+	}
+	samplesPerMessage = CanMessageClosedLoopData::MaxDataItems / variableCount;
+	const unsigned int samplesPerBuffer = ((DataBufferSize / sampleSize) / samplesPerMessage) * samplesPerMessage;
+	sampleBufferLimit = samplesPerBuffer * sampleSize;			// wrap the read/write pointers round when they reach this value
+	if (requestedMode == (uint8_t)RecordingMode::Triggered && (preTriggerSamples >= msg.numSamples || preTriggerSamples >= samplesPerBuffer))
+	{
+		reply.printf("Too many pre-trigger samples, the limit is %u", min<unsigned int>(msg.numSamples, samplesPerBuffer) - 1);
+		return GCodeResult::error;
+	}
 
 	// Set up the recording vars
 	sampleBufferWritePointer = sampleBufferReadPointer = 0;
@@ -568,6 +801,17 @@ GCodeResult ClosedLoop::ProcessM569Point6(const CanMessageGeneric &msg, const St
 						offsetCorrectionMade, finalRawEncoderReading, finalMeasuredStepPhase, (double)finalCurrentMotorSteps);
 #endif
 			reply.catf("Driver %u.0 tuned successfully, measured hysteresis %.2f step", CanInterface::GetCanAddress(), (double)tuningHysteresis);
+			if (Kv != 0.0 || Ka != 0.0)
+			{
+				reply.catf(", feed-forward V=%.4f A=%.6f", (double)Kv, (double)Ka);
+			}
+			if (ultimateGain != 0.0)
+			{
+				// Report the Ziegler-Nichols PID parameters but don't apply them, because the user may prefer a less aggressive tune
+				reply.lcatf("Ultimate gain %.2f period %.4fs, suggested PID parameters P=%.3f I=%.3f D=%.4f",
+							(double)ultimateGain, (double)oscillationPeriod,
+							(double)(0.6 * ultimateGain), (double)(1.2 * ultimateGain/oscillationPeriod), (double)(0.075 * ultimateGain * oscillationPeriod));
+			}
 			if (tuningHysteresis <= MaxSafeHysteresis)
 			{
 				return GCodeResult::ok;
@@ -624,6 +868,11 @@ void ClosedLoop::StartTuning(uint8_t tuningMode) noexcept
 		{
 			tuningMode |= BASIC_TUNING_MANOEUVRE;				// always run basic tuning before encoder calibration
 		}
+		if (tuningMode & ZIEGLER_NICHOLS_MANOEUVRE)
+		{
+			ultimateGain = oscillationPeriod = 0.0;				// so that we only report the suggested PID parameters if this tune measured them
+		}
+		relayAmplitude = 0.0;									// in case an earlier relay tune didn't finish
 		tuning = tuningMode;
 	}
 }
@@ -633,12 +882,13 @@ void ClosedLoop::SetForwardPolarity() noexcept
 	reversePolarityMultiplier = 1;
 }
 
-void ClosedLoop::SaveBasicTuningResult(float slope, float origin, float xMean, bool reverse) noexcept
+void ClosedLoop::SaveBasicTuningResult(float slope, float origin, float xMean, unsigned int numSamples, bool reverse) noexcept
 {
 	TuningResults& r = (reverse) ? reverseTuningResults : forwardTuningResults;
 	r.slope = slope;
 	r.origin = origin;
 	r.xMean = xMean;
+	r.numSamples = numSamples;
 }
 
 // Call this when we have stopped basic tuning movement and are ready to switch to closed loop control
@@ -700,6 +950,39 @@ void ClosedLoop::FinishedBasicTuning() noexcept
 	tuningError &= ~TUNE_ERR_NOT_DONE_BASIC;
 }
 
+// This is called by tuning to find out how hard the controller is having to work
+float ClosedLoop::GetControlSignal() noexcept
+{
+	return PIDControlSignal;
+}
+
+// This is called by tuning to set the feed-forward constants it has measured
+void ClosedLoop::SetFeedForward(float kv, float ka) noexcept
+{
+	Kv = kv;
+	Ka = ka;
+}
+
+// This is called by tuning to find out how far the motor is from the target
+float ClosedLoop::GetCurrentError() noexcept
+{
+	return currentError;
+}
+
+// This is called by tuning to replace the PID controller by a relay, or to restore it
+void ClosedLoop::SetRelayAmplitude(float amplitude) noexcept
+{
+	relayAmplitude = amplitude;
+	PIDITerm = 0.0;
+}
+
+// This is called by tuning to set the ultimate gain and period it has measured
+void ClosedLoop::SetUltimateGain(float ku, float tu) noexcept
+{
+	ultimateGain = ku;
+	oscillationPeriod = tu;
+}
+
 // This is called by tuning to execute a step
 void ClosedLoop::AdjustTargetMotorSteps(float amount) noexcept
 {
@@ -718,9 +1001,54 @@ void ClosedLoop::ControlLoop() noexcept
 	// Read the current state of the drive
 	ReadState();
 
+	// Move the target position by however far the movement system says the motor should have moved since we last ran.
+	// In closed loop mode the step ISR doesn't call TakeStep, and for most moves it doesn't generate any step interrupts at all.
+	MotionParameters mParams;
+	moveInstance->GetCurrentMotion(mParams);
+	const float directionMultiplier = (Platform::GetDirectionPinLevel(true)) ? -1.0 : 1.0;		// same sign convention as TakeStep
+	const float positionChange = mParams.position - lastMotionPosition;
+	lastMotionPosition = mParams.position;
+	targetSpeed = mParams.speed * directionMultiplier;
+	targetAcceleration = mParams.acceleration * directionMultiplier;
+	if (closedLoopEnabled && positionChange != 0.0)
+	{
+		targetMotorSteps += positionChange * directionMultiplier;
+		targetEncoderReading = lrintf(targetMotorSteps * encoderPulsePerStep);
+		if (samplingMode == RecordingMode::OnNextMove)
+		{
+			dataCollectionStartTicks = whenNextSampleDue = loopCallTime;
+			samplingMode = RecordingMode::Immediate;
+		}
+	}
+
 	// Calculate and store the current error
-	currentError = (float)(targetEncoderReading - currentEncoderReading) * recipEncoderPulsesPerStep;
-	derivativeFilter.ProcessReading(currentError, loopCallTime);
+	currentError = (float)((int64_t)targetEncoderReading * positionFixedPerCount - currentPositionFixed) * PositionFixedToSteps;
+	switch (velocityEstimator)
+	{
+	case VelocityEstimator::errorAveraging:
+	default:
+		derivativeFilter.ProcessReading(currentError, loopCallTime);
+		break;
+
+	case VelocityEstimator::fixedPoint:
+		fixedPointFilter.ProcessReading(currentEncoderReading, loopCallTime);
+		break;
+
+	case VelocityEstimator::alphaBeta:
+		alphaBetaObserver.ProcessReading(currentEncoderReading, loopCallTime);
+		break;
+
+	case VelocityEstimator::edgeTiming:
+		edgeTimingEstimator.ProcessReading(currentEncoderReading, loopCallTime);
+		break;
+	}
+
+	// Look for a stall or pre-stall, and work out the error that the controller should act on
+	CheckForStall(loopCallTime);
+	if (samplingMode == RecordingMode::Triggered)
+	{
+		CheckCaptureTrigger();
+	}
 
 	if (!closedLoopEnabled)
 	{
@@ -736,9 +1064,18 @@ void ClosedLoop::ControlLoop() noexcept
 			PerformTune();
 			if (tuning == 0)
 			{
+				relayAmplitude = 0.0;								// restore the PID controller even if relay tuning ended with an error
 				Platform::DriveEnableOverride(0, false);			// If that was the last tuning move, release the override
 			}
 		}
+		// PerformTune runs the manoeuvres in priority order, so feedforward or Ziegler-Nichols tuning is running if its bit is set and none of the earlier ones are
+		if (   (tuning & (BASIC_TUNING_MANOEUVRE | ENCODER_CALIBRATION_MANOEUVRE | STEP_MANOEUVRE)) == 0
+			&& (tuning & (FEEDFORWARD_TUNING_MANOEUVRE | ZIEGLER_NICHOLS_MANOEUVRE)) != 0
+			&& (tuningError & TUNE_ERR_NOT_DONE_BASIC) == 0
+		   )
+		{
+			ControlMotorCurrents(loopCallTime);						// these manoeuvres measure how the motor responds to the controller, so keep controlling the motor
+		}
 		else if (samplingMode == RecordingMode::OnNextMove && timeSinceLastTuningStep + (int32_t)DataCollectionIdleStepTicks >= 0)
 		{
 			dataCollectionStartTicks = whenNextSampleDue = loopCallTime;
@@ -754,17 +1091,8 @@ void ClosedLoop::ControlLoop() noexcept
 		ControlMotorCurrents(loopCallTime);							// otherwise control those motor currents!
 	}
 
-	// Look for a stall or pre-stall
-	preStall = errorThresholds[0] > 0 && fabsf(currentError) > errorThresholds[0];
-	const bool alreadyStalled = stall;
-	stall 	 = errorThresholds[1] > 0 && fabsf(currentError) > errorThresholds[1];
-	if (stall && !alreadyStalled)
-	{
-		Platform::NewDriverFault();
-	}
-
 	// Collect a sample, if we need to
-	if (samplingMode == RecordingMode::Immediate && (int32_t)(loopCallTime - whenNextSampleDue) >= 0)
+	if ((TakingSamples() || samplingMode == RecordingMode::Triggered) && (int32_t)(loopCallTime - whenNextSampleDue) >= 0)
 	{
 		// It's time to take a sample
 		CollectSample();
@@ -776,6 +1104,12 @@ void ClosedLoop::ControlLoop() noexcept
 	const StepTimer::Ticks loopRuntime = StepTimer::GetTimerTicks() - loopCallTime;
 	minControlLoopRuntime = min<StepTimer::Ticks>(minControlLoopRuntime, loopRuntime);
 	maxControlLoopRuntime = max<StepTimer::Ticks>(maxControlLoopRuntime, loopRuntime);
+
+	// Start reading the encoder for the next iteration, so that we don't have to wait for the SPI transfers then
+	if (encoder != nullptr)
+	{
+		encoder->StartNextReading();
+	}
 }
 
 // Send data from the buffer to the main board over CAN
@@ -784,13 +1118,14 @@ void ClosedLoop::ControlLoop() noexcept
 	while (true)
 	{
 		RecordingMode locMode;										// to capture the volatile variable
-		if ((locMode = samplingMode) == RecordingMode::Immediate || locMode == RecordingMode::SendingData)
+		if ((locMode = samplingMode) == RecordingMode::Immediate || locMode == RecordingMode::SendingData || locMode == RecordingMode::Continuous)
 		{
 			// Started a new data collection
 			samplesSent = 0;
 
 			// Loop until everything has been read. Stop when either we have sent the requested number of samples, or the state is SendingData and we have sent all the data in the buffer.
 			// Note, this may mean that the last packet contains no data and has the "last" flag set.
+			// When streaming continuously the sample numbers wrap round, so compare them only for equality.
 			bool finished;
 			do
 			{
@@ -803,39 +1138,75 @@ void ClosedLoop::ControlLoop() noexcept
 				msg.filter = filterRequested;
 				msg.zero = msg.zero2 = 0;
 
-				unsigned int numCopied = 0;
-				unsigned int numSamplesInMessage = 0;
-				size_t copyReadPointer = sampleBufferReadPointer;	// capture volatile variable
-				do
+				// Wait until there is a whole message of samples to send, or collection has stopped. CollectSample wakes us only when one of these is true.
+				while ((uint16_t)(samplesCollected - samplesSent) < samplesPerMessage && TakingSamples())
 				{
-					while (samplesSent == samplesCollected && samplingMode == RecordingMode::Immediate)
-					{
-						TaskBase::Take();							// wait for data to be available
-					}
+					TaskBase::Take();
+				}
 
-					if (samplesSent < samplesCollected)
+				const unsigned int numSamplesInMessage = min<unsigned int>((uint16_t)(samplesCollected - samplesSent), samplesPerMessage);
+				size_t copyReadPointer = sampleBufferReadPointer;	// capture volatile variable
+				if (packedSamples)
+				{
+					// The message format requires each variable as a float, so unpack any variables that were stored in fixed point
+					unsigned int numCopied = 0;
+					for (unsigned int i = 0; i < numSamplesInMessage; ++i)
 					{
-						memcpy(msg.data + numCopied, sampleBuffer + copyReadPointer, variableCount * sizeof(float));
-						numCopied += variableCount;
-						copyReadPointer += variableCount;
+						memcpy(msg.data + numCopied++, sampleBuffer + copyReadPointer, sizeof(float));
+						copyReadPointer += 2;
+						for (const RecordedVariable& v : RecordedVariables)
+						{
+							if (filterRequested & v.flag)
+							{
+								if (v.packedScale != 0.0)
+								{
+									msg.data[numCopied++] = (float)(int16_t)sampleBuffer[copyReadPointer++] / v.packedScale;
+								}
+								else
+								{
+									memcpy(msg.data + numCopied++, sampleBuffer + copyReadPointer, sizeof(float));
+									copyReadPointer += 2;
+								}
+							}
+						}
 						if (copyReadPointer >= sampleBufferLimit)
 						{
 							copyReadPointer = 0;
 						}
-						++samplesSent;								// update this one first to avoid a race condition
-						sampleBufferReadPointer = copyReadPointer;	// now it's safe to update this one
-						++numSamplesInMessage;
 					}
-					finished = (samplingMode != RecordingMode::Immediate && samplesSent == samplesCollected);
-				} while (!finished && numCopied + variableCount <= CanMessageClosedLoopData::MaxDataItems);
+				}
+				else
+				{
+					// Unpacked samples are stored just as the message needs them, so copy them in one block, or two if they wrap round the end of the buffer
+					const size_t numEntries = numSamplesInMessage * sampleSize;
+					const size_t numBeforeWrap = min<size_t>(numEntries, sampleBufferLimit - copyReadPointer);
+					memcpy(msg.data, sampleBuffer + copyReadPointer, numBeforeWrap * sizeof(uint16_t));
+					memcpy(reinterpret_cast<uint16_t*>(msg.data) + numBeforeWrap, sampleBuffer, (numEntries - numBeforeWrap) * sizeof(uint16_t));
+					copyReadPointer = (numBeforeWrap < numEntries) ? numEntries - numBeforeWrap
+										: (copyReadPointer + numEntries >= sampleBufferLimit) ? 0
+											: copyReadPointer + numEntries;
+				}
+				samplesSent += numSamplesInMessage;					// update this one first to avoid a race condition
+				sampleBufferReadPointer = copyReadPointer;			// now it's safe to update this one
+				finished = (!TakingSamples() && samplesSent == samplesCollected);
 
 				msg.numSamples = numSamplesInMessage;
 				msg.lastPacket = finished;
 				msg.overflowed = sampleBufferOverflowed;
 
+				if (samplingMode == RecordingMode::Continuous)
+				{
+					// Streaming is low priority, so don't send it until there is room in the CAN send queue. If the buffer fills up meanwhile, samples are dropped.
+					sampleBufferOverflowed = false;					// the flag marks the messages that follow dropped samples
+					while (CanInterface::GetNumFreeQueuedSends() < MinFreeQueuedSendsForStreaming && samplingMode == RecordingMode::Continuous)
+					{
+						delay(StreamingBackoffMillis);
+					}
+				}
+
 				// Send the CAN message
 				buf.dataLength = msg.GetActualDataLength();
-				CanInterface::Send(&buf);
+				CanInterface::SendQueued(buf);
 			} while (!finished);
 			samplingMode = RecordingMode::None;
 		}
@@ -846,42 +1217,149 @@ void ClosedLoop::ControlLoop() noexcept
 	}
 }
 
+// Store a float in the sample buffer
+static inline void StoreFloat(size_t& wp, float val) noexcept
+{
+	memcpy(ClosedLoop::sampleBuffer + wp, &val, sizeof(float));
+	wp += 2;
+}
+
+// Store a variable in the sample buffer, in 16-bit fixed point if we are packing samples
+static inline void StoreVariable(size_t& wp, float val, float packedScale) noexcept
+{
+	if (ClosedLoop::packedSamples)
+	{
+		ClosedLoop::sampleBuffer[wp++] = (uint16_t)(int16_t)constrain<int32_t>(lrintf(val * packedScale), -32768, 32767);
+	}
+	else
+	{
+		StoreFloat(wp, val);
+	}
+}
+
 // Store a sample in the buffer
 void ClosedLoop::CollectSample() noexcept
 {
 	size_t wp = sampleBufferWritePointer;						// capture volatile variable and don't update it until all data has been written
+	if (samplingMode == RecordingMode::Triggered && samplesCollected == preTriggerSamples)
+	{
+		// The pre-trigger history is full, so discard the oldest sample. Nothing is sent until the trigger fires, so we own the read pointer.
+		if (preTriggerSamples == 0)
+		{
+			return;
+		}
+		const size_t rp = sampleBufferReadPointer + sampleSize;
+		sampleBufferReadPointer = (rp >= sampleBufferLimit) ? 0 : rp;
+		--samplesCollected;
+	}
+
 	if (wp == sampleBufferReadPointer && samplesSent != samplesCollected)
 	{
 		sampleBufferOverflowed = true;							// the buffer is full so tell the sending task about it
-		samplingMode = RecordingMode::SendingData;				// stop collecting data
+		if (samplingMode != RecordingMode::Continuous)			// if we are streaming then just drop this sample
+		{
+			samplingMode = RecordingMode::SendingData;			// stop collecting data
+		}
 	}
 	else
 	{
-		sampleBuffer[wp++] = TickPeriodToTimePeriod(StepTimer::GetTimerTicks() - dataCollectionStartTicks);		// always collect this
-
-		if (filterRequested & CL_RECORD_RAW_ENCODER_READING) 	{sampleBuffer[wp++] = (float)currentEncoderReading;}
-		if (filterRequested & CL_RECORD_CURRENT_MOTOR_STEPS) 	{sampleBuffer[wp++] = currentMotorSteps;}
-		if (filterRequested & CL_RECORD_TARGET_MOTOR_STEPS)  	{sampleBuffer[wp++] = targetMotorSteps;}
-		if (filterRequested & CL_RECORD_CURRENT_ERROR) 			{sampleBuffer[wp++] = currentError;}
-		if (filterRequested & CL_RECORD_PID_CONTROL_SIGNAL)  	{sampleBuffer[wp++] = PIDControlSignal;}
-		if (filterRequested & CL_RECORD_PID_P_TERM)  			{sampleBuffer[wp++] = PIDPTerm;}
-		if (filterRequested & CL_RECORD_PID_I_TERM)  			{sampleBuffer[wp++] = PIDITerm;}
-		if (filterRequested & CL_RECORD_PID_D_TERM)  			{sampleBuffer[wp++] = PIDDTerm;}
-		if (filterRequested & CL_RECORD_STEP_PHASE)  			{sampleBuffer[wp++] = (float)measuredStepPhase;}
-		if (filterRequested & CL_RECORD_DESIRED_STEP_PHASE)  	{sampleBuffer[wp++] = (float)desiredStepPhase;}
-		if (filterRequested & CL_RECORD_PHASE_SHIFT)  			{sampleBuffer[wp++] = phaseShift;}
-		if (filterRequested & CL_RECORD_COIL_A_CURRENT) 		{sampleBuffer[wp++] = (float)coilA;}
-		if (filterRequested & CL_RECORD_COIL_B_CURRENT) 		{sampleBuffer[wp++] = (float)coilB;}
+		StoreFloat(wp, TickPeriodToTimePeriod(StepTimer::GetTimerTicks() - dataCollectionStartTicks));		// always collect this
+
+		// This must store the variables in the same order as in RecordedVariables
+		if (filterRequested & CL_RECORD_RAW_ENCODER_READING) 	{StoreFloat(wp, (float)currentEncoderReading);}
+		if (filterRequested & CL_RECORD_CURRENT_MOTOR_STEPS) 	{StoreFloat(wp, currentMotorSteps);}
+		if (filterRequested & CL_RECORD_TARGET_MOTOR_STEPS)  	{StoreFloat(wp, targetMotorSteps);}
+		if (filterRequested & CL_RECORD_CURRENT_ERROR) 			{StoreVariable(wp, currentError, PackedErrorScale);}
+		if (filterRequested & CL_RECORD_PID_CONTROL_SIGNAL)  	{StoreVariable(wp, PIDControlSignal, PackedControlSignalScale);}
+		if (filterRequested & CL_RECORD_PID_P_TERM)  			{StoreVariable(wp, PIDPTerm, PackedControlSignalScale);}
+		if (filterRequested & CL_RECORD_PID_I_TERM)  			{StoreVariable(wp, PIDITerm, PackedControlSignalScale);}
+		if (filterRequested & CL_RECORD_PID_D_TERM)  			{StoreVariable(wp, PIDDTerm, PackedControlSignalScale);}
+		if (filterRequested & CL_RECORD_STEP_PHASE)  			{StoreVariable(wp, (float)measuredStepPhase, PackedIntegerScale);}
+		if (filterRequested & CL_RECORD_DESIRED_STEP_PHASE)  	{StoreVariable(wp, (float)desiredStepPhase, PackedIntegerScale);}
+		if (filterRequested & CL_RECORD_PHASE_SHIFT)  			{StoreVariable(wp, phaseShift, PackedPhaseShiftScale);}
+		if (filterRequested & CL_RECORD_COIL_A_CURRENT) 		{StoreVariable(wp, (float)coilA, PackedIntegerScale);}
+		if (filterRequested & CL_RECORD_COIL_B_CURRENT) 		{StoreVariable(wp, (float)coilB, PackedIntegerScale);}
 
 		sampleBufferWritePointer = (wp >= sampleBufferLimit) ? 0 : wp;
 		++samplesCollected;
-		if (samplesCollected == samplesRequested)
+		if (samplesCollected == samplesRequested && samplingMode != RecordingMode::Continuous)
 		{
 			samplingMode = RecordingMode::SendingData;			// stop collecting data
 		}
 	}
 
-	dataTransmissionTask->Give();
+	// Wake the transmission task only when it has a whole message to send or collection has stopped, to save task switches during fast captures.
+	// There is nothing to send until the trigger fires.
+	if (!TakingSamples() ? samplingMode != RecordingMode::Triggered : (uint16_t)(samplesCollected - samplesSent) >= samplesPerMessage)
+	{
+		dataTransmissionTask->Give();
+	}
+}
+
+// Check whether the capture trigger has fired, and if so start collecting the samples that follow it. The pre-trigger history is already in the buffer.
+void ClosedLoop::CheckCaptureTrigger() noexcept
+{
+	bool fired;
+	switch (captureTrigger)
+	{
+	case CaptureTrigger::error:			fired = fabsf(currentError) > captureErrorThreshold; break;
+	case CaptureTrigger::stall:			fired = stall; break;
+	case CaptureTrigger::preStall:		fired = preStall; break;
+	case CaptureTrigger::moveNumber:	fired = moveInstance->GetCompletedMoves() >= captureMoveNumber; break;
+	default:							fired = false; break;
+	}
+
+	if (fired)
+	{
+		samplingMode = RecordingMode::Immediate;
+		dataTransmissionTask->Give();
+	}
+}
+
+// Configure the condition that fires the trigger in triggered data collection mode (M569.5 A3), and how many samples from before the trigger to keep.
+// The parameter is the error threshold in 1/1000 full steps for the error trigger, or the completed move count for the move number trigger.
+GCodeResult ClosedLoop::ConfigureCaptureTrigger(unsigned int trigger, uint32_t param, uint32_t numPreTriggerSamples, const StringRef& reply) noexcept
+{
+	if (trigger >= ARRAY_SIZE(CaptureTriggerNames))
+	{
+		reply.copy("Invalid capture trigger");
+		return GCodeResult::error;
+	}
+	if (samplingMode == RecordingMode::Triggered)
+	{
+		reply.copy("Cannot change the capture trigger while waiting for it");
+		return GCodeResult::error;
+	}
+	if (numPreTriggerSamples > DataBufferSize/4)
+	{
+		reply.printf("Too many pre-trigger samples, the limit is %u", (unsigned int)(DataBufferSize/4));
+		return GCodeResult::error;
+	}
+
+	captureTrigger = (CaptureTrigger)trigger;
+	captureErrorThreshold = (float)param * 0.001;
+	captureMoveNumber = param;
+	preTriggerSamples = (uint16_t)numPreTriggerSamples;
+
+	reply.printf("Capture trigger %s", CaptureTriggerNames[trigger]);
+	switch (captureTrigger)
+	{
+	case CaptureTrigger::none:
+		return GCodeResult::ok;
+
+	case CaptureTrigger::error:
+		reply.catf(" above %.3f steps", (double)captureErrorThreshold);
+		break;
+
+	case CaptureTrigger::moveNumber:
+		reply.catf(" %" PRIu32 " (%" PRIu32 " moves completed so far)", captureMoveNumber, moveInstance->GetCompletedMoves());
+		break;
+
+	default:
+		break;
+	}
+	reply.catf(", keeping %u samples from before the trigger", preTriggerSamples);
+	return GCodeResult::ok;
 }
 
 void ClosedLoop::ReadState() noexcept
@@ -890,11 +1368,102 @@ void ClosedLoop::ReadState() noexcept
 
 	// Calculate the current position & phase from the encoder reading
 	currentEncoderReading = encoder->GetReading() * reversePolarityMultiplier;
-	currentMotorSteps = (float)currentEncoderReading / encoderPulsePerStep;
 
-	// Calculate stepPhase - a 0-4095 value representing the phase *within* the current 4 full steps
-	const float tmp = currentMotorSteps * 0.25;
-	measuredStepPhase = (uint16_t)((tmp - floorf(tmp)) * 4095.9);
+	// Convert the reading to a fixed point number of full steps. The position, the step phase and the error are all derived from this, which avoids a division and floorf calls.
+	currentPositionFixed = (int64_t)currentEncoderReading * positionFixedPerCount;
+
+	// If the encoder can interpolate between counts then use the interpolated position, because at low speeds a quadrature encoder changes count less often than we run
+	float fraction, countsPerSecond;
+	encoderSpeedValid = encoder->GetSubCountPosition(fraction, countsPerSecond);
+	if (encoderSpeedValid)
+	{
+		encoderCountsPerSecond = countsPerSecond * reversePolarityMultiplier;
+		currentPositionFixed += lrintf(fraction * (float)(reversePolarityMultiplier * positionFixedPerCount));
+	}
+
+	// Split the position into whole full steps and the fraction, then calculate stepPhase - a 0-4095 value representing the phase *within* the current 4 full steps
+	const int32_t wholeSteps = (int32_t)(currentPositionFixed >> PositionFractionBits);		// this rounds towards minus infinity
+	const uint32_t fractionFixed = (uint32_t)currentPositionFixed & ((1ul << PositionFractionBits) - 1);
+	currentMotorSteps = (float)wholeSteps + (float)fractionFixed * PositionFixedToSteps;
+	const uint32_t phaseFixed = (((uint32_t)wholeSteps & 3u) << PositionFractionBits) | fractionFixed;		// the phase with PhaseFractionBits fraction bits
+	measuredStepPhase = (uint16_t)(phaseFixed >> PhaseFractionBits);
+	measuredStepPhaseFine = (float)phaseFixed * (1.0/(float)(1ul << PhaseFractionBits));
+}
+
+// Look for a stall or pre-stall and set up controlError.
+// A stall is normally handled by the main board, but it can't react until a CAN round trip later and most stalls are transient. So if stall recovery is enabled,
+// when the error first exceeds the stall threshold we limit the error that the controller sees, apply full current, and move the target that the controller is working towards
+// back to the real target with limited acceleration. We report the stall only if the motor hasn't caught up by the time limit.
+void ClosedLoop::CheckForStall(StepTimer::Ticks loopCallTime) noexcept
+{
+	preStall = errorThresholds[0] > 0 && fabsf(currentError) > errorThresholds[0];
+	const bool alreadyStalled = stall;
+	const bool stallDetected = errorThresholds[1] > 0 && fabsf(currentError) > errorThresholds[1];
+	const bool canRecover = stallRecoveryTicks != 0 && closedLoopEnabled && tuning == 0 && tuningError == 0;
+
+	if (!recoveringFromStall)
+	{
+		if (stallDetected && !alreadyStalled && canRecover)
+		{
+			recoveringFromStall = true;
+			whenStallRecoveryStarted = loopCallTime;
+			recoveryLag = recoverySpeed = 0.0;
+			recoveryCurrentFraction = holdCurrentFraction;
+			++numStallRecoveries;
+		}
+	}
+	else if (!canRecover)
+	{
+		recoveringFromStall = false;
+	}
+
+	if (recoveringFromStall)
+	{
+		// Reduce the lag at a speed that accelerates at the configured rate, but no faster than we can decelerate from before it reaches zero
+		const float timeDelta = (float)(loopCallTime - prevControlLoopCallTime) * (1.0/(float)StepTimer::StepClockRate);
+		const float absLag = fabsf(recoveryLag);
+		recoverySpeed = min<float>(recoverySpeed + stallRecoveryAcceleration * timeDelta, sqrtf(2.0 * stallRecoveryAcceleration * absLag));
+		const float newAbsLag = max<float>(absLag - recoverySpeed * timeDelta, 0.0);
+		recoveryLag = (recoveryLag >= 0.0) ? newAbsLag : -newAbsLag;
+		recoveryCurrentFraction = min<float>(recoveryCurrentFraction + timeDelta * (1.0/StallRecoveryCurrentRampTime), 1.0);
+
+		// If the motor has fallen further behind, hold the controller's target at the edge of the envelope
+		const float envelope = errorThresholds[1] * StallRecoveryEnvelopeFraction;
+		controlError = currentError - recoveryLag;
+		if (fabsf(controlError) > envelope)
+		{
+			controlError = (controlError >= 0.0) ? envelope : -envelope;
+			recoveryLag = currentError - controlError;
+			recoverySpeed = 0.0;
+		}
+
+		if (recoveryLag == 0.0)
+		{
+			recoveringFromStall = false;								// we have caught up with the real target
+			stall = false;
+		}
+		else if (loopCallTime - whenStallRecoveryStarted >= stallRecoveryTicks)
+		{
+			recoveringFromStall = false;								// we failed to catch up in time, so report the stall
+			controlError = currentError;
+			stall = true;
+			++numFailedStallRecoveries;
+		}
+		else
+		{
+			stall = false;
+		}
+	}
+	else
+	{
+		controlError = currentError;
+		stall = stallDetected;
+	}
+
+	if (stall && !alreadyStalled)
+	{
+		Platform::NewDriverFault();
+	}
 }
 
 void ClosedLoop::ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept
@@ -902,12 +1471,35 @@ void ClosedLoop::ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept
 	// Get the time delta in seconds
 	const float timeDelta = (float)(loopStartTime - prevControlLoopCallTime) * (1.0/(float)StepTimer::StepClockRate);
 
-	// Use a PID controller to calculate the required 'torque' - the control signal
-	// We choose to use a PID control signal in the range -256 to +256. This is rather arbitrary.
-	PIDPTerm = Kp * currentError;
-	PIDITerm = constrain<float>(PIDITerm + Ki * currentError * timeDelta, -PIDIlimit, PIDIlimit);	// constrain I to prevent it running away
-	PIDDTerm = constrain<float>(Kd * derivativeFilter.GetDerivative(), -256.0, 256.0);		// constrain D so that we can graph it more sensibly after a sudden step input
-	PIDControlSignal = constrain<float>(PIDPTerm + PIDITerm + PIDDTerm, -256.0, 256.0);		// clamp the sum between +/- 256
+	feedForwardTerm = Kv * targetSpeed + Ka * targetAcceleration;							// provide the torque needed to follow the move, so that it doesn't have to come from the error
+	if (positionLoopDivider != 0 && relayAmplitude == 0.0)
+	{
+		// Cascaded control. The position loop runs at a lower rate and asks for the target speed plus a correction proportional to the error.
+		// The velocity loop runs every time and works on the difference between that and the speed measured by the selected velocity estimator.
+		// We store its terms in the PID P and I terms so that they can be recorded.
+		if (positionLoopCountdown == 0)
+		{
+			positionLoopCountdown = positionLoopDivider;
+			speedDemand = targetSpeed + constrain<float>(Kpp * controlError, -maxSpeedCorrection, maxSpeedCorrection);
+		}
+		--positionLoopCountdown;
+		const float speedError = speedDemand - targetSpeed + GetErrorDerivative();		// the derivative of the error is the target speed less the measured speed
+		PIDPTerm = Kvp * speedError;
+		PIDITerm = constrain<float>(PIDITerm + Kvi * speedError * timeDelta, -velocityIlimit, velocityIlimit);
+		PIDDTerm = 0.0;
+		PIDControlSignal = constrain<float>(PIDPTerm + PIDITerm + feedForwardTerm, -256.0, 256.0);
+	}
+	else
+	{
+		// Use a PID controller to calculate the required 'torque' - the control signal
+		// We choose to use a PID control signal in the range -256 to +256. This is rather arbitrary.
+		PIDPTerm = Kp * controlError;
+		PIDITerm = constrain<float>(PIDITerm + Ki * controlError * timeDelta, -PIDIlimit, PIDIlimit);	// constrain I to prevent it running away
+		PIDDTerm = constrain<float>(Kd * GetErrorDerivative(), -256.0, 256.0);		// constrain D so that we can graph it more sensibly after a sudden step input
+		PIDControlSignal = (relayAmplitude != 0.0)
+							? ((controlError >= 0.0) ? relayAmplitude : -relayAmplitude)								// relay feedback tuning is in progress
+								: constrain<float>(PIDPTerm + PIDITerm + PIDDTerm + feedForwardTerm, -256.0, 256.0);		// clamp the sum between +/- 256
+	}
 
 	// Calculate the offset required to produce the torque in the correct direction
 	// i.e. if we are moving in the positive direction, we must apply currents with a positive phase shift
@@ -940,12 +1532,20 @@ void ClosedLoop::ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept
 		phaseShift *= recipHoldCurrentFraction;
 	}
 
+	// When recovering from a stall, ramp up the current to help the motor catch up
+	if (recoveringFromStall && currentFraction < recoveryCurrentFraction)
+	{
+		currentFraction = recoveryCurrentFraction;
+	}
+
 	// Calculate the required motor currents to induce that torque and reduce it module 4096
 	// The following assumes that signed arithmetic is 2's complement
-	desiredStepPhase = (uint16_t)((int32_t)measuredStepPhase + lrintf(phaseShift)) % 4096;
+	// Use the interpolated phase so that the currents aren't quantised to 4096 values per 4 full steps, which matters at low speeds with high resolution encoders
+	const float desiredStepPhaseFine = measuredStepPhaseFine + phaseShift;
+	desiredStepPhase = (uint16_t)((int32_t)lrintf(desiredStepPhaseFine) & 4095);
 
 	// Assert the required motor currents
-	SetMotorPhase(desiredStepPhase, currentFraction);
+	SetMotorPhaseInterpolated(desiredStepPhaseFine, currentFraction);
 }
 
 void ClosedLoop::Diagnostics(const StringRef& reply) noexcept
@@ -967,12 +1567,14 @@ void ClosedLoop::Diagnostics(const StringRef& reply) noexcept
 		reply.catf(", collecting data: %s", CollectingData() ? "yes" : "no");
 		if (CollectingData())
 		{
-			reply.catf(" (filter: %#x, mode: %u, rate: %u, movement: %u)", filterRequested, samplingMode, (unsigned int)(StepTimer::StepClockRate/dataCollectionIntervalTicks), movementRequested);
+			reply.catf(" (filter: %#x, mode: %u, rate: %u, movement: %u%s)", filterRequested, samplingMode, (unsigned int)(StepTimer::StepClockRate/dataCollectionIntervalTicks), movementRequested,
+						(packedSamples) ? ", packed" : "");
 		}
 
 #if 0	// DC disabled this because it doesn't work yet and the driver diagnostics were too long for the reply buffer
 		reply.catf(", ultimateGain=%f, oscillationPeriod=%f", (double) ultimateGain, (double) oscillationPeriod);
 #endif
+		reply.lcatf("Stall recoveries %" PRIu32 ", failed %" PRIu32, numStallRecoveries, numFailedStallRecoveries);
 		reply.lcatf("Control loop runtime (ms): min=%.3f, max=%.3f, frequency (Hz): min=%ld, max=%ld",
 					(double) TickPeriodToTimePeriod(minControlLoopRuntime), (double)TickPeriodToTimePeriod(maxControlLoopRuntime),
 					lrintf(TickPeriodToFreq(maxControlLoopCallInterval)), lrintf(TickPeriodToFreq(minControlLoopCallInterval)));
@@ -984,7 +1586,178 @@ void ClosedLoop::Diagnostics(const StringRef& reply) noexcept
 	//reply.catf(", event status 0x%08" PRIx32 ", TCC2 CTRLA 0x%08" PRIx32 ", TCC2 EVCTRL 0x%08" PRIx32, EVSYS->CHSTATUS.reg, QuadratureTcc->CTRLA.reg, QuadratureTcc->EVCTRL.reg);
 }
 
-// TODO: Instead of having this take step, why not use the current DDA to calculate where we need to be?
+// Time the sine/cosine functions used to calculate the coil currents
+GCodeResult ClosedLoop::RunTrigonometryBenchmark(const StringRef& reply) noexcept
+{
+	constexpr unsigned int NumCalls = 4096;
+	volatile float sink;										// stop the compiler optimising the calls away
+	float sine, cosine;
+
+	uint32_t startTicks = StepTimer::GetTimerTicks();
+	for (unsigned int i = 0; i < NumCalls; ++i)
+	{
+		Trigonometry::FastSinCos((uint16_t)i, sine, cosine);
+		sink = sine + cosine;
+	}
+	const uint32_t plainTicks = StepTimer::GetTimerTicks() - startTicks;
+
+	startTicks = StepTimer::GetTimerTicks();
+	for (unsigned int i = 0; i < NumCalls; ++i)
+	{
+		Trigonometry::FastSinCosInterpolated((float)i + 0.37, sine, cosine);
+		sink = sine + cosine;
+	}
+	const uint32_t interpolatedTicks = StepTimer::GetTimerTicks() - startTicks;
+	(void)sink;
+
+	constexpr uint32_t CyclesPerTick = SystemCoreClockFreq/StepTimer::StepClockRate;
+	reply.printf("Sin/cos calculation: %" PRIu32 " cycles, interpolated %" PRIu32 " cycles, including loop overhead",
+					(plainTicks * CyclesPerTick)/NumCalls, (interpolatedTicks * CyclesPerTick)/NumCalls);
+	return GCodeResult::ok;
+}
+
+// Report the range of control loop run times since the diagnostics were last reported, without resetting them.
+// We can't call the control loop out of turn to time it because that would disturb the motor, so this relies on it running normally.
+GCodeResult ClosedLoop::ReportControlLoopTiming(const StringRef& reply) noexcept
+{
+	constexpr uint32_t CyclesPerTick = SystemCoreClockFreq/StepTimer::StepClockRate;
+	if (minControlLoopRuntime > maxControlLoopRuntime)
+	{
+		reply.copy("Control loop: not running");
+	}
+	else
+	{
+		reply.printf("Control loop: min %" PRIu32 " max %" PRIu32 " cycles", minControlLoopRuntime * CyclesPerTick, maxControlLoopRuntime * CyclesPerTick);
+	}
+	return GCodeResult::ok;
+}
+
+// Select the velocity estimator used to calculate the D term, and report how long each one takes per call
+GCodeResult ClosedLoop::SetVelocityEstimator(unsigned int estimator, const StringRef& reply) noexcept
+{
+	if (estimator >= (unsigned int)VelocityEstimator::numEstimators)
+	{
+		reply.printf("Velocity estimator must be 0 to %u", (unsigned int)VelocityEstimator::numEstimators - 1);
+		return GCodeResult::error;
+	}
+
+	// Time each estimator using simulated readings from a motor moving at a steady speed, with the control loop running at 20kHz
+	constexpr unsigned int NumCalls = 1024;
+	constexpr uint32_t TicksPerCall = StepTimer::StepClockRate/20000;
+	constexpr uint32_t CyclesPerTick = SystemCoreClockFreq/StepTimer::StepClockRate;
+	DerivativeAveragingFilter<derivativeFilterSize> testAveraging;
+	FixedPointDerivativeFilter<derivativeFilterSize> testFixedPoint;
+	AlphaBetaVelocityObserver testAlphaBeta;
+	EdgeTimingVelocityEstimator testEdgeTiming;
+	uint32_t ticks[(size_t)VelocityEstimator::numEstimators] = { 0 };
+	for (unsigned int i = 0; i < NumCalls; ++i)
+	{
+		const int32_t reading = (int32_t)(i/3);
+		const uint32_t timestamp = i * TicksPerCall;
+		uint32_t startTicks = StepTimer::GetTimerTicks();
+		testAveraging.ProcessReading((float)reading, timestamp);
+		uint32_t endTicks = StepTimer::GetTimerTicks();
+		ticks[0] += endTicks - startTicks;
+		startTicks = endTicks;
+		testFixedPoint.ProcessReading(reading, timestamp);
+		endTicks = StepTimer::GetTimerTicks();
+		ticks[1] += endTicks - startTicks;
+		startTicks = endTicks;
+		testAlphaBeta.ProcessReading(reading, timestamp);
+		endTicks = StepTimer::GetTimerTicks();
+		ticks[2] += endTicks - startTicks;
+		startTicks = endTicks;
+		testEdgeTiming.ProcessReading(reading, timestamp);
+		ticks[3] += StepTimer::GetTimerTicks() - startTicks;
+	}
+
+	{
+		TaskCriticalSectionLocker lock;
+		ResetVelocityEstimators();
+		velocityEstimator = (VelocityEstimator)estimator;
+	}
+
+	reply.printf("Using velocity estimator %u, cycles per call including timing overhead: averaging %" PRIu32 ", fixed point %" PRIu32 ", alpha-beta %" PRIu32 ", edge timing %" PRIu32,
+					estimator, (ticks[0] * CyclesPerTick)/NumCalls, (ticks[1] * CyclesPerTick)/NumCalls, (ticks[2] * CyclesPerTick)/NumCalls, (ticks[3] * CyclesPerTick)/NumCalls);
+	return GCodeResult::ok;
+}
+
+// Set the time limit in milliseconds and the acceleration in full steps/sec^2 for local stall recovery. A time limit of zero reports stalls to the main board immediately.
+GCodeResult ClosedLoop::ConfigureStallRecovery(uint32_t timeoutMillis, uint32_t acceleration, const StringRef& reply) noexcept
+{
+	{
+		TaskCriticalSectionLocker lock;
+		recoveringFromStall = false;
+		stallRecoveryTicks = timeoutMillis * (StepTimer::StepClockRate/1000);
+		if (acceleration != 0)
+		{
+			stallRecoveryAcceleration = (float)acceleration;
+		}
+	}
+
+	if (timeoutMillis == 0)
+	{
+		reply.copy("Stall recovery disabled");
+	}
+	else
+	{
+		reply.printf("Stall recovery for up to %" PRIu32 "ms at %.0f steps/sec^2", timeoutMillis, (double)stallRecoveryAcceleration);
+	}
+	return GCodeResult::ok;
+}
+
+// Configure the outer position loop of cascaded control. The gain is in 1/1000 (full steps/sec) per full step of error, and the limit on the speed correction is in full steps/sec.
+// A divider of zero selects the single PID controller instead of cascaded control.
+GCodeResult ClosedLoop::ConfigurePositionLoop(unsigned int divider, uint32_t milliGain, uint32_t maxCorrection, const StringRef& reply) noexcept
+{
+	{
+		TaskCriticalSectionLocker lock;
+		if ((divider == 0) != (positionLoopDivider == 0))
+		{
+			PIDITerm = 0.0;							// the integral term means something different in the other controller
+		}
+		positionLoopDivider = divider;
+		positionLoopCountdown = 0;
+		if (divider != 0)
+		{
+			Kpp = (float)milliGain * 0.001;
+			maxSpeedCorrection = (float)maxCorrection;
+		}
+	}
+
+	if (divider == 0)
+	{
+		reply.copy("Using the single PID controller");
+	}
+	else
+	{
+		reply.printf("Cascaded control position loop P=%.3f every %u loops, speed correction limit %.0f steps/sec", (double)Kpp, divider, (double)maxSpeedCorrection);
+		if (Kvp == 0.0 && Kvi == 0.0)
+		{
+			reply.cat(". Warning: the velocity loop gains are zero");
+		}
+	}
+	return GCodeResult::ok;
+}
+
+// Configure the inner velocity loop of cascaded control. The gains are in 1/1000 control signal units per full step/sec of speed error, and the integral limit is in control signal units.
+GCodeResult ClosedLoop::ConfigureVelocityLoop(unsigned int iLimit, uint32_t milliKp, uint32_t milliKi, const StringRef& reply) noexcept
+{
+	{
+		TaskCriticalSectionLocker lock;
+		Kvp = (float)milliKp * 0.001;
+		Kvi = (float)milliKi * 0.001;
+		velocityIlimit = (iLimit == 0) ? PIDIlimit : constrain<float>((float)iLimit, 1.0, 256.0);
+		if (positionLoopDivider != 0)
+		{
+			PIDITerm = constrain<float>(PIDITerm, -velocityIlimit, velocityIlimit);
+		}
+	}
+	reply.printf("Cascaded control velocity loop P=%.4f I=%.4f I limit %.0f", (double)Kvp, (double)Kvi, (double)velocityIlimit);
+	return GCodeResult::ok;
+}
+
+// This is called by the step ISR for each step when closed loop mode is not enabled, so that the target position is right if it gets enabled
 void ClosedLoop::TakeStep() noexcept
 {
 # if SUPPORT_TMC2160 && SINGLE_DRIVER
@@ -1031,9 +1804,10 @@ void ClosedLoop::ResetError(size_t driver) noexcept
 	if (driver == 0) {
 		// Set the target position to the current position
 		ReadState();
-		derivativeFilter.Reset();
+		ResetVelocityEstimators();
 		targetMotorSteps = currentMotorSteps;
 		targetEncoderReading = currentEncoderReading;
+		recoveringFromStall = false;
 	}
 # else
 #  error Cannot support closed loop with the specified hardware
@@ -1081,6 +1855,14 @@ bool ClosedLoop::SetClosedLoopEnabled(size_t driver, bool enabled, const StringR
 		prevControlLoopCallTime = StepTimer::GetTimerTicks();			// to avoid huge integral term windup
 	}
 
+	// If we are disabling closed loop mode, abandon any tuning so that a relay tune doesn't carry on when closed loop mode is next enabled
+	if (!enabled && tuning != 0)
+	{
+		tuning = 0;
+		relayAmplitude = 0.0;
+		Platform::DriveEnableOverride(0, false);
+	}
+
 	// If we are disabling closed loop mode, we should ideally send steps to get the microstep counter to match the current phase here
 	closedLoopEnabled = enabled;
 
@@ -1095,6 +1877,7 @@ void ClosedLoop::DriverSwitchedToClosedLoop(size_t driver) noexcept
 		delay(3);														// allow time for the switch to complete and a few control loop iterations to be done
 		SetMotorPhase(desiredStepPhase, SmartDrivers::GetStandstillCurrentPercent(0) * 0.01);	// set the motor currents to match the initial position using the open loop standstill current
 		PIDITerm = 0.0;													// clear the integral term accumulator
+		positionLoopCountdown = 0;										// run the position loop first in cascaded control
 		ResetMonitoringVariables();										// the first loop iteration will have recorded a higher than normal loop call interval, so start again
 	}
 }
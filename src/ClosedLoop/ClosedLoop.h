@@ -37,14 +37,17 @@ namespace ClosedLoop
 	constexpr uint8_t TUNE_ERR_TUNING_FAILURE 				= TUNE_ERR_NOT_CALIBRATED | TUNE_ERR_SYSTEM_ERROR
 															| TUNE_ERR_TOO_LITTLE_MOTION | TUNE_ERR_TOO_MUCH_MOTION | TUNE_ERR_INCONSISTENT_MOTION;
 
+	constexpr unsigned int tuningStepsPerSecond = 2000;	// the rate at which we send 1/256 microsteps during tuning, slow enough for high-inertia motors
+
 	// Tuning manoeuvres
 	constexpr uint8_t BASIC_TUNING_MANOEUVRE 				= 1u << 0;		// this measures the polarity, check that the CPR looks OK, and for relative encoders sets the zero position
 	constexpr uint8_t ENCODER_CALIBRATION_MANOEUVRE 		= 1u << 1;		// this calibrates an absolute encoder
+	constexpr uint8_t FEEDFORWARD_TUNING_MANOEUVRE			= 1u << 2;		// this measures the velocity and acceleration feed-forward constants
 	constexpr uint8_t STEP_MANOEUVRE 						= 1u << 6;		// this does a sudden step change in the requested position for PID tuning
+	constexpr uint8_t ZIEGLER_NICHOLS_MANOEUVRE 			= 1u << 7;		// this does a relay feedback test to measure the ultimate gain and period for PID tuning
 
 #if 0	// The remainder are not currently implemented
 	constexpr uint8_t CONTINUOUS_PHASE_INCREASE_MANOEUVRE 	= 1u << 5;
-	constexpr uint8_t ZIEGLER_NICHOLS_MANOEUVRE 			= 1u << 7;
 #endif
 
 	//TODO reduce the number of these public variables, preferably to zero. Use a cleaner interface between the tuning module and the main closed loop module.
@@ -64,6 +67,13 @@ namespace ClosedLoop
 	GCodeResult ProcessM569Point6(const CanMessageGeneric& msg, const StringRef& reply) noexcept;
 
 	void Diagnostics(const StringRef& reply) noexcept;
+	GCodeResult RunTrigonometryBenchmark(const StringRef& reply) noexcept;
+	GCodeResult ReportControlLoopTiming(const StringRef& reply) noexcept;
+	GCodeResult SetVelocityEstimator(unsigned int estimator, const StringRef& reply) noexcept;
+	GCodeResult ConfigureStallRecovery(uint32_t timeoutMillis, uint32_t acceleration, const StringRef& reply) noexcept;
+	GCodeResult ConfigurePositionLoop(unsigned int divider, uint32_t milliGain, uint32_t maxCorrection, const StringRef& reply) noexcept;
+	GCodeResult ConfigureVelocityLoop(unsigned int iLimit, uint32_t milliKp, uint32_t milliKi, const StringRef& reply) noexcept;
+	GCodeResult ConfigureCaptureTrigger(unsigned int trigger, uint32_t param, uint32_t numPreTriggerSamples, const StringRef& reply) noexcept;
 
 	// Methods called by the motion system
 	void ControlLoop() noexcept;
@@ -84,10 +94,16 @@ namespace ClosedLoop
 	float PulsePerStepToExternalUnits(float pps, uint8_t encoderType) noexcept;
 	float ExternalUnitsToPulsePerStep(float externalUnits, uint8_t encoderType) noexcept;
 	void SetMotorPhase(uint16_t phase, float magnitude) noexcept;
+	void SetMotorPhaseInterpolated(float phase, float magnitude) noexcept;
 	void SetForwardPolarity() noexcept;
-	void SaveBasicTuningResult(float slope, float origin, float xMean, bool reverse) noexcept;
+	void SaveBasicTuningResult(float slope, float origin, float xMean, unsigned int numSamples, bool reverse) noexcept;
 	void FinishedBasicTuning() noexcept;			// call this when we have stopped basic tuning movement and are ready to switch to closed loop control
 	void AdjustTargetMotorSteps(float amount) noexcept;	// called by tuning to execute a step
+	float GetControlSignal() noexcept;				// called by tuning to get the latest control signal
+	void SetFeedForward(float kv, float ka) noexcept;	// called by tuning to set the feed-forward constants
+	float GetCurrentError() noexcept;				// called by tuning to get the latest position error
+	void SetRelayAmplitude(float amplitude) noexcept;	// called by tuning to replace the PID controller by a relay, or restore it if amplitude is zero
+	void SetUltimateGain(float ku, float tu) noexcept;	// called by tuning to set the ultimate gain and period it has measured
 
 	// Methods in the tuning module
 	void PerformTune() noexcept;
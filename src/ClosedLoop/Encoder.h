@@ -40,6 +40,13 @@ public:
 	// Get the current reading
 	virtual int32_t GetReading() noexcept = 0;
 
+	// Start reading the encoder in the background, so that the result is ready when the closed loop task next calls GetReading. Encoders that can't do this ignore it.
+	virtual void StartNextReading() noexcept { }
+
+	// Get how far the encoder has moved since the reading last changed, as a fraction of a count, and the speed in counts per second, estimated from the times of the most recent edges.
+	// Call this after GetReading. Return false if the encoder can't do this.
+	virtual bool GetSubCountPosition(float& fraction, float& countsPerSecond) noexcept { return false; }
+
 	// Get diagnostic information and append it to a string
 	virtual void AppendDiagnostics(const StringRef& reply) noexcept = 0;
 
@@ -10,9 +10,12 @@
 #if SAME5x && SUPPORT_CLOSED_LOOP
 
 #include "QuadratureEncoderPdec.h"
+#include <Movement/StepTimer.h>
 #include <hri_mclk_e54.h>
 #include <cmath>
 
+constexpr uint32_t MaxEdgeInterval = StepTimer::StepClockRate/10;		// if the count hasn't changed for this long, assume that the encoder is stationary
+
 // Overridden virtual functions
 
 // Initialise the encoder and enable it if successful. If there are any warnings or errors, put the corresponding message text in 'reply'.
@@ -81,6 +84,19 @@ int32_t QuadratureEncoderPdec::GetRelativePosition(bool& error) noexcept
 	PDEC->CTRLBSET.reg = PDEC_CTRLBSET_CMD_READSYNC;
 	while (PDEC->SYNCBUSY.reg & (PDEC_SYNCBUSY_CTRLB | PDEC_SYNCBUSY_COUNT)) { }
 	const uint16_t count = PDEC->COUNT.reg;
+	const uint32_t now = StepTimer::GetTimerTicks();
+
+	// Record when the count changed. We only see the change when we read the count, so the edge times are only as accurate as the interval between readings.
+	const int16_t change = (int16_t)(count - lastCount);
+	if (change != 0)
+	{
+		const int8_t direction = (change > 0) ? 1 : -1;
+		const uint32_t interval = now - lastEdgeTime;
+		edgeInterval = (direction == edgeDirection && interval < MaxEdgeInterval) ? interval/(uint32_t)abs(change) : 0;
+		edgeDirection = direction;
+		lastEdgeTime = now;
+	}
+	lastReadTime = now;
 
 	// Handle wrap around of the high position bits or the low revolution bits
 	const uint16_t currentHighBits = count >> 14;
@@ -100,6 +116,29 @@ int32_t QuadratureEncoderPdec::GetRelativePosition(bool& error) noexcept
 	return (int32_t)((counterHigh << 16) | count);
 }
 
+// Get the fraction of a count that the encoder has moved since the count last changed, and the speed in counts per second.
+// We assume that the encoder has kept moving at the speed implied by the last two edges, but it can't have moved a whole count or we would have seen another edge.
+// If it has taken longer than that, it must have slowed down, so we reduce the speed.
+bool QuadratureEncoderPdec::GetSubCountPosition(float& fraction, float& countsPerSecond) noexcept
+{
+	const uint32_t timeSinceEdge = lastReadTime - lastEdgeTime;
+	if (edgeInterval == 0 || timeSinceEdge >= MaxEdgeInterval)
+	{
+		fraction = countsPerSecond = 0.0;
+	}
+	else if (timeSinceEdge < edgeInterval)
+	{
+		fraction = (float)(edgeDirection * (int32_t)timeSinceEdge)/(float)edgeInterval;
+		countsPerSecond = (float)(edgeDirection * (int32_t)StepTimer::StepClockRate)/(float)edgeInterval;
+	}
+	else
+	{
+		fraction = (float)edgeDirection;
+		countsPerSecond = (float)(edgeDirection * (int32_t)StepTimer::StepClockRate)/(float)timeSinceEdge;
+	}
+	return true;
+}
+
 // End of overridden virtual functions
 
 // Set the position to the 32 bit signed value 'position'
@@ -21,7 +21,7 @@ public:
 	void* operator new(size_t sz) noexcept { return FreelistManager::Allocate<QuadratureEncoderPdec>(); }
 	void operator delete(void* p) noexcept { FreelistManager::Release<QuadratureEncoderPdec>(p); }
 
-	inline QuadratureEncoderPdec() noexcept : RelativeEncoder(), lastCount(0), counterHigh(0) {}
+	inline QuadratureEncoderPdec() noexcept : RelativeEncoder(), lastCount(0), counterHigh(0), lastReadTime(0), lastEdgeTime(0), edgeInterval(0), edgeDirection(0) {}
 	inline ~QuadratureEncoderPdec() { QuadratureEncoderPdec::Disable(); }
 
 	EncoderType GetType() const noexcept override { return EncoderType::rotaryQuadrature; }
@@ -30,6 +30,7 @@ public:
 	void Disable() noexcept override;				// Disable the decoder. Call this during initialisation. Can also be called later if necessary.
 	void AppendDiagnostics(const StringRef& reply) noexcept override;
 	void AppendStatus(const StringRef& reply) noexcept override;
+	bool GetSubCountPosition(float& fraction, float& countsPerSecond) noexcept override;
 
 protected:
 	// Get the current position relative to the starting position
@@ -41,6 +42,12 @@ private:
 
 	uint16_t lastCount;
 	uint32_t counterHigh;
+
+	// Edge timing, used to interpolate between counts and to measure low speeds
+	uint32_t lastReadTime;							// the step clock when we last read the count
+	uint32_t lastEdgeTime;							// the step clock when we first saw the current count
+	uint32_t edgeInterval;							// the step clocks per count between the last two changes of count in the same direction, or 0 if not known
+	int8_t edgeDirection;							// the direction of the last change of count, or 0 if no change has been seen
 };
 
 #endif
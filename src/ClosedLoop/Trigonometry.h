@@ -34,22 +34,15 @@ namespace Trigonometry
 	static_assert(lookupTable[Resolution] == 248.0);
 
 	void FastSinCos(uint16_t phase, float& sine, float& cosine) noexcept;
+	void FastSinCosInterpolated(float phase, float& sine, float& cosine) noexcept;
+	void SelectQuadrant(unsigned int quadrant, float r1, float r2, float& sine, float& cosine) noexcept;
 }
 
-// Calculate 248 * the sine and cosine of the phase value passed, where phase is between 0 and 4095, and 4096 would correspond to 2*pi
-// The phase is normally in the range 0 to 4095 but when tuning it can be 0 to somewhat over 8192. We must take it modulo 4096.
-// The reason for using 248n not 255 is this paragraph from section 16.2 of the TMC2160A data sheet:
-// "The maximum resulting swing of the wave should be adjusted to a range of -248 to 248, in order to give the best possible resolution while
-//  leaving headroom for the hysteresis-based chopper to add an offset."
-inline void Trigonometry::FastSinCos(uint16_t phase, float& sine, float& cosine) noexcept
-post(fabsf(sin) <= 248.0; fabsf(cosine) <= 248.0)
+// Set the sine and cosine from the lookup table results r1 = sin(x) and r2 = cos(x) for the angle x within the quadrant
+inline void Trigonometry::SelectQuadrant(unsigned int quadrant, float r1, float r2, float& sine, float& cosine) noexcept
 {
-	unsigned int quadrant = (phase / Resolution) & 3;
-	unsigned int index = phase % Resolution;
-
-	const float r1 = lookupTable[index];
-	const float r2 = lookupTable[Resolution - index];
-	switch (quadrant) {
+	switch (quadrant & 3)
+	{
 	case 0:
 		sine = r1;
 		cosine = r2;
@@ -69,4 +62,36 @@ post(fabsf(sin) <= 248.0; fabsf(cosine) <= 248.0)
 	}
 }
 
+// Calculate 248 * the sine and cosine of the phase value passed, where phase is between 0 and 4095, and 4096 would correspond to 2*pi
+// The phase is normally in the range 0 to 4095 but when tuning it can be 0 to somewhat over 8192. We must take it modulo 4096.
+// The reason for using 248n not 255 is this paragraph from section 16.2 of the TMC2160A data sheet:
+// "The maximum resulting swing of the wave should be adjusted to a range of -248 to 248, in order to give the best possible resolution while
+//  leaving headroom for the hysteresis-based chopper to add an offset."
+inline void Trigonometry::FastSinCos(uint16_t phase, float& sine, float& cosine) noexcept
+post(fabsf(sin) <= 248.0; fabsf(cosine) <= 248.0)
+{
+	unsigned int quadrant = (phase / Resolution) & 3;
+	unsigned int index = phase % Resolution;
+
+	const float r1 = lookupTable[index];
+	const float r2 = lookupTable[Resolution - index];
+	SelectQuadrant(quadrant, r1, r2, sine, cosine);
+}
+
+// As FastSinCos but the phase may have a fractional part and may be any value, and we interpolate linearly between adjacent lookup table entries.
+// The worst case error of the interpolation is about 248 * (pi/2048)^2/8 = 0.00007, which is far smaller than the 1 unit resolution of the coil currents.
+inline void Trigonometry::FastSinCosInterpolated(float phase, float& sine, float& cosine) noexcept
+post(fabsf(sin) <= 248.0; fabsf(cosine) <= 248.0)
+{
+	constexpr float PhasesPerCycle = 4 * Resolution;
+	phase -= floorf(phase * (1.0/PhasesPerCycle)) * PhasesPerCycle;		// reduce it to the range 0 to 4096
+	const unsigned int intPhase = (unsigned int)phase;
+	const float fraction = phase - (float)intPhase;
+	const unsigned int index = intPhase % Resolution;
+
+	const float r1 = lookupTable[index] + (lookupTable[index + 1] - lookupTable[index]) * fraction;
+	const float r2 = lookupTable[Resolution - index] + (lookupTable[Resolution - index - 1] - lookupTable[Resolution - index]) * fraction;
+	SelectQuadrant(intPhase / Resolution, r1, r2, sine, cosine);
+}
+
 #endif /* SRC_CLOSEDLOOP_TRIGONOMETRY_H_ */
@@ -30,45 +30,64 @@
  * Basic tuning
  * ------------------
  *
- *  - Increase the step phase by a little over 4096 counts and back again
+ *  - Increase the step phase by up to 4 full steps and back again
  *  - ignore the points near the start position
  *  - feed the remaining (phase, encoder reading) points into a linear regression algorithm, separately on the forward and the reverse movements
+ *  - stop each movement early at a full step boundary once the slope is known accurately enough
  *  - the linear regression gives us the encoder offset and the counts per step
  *  - pass these figures to the ClosedLoop module. It will check the counts per step, set the forward/reverse encoder polarity flag, and set the zero position
  *
  *  Notes on linear regression:
  *  From https://en.wikipedia.org/wiki/Simple_linear_regression the formula to fit a straight line y = mx + c to a set of N (x, y) points is:
- *   m = sigma(i=0..(N-1): (xi - xm) * (yi - ym)) / sigma(i=0..(N-1): (xi - xm)^2)
+ *   m = Sxy/Sxx where Sxy = sigma(i=0..(N-1): (xi - xm) * (yi - ym)) and Sxx = sigma(i=0..(N-1): (xi - xm)^2)
  *   c = ym - m * xm
  *  where xi is the ith x, yi is the ith y, xm is the mean x, ym is the mean y
- *  In our case the x values are the motor phase values selected, which are spaced uniformly, so that xi = x0 + p*i
- *  So xm = (x0 + (x0 + p*(N-1)))/2 = x0 + p*(N-1)/2
- *  and (xi - xm) = x0 + p*i - x0 - p*(N-1)/2 = p*(i - (N-1)/2)
- *
- *  Expand the numerator in the equation for m to:
- *   sigma(i=0..(N-1): yi*(xi - xm)) - ym*sigma(i=0..(N-1): (xi - xm))
- *  Simplify this to:
- *   sigma(i=0..N-1): yi*p*(i - (N-1)/2)) - ym*sigma(i=0..(N-1): p*(i - (N-1)/2))
- *  and further to:
- *   p * sigma(i=0..N-1): yi*(i - (N-1)/2)) - ym*p*(N * (N-1)/2 - N * (N-1)/2)
- *  and even further to:
- *   p * (sigma(i=0..N-1): yi*(i - (N-1)/2))
- *  We can accumulate the first term as we take readings, and we can accumulate the sum of the y values so we can calculate ym at the end.
- *
- *  The denominator in the equation for m expands to:
- *   sigma(i=0..(N-1): p^2*(i - (N-1)/2)^2)
- *  Expand this to:
- *   p^2 * sigma(i=0..(N-1): i^2) - sigma(i=0..(N-1): i * (N-1)) + sigma(i=0..(N-1): ((N-1)/2)^2)
- *  Simplify to:
- *   p^2 * sigma(i=0..(N-1): i^2) - (N-1) * sigma(i=0..(N-1): i) + N * ((N-1)/2)^2
- *  Using sigma(i=0..(N-1): i) = N * (N-1)/2, sigma(i=0..(N-1): i^2) = (N * (N-1) * (2*N - 1))/6 we get:
- *   p^2 * ((N * (N-1) * (2*N - 1))/6 - (N-1)*N * (N-1)/2 + N * ((N-1)/2)^2)
- *  which simplifies to:
- *   p^2*(N^3-N)/12
- *  So numerator/denominator is:
- *   (sigma(i=0..N-1): yi*(i - (N-1)/2))) / (p*(N^3-N)/12)
+ *  We update the means and the sums of products of deviations from them on every iteration using Welford's method, which avoids the loss of precision from subtracting large sums:
+ *   dx = xN - xm(N-1), xm(N) = xm(N-1) + dx/N, and similarly for y
+ *   Sxx(N) = Sxx(N-1) + dx * (xN - xm(N)), Sxy(N) = Sxy(N-1) + dx * (yN - ym(N)), Syy(N) = Syy(N-1) + dy * (yN - ym(N))
+ *  So the fit is available at any point during the movement. The standard error of the slope is sqrt((Syy - m * Sxy)/((N - 2) * Sxx)).
+ *  The encoder reading is not quite linear within a full step, so we only stop early when we have moved a whole number of full steps.
  */
 
+class StreamingRegression
+{
+public:
+	void Clear() noexcept { n = 0; xMean = yMean = sxx = sxy = syy = 0.0; }
+
+	void Add(float x, float y) noexcept
+	{
+		++n;
+		const float dx = x - xMean;
+		const float dy = y - yMean;
+		xMean += dx/n;
+		yMean += dy/n;
+		sxx += dx * (x - xMean);
+		sxy += dx * (y - yMean);
+		syy += dy * (y - yMean);
+	}
+
+	unsigned int GetNumSamples() const noexcept { return n; }
+	float GetXMean() const noexcept { return xMean; }
+	float GetYMean() const noexcept { return yMean; }
+	float GetSlope() const noexcept { return (sxx > 0.0) ? sxy/sxx : 0.0; }
+
+	// Return true if the standard error of the slope is no more than the specified fraction of the slope
+	bool SlopeIsAccurate(float maxRelativeError) const noexcept
+	{
+		if (n < 3 || sxx <= 0.0)
+		{
+			return false;
+		}
+		const float residualSumOfSquares = max<float>(syy - GetSlope() * sxy, 0.0);
+		return residualSumOfSquares <= fsquare(maxRelativeError * sxy) * (float)(n - 2)/sxx;
+	}
+
+private:
+	unsigned int n;
+	float xMean, yMean;
+	float sxx, sxy, syy;
+};
+
 static bool BasicTuning(bool firstIteration) noexcept
 {
 	enum class BasicTuningState { forwardInitial = 0, forwards, reverseInitial, reverse };
@@ -77,15 +96,15 @@ static bool BasicTuning(bool firstIteration) noexcept
 	static uint16_t initialStepPhase;								// the step phase we started at
 	static int32_t initialEncoderReading;							// this stores the reading at the start of a data collection phase
 	static unsigned int stepCounter;								// a counter to use within a state
-	static float regressionAccumulator;
-	static float readingAccumulator;
+	static StreamingRegression regression;
 
 	constexpr unsigned int NumDummySteps = 8;						// how many steps to take before we start collecting data
-	constexpr uint16_t PhaseIncrement = 8;							// how much to increment the phase by on each step, must be a factor of 4096
-	static_assert(4096 % PhaseIncrement == 0);
-	constexpr unsigned int NumSamples = 4096/PhaseIncrement;		// the number of samples we take to d the linear regression
-	constexpr float HalfNumSamplesMinusOne = (float)(NumSamples - 1) * 0.5;
-	constexpr float Denominator = (float)PhaseIncrement * (fcube((float)NumSamples) - (float)NumSamples)/12.0;
+	constexpr uint16_t PhaseIncrement = 8;							// how much to increment the phase by on each step, must be a factor of 1024
+	static_assert(1024 % PhaseIncrement == 0);
+	constexpr unsigned int SamplesPerFullStep = 1024/PhaseIncrement;
+	constexpr unsigned int MinSamples = SamplesPerFullStep;			// the minimum number of samples we take to do the linear regression
+	constexpr unsigned int MaxSamples = 4 * SamplesPerFullStep;		// the maximum number of samples we take to do the linear regression
+	constexpr float MaxSlopeRelativeError = 0.002;					// we stop early when the standard error of the slope is no more than this fraction of the slope
 
 	if (firstIteration)
 	{
@@ -97,93 +116,58 @@ static bool BasicTuning(bool firstIteration) noexcept
 	switch (state)
 	{
 	case BasicTuningState::forwardInitial:
-		// In this state we move forwards a few microsteps to allow the motor to settle down
-		ClosedLoop::desiredStepPhase += PhaseIncrement;
+	case BasicTuningState::reverseInitial:
+		// In this state we move a few microsteps to allow the motor to settle down
+		ClosedLoop::desiredStepPhase += (state == BasicTuningState::reverseInitial) ? -PhaseIncrement : PhaseIncrement;
 		ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1.0);
 		++stepCounter;
 		if (stepCounter == NumDummySteps)
 		{
-			regressionAccumulator = readingAccumulator = 0.0;
+			regression.Clear();
 			stepCounter = 0;
 			initialStepPhase = ClosedLoop::desiredStepPhase;
-			state = BasicTuningState::forwards;
+			state = (state == BasicTuningState::reverseInitial) ? BasicTuningState::reverse : BasicTuningState::forwards;
 		}
 		break;
 
 	case BasicTuningState::forwards:
-		// Collect data and move forwards, until we have moved 4 full steps
+	case BasicTuningState::reverse:
+		// Collect data and move, until we have moved 4 full steps or we already have an accurate enough slope
 		{
+			const bool reverse = (state == BasicTuningState::reverse);
 			const int32_t reading = ClosedLoop::encoder->GetReading();
 			if (stepCounter == 0)
 			{
 				initialEncoderReading = reading;			// to reduce rounding error, get rid of any large constant offset when accumulating
 			}
-			readingAccumulator += (float)(reading - initialEncoderReading);
-			regressionAccumulator += (float)(reading - initialEncoderReading) * ((float)stepCounter - HalfNumSamplesMinusOne);
-		}
-
-		if (stepCounter == NumSamples)
-		{
-			// Save the accumulated data
-			const float yMean = readingAccumulator/NumSamples + (float)initialEncoderReading;
-			const float slope = regressionAccumulator / Denominator;
-			const float xMean = (float)initialStepPhase + (float)PhaseIncrement * HalfNumSamplesMinusOne;
-			const float origin = yMean - slope * xMean;
-			ClosedLoop::SaveBasicTuningResult(slope, origin, xMean, false);
-
-			stepCounter = 0;
-			state = BasicTuningState::reverseInitial;
-		}
-		else
-		{
-			ClosedLoop::desiredStepPhase += PhaseIncrement;
-			ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1.0);
-			++stepCounter;
-		}
-		break;
+			const int32_t phaseOffset = (int32_t)(stepCounter * PhaseIncrement);
+			regression.Add((float)((reverse) ? -phaseOffset : phaseOffset), (float)(reading - initialEncoderReading));
 
-	case BasicTuningState::reverseInitial:
-		// In this state we move backwards a few microsteps to allow the motor to settle down
-		ClosedLoop::desiredStepPhase -= PhaseIncrement;
-		ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1.0);
-		++stepCounter;
-		if (stepCounter == NumDummySteps)
-		{
-			regressionAccumulator = readingAccumulator = 0.0;
-			stepCounter = 0;
-			initialStepPhase = ClosedLoop::desiredStepPhase;
-			state = BasicTuningState::reverse;
-		}
-		break;
+			if (   stepCounter == MaxSamples
+				|| (stepCounter >= MinSamples && stepCounter % SamplesPerFullStep == 0 && regression.SlopeIsAccurate(MaxSlopeRelativeError))
+			   )
+			{
+				// Save the results
+				const float yMean = regression.GetYMean() + (float)initialEncoderReading;
+				const float slope = regression.GetSlope();
+				const float xMean = (float)initialStepPhase + regression.GetXMean();
+				const float origin = yMean - slope * xMean;
+				ClosedLoop::SaveBasicTuningResult(slope, origin, xMean, regression.GetNumSamples(), reverse);
+				if (reverse)
+				{
+					ClosedLoop::FinishedBasicTuning();									// call this when we have stopped and are ready to switch to closed loop control
+					return true;														// finished tuning
+				}
 
-	case BasicTuningState::reverse:
-		// Collect data and move backwards, until we have moved 4 full steps
-		{
-			const int32_t reading = ClosedLoop::encoder->GetReading();
-			if (stepCounter == 0)
+				stepCounter = 0;
+				state = BasicTuningState::reverseInitial;
+			}
+			else
 			{
-				initialEncoderReading = reading;			// to reduce rounding error, get rid of any large constant offset when accumulating
+				ClosedLoop::desiredStepPhase += (reverse) ? -PhaseIncrement : PhaseIncrement;
+				ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1.0);
+				++stepCounter;
 			}
-			readingAccumulator += (float)(reading - initialEncoderReading);
-			regressionAccumulator += (float)(reading - initialEncoderReading) * ((float)stepCounter - HalfNumSamplesMinusOne);
-		}
-
-		if (stepCounter == NumSamples)
-		{
-			// Save the accumulated data
-			const float yMean = readingAccumulator/NumSamples + (float)initialEncoderReading;
-			const float slope = regressionAccumulator / (-Denominator);			// negate the denominator because the phase increment was negative this time
-			const float xMean = (float)initialStepPhase - (float)PhaseIncrement * HalfNumSamplesMinusOne;
-			const float origin = yMean - slope * xMean;
-			ClosedLoop::SaveBasicTuningResult(slope, origin, xMean, true);
-			ClosedLoop::FinishedBasicTuning();									// call this when we have stopped and are ready to switch to closed loop control
-			return true;														// finished tuning
-		}
-		else
-		{
-			ClosedLoop::desiredStepPhase -= PhaseIncrement;
-			ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1.0);
-			++stepCounter;
 		}
 		break;
 	}
@@ -197,15 +181,94 @@ static bool BasicTuning(bool firstIteration) noexcept
  * ----------------------------
  *
  * Absolute:
- * 	- Move to a number of 'target positions'
- * 	- At each target position, record the current encoder reading
- * 	- Store this reading in the encoder LUT
+ * 	- Sweep the motor phase slowly and continuously forwards until the encoder has turned through one revolution, then back again
+ * 	- On each iteration, take the difference y between the encoder reading and the position implied by the commanded phase
+ * 	- Fit y by least squares to a constant, a term proportional to the distance u moved (in case the counts per step is slightly out) and harmonics 1-16 of the encoder angle
+ * 	- Store the harmonics in NVM and calculate the LUT from them
+ *
+ *  Each sample is weighted by how far the encoder turned since the previous one, so the sums approximate integrals over whole revolutions of the encoder.
+ *  Then the harmonics are orthogonal to each other and to the constant, so the normal equations reduce to:
+ *   a[h] = 2 * (sigma(y * sin(h * theta)) - s * sigma(u * sin(h * theta)))/W, and similarly b[h] using cos
+ *  where W is the sum of the weights and s is the slope of the linear term, which we can solve for separately.
+ *  So we only need to accumulate a few sums per harmonic instead of storing the samples.
+ *  Sweeping in both directions cancels the lag of the motor behind the commanded phase.
  */
 
+constexpr float MaxEncoderCalibrationResidual = 0.1;		// the largest RMS difference between the calibration measurements and the fitted correction that we accept, in full steps
+constexpr int32_t EncoderCalibrationPhaseIncrement = 16;	// how far we advance the phase on each iteration, where 1024 is one full step
+constexpr float EncoderCalibrationMaxTravel = 1.25;			// give up if the encoder hasn't turned through a revolution after we commanded this many revolutions in each direction
+
+struct EncoderCalibrationSums
+{
+	float w, u, uu, y, yu, yy;
+	float ySin[NUM_HARMONICS], yCos[NUM_HARMONICS];			// index 0 is not used
+	float uSin[NUM_HARMONICS], uCos[NUM_HARMONICS];
+
+	void Clear() noexcept { memset(this, 0, sizeof(*this)); }
+	void Add(float theta, float uVal, float yVal, float weight) noexcept;
+	bool Solve(float maxMeanSquareResidual, float sinCoefficients[NUM_HARMONICS], float cosCoefficients[NUM_HARMONICS]) const noexcept;
+};
+
+void EncoderCalibrationSums::Add(float theta, float uVal, float yVal, float weight) noexcept
+{
+	w += weight;
+	const float wu = weight * uVal, wy = weight * yVal;
+	u += wu;
+	uu += wu * uVal;
+	y += wy;
+	yu += wy * uVal;
+	yy += wy * yVal;
+
+	// Generate sin(h * theta) and cos(h * theta) using the angle addition formulae, so that we only need one sin/cos calculation per sample
+	const float sin1 = sinf(theta), cos1 = cosf(theta);
+	float sinH = sin1, cosH = cos1;
+	for (size_t h = 1; h < NUM_HARMONICS; ++h)
+	{
+		ySin[h] += wy * sinH;
+		yCos[h] += wy * cosH;
+		uSin[h] += wu * sinH;
+		uCos[h] += wu * cosH;
+		const float nextSin = sinH * cos1 + cosH * sin1;
+		cosH = cosH * cos1 - sinH * sin1;
+		sinH = nextSin;
+	}
+}
+
+// Calculate the harmonic coefficients, returning false if the fit is poor. Harmonic 0 is set to zero, so that the correction doesn't move the zero position found by basic tuning.
+bool EncoderCalibrationSums::Solve(float maxMeanSquareResidual, float sinCoefficients[NUM_HARMONICS], float cosCoefficients[NUM_HARMONICS]) const noexcept
+{
+	const float twoOverW = 2.0/w;
+	float numerator = yu - u * y/w;
+	float denominator = uu - u * u/w;
+	for (size_t h = 1; h < NUM_HARMONICS; ++h)
+	{
+		numerator -= twoOverW * (ySin[h] * uSin[h] + yCos[h] * uCos[h]);
+		denominator -= twoOverW * (fsquare(uSin[h]) + fsquare(uCos[h]));
+	}
+	const float slope = (denominator > 0.0) ? numerator/denominator : 0.0;
+	const float constant = (y - slope * u)/w;
+
+	// The sum of the squared residuals of a least squares fit is the sum of y^2 less the sum of each coefficient times the corresponding sum of y times its basis function
+	float explained = constant * y + slope * yu;
+	sinCoefficients[0] = cosCoefficients[0] = 0.0;
+	for (size_t h = 1; h < NUM_HARMONICS; ++h)
+	{
+		sinCoefficients[h] = twoOverW * (ySin[h] - slope * uSin[h]);
+		cosCoefficients[h] = twoOverW * (yCos[h] - slope * uCos[h]);
+		explained += sinCoefficients[h] * ySin[h] + cosCoefficients[h] * yCos[h];
+	}
+	return (yy - explained)/w <= maxMeanSquareResidual;
+}
+
 static bool EncoderCalibration(bool firstIteration) noexcept
 {
-	static int targetPosition;
-	static int positionCounter;
+	static EncoderCalibrationSums sums;
+	static bool reverse;
+	static int32_t phase;									// the commanded phase relative to the start, where 1024 is one full step
+	static uint16_t startStepPhase;
+	static int32_t startReading;
+	static float prevU;
+	static unsigned int iterations;
 
 	if (ClosedLoop::encoder->GetPositioningType() == EncoderPositioningType::relative)
 	{
@@ -213,30 +276,64 @@ static bool EncoderCalibration(bool firstIteration) noexcept
 	}
 
 	AS5047D* absoluteEncoder = (AS5047D*) ClosedLoop::encoder;
-	if (firstIteration) {
+	const float radiansPerCount = TwoPi/(float)absoluteEncoder->GetMaxValue();
+	const float countsPerPhase = ClosedLoop::encoderPulsePerStep * (1.0/1024);
+	if (firstIteration)
+	{
 		absoluteEncoder->ClearLUT();
-		targetPosition = 0;
-		positionCounter = 0;
-	}
-
-	if (ClosedLoop::currentEncoderReading < targetPosition) {
-		positionCounter += 1;
-	} else if (ClosedLoop::currentEncoderReading > targetPosition) {
-		positionCounter -= 1;
-	} else {
-		const float realWorldPos = absoluteEncoder->GetMaxValue() * positionCounter / (1024 * (360.0 / ClosedLoop::PulsePerStepToExternalUnits(ClosedLoop::encoderPulsePerStep, EncoderType::AS5047)));
-		absoluteEncoder->StoreLUTValueForPosition(ClosedLoop::currentEncoderReading, realWorldPos);
-		targetPosition += absoluteEncoder->GetLUTResolution();
+		sums.Clear();
+		reverse = false;
+		phase = 0;
+		startStepPhase = ClosedLoop::desiredStepPhase;
+		startReading = ClosedLoop::currentEncoderReading;
+		prevU = 0.0;
+		iterations = 0;
 	}
+	else
+	{
+		// Accumulate the reading resulting from the phase we set last time
+		const int32_t reading = ClosedLoop::currentEncoderReading;
+		const float u = (float)(reading - startReading) * radiansPerCount;
+		const float weight = fabsf(u - prevU);
+		prevU = u;
+		if (weight != 0.0)
+		{
+			const int32_t angle = reading % (int32_t)absoluteEncoder->GetMaxValue();
+			const float theta = (float)((angle < 0) ? angle + (int32_t)absoluteEncoder->GetMaxValue() : angle) * radiansPerCount;
+			sums.Add(theta, u, (float)(reading - startReading) - (float)phase * countsPerPhase, weight);
+		}
 
-	if ((unsigned int) targetPosition >= absoluteEncoder->GetMaxValue()) {
-		// We are finished
-		absoluteEncoder->StoreLUT();
-		return true;
+		if (!reverse && u >= TwoPi)
+		{
+			reverse = true;
+			iterations = 0;
+		}
+		else if (reverse && u <= 0.0)
+		{
+			// We are finished. If the harmonics don't fit the measurements to within a small fraction of a step then the motion must have been inconsistent.
+			float sinCoefficients[NUM_HARMONICS], cosCoefficients[NUM_HARMONICS];
+			if (!sums.Solve(fsquare(ClosedLoop::encoderPulsePerStep * MaxEncoderCalibrationResidual), sinCoefficients, cosCoefficients)
+				|| !absoluteEncoder->StoreHarmonics(sinCoefficients, cosCoefficients))
+			{
+				absoluteEncoder->ClearLUT();
+				ClosedLoop::tuningError |= ClosedLoop::TUNE_ERR_INCONSISTENT_MOTION;
+			}
+			else
+			{
+				ClosedLoop::tuningError &= ~ClosedLoop::TUNE_ERR_NOT_CALIBRATED;
+			}
+			return true;
+		}
+		else if ((float)(++iterations * EncoderCalibrationPhaseIncrement) * countsPerPhase > EncoderCalibrationMaxTravel * (float)absoluteEncoder->GetMaxValue())
+		{
+			ClosedLoop::tuningError |= ClosedLoop::TUNE_ERR_TOO_LITTLE_MOTION;
+			return true;
+		}
 	}
 
-	ClosedLoop::desiredStepPhase = (positionCounter > 0 ? 0 : 4096) + positionCounter % 4096;
-	ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1);
+	phase += (reverse) ? -EncoderCalibrationPhaseIncrement : EncoderCalibrationPhaseIncrement;
+	ClosedLoop::desiredStepPhase = (uint16_t)(((int32_t)startStepPhase + phase) & 4095);
+	ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1.0);
 	return false;
 }
 
@@ -278,147 +375,170 @@ static bool Step(bool firstIteration) noexcept
 
 
 /*
- * Ziegler Nichols Manoeuvre
- * -------------
+ * Feed-forward tuning
+ * -------------------
  *
  * Absolute:
  * Relative:
- *  - TODO!
- *
+ *  - with the PID controller running, move the target forwards and then backwards with a trapezoidal speed profile
+ *  - the mean control signal in the second half of the steady speed phases, divided by the speed, gives the velocity feed-forward constant Kv
+ *  - the mean control signal in the acceleration phases less that in the deceleration phases, after allowing for Kv, gives the acceleration feed-forward constant Ka.
+ *    Taking the difference cancels out friction, which needs the same control signal in both phases.
  */
 
-#if 1
-// TODO: Implement ziegler-Nichols move
+constexpr float FeedForwardTuningSpeed = 400.0;				// the steady speed in full steps per second
+constexpr unsigned int FeedForwardRampIterations = 200;		// how many iterations we accelerate and decelerate for
+constexpr unsigned int FeedForwardSteadyIterations = 400;	// how many iterations we move at steady speed for
+constexpr unsigned int FeedForwardSettleIterations = 200;	// how many iterations we wait for after each movement
+constexpr unsigned int FeedForwardPassIterations = 2 * FeedForwardRampIterations + FeedForwardSteadyIterations + FeedForwardSettleIterations;
+constexpr float FeedForwardTuningAcceleration = (FeedForwardTuningSpeed * ClosedLoop::tuningStepsPerSecond)/FeedForwardRampIterations;
 
-#else
-static bool ZieglerNichols(bool firstIteration) noexcept
+static bool FeedForwardTuning(bool firstIteration) noexcept
 {
+	static unsigned int iteration;
+	static unsigned int numSteadySamples;
+	static float steadySignal, accelSignal, accelSpeed, decelSignal, decelSpeed;
 
-	// We will need to restore these afterwards...
-	const float prevKp = Kp;
-	const float prevKi = Ki;
-	const float prevKd = Kd;
-
-	// Reset the PID controller
-	Ki = 0;
-	Kd = 0;
-	Kp = 0;
-	PIDITerm = 0;
-
-	ultimateGain = 0;		// Reset the ultimate gain value
-	int direction = 1;		// Which direction are we moving in
-
-	float lowerBound = 0;
-	float upperBound = 10000;
-
-	while (upperBound - lowerBound > 100) {
-
-		Kp = lowerBound + (upperBound - lowerBound) / 2;
-
-		targetMotorSteps = currentMotorSteps + (direction * 10);
-
-		// Flip the direction
-		direction = -direction;
-
-		unsigned int initialRiseTime = 0;		// The time it takes to initially meet the target
-
-		float peakError = 0;			// The peak of the current oscillation
-		float prevPeakError = 0;		// The peak of the previous oscillation
-		unsigned int prevTimestamp = 0;			// The previous time of oscillation
-
-		unsigned int oscillationCount = 0;		// The number of oscillations that have occurred
-
-		float ewmaDecayFraction = 0;	// An EWMA of the decay fraction of oscillations
-		float ewmaOscillationPeriod = 0;// An EWMA of the oscillation period
-
-		// Run up to a maximum of 4096
-		for (unsigned int time=0; time<16384; time++) {
-			TaskBase::Take(10);		// TODO: Use delayuntil here? And run at PID frequency
-
-			ControlMotorCurrents();
-
-			float currentPosition = direction * currentMotorSteps;
-			float targetPosition = direction * targetMotorSteps;
-			float error = abs(currentPosition - targetPosition);
+	if (firstIteration)
+	{
+		if ((ClosedLoop::tuningError & ClosedLoop::TUNE_ERR_NOT_DONE_BASIC) != 0)
+		{
+			return true;										// we can't control the motor until basic tuning has been done
+		}
+		iteration = numSteadySamples = 0;
+		steadySignal = accelSignal = accelSpeed = decelSignal = decelSpeed = 0.0;
+	}
 
-			// Search for the initial rise time
-			if (initialRiseTime == 0) {
-				if (currentPosition > targetPosition) {
-					initialRiseTime = time;
-				} else {
-					continue;
-				}
-			}
+	// Work out where we are in the current pass and sample the control signal, taking the direction of movement as positive
+	const unsigned int i = iteration % FeedForwardPassIterations;
+	const float direction = (iteration < FeedForwardPassIterations) ? 1.0 : -1.0;
+	const float signal = ClosedLoop::GetControlSignal() * direction;
+	float speed;
+	if (i < FeedForwardRampIterations)
+	{
+		speed = (FeedForwardTuningSpeed * (i + 1))/FeedForwardRampIterations;
+		accelSignal += signal;
+		accelSpeed += speed;
+	}
+	else if (i < FeedForwardRampIterations + FeedForwardSteadyIterations)
+	{
+		speed = FeedForwardTuningSpeed;
+		if (i >= FeedForwardRampIterations + FeedForwardSteadyIterations/2)
+		{
+			steadySignal += signal;
+			++numSteadySamples;
+		}
+	}
+	else if (i < 2 * FeedForwardRampIterations + FeedForwardSteadyIterations)
+	{
+		speed = (FeedForwardTuningSpeed * (2 * FeedForwardRampIterations + FeedForwardSteadyIterations - 1 - i))/FeedForwardRampIterations;
+		decelSignal += signal;
+		decelSpeed += speed;
+	}
+	else
+	{
+		speed = 0.0;
+	}
 
-			// Wait another two initial rise times for oscillations to occur
-			if (time < 3 * initialRiseTime) {continue;}
+	ClosedLoop::AdjustTargetMotorSteps((direction * speed)/ClosedLoop::tuningStepsPerSecond);
+	++iteration;
+	if (iteration < 2 * FeedForwardPassIterations)
+	{
+		return false;
+	}
 
-			// We're now in the prime time for oscillations - check if they are actually happening:
+	// Both passes are complete, so calculate the constants
+	const float kv = steadySignal/(numSteadySamples * FeedForwardTuningSpeed);
+	constexpr unsigned int NumRampSamples = 2 * FeedForwardRampIterations;
+	const float ka = ((accelSignal - kv * accelSpeed) - (decelSignal - kv * decelSpeed))/(NumRampSamples * 2 * FeedForwardTuningAcceleration);
+	ClosedLoop::SetFeedForward(max<float>(kv, 0.0), max<float>(ka, 0.0));
+	return true;
+}
 
-			// Record data if we are above the target
-			if (currentPosition > targetPosition) {
-				peakError = max<float>(peakError, error);
-				continue;
-			}
-			// Process data if we have just crossed the target
-			float decayFraction;
-			if (peakError > 0) {
-				if (prevPeakError > 0) {
-					decayFraction = peakError / prevPeakError;
-					ewmaDecayFraction =
-							ewmaDecayFraction == 0
-							? decayFraction
-							: 0.7 * ewmaDecayFraction + 0.3 * decayFraction;
-					if (oscillationCount > 5) {
-						ewmaOscillationPeriod =
-								ewmaOscillationPeriod == 0
-								? (time - prevTimestamp)
-								: 0.3 * ewmaOscillationPeriod + 0.7 * (time - prevTimestamp);
-					}
-				}
-				oscillationCount++;
-				prevPeakError = peakError;
-				peakError = 0;
-				prevTimestamp = time;
-			}
 
-			PIDPTerm = ewmaOscillationPeriod;
-			PIDDTerm = (time - prevTimestamp);
+/*
+ * Ziegler Nichols Manoeuvre
+ * -------------
+ *
+ * Absolute:
+ * Relative:
+ *  - hold the target position still and replace the PID controller by a relay, which applies a fixed control signal in the direction that reduces the error
+ *  - this makes the motor oscillate about the target. Ignore the first few cycles, then measure the period and amplitude of the oscillation
+ *  - the describing function of a relay of amplitude d gives the ultimate gain Ku = 4d/(pi * amplitude), and the ultimate period is the oscillation period
+ *  - the classic Ziegler-Nichols rules then give the suggested PID parameters, which are reported when tuning completes
+ */
 
-			// Wait for at least 5 oscillations
-			if (oscillationCount < 5) {
-				continue;
-			}
+constexpr float RelayAmplitude = 64.0;						// the control signal used by the relay, out of 256
+constexpr unsigned int RelaySettleCycles = 3;				// how many oscillation cycles we ignore before we start measuring
+constexpr unsigned int RelayMeasuredCycles = 5;				// how many oscillation cycles we measure
+constexpr unsigned int RelayTimeoutIterations = 4 * ClosedLoop::tuningStepsPerSecond;	// give up if we haven't finished after this many iterations
 
-			// Check that the next 5 oscillations all keep the average decay fraction above 98%
-			if (ewmaDecayFraction < 0.98) {
-				// No oscillations, this is the new lower bound.
-				lowerBound = Kp;
-				break;
-			}
-			if (oscillationCount >= 10) {
-				// Oscillations found! This is the new upper bound.
-				upperBound = Kp;
-				oscillationPeriod = ewmaOscillationPeriod;
-				break;
-			}
+static bool ZieglerNichols(bool firstIteration) noexcept
+{
+	static unsigned int iteration, lastCrossingIteration, numCrossings, numMeasured;
+	static float minError, maxError, totalPeriod, totalAmplitude;
+	static bool wasPositive;
 
-			// If we time out of this loop, assume no oscillations
-			if (time == 16383) {
-				lowerBound = Kp;
-			}
+	const float error = ClosedLoop::GetCurrentError();
+	if (firstIteration)
+	{
+		if ((ClosedLoop::tuningError & ClosedLoop::TUNE_ERR_NOT_DONE_BASIC) != 0)
+		{
+			return true;										// we can't control the motor until basic tuning has been done
+		}
+		iteration = lastCrossingIteration = numCrossings = numMeasured = 0;
+		minError = maxError = error;
+		totalPeriod = totalAmplitude = 0.0;
+		wasPositive = (error >= 0.0);
+		ClosedLoop::SetRelayAmplitude(RelayAmplitude);
+	}
 
+	++iteration;
+	const bool isPositive = (error >= 0.0);
+	if (isPositive && !wasPositive)
+	{
+		// The error has just crossed zero going upwards, so we have completed a cycle
+		if (numCrossings > RelaySettleCycles)
+		{
+			totalPeriod += (float)(iteration - lastCrossingIteration);
+			totalAmplitude += (maxError - minError) * 0.5;
+			++numMeasured;
 		}
+		++numCrossings;
+		lastCrossingIteration = iteration;
+		minError = maxError = error;
 	}
+	else
+	{
+		minError = min<float>(minError, error);
+		maxError = max<float>(maxError, error);
+	}
+	wasPositive = isPositive;
 
-	ultimateGain = upperBound;
-	Kp = prevKp;
-	Ki = prevKi;
-	Kd = prevKd;
+	if (numMeasured == RelayMeasuredCycles)
+	{
+		ClosedLoop::SetRelayAmplitude(0.0);
+		const float amplitude = totalAmplitude/numMeasured;
+		if (amplitude <= 0.0)
+		{
+			ClosedLoop::tuningError |= ClosedLoop::TUNE_ERR_TOO_LITTLE_MOTION;
+		}
+		else
+		{
+			ClosedLoop::SetUltimateGain((4.0 * RelayAmplitude)/(Pi * amplitude), totalPeriod/(numMeasured * ClosedLoop::tuningStepsPerSecond));
+		}
+		return true;
+	}
 
-	tuning &= ~ZIEGLER_NICHOLS_MANOEUVRE;
+	if (iteration >= RelayTimeoutIterations)
+	{
+		// The motor didn't oscillate consistently
+		ClosedLoop::SetRelayAmplitude(0.0);
+		ClosedLoop::tuningError |= ClosedLoop::TUNE_ERR_INCONSISTENT_MOTION;
+		return true;
+	}
+	return false;
 }
-#endif
 
 
 /*
@@ -461,9 +581,8 @@ void ClosedLoop::PerformTune() noexcept
 		if (newTuningMove) {
 			tuning = 0;
 		}
-#if 0	// not implemented
-	} else if (tuning & CONTINUOUS_PHASE_INCREASE_MANOEUVRE) {
-		newTuningMove = ContinuousPhaseIncrease(newTuningMove);
+	} else if (tuning & FEEDFORWARD_TUNING_MANOEUVRE) {
+		newTuningMove = FeedForwardTuning(newTuningMove);
 		if (newTuningMove) {
 			tuning = 0;
 		}
@@ -472,6 +591,12 @@ void ClosedLoop::PerformTune() noexcept
 		if (newTuningMove) {
 			tuning = 0;
 		}
+#if 0	// not implemented
+	} else if (tuning & CONTINUOUS_PHASE_INCREASE_MANOEUVRE) {
+		newTuningMove = ContinuousPhaseIncrease(newTuningMove);
+		if (newTuningMove) {
+			tuning = 0;
+		}
 #endif
 	} else {
 		tuning = 0;
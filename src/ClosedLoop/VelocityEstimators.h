@@ -0,0 +1,170 @@
+/*
+ * VelocityEstimators.h
+ */
+
+#ifndef SRC_CLOSEDLOOP_VELOCITYESTIMATORS_H_
+#define SRC_CLOSEDLOOP_VELOCITYESTIMATORS_H_
+
+#include "RepRapFirmware.h"
+#include <Movement/StepTimer.h>
+
+// Alternatives to DerivativeAveragingFilter for estimating the motor speed from the encoder readings.
+// Each takes the encoder reading and the step clock time when it was taken, and returns the speed in encoder counts per second.
+
+// The ways we can estimate the derivative of the position error
+enum class VelocityEstimator : uint8_t
+{
+	errorAveraging = 0,			// DerivativeAveragingFilter applied to the position error
+	fixedPoint,					// FixedPointDerivativeFilter applied to the encoder reading
+	alphaBeta,					// AlphaBetaVelocityObserver applied to the encoder reading
+	edgeTiming,					// EdgeTimingVelocityEstimator applied to the encoder reading
+	numEstimators
+};
+
+// As DerivativeAveragingFilter but using the integer encoder reading. The window time changes only when the control loop rate changes,
+// so instead of dividing by it on every call we recalculate its reciprocal once every N calls.
+template<size_t N> class FixedPointDerivativeFilter
+{
+public:
+	FixedPointDerivativeFilter() noexcept { Reset(); }
+
+	void Reset() noexcept { valid = false; index = 0; velocity = 0.0; countsPerTickToPerSecond = 0.0; }
+
+	void ProcessReading(int32_t reading, uint32_t timestamp) noexcept
+	{
+		const int32_t prevReading = readings[index];
+		const uint32_t prevTimestamp = timestamps[index];
+		readings[index] = reading;
+		timestamps[index] = timestamp;
+
+		if (valid)
+		{
+			if (index == 0)
+			{
+				countsPerTickToPerSecond = (float)StepTimer::StepClockRate/(float)(timestamp - prevTimestamp);
+			}
+			velocity = (float)(reading - prevReading) * countsPerTickToPerSecond;
+		}
+
+		index = (index + 1) % N;
+		if (index == 0 && !valid)
+		{
+			valid = true;
+			countsPerTickToPerSecond = (float)StepTimer::StepClockRate/(float)(timestamp - timestamps[0]) * ((float)(N - 1)/(float)N);
+		}
+	}
+
+	float GetVelocity() const noexcept { return velocity; }
+
+private:
+	bool valid;
+	size_t index;
+	float velocity;
+	float countsPerTickToPerSecond;			// the reciprocal of the window time in seconds
+	int32_t readings[N];
+	uint32_t timestamps[N];
+};
+
+// Alpha-beta observer of position and velocity. This predicts the reading from the previous estimates and corrects them by fractions of the prediction error,
+// which gives a smoother speed at low speeds than differencing readings. The time between calls is assumed to be nearly constant, so as above we divide only occasionally.
+class AlphaBetaVelocityObserver
+{
+public:
+	static constexpr float Alpha = 0.25;	// the fraction of the prediction error applied to the position
+	static constexpr float Beta = 0.02;		// the fraction of the prediction error per loop interval applied to the velocity
+	static constexpr unsigned int CallsPerRecalc = 16;
+
+	AlphaBetaVelocityObserver() noexcept { Reset(); }
+
+	void Reset() noexcept { valid = betaValid = false; velocity = 0.0; callsSinceRecalc = 0; }
+
+	void ProcessReading(int32_t reading, uint32_t timestamp) noexcept
+	{
+		if (!valid)
+		{
+			position = (float)reading;
+			lastTimestamp = recalcTimestamp = timestamp;
+			valid = true;
+			return;
+		}
+
+		const float dt = (float)(timestamp - lastTimestamp) * (1.0/(float)StepTimer::StepClockRate);
+		lastTimestamp = timestamp;
+		++callsSinceRecalc;
+		if ((callsSinceRecalc >= CallsPerRecalc || !betaValid) && timestamp != recalcTimestamp)
+		{
+			betaOverDt = (Beta * callsSinceRecalc * (float)StepTimer::StepClockRate)/(float)(timestamp - recalcTimestamp);
+			recalcTimestamp = timestamp;
+			callsSinceRecalc = 0;
+			betaValid = true;
+		}
+
+		const float predicted = position + velocity * dt;
+		const float residual = (float)reading - predicted;
+		position = predicted + Alpha * residual;
+		velocity += betaOverDt * residual;
+	}
+
+	float GetVelocity() const noexcept { return velocity; }
+
+private:
+	bool valid;
+	bool betaValid;
+	unsigned int callsSinceRecalc;
+	float position;
+	float velocity;
+	float betaOverDt = 0.0;
+	uint32_t lastTimestamp;
+	uint32_t recalcTimestamp;
+};
+
+// Velocity estimator that times encoder edges, for quadrature encoders at low speed where the reading changes less often than once per control loop.
+// The speed is the change in reading divided by the time since the reading last changed, so we divide only when the reading changes.
+// If the reading hasn't changed for longer than the current speed implies that it should have, the speed must have fallen, so we reduce it.
+// The edge times are only known to the resolution of the control loop interval because the quadrature decoder doesn't capture them.
+class EdgeTimingVelocityEstimator
+{
+public:
+	static constexpr uint32_t MaxEdgeInterval = StepTimer::StepClockRate/10;		// if there has been no edge for this long, assume that the motor is stationary
+
+	EdgeTimingVelocityEstimator() noexcept { Reset(); }
+
+	void Reset() noexcept { valid = false; velocity = 0.0; }
+
+	void ProcessReading(int32_t reading, uint32_t timestamp) noexcept
+	{
+		if (!valid)
+		{
+			lastReading = reading;
+			lastEdgeTime = timestamp;
+			valid = true;
+			return;
+		}
+
+		const uint32_t timeSinceEdge = timestamp - lastEdgeTime;
+		if (reading != lastReading)
+		{
+			velocity = (float)(reading - lastReading) * (float)StepTimer::StepClockRate/(float)timeSinceEdge;
+			lastReading = reading;
+			lastEdgeTime = timestamp;
+		}
+		else if (timeSinceEdge >= MaxEdgeInterval)
+		{
+			velocity = 0.0;
+		}
+		else if (fabsf(velocity) * (float)timeSinceEdge > (float)StepTimer::StepClockRate)
+		{
+			velocity = (velocity > 0.0) ? (float)StepTimer::StepClockRate/(float)timeSinceEdge : -(float)StepTimer::StepClockRate/(float)timeSinceEdge;
+		}
+	}
+
+	float GetVelocity() const noexcept { return velocity; }
+
+private:
+	bool valid;
+	int32_t lastReading;
+	uint32_t lastEdgeTime;
+	float velocity;
+};
+
+#endif /* SRC_CLOSEDLOOP_VELOCITYESTIMATORS_H_ */
@@ -7,27 +7,34 @@
 
 #include "AccelerometerHandler.h"
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 
 #include <RTOSIface/RTOSIface.h>
 #include <Hardware/LIS3DH.h>
+#include <Hardware/ADXL345.h>
+#include "ResonanceAnalyser.h"
 #include <CanMessageFormats.h>
 #include <Platform.h>
 #include <TaskPriorities.h>
+#include <TaskStackSizes.h>
 #include <CanMessageBuffer.h>
 #include <CAN/CanInterface.h>
 #include <CanMessageGenericParser.h>
 #include <CanMessageGenericTables.h>
+#include <Tasks.h>
+#include <Movement/StepTimer.h>
+#include <math.h>
 
 #define TEST_PACKING	0
 
 constexpr uint16_t DefaultSamplingRate = 1000;
 constexpr uint8_t DefaultResolution = 10;
 
-constexpr size_t AccelerometerTaskStackWords = 130;
-static Task<AccelerometerTaskStackWords> *accelerometerTask;
+static Task<AccelerometerTaskStackWords> *accelerometerTask = nullptr;	// created when first needed
+[[noreturn]] void AccelerometerTaskCode(void*) noexcept;
 
-static LIS3DH *accelerometer = nullptr;
+static Accelerometer *accelerometer = nullptr;
+static ResonanceAnalyser *analyser = nullptr;				// if not null, we analyse the spectrum of each capture as well as sending the samples
 
 static uint16_t samplingRate = DefaultSamplingRate;
 static volatile uint32_t numSamplesRequested;
@@ -37,6 +44,48 @@ static volatile uint8_t axesRequested;
 static volatile bool running = false;
 static volatile bool successfulStart = false;
 static volatile bool failedStart = false;
+
+// Capture triggered by the start of a move
+enum class TriggerState : uint8_t { none, armed, triggered };
+constexpr uint32_t MaxTriggerWaitMillis = 5000;			// if no move starts within this time then we send the samples from then on anyway
+
+static bool moveTriggerEnabled = false;
+static uint32_t triggerAfterMasterTime = 0;				// if nonzero, the triggering move is the first one scheduled to start at or after this master time
+static volatile TriggerState triggerState = TriggerState::none;
+static volatile uint32_t triggerTime;					// the local step clock time at which the triggering move started
+
+// Timing of the last capture, for diagnostics
+static bool haveCaptureTiming = false;
+static bool lastCaptureTriggered = false;
+static uint32_t lastFirstSampleMasterTime;
+static uint32_t lastTriggerMasterTime;
+
+// Continuous vibration monitoring between captures
+constexpr uint16_t MonitoringSamplingRate = 400;		// the lowest rate the driver supports
+constexpr unsigned int MonitoringWindowSamples = 400;	// we produce statistics about once a second
+constexpr float CountsPerMilliG = 16.384;				// the accelerometer data is left justified and full scale is +/-2g
+
+struct VibrationStats
+{
+	int32_t sum;										// sums over the current window
+	uint64_t sumOfSquares;
+	uint16_t peak;										// largest deviation from the mean of the previous window
+	int16_t mean;										// mean of the previous window, which we take to be the gravity component
+	uint16_t rms;										// results from the last completed window in milli-g
+	uint16_t lastPeak;
+	uint16_t maxRms;									// highest values since monitoring was started
+	uint16_t maxPeak;
+};
+
+static volatile bool monitoringEnabled = false;
+static volatile bool monitoringPauseRequested = false;
+static volatile bool monitoringActive = false;			// true while the task is collecting data for monitoring
+static uint16_t rmsThreshold;							// thresholds in milli-g, zero means don't check
+static uint16_t peakThreshold;
+static bool vibrationAlarm = false;
+static uint32_t numVibrationEvents = 0;
+static VibrationStats vibrationStats[3];				// statistics for each Cartesian axis
+
 static uint8_t axisLookup[3];								// mapping from each Cartesian axis to the corresponding accelerometer axis
 static bool axisInverted[3];
 
@@ -53,12 +102,276 @@ static uint8_t TranslateAxes(uint8_t axes) noexcept
 	return rslt;
 }
 
+// Table of the axes to send, with the axis mapping and inversion precomputed so that the packing loops don't need to look them up for every sample
+struct AxisTable
+{
+	unsigned int numAxes;
+	uint8_t source[3];										// index of each axis in the accelerometer data
+	uint16_t invert[3];										// 0xFFFF if the axis is inverted, else 0
+};
+
+// State of the packing into the CAN buffer, carried over between batches of samples
+struct PackingState
+{
+	size_t canDataIndex;
+	unsigned int bitsUsed;
+	uint16_t bitsPending;
+#if TEST_PACKING
+	uint16_t pattern;
+#endif
+};
+
+static void SetUpAxisTable(AxisTable& table) noexcept
+{
+	table.numAxes = 0;
+	for (unsigned int axis = 0; axis < 3; ++axis)
+	{
+		if (axesRequested & (1u << axis))
+		{
+			table.source[table.numAxes] = axisLookup[axis];
+			table.invert[table.numAxes] = (axisInverted[axis]) ? 0xFFFF : 0;
+			++table.numAxes;
+		}
+	}
+}
+
+// Negate the value if 'invert' is 0xFFFF, mapping 0x8000 to 0x7FFF so that it doesn't overflow
+static inline uint16_t OrientValue(uint16_t val, uint16_t invert) noexcept
+{
+	const uint16_t temp = val ^ invert;
+	return (temp == 0x7FFF) ? temp : (uint16_t)(temp - invert);
+}
+
+// Pack some samples into the CAN buffer. Specialised for each resolution so that the shifts are constants and the 16-bit case has no bit packing at all.
+template<unsigned int Resolution> static void PackSamples(const uint16_t *data, unsigned int numSamples, const AxisTable& table, PackingState& state, uint16_t *dest) noexcept
+{
+	size_t canDataIndex = state.canDataIndex;
+	unsigned int bitsUsed = state.bitsUsed;
+	uint16_t bitsPending = state.bitsPending;
+	for (; numSamples != 0; --numSamples)
+	{
+		for (unsigned int i = 0; i < table.numAxes; ++i)
+		{
+#if TEST_PACKING
+			const uint16_t dataVal = state.pattern++;
+#else
+			const uint16_t dataVal = OrientValue(data[table.source[i]], table.invert[i]) >> (16u - Resolution);		// accelerometer data is left justified
+#endif
+			if (Resolution == 16u)
+			{
+				dest[canDataIndex++] = dataVal;
+			}
+			else
+			{
+				bitsPending |= dataVal << bitsUsed;
+				bitsUsed += Resolution;
+				if (bitsUsed >= 16u)
+				{
+					dest[canDataIndex++] = bitsPending;
+					bitsUsed -= 16u;
+					bitsPending = dataVal >> (Resolution - bitsUsed);
+				}
+			}
+		}
+		data += 3;
+	}
+	state.canDataIndex = canDataIndex;
+	state.bitsUsed = bitsUsed;
+	state.bitsPending = bitsPending;
+}
+
+typedef void (*PackingFunction)(const uint16_t *data, unsigned int numSamples, const AxisTable& table, PackingState& state, uint16_t *dest) noexcept;
+
+static PackingFunction GetPackingFunction(uint8_t res) noexcept
+{
+	switch (res)
+	{
+	case 8:		return PackSamples<8>;
+	case 10:	return PackSamples<10>;
+	case 12:	return PackSamples<12>;
+	default:	return PackSamples<16>;
+	}
+}
+
+static void RaiseVibrationEvent(const char *format, ...) noexcept
+{
+	va_list vargs;
+	va_start(vargs, format);
+	CanInterface::RaiseEvent(EventType::driver_warning, 0, 0, format, vargs);
+	va_end(vargs);
+}
+
+// Finish a window of monitoring samples, update the statistics and raise an event if the vibration has become excessive
+static void FinishMonitoringWindow(unsigned int numSamples) noexcept
+{
+	bool overThreshold = false, wellUnderThreshold = true;
+	for (unsigned int axis = 0; axis < 3; ++axis)
+	{
+		VibrationStats& stats = vibrationStats[axis];
+		const float mean = (float)stats.sum/numSamples;
+		const float variance = max<float>((float)stats.sumOfSquares/numSamples - fsquare(mean), 0.0);
+		stats.rms = (uint16_t)min<float>(sqrtf(variance)/CountsPerMilliG, 65535.0);
+		stats.lastPeak = (uint16_t)min<float>(stats.peak/CountsPerMilliG, 65535.0);
+		stats.maxRms = max<uint16_t>(stats.maxRms, stats.rms);
+		stats.maxPeak = max<uint16_t>(stats.maxPeak, stats.lastPeak);
+		stats.mean = (int16_t)lrintf(mean);
+		stats.sum = 0;
+		stats.sumOfSquares = 0;
+		stats.peak = 0;
+
+		if ((rmsThreshold != 0 && stats.rms > rmsThreshold) || (peakThreshold != 0 && stats.lastPeak > peakThreshold))
+		{
+			if (!vibrationAlarm && !overThreshold)
+			{
+				RaiseVibrationEvent("Vibration on %c axis RMS %umg peak %umg", "XYZ"[axis], stats.rms, stats.lastPeak);
+				++numVibrationEvents;
+			}
+			overThreshold = true;
+		}
+
+		// Use 20% hysteresis so that we don't keep sending events when the vibration is close to a threshold
+		if ((rmsThreshold != 0 && stats.rms * 5u > rmsThreshold * 4u) || (peakThreshold != 0 && stats.lastPeak * 5u > peakThreshold * 4u))
+		{
+			wellUnderThreshold = false;
+		}
+	}
+
+	if (overThreshold)
+	{
+		vibrationAlarm = true;
+	}
+	else if (wellUnderThreshold)
+	{
+		vibrationAlarm = false;
+	}
+}
+
+// Monitor the vibration continuously until we are asked to do a capture, stop or pause
+static void RunVibrationMonitoring() noexcept
+{
+	uint16_t rate = MonitoringSamplingRate;
+	uint8_t res = resolution;
+	if (!accelerometer->Configure(rate, res) || !accelerometer->StartCollecting(0x07))
+	{
+		monitoringEnabled = false;
+		return;
+	}
+
+	monitoringActive = true;
+	bool firstSample = true;
+	bool needMean = true;
+	unsigned int samplesInWindow = 0;
+	while (!running && !monitoringPauseRequested && monitoringEnabled)
+	{
+		const uint16_t *data;
+		uint16_t dataRate;
+		bool overflowed;
+		unsigned int samplesRead = accelerometer->CollectData(&data, dataRate, overflowed);
+		if (firstSample && samplesRead != 0)
+		{
+			// The first sample taken after waking up is inaccurate, so discard it
+			--samplesRead;
+			data += 3;
+			firstSample = false;
+		}
+
+		for (; samplesRead != 0; --samplesRead)
+		{
+			if (needMean)
+			{
+				// Until we have completed a window, use the first good sample as the gravity component
+				for (unsigned int axis = 0; axis < 3; ++axis)
+				{
+					vibrationStats[axis].mean = (int16_t)data[axisLookup[axis]];
+				}
+				needMean = false;
+			}
+			for (unsigned int axis = 0; axis < 3; ++axis)
+			{
+				VibrationStats& stats = vibrationStats[axis];
+				const int32_t val = (int16_t)data[axisLookup[axis]];
+				stats.sum += val;
+				stats.sumOfSquares += (uint64_t)(val * val);
+				const int32_t diff = val - stats.mean;
+				const uint16_t deviation = (uint16_t)min<int32_t>((diff < 0) ? -diff : diff, 65535);
+				if (deviation > stats.peak)
+				{
+					stats.peak = deviation;
+				}
+			}
+			data += 3;
+			if (++samplesInWindow == MonitoringWindowSamples)
+			{
+				FinishMonitoringWindow(samplesInWindow);
+				samplesInWindow = 0;
+			}
+		}
+	}
+
+	accelerometer->StopCollecting();
+	for (VibrationStats& stats : vibrationStats)
+	{
+		stats.sum = 0;
+		stats.sumOfSquares = 0;
+		stats.peak = 0;
+	}
+
+	// Restore the configuration used for captures
+	rate = samplingRate;
+	res = resolution;
+	(void)accelerometer->Configure(rate, res);
+	monitoringActive = false;
+}
+
+// Stop the accelerometer task monitoring vibration so that the main task can change the configuration, returning true if it was monitoring.
+// The caller must call ResumeMonitoring afterwards.
+static bool PauseMonitoring() noexcept
+{
+	monitoringPauseRequested = true;
+	const uint32_t startTime = millis();
+	while (monitoringActive && millis() - startTime < 500)
+	{
+		delay(2);
+	}
+	return monitoringEnabled;
+}
+
+// Wake up the accelerometer task, creating it if this is the first time it is needed
+static void WakeTask() noexcept
+{
+	if (accelerometerTask == nullptr)
+	{
+		accelerometerTask = new Task<AccelerometerTaskStackWords>;
+		accelerometerTask->Create(AccelerometerTaskCode, "ACCEL", nullptr, TaskPriority::Accelerometer);
+	}
+	accelerometerTask->Give();
+}
+
+static void ResumeMonitoring() noexcept
+{
+	monitoringPauseRequested = false;
+	if (monitoringEnabled || accelerometerTask != nullptr)
+	{
+		WakeTask();
+	}
+}
+
 [[noreturn]] void AccelerometerTaskCode(void*) noexcept
 {
 	for (;;)
 	{
-		TaskBase::Take();
-		if (running)
+		if (!running)
+		{
+			if (monitoringEnabled && !monitoringPauseRequested)
+			{
+				RunVibrationMonitoring();
+			}
+			else
+			{
+				TaskBase::Take();
+			}
+		}
+		else
 		{
 			// Collect and send the samples
 			CanMessageBuffer buf(nullptr);
@@ -68,27 +381,91 @@ static uint8_t TranslateAxes(uint8_t axes) noexcept
 			unsigned int samplesSent = 0;
 			unsigned int samplesInBuffer = 0;
 			unsigned int samplesWanted = numSamplesRequested;
-			size_t canDataIndex = 0;
-			unsigned int bitsUsed = 0;
-			uint16_t bitsPending = 0;
 			bool overflowed = false;
 
+			AxisTable axisTable;
+			SetUpAxisTable(axisTable);
+			const PackingFunction packer = GetPackingFunction(resolution);
+			PackingState packingState;
+			packingState.canDataIndex = 0;
+			packingState.bitsUsed = 0;
+			packingState.bitsPending = 0;
 #if TEST_PACKING
-			uint16_t pattern = 0;
+			packingState.pattern = 0;
 #endif
+			// We analyse the lowest numbered axis requested
+			const uint8_t analysisAxis = (axesRequested & 1u) ? 0 : (axesRequested & 2u) ? 1 : 2;
+			if (analyser != nullptr)
+			{
+				analyser->Start(samplingRate, analysisAxis);
+			}
+			uint16_t dataRate = 0;
+			uint32_t samplesCollected = 0;						// how many samples we have collected including those we discarded
+			bool waitingForTrigger = moveTriggerEnabled;
+			triggerState = (waitingForTrigger) ? TriggerState::armed : TriggerState::none;
+			haveCaptureTiming = false;
+			const uint32_t startMillis = millis();
+
 			if (accelerometer->StartCollecting(TranslateAxes(axesRequested)))
 			{
 				successfulStart = true;
 				do
 				{
-					uint16_t dataRate;
 					const uint16_t *data;
 					unsigned int samplesRead = accelerometer->CollectData(&data, dataRate, overflowed);
-					if (samplesSent + samplesInBuffer == 0 && samplesRead != 0)
+					uint32_t sampleNumber = samplesCollected;
+					samplesCollected += samplesRead;
+					if (sampleNumber == 0 && samplesRead != 0)
 					{
 						// The first sample taken after waking up is inaccurate, so discard it
 						--samplesRead;
 						data += 3;
+						++sampleNumber;
+					}
+
+					if (samplesRead != 0 && !haveCaptureTiming)
+					{
+						const uint16_t rateForTiming = (dataRate != 0) ? dataRate : samplingRate;
+						if (waitingForTrigger)
+						{
+							if (triggerState == TriggerState::triggered)
+							{
+								// Discard the samples taken before the move started
+								const uint32_t locTriggerTime = triggerTime;
+								while (samplesRead != 0 && (int32_t)(accelerometer->GetSampleTime(sampleNumber, rateForTiming) - locTriggerTime) < 0)
+								{
+									--samplesRead;
+									data += 3;
+									++sampleNumber;
+								}
+								if (samplesRead != 0)
+								{
+									waitingForTrigger = false;
+									lastCaptureTriggered = true;
+									lastTriggerMasterTime = StepTimer::ConvertToMasterTime(locTriggerTime);
+								}
+							}
+							else if (millis() - startMillis >= MaxTriggerWaitMillis)
+							{
+								waitingForTrigger = false;
+								triggerState = TriggerState::none;
+								lastCaptureTriggered = false;
+							}
+							else
+							{
+								samplesRead = 0;
+							}
+						}
+						else
+						{
+							lastCaptureTriggered = false;
+						}
+
+						if (samplesRead != 0)
+						{
+							lastFirstSampleMasterTime = StepTimer::ConvertToMasterTime(accelerometer->GetSampleTime(sampleNumber, rateForTiming));
+							haveCaptureTiming = true;
+						}
 					}
 					if (samplesRead >= samplesWanted)
 					{
@@ -97,58 +474,31 @@ static uint8_t TranslateAxes(uint8_t axes) noexcept
 
 					while (samplesRead != 0)
 					{
-						unsigned int samplesToCopy = min<unsigned int>(samplesRead, MaxSamplesInBuffer - samplesInBuffer);
-						while (samplesToCopy != 0)
+						const unsigned int samplesToCopy = min<unsigned int>(samplesRead, MaxSamplesInBuffer - samplesInBuffer);
+#if !TEST_PACKING
+						if (analyser != nullptr)
 						{
-							// Extract the required bits from the data and pack them into the CAN buffer
-							for (unsigned int axis = 0; axis < 3; ++axis)
+							const uint16_t *analysisData = data + axisLookup[analysisAxis];
+							for (unsigned int i = 0; i < samplesToCopy; ++i)
 							{
-								if (axesRequested & (1u << axis))
-								{
-									uint16_t dataVal =
-#if TEST_PACKING
-														pattern++;
-#else
-														data[axisLookup[axis]];
-									if (axisInverted[axis])
-									{
-										dataVal = (dataVal == 0x8000) ? ~dataVal : ~dataVal + 1;
-									}
-									dataVal >>= (16u - resolution);								// data from LIS3DH is left justified
-#endif
-									// Copy data for this axis
-									if (resolution == 16u)
-									{
-										msg.data[canDataIndex++] = dataVal;
-									}
-									else
-									{
-										const uint16_t val = dataVal;
-										bitsPending |= val << bitsUsed;
-										bitsUsed += resolution;
-										if (bitsUsed >= 16u)
-										{
-											msg.data[canDataIndex++] = bitsPending;
-											bitsUsed -= 16u;
-											bitsPending = val >> (resolution - bitsUsed);
-										}
-									}
-								}
+								const float val = (float)(int16_t)analysisData[3 * i];
+								analyser->AddSample((axisInverted[analysisAxis]) ? -val : val);
 							}
-							data += 3;
-
-							++samplesInBuffer;
-							--samplesToCopy;
-							--samplesWanted;
-							--samplesRead;
 						}
+#endif
+						// Extract the required bits from the data and pack them into the CAN buffer
+						packer(data, samplesToCopy, axisTable, packingState, msg.data);
+						data += 3 * samplesToCopy;
+						samplesInBuffer += samplesToCopy;
+						samplesWanted -= samplesToCopy;
+						samplesRead -= samplesToCopy;
 
 						if (samplesInBuffer == MaxSamplesInBuffer || samplesWanted == 0)
 						{
 							// Send the buffer
-							if (bitsUsed != 0)
+							if (packingState.bitsUsed != 0)
 							{
-								msg.data[canDataIndex] = bitsPending;
+								msg.data[packingState.canDataIndex] = packingState.bitsPending;
 							}
 							msg.firstSampleNumber = samplesSent;
 							msg.numSamples = samplesInBuffer;
@@ -158,14 +508,14 @@ static uint8_t TranslateAxes(uint8_t axes) noexcept
 							msg.zero = 0;
 
 							buf.dataLength = msg.GetActualDataLength();
-							CanInterface::Send(&buf);
+							CanInterface::SendQueued(buf);
 
 							samplesSent += samplesInBuffer;
 							samplesInBuffer = 0;
-							canDataIndex = 0;
+							packingState.canDataIndex = 0;
 							overflowed = false;
-							bitsUsed = 0;
-							bitsPending = 0;
+							packingState.bitsUsed = 0;
+							packingState.bitsPending = 0;
 						}
 					}
 				} while (samplesWanted != 0);
@@ -176,6 +526,11 @@ static uint8_t TranslateAxes(uint8_t axes) noexcept
 			}
 
 			accelerometer->StopCollecting();
+			triggerState = TriggerState::none;
+			if (analyser != nullptr)
+			{
+				analyser->Finish(dataRate);
+			}
 
 			// Wait for another command
 			running = false;
@@ -218,18 +573,32 @@ static bool TranslateOrientation(uint8_t input) noexcept
 // Interface functions called by the main task
 void AccelerometerHandler::Init() noexcept
 {
-	LIS3DH *temp = new LIS3DH(Platform::GetSharedI2C(), Lis3dhInt1Pin);
-	if (temp->CheckPresent())
+	Accelerometer *temp = nullptr;
+#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+	temp = new LIS3DH(Platform::GetSharedI2C(), Lis3dhInt1Pin);
+	if (!temp->CheckPresent())
 	{
-		temp->Configure(samplingRate, resolution);
-		accelerometer = temp;
-		(void)TranslateOrientation(orientation);
-		accelerometerTask = new Task<AccelerometerTaskStackWords>;
-		accelerometerTask->Create(AccelerometerTaskCode, "ACCEL", nullptr, TaskPriority::Accelerometer);
+		delete temp;
+		temp = nullptr;
 	}
-	else
+#endif
+#if SUPPORT_SPI_SENSORS && SUPPORT_ADXL345
+	if (temp == nullptr)
 	{
-		delete temp;
+		temp = new ADXL345(Platform::GetSharedSpi(), Adxl345CsPin, Adxl345Int1Pin);
+		if (!temp->CheckPresent())
+		{
+			delete temp;
+			temp = nullptr;
+		}
+	}
+#endif
+
+	if (temp != nullptr)
+	{
+		temp->Configure(samplingRate, resolution);
+		accelerometer = temp;
+		(void)TranslateOrientation(orientation);				// the task is created when we first collect data or monitor vibration, so that boards that don't use the accelerometer keep its stack free
 	}
 }
 
@@ -280,7 +649,10 @@ GCodeResult AccelerometerHandler::ProcessConfigRequest(const CanMessageGeneric&
 
 	if (seen)
 	{
-		if (!accelerometer->Configure(samplingRate, resolution))
+		(void)PauseMonitoring();
+		const bool ok = accelerometer->Configure(samplingRate, resolution);
+		ResumeMonitoring();
+		if (!ok)
 		{
 			reply.copy("Failed to configure accelerometer");
 			return GCodeResult::error;
@@ -313,7 +685,7 @@ GCodeResult AccelerometerHandler::ProcessStartRequest(const CanMessageStartAccel
 	successfulStart = false;
 	failedStart = false;
 	running = true;
-	accelerometerTask->Give();
+	WakeTask();
 	const uint32_t startTime = millis();
 	do
 	{
@@ -342,6 +714,163 @@ void AccelerometerHandler::Diagnostics(const StringRef& reply) noexcept
 		{
 			reply.cat(", INT1 error!");
 		}
+		if (!running)
+		{
+			accelerometer->AppendCollectionStats(reply);
+			if (haveCaptureTiming)
+			{
+				reply.lcatf("Last capture first sample at master time %" PRIu32, lastFirstSampleMasterTime);
+				if (lastCaptureTriggered)
+				{
+					reply.catf(", %" PRIi32 "us after the triggering move started at %" PRIu32,
+								(int32_t)(((int64_t)(int32_t)(lastFirstSampleMasterTime - lastTriggerMasterTime) * 1000000)/(int32_t)StepTimer::StepClockRate), lastTriggerMasterTime);
+				}
+				else if (moveTriggerEnabled)
+				{
+					reply.cat(", no triggering move");
+				}
+			}
+			if (analyser != nullptr)
+			{
+				analyser->AppendResults(reply);
+			}
+		}
+		if (monitoringEnabled)
+		{
+			reply.lcatf("Vibration monitoring events %" PRIu32 ", RMS/peak/max RMS/max peak mg:", numVibrationEvents);
+			for (unsigned int axis = 0; axis < 3; ++axis)
+			{
+				const VibrationStats& stats = vibrationStats[axis];
+				reply.catf(" %c %u/%u/%u/%u", "XYZ"[axis], stats.rms, stats.lastPeak, stats.maxRms, stats.maxPeak);
+				if (stats.rms != 0)
+				{
+					reply.catf(" crest %.1f", (double)((float)stats.lastPeak/(float)stats.rms));
+				}
+			}
+		}
+	}
+}
+
+// Monitor vibration continuously between captures and raise an event if the RMS or peak acceleration in milli-g on any axis exceeds the threshold, or stop monitoring if both thresholds are zero
+GCodeResult AccelerometerHandler::ConfigureMonitoring(uint32_t p_rmsThreshold, uint32_t p_peakThreshold, const StringRef& reply) noexcept
+{
+	if (accelerometer == nullptr)
+	{
+		reply.copy("Accelerometer not present");
+		return GCodeResult::error;
+	}
+	if (p_rmsThreshold > UINT16_MAX || p_peakThreshold > UINT16_MAX)
+	{
+		reply.printf("Thresholds must not exceed %umg", UINT16_MAX);
+		return GCodeResult::error;
+	}
+
+	(void)PauseMonitoring();
+	if (p_rmsThreshold == 0 && p_peakThreshold == 0)
+	{
+		monitoringEnabled = false;
+		reply.copy("Vibration monitoring stopped");
+	}
+	else
+	{
+		rmsThreshold = (uint16_t)p_rmsThreshold;
+		peakThreshold = (uint16_t)p_peakThreshold;
+		vibrationAlarm = false;
+		numVibrationEvents = 0;
+		for (VibrationStats& stats : vibrationStats)
+		{
+			stats.rms = stats.lastPeak = stats.maxRms = stats.maxPeak = 0;
+		}
+		monitoringEnabled = true;
+		reply.printf("Monitoring vibration at %uHz, RMS threshold %umg, peak threshold %umg", MonitoringSamplingRate, rmsThreshold, peakThreshold);
+	}
+	ResumeMonitoring();
+	return GCodeResult::ok;
+}
+
+// Analyse the spectrum of subsequent captures between the specified frequencies, or stop analysing if maxFrequency is zero. Report the results of the last analysis if there are any.
+GCodeResult AccelerometerHandler::ConfigureAnalysis(uint32_t minFrequency, uint32_t maxFrequency, const StringRef& reply) noexcept
+{
+	if (accelerometer == nullptr)
+	{
+		reply.copy("Accelerometer not present");
+		return GCodeResult::error;
+	}
+	if (running)
+	{
+		reply.copy("Accelerometer is busy collecting data");
+		return GCodeResult::error;
+	}
+
+	if (maxFrequency == 0)
+	{
+		if (analyser == nullptr)
+		{
+			reply.copy("Resonance analysis is not enabled");
+		}
+		else
+		{
+			analyser->AppendResults(reply);
+			DeleteObject(analyser);
+		}
+		return GCodeResult::ok;
+	}
+
+	if (minFrequency == 0 || minFrequency >= maxFrequency || maxFrequency >= samplingRate/2)
+	{
+		reply.printf("Frequency range must be within 1 to %uHz", samplingRate/2 - 1);
+		return GCodeResult::error;
+	}
+
+	if (analyser == nullptr && !Tasks::CanAllocate(sizeof(ResonanceAnalyser)))
+	{
+		reply.copy("Not enough RAM for resonance analysis");
+		return GCodeResult::error;
+	}
+	DeleteObject(analyser);
+	analyser = new ResonanceAnalyser((uint16_t)minFrequency, (uint16_t)maxFrequency);		// the range check above ensures that they fit
+	reply.printf("Analysing captures from %" PRIu32 " to %" PRIu32 "Hz", minFrequency, maxFrequency);
+	return GCodeResult::ok;
+}
+
+// Start each capture when a move starts, or stop doing so
+GCodeResult AccelerometerHandler::ConfigureMoveTrigger(bool enable, uint32_t afterMasterTime, const StringRef& reply) noexcept
+{
+	if (accelerometer == nullptr)
+	{
+		reply.copy("Accelerometer not present");
+		return GCodeResult::error;
+	}
+	if (running)
+	{
+		reply.copy("Accelerometer is busy collecting data");
+		return GCodeResult::error;
+	}
+
+	moveTriggerEnabled = enable;
+	triggerAfterMasterTime = afterMasterTime;
+	if (!enable)
+	{
+		reply.copy("Accelerometer captures start immediately");
+	}
+	else if (afterMasterTime == 0)
+	{
+		reply.copy("Accelerometer captures start at the start of the next move");
+	}
+	else
+	{
+		reply.printf("Accelerometer captures start at the start of the first move due at or after master time %" PRIu32, afterMasterTime);
+	}
+	return GCodeResult::ok;
+}
+
+// This is called by DDA::Start with interrupts disabled, so keep it short
+void AccelerometerHandler::MoveStarting(uint32_t startTime) noexcept
+{
+	if (triggerState == TriggerState::armed && (triggerAfterMasterTime == 0 || (int32_t)(StepTimer::ConvertToMasterTime(startTime) - triggerAfterMasterTime) >= 0))
+	{
+		triggerTime = startTime;
+		triggerState = TriggerState::triggered;
 	}
 }
 
@@ -10,7 +10,7 @@
 
 #include <RepRapFirmware.h>
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 
 class CanMessageGeneric;
 class CanMessageStartAccelerometer;
@@ -23,6 +23,12 @@ namespace AccelerometerHandler
 	GCodeResult ProcessConfigRequest(const CanMessageGeneric& msg, const StringRef& reply) noexcept;
 	GCodeResult ProcessStartRequest(const CanMessageStartAccelerometer& msg, const StringRef& reply) noexcept;
 	void Diagnostics(const StringRef& reply) noexcept;
+	GCodeResult ConfigureAnalysis(uint32_t minFrequency, uint32_t maxFrequency, const StringRef& reply) noexcept;
+	GCodeResult ConfigureMoveTrigger(bool enable, uint32_t afterMasterTime, const StringRef& reply) noexcept;
+	GCodeResult ConfigureMonitoring(uint32_t p_rmsThreshold, uint32_t p_peakThreshold, const StringRef& reply) noexcept;
+
+	// Called by DDA::Start with interrupts disabled
+	void MoveStarting(uint32_t startTime) noexcept;
 };
 
 #endif
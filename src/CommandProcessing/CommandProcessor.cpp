@@ -18,6 +18,7 @@
 #include <Platform.h>
 #include <Movement/Move.h>
 #include <Tasks.h>
+#include <DeadlineMonitor.h>
 #include <AnalogIn.h>
 #include <Hardware/NonVolatileMemory.h>
 #include <hpl_user_area.h>
@@ -35,7 +36,7 @@
 # endif
 #endif
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 # include "AccelerometerHandler.h"
 #endif
 
@@ -700,7 +701,7 @@ static GCodeResult InitiateReset(const CanMessageReset& msg, const StringRef& re
 
 static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& reply, uint8_t& extra)
 {
-	static constexpr uint8_t LastDiagnosticsPart = 7;				// the last diagnostics part is typeDiagnosticsPart0 + 7
+	static constexpr uint8_t LastDiagnosticsPart = 10;				// the last diagnostics part is typeDiagnosticsPart0 + 10
 
 	switch (msg.type)
 	{
@@ -815,6 +816,7 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 			if (!status.notPresent)
 			{
 				SmartDrivers::AppendDriverStatus(driver, reply);
+				reply.catf(", est. temp %.0fC", (double)Platform::GetTmcDriverTemperature(driver));
 			}
 # endif
 			reply.catf(", steps req %" PRIu32 " done %" PRIu32, DDA::stepsRequested[driver], DDA::stepsDone[driver]);
@@ -834,7 +836,8 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 #if HAS_VOLTAGE_MONITOR
 			{
 				const MinCurMax vin = Platform::GetPowerVoltages(true);
-				reply.lcatf("VIN voltage: min %.1f, current %.1f, max %.1f", (double)vin.minimum, (double)vin.current, (double)vin.maximum);
+				reply.lcatf("VIN voltage: min %.1f, current %.1f, max %.1f, under voltage events %" PRIu32,
+							(double)vin.minimum, (double)vin.current, (double)vin.maximum, Platform::GetNumUnderVoltageEvents());
 			}
 #endif
 #if HAS_12V_MONITOR
@@ -861,6 +864,7 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 		extra = LastDiagnosticsPart;
 		Heat::Diagnostics(reply);
 		CanInterface::Diagnostics(reply);
+		InputMonitor::Diagnostics(reply);
 #if 0
 		{
 			uint32_t nvmUserRow0 = *reinterpret_cast<const uint32_t*>(NVMCTRL_USER);
@@ -879,301 +883,356 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 
 	case CanMessageReturnInfo::typeDiagnosticsPart0 + 7:
 		extra = LastDiagnosticsPart;
-#if SUPPORT_I2C_SENSORS
-# if SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 		AccelerometerHandler::Diagnostics(reply);
-# endif
+#endif
+#if SUPPORT_I2C_SENSORS
 		Platform::GetSharedI2C().Diagnostics(reply);
 #endif
+#if SUPPORT_SPI_SENSORS
+		Platform::GetSharedSpi().Diagnostics(reply);
+#endif
 
 #if SUPPORT_DRIVERS
 		FilamentMonitor::GetDiagnostics(reply);
 #endif
 		break;
-	}
-	return GCodeResult::ok;
-}
-
-void CommandProcessor::Spin()
-{
-	CanMessageBuffer *buf = CanInterface::GetCanCommand(0);
-	if (buf != nullptr)
-	{
-		if (buf->id.Dst() != CanId::BroadcastAddress)
-		{
-			Platform::OnProcessingCanMessage();
-		}
-		String<StringLength500> reply;
-		const StringRef& replyRef = reply.GetRef();
-		const CanMessageType id = buf->id.MsgType();
-		GCodeResult rslt;
-		CanRequestId requestId;
-		uint8_t extra = 0;
-
-		switch (id)
-		{
-		case CanMessageType::sensorTemperaturesReport:
-			requestId = CanRequestIdNoReplyNeeded;
-			Heat::ProcessRemoteSensorsReport(buf->id.Src(), buf->msg.sensorTemperaturesBroadcast);
-			break;
-
-		case CanMessageType::returnInfo:
-			requestId = buf->msg.getInfo.requestId;
-			rslt = GetInfo(buf->msg.getInfo, replyRef, extra);
-			break;
 
-		case CanMessageType::heaterModelNewNew:
-			requestId = buf->msg.heaterModelNewNew.requestId;
-			rslt = Heat::ProcessM307New(buf->msg.heaterModelNewNew, replyRef);
-			break;
-
-		case CanMessageType::setHeaterTemperature:
-			requestId = buf->msg.setTemp.requestId;
-			rslt = Heat::SetTemperature(buf->msg.setTemp, replyRef);
-			break;
-
-		case CanMessageType::heaterTuningCommand:
-			requestId = buf->msg.heaterTuningCommand.requestId;
-			rslt = Heat::TuningCommand(buf->msg.heaterTuningCommand, replyRef);
-			break;
-
-		case CanMessageType::m308New:
-			requestId = buf->msg.generic.requestId;
-			rslt = Heat::ProcessM308(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::m950Fan:
-			requestId = buf->msg.generic.requestId;
-			rslt = FansManager::ConfigureFanPort(buf->msg.generic, replyRef);
-			break;
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 8:
+		extra = LastDiagnosticsPart;
+#if SUPPORT_DRIVERS
+		moveInstance->TimingDiagnostics(reply);
+#endif
+		break;
 
-		case CanMessageType::m950Heater:
-			requestId = buf->msg.generic.requestId;
-			rslt = Heat::ConfigureHeater(buf->msg.generic, replyRef);
-			break;
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 9:
+		extra = LastDiagnosticsPart;
+		CanInterface::TrafficDiagnostics(reply);
+		break;
 
-		case CanMessageType::heaterFeedForward:
-			requestId = buf->msg.heaterFeedForward.requestId;
-			rslt = Heat::FeedForward(buf->msg.heaterFeedForward, replyRef);
-			break;
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 10:
+		extra = LastDiagnosticsPart;
+		DeadlineMonitor::Diagnostics(reply);
+		break;
+	}
+	return GCodeResult::ok;
+}
 
-		case CanMessageType::m950Gpio:
-			requestId = buf->msg.generic.requestId;
-			rslt = GpioPorts::HandleM950Gpio(buf->msg.generic, replyRef);
-			break;
+// Command dispatch table. Each handler sets the request ID to reply to and returns the result code, with any reply text in 'reply'.
+typedef GCodeResult (*CommandHandler)(CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t& extra);
 
-		case CanMessageType::writeGpio:
-			requestId = buf->msg.writeGpio.requestId;
-			rslt = GpioPorts::HandleGpioWrite(buf->msg.writeGpio, replyRef);
-			break;
+struct CommandTableEntry
+{
+	CanMessageType type;
+	CommandHandler handler;
+};
 
+// The commonest messages during startup configuration come first, because we search the table in order
+static const CommandTableEntry commandTable[] =
+{
+	{ CanMessageType::m308New, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.generic.requestId; return Heat::ProcessM308(buf->msg.generic, reply); } },
+	{ CanMessageType::m950Fan, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.generic.requestId; return FansManager::ConfigureFanPort(buf->msg.generic, reply); } },
+	{ CanMessageType::m950Heater, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.generic.requestId; return Heat::ConfigureHeater(buf->msg.generic, reply); } },
+	{ CanMessageType::m950Gpio, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.generic.requestId; return GpioPorts::HandleM950Gpio(buf->msg.generic, reply); } },
 #if SUPPORT_DRIVERS
-		case CanMessageType::setMotorCurrents:
-			requestId = buf->msg.multipleDrivesRequestFloat.requestId;
-			rslt = SetMotorCurrents(buf->msg.multipleDrivesRequestFloat, buf->dataLength, replyRef);
-			break;
-
-		case CanMessageType::m569:
-			requestId = buf->msg.generic.requestId;
-			rslt = ProcessM569(buf->msg.generic, replyRef);
-			break;
+	{ CanMessageType::m569, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.generic.requestId; return ProcessM569(buf->msg.generic, reply); } },
+#endif
+	{ CanMessageType::returnInfo, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t& extra)
+		{ requestId = buf->msg.getInfo.requestId; return GetInfo(buf->msg.getInfo, reply, extra); } },
+	{ CanMessageType::heaterModelNewNew, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.heaterModelNewNew.requestId; return Heat::ProcessM307New(buf->msg.heaterModelNewNew, reply); } },
+	{ CanMessageType::setHeaterTemperature, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.setTemp.requestId; return Heat::SetTemperature(buf->msg.setTemp, reply); } },
+	{ CanMessageType::heaterTuningCommand, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.heaterTuningCommand.requestId; return Heat::TuningCommand(buf->msg.heaterTuningCommand, reply); } },
+	{ CanMessageType::heaterFeedForward, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.heaterFeedForward.requestId; return Heat::FeedForward(buf->msg.heaterFeedForward, reply); } },
+	{ CanMessageType::writeGpio, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.writeGpio.requestId; return GpioPorts::HandleGpioWrite(buf->msg.writeGpio, reply); } },
 
-		case CanMessageType::m569p1:
+#if SUPPORT_DRIVERS
+	{ CanMessageType::setMotorCurrents, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.multipleDrivesRequestFloat.requestId; return SetMotorCurrents(buf->msg.multipleDrivesRequestFloat, buf->dataLength, reply); } },
+	{ CanMessageType::m569p1, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{
 			requestId = buf->msg.generic.requestId;
 # if SUPPORT_CLOSED_LOOP
-			rslt = ClosedLoop::ProcessM569Point1(buf->msg.generic, replyRef);
+			return ClosedLoop::ProcessM569Point1(buf->msg.generic, reply);
 # else
-			rslt = GCodeResult::errorNotSupported;
+			(void)reply;
+			return GCodeResult::errorNotSupported;
 # endif
-			break;
-
-		case CanMessageType::m569p2:		// read/write smart driver register
-			requestId = buf->msg.generic.requestId;
-			rslt = ProcessM569Point2(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::m569p6:
+		} },
+	{ CanMessageType::m569p2, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)		// read/write smart driver register
+		{ requestId = buf->msg.generic.requestId; return ProcessM569Point2(buf->msg.generic, reply); } },
+	{ CanMessageType::m569p6, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{
 			requestId = buf->msg.generic.requestId;
 # if SUPPORT_CLOSED_LOOP
-			rslt = ClosedLoop::ProcessM569Point6(buf->msg.generic, replyRef);
+			return ClosedLoop::ProcessM569Point6(buf->msg.generic, reply);
 # else
-			rslt = GCodeResult::errorNotSupported;
+			(void)reply;
+			return GCodeResult::errorNotSupported;
 # endif
-			break;
-
-		case CanMessageType::m569p7:
-			requestId = buf->msg.generic.requestId;
-			rslt = Platform::ProcessM569Point7(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::setStandstillCurrentFactor:
-			requestId = buf->msg.multipleDrivesRequestFloat.requestId;
-			rslt = SetStandstillCurrentFactor(buf->msg.multipleDrivesRequestFloat, buf->dataLength, replyRef);
-			break;
-
-		case CanMessageType::setStepsPerMmAndMicrostepping:
+		} },
+	{ CanMessageType::m569p7, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.generic.requestId; return Platform::ProcessM569Point7(buf->msg.generic, reply); } },
+	{ CanMessageType::setStandstillCurrentFactor, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.multipleDrivesRequestFloat.requestId; return SetStandstillCurrentFactor(buf->msg.multipleDrivesRequestFloat, buf->dataLength, reply); } },
+	{ CanMessageType::setStepsPerMmAndMicrostepping, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{
 			requestId = buf->msg.multipleDrivesStepsPerUnitAndMicrostepping.requestId;
-			rslt = SetStepsPerMmAndMicrostepping(buf->msg.multipleDrivesStepsPerUnitAndMicrostepping, buf->dataLength, replyRef);
-			break;
-
-		case CanMessageType::setDriverStates:
-			requestId = buf->msg.multipleDrivesRequestUint16.requestId;
-			rslt = HandleSetDriverStates(buf->msg.multipleDrivesRequestDriverState, replyRef);
-			break;
-
-		case CanMessageType::m915:
-			requestId = buf->msg.generic.requestId;
-			rslt = ProcessM915(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::setPressureAdvance:
-			requestId = buf->msg.multipleDrivesRequestFloat.requestId;
-			rslt = HandlePressureAdvance(buf->msg.multipleDrivesRequestFloat, buf->dataLength, replyRef);
-			break;
+			return SetStepsPerMmAndMicrostepping(buf->msg.multipleDrivesStepsPerUnitAndMicrostepping, buf->dataLength, reply);
+		} },
+	{ CanMessageType::setDriverStates, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.multipleDrivesRequestUint16.requestId; return HandleSetDriverStates(buf->msg.multipleDrivesRequestDriverState, reply); } },
+	{ CanMessageType::m915, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.generic.requestId; return ProcessM915(buf->msg.generic, reply); } },
+	{ CanMessageType::setPressureAdvance, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.multipleDrivesRequestFloat.requestId; return HandlePressureAdvance(buf->msg.multipleDrivesRequestFloat, buf->dataLength, reply); } },
 #endif
 
-		case CanMessageType::updateFirmware:
-			requestId = buf->msg.updateYourFirmware.requestId;
-			rslt = InitiateFirmwareUpdate(buf->msg.updateYourFirmware, replyRef);
-			break;
-
-		case CanMessageType::reset:
-			requestId = buf->msg.reset.requestId;
-			rslt = InitiateReset(buf->msg.reset, replyRef);
-			break;
-
-		case CanMessageType::fanParameters:
-			requestId = buf->msg.fanParameters.requestId;
-			rslt = FansManager::ConfigureFan(buf->msg.fanParameters, replyRef);
-			break;
+	{ CanMessageType::updateFirmware, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.updateYourFirmware.requestId; return InitiateFirmwareUpdate(buf->msg.updateYourFirmware, reply); } },
+	{ CanMessageType::reset, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.reset.requestId; return InitiateReset(buf->msg.reset, reply); } },
+	{ CanMessageType::fanParameters, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.fanParameters.requestId; return FansManager::ConfigureFan(buf->msg.fanParameters, reply); } },
+	{ CanMessageType::setFanSpeed, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.setFanSpeed.requestId; return FansManager::SetFanSpeed(buf->msg.setFanSpeed, reply); } },
+	{ CanMessageType::setHeaterFaultDetection, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.setHeaterFaultDetection.requestId; return Heat::SetFaultDetection(buf->msg.setHeaterFaultDetection, reply); } },
+	{ CanMessageType::setHeaterMonitors, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.setHeaterMonitors.requestId; return Heat::SetHeaterMonitors(buf->msg.setHeaterMonitors, reply); } },
+	{ CanMessageType::createInputMonitor, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t& extra)
+		{ requestId = buf->msg.createInputMonitor.requestId; return InputMonitor::Create(buf->msg.createInputMonitor, buf->dataLength, reply, extra); } },
+	{ CanMessageType::changeInputMonitor, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t& extra)
+		{ requestId = buf->msg.changeInputMonitor.requestId; return InputMonitor::Change(buf->msg.changeInputMonitor, reply, extra); } },
+	{ CanMessageType::setAddressAndNormalTiming, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.setAddressAndNormalTiming.requestId; return CanInterface::ChangeAddressAndDataRate(buf->msg.setAddressAndNormalTiming, reply); } },
+	{ CanMessageType::diagnosticTest, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.diagnosticTest.requestId; return Platform::DoDiagnosticTest(buf->msg.diagnosticTest, reply); } },
 
-		case CanMessageType::setFanSpeed:
-			requestId = buf->msg.setFanSpeed.requestId;
-			rslt = FansManager::SetFanSpeed(buf->msg.setFanSpeed, replyRef);
-			break;
+#if SUPPORT_DRIVERS
+	{ CanMessageType::createFilamentMonitor, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.createFilamentMonitor.requestId; return FilamentMonitor::Create(buf->msg.createFilamentMonitor, reply); } },
+	{ CanMessageType::deleteFilamentMonitor, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.deleteFilamentMonitor.requestId; return FilamentMonitor::Delete(buf->msg.deleteFilamentMonitor, reply); } },
+	{ CanMessageType::configureFilamentMonitor, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.generic.requestId; return FilamentMonitor::Configure(buf->msg.generic, reply); } },
+#endif
 
-		case CanMessageType::setHeaterFaultDetection:
-			requestId = buf->msg.setHeaterFaultDetection.requestId;
-			rslt = Heat::SetFaultDetection(buf->msg.setHeaterFaultDetection, replyRef);
-			break;
+#if SUPPORT_CLOSED_LOOP
+	{ CanMessageType::startClosedLoopDataCollection, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.startClosedLoopDataCollection.requestId; return ClosedLoop::ProcessM569Point5(buf->msg.startClosedLoopDataCollection, reply); } },
+#endif
 
-		case CanMessageType::setHeaterMonitors:
-			requestId = buf->msg.setHeaterMonitors.requestId;
-			rslt = Heat::SetHeaterMonitors(buf->msg.setHeaterMonitors, replyRef);
-			break;
+#if SUPPORT_ACCELEROMETERS
+	{ CanMessageType::accelerometerConfig, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.generic.requestId; return AccelerometerHandler::ProcessConfigRequest(buf->msg.generic, reply); } },
+	{ CanMessageType::startAccelerometer, [](CanMessageBuffer *buf, CanRequestId& requestId, const StringRef& reply, uint8_t&)
+		{ requestId = buf->msg.startAccelerometer.requestId; return AccelerometerHandler::ProcessStartRequest(buf->msg.startAccelerometer, reply); } },
+#endif
+};
 
-		case CanMessageType::createInputMonitor:
-			requestId = buf->msg.createInputMonitor.requestId;
-			rslt = InputMonitor::Create(buf->msg.createInputMonitor, buf->dataLength, replyRef, extra);
-			break;
+// Replies that don't fit in one CAN frame are sent a few fragments at a time, interleaved with processing other commands, so that the commands queued behind a long reply
+// such as a part of M122 don't have to wait for all of it to be sent, and CommandProcessor::Spin returns to the main loop in between.
+// Each stream keeps the buffer that the request arrived in and reuses it for every fragment.
+class ReplyStream
+{
+public:
+	bool IsBusy() const noexcept { return buf != nullptr; }
+	bool StartedBefore(const ReplyStream& other) const noexcept { return (int32_t)(startNumber - other.startNumber) < 0; }
+	StringRef GetText() noexcept { return text.GetRef(); }
+	void Start(CanMessageBuffer *p_buf, CanRequestId requestId, GCodeResult rslt, uint8_t extra) noexcept;
+	bool SendFragments(unsigned int maxFragments) noexcept;
+
+private:
+	CanMessageBuffer *buf = nullptr;
+	CanMessageStandardReply *msg;
+	String<StringLength500> text;
+	size_t lengthDone;
+	uint32_t startNumber;									// which reply this is, so that we can tell which of two busy streams is older
+	uint8_t fragmentNumber;
+
+	static uint32_t numStarted;
+};
+
+constexpr size_t NumReplyStreams = 2;
+constexpr unsigned int FragmentsPerTurn = 2;				// how many fragments of a reply we send before looking for other work
+
+static ReplyStream replyStreams[NumReplyStreams];
+uint32_t ReplyStream::numStarted = 0;
+
+// Set up the reply message header in the buffer that the request arrived in. The reply text must already be in the stream.
+void ReplyStream::Start(CanMessageBuffer *p_buf, CanRequestId requestId, GCodeResult rslt, uint8_t extra) noexcept
+{
+	const CanAddress srcAddress = p_buf->id.Src();
+	msg = p_buf->SetupResponseMessage<CanMessageStandardReply>(requestId, CanInterface::GetCanAddress(), srcAddress);
+	msg->resultCode = (uint16_t)rslt;
+	msg->extra = extra;
+	lengthDone = 0;
+	fragmentNumber = 0;
+	startNumber = numStarted++;
+	buf = p_buf;
+}
 
-		case CanMessageType::changeInputMonitor:
-			requestId = buf->msg.changeInputMonitor.requestId;
-			rslt = InputMonitor::Change(buf->msg.changeInputMonitor, replyRef, extra);
-			break;
+// Send up to maxFragments fragments of the reply. When we have sent the last one, free the buffer and return true.
+bool ReplyStream::SendFragments(unsigned int maxFragments) noexcept
+{
+	const size_t totalLength = text.strlen();
+	for (;;)
+	{
+		const size_t fragmentLength = min<size_t>(totalLength - lengthDone, CanMessageStandardReply::MaxTextLength);
+		memcpy(msg->text, text.c_str() + lengthDone, fragmentLength);
+		lengthDone += fragmentLength;
+		buf->dataLength = msg->GetActualDataLength(fragmentLength);
+		msg->fragmentNumber = fragmentNumber;
+		if (lengthDone == totalLength)
+		{
+			msg->moreFollows = false;
+			CanInterface::SendAndFree(buf, CanBufferClass::command);
+			buf = nullptr;
+			text.Clear();
+			return true;
+		}
+		msg->moreFollows = true;
+		CanInterface::Send(buf);
+		++fragmentNumber;
+		if (--maxFragments == 0)
+		{
+			return false;
+		}
+	}
+}
 
-		case CanMessageType::readInputsRequest:
-			// This one has its own reply message type
-			InputMonitor::ReadInputs(buf);
-			CanInterface::SendAndFree(buf);
-			return;
+// Get a free reply stream. If they are all busy, finish sending the oldest reply.
+static ReplyStream& GetFreeReplyStream() noexcept
+{
+	ReplyStream *oldest = nullptr;
+	for (ReplyStream& rs : replyStreams)
+	{
+		if (!rs.IsBusy())
+		{
+			return rs;
+		}
+		if (oldest == nullptr || rs.StartedBefore(*oldest))
+		{
+			oldest = &rs;
+		}
+	}
 
-		case CanMessageType::setAddressAndNormalTiming:
-			requestId = buf->msg.setAddressAndNormalTiming.requestId;
-			rslt = CanInterface::ChangeAddressAndDataRate(buf->msg.setAddressAndNormalTiming, replyRef);
-			break;
+	while (!oldest->SendFragments(FragmentsPerTurn)) { }
+	return *oldest;
+}
 
-#if 0
-		case CanMessageType::setFastTiming:
-			requestId = buf->msg.setFastTiming.requestId;
-			rslt = CanInterface::SetFastTiming(buf->msg.setFastTiming, replyRef);
-			break;
-#endif
+// Process a command that gets a standard reply. The reply text is built in a free reply stream, so the commands that don't need one don't pay for it.
+static void ProcessStandardCommand(CanMessageBuffer *buf, CommandHandler handler) noexcept
+{
+	ReplyStream& rs = GetFreeReplyStream();
+	const StringRef reply = rs.GetText();
+	CanRequestId requestId;
+	uint8_t extra = 0;
+	GCodeResult rslt;
+	if (handler != nullptr)
+	{
+		rslt = handler(buf, requestId, reply, extra);
+	}
+	else
+	{
+		requestId = CanRequestIdAcceptAlways;
+		reply.printf("Board %u received unknown msg type %u", CanInterface::GetCanAddress(), (unsigned int)buf->id.MsgType());
+		rslt = GCodeResult::error;
+	}
 
-		case CanMessageType::diagnosticTest:
-			requestId = buf->msg.diagnosticTest.requestId;
-			rslt = Platform::DoDiagnosticTest(buf->msg.diagnosticTest, replyRef);
-			break;
+	if (requestId == CanRequestIdNoReplyNeeded)
+	{
+		reply.Clear();
+		CanInterface::FreeBuffer(buf, CanBufferClass::command);		// no reply wanted so discard the response and free the buffer
+	}
+	else
+	{
+		rs.Start(buf, requestId, rslt, extra);
+		(void)rs.SendFragments(FragmentsPerTurn);
+	}
+}
 
-#if SUPPORT_DRIVERS
-		case CanMessageType::createFilamentMonitor:
-			requestId = buf->msg.createFilamentMonitor.requestId;
-			rslt = FilamentMonitor::Create(buf->msg.createFilamentMonitor, replyRef);
-			break;
+// Process one command and free its buffer
+static void ProcessCommand(CanMessageBuffer *buf) noexcept
+{
+	if (buf->id.Dst() != CanId::BroadcastAddress)
+	{
+		Platform::OnProcessingCanMessage();
+	}
 
-		case CanMessageType::deleteFilamentMonitor:
-			requestId = buf->msg.deleteFilamentMonitor.requestId;
-			rslt = FilamentMonitor::Delete(buf->msg.deleteFilamentMonitor, replyRef);
-			break;
+	const CanMessageType id = buf->id.MsgType();
+	switch (id)
+	{
+	// First the messages that don't get a standard reply
+	case CanMessageType::sensorTemperaturesReport:
+		Heat::ProcessRemoteSensorsReport(buf->id.Src(), buf->msg.sensorTemperaturesBroadcast);
+		CanInterface::FreeBuffer(buf, CanBufferClass::command);
+		return;
+
+	case CanMessageType::readInputsRequest:
+		// This one has its own reply message type
+		InputMonitor::ReadInputs(buf);
+		CanInterface::SendAndFree(buf, CanBufferClass::command);
+		return;
 
-		case CanMessageType::configureFilamentMonitor:
-			requestId = buf->msg.generic.requestId;
-			rslt = FilamentMonitor::Configure(buf->msg.generic, replyRef);
-			break;
-#endif
+	default:
+		break;
+	}
 
-#if SUPPORT_CLOSED_LOOP
-		case CanMessageType::startClosedLoopDataCollection:
-			requestId = buf->msg.startClosedLoopDataCollection.requestId;
-			rslt = ClosedLoop::ProcessM569Point5(buf->msg.startClosedLoopDataCollection, replyRef);
-			break;
-#endif
+	for (const CommandTableEntry& entry : commandTable)
+	{
+		if (entry.type == id)
+		{
+			ProcessStandardCommand(buf, entry.handler);
+			return;
+		}
+	}
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
-		case CanMessageType::accelerometerConfig:
-			requestId = buf->msg.generic.requestId;
-			rslt = AccelerometerHandler::ProcessConfigRequest(buf->msg.generic, replyRef);
-			break;
+	// We received a message type that we don't recognise. If it's a broadcast, ignore it. If it's addressed to us, send a reply.
+	if (buf->id.Src() != CanInterface::GetCanAddress())
+	{
+		CanInterface::FreeBuffer(buf, CanBufferClass::command);
+		return;
+	}
+	ProcessStandardCommand(buf, nullptr);
+}
 
-		case CanMessageType::startAccelerometer:
-			requestId = buf->msg.startAccelerometer.requestId;
-			rslt = AccelerometerHandler::ProcessStartRequest(buf->msg.startAccelerometer, replyRef);
-			break;
-#endif
-		default:
-			// We received a message type that we don't recognise. If it's a broadcast, ignore it. If it's addressed to us, send a reply.
-			if (buf->id.Src() != CanInterface::GetCanAddress())
-			{
-				CanMessageBuffer::Free(buf);
-				return;
-			}
-			requestId = CanRequestIdAcceptAlways;
-			reply.printf("Board %u received unknown msg type %u", CanInterface::GetCanAddress(), (unsigned int)buf->id.MsgType());
-			rslt = GCodeResult::error;
+// Process all the commands that are waiting, so that a burst of configuration commands doesn't have to wait for the rest of the main loop between commands.
+// Then send the next few fragments of any long replies.
+// If there is no command waiting and no reply to send, wait up to idleTimeout milliseconds for a command so that the processor can sleep.
+void CommandProcessor::Spin(uint32_t idleTimeout)
+{
+	for (const ReplyStream& rs : replyStreams)
+	{
+		if (rs.IsBusy())
+		{
+			idleTimeout = 0;
 			break;
 		}
+	}
 
-		if (requestId == CanRequestIdNoReplyNeeded)
-		{
-			CanMessageBuffer::Free(buf);					// no reply wanted so discard the response and free the buffer
-		}
-		else
+	CanMessageBuffer *buf = CanInterface::GetCanCommand(idleTimeout);
+	while (buf != nullptr)
+	{
+		ProcessCommand(buf);
+		buf = CanInterface::GetCanCommand(0);
+	}
+
+	for (ReplyStream& rs : replyStreams)
+	{
+		if (rs.IsBusy())
 		{
-			// Re-use the message buffer to send a standard reply
-			const CanAddress srcAddress = buf->id.Src();
-			CanMessageStandardReply *msg = buf->SetupResponseMessage<CanMessageStandardReply>(requestId, CanInterface::GetCanAddress(), srcAddress);
-			msg->resultCode = (uint16_t)rslt;
-			msg->extra = extra;
-			const size_t totalLength = reply.strlen();
-			size_t lengthDone = 0;
-			uint8_t fragmentNumber = 0;
-			for (;;)
-			{
-				const size_t fragmentLength = min<size_t>(totalLength - lengthDone, CanMessageStandardReply::MaxTextLength);
-				memcpy(msg->text, reply.c_str() + lengthDone, fragmentLength);
-				lengthDone += fragmentLength;
-				buf->dataLength = msg->GetActualDataLength(fragmentLength);
-				msg->fragmentNumber = fragmentNumber;
-				if (lengthDone == totalLength)
-				{
-					msg->moreFollows = false;
-					CanInterface::SendAndFree(buf);
-					break;
-				}
-				msg->moreFollows = true;
-				CanInterface::Send(buf);
-				++fragmentNumber;
-			}
+			(void)rs.SendFragments(FragmentsPerTurn);
 		}
 	}
 }
@@ -12,7 +12,7 @@
 
 namespace CommandProcessor
 {
-	void Spin();
+	void Spin(uint32_t idleTimeout);
 }
 
 #endif /* SRC_COMMANDPROCESSING_COMMANDPROCESSOR_H_ */
@@ -0,0 +1,92 @@
+/*
+ * CompactDiagnostics.h
+ */
+
+#ifndef SRC_COMMANDPROCESSING_COMPACTDIAGNOSTICS_H_
+#define SRC_COMMANDPROCESSING_COMPACTDIAGNOSTICS_H_
+
+#include <RepRapFirmware.h>
+
+// Builder for the compact machine-readable diagnostics report, which is cheap to produce and to parse so that it can be polled often.
+// The reply to a diagnostic request has to be a string, so the values are encoded as hex numbers without leading zeros rather than as binary.
+// The format is "D<version>" followed by sections, each being ';' then a section letter then comma-separated fields. Fields within a compound field are separated by ':'.
+// Fields are only ever added to the end of a section, and the version is increased if the meaning of an existing field changes.
+class CompactDiagnostics
+{
+public:
+	static constexpr unsigned int Version = 1;
+
+	CompactDiagnostics(const StringRef& p_reply) noexcept : reply(p_reply), needSeparator(false)
+	{
+		reply.printf("D%u", Version);
+	}
+
+	void StartSection(char tag) noexcept
+	{
+		reply.cat(';');
+		reply.cat(tag);
+		needSeparator = false;
+	}
+
+	void Add(uint32_t val) noexcept
+	{
+		Separate(',');
+		AppendHex(val);
+	}
+
+	void Add(int32_t val) noexcept
+	{
+		Separate(',');
+		if (val < 0)
+		{
+			reply.cat('-');
+			AppendHex((uint32_t)-val);
+		}
+		else
+		{
+			AppendHex((uint32_t)val);
+		}
+	}
+
+	// Add a further part of a compound field
+	void AddPart(uint32_t val) noexcept
+	{
+		reply.cat(':');
+		AppendHex(val);
+	}
+
+	// Add a name, which must not contain any of the separator characters
+	void AddName(const char *name) noexcept
+	{
+		Separate(',');
+		reply.cat(name);
+	}
+
+private:
+	void Separate(char c) noexcept
+	{
+		if (needSeparator)
+		{
+			reply.cat(c);
+		}
+		needSeparator = true;
+	}
+
+	void AppendHex(uint32_t val) noexcept
+	{
+		char buf[9];
+		char *p = buf + sizeof(buf);
+		*--p = 0;
+		do
+		{
+			*--p = "0123456789abcdef"[val & 0x0F];
+			val >>= 4;
+		} while (val != 0);
+		reply.cat(p);
+	}
+
+	const StringRef& reply;
+	bool needSeparator;
+};
+
+#endif /* SRC_COMMANDPROCESSING_COMPACTDIAGNOSTICS_H_ */
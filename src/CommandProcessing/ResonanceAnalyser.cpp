@@ -0,0 +1,149 @@
+/*
+ * ResonanceAnalyser.cpp
+ */
+
+#include "ResonanceAnalyser.h"
+
+#if SUPPORT_ACCELEROMETERS
+
+#include <math.h>
+
+constexpr float CountsPerG = 16384.0;					// the accelerometer data is left justified and full scale is +/-2g
+
+ResonanceAnalyser::ResonanceAnalyser(uint16_t p_minFrequency, uint16_t p_maxFrequency) noexcept
+	: windowSum(0.0), frequencyScale(1.0), numBlocks(0), minFrequency(p_minFrequency), maxFrequency(p_maxFrequency), blockIndex(0), nominalRate(0), axis(0)
+{
+	numBins = min<unsigned int>(MaxBins, maxFrequency - minFrequency + 1);
+	binSpacing = (numBins > 1) ? (float)(maxFrequency - minFrequency)/(numBins - 1) : 0.0;
+	for (size_t i = 0; i < BlockLength/2; ++i)
+	{
+		window[i] = 0.5 - 0.5 * cosf((TwoPi * i)/(BlockLength - 1));
+		windowSum += 2.0 * window[i];
+	}
+}
+
+// Prepare to analyse a new capture
+void ResonanceAnalyser::Start(uint16_t nominalSampleRate, uint8_t p_axis) noexcept
+{
+	axis = p_axis;
+	nominalRate = nominalSampleRate;
+	for (size_t i = 0; i < numBins; ++i)
+	{
+		coefficients[i] = 2.0 * cosf((TwoPi * (minFrequency + i * binSpacing))/nominalSampleRate);
+		s1[i] = s2[i] = power[i] = 0.0;
+	}
+	numBlocks = 0;
+	blockIndex = 0;
+	blockTotal = 0.0;
+	offset = 0.0;
+	frequencyScale = 1.0;
+}
+
+// Process one sample. This is called by the accelerometer task for every sample it sends, so we keep it as short as we can.
+void ResonanceAnalyser::AddSample(float val) noexcept
+{
+	if (numBlocks == 0 && blockIndex == 0)
+	{
+		offset = val;									// best estimate of the gravity component we have until we complete a block
+	}
+	blockTotal += val;
+	const float x = (val - offset) * window[(blockIndex < BlockLength/2) ? blockIndex : BlockLength - 1 - blockIndex];
+	for (size_t i = 0; i < numBins; ++i)
+	{
+		const float s = x + coefficients[i] * s1[i] - s2[i];
+		s2[i] = s1[i];
+		s1[i] = s;
+	}
+	if (++blockIndex == BlockLength)
+	{
+		FinishBlock();
+	}
+}
+
+void ResonanceAnalyser::FinishBlock() noexcept
+{
+	for (size_t i = 0; i < numBins; ++i)
+	{
+		power[i] += fsquare(s1[i]) + fsquare(s2[i]) - coefficients[i] * s1[i] * s2[i];
+		s1[i] = s2[i] = 0.0;
+	}
+	++numBlocks;
+	offset = blockTotal/BlockLength;
+	blockTotal = 0.0;
+	blockIndex = 0;
+}
+
+// Finish the analysis. The sample rate the accelerometer actually achieved is not exactly the nominal one, so we scale the bin frequencies accordingly.
+void ResonanceAnalyser::Finish(uint16_t actualSampleRate) noexcept
+{
+	frequencyScale = (actualSampleRate != 0 && nominalRate != 0) ? (float)actualSampleRate/(float)nominalRate : 1.0;
+}
+
+// Report the peaks and the spectrum of the last capture analysed
+void ResonanceAnalyser::AppendResults(const StringRef& reply) const noexcept
+{
+	reply.lcatf("Resonance analysis %u to %uHz: ", minFrequency, maxFrequency);
+	if (numBlocks == 0)
+	{
+		reply.cat("no data");
+		return;
+	}
+
+	// Find the peaks, largest first
+	size_t peaks[MaxPeaks];
+	size_t numPeaks = 0;
+	float maxPower = 0.0;
+	for (size_t i = 0; i < numBins; ++i)
+	{
+		maxPower = max<float>(maxPower, power[i]);
+		if ((i == 0 || power[i] > power[i - 1]) && (i + 1 == numBins || power[i] >= power[i + 1]))
+		{
+			size_t j = numPeaks;
+			while (j != 0 && power[peaks[j - 1]] < power[i])
+			{
+				if (j < MaxPeaks)
+				{
+					peaks[j] = peaks[j - 1];
+				}
+				--j;
+			}
+			if (j < MaxPeaks)
+			{
+				peaks[j] = i;
+				if (numPeaks < MaxPeaks)
+				{
+					++numPeaks;
+				}
+			}
+		}
+	}
+
+	reply.catf("%" PRIu32 " blocks on %c axis, peaks", numBlocks, "XYZ"[axis]);
+	for (size_t p = 0; p < numPeaks; ++p)
+	{
+		// Interpolate the peak position by fitting a parabola through it and its neighbours
+		const size_t i = peaks[p];
+		float bin = i;
+		if (i != 0 && i + 1 < numBins)
+		{
+			const float denominator = power[i - 1] - 2.0 * power[i] + power[i + 1];
+			if (denominator < 0.0)
+			{
+				bin += 0.5 * (power[i - 1] - power[i + 1])/denominator;
+			}
+		}
+		const float amplitude = 2.0 * sqrtf(power[i]/numBlocks)/(windowSum * CountsPerG);
+		reply.catf(" %.1fHz %.1fmg", (double)GetBinFrequency(bin), (double)(amplitude * 1000.0));
+	}
+
+	// Append the spectrum as a percentage of the largest bin
+	reply.cat(", relative power %");
+	for (size_t i = 0; i < numBins; ++i)
+	{
+		reply.catf(" %u", (maxPower > 0.0) ? (unsigned int)lrintf((power[i] * 100.0)/maxPower) : 0u);
+	}
+}
+
+#endif
+
+// End
@@ -0,0 +1,57 @@
+/*
+ * ResonanceAnalyser.h
+ */
+
+#ifndef SRC_COMMANDPROCESSING_RESONANCEANALYSER_H_
+#define SRC_COMMANDPROCESSING_RESONANCEANALYSER_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_ACCELEROMETERS
+
+// Spectrum analyser for accelerometer data, used to find resonances without the main board having to analyse the raw samples.
+// The samples are split into Hann-windowed blocks and a Goertzel filter for each frequency bin is run over each block. The power from all the blocks is averaged.
+// We use a Goertzel bank rather than an FFT because we only need a few bins, and it processes each sample as it arrives so we don't need to store the samples.
+class ResonanceAnalyser
+{
+public:
+	static constexpr size_t MaxBins = 24;
+	static constexpr size_t BlockLength = 256;
+	static constexpr size_t MaxPeaks = 3;
+
+	ResonanceAnalyser(uint16_t p_minFrequency, uint16_t p_maxFrequency) noexcept;
+
+	uint16_t GetMinFrequency() const noexcept { return minFrequency; }
+	uint16_t GetMaxFrequency() const noexcept { return maxFrequency; }
+
+	void Start(uint16_t nominalSampleRate, uint8_t p_axis) noexcept;
+	void AddSample(float val) noexcept;
+	void Finish(uint16_t actualSampleRate) noexcept;
+	void AppendResults(const StringRef& reply) const noexcept;
+
+private:
+	void FinishBlock() noexcept;
+	float GetBinFrequency(float bin) const noexcept { return (minFrequency + bin * binSpacing) * frequencyScale; }
+
+	float coefficients[MaxBins];						// 2 * cos(2 * pi * f/fs) for each bin
+	float s1[MaxBins];									// Goertzel filter state
+	float s2[MaxBins];
+	float power[MaxBins];								// total power in each bin over all completed blocks
+	float window[BlockLength/2];						// first half of the Hann window, the second half is its mirror image
+	float windowSum;
+	float blockTotal;									// sum of the samples in the current block
+	float offset;										// the mean of the previous block, subtracted from each sample to remove the gravity component
+	float binSpacing;
+	float frequencyScale;								// ratio of the actual to the nominal sample rate
+	uint32_t numBlocks;
+	uint16_t minFrequency;
+	uint16_t maxFrequency;
+	uint16_t blockIndex;
+	uint16_t nominalRate;
+	uint8_t numBins;
+	uint8_t axis;
+};
+
+#endif
+
+#endif /* SRC_COMMANDPROCESSING_RESONANCEANALYSER_H_ */
@@ -130,12 +130,14 @@ constexpr DmaChannel DmacChanTmcTx = 0;
 constexpr DmaChannel DmacChanTmcRx = 1;
 constexpr DmaChannel DmacChanAdc0Rx = 2;
 constexpr DmaChannel DmacChanSdadcRx = 3;
+constexpr DmaChannel DmacChanCrc = 4;						// used to compute flash CRCs
 
-constexpr unsigned int NumDmaChannelsUsed = 4;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
+constexpr unsigned int NumDmaChannelsUsed = 5;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
 
 constexpr DmaPriority DmacPrioTmcTx = 0;
 constexpr DmaPriority DmacPrioTmcRx = 3;
 constexpr DmaPriority DmacPrioAdcRx = 2;
+constexpr DmaPriority DmacPrioCrc = 0;
 
 // Interrupt priorities, lower means higher priority. 0 can't make RTOS calls.
 const NvicPriority NvicPriorityStep = 1;				// step interrupt is next highest, it can preempt most other interrupts
@@ -151,10 +151,12 @@ constexpr unsigned int StepTcNumber = 2;
 // DMA channel assignments
 constexpr DmaChannel DmacChanAdc0Rx = 0;
 constexpr DmaChannel DmacChanSdadcRx = 1;
+constexpr DmaChannel DmacChanCrc = 2;						// used to compute flash CRCs
 
-constexpr unsigned int NumDmaChannelsUsed = 2;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
+constexpr unsigned int NumDmaChannelsUsed = 3;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
 
 constexpr DmaPriority DmacPrioAdcRx = 2;
+constexpr DmaPriority DmacPrioCrc = 0;
 
 // Interrupt priorities, lower means higher priority. 0 can't make RTOS calls.
 const NvicPriority NvicPriorityStep = 1;				// step interrupt is next highest, it can preempt most other interrupts
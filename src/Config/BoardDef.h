@@ -44,6 +44,18 @@
 # define SUPPORT_CLOSED_LOOP			0
 #endif
 
+#ifndef SUPPORT_PULSE_COUNTER
+# define SUPPORT_PULSE_COUNTER			0		// 1 = the board has a timer/counter free to count filament monitor pulses
+#endif
+
+#ifndef ISR_CODE_IN_RAM
+# define ISR_CODE_IN_RAM				1		// 1 = run the step ISR code from RAM so that it doesn't suffer flash wait states, 0 = run it from flash to save RAM
+#endif
+
+#ifndef USE_DM_SCAN
+# define USE_DM_SCAN					0		// 1 = find the drives due for stepping by scanning them all, 0 = keep them in a list sorted by step time
+#endif
+
 #if !SUPPORT_DRIVERS
 # define HAS_SMART_DRIVERS				0
 # define SUPPORT_TMC22xx				0
@@ -53,4 +65,22 @@
 constexpr size_t NumDrivers = 0;
 #endif
 
+#ifndef SUPPORT_LIS3DH
+# define SUPPORT_LIS3DH					0		// 1 = the board may have a LIS3DH or LIS3DSH accelerometer on the I2C bus, with its INT1 output on Lis3dhInt1Pin
+#endif
+
+#ifndef SUPPORT_ADXL345
+# define SUPPORT_ADXL345				0		// 1 = the board may have an ADXL345 accelerometer on the shared SPI bus, with its CS on Adxl345CsPin and INT1 on Adxl345Int1Pin
+#endif
+
+#define SUPPORT_ACCELEROMETERS			((SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH) || (SUPPORT_SPI_SENSORS && SUPPORT_ADXL345))
+
+#ifndef SUPPORT_MICROSTEP_REDUCTION
+# define SUPPORT_MICROSTEP_REDUCTION	(HAS_SMART_DRIVERS && !SUPPORT_CLOSED_LOOP)	// 1 = allow the microstepping to be reduced automatically at high step rates
+#endif
+
+#ifndef SUPPORT_CAN_RECORDER
+# define SUPPORT_CAN_RECORDER			(SAME5x && SUPPORT_DRIVERS)	// 1 = support recording received movement messages and replaying them for benchmarking, which needs about 19K of RAM
+#endif
+
 #endif /* SRC_CONFIG_BOARDDEF_H_ */
@@ -208,12 +208,18 @@ constexpr unsigned int StepTcNumber = 0;
 constexpr DmaChannel DmacChanTmcTx = 0;
 constexpr DmaChannel DmacChanTmcRx = 1;
 constexpr DmaChannel DmacChanAdc0Rx = 2;
+constexpr DmaChannel DmacChanSspiTx = 3;					// used by the encoder and by SPI temperature sensors
+constexpr DmaChannel DmacChanSspiRx = 4;
+constexpr DmaChannel DmacChanCrc = 5;						// used to compute flash CRCs
 
-constexpr unsigned int NumDmaChannelsUsed = 4;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
+constexpr unsigned int NumDmaChannelsUsed = 6;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
 
 constexpr DmaPriority DmacPrioTmcTx = 0;
 constexpr DmaPriority DmacPrioTmcRx = 3;
 constexpr DmaPriority DmacPrioAdcRx = 2;
+constexpr DmaPriority DmacPrioSspiTx = 1;
+constexpr DmaPriority DmacPrioSspiRx = 3;
+constexpr DmaPriority DmacPrioCrc = 0;
 
 // Interrupt priorities, lower means higher priority. 0-2 can't make RTOS calls.
 const NvicPriority NvicPriorityStep = 3;				// step interrupt is next highest, it can preempt most other interrupts
@@ -239,11 +239,17 @@ constexpr IRQn Serial1_IRQn = SERCOM5_0_IRQn;
 // DMA channel assignments. Channels 0-3 have individual interrupt vectors, channels 4-31 share an interrupt vector.
 constexpr DmaChannel DmacChanTmcTx = 0;
 constexpr DmaChannel DmacChanTmcRx = 1;
+constexpr DmaChannel DmacChanSspiTx = 2;
+constexpr DmaChannel DmacChanSspiRx = 3;
+constexpr DmaChannel DmacChanCrc = 4;						// used to compute flash CRCs
 
-constexpr unsigned int NumDmaChannelsUsed = 2;			// must be at least the number of channels used, may be larger. Max 32 on the SAME51.
+constexpr unsigned int NumDmaChannelsUsed = 5;			// must be at least the number of channels used, may be larger. Max 32 on the SAME51.
 
 constexpr DmaPriority DmacPrioTmcTx = 0;
 constexpr DmaPriority DmacPrioTmcRx = 3;
+constexpr DmaPriority DmacPrioSspiTx = 1;
+constexpr DmaPriority DmacPrioSspiRx = 3;
+constexpr DmaPriority DmacPrioCrc = 0;
 
 // Interrupt priorities, lower means higher priority. 0-2 can't make RTOS calls.
 const NvicPriority NvicPriorityStep = 3;				// step interrupt is next highest, it can preempt most other interrupts
@@ -202,6 +202,13 @@ constexpr unsigned int StepTcClockId = TC2_GCLK_ID;
 constexpr unsigned int StepTcNumber = 2;
 #define STEP_TC_HANDLER		TC2_Handler
 
+// Timer/counter used to count the pulses from a pulse-type filament monitor. TC1 isn't used on any pin in the table above.
+#define SUPPORT_PULSE_COUNTER	1
+TcCount16 * const PulseCounterTc = &(TC1->COUNT16);
+constexpr unsigned int PulseCounterTcNumber = 1;
+constexpr unsigned int PulseCounterEventChannel = 11;					// the last event channel
+constexpr unsigned int PulseCounterEventUser = EVSYS_ID_USER_TC1_EVU;
+
 // Available UART ports
 #define NUM_SERIAL_PORTS		1
 constexpr IRQn Serial0_IRQn = SERCOM5_IRQn;
@@ -210,12 +217,20 @@ constexpr IRQn Serial0_IRQn = SERCOM5_IRQn;
 constexpr DmaChannel DmacChanTmcTx = 0;
 constexpr DmaChannel DmacChanTmcRx = 1;
 constexpr DmaChannel DmacChanAdc0Rx = 2;
+constexpr DmaChannel DmacChanSspiTx = 3;
+constexpr DmaChannel DmacChanSspiRx = 4;
+constexpr DmaChannel DmacChanI2CRx = 5;
+constexpr DmaChannel DmacChanCrc = 6;						// used to compute flash CRCs
 
-constexpr unsigned int NumDmaChannelsUsed = 4;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
+constexpr unsigned int NumDmaChannelsUsed = 7;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
 
 constexpr DmaPriority DmacPrioTmcTx = 0;
 constexpr DmaPriority DmacPrioTmcRx = 3;
 constexpr DmaPriority DmacPrioAdcRx = 2;
+constexpr DmaPriority DmacPrioSspiTx = 1;
+constexpr DmaPriority DmacPrioSspiRx = 3;
+constexpr DmaPriority DmacPrioI2CRx = 1;
+constexpr DmaPriority DmacPrioCrc = 0;
 
 // Interrupt priorities, lower means higher priority. 0 can't make RTOS calls.
 const NvicPriority NvicPriorityStep = 1;				// step interrupt is next highest, it can preempt most other interrupts
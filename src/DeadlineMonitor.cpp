@@ -0,0 +1,162 @@
+/*
+ * DeadlineMonitor.cpp
+ */
+
+#include "DeadlineMonitor.h"
+#include <Histogram.h>
+#include <RTOSIface/RTOSIface.h>
+
+namespace DeadlineMonitor
+{
+	constexpr size_t MaxMonitored = 6;
+	constexpr size_t MaxActivityReportLength = 200;		// enough for the summary line and the lateness histogram of one activity
+
+	// Each activity is only updated by the task that runs it, so we don't need a lock. Diagnostics may see a partly-updated record, which doesn't matter.
+	struct MonitoredActivity
+	{
+		const char *name;
+		StepTimer::Ticks period;
+		StepTimer::Ticks lastStartTime;
+		uint32_t numPeriods;								// how many periods we have seen since the last report
+		uint32_t numLate;									// how many periods started at least one whole period late, i.e. a deadline was missed
+		uint32_t numOverruns;								// how many periods the work took longer than the period
+		uint32_t maxLateness;								// the worst lateness since the last report, in step clocks
+		uint32_t maxDuration;								// the longest the work took since the last report, in step clocks
+		bool running;										// true if lastStartTime is valid
+		Histogram<9, 0> lateness;							// lateness in eighths of the period, with the last bucket counting missed deadlines
+	};
+
+	static MonitoredActivity activities[MaxMonitored];
+	static size_t numActivities = 0;
+
+	// Convert step clocks to microseconds without overflowing if a task has been stuck for a long time
+	static uint32_t ToMicroseconds(uint32_t ticks) noexcept
+	{
+		return (uint32_t)(((uint64_t)ticks * 1000000u)/StepTimer::StepClockRate);
+	}
+}
+
+DeadlineMonitor::Handle DeadlineMonitor::Register(const char *name, StepTimer::Ticks period) noexcept
+{
+	TaskCriticalSectionLocker lock;
+
+	if (numActivities == MaxMonitored)
+	{
+		return NoHandle;
+	}
+	MonitoredActivity& a = activities[numActivities];
+	a.name = name;
+	a.period = period;
+	a.running = false;
+	a.numPeriods = a.numLate = a.numOverruns = a.maxLateness = a.maxDuration = 0;
+	return (Handle)numActivities++;
+}
+
+void DeadlineMonitor::SetPeriod(Handle h, StepTimer::Ticks period) noexcept
+{
+	if (h < numActivities)
+	{
+		activities[h].period = period;
+		activities[h].running = false;
+	}
+}
+
+void DeadlineMonitor::Begin(Handle h, StepTimer::Ticks due) noexcept
+{
+	if (h < numActivities)
+	{
+		MonitoredActivity& a = activities[h];
+		const StepTimer::Ticks now = StepTimer::GetTimerTicks();
+		if (a.running && a.period != 0)
+		{
+			const int32_t late = (int32_t)(now - due);
+			const uint32_t lateness = (late > 0) ? (uint32_t)late : 0;
+			if (lateness > a.maxLateness)
+			{
+				a.maxLateness = lateness;
+			}
+			if (lateness >= a.period)
+			{
+				++a.numLate;
+			}
+			a.lateness.Record((uint32_t)min<uint64_t>(((uint64_t)lateness * 8u)/a.period, 8));
+			++a.numPeriods;
+		}
+		a.lastStartTime = now;
+		a.running = true;
+	}
+}
+
+void DeadlineMonitor::Begin(Handle h) noexcept
+{
+	if (h < numActivities)
+	{
+		Begin(h, activities[h].lastStartTime + activities[h].period);
+	}
+}
+
+void DeadlineMonitor::End(Handle h) noexcept
+{
+	if (h < numActivities)
+	{
+		MonitoredActivity& a = activities[h];
+		if (a.running)
+		{
+			const uint32_t duration = StepTimer::GetTimerTicks() - a.lastStartTime;
+			if (duration > a.maxDuration)
+			{
+				a.maxDuration = duration;
+			}
+			if (a.period != 0 && duration > a.period)
+			{
+				++a.numOverruns;
+			}
+		}
+	}
+}
+
+void DeadlineMonitor::Stop(Handle h) noexcept
+{
+	if (h < numActivities)
+	{
+		activities[h].running = false;
+	}
+}
+
+// Report each activity and the one that came closest to its deadline, clearing the statistics of the activities reported.
+// If the reply doesn't have room for an activity then it and the ones after it keep their statistics until the next report.
+void DeadlineMonitor::Diagnostics(const StringRef& reply) noexcept
+{
+	const MonitoredActivity *worst = nullptr;
+	uint32_t worstPermille = 0;
+	for (size_t i = 0; i < numActivities; ++i)
+	{
+		MonitoredActivity& a = activities[i];
+		if (a.period == 0 || a.numPeriods == 0)
+		{
+			continue;
+		}
+		if (reply.strlen() + MaxActivityReportLength > reply.Capacity())
+		{
+			reply.lcat("More deadlines not shown");
+			break;
+		}
+		const uint32_t permille = (uint32_t)(((uint64_t)a.maxLateness * 1000u)/a.period);
+		reply.lcatf("%s: period %" PRIu32 "us, %" PRIu32 " periods, %" PRIu32 " late, %" PRIu32 " overruns, max late %" PRIu32 "us, max time %" PRIu32 "us",
+					a.name, ToMicroseconds(a.period), a.numPeriods, a.numLate, a.numOverruns,
+					ToMicroseconds(a.maxLateness), ToMicroseconds(a.maxDuration));
+		a.lateness.AppendAndClear(reply, "  lateness", "/8 period");
+		if (worst == nullptr || permille > worstPermille)
+		{
+			worst = &a;
+			worstPermille = permille;
+		}
+		a.numPeriods = a.numLate = a.numOverruns = a.maxLateness = a.maxDuration = 0;
+	}
+	if (worst != nullptr)
+	{
+		reply.lcatf("Worst deadline: %s, %" PRIu32 ".%" PRIu32 "%% of period late", worst->name, worstPermille/10, worstPermille % 10);
+	}
+}
+
+// End
@@ -0,0 +1,39 @@
+/*
+ * DeadlineMonitor.h
+ *
+ *  Records how late periodic tasks start each period and whether their work overruns the period, so that M122 shows which subsystem is overloaded.
+ */
+
+#ifndef SRC_DEADLINEMONITOR_H_
+#define SRC_DEADLINEMONITOR_H_
+
+#include "RepRapFirmware.h"
+#include <Movement/StepTimer.h>
+
+namespace DeadlineMonitor
+{
+	typedef uint8_t Handle;
+	constexpr Handle NoHandle = 0xFF;
+
+	// Register a periodic activity with its period in step clocks, returning NoHandle if there is no room. Each activity must be registered only once.
+	Handle Register(const char *name, StepTimer::Ticks period) noexcept;
+
+	// Change the period of an activity, e.g. when its rate is reconfigured
+	void SetPeriod(Handle h, StepTimer::Ticks period) noexcept;
+
+	// Record the start of the work for a period that was due to start at step clock time 'due'. The first start after registering, changing the period or stopping isn't checked.
+	void Begin(Handle h, StepTimer::Ticks due) noexcept;
+
+	// Record the start of the work for a period of a free-running loop, which is due one period after the previous start
+	void Begin(Handle h) noexcept;
+
+	// Record the end of the work for this period
+	void End(Handle h) noexcept;
+
+	// Tell the monitor that the activity has stopped running periodically, so that the gap before it next starts is not counted as lateness
+	void Stop(Handle h) noexcept;
+
+	void Diagnostics(const StringRef& reply) noexcept;
+}
+
+#endif /* SRC_DEADLINEMONITOR_H_ */
@@ -14,7 +14,8 @@ Fan::Fan(unsigned int fanNum)
 	  val(0.0), lastVal(0.0),
 	  minVal(DefaultMinFanPwm),
 	  maxVal(1.0),										// 100% maximum fan speed
-	  blipTime(DefaultFanBlipTime)
+	  blipTime(DefaultFanBlipTime),
+	  lastReportedRpm(-1), whenLastReported(0), lastReportedPwm(0xFFFF)
 {
 	triggerTemperatures[0] = triggerTemperatures[1] = DefaultHotEndFanTemperature;
 }
@@ -40,4 +41,25 @@ void Fan::SetPwm(float speed)
 	Refresh(true);
 }
 
+// Decide whether to include this fan in the next fans report. If rpmThreshold is zero we always report it, otherwise only if the PWM has changed,
+// the RPM has changed by more than rpmThreshold, or we haven't reported it for maxInterval milliseconds. A fan with no tacho always reports -1 RPM, so it is only reported when its PWM changes or it is due.
+bool Fan::IsReportDue(uint16_t pwm, int32_t rpm, int32_t rpmThreshold, uint32_t maxInterval, uint32_t now) noexcept
+{
+	if (rpmThreshold > 0 && pwm == lastReportedPwm && now - whenLastReported < maxInterval && labs(rpm - lastReportedRpm) <= rpmThreshold)
+	{
+		return false;
+	}
+
+	lastReportedPwm = pwm;
+	lastReportedRpm = rpm;
+	whenLastReported = now;
+	return true;
+}
+
+GCodeResult Fan::SetFullSpeedRpm(uint32_t rpm, const StringRef& reply)
+{
+	reply.printf("Fan %u does not support speed control", fanNumber);
+	return GCodeResult::error;
+}
+
 // End
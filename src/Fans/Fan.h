@@ -37,7 +37,14 @@ public:
 	float GetConfiguredPwm() const { return val; }			// returns the configured PWM. Actual PWM may be different, e.g. due to blipping or for thermostatic fans.
 
 	void SetPwm(float speed);
+
+	// Decide whether to include this fan in the next fans report, and if so record the values as reported
+	bool IsReportDue(uint16_t pwm, int32_t rpm, int32_t rpmThreshold, uint32_t maxInterval, uint32_t now) noexcept;
+
+	// Control the fan speed using the tacho so that a PWM of 1.0 corresponds to 'rpm', or use open loop PWM if 'rpm' is zero. Overridden by fans that have a tacho.
+	virtual GCodeResult SetFullSpeedRpm(uint32_t rpm, const StringRef& reply);
 	bool HasMonitoredSensors() const { return !sensorsMonitored.IsEmpty(); }
+	SensorsBitmap GetMonitoredSensors() const noexcept { return sensorsMonitored; }
 
 protected:
 	virtual void Refresh(bool checkSensors) = 0;
@@ -53,6 +60,11 @@ protected:
 	float triggerTemperatures[2];
 	uint32_t blipTime;										// in milliseconds
 	SensorsBitmap sensorsMonitored;
+
+	// Variables used to decide when to report the fan
+	int32_t lastReportedRpm;								// the RPM we last reported
+	uint32_t whenLastReported;								// the millis tick count when we last reported the fan
+	uint16_t lastReportedPwm;								// the PWM we last reported
 };
 
 #endif /* SRC_FAN_H_ */
@@ -18,6 +18,10 @@
 static ReadWriteLock fansLock;
 static Fan *fans[MaxFans] = { 0 };
 
+constexpr uint32_t MaxFanReportInterval = 1000;
+static int32_t fanReportRpmThreshold = 0;					// only report a fan if its PWM changed or its RPM changed by more than this, or 0 to report all fans every time
+static uint32_t fanReportMaxInterval = MaxFanReportInterval;	// the maximum interval between reports of a fan when fanReportRpmThreshold is nonzero
+
 // Retrieve the pointer to a fan, or nullptr if it doesn't exist.
 // Lock the fan system before calling this, so that the fan can't be deleted while we are accessing it.
 static ReadLockedPointer<Fan> FindFan(uint32_t fanNum)
@@ -135,6 +139,18 @@ GCodeResult FansManager::SetFanSpeed(const CanMessageSetFanSpeed& msg, const Str
 	return GCodeResult::ok;
 }
 
+GCodeResult FansManager::SetFanFullSpeedRpm(unsigned int fanNum, uint32_t rpm, const StringRef& reply)
+{
+	auto fan = FindFan(fanNum);
+	if (fan.IsNull())
+	{
+		reply.printf("Board %u doesn't have fan %u", CanInterface::GetCanAddress(), fanNum);
+		return GCodeResult::error;
+	}
+
+	return fan->SetFullSpeedRpm(rpm, reply);
+}
+
 #if 0
 
 void FansManager::SetFanValue(uint32_t fanNum, float speed)
@@ -157,6 +173,22 @@ void FansManager::Init()
 	}
 }
 
+// Get the sensors that thermostatic fans use
+SensorsBitmap FansManager::GetMonitoredSensors() noexcept
+{
+	ReadLocker locker(fansLock);
+
+	SensorsBitmap sensors;
+	for (const Fan* f : fans)
+	{
+		if (f != nullptr)
+		{
+			sensors |= f->GetMonitoredSensors();
+		}
+	}
+	return sensors;
+}
+
 // Construct a fan RPM report message. Returns the number of fans reported in it.
 unsigned int FansManager::PopulateFansReport(CanMessageFansReport& msg)
 {
@@ -164,17 +196,51 @@ unsigned int FansManager::PopulateFansReport(CanMessageFansReport& msg)
 
 	msg.whichFans = 0;
 	unsigned int numReported = 0;
+	const uint32_t now = millis();
 	for (Fan* f : fans)
 	{
 		if (f != nullptr)
 		{
-			msg.fanReports[numReported].actualPwm = (uint16_t)(f->GetLastVal() * 65535);
-			msg.fanReports[numReported].rpm = f->GetRPM();
-			msg.whichFans |= (uint64_t)1 << f->GetNumber();
-			++numReported;
+			const uint16_t pwm = (uint16_t)(f->GetLastVal() * 65535);
+			const int32_t rpm = f->GetRPM();
+			if (f->IsReportDue(pwm, rpm, fanReportRpmThreshold, fanReportMaxInterval, now))
+			{
+				msg.fanReports[numReported].actualPwm = pwm;
+				msg.fanReports[numReported].rpm = rpm;
+				msg.whichFans |= (uint64_t)1 << f->GetNumber();
+				++numReported;
+			}
 		}
 	}
 	return numReported;
 }
 
+bool FansManager::GetFanState(unsigned int fanNum, float& pwm, int32_t& rpm) noexcept
+{
+	const auto fan = FindFan(fanNum);
+	if (fan.IsNull())
+	{
+		return false;
+	}
+	pwm = fan->GetLastVal();
+	rpm = fan->GetRPM();
+	return true;
+}
+
+// Set when to report fans. A threshold of zero means report every fan every time.
+GCodeResult FansManager::SetFansReporting(uint32_t rpmThreshold, uint32_t maxInterval, const StringRef& reply)
+{
+	fanReportRpmThreshold = (int32_t)min<uint32_t>(rpmThreshold, INT32_MAX);
+	fanReportMaxInterval = (maxInterval == 0 || maxInterval > MaxFanReportInterval) ? MaxFanReportInterval : maxInterval;
+	if (fanReportRpmThreshold > 0)
+	{
+		reply.printf("Reporting fans when their PWM changes or their speed changes by more than %" PRIi32 "RPM, or at least every %" PRIu32 "ms", fanReportRpmThreshold, fanReportMaxInterval);
+	}
+	else
+	{
+		reply.copy("Reporting all fans every time");
+	}
+	return GCodeResult::ok;
+}
+
 // End
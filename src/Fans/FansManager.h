@@ -24,7 +24,11 @@ namespace FansManager
 	GCodeResult ConfigureFanPort(const CanMessageGeneric& msg, const StringRef& reply);
 	GCodeResult ConfigureFan(const CanMessageFanParameters& gb, const StringRef& reply);
 	GCodeResult SetFanSpeed(const CanMessageSetFanSpeed& msg, const StringRef& reply);
+	GCodeResult SetFanFullSpeedRpm(unsigned int fanNum, uint32_t rpm, const StringRef& reply);
 	unsigned int PopulateFansReport(CanMessageFansReport& msg);
+	GCodeResult SetFansReporting(uint32_t rpmThreshold, uint32_t maxInterval, const StringRef& reply);	// Set when to report fans
+	SensorsBitmap GetMonitoredSensors() noexcept;				// Get the sensors that thermostatic fans use
+	bool GetFanState(unsigned int fanNum, float& pwm, int32_t& rpm) noexcept;	// Get the actual PWM and speed of a fan, returning false if it doesn't exist
 #if 0
 	void SetFanValue(uint32_t fanNum, float speed);
 #endif
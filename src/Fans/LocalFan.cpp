@@ -19,7 +19,8 @@ void FanInterrupt(CallbackParameter cb) noexcept
 
 LocalFan::LocalFan(unsigned int fanNum)
 	: Fan(fanNum),
-	  fanInterruptCount(0), fanLastResetTime(0), fanInterval(0),
+	  fanInterruptCount(0), fanBurstStartTime(0), fanLastResetTime(0), fanInterval(0), tachoExintMask(0), tachoReadingPending(false),
+	  fullSpeedRpm(0.0), speedIntegral(0.0), lastReqVal(0.0), lastTachoReadingTime(0),
 	  blipping(false)
 {
 }
@@ -64,7 +65,7 @@ void LocalFan::Refresh(bool checkSensors)
 	}
 	else if (!checkSensors)
 	{
-		reqVal = lastVal;
+		reqVal = lastReqVal;
 	}
 	else
 	{
@@ -77,16 +78,15 @@ void LocalFan::Refresh(bool checkSensors)
 #endif
 		 ](unsigned int sensorNum, unsigned int) noexcept
 			{
-				const auto sensor = Heat::FindSensor(sensorNum);
-				if (sensor.IsNull())
+				TemperatureError err;
+				const float ht = Heat::GetSensorTemperature(sensorNum, err);
+				if (err == TemperatureError::unknownSensor)
 				{
 					reqVal = maxVal;					// sensor not found, so turn the fan fully on
 				}
 				else
 				{
 					//TODO we used to turn the fan on if the associated heater was being tuned
-					float ht;
-					const TemperatureError err = sensor->GetLatestTemperature(ht);
 					if (err != TemperatureError::success || ht < BadLowTemperature || ht >= triggerTemperatures[1])
 					{
 						reqVal = maxVal;
@@ -100,7 +100,7 @@ void LocalFan::Refresh(bool checkSensors)
 							reqVal = newVal;
 						}
 					}
-					else if (lastVal > 0.0 && ht + ThermostatHysteresis > triggerTemperatures[0])		// if the fan is on, add a hysteresis before turning it off
+					else if (lastReqVal > 0.0 && ht + ThermostatHysteresis > triggerTemperatures[0])		// if the fan is on, add a hysteresis before turning it off
 					{
 						const float newVal = (bangBangMode) ? maxVal : minVal;
 						if (newVal > reqVal)
@@ -122,7 +122,7 @@ void LocalFan::Refresh(bool checkSensors)
 
 	if (reqVal > 0.0)
 	{
-		if (lastVal == 0.0)
+		if (lastReqVal == 0.0)
 		{
 			// We are turning this fan on
 #if 0 //TODO HAS_SMART_DRIVERS
@@ -154,8 +154,53 @@ void LocalFan::Refresh(bool checkSensors)
 #endif
 	}
 
-	lastVal = reqVal;
-	SetHardwarePwm((blipping) ? 1.0 : reqVal);
+	lastReqVal = reqVal;
+	const float pwm = (fullSpeedRpm != 0.0 && reqVal > 0.0 && !blipping) ? SpeedControlPwm(reqVal) : reqVal;
+	if (reqVal == 0.0)
+	{
+		speedIntegral = 0.0;
+	}
+	lastVal = pwm;
+	SetHardwarePwm((blipping) ? 1.0 : pwm);
+}
+
+// Return the PWM needed to run the fan at speed reqVal * fullSpeedRpm. We use the requested PWM as the feedforward term and correct it with a PI controller.
+// The controller only updates when there is a new tacho reading, so that the integral term doesn't wind up while we wait for one.
+float LocalFan::SpeedControlPwm(float reqVal)
+{
+	const uint32_t readingTime = fanLastResetTime;					// capture volatile variable
+	const float error = reqVal - (float)max<int32_t>(GetRPM(), 0)/fullSpeedRpm;
+	if (readingTime != lastTachoReadingTime)
+	{
+		const float dt = (float)(readingTime - lastTachoReadingTime) * (1.0/(float)StepTimer::StepClockRate);
+		lastTachoReadingTime = readingTime;
+		speedIntegral = constrain<float>(speedIntegral + SpeedControlKi * error * min<float>(dt, 1.0), -1.0, 1.0);
+	}
+	return constrain<float>(reqVal + SpeedControlKp * error + speedIntegral, minVal, 1.0);
+}
+
+// Set the speed that corresponds to a requested PWM of 1.0, or use open loop control if rpm is zero
+GCodeResult LocalFan::SetFullSpeedRpm(uint32_t rpm, const StringRef& reply)
+{
+	if (rpm != 0 && !tachoPort.IsValid())
+	{
+		reply.printf("Fan %u has no tacho", fanNumber);
+		return GCodeResult::error;
+	}
+
+	fullSpeedRpm = (float)rpm;
+	speedIntegral = 0.0;
+	lastTachoReadingTime = fanLastResetTime;
+	Refresh(true);
+	if (rpm == 0)
+	{
+		reply.printf("Fan %u uses open loop PWM", fanNumber);
+	}
+	else
+	{
+		reply.printf("Fan %u speed is controlled using the tacho, full speed %" PRIu32 "RPM", fanNumber, rpm);
+	}
+	return GCodeResult::ok;
 }
 
 bool LocalFan::UpdateFanConfiguration(const StringRef& reply)
@@ -167,6 +212,14 @@ bool LocalFan::UpdateFanConfiguration(const StringRef& reply)
 // Update the fan if necessary. Return true if it is a thermostatic fan and is running.
 bool LocalFan::Check(bool checkSensors)
 {
+	// If the tacho interrupt was disabled after the last reading and the next reading is due, enable it again
+	if (tachoExintMask != 0 && !tachoReadingPending && StepTimer::GetTimerTicks() - fanLastResetTime >= TachoReadingInterval)
+	{
+		tachoReadingPending = true;
+		EIC->INTFLAG.reg = tachoExintMask;					// discard any edge that arrived while the interrupt was disabled
+		EIC->INTENSET.reg = tachoExintMask;
+	}
+
 	Refresh(checkSensors);
 	return !sensorsMonitored.IsEmpty() && lastVal != 0.0;
 }
@@ -185,9 +238,15 @@ bool LocalFan::AssignPorts(const char *pinNames, const StringRef& reply)
 	}
 
 	// Tacho initialisation
-	if (tachoPort.IsValid())
+	tachoExintMask = 0;
+	if (tachoPort.IsValid() && tachoPort.AttachInterrupt(FanInterrupt, InterruptMode::falling, CallbackParameter(this)))
 	{
-		tachoPort.AttachInterrupt(FanInterrupt, InterruptMode::falling, CallbackParameter(this));
+		const ExintNumber exint = PinTable[tachoPort.GetPin()].exintNumber;
+		if (exint != Nx)
+		{
+			tachoReadingPending = true;
+			tachoExintMask = 1u << exint;
+		}
 	}
 
 	Refresh(true);
@@ -209,14 +268,26 @@ int32_t LocalFan::GetRPM()
 
 void LocalFan::Interrupt()
 {
-	++fanInterruptCount;
+	const uint32_t now = StepTimer::GetTimerTicks();
 	if (fanInterruptCount == fanMaxInterruptCount)
 	{
-		const uint32_t now = StepTimer::GetTimerTicks();
-		fanInterval = now - fanLastResetTime;
+		fanInterval = now - fanBurstStartTime;
 		fanLastResetTime = now;
 		fanInterruptCount = 0;
+		if (tachoExintMask != 0)
+		{
+			// We have a reading, so disable the interrupt until the next one is due. Check will enable it again.
+			EIC->INTENCLR.reg = tachoExintMask;
+			tachoReadingPending = false;
+			return;
+		}
 	}
+
+	if (fanInterruptCount == 0)
+	{
+		fanBurstStartTime = now;
+	}
+	++fanInterruptCount;
 }
 
 // End
@@ -20,6 +20,7 @@ public:
 	bool IsEnabled() const override { return port.IsValid(); }
 	void SetPwmFrequency(PwmFrequency freq) override { port.SetFrequency(freq); }
 	int32_t GetRPM() override;
+	GCodeResult SetFullSpeedRpm(uint32_t rpm, const StringRef& reply) override;
 	void ReportPortDetails(const StringRef& str) const override;
 
 	bool AssignPorts(const char *pinNames, const StringRef& reply);
@@ -32,15 +33,29 @@ protected:
 
 private:
 	void SetHardwarePwm(float pwmVal);
+	float SpeedControlPwm(float reqVal);
 
 	PwmPort port;											// port used to control the fan
 	IoPort tachoPort;										// port used to read the tacho
 
-	// Variables used to read the tacho
+	// Variables used to read the tacho.
+	// To limit the interrupt rate from fast fans, we time a burst of fanMaxInterruptCount interrupts and then disable the tacho interrupt until the next reading is due.
 	static constexpr uint32_t fanMaxInterruptCount = 16;	// number of fan interrupts that we average over
+	static constexpr uint32_t TachoReadingInterval = StepTimer::StepClockRate/2;	// how often we take a tacho reading, in step clocks
 	uint32_t fanInterruptCount;								// accessed only in ISR, so no need to declare it volatile
-	volatile uint32_t fanLastResetTime;						// time (in step clocks) at which we last reset the interrupt count, accessed inside and outside ISR
+	uint32_t fanBurstStartTime;								// time (in step clocks) of the first interrupt in the current burst, accessed only in ISR
+	volatile uint32_t fanLastResetTime;						// time (in step clocks) at which we last completed a burst, accessed inside and outside ISR
 	volatile uint32_t fanInterval;							// written by ISR, read outside the ISR
+	uint32_t tachoExintMask;								// the EIC interrupt bit for the tacho input, or 0 if we leave the interrupt enabled all the time
+	volatile bool tachoReadingPending;						// true while the tacho interrupt is enabled
+
+	// Variables used for closed loop speed control
+	static constexpr float SpeedControlKp = 0.5;			// PWM per unit of speed error as a fraction of full speed
+	static constexpr float SpeedControlKi = 0.5;			// PWM per second per unit of speed error
+	float fullSpeedRpm;										// the speed corresponding to a requested PWM of 1.0, or 0 for open loop control
+	float speedIntegral;									// the integral term of the speed controller in PWM units
+	float lastReqVal;										// the PWM requested before speed control was applied
+	uint32_t lastTachoReadingTime;							// the value of fanLastResetTime when the speed controller last ran
 
 	uint32_t blipStartTime;
 	bool blipping;
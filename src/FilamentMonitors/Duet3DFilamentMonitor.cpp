@@ -37,7 +37,7 @@ Duet3DFilamentMonitor::Duet3DFilamentMonitor(unsigned int extruder, unsigned int
 void Duet3DFilamentMonitor::InitReceiveBuffer() noexcept
 {
 	edgeCaptureReadPointer = edgeCaptureWritePointer = 1;
-	edgeCaptures[0] = StepTimer::GetTimerTicks();				// pretend we just had a high-to-low transition
+	edgeCaptures[0] = wordStartTime = StepTimer::GetTimerTicks();	// pretend we just had a high-to-low transition
 	state = RxdState::waitingForStartBit;
 }
 
@@ -133,7 +133,8 @@ Duet3DFilamentMonitor::PollResult Duet3DFilamentMonitor::PollReceiveBuffer(uint1
 			{
 				// Check for a valid start bit
 				lastBitChangeIndex = (edgeCaptureReadPointer + 1u) % EdgeCaptureBufferSize;
-				startBitLength = edgeCaptures[lastBitChangeIndex] - edgeCaptures[edgeCaptureReadPointer];
+				wordStartTime = edgeCaptures[edgeCaptureReadPointer];
+				startBitLength = edgeCaptures[lastBitChangeIndex] - wordStartTime;
 				edgeCaptureReadPointer = lastBitChangeIndex;
 				if (startBitLength >= MinBitLength && startBitLength <= MaxBitLength)
 				{
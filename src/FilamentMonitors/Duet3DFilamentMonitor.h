@@ -33,6 +33,7 @@ protected:
 	PollResult PollReceiveBuffer(uint16_t& measurement) noexcept;
 	bool IsReceiving() const noexcept;
 	bool IsWaitingForStartBit() const noexcept;
+	uint32_t GetWordStartTime() const noexcept { return wordStartTime; }	// get the step clock time of the start bit of the word being received or most recently received
 
 protected:
 	uint32_t overrunErrorCount;
@@ -58,6 +59,7 @@ private:
 	};
 
 	uint32_t startBitLength;
+	uint32_t wordStartTime;
 	uint32_t errorRecoveryStartTime;
 	size_t lastBitChangeIndex;
 	uint16_t valueBeingAssembled;
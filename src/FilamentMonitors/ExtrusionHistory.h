@@ -0,0 +1,87 @@
+/*
+ * ExtrusionHistory.h
+ */
+
+#ifndef SRC_FILAMENTMONITORS_EXTRUSIONHISTORY_H_
+#define SRC_FILAMENTMONITORS_EXTRUSIONHISTORY_H_
+
+#include <RepRapFirmware.h>
+#include <Movement/StepTimer.h>
+
+// Short history of the total extrusion commanded, timestamped by the step clock.
+// This lets a filament monitor compare a measurement with the extrusion that was commanded a little earlier, to allow for the delay between the extruder and the sensor.
+class ExtrusionHistory
+{
+public:
+	static constexpr size_t NumEntries = 64;										// must be a power of 2
+	static constexpr uint32_t MinEntryInterval = StepTimer::StepClockRate/200;		// we combine samples less than 5ms apart unless they are exact
+
+	ExtrusionHistory() noexcept { Reset(); }
+
+	void Reset() noexcept { numEntries = 0; newest = 0; total = 0.0; }
+
+	// Record that 'amount' more extrusion had been commanded by step clock time 'when'. If 'exact' then the time is that of a start bit, so don't combine it with another sample.
+	void Add(uint32_t when, float amount, bool exact) noexcept
+	{
+		total += amount;
+		if (numEntries != 0 && !exact && !entries[newest].exact && when - entries[newest].time < MinEntryInterval)
+		{
+			entries[newest].time = when;
+			entries[newest].total = total;
+			return;
+		}
+
+		newest = (newest + 1) % NumEntries;
+		entries[newest].time = when;
+		entries[newest].total = total;
+		entries[newest].exact = exact;
+		if (numEntries < NumEntries)
+		{
+			++numEntries;
+		}
+	}
+
+	// Get the total extrusion commanded at step clock time 'when' by interpolating between samples. Return false if 'when' is older than the history we hold.
+	bool GetTotalAt(uint32_t when, float& result) const noexcept
+	{
+		if (numEntries == 0)
+		{
+			return false;
+		}
+
+		size_t index = newest;
+		if ((int32_t)(when - entries[index].time) >= 0)
+		{
+			result = entries[index].total;
+			return true;
+		}
+
+		for (size_t i = 1; i < numEntries; ++i)
+		{
+			const size_t prev = (index - 1) % NumEntries;
+			if ((int32_t)(when - entries[prev].time) >= 0)
+			{
+				const float fraction = (float)(when - entries[prev].time)/(float)(entries[index].time - entries[prev].time);
+				result = entries[prev].total + (entries[index].total - entries[prev].total) * fraction;
+				return true;
+			}
+			index = prev;
+		}
+		return false;
+	}
+
+private:
+	struct Entry
+	{
+		uint32_t time;
+		float total;
+		bool exact;
+	};
+
+	Entry entries[NumEntries];
+	size_t numEntries;
+	size_t newest;
+	float total;
+};
+
+#endif /* SRC_FILAMENTMONITORS_EXTRUSIONHISTORY_H_ */
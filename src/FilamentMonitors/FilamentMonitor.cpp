@@ -13,6 +13,7 @@
 #include "RotatingMagnetFilamentMonitor.h"
 #include "LaserFilamentMonitor.h"
 #include "PulsedFilamentMonitor.h"
+#include "ExtrusionHistory.h"
 #include <Platform.h>
 #include <Movement/Move.h>
 #include <CAN/CanInterface.h>
@@ -20,11 +21,16 @@
 #include <CanMessageBuffer.h>
 #include <CanMessageGenericParser.h>
 #include <CanMessageGenericTables.h>
+#include <Tasks.h>
+#include <DeadlineMonitor.h>
+
+constexpr StepTimer::Ticks SpinDeadline = StepTimer::StepClockRate/50;	// when printing we expect to check the filament monitors at least every 20ms
 
 // Static data
 ReadWriteLock FilamentMonitor::filamentMonitorsLock;
 FilamentMonitor *FilamentMonitor::filamentSensors[NumDrivers] = { 0 };
 uint32_t FilamentMonitor::whenStatusLastSent = 0;
+uint32_t FilamentMonitor::statusUpdateInterval = DefaultStatusUpdateInterval;
 uint32_t FilamentMonitor::minInterruptTime = 0xFFFFFFFF, FilamentMonitor::maxInterruptTime = 0;
 uint32_t FilamentMonitor::minPollTime = 0xFFFFFFFF, FilamentMonitor::maxPollTime = 0;
 
@@ -32,11 +38,14 @@ uint32_t FilamentMonitor::minPollTime = 0xFFFFFFFF, FilamentMonitor::maxPollTime
 FilamentMonitor::FilamentMonitor(uint8_t p_driver, unsigned int t) noexcept
 	: type(t), driver(p_driver), lastStatus(FilamentSensorStatus::noDataReceived)
 {
+	bool isPrinting;
+	lastExtruderStepsTotal = moveInstance->GetTotalExtrusion(driver, isPrinting);
 }
 
-// Default destructor
+// Destructor
 FilamentMonitor::~FilamentMonitor() noexcept
 {
+	delete extrusionHistory;
 }
 
 // Call this to disable the interrupt before deleting or re-configuring a local filament monitor
@@ -70,6 +79,46 @@ GCodeResult FilamentMonitor::CommonConfigure(const CanMessageGenericParser& pars
 	return GCodeResult::ok;
 }
 
+// Enable or disable time-aligned comparison. Sensor types that support it override this.
+GCodeResult FilamentMonitor::SetTimeAligned(bool enable, const StringRef& reply) noexcept
+{
+	reply.copy("This filament monitor type does not support time-aligned comparison");
+	return GCodeResult::error;
+}
+
+// Set the limit for applying pressure advance from the measured lag. Sensor types that support it override this.
+GCodeResult FilamentMonitor::SetMaxPressureAdvance(float maxAdvance, const StringRef& reply) noexcept
+{
+	reply.copy("This filament monitor type does not support pressure advance feedback");
+	return GCodeResult::error;
+}
+
+// Set the quality thresholds for weighting measurements. Sensor types that support it override this.
+GCodeResult FilamentMonitor::SetQualityWeighting(uint32_t minQuality, uint32_t fullWeightQuality, const StringRef& reply) noexcept
+{
+	reply.copy("This filament monitor type does not report measurement quality");
+	return GCodeResult::error;
+}
+
+// Allocate or free the history of commanded extrusion. The caller must hold a write lock on filamentMonitorsLock.
+bool FilamentMonitor::EnableExtrusionHistory(bool enable) noexcept
+{
+	if (!enable)
+	{
+		delete extrusionHistory;
+		extrusionHistory = nullptr;
+	}
+	else if (extrusionHistory == nullptr)
+	{
+		if (!Tasks::CanAllocate(sizeof(ExtrusionHistory)))
+		{
+			return false;
+		}
+		extrusionHistory = new ExtrusionHistory;
+	}
+	return true;
+}
+
 // Static initialisation
 /*static*/ void FilamentMonitor::InitStatic() noexcept
 {
@@ -173,6 +222,69 @@ GCodeResult FilamentMonitor::CommonConfigure(const CanMessageGenericParser& pars
 	return fm->Configure(parser, reply);
 }
 
+// Enable or disable time-aligned comparison for a filament monitor
+/*static*/ GCodeResult FilamentMonitor::SetTimeAlignedMode(size_t drive, bool enable, const StringRef& reply) noexcept
+{
+	if (drive >= NumDrivers)
+	{
+		reply.copy("Driver number out of range");
+		return GCodeResult::error;
+	}
+
+	WriteLocker lock(filamentMonitorsLock);
+
+	FilamentMonitor * const fm = filamentSensors[drive];
+	if (fm == nullptr)
+	{
+		reply.printf("Driver %u.%u has no filament monitor", CanInterface::GetCanAddress(), drive);
+		return GCodeResult::error;
+	}
+
+	return fm->SetTimeAligned(enable, reply);
+}
+
+// Set the maximum pressure advance that a filament monitor may apply, or zero to only report the suggested value
+/*static*/ GCodeResult FilamentMonitor::SetPressureAdvanceFeedback(size_t drive, float maxAdvance, const StringRef& reply) noexcept
+{
+	if (drive >= NumDrivers)
+	{
+		reply.copy("Driver number out of range");
+		return GCodeResult::error;
+	}
+
+	WriteLocker lock(filamentMonitorsLock);
+
+	FilamentMonitor * const fm = filamentSensors[drive];
+	if (fm == nullptr)
+	{
+		reply.printf("Driver %u.%u has no filament monitor", CanInterface::GetCanAddress(), drive);
+		return GCodeResult::error;
+	}
+
+	return fm->SetMaxPressureAdvance(maxAdvance, reply);
+}
+
+// Set the sensor quality thresholds that a filament monitor uses to discard or down-weight measurements
+/*static*/ GCodeResult FilamentMonitor::SetMeasurementQualityWeighting(size_t drive, uint32_t minQuality, uint32_t fullWeightQuality, const StringRef& reply) noexcept
+{
+	if (drive >= NumDrivers)
+	{
+		reply.copy("Driver number out of range");
+		return GCodeResult::error;
+	}
+
+	WriteLocker lock(filamentMonitorsLock);
+
+	FilamentMonitor * const fm = filamentSensors[drive];
+	if (fm == nullptr)
+	{
+		reply.printf("Driver %u.%u has no filament monitor", CanInterface::GetCanAddress(), drive);
+		return GCodeResult::error;
+	}
+
+	return fm->SetQualityWeighting(minQuality, fullWeightQuality, reply);
+}
+
 // Return an error message corresponding to a status code
 /*static*/ const char *FilamentMonitor::GetErrorMessage(FilamentSensorStatus f) noexcept
 {
@@ -192,11 +304,13 @@ GCodeResult FilamentMonitor::CommonConfigure(const CanMessageGenericParser& pars
 {
 	const uint32_t startTime = StepTimer::GetTimerTicks();
 	FilamentMonitor * const fm = static_cast<FilamentMonitor*>(param.vp);
-	if (fm->Interrupt())
+	if (fm->Interrupt() && !fm->haveIsrStepsCommanded)			// if Spin hasn't taken the previous sample yet then we leave it alone and Spin will read the total extrusion itself
 	{
-		fm->isrExtruderStepsCommanded = moveInstance->GetAccumulatedExtrusion(fm->driver, fm->isrWasPrinting);
-		fm->haveIsrStepsCommanded = true;
+		fm->isrExtruderStepsTotal = moveInstance->GetTotalExtrusion(fm->driver, fm->isrWasPrinting);
 		fm->lastIsrMillis = millis();
+		fm->lastIsrStepTime = startTime;
+		std::atomic_signal_fence(std::memory_order_seq_cst);	// make sure the sample is written before the flag
+		fm->haveIsrStepsCommanded = true;
 	}
 	const uint32_t elapsedTime = StepTimer::GetTimerTicks() - startTime;
 	if (elapsedTime > maxInterruptTime)
@@ -211,6 +325,9 @@ GCodeResult FilamentMonitor::CommonConfigure(const CanMessageGenericParser& pars
 
 /*static*/ void FilamentMonitor::Spin() noexcept
 {
+	static const DeadlineMonitor::Handle deadlineHandle = DeadlineMonitor::Register("Filament", SpinDeadline);
+	DeadlineMonitor::Begin(deadlineHandle);
+
 	CanMessageBuffer buf(nullptr);
 	auto msg = buf.SetupStatusMessage<CanMessageFilamentMonitorsStatus>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
 	bool statusChanged = false;
@@ -228,34 +345,54 @@ GCodeResult FilamentMonitor::CommonConfigure(const CanMessageGenericParser& pars
 				haveMonitor = true;
 				FilamentMonitor& fs = *filamentSensors[drv];
 				bool isPrinting;
-				bool fromIsr;
-				int32_t extruderStepsCommanded;
+				int32_t extruderStepsTotal;
 				uint32_t locIsrMillis;
-				IrqDisable();
-				if (fs.haveIsrStepsCommanded)
+				uint32_t locStepTime;
+
+				// If the ISR hasn't taken a sample then read the total extrusion ourselves. The ISR may take a sample while we are doing that, in which case
+				// its sample is more recent than the total we read, so we use the sample instead. Neither path disables interrupts.
+				bool fromIsr = fs.haveIsrStepsCommanded;
+				if (!fromIsr)
 				{
-					extruderStepsCommanded = fs.isrExtruderStepsCommanded;
+					extruderStepsTotal = moveInstance->GetTotalExtrusion(drv, isPrinting);
+					std::atomic_signal_fence(std::memory_order_seq_cst);	// make sure we read the total before we check the flag again
+					fromIsr = fs.haveIsrStepsCommanded;
+				}
+				if (fromIsr)
+				{
+					// The ISR doesn't write the sample while the flag is set, so we can copy it without disabling interrupts
+					std::atomic_signal_fence(std::memory_order_seq_cst);	// make sure we read the sample after the flag
+					extruderStepsTotal = fs.isrExtruderStepsTotal;
 					isPrinting = fs.isrWasPrinting;
 					locIsrMillis = fs.lastIsrMillis;
+					locStepTime = fs.lastIsrStepTime;
+					std::atomic_signal_fence(std::memory_order_seq_cst);	// make sure we have read the sample before we let the ISR overwrite it
 					fs.haveIsrStepsCommanded = false;
-					IrqEnable();
-					fromIsr = true;
 				}
 				else
 				{
-					extruderStepsCommanded = moveInstance->GetAccumulatedExtrusion(drv, isPrinting);		// get and clear the net extrusion commanded
-					IrqEnable();
-					fromIsr = false;
 					locIsrMillis = 0;
+					locStepTime = startTime;
 				}
+				const int32_t extruderStepsCommanded = extruderStepsTotal - fs.lastExtruderStepsTotal;		// the net extrusion commanded since we last checked
+				fs.lastExtruderStepsTotal = extruderStepsTotal;
 
 				if (Platform::IsPrinting())
 				{
 					const float extrusionCommanded = (float)extruderStepsCommanded/Platform::DriveStepsPerUnit(drv);
+					fs.checkStepTime = locStepTime;
+					if (fs.extrusionHistory != nullptr)
+					{
+						fs.extrusionHistory->Add(locStepTime, extrusionCommanded, fromIsr);
+					}
 					fst = fs.Check(isPrinting, fromIsr, locIsrMillis, extrusionCommanded);
 				}
 				else
 				{
+					if (fs.extrusionHistory != nullptr)
+					{
+						fs.extrusionHistory->Reset();
+					}
 					fst = fs.Clear();
 				}
 				if (fst != fs.lastStatus)
@@ -278,13 +415,39 @@ GCodeResult FilamentMonitor::CommonConfigure(const CanMessageGenericParser& pars
 		}
 	}
 
-	if (statusChanged || (haveMonitor && millis() - whenStatusLastSent >= StatusUpdateInterval))
+	if (statusChanged || (haveMonitor && millis() - whenStatusLastSent >= statusUpdateInterval))
 	{
 		msg->SetStandardFields(NumDrivers);
 		buf.dataLength = msg->GetActualDataLength();
 		CanInterface::Send(&buf);
 		whenStatusLastSent = millis();
 	}
+
+	// We only need to check the filament monitors promptly while printing, so don't count the gaps when the main task waits for commands
+	if (haveMonitor && Platform::IsPrinting())
+	{
+		DeadlineMonitor::End(deadlineHandle);
+	}
+	else
+	{
+		DeadlineMonitor::Stop(deadlineHandle);
+	}
+}
+
+// Set how often we send the status of the filament monitors when it hasn't changed. Changes are always sent at once.
+/*static*/ GCodeResult FilamentMonitor::SetStatusInterval(uint32_t interval, const StringRef& reply) noexcept
+{
+	if (interval != 0)
+	{
+		if (interval < MinStatusUpdateInterval || interval > MaxStatusUpdateInterval)
+		{
+			reply.printf("Interval must be between %" PRIu32 " and %" PRIu32 "ms", MinStatusUpdateInterval, MaxStatusUpdateInterval);
+			return GCodeResult::error;
+		}
+		statusUpdateInterval = interval;
+	}
+	reply.printf("Filament monitor status is sent on change and every %" PRIu32 "ms", statusUpdateInterval);
+	return GCodeResult::ok;
 }
 
 // Close down the filament monitors, in particular stop them generating interrupts. Called when we are about to update firmware.
@@ -17,6 +17,7 @@
 #include <Duet3Common.h>
 
 class CanMessageGeneric;
+class ExtrusionHistory;
 class CanMessageCreateFilamentMonitor;
 class CanMessageDeleteFilamentMonitor;
 class CanMessageConfigureFilamentMonitor;
@@ -69,12 +70,24 @@ public:
 	// Generate diagnostics info
 	static void GetDiagnostics(const StringRef& reply) noexcept;
 
+	// Set how often we send the status of the filament monitors when it hasn't changed
+	static GCodeResult SetStatusInterval(uint32_t interval, const StringRef& reply) noexcept;
+
 	// This must be public so that the array descriptor in class RepRap can lock it
 	static ReadWriteLock filamentMonitorsLock;
 
 	// Return the status of the filament sensor for a drive
 	static FilamentSensorStatus GetFilamentStatus(size_t drive);
 
+	// Enable or disable comparing the measured movement with the extrusion commanded slightly earlier, to allow for the lag between the extruder and the sensor
+	static GCodeResult SetTimeAlignedMode(size_t drive, bool enable, const StringRef& reply) noexcept;
+
+	// Set the maximum pressure advance that the filament monitor may apply from its lag estimate, or zero to only report the suggested pressure advance
+	static GCodeResult SetPressureAdvanceFeedback(size_t drive, float maxAdvance, const StringRef& reply) noexcept;
+
+	// Set the sensor quality thresholds used to discard or down-weight measurements
+	static GCodeResult SetMeasurementQualityWeighting(size_t drive, uint32_t minQuality, uint32_t fullWeightQuality, const StringRef& reply) noexcept;
+
 protected:
 	FilamentMonitor(uint8_t p_driver, unsigned int t) noexcept;
 
@@ -85,11 +98,25 @@ protected:
 	// Clear the measurement state - called when we are not printing a file. Return the present/not present status if available.
 	virtual FilamentSensorStatus Clear() noexcept = 0;
 
+	// Enable or disable time-aligned comparison. Override this if the sensor type supports it.
+	virtual GCodeResult SetTimeAligned(bool enable, const StringRef& reply) noexcept;
+
+	// Set the limit for applying pressure advance from the measured lag. Override this if the sensor type supports it.
+	virtual GCodeResult SetMaxPressureAdvance(float maxAdvance, const StringRef& reply) noexcept;
+
+	// Set the quality thresholds for weighting measurements. Override this if the sensor type supports it.
+	virtual GCodeResult SetQualityWeighting(uint32_t minQuality, uint32_t fullWeightQuality, const StringRef& reply) noexcept;
+
+	// Allocate or free the history of commanded extrusion, returning false if there was insufficient RAM
+	bool EnableExtrusionHistory(bool enable) noexcept;
+
 	GCodeResult CommonConfigure(const CanMessageGenericParser& parser, const StringRef& reply, InterruptMode interruptMode, bool& seen) noexcept;
 
 	uint8_t GetDriver() const noexcept { return driver; }
 	const IoPort& GetPort() const noexcept { return port; }
 	bool HaveIsrStepsCommanded() const noexcept { return haveIsrStepsCommanded; }
+	const ExtrusionHistory *GetExtrusionHistory() const noexcept { return extrusionHistory; }
+	uint32_t GetCheckStepTime() const noexcept { return checkStepTime; }	// the step clock time of the sample passed to Check, which is the time of the interrupt if it came from the ISR
 
 	static int32_t ConvertToPercent(float f)
 	{
@@ -104,16 +131,26 @@ private:
 	static uint32_t minInterruptTime, maxInterruptTime;
 	static uint32_t minPollTime, maxPollTime;
 
-	static constexpr uint32_t StatusUpdateInterval = 2000;				// how often we send status reports when there isn't a change
+	static uint32_t statusUpdateInterval;								// how often we send status reports when there isn't a change
+
+	static constexpr uint32_t DefaultStatusUpdateInterval = 2000;
+	static constexpr uint32_t MinStatusUpdateInterval = 100;
+	static constexpr uint32_t MaxStatusUpdateInterval = 60000;
 
-	int32_t isrExtruderStepsCommanded;
+	ExtrusionHistory *extrusionHistory = nullptr;			// only allocated when time-aligned comparison is enabled
+	int32_t isrExtruderStepsTotal;							// the total extruder steps commanded when the ISR took its sample
+	int32_t lastExtruderStepsTotal;							// the total extruder steps commanded when Spin last checked the filament, only used by Spin
 	uint32_t lastIsrMillis;
+	uint32_t lastIsrStepTime;
+	uint32_t checkStepTime;
 	unsigned int type;
 	IoPort port;
 	uint8_t driver;
 
+	// The ISR writes the sample fields above only when haveIsrStepsCommanded is false and sets it last, and Spin clears it only after reading them,
+	// so Spin can read them without disabling interrupts
 	bool isrWasPrinting;
-	bool haveIsrStepsCommanded;
+	volatile bool haveIsrStepsCommanded;
 	FilamentSensorStatus lastStatus;
 };
 
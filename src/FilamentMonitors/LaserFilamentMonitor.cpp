@@ -6,6 +6,7 @@
  */
 
 #include "LaserFilamentMonitor.h"
+#include "ExtrusionHistory.h"
 
 #if SUPPORT_DRIVERS
 
@@ -23,7 +24,8 @@ LaserFilamentMonitor::LaserFilamentMonitor(unsigned int extruder, unsigned int m
 	: Duet3DFilamentMonitor(extruder, monitorType),
 	  calibrationFactor(1.0),
 	  minMovementAllowed(DefaultMinMovementAllowed), maxMovementAllowed(DefaultMaxMovementAllowed),
-	  minimumExtrusionCheckLength(DefaultMinimumExtrusionCheckLength), comparisonEnabled(false), checkNonPrintingMoves(false)
+	  minimumExtrusionCheckLength(DefaultMinimumExtrusionCheckLength), comparisonEnabled(false), checkNonPrintingMoves(false),
+	  maxPressureAdvance(0.0), minImageQuality(DefaultMinImageQuality), fullWeightImageQuality(DefaultFullWeightImageQuality)
 {
 	switchOpenMask = (monitorType == 6) ? TypeLaserSwitchOpenBitMask : 0;
 	Init();
@@ -38,11 +40,28 @@ void LaserFilamentMonitor::Init() noexcept
 	imageQuality = shutter = brightness = lastErrorCode = 0;
 	version = 1;
 	backwards = false;
-	sensorError = false;
+	sensorError = shutterReceived = false;
+	windowsUsed = windowsDiscarded = 0;
+	consecutiveWindowsDiscarded = 0;
+	totalWindowWeight = 0.0;
+	for (uint16_t& bin : ratioBins)
+	{
+		bin = 0;
+	}
 	InitReceiveBuffer();
+	ResetCorrelation();
 	Reset();
 }
 
+void LaserFilamentMonitor::ResetCorrelation() noexcept
+{
+	for (size_t i = 0; i < NumCorrelationLags; ++i)
+	{
+		sumMeasuredTimesCommanded[i] = sumCommandedSquared[i] = 0.0;
+	}
+	bestLag = 0;
+}
+
 void LaserFilamentMonitor::Reset() noexcept
 {
 	extrusionCommandedThisSegment = extrusionCommandedSinceLastSync = movementMeasuredThisSegment = movementMeasuredSinceLastSync = 0.0;
@@ -61,6 +80,39 @@ float LaserFilamentMonitor::MeasuredSensitivity() const noexcept
 	return totalMovementMeasured/totalExtrusionCommanded;
 }
 
+// Return the weight to give to a window measured at the current sensor quality, from 0 (discard it) to 1, or always 1 if quality weighting is off.
+// Version 1 sensors don't report image quality, so for them we only check the shutter.
+float LaserFilamentMonitor::GetQualityWeight() const noexcept
+{
+	if (fullWeightImageQuality == 0)
+	{
+		return 1.0;
+	}
+	if (shutterReceived && shutter < MinShutter)
+	{
+		return 0.0;
+	}
+	if (imageQuality == 0 || imageQuality >= fullWeightImageQuality)
+	{
+		return 1.0;
+	}
+	return (imageQuality < minImageQuality) ? 0.0 : (float)(imageQuality - minImageQuality + 1)/(float)(fullWeightImageQuality - minImageQuality + 1);
+}
+
+// Add a measured/commanded ratio to the history. If a bin is about to overflow, halve them all so that the history favours recent comparisons.
+void LaserFilamentMonitor::RecordRatio(float ratio) noexcept
+{
+	const size_t bin = (ratio <= 0.0) ? 0 : min<size_t>((size_t)(ratio/RatioBinWidth), NumRatioBins - 1);
+	if (ratioBins[bin] == UINT16_MAX)
+	{
+		for (uint16_t& b : ratioBins)
+		{
+			b >>= 1;
+		}
+	}
+	++ratioBins[bin];
+}
+
 // Configure this sensor, returning true if error and setting 'seen' if we processed any configuration parameters
 GCodeResult LaserFilamentMonitor::Configure(const CanMessageGenericParser& parser, const StringRef& reply) noexcept
 {
@@ -217,6 +269,7 @@ void LaserFilamentMonitor::HandleIncomingData() noexcept
 				case TypeLaserMessageTypeQuality:
 					brightness = val & 0x00FF;
 					shutter = (val >> 8) & 0x1F;
+					shutterReceived = true;
 					break;
 
 				case TypeLaserMessageTypeInfo:
@@ -236,6 +289,7 @@ void LaserFilamentMonitor::HandleIncomingData() noexcept
 
 					case TypeLaserInfoTypeShutter:
 						shutter = val & 0x00FF;
+						shutterReceived = true;
 						break;
 					}
 					break;
@@ -265,12 +319,32 @@ void LaserFilamentMonitor::HandleIncomingData() noexcept
 						|| (wasPrintingAtStartBit && (int32_t)(lastSyncTime - moveInstance->ExtruderPrintingSince()) >= SyncDelayMillis)
 					   )
 					{
-						// We can use this measurement
-						extrusionCommandedThisSegment += extrusionCommandedAtCandidateStartBit;
-						movementMeasuredThisSegment += movementMeasuredSinceLastSync;
+						// We can use this measurement unless the sensor quality was too poor. Scaling both amounts by the weight leaves the ratio for this window unchanged
+						// but reduces its contribution to the segment, so that a segment made up of marginal windows needs more extrusion before we compare it.
+						const float weight = GetQualityWeight();
+						if (weight > 0.0)
+						{
+							const float commanded = (GetExtrusionHistory() != nullptr)
+														? GetTimeAlignedExtrusion(extrusionCommandedAtCandidateStartBit, movementMeasuredSinceLastSync)
+															: extrusionCommandedAtCandidateStartBit;
+							extrusionCommandedThisSegment += commanded * weight;
+							movementMeasuredThisSegment += movementMeasuredSinceLastSync * weight;
+							totalWindowWeight += weight;
+							++windowsUsed;
+							consecutiveWindowsDiscarded = 0;
+						}
+						else
+						{
+							++windowsDiscarded;
+							if (consecutiveWindowsDiscarded < MaxConsecutiveDiscardedWindows)
+							{
+								++consecutiveWindowsDiscarded;
+							}
+						}
 					}
 				}
 				lastSyncTime = candidateStartBitTime;
+				lastSyncStepTime = candidateStartBitStepTime;
 				extrusionCommandedSinceLastSync -= extrusionCommandedAtCandidateStartBit;
 				movementMeasuredSinceLastSync = 0.0;
 				synced = checkNonPrintingMoves || wasPrintingAtStartBit;
@@ -280,6 +354,156 @@ void LaserFilamentMonitor::HandleIncomingData() noexcept
 	}
 }
 
+// Return the extrusion commanded during the window between the last two synced measurements, delayed by the lag that best matches the measured movement.
+// We get the commanded extrusion over the window for each candidate lag from the history and accumulate its correlation with the measured movement.
+// The best lag is the one that explains most of the measured movement, i.e. that maximises (sum of m*c)^2/(sum of c^2).
+// If the history doesn't cover the window delayed by the best lag, return the unaligned extrusion.
+float LaserFilamentMonitor::GetTimeAlignedExtrusion(float unalignedExtrusion, float measuredMovement) noexcept
+{
+	const ExtrusionHistory& history = *GetExtrusionHistory();
+	float commandedAtLag[NumCorrelationLags];
+	bool valid[NumCorrelationLags];
+	for (size_t lag = 0; lag < NumCorrelationLags; ++lag)
+	{
+		const uint32_t delay = lag * CorrelationLagStep;
+		float startTotal, endTotal;
+		valid[lag] = history.GetTotalAt(lastSyncStepTime - delay, startTotal) && history.GetTotalAt(candidateStartBitStepTime - delay, endTotal);
+		if (valid[lag])
+		{
+			commandedAtLag[lag] = endTotal - startTotal;
+			sumMeasuredTimesCommanded[lag] = sumMeasuredTimesCommanded[lag] * CorrelationDecay + measuredMovement * commandedAtLag[lag];
+			sumCommandedSquared[lag] = sumCommandedSquared[lag] * CorrelationDecay + fsquare(commandedAtLag[lag]);
+		}
+	}
+
+	float bestScore = 0.0;
+	for (size_t lag = 0; lag < NumCorrelationLags; ++lag)
+	{
+		const float score = CorrelationScore(lag);
+		if (score > bestScore)
+		{
+			bestScore = score;
+			bestLag = lag;
+		}
+	}
+
+	return (valid[bestLag]) ? commandedAtLag[bestLag] : unalignedExtrusion;
+}
+
+// Return how much of the measured movement is explained by the commanded extrusion delayed by this lag
+float LaserFilamentMonitor::CorrelationScore(size_t lag) const noexcept
+{
+	return (sumCommandedSquared[lag] > 0.0) ? fsquare(sumMeasuredTimesCommanded[lag])/sumCommandedSquared[lag] : 0.0;
+}
+
+// Get the pressure advance that would compensate for the measured lag, in seconds. The filament lags the extruder by approximately the pressure advance time constant,
+// so we use the best lag, refined by fitting a parabola to the scores of it and its neighbours because the lag step is coarse compared with typical pressure advance values.
+// Return false if we haven't seen enough changes in extrusion rate to estimate it.
+bool LaserFilamentMonitor::GetSuggestedPressureAdvance(float& advance) const noexcept
+{
+	if (GetExtrusionHistory() == nullptr || sumCommandedSquared[bestLag] < MinCorrelationWeight)
+	{
+		return false;
+	}
+
+	float lag = (float)bestLag;
+	if (bestLag > 0 && bestLag + 1 < NumCorrelationLags)
+	{
+		const float before = CorrelationScore(bestLag - 1), best = CorrelationScore(bestLag), after = CorrelationScore(bestLag + 1);
+		const float curvature = before - 2.0 * best + after;
+		if (curvature < 0.0)
+		{
+			lag += constrain<float>(0.5 * (before - after)/curvature, -0.5, 0.5);
+		}
+	}
+	advance = lag * (float)CorrelationLagStep/(float)StepTimer::StepClockRate;
+	return true;
+}
+
+// Move the pressure advance for our driver towards the suggested value, by a limited amount and within the configured limit
+void LaserFilamentMonitor::AdjustPressureAdvance() noexcept
+{
+	float suggested;
+	if (maxPressureAdvance > 0.0 && GetSuggestedPressureAdvance(suggested))
+	{
+		const float current = Platform::GetPressureAdvanceClocks(GetDriver())/(float)StepTimer::StepClockRate;
+		const float target = min<float>(suggested, maxPressureAdvance);
+		Platform::SetPressureAdvance(GetDriver(), constrain<float>(current + constrain<float>(target - current, -MaxPressureAdvanceChange, MaxPressureAdvanceChange), 0.0, maxPressureAdvance));
+	}
+}
+
+// Set the highest pressure advance we may apply from the lag estimate, or zero to only report the suggested value
+GCodeResult LaserFilamentMonitor::SetMaxPressureAdvance(float maxAdvance, const StringRef& reply) noexcept
+{
+	if (maxAdvance < 0.0 || maxAdvance > MaxPressureAdvanceLimit)
+	{
+		reply.printf("Maximum pressure advance must be between 0 and %.1f seconds", (double)MaxPressureAdvanceLimit);
+		return GCodeResult::error;
+	}
+	if (GetExtrusionHistory() == nullptr)
+	{
+		reply.copy("Time-aligned comparison must be enabled first");
+		return GCodeResult::error;
+	}
+
+	maxPressureAdvance = maxAdvance;
+	if (maxAdvance > 0.0)
+	{
+		reply.printf("Applying pressure advance up to %.3fs from the measured lag", (double)maxAdvance);
+	}
+	else
+	{
+		reply.copy("Reporting pressure advance from the measured lag without applying it");
+	}
+	float suggested;
+	if (GetSuggestedPressureAdvance(suggested))
+	{
+		reply.catf(", suggested %.3fs", (double)suggested);
+	}
+	return GCodeResult::ok;
+}
+
+// Set the image quality thresholds for weighting measurements, or weight them all equally if fullWeightQuality is zero
+GCodeResult LaserFilamentMonitor::SetQualityWeighting(uint32_t minQuality, uint32_t fullWeightQuality, const StringRef& reply) noexcept
+{
+	if (fullWeightQuality > UINT8_MAX || minQuality > fullWeightQuality)
+	{
+		reply.printf("Image quality thresholds must be in the range 0 to %u with the minimum not above the full weight value", UINT8_MAX);
+		return GCodeResult::error;
+	}
+
+	minImageQuality = (uint8_t)minQuality;
+	fullWeightImageQuality = (uint8_t)fullWeightQuality;
+	consecutiveWindowsDiscarded = 0;
+	if (fullWeightQuality == 0)
+	{
+		reply.copy("Weighting all measurements equally");
+	}
+	else
+	{
+		reply.printf("Discarding measurements below image quality %u, full weight from %u", minImageQuality, fullWeightImageQuality);
+	}
+	return GCodeResult::ok;
+}
+
+// Enable or disable time-aligned comparison
+GCodeResult LaserFilamentMonitor::SetTimeAligned(bool enable, const StringRef& reply) noexcept
+{
+	if (!EnableExtrusionHistory(enable))
+	{
+		reply.copy("Insufficient RAM for extrusion history");
+		return GCodeResult::error;
+	}
+	if (!enable)
+	{
+		maxPressureAdvance = 0.0;
+	}
+	ResetCorrelation();
+	Reset();
+	reply.printf("Time-aligned comparison %s", (enable) ? "enabled" : "disabled");
+	return GCodeResult::ok;
+}
+
 // Call the following at intervals to check the status. This is only called when printing is in progress.
 // 'filamentConsumed' is the net amount of extrusion commanded since the last call to this function.
 // 'hadNonPrintingMove' is true if filamentConsumed includes extruder movement from non-printing moves.
@@ -295,6 +519,7 @@ FilamentSensorStatus LaserFilamentMonitor::Check(bool isPrinting, bool fromIsr,
 		extrusionCommandedAtCandidateStartBit = extrusionCommandedSinceLastSync;
 		wasPrintingAtStartBit = isPrinting;
 		candidateStartBitTime = isrMillis;
+		candidateStartBitStepTime = GetCheckStepTime();
 		haveStartBitData = true;
 	}
 
@@ -303,7 +528,7 @@ FilamentSensorStatus LaserFilamentMonitor::Check(bool isPrinting, bool fromIsr,
 
 	// 4. Decide whether it is time to do a comparison, and return the status
 	FilamentSensorStatus ret = FilamentSensorStatus::ok;
-	if (sensorError)
+	if (sensorError || consecutiveWindowsDiscarded >= MaxConsecutiveDiscardedWindows)		// if every recent window was too poor to use then we are not really monitoring the filament
 	{
 		ret = FilamentSensorStatus::sensorError;
 	}
@@ -315,6 +540,7 @@ FilamentSensorStatus LaserFilamentMonitor::Check(bool isPrinting, bool fromIsr,
 	{
 		ret = CheckFilament(extrusionCommandedThisSegment, movementMeasuredThisSegment, false);
 		extrusionCommandedThisSegment = movementMeasuredThisSegment = 0.0;
+		AdjustPressureAdvance();
 	}
 	else if (   extrusionCommandedThisSegment + extrusionCommandedSinceLastSync >= minimumExtrusionCheckLength * 3
 			 && millis() - lastMeasurementTime > 500
@@ -359,6 +585,7 @@ FilamentSensorStatus LaserFilamentMonitor::CheckFilament(float amountCommanded,
 				totalMovementMeasured = -totalMovementMeasured;
 			}
 			minMovementRatio = maxMovementRatio = totalMovementMeasured/totalExtrusionCommanded;
+			RecordRatio(minMovementRatio);
 			if (comparisonEnabled)
 			{
 				if (minMovementRatio < minMovementAllowed)
@@ -383,6 +610,7 @@ FilamentSensorStatus LaserFilamentMonitor::CheckFilament(float amountCommanded,
 			}
 			totalMovementMeasured += extrusionMeasured;
 			const float ratio = extrusionMeasured/amountCommanded;
+			RecordRatio(ratio);
 			if (ratio > maxMovementRatio)
 			{
 				maxMovementRatio = ratio;
@@ -417,7 +645,7 @@ FilamentSensorStatus LaserFilamentMonitor::Clear() noexcept
 
 	return (!comparisonEnabled) ? FilamentSensorStatus::ok
 			: (!dataReceived) ? FilamentSensorStatus::noDataReceived
-				: (sensorError) ? FilamentSensorStatus::sensorError
+				: (sensorError || consecutiveWindowsDiscarded >= MaxConsecutiveDiscardedWindows) ? FilamentSensorStatus::sensorError
 					: ((sensorValue & switchOpenMask) != 0) ? FilamentSensorStatus::noFilament
 						: FilamentSensorStatus::ok;
 }
@@ -436,6 +664,34 @@ void LaserFilamentMonitor::Diagnostics(const StringRef& reply) noexcept
 	}
 	reply.catf(", errs: frame %" PRIu32 " parity %" PRIu32 " ovrun %" PRIu32 " pol %" PRIu32 " ovdue %" PRIu32,
 				framingErrorCount, parityErrorCount, overrunErrorCount, polarityErrorCount, overdueCount);
+	if (GetExtrusionHistory() != nullptr && sumCommandedSquared[bestLag] > 0.0)
+	{
+		// Report the lag and the flow ratio at that lag. A flow ratio that is below 100% but within the allowed range indicates partial under-extrusion or slip.
+		reply.catf(", lag %" PRIu32 "ms flow %ld%%",
+					StepTimer::TicksToIntegerMicroseconds(bestLag * CorrelationLagStep)/1000,
+					ConvertToPercent(fabsf(sumMeasuredTimesCommanded[bestLag]) * calibrationFactor/sumCommandedSquared[bestLag]));
+		float suggested;
+		if (GetSuggestedPressureAdvance(suggested))
+		{
+			reply.catf(" suggested PA %.3f%s", (double)suggested, (maxPressureAdvance > 0.0) ? " applied" : "");
+		}
+	}
+	if (windowsUsed != 0 || windowsDiscarded != 0)
+	{
+		reply.catf(", windows %" PRIu32 " avg weight %.2f discarded %" PRIu32 " (%u in a row)",
+					windowsUsed, (double)((windowsUsed != 0) ? totalWindowWeight/windowsUsed : 0.0), windowsDiscarded, consecutiveWindowsDiscarded);
+	}
+
+	// Report the ratio history as the lower bound of each bin in percent and the number of comparisons in it
+	bool first = true;
+	for (size_t i = 0; i < NumRatioBins; ++i)
+	{
+		if (ratioBins[i] != 0)
+		{
+			reply.catf("%s %u:%u", (first) ? ", ratio%" : "", (unsigned int)(i * RatioBinWidth * 100), ratioBins[i]);
+			first = false;
+		}
+	}
 }
 
 #endif	// SUPPORT_DRIVERS
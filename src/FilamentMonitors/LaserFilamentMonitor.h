@@ -21,6 +21,9 @@ public:
 	FilamentSensorStatus Check(bool isPrinting, bool fromIsr, uint32_t isrMillis, float filamentConsumed) noexcept override;
 	FilamentSensorStatus Clear() noexcept override;
 	void Diagnostics(const StringRef& reply) noexcept override;
+	GCodeResult SetTimeAligned(bool enable, const StringRef& reply) noexcept override;
+	GCodeResult SetMaxPressureAdvance(float maxAdvance, const StringRef& reply) noexcept override;
+	GCodeResult SetQualityWeighting(uint32_t minQuality, uint32_t fullWeightQuality, const StringRef& reply) noexcept override;
 
 private:
 	static constexpr float DefaultMinMovementAllowed = 0.6;
@@ -63,12 +66,39 @@ private:
 
 	static constexpr size_t EdgeCaptureBufferSize = 64;				// must be a power of 2
 
+	// Time-aligned comparison. We correlate the measured movement in each synced window with the extrusion commanded over the same window delayed by each candidate lag.
+	static constexpr size_t NumCorrelationLags = 8;
+	static constexpr uint32_t CorrelationLagStep = StepTimer::StepClockRate/50;	// 20ms between candidate lags
+	static constexpr float CorrelationDecay = 0.98;					// the factor by which we reduce the weight of older windows
+	static constexpr float MinCorrelationWeight = 1.0;				// the decayed sum of squared commanded extrusion (mm^2) we need before we suggest a pressure advance
+	static constexpr float MaxPressureAdvanceChange = 0.002;		// the most we change the pressure advance by at each comparison, in seconds
+	static constexpr float MaxPressureAdvanceLimit = 1.0;			// the highest limit on the applied pressure advance that we accept, in seconds
+
+	// Quality weighting, off by default. Windows measured while the image quality is below the minimum are discarded, and those below the full weight quality count for less.
+	static constexpr uint8_t DefaultMinImageQuality = 0;
+	static constexpr uint8_t DefaultFullWeightImageQuality = 0;
+	static constexpr uint8_t MinShutter = 1;						// a shutter value below this means the exposure has bottomed out and the image is probably saturated
+	static constexpr uint16_t MaxConsecutiveDiscardedWindows = 20;	// report a sensor error if we discard this many windows in a row, because we can't monitor the filament
+
+	// History of the measured/commanded ratio at each comparison
+	static constexpr size_t NumRatioBins = 16;
+	static constexpr float RatioBinWidth = 0.125;					// so the bins cover ratios from 0 to 200%
+
 	void Init() noexcept;
 	void Reset() noexcept;
 	void HandleIncomingData() noexcept;
 	float GetCurrentPosition() const noexcept;
 	FilamentSensorStatus CheckFilament(float amountCommanded, float amountMeasured, bool overdue) noexcept;
 
+	float GetTimeAlignedExtrusion(float unalignedExtrusion, float measuredMovement) noexcept;
+	void ResetCorrelation() noexcept;
+	float CorrelationScore(size_t lag) const noexcept;
+	bool GetSuggestedPressureAdvance(float& advance) const noexcept;
+	void AdjustPressureAdvance() noexcept;
+
+	float GetQualityWeight() const noexcept;
+	void RecordRatio(float ratio) noexcept;
+
 	bool HaveCalibrationData() const noexcept;
 	float MeasuredSensitivity() const noexcept;
 
@@ -88,6 +118,8 @@ private:
 	float extrusionCommandedAtCandidateStartBit;			// the amount of extrusion commanded since the previous comparison when we received the possible start bit
 
 	uint32_t lastSyncTime;									// the last time we took a measurement that was synced to a start bit
+	uint32_t candidateStartBitStepTime;						// the step clock time that we received the possible start bit
+	uint32_t lastSyncStepTime;								// the step clock time of the last measurement that was synced to a start bit
 	float extrusionCommandedSinceLastSync;
 	float movementMeasuredSinceLastSync;
 
@@ -100,6 +132,7 @@ private:
 	uint8_t brightness;										// brightness returned by sensor
 	uint8_t lastErrorCode;									// the last error code received
 	bool sensorError;										// true if received an error report (cleared by a position report)
+	bool shutterReceived;									// true if the sensor has reported a shutter value
 
 	bool wasPrintingAtStartBit;
 	bool haveStartBitData;
@@ -108,6 +141,23 @@ private:
 	float extrusionCommandedThisSegment;					// the amount of extrusion commanded since we last did a comparison
 	float movementMeasuredThisSegment;						// the accumulated movement since the previous comparison
 
+	// Correlation of measured movement with lagged commanded extrusion
+	float sumMeasuredTimesCommanded[NumCorrelationLags];
+	float sumCommandedSquared[NumCorrelationLags];
+	size_t bestLag;
+	float maxPressureAdvance;								// the highest pressure advance we may apply from the lag estimate, or zero to only report it
+
+	// Quality weighting of the measurements
+	uint8_t minImageQuality;								// windows measured at a lower image quality are discarded
+	uint8_t fullWeightImageQuality;							// windows measured at this image quality or higher get full weight, or zero to weight all windows equally
+	uint32_t windowsUsed;									// the number of synced windows we compared
+	uint32_t windowsDiscarded;								// the number of synced windows we discarded because of poor quality
+	uint16_t consecutiveWindowsDiscarded;					// the number of synced windows we discarded since we last used one
+	float totalWindowWeight;								// the sum of the weights of the windows we used
+
+	// History of the measured/commanded ratio
+	uint16_t ratioBins[NumRatioBins];
+
 	// Values measured for calibration
 	float minMovementRatio, maxMovementRatio;
 	float totalExtrusionCommanded;
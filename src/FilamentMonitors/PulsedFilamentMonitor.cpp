@@ -14,6 +14,12 @@
 #include <CanMessageFormats.h>
 #include <CanMessageGenericParser.h>
 
+#if SUPPORT_PULSE_COUNTER
+# include <Hardware/IoPorts.h>
+
+PulsedFilamentMonitor *PulsedFilamentMonitor::counterOwner = nullptr;
+#endif
+
 // Unless we set the option to compare filament on all type of move, we reject readings if the last retract or reprime move wasn't completed
 // well before the start bit was received. This is because those moves have high accelerations and decelerations, so the measurement delay
 // is more likely to cause errors. This constant sets the delay required after a retract or reprime move before we accept the measurement.
@@ -28,6 +34,16 @@ PulsedFilamentMonitor::PulsedFilamentMonitor(unsigned int extruder, unsigned int
 	Init();
 }
 
+PulsedFilamentMonitor::~PulsedFilamentMonitor() noexcept
+{
+#if SUPPORT_PULSE_COUNTER
+	if (UsingHardwareCounter())
+	{
+		StopHardwareCounter();
+	}
+#endif
+}
+
 void PulsedFilamentMonitor::Init() noexcept
 {
 	sensorValue = 0;
@@ -64,7 +80,22 @@ float PulsedFilamentMonitor::MeasuredSensitivity() const noexcept
 GCodeResult PulsedFilamentMonitor::Configure(const CanMessageGenericParser& parser, const StringRef& reply) noexcept
 {
 	bool seen = false;
-	const GCodeResult rslt = CommonConfigure(parser, reply, InterruptMode::rising, seen);
+	GCodeResult rslt = CommonConfigure(parser, reply, InterruptMode::rising, seen);
+#if SUPPORT_PULSE_COUNTER
+	// If the pin was changed, count the pulses in hardware instead of taking an interrupt for each one if the counter is free and the pin can generate events
+	if (Succeeded(rslt) && seen)
+	{
+		if (UsingHardwareCounter())
+		{
+			StopHardwareCounter();
+		}
+		if (counterOwner == nullptr && PinTable[GetPort().GetPin()].exintNumber != Nx && !StartHardwareCounter())
+		{
+			reply.copy("unsuitable pin");
+			rslt = GCodeResult::error;
+		}
+	}
+#endif
 	if (Succeeded(rslt))
 	{
 		if (parser.GetFloatParam('L', mmPerPulse))
@@ -106,6 +137,12 @@ GCodeResult PulsedFilamentMonitor::Configure(const CanMessageGenericParser& pars
 		{
 			reply.copy("Pulse-type filament monitor on pin ");
 			GetPort().AppendPinName(reply);
+#if SUPPORT_PULSE_COUNTER
+			if (UsingHardwareCounter())
+			{
+				reply.cat(" (hardware counter)");
+			}
+#endif
 			reply.catf(", %s, sensitivity %.3fmm/pulse, allowed movement %ld%% to %ld%%, check every %.1fmm, ",
 						(comparisonEnabled) ? "enabled" : "disabled",
 						(double)mmPerPulse,
@@ -154,13 +191,101 @@ bool PulsedFilamentMonitor::Interrupt() noexcept
 	return false;
 }
 
+// Call this to disable the interrupt or the hardware counter before deleting or re-configuring the filament monitor
+void PulsedFilamentMonitor::Disable() noexcept
+{
+#if SUPPORT_PULSE_COUNTER
+	if (UsingHardwareCounter())
+	{
+		StopHardwareCounter();
+	}
+#endif
+	FilamentMonitor::Disable();
+}
+
+#if SUPPORT_PULSE_COUNTER
+
+// Route rising edges on our pin through the event system to the pulse counter, so that we don't need an interrupt per pulse. Return true if successful.
+// This follows the same sequence as the quadrature decoder on the EXP1HCE.
+bool PulsedFilamentMonitor::StartHardwareCounter() noexcept
+{
+	const Pin pin = GetPort().GetPin();
+	GetPort().DetachInterrupt();								// the pin is no longer used to generate interrupts
+	const ExintNumber exint = AttachEvent(pin, InterruptMode::rising, false);
+	if (exint == Nx)
+	{
+		return false;
+	}
+
+	MCLK->APBCMASK.reg |= MCLK_APBCMASK_EVSYS;
+	EnableTcClock(PulseCounterTcNumber, GclkNum48MHz);
+
+	EVSYS->USER[PulseCounterEventUser].reg = PulseCounterEventChannel + 1;
+	static constexpr uint32_t EVSYS_CHANNEL_EVGEN_EIC_EXINT0 = 0x0E;	// see datasheet (this definition is not in the device pack)
+	EVSYS->CHANNEL[PulseCounterEventChannel].reg = EVSYS_CHANNEL_EVGEN(EVSYS_CHANNEL_EVGEN_EIC_EXINT0 + exint) | EVSYS_CHANNEL_PATH_ASYNCHRONOUS | EVSYS_CHANNEL_ONDEMAND;
+
+	PulseCounterTc->CTRLA.reg = 0;								// datasheet says disable before reset to avoid undefined behaviour
+	while (PulseCounterTc->SYNCBUSY.bit.ENABLE) { }
+	PulseCounterTc->CTRLA.reg = TC_CTRLA_SWRST;
+	while (PulseCounterTc->SYNCBUSY.bit.SWRST) { }
+	PulseCounterTc->CTRLA.reg = TC_CTRLA_MODE_COUNT16;
+	PulseCounterTc->EVCTRL.reg = TC_EVCTRL_EVACT_COUNT | TC_EVCTRL_TCEI;
+	PulseCounterTc->CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_ENABLE;
+	while (PulseCounterTc->SYNCBUSY.bit.ENABLE) { }
+
+	counterOwner = this;
+	lastCounterValue = 0;
+	return true;
+}
+
+void PulsedFilamentMonitor::StopHardwareCounter() noexcept
+{
+	PulseCounterTc->CTRLA.reg = 0;
+	while (PulseCounterTc->SYNCBUSY.bit.ENABLE) { }
+	EVSYS->CHANNEL[PulseCounterEventChannel].reg = 0;
+	EVSYS->USER[PulseCounterEventUser].reg = 0;
+	counterOwner = nullptr;
+}
+
+// Return the number of pulses counted since we last called this. We call it often enough that the 16-bit counter can't wrap more than once between calls.
+uint32_t PulsedFilamentMonitor::GetHardwareCount() noexcept
+{
+	PulseCounterTc->CTRLBSET.reg = TC_CTRLBSET_CMD_READSYNC;
+	while (PulseCounterTc->CTRLBSET.bit.CMD != 0) { }
+	while (PulseCounterTc->SYNCBUSY.bit.COUNT) { }
+	const uint16_t count = PulseCounterTc->COUNT.reg;
+	const uint16_t pulses = count - lastCounterValue;
+	lastCounterValue = count;
+	if (pulses != 0)
+	{
+		if (samplesReceived < 100)
+		{
+			++samplesReceived;
+		}
+		lastMeasurementTime = millis();
+	}
+	return pulses;
+}
+
+#endif
+
 // Call the following regularly to keep the status up to date
 void PulsedFilamentMonitor::Poll() noexcept
 {
-	IrqDisable();
-	const uint32_t locSensorVal = sensorValue;
-	sensorValue = 0;
-	IrqEnable();
+	uint32_t locSensorVal;
+#if SUPPORT_PULSE_COUNTER
+	if (UsingHardwareCounter())
+	{
+		locSensorVal = GetHardwareCount();
+	}
+	else
+#endif
+	{
+		IrqDisable();
+		locSensorVal = sensorValue;
+		sensorValue = 0;
+		IrqEnable();
+	}
 	movementMeasuredSinceLastSync += (float)locSensorVal;
 
 	if (haveInterruptData)					// if we have a synchronised value for the amount of extrusion commanded
@@ -188,7 +313,15 @@ FilamentSensorStatus PulsedFilamentMonitor::Check(bool isPrinting, bool fromIsr,
 	// 1. Update the extrusion commanded
 	extrusionCommandedSinceLastSync += filamentConsumed;
 
-	// 2. If this call passes values synced to the interrupt, save the data
+	// 2. If this call passes values synced to the interrupt, save the data.
+	// When we count pulses in hardware we read the counter at the same time as the commanded extrusion, so every call is synced.
+#if SUPPORT_PULSE_COUNTER
+	if (UsingHardwareCounter())
+	{
+		fromIsr = true;
+		isrMillis = millis();
+	}
+#endif
 	if (fromIsr)
 	{
 		extrusionCommandedAtInterrupt = extrusionCommandedSinceLastSync;
@@ -16,12 +16,14 @@ class PulsedFilamentMonitor : public FilamentMonitor
 {
 public:
 	PulsedFilamentMonitor(unsigned int extruder, unsigned int monitorType) noexcept;
+	~PulsedFilamentMonitor() noexcept override;
 
 	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) noexcept override;
 	FilamentSensorStatus Check(bool isPrinting, bool fromIsr, uint32_t isrMillis, float filamentConsumed) noexcept override;
 	FilamentSensorStatus Clear() noexcept override;
 	void Diagnostics(const StringRef& reply) noexcept override;
 	bool Interrupt() noexcept override;
+	void Disable() noexcept override;
 
 private:
 	static constexpr float DefaultMmPerPulse = 1.0;
@@ -34,6 +36,15 @@ private:
 	void Poll() noexcept;
 	FilamentSensorStatus CheckFilament(float amountCommanded, float amountMeasured, bool overdue) noexcept;
 
+#if SUPPORT_PULSE_COUNTER
+	bool StartHardwareCounter() noexcept;
+	void StopHardwareCounter() noexcept;
+	uint32_t GetHardwareCount() noexcept;
+	bool UsingHardwareCounter() const noexcept { return counterOwner == this; }
+
+	static PulsedFilamentMonitor *counterOwner;				// the monitor that is using the hardware pulse counter, if any
+#endif
+
 	bool DataReceived() const noexcept;
 	bool HaveCalibrationData() const noexcept;
 	float MeasuredSensitivity() const noexcept;
@@ -49,6 +60,9 @@ private:
 	uint32_t lastIsrTime;									// the time we recorded an interrupt
 	uint32_t lastSyncTime;									// the last time we synced a measurement
 	uint32_t lastMeasurementTime;							// the last time we received a value
+#if SUPPORT_PULSE_COUNTER
+	uint16_t lastCounterValue;								// the hardware counter value when we last read it
+#endif
 
 	float extrusionCommandedAtInterrupt;					// the amount of extrusion commanded (mm) when we received the interrupt since the last sync
 	float extrusionCommandedSinceLastSync;					// the amount of extrusion commanded (mm) since the last sync
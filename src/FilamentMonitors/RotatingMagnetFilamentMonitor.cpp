@@ -11,6 +11,7 @@
 
 #include "Platform.h"
 #include "Movement/Move.h"
+#include "Movement/StepTimer.h"
 #include <CanMessageFormats.h>
 #include <CanMessageGenericParser.h>
 
@@ -47,7 +48,9 @@ void RotatingMagnetFilamentMonitor::Init() noexcept
 
 void RotatingMagnetFilamentMonitor::Reset() noexcept
 {
-	extrusionCommandedThisSegment = extrusionCommandedSinceLastSync = movementMeasuredThisSegment = movementMeasuredSinceLastSync = 0.0;
+	extrusionCommandedThisSegment = extrusionCommandedSinceLastSync = movementMeasuredThisSegment = 0.0;
+	countsMeasuredSinceLastSync = 0;
+	commandedSpeed = measuredSpeed = 0.0;
 	magneticMonitorState = MagneticMonitorState::idle;
 	haveStartBitData = false;
 	synced = false;							// force a resync
@@ -178,6 +181,28 @@ GCodeResult RotatingMagnetFilamentMonitor::Configure(const CanMessageGenericPars
 	return rslt;
 }
 
+// Get the amount of extrusion commanded between comparisons. This shortens at high extrusion speeds so that we detect slipping filament sooner.
+float RotatingMagnetFilamentMonitor::GetCheckLength() const noexcept
+{
+	if (commandedSpeed <= AdaptiveReferenceSpeed)
+	{
+		return minimumExtrusionCheckLength;
+	}
+	return min<float>(minimumExtrusionCheckLength, max<float>(minimumExtrusionCheckLength * AdaptiveReferenceSpeed/commandedSpeed, MinRevsPerCheck * mmPerRev));
+}
+
+// Update the commanded and measured speeds from a sync window, timed by the start bits that bound it
+void RotatingMagnetFilamentMonitor::UpdateSpeeds(float amountCommanded, int32_t countsMeasured, uint32_t windowTicks) noexcept
+{
+	if (windowTicks != 0)
+	{
+		const float recipWindowSeconds = (float)StepTimer::StepClockRate/(float)windowTicks;
+		const float windowMeasuredSpeed = (float)((backwards) ? -countsMeasured : countsMeasured) * (mmPerRev/CountsPerRev) * recipWindowSeconds;
+		commandedSpeed += (amountCommanded * recipWindowSeconds - commandedSpeed) * SpeedFilterFactor;
+		measuredSpeed += (windowMeasuredSpeed - measuredSpeed) * SpeedFilterFactor;
+	}
+}
+
 // Deal with any received data
 void RotatingMagnetFilamentMonitor::HandleIncomingData() noexcept
 {
@@ -288,10 +313,11 @@ void RotatingMagnetFilamentMonitor::HandleIncomingData() noexcept
 		if (receivedPositionReport)
 		{
 			// We have a completed a position report
+			// Accumulate the angle change in sensor counts. We assume that the filament moved by less than half a revolution between reports, so the shorter way round is the right one.
+			// Integer counts don't lose precision however many reports we receive between syncs, so we only convert to revolutions when we use the movement.
 			lastKnownPosition = sensorValue & TypeMagnetAngleMask;
 			const uint16_t angleChange = (val - sensorValue) & TypeMagnetAngleMask;			// angle change in range 0..1023
-			const int32_t movement = (angleChange <= 512) ? (int32_t)angleChange : (int32_t)angleChange - 1024;
-			movementMeasuredSinceLastSync += (float)movement/1024;
+			countsMeasuredSinceLastSync += (angleChange <= CountsPerRev/2) ? (int32_t)angleChange : (int32_t)angleChange - CountsPerRev;
 			sensorValue = val;
 			lastMeasurementTime = millis();
 
@@ -305,12 +331,14 @@ void RotatingMagnetFilamentMonitor::HandleIncomingData() noexcept
 					{
 						// We can use this measurement
 						extrusionCommandedThisSegment += extrusionCommandedAtCandidateStartBit;
-						movementMeasuredThisSegment += movementMeasuredSinceLastSync;
+						movementMeasuredThisSegment += (float)countsMeasuredSinceLastSync * (1.0/CountsPerRev);
+						UpdateSpeeds(extrusionCommandedAtCandidateStartBit, countsMeasuredSinceLastSync, GetWordStartTime() - lastSyncWordTime);
 					}
 				}
 				lastSyncTime = candidateStartBitTime;
+				lastSyncWordTime = GetWordStartTime();
 				extrusionCommandedSinceLastSync -= extrusionCommandedAtCandidateStartBit;
-				movementMeasuredSinceLastSync = 0.0;
+				countsMeasuredSinceLastSync = 0;
 				synced = checkNonPrintingMoves || wasPrintingAtStartBit;
 			}
 		}
@@ -341,6 +369,7 @@ FilamentSensorStatus RotatingMagnetFilamentMonitor::Check(bool isPrinting, bool
 
 	// 4. Decide whether it is time to do a comparison, and return the status
 	FilamentSensorStatus ret = FilamentSensorStatus::ok;
+	const float checkLength = GetCheckLength();
 	if (sensorError)
 	{
 		ret = FilamentSensorStatus::sensorError;
@@ -349,19 +378,21 @@ FilamentSensorStatus RotatingMagnetFilamentMonitor::Check(bool isPrinting, bool
 	{
 		ret = FilamentSensorStatus::noFilament;
 	}
-	else if (extrusionCommandedThisSegment >= minimumExtrusionCheckLength)
+	else if (extrusionCommandedThisSegment >= checkLength)
 	{
 		ret = CheckFilament(extrusionCommandedThisSegment, movementMeasuredThisSegment, false);
 		extrusionCommandedThisSegment = movementMeasuredThisSegment = 0.0;
 	}
-	else if (   extrusionCommandedThisSegment + extrusionCommandedSinceLastSync >= minimumExtrusionCheckLength * 3
+	else if (   extrusionCommandedThisSegment + extrusionCommandedSinceLastSync >= checkLength * 3
 			 && millis() - lastMeasurementTime > 500
 			 && !IsReceiving()
 			)
 	{
 		// A sync is overdue
-		ret = CheckFilament(extrusionCommandedThisSegment + extrusionCommandedSinceLastSync, movementMeasuredThisSegment + movementMeasuredSinceLastSync, true);
-		extrusionCommandedThisSegment = extrusionCommandedSinceLastSync = movementMeasuredThisSegment = movementMeasuredSinceLastSync = 0.0;
+		ret = CheckFilament(extrusionCommandedThisSegment + extrusionCommandedSinceLastSync,
+							movementMeasuredThisSegment + (float)countsMeasuredSinceLastSync * (1.0/CountsPerRev), true);
+		extrusionCommandedThisSegment = extrusionCommandedSinceLastSync = movementMeasuredThisSegment = 0.0;
+		countsMeasuredSinceLastSync = 0;
 	}
 
 	return (comparisonEnabled) ? ret : FilamentSensorStatus::ok;
@@ -476,6 +507,7 @@ void RotatingMagnetFilamentMonitor::Diagnostics(const StringRef& reply) noexcept
 	{
 		reply.cat("no data received");
 	}
+	reply.catf(", speed cmd %.1f meas %.1fmm/s, check %.2fmm", (double)commandedSpeed, (double)measuredSpeed, (double)GetCheckLength());
 	reply.catf(", errs: frame %" PRIu32 " parity %" PRIu32 " ovrun %" PRIu32 " pol %" PRIu32 " ovdue %" PRIu32,
 				framingErrorCount, parityErrorCount, overrunErrorCount, polarityErrorCount, overdueCount);
 }
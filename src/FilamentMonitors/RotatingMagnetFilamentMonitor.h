@@ -28,6 +28,12 @@ private:
 	static constexpr float DefaultMaxMovementAllowed = 1.6;
 	static constexpr float DefaultMinimumExtrusionCheckLength = 3.0;
 
+	// Above this commanded extrusion speed in mm/sec we shorten the check length in proportion, because each sync window then covers many sensor counts
+	static constexpr float AdaptiveReferenceSpeed = 5.0;
+	static constexpr float MinRevsPerCheck = 0.05;					// never shorten the check length below this fraction of a revolution, so that angle quantisation stays small
+	static constexpr float SpeedFilterFactor = 0.25;				// the weight of each new sync window in the filtered speeds
+	static constexpr int32_t CountsPerRev = 1024;
+
 	// Version 1 message definitions
 	static constexpr uint16_t TypeMagnetV1ErrorMask = 0x8000u;
 	static constexpr uint16_t TypeMagnetV1SwitchOpenMask = 0x4000;
@@ -56,6 +62,8 @@ private:
 	void Reset() noexcept;
 	void HandleIncomingData() noexcept;
 	FilamentSensorStatus CheckFilament(float amountCommanded, float amountMeasured, bool overdue) noexcept;
+	void UpdateSpeeds(float amountCommanded, int32_t countsMeasured, uint32_t windowTicks) noexcept;
+	float GetCheckLength() const noexcept;
 
 	bool HaveCalibrationData() const noexcept;
 	float MeasuredSensitivity() const noexcept;
@@ -76,8 +84,13 @@ private:
 	float extrusionCommandedAtCandidateStartBit;			// the amount of extrusion commanded since the previous comparison when we received the possible start bit
 
 	uint32_t lastSyncTime;									// the last time we took a measurement that was synced to a start bit
+	uint32_t lastSyncWordTime;								// the step clock time of the start bit of that measurement, from the edge capture buffer
 	float extrusionCommandedSinceLastSync;
-	float movementMeasuredSinceLastSync;
+	int32_t countsMeasuredSinceLastSync;					// the movement since the last sync in sensor counts, tracked across angle wraparound
+
+	// Speeds over the recent sync windows, used to adapt the check length and for diagnostics
+	float commandedSpeed;									// mm/sec
+	float measuredSpeed;									// mm/sec
 
 	uint16_t sensorValue;									// the last data word received from the sensor
 	uint16_t lastKnownPosition;								// last known filament position (10 bits)
@@ -9,9 +9,76 @@
 #include <CAN/CanInterface.h>
 #include <CanMessageGenericParser.h>
 #include <CanMessageGenericTables.h>
+#include <Movement/StepTimer.h>
+
+#if SUPPORT_DRIVERS
+# include <Movement/Move.h>
+#endif
+
+constexpr size_t MaxPendingTimedWrites = 8;
+
+struct TimedWrite
+{
+	uint32_t when;										// the step clock time at which to write the port
+	float pwm;
+	uint8_t portNumber;
+};
 
 static PwmPort ports[MaxGpOutPorts];
 
+// Timed writes are executed by a step timer callback. The callback runs at step interrupt priority, so tasks disable interrupts while they change the queue.
+static TimedWrite pendingWrites[MaxPendingTimedWrites];	// writes not yet done, soonest first
+static size_t numPendingWrites = 0;
+static StepTimer writeTimer;
+static bool writeTimerInitialised = false;
+static uint32_t numTimedWrites = 0;
+static uint32_t numTimedWritesRejected = 0;
+
+#if SUPPORT_DRIVERS
+static uint32_t motionSyncedPorts = 0;					// bitmap of ports whose writes we apply at the next move boundary
+static_assert(MaxGpOutPorts <= 32);
+
+// Velocity-proportional PWM, e.g. for a laser. We write the port periodically with the requested PWM scaled by the step rate of the executing move,
+// so that the PWM is proportional to the actual speed and not to the speed relative to whatever top speed each move has.
+constexpr uint32_t MaxVelocityPwmUpdateRate = 10000;	// the maximum updates per second, to limit the load on the step interrupt
+constexpr size_t NoVelocityPort = MaxGpOutPorts;
+static size_t velocityPort = NoVelocityPort;				// the port whose PWM follows the speed, or NoVelocityPort if none
+static volatile float velocityRequestedPwm = 0.0;		// the PWM to use at the full speed step rate
+static float velocityFullSpeedStepRate;					// the step rate at which we use the requested PWM, in steps per step clock
+static uint32_t velocityUpdateInterval;					// in step clocks
+static uint32_t velocityNextUpdateTime;
+static StepTimer velocityTimer;
+
+static void VelocityTimerCallback(CallbackParameter) noexcept
+{
+	if (velocityPort < NoVelocityPort)
+	{
+		ports[velocityPort].WriteAnalog(velocityRequestedPwm * min<float>(moveInstance->GetCurrentStepRate()/velocityFullSpeedStepRate, 1.0));
+		do
+		{
+			velocityNextUpdateTime += velocityUpdateInterval;	// if we are running late then skip updates rather than doing them all at once
+		} while (velocityTimer.ScheduleCallbackFromIsr(velocityNextUpdateTime));
+	}
+}
+#endif
+
+// Do the timed writes that are due and schedule the callback for the next one
+static void WriteTimerCallback(CallbackParameter) noexcept
+{
+	while (numPendingWrites != 0)
+	{
+		const TimedWrite& tw = pendingWrites[0];
+		if ((int32_t)(tw.when - StepTimer::GetTimerTicks()) > 0 && !writeTimer.ScheduleCallbackFromIsr(tw.when))
+		{
+			return;
+		}
+		ports[tw.portNumber].WriteAnalog(tw.pwm);
+		--numPendingWrites;
+		memmove(pendingWrites, pendingWrites + 1, numPendingWrites * sizeof(TimedWrite));
+		++numTimedWrites;
+	}
+}
+
 GCodeResult GpioPorts::HandleM950Gpio(const CanMessageGeneric &msg, const StringRef &reply)
 {
 	// Get and validate the port number
@@ -83,8 +150,141 @@ GCodeResult GpioPorts::HandleGpioWrite(const CanMessageWriteGpio &msg, const Str
 		return GCodeResult::error;
 	}
 
+#if SUPPORT_DRIVERS
+	if (msg.portNumber == velocityPort)
+	{
+		velocityRequestedPwm = msg.pwm;					// the velocity timer will write the port
+		return GCodeResult::ok;
+	}
+
+	// If the port is synchronised to motion and a move is executing or waiting to start, write the port when it finishes or starts.
+	// Otherwise there is no move to synchronise with, so we write the port now.
+	uint32_t when;
+	if ((motionSyncedPorts & (1u << msg.portNumber)) != 0 && moveInstance->GetNextMoveBoundary(when))
+	{
+		if (ScheduleWrite(msg.portNumber, msg.pwm, when))
+		{
+			return GCodeResult::ok;
+		}
+		ports[msg.portNumber].WriteAnalog(msg.pwm);
+		reply.printf("Too many timed GPIO writes pending, so port %u was written immediately", msg.portNumber);
+		return GCodeResult::warning;
+	}
+#endif
+
 	ports[msg.portNumber].WriteAnalog(msg.pwm);
 	return GCodeResult::ok;
 }
 
+// Write a port at the specified step clock time, or at once if that time has passed. Writes due at the same time are done in the order we were asked to do them.
+bool GpioPorts::ScheduleWrite(size_t portNumber, float pwm, uint32_t when) noexcept
+{
+	if (!writeTimerInitialised)
+	{
+		writeTimer.SetCallback(WriteTimerCallback, CallbackParameter(nullptr), "GPIO");
+		writeTimerInitialised = true;
+	}
+
+	AtomicCriticalSectionLocker lock;
+	if (numPendingWrites == MaxPendingTimedWrites)
+	{
+		++numTimedWritesRejected;
+		return false;
+	}
+
+	size_t index = numPendingWrites;
+	while (index != 0 && (int32_t)(pendingWrites[index - 1].when - when) > 0)
+	{
+		pendingWrites[index] = pendingWrites[index - 1];
+		--index;
+	}
+	pendingWrites[index].when = when;
+	pendingWrites[index].pwm = pwm;
+	pendingWrites[index].portNumber = portNumber;
+	++numPendingWrites;
+
+	if (index == 0 && writeTimer.ScheduleCallbackFromIsr(when))
+	{
+		WriteTimerCallback(CallbackParameter(nullptr));			// it is due already
+	}
+	return true;
+}
+
+#if SUPPORT_DRIVERS
+
+GCodeResult GpioPorts::ConfigureMotionSync(uint32_t portNumber, bool sync, const StringRef& reply) noexcept
+{
+	if (portNumber >= MaxGpOutPorts)
+	{
+		reply.printf("GPIO port# %" PRIu32 " is too high for this expansion board", portNumber);
+		return GCodeResult::error;
+	}
+
+	if (sync)
+	{
+		motionSyncedPorts |= 1u << portNumber;
+	}
+	else
+	{
+		motionSyncedPorts &= ~(1u << portNumber);
+	}
+	reply.printf("GPIO port %" PRIu32 " writes are applied %s, %" PRIu32 " timed writes done, %" PRIu32 " rejected",
+					portNumber, (sync) ? "at the next move boundary" : "immediately", numTimedWrites, numTimedWritesRejected);
+	return GCodeResult::ok;
+}
+
+// Make the PWM of a port follow the speed of the executing move, updating it updateRate times per second, or stop doing so if updateRate is zero.
+// Writes to the port then set the PWM to use when the fastest drive in the move is stepping at fullSpeedStepRate steps per second. Only one port at a time can do this.
+// The speed is the speed of the moves that this board executes, so the board must be driving a motor involved in them.
+GCodeResult GpioPorts::ConfigureVelocityPwm(uint32_t portNumber, uint32_t updateRate, uint32_t fullSpeedStepRate, const StringRef& reply) noexcept
+{
+	if (portNumber >= MaxGpOutPorts)
+	{
+		reply.printf("GPIO port# %" PRIu32 " is too high for this expansion board", portNumber);
+		return GCodeResult::error;
+	}
+
+	if (updateRate == 0)
+	{
+		if (velocityPort == portNumber)
+		{
+			velocityTimer.CancelCallback();
+			velocityPort = NoVelocityPort;
+			ports[portNumber].WriteAnalog(velocityRequestedPwm);
+		}
+		reply.printf("GPIO port %" PRIu32 " PWM does not follow the speed", portNumber);
+		return GCodeResult::ok;
+	}
+
+	if (velocityPort != NoVelocityPort && velocityPort != portNumber)
+	{
+		reply.printf("GPIO port %u PWM already follows the speed", (unsigned int)velocityPort);
+		return GCodeResult::error;
+	}
+	if (updateRate > MaxVelocityPwmUpdateRate)
+	{
+		reply.printf("Maximum update rate is %" PRIu32 "Hz", MaxVelocityPwmUpdateRate);
+		return GCodeResult::error;
+	}
+	if (fullSpeedStepRate == 0)
+	{
+		reply.copy("Full speed step rate must be greater than zero");
+		return GCodeResult::error;
+	}
+
+	velocityTimer.CancelCallback();
+	velocityTimer.SetCallback(VelocityTimerCallback, CallbackParameter(nullptr), "velocity PWM");
+	velocityUpdateInterval = StepTimer::StepClockRate/updateRate;
+	velocityFullSpeedStepRate = (float)fullSpeedStepRate/(float)StepTimer::StepClockRate;
+	velocityRequestedPwm = 0.0;
+	velocityPort = portNumber;
+	ports[portNumber].WriteAnalog(0.0);
+	velocityNextUpdateTime = StepTimer::GetTimerTicks() + velocityUpdateInterval;
+	(void)velocityTimer.ScheduleCallback(velocityNextUpdateTime);
+	reply.printf("GPIO port %" PRIu32 " PWM follows the speed with full PWM at %" PRIu32 " steps/sec, updated %" PRIu32 " times per second", portNumber, fullSpeedStepRate, updateRate);
+	return GCodeResult::ok;
+}
+
+#endif
+
 // End
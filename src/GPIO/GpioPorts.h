@@ -16,6 +16,11 @@ namespace GpioPorts
 {
 	GCodeResult HandleM950Gpio(const CanMessageGeneric& msg, const StringRef& reply);
 	GCodeResult HandleGpioWrite(const CanMessageWriteGpio& msg, const StringRef& reply);
+	bool ScheduleWrite(size_t portNumber, float pwm, uint32_t when) noexcept;		// write a port at a step clock time, returning false if too many writes are pending
+#if SUPPORT_DRIVERS
+	GCodeResult ConfigureMotionSync(uint32_t portNumber, bool sync, const StringRef& reply) noexcept;	// apply writes to a port at the next move boundary instead of at once
+	GCodeResult ConfigureVelocityPwm(uint32_t portNumber, uint32_t updateRate, uint32_t fullSpeedStepRate, const StringRef& reply) noexcept;	// scale the PWM of a port by the speed of the executing move
+#endif
 }
 
 #endif /* SRC_GPIO_GPODEVICE_H_ */
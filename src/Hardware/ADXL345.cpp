@@ -0,0 +1,250 @@
+/*
+ * ADXL345.cpp
+ */
+
+#include "ADXL345.h"
+
+#if SUPPORT_SPI_SENSORS && SUPPORT_ADXL345
+
+#include <Hardware/IoPorts.h>
+#include <Movement/StepTimer.h>
+
+constexpr uint32_t AdxlSpiClockFrequency = 4000000;					// the ADXL345 allows up to 5MHz and needs at least 2MHz to sustain 3200Hz sampling
+constexpr uint32_t AdxlSpiTimeout = 10;
+constexpr uint8_t FifoInterruptLevel = 24;							// how full the FIFO must get before we want an interrupt
+
+constexpr uint8_t DevIdValue = 0xE5;
+constexpr uint8_t ReadBit = 0x80;
+constexpr uint8_t MultipleBytesBit = 0x40;
+
+// Reading the 6 data registers in one transaction pops one entry from the FIFO
+alignas(4) static const uint8_t ReadFifoEntryCommand[7] = { ReadBit | MultipleBytesBit | 0x32, 0, 0, 0, 0, 0, 0 };
+
+static void Adxl345Int1Interrupt(CallbackParameter p) noexcept;		// forward declaration
+
+ADXL345::ADXL345(SharedSpiDevice& dev, Pin p_csPin, Pin p_int1Pin) noexcept
+	: SharedSpiClient(dev, AdxlSpiClockFrequency, SpiMode::mode3, false), taskWaiting(nullptr), interruptError(false), int1Pin(p_int1Pin)
+{
+	SetCsPin(p_csPin);
+	InitMaster();
+}
+
+// Do a quick test to check whether the accelerometer is present, returning true if it is
+bool ADXL345::CheckPresent() noexcept
+{
+	interruptError = false;
+	uint8_t val;
+	return ReadRegister(AdxlRegister::DevId, val) && val == DevIdValue;
+}
+
+uint8_t ADXL345::ReadStatus() noexcept
+{
+	uint8_t val;
+	return (ReadRegister(AdxlRegister::IntSource, val)) ? val : 0xFF;
+}
+
+// Configure the accelerometer to collect at or near the requested sampling rate. The resolution is always 10 bits in the +/-2g range.
+// Update the sampling rate and resolution to the actual values used.
+bool ADXL345::Configure(uint16_t& samplingRate, uint8_t& resolution) noexcept
+{
+	resolution = 10;
+	if (samplingRate == 0 || samplingRate >= 2400)
+	{
+		samplingRate = 3200;
+		bwRate = 0x0F;
+	}
+	else if (samplingRate >= 1200)
+	{
+		samplingRate = 1600;
+		bwRate = 0x0E;
+	}
+	else if (samplingRate >= 600)
+	{
+		samplingRate = 800;
+		bwRate = 0x0D;
+	}
+	else
+	{
+		samplingRate = 400;												// select 400Hz, lower is not useful
+		bwRate = 0x0C;
+	}
+
+	return WriteRegister(AdxlRegister::PowerCtl, 0)						// standby mode until we start collecting
+		&& WriteRegister(AdxlRegister::BwRate, bwRate)
+		&& WriteRegister(AdxlRegister::DataFormat, 1u << 2)				// 4-wire SPI, interrupts active high, +/-2g, data left justified to match the LIS3DH
+		&& WriteRegister(AdxlRegister::IntMap, 0)						// all interrupts on INT1
+		&& WriteRegister(AdxlRegister::IntEnable, 1u << 1)				// watermark interrupt
+		&& WriteRegister(AdxlRegister::FifoCtl, (2u << 6) | FifoInterruptLevel);	// stream mode
+}
+
+// Start collecting data, returning true if successful. The ADXL345 always samples all three axes.
+bool ADXL345::StartCollecting(uint8_t axes) noexcept
+{
+	// Clear the fifo by switching it to bypass mode and back
+	if (!WriteRegister(AdxlRegister::FifoCtl, 0) || !WriteRegister(AdxlRegister::FifoCtl, (2u << 6) | FifoInterruptLevel))
+	{
+		return false;
+	}
+
+	// Pulling the interrupt pin up allows us to check for a disconnected pin
+	pinMode(int1Pin, INPUT_PULLUP);
+
+	totalNumRead = 0;
+	ticksWaiting = numOverflows = 0;
+	maxFifoLevel = 0;
+	collectionStartTime = StepTimer::GetTimerTicks();
+
+	// Before we enable data collection, check that the interrupt line is low
+	delayMicroseconds(5);
+	interruptError = digitalRead(int1Pin);
+	if (interruptError)
+	{
+		return false;
+	}
+
+	const bool ok = WriteRegister(AdxlRegister::PowerCtl, 1u << 3);		// measurement mode
+	return ok && attachInterrupt(int1Pin, Adxl345Int1Interrupt, InterruptMode::rising, CallbackParameter(this));
+}
+
+// Collect some data from the FIFO, suspending until the data is available.
+// Each FIFO entry must be read in a separate SPI transaction. We use DMA for them so that this task sleeps while the data is transferred.
+unsigned int ADXL345::CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept
+{
+	// Wait until we have some more data
+	const uint32_t startedWaiting = StepTimer::GetTimerTicks();
+	taskWaiting = TaskBase::GetCallerTaskHandle();
+	while (!digitalRead(int1Pin))
+	{
+		TaskBase::Take();
+	}
+	taskWaiting = nullptr;
+	ticksWaiting += StepTimer::GetTimerTicks() - startedWaiting;
+
+	// Get the fifo status to see how much data we can read and whether the fifo overflowed
+	uint8_t intSource, fifoStatus;
+	if (!ReadRegister(AdxlRegister::IntSource, intSource) || !ReadRegister(AdxlRegister::FifoStatus, fifoStatus))
+	{
+		return 0;
+	}
+
+	const uint8_t numToRead = min<uint8_t>(fifoStatus & 0x3F, 32);		// there may be 33 entries including the output registers, but we only have room for 32
+	if (numToRead > maxFifoLevel)
+	{
+		maxFifoLevel = numToRead;
+	}
+	if (numToRead == 0)
+	{
+		return 0;
+	}
+
+	overflowed = (intSource & 0x01) != 0;
+	if (overflowed)
+	{
+		++numOverflows;
+	}
+	const uint32_t interruptInterval = lastInterruptTime - firstInterruptTime;
+	dataRate = (totalNumRead == 0 || interruptInterval == 0) ? 0 : (totalNumRead * (uint64_t)StepTimer::StepClockRate)/interruptInterval;	// report 0 until we have data from more than one interrupt
+	if (!ReadFifoEntries(fifoBuffer, numToRead))
+	{
+		return 0;
+	}
+	totalNumRead += numToRead;
+	*collectedData = reinterpret_cast<const uint16_t*>(fifoBuffer);
+	return numToRead;
+}
+
+// Stop collecting data
+void ADXL345::StopCollecting() noexcept
+{
+	detachInterrupt(int1Pin);
+	(void)WriteRegister(AdxlRegister::PowerCtl, 0);
+}
+
+// Estimate the step clock time at which a sample was taken. We know roughly when the FIFO reached the interrupt level for the first time, and the samples are evenly spaced from then.
+// This must only be called after CollectData has returned some data.
+uint32_t ADXL345::GetSampleTime(uint32_t sampleNumber, uint16_t dataRate) const noexcept
+{
+	return firstInterruptTime + (int32_t)(((int64_t)sampleNumber - (FifoInterruptLevel - 1)) * (int64_t)StepTimer::StepClockRate/dataRate);
+}
+
+// Report how busy we were during the last data collection
+void ADXL345::AppendCollectionStats(const StringRef& reply) noexcept
+{
+	if (totalNumRead != 0 && lastInterruptTime != firstInterruptTime)
+	{
+		const uint32_t elapsed = lastInterruptTime - collectionStartTime;
+		const unsigned int busyPercent = (elapsed > ticksWaiting) ? (unsigned int)(((uint64_t)(elapsed - ticksWaiting) * 100u)/elapsed) : 0;
+		reply.catf(", last run %" PRIu32 " samples at %" PRIu32 "Hz, busy %u%%, max FIFO level %u, overflows %" PRIu32,
+					totalNumRead, (uint32_t)((totalNumRead * (uint64_t)StepTimer::StepClockRate)/(lastInterruptTime - firstInterruptTime)),
+					busyPercent, maxFifoLevel, numOverflows);
+	}
+}
+
+// Read FIFO entries into the buffer, returning true if successful
+bool ADXL345::ReadFifoEntries(uint8_t *dst, unsigned int numEntries) noexcept
+{
+	for (unsigned int i = 0; i < numEntries; ++i)
+	{
+		if (!Select(AdxlSpiTimeout))
+		{
+			return false;
+		}
+		uint8_t rawBytes[7];
+		const bool ok = TransceivePacketDma(ReadFifoEntryCommand, rawBytes, sizeof(rawBytes), AdxlSpiTimeout);
+		Deselect();
+		if (!ok)
+		{
+			return false;
+		}
+		memcpy(dst + 6 * i, rawBytes + 1, 6);
+		delayMicroseconds(5);											// the next entry isn't available until 5us after we finished reading this one
+	}
+	return true;
+}
+
+bool ADXL345::ReadRegister(AdxlRegister reg, uint8_t& val) noexcept
+{
+	if (!Select(AdxlSpiTimeout))
+	{
+		return false;
+	}
+	const uint8_t command[2] = { (uint8_t)(ReadBit | (uint8_t)reg), 0 };
+	uint8_t response[2];
+	const bool ok = TransceivePacket(command, response, 2);
+	Deselect();
+	val = response[1];
+	return ok;
+}
+
+bool ADXL345::WriteRegister(AdxlRegister reg, uint8_t val) noexcept
+{
+	if (!Select(AdxlSpiTimeout))
+	{
+		return false;
+	}
+	const uint8_t command[2] = { (uint8_t)reg, val };
+	const bool ok = TransceivePacket(command, nullptr, 2);
+	Deselect();
+	return ok;
+}
+
+void ADXL345::Int1Isr() noexcept
+{
+	const uint32_t now = StepTimer::GetTimerTicks();
+	if (totalNumRead == 0)
+	{
+		firstInterruptTime = now;
+	}
+	lastInterruptTime = now;
+	TaskBase::GiveFromISR(taskWaiting);
+	taskWaiting = nullptr;
+}
+
+static void Adxl345Int1Interrupt(CallbackParameter p) noexcept
+{
+	static_cast<ADXL345*>(p.vp)->Int1Isr();
+}
+
+#endif
+
+// End
@@ -0,0 +1,74 @@
+/*
+ * ADXL345.h
+ *
+ *  ADXL345 accelerometer on the shared SPI bus. This supports sampling rates up to 3200Hz, which is more than we can read from a LIS3DH over I2C.
+ */
+
+#ifndef SRC_HARDWARE_ADXL345_H_
+#define SRC_HARDWARE_ADXL345_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_SPI_SENSORS && SUPPORT_ADXL345
+
+#include "SharedSpiClient.h"
+#include "Accelerometer.h"
+
+class ADXL345 : public SharedSpiClient, public Accelerometer
+{
+public:
+	ADXL345(SharedSpiDevice& dev, Pin p_csPin, Pin p_int1Pin) noexcept;
+
+	bool CheckPresent() noexcept override;
+	const char *GetTypeName() const noexcept override { return "ADXL345"; }
+	bool Configure(uint16_t& samplingRate, uint8_t& resolution) noexcept override;
+	bool StartCollecting(uint8_t axes) noexcept override;
+	unsigned int CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept override;
+	void StopCollecting() noexcept override;
+	uint32_t GetSampleTime(uint32_t sampleNumber, uint16_t dataRate) const noexcept override;
+	uint8_t ReadStatus() noexcept override;
+	bool HasInterruptError() const noexcept override { return interruptError; }
+	void AppendCollectionStats(const StringRef& reply) noexcept override;
+
+	// Used by the ISR
+	void Int1Isr() noexcept;
+
+private:
+	enum class AdxlRegister : uint8_t
+	{
+		DevId = 0x00,
+		BwRate = 0x2C,
+		PowerCtl = 0x2D,
+		IntEnable = 0x2E,
+		IntMap = 0x2F,
+		IntSource = 0x30,
+		DataFormat = 0x31,
+		DataX0 = 0x32,
+		FifoCtl = 0x38,
+		FifoStatus = 0x39
+	};
+
+	bool ReadRegister(AdxlRegister reg, uint8_t& val) noexcept;
+	bool WriteRegister(AdxlRegister reg, uint8_t val) noexcept;
+	bool ReadFifoEntries(uint8_t *dst, unsigned int numEntries) noexcept;
+
+	volatile TaskHandle taskWaiting;
+	uint32_t firstInterruptTime;
+	uint32_t lastInterruptTime;
+	uint32_t totalNumRead;
+	bool interruptError;
+	uint8_t bwRate;
+	Pin int1Pin;
+
+	// Statistics for the last data collection run, used to find the highest sampling rate we can sustain
+	uint32_t collectionStartTime;
+	uint32_t ticksWaiting;									// step clocks spent waiting for the FIFO to reach the watermark
+	uint32_t numOverflows;
+	uint8_t maxFifoLevel;
+
+	alignas(2) uint8_t fifoBuffer[6 * 32];
+};
+
+#endif
+
+#endif /* SRC_HARDWARE_ADXL345_H_ */
@@ -12,6 +12,7 @@
 
 #include <Platform.h>
 #include <Hardware/SharedSpiClient.h>
+#include <Movement/StepTimer.h>
 
 // AD7327 latches the data in the falling edge of SCLK. Max clock frequency 10MHz, minimum 50kHz. It expects SCLK to be high when /CS changes state. This is SPI mode 2.
 constexpr uint32_t AdcClockFrequency = 4000000;
@@ -24,8 +25,15 @@ constexpr uint16_t ControlRegisterValue = (1 << 15)		// write
 										| (1 << 5)		// coding = straight binary
 										| (1 << 4)		// internal reference
 										| (0 << 2);		// sequencer not used
+constexpr uint16_t SequencerConsecutive = (2 << 2);		// SEQ1:SEQ0 = 10, the sequencer converts channels 0 to the channel number in the control register in turn
+
+constexpr unsigned int NumChannels = 8;
+constexpr uint32_t CacheValidTicks = StepTimer::StepClockRate/1000;	// how long a scanned reading may be used for, long enough for a test to read all the channels in turn
 
 static SharedSpiClient *device = nullptr;
+static uint16_t cachedReadings[NumChannels];
+static StepTimer::Ticks whenScanned[NumChannels];
+static bool cacheValid[NumChannels] = { false };
 
 // Write and read 16 bits to the ADC
 static uint16_t AdcTransfer(uint16_t dataOut) noexcept
@@ -66,8 +74,73 @@ void ExtendedAnalog::Init(SharedSpiDevice& sharedSpi) noexcept
 	device->Deselect();
 }
 
-// Read an ADC channel
+// Convert a result from the ADC to the value we return, or an error value if it isn't for the channel we expected
+static uint16_t ConvertResult(uint16_t rslt, unsigned int chan) noexcept
+{
+	if ((rslt >> 13) == chan)											// if the result is for the channel we asked for
+	{
+		static_assert(AnalogIn::AdcBits >= 14);
+		return (rslt & 8191) << (AnalogIn::AdcBits - 13 - 1);			// extend 13-bit result to the required number of bits, leaving the top bit clear
+	}
+	return 0x8001;														// indicate channel reading error
+}
+
+// Read all the ADC channels in one burst and cache the results. Return false if we couldn't get the SPI bus.
+// The AD7327 needs /CS raised between conversions, so we still need one short transfer per channel, but we only acquire the shared SPI bus
+// and write the control register once. The sequencer then converts the channels in turn and tags each result with its channel number.
+bool ExtendedAnalog::ScanAll() noexcept
+{
+	if (!device->Select(200))
+	{
+		return false;
+	}
+
+	for (bool& v : cacheValid)
+	{
+		v = false;
+	}
+	(void)AdcTransfer(ControlRegisterValue | SequencerConsecutive | ((NumChannels - 1) << 10));
+	for (unsigned int i = 0; i < NumChannels; ++i)
+	{
+		digitalWrite(ExtendedAdcCsPin, true);
+		delayMicroseconds(5);											// the ADC data acquisition time is this delay plus about 1.5clock cycles
+		digitalWrite(ExtendedAdcCsPin, false);
+		const uint16_t rslt = AdcTransfer(0);							// writing zero leaves the control register and sequencer unchanged
+		const unsigned int chan = rslt >> 13;
+		cachedReadings[chan] = ConvertResult(rslt, chan);
+		whenScanned[chan] = StepTimer::GetTimerTicks();
+		cacheValid[chan] = true;
+	}
+
+	// Stop the sequencer so that single channel reads work as before
+	digitalWrite(ExtendedAdcCsPin, true);
+	delayMicroseconds(1);
+	digitalWrite(ExtendedAdcCsPin, false);
+	(void)AdcTransfer(ControlRegisterValue);
+	device->Deselect();
+	return true;
+}
+
+// Read an ADC channel. If we scanned all the channels recently, return the cached reading, otherwise scan them all so that reading the other channels is fast.
 uint16_t ExtendedAnalog::AnalogIn(unsigned int chan) noexcept
+{
+	chan &= 7;
+	if (!cacheValid[chan] || StepTimer::GetTimerTicks() - whenScanned[chan] >= CacheValidTicks)
+	{
+		if (!ScanAll())
+		{
+			return 0x8000;												// indicate select error
+		}
+		if (!cacheValid[chan])
+		{
+			return ReadChannel(chan);									// the scan didn't return this channel, so read it on its own
+		}
+	}
+	return cachedReadings[chan];
+}
+
+// Read a single ADC channel
+uint16_t ExtendedAnalog::ReadChannel(unsigned int chan) noexcept
 {
 	if (device->Select(200))
 	{
@@ -78,12 +151,7 @@ uint16_t ExtendedAnalog::AnalogIn(unsigned int chan) noexcept
 		digitalWrite(ExtendedAdcCsPin, false);
 		const uint16_t rslt = AdcTransfer(0);
 		device->Deselect();
-		if ((rslt >> 13) == chan)										// if the result is for the channel we asked for
-		{
-			static_assert(AnalogIn::AdcBits >= 14);
-			return (rslt & 8191) << (AnalogIn::AdcBits - 13 - 1);		// extend 13-bit result to the required number of bits, leaving the top bit clear
-		}
-		return 0x8001;													// indicate channel reading error
+		return ConvertResult(rslt, chan);
 	}
 
 	return 0x8000;														// indicate select error
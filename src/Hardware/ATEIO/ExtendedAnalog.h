@@ -17,7 +17,9 @@ class SharedSpiDevice;
 namespace ExtendedAnalog
 {
 	void Init(SharedSpiDevice& sharedSpi) noexcept;
-	uint16_t AnalogIn(unsigned int chan) noexcept;
+	bool ScanAll() noexcept;											// read all the channels and cache the results
+	uint16_t AnalogIn(unsigned int chan) noexcept;						// read a channel, from the results of a recent scan if possible
+	uint16_t ReadChannel(unsigned int chan) noexcept;					// read a channel on its own
 }
 
 #endif
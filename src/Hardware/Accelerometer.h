@@ -0,0 +1,52 @@
+/*
+ * Accelerometer.h
+ *
+ *  Interface implemented by each type of accelerometer that AccelerometerHandler can use.
+ *  Sample data is returned as groups of 3 little-endian 16-bit values (X, Y, Z) left justified, with a full scale of +/-2g.
+ */
+
+#ifndef SRC_HARDWARE_ACCELEROMETER_H_
+#define SRC_HARDWARE_ACCELEROMETER_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_ACCELEROMETERS
+
+class Accelerometer
+{
+public:
+	virtual ~Accelerometer() noexcept { }
+
+	// Do a quick test to check whether the accelerometer is present, returning true if it is
+	virtual bool CheckPresent() noexcept = 0;
+
+	// Return the type name of the accelerometer. Only valid after checkPresent returns true.
+	virtual const char *GetTypeName() const noexcept = 0;
+
+	// Configure the accelerometer to collect at or near the requested sampling rate and the requested resolution in bits.
+	// Update the sampling rate and resolution to the actual values used.
+	virtual bool Configure(uint16_t& samplingRate, uint8_t& resolution) noexcept = 0;
+
+	// Start collecting data
+	virtual bool StartCollecting(uint8_t axes) noexcept = 0;
+
+	// Collect some data from the FIFO, suspending until the data is available. The data returned remains valid until the next call.
+	virtual unsigned int CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept = 0;
+
+	// Stop collecting data
+	virtual void StopCollecting() noexcept = 0;
+
+	// Estimate the step clock time at which a sample was taken, given its number counting from zero when we started collecting and the sampling rate
+	virtual uint32_t GetSampleTime(uint32_t sampleNumber, uint16_t dataRate) const noexcept = 0;
+
+	// Get a status byte
+	virtual uint8_t ReadStatus() noexcept = 0;
+
+	// Used by diagnostics
+	virtual bool HasInterruptError() const noexcept = 0;
+	virtual void AppendCollectionStats(const StringRef& reply) noexcept = 0;
+};
+
+#endif
+
+#endif /* SRC_HARDWARE_ACCELEROMETER_H_ */
@@ -0,0 +1,312 @@
+/*
+ * FlashCrc.cpp
+ */
+
+#include "FlashCrc.h"
+#include <DmacManager.h>
+#include <RTOSIface/RTOSIface.h>
+
+extern uint32_t _sfixed;							// defined in the linker script, the start of the firmware image
+extern uint32_t _firmware_crc;						// defined in the linker script, where the CRC is appended to the firmware image
+
+constexpr uint32_t MaxDmaBlockWords = 16384;		// we compute the CRC in 64K blocks, well within the 16-bit DMA beat count
+constexpr uint32_t MinImageLength = 0x2000;			// an image shorter than 8K can't be valid
+constexpr uint32_t FirstScanDelay = 10000;			// how long after startup we check the images in flash for the first time
+constexpr uint32_t ScanInterval = 10 * 60 * 1000;	// how often we check them after that
+constexpr uint32_t CrcWaitTimeout = 1000;			// how long ComputeCrc waits for the CRC unit to become free, and then for the CRC to complete
+
+namespace FlashCrc
+{
+	enum class ScanImage : uint8_t { bootloader = 0, firmware, numImages };
+
+	struct ImageCheck
+	{
+		uint32_t checksDone;
+		uint32_t checksFailed;
+		bool lastOk;
+	};
+
+	static volatile bool crcBusy = false;
+	static const uint32_t *nextBlockStart;
+	static const uint32_t *blockEnd;
+	static CompletionCallback completionCallback;
+	static CallbackParameter completionParam;
+	static volatile uint32_t dmaSink;				// the DMA channel copies every word here so that it passes through the CRC unit
+
+	static ScanImage nextImageToScan = ScanImage::bootloader;
+	static ScanImage imageBeingScanned = ScanImage::numImages;
+	static volatile bool scanResultAvailable = false;
+	static bool scanResultOk;
+	static uint32_t scanExpectedCrc;
+	static uint32_t scanCrc;
+	static uint32_t lastScanTime;
+	static bool firstScanDone = false;
+	static ImageCheck imageChecks[(unsigned int)ScanImage::numImages] = { };
+	static uint32_t dmaStartsFailed = 0;
+	static uint32_t crcTimeouts = 0;
+
+	static void StartBlock() noexcept;
+	static bool AbortCrc() noexcept;
+	static void DmaCompleteCallback(CallbackParameter cbp, DmaCallbackReason reason) noexcept;
+}
+
+// Set up the DMA channel and the CRC unit to compute the CRC of the next block of data, without resetting the CRC checksum
+void FlashCrc::StartBlock() noexcept
+{
+	const uint32_t numWords = min<uint32_t>(blockEnd - nextBlockStart, MaxDmaBlockWords);
+	DmacManager::DisableChannel(DmacChanCrc);
+	DmacManager::SetBtctrl(DmacChanCrc, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_WORD
+								| DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_STEPSIZE_X1);
+	DmacManager::SetSourceAddress(DmacChanCrc, nextBlockStart);
+	DmacManager::SetDestinationAddress(DmacChanCrc, &dmaSink);
+	DmacManager::SetDataLength(DmacChanCrc, numWords);
+	nextBlockStart += numWords;
+
+	// There is no peripheral trigger, so we trigger the channel from software and have it transfer the whole block in response
+#if SAME5x
+	DMAC->Channel[DmacChanCrc].CHCTRLA.reg = DMAC_CHCTRLA_TRIGSRC(0) | DMAC_CHCTRLA_TRIGACT_BLOCK | DMAC_CHCTRLA_BURSTLEN_SINGLE;
+#elif SAMC21
+	DMAC->CHID.reg = DmacChanCrc;
+	DMAC->CHCTRLB.reg = DMAC_CHCTRLB_TRIGSRC(0) | DMAC_CHCTRLB_TRIGACT_BLOCK;
+#else
+# error Unsupported processor
+#endif
+	DmacManager::EnableCompletedInterrupt(DmacChanCrc);
+	DmacManager::EnableChannel(DmacChanCrc, DmacPrioCrc);
+	DMAC->SWTRIGCTRL.reg = 1ul << DmacChanCrc;
+}
+
+// Called from the DMA interrupt when a block has passed through the CRC unit
+/*static*/ void FlashCrc::DmaCompleteCallback(CallbackParameter cbp, DmaCallbackReason reason) noexcept
+{
+	if (!crcBusy)
+	{
+		return;											// AbortCrc has already stopped this transfer
+	}
+
+	const bool ok = (reason == DmaCallbackReason::complete);
+	if (ok && nextBlockStart < blockEnd)
+	{
+		StartBlock();
+		return;
+	}
+
+	DmacManager::DisableCompletedInterrupt(DmacChanCrc);
+	DmacManager::DisableChannel(DmacChanCrc);
+	DMAC->CRCSTATUS.reg = DMAC_CRCSTATUS_CRCBUSY;
+	asm volatile("nop");
+	const uint32_t crc = DMAC->CRCCHKSUM.reg;
+	crcBusy = false;
+	completionCallback(completionParam, ok, crc);
+}
+
+void FlashCrc::Init() noexcept
+{
+	DmacManager::SetInterruptCallback(DmacChanCrc, DmaCompleteCallback, CallbackParameter(nullptr));
+	lastScanTime = millis();
+}
+
+// Start computing the CRC of a dword-aligned block of memory, returning false if the CRC unit is busy
+bool FlashCrc::StartCrc(const uint32_t *start, const uint32_t *end, CompletionCallback callback, CallbackParameter cbp) noexcept
+{
+	{
+		AtomicCriticalSectionLocker lock;
+		if (crcBusy)
+		{
+			return false;
+		}
+		crcBusy = true;
+	}
+
+	completionCallback = callback;
+	completionParam = cbp;
+	nextBlockStart = start;
+	blockEnd = end;
+
+	// Reset the CRC unit and attach it to our DMA channel
+#if SAME5x
+	DMAC->CRCCTRL.reg = DMAC_CRCCTRL_CRCBEATSIZE_WORD | DMAC_CRCCTRL_CRCSRC_DISABLE | DMAC_CRCCTRL_CRCPOLY_CRC32;	// disable the CRC unit
+#elif SAMC21
+	DMAC->CTRL.bit.CRCENABLE = 0;
+#endif
+	DMAC->CRCCHKSUM.reg = 0xFFFFFFFF;
+	DMAC->CRCCTRL.reg = DMAC_CRCCTRL_CRCBEATSIZE_WORD | DMAC_CRCCTRL_CRCSRC(0x20 + DmacChanCrc) | DMAC_CRCCTRL_CRCPOLY_CRC32;
+#if SAMC21
+	DMAC->CTRL.bit.CRCENABLE = 1;
+#endif
+
+	if (start >= end)
+	{
+		// Nothing to do, but we still report completion the same way
+		crcBusy = false;
+		callback(cbp, true, DMAC->CRCCHKSUM.reg);
+	}
+	else
+	{
+		StartBlock();
+	}
+	return true;
+}
+
+// Stop the transfer in progress without calling the completion callback. Returns false if the transfer completed before we could stop it.
+bool FlashCrc::AbortCrc() noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	if (!crcBusy)
+	{
+		return false;
+	}
+	DmacManager::DisableCompletedInterrupt(DmacChanCrc);
+	DmacManager::DisableChannel(DmacChanCrc);
+	DMAC->CRCSTATUS.reg = DMAC_CRCSTATUS_CRCBUSY;
+	crcBusy = false;
+	return true;
+}
+
+// Compute the CRC of a dword-aligned block of memory, sleeping while the DMA runs
+bool FlashCrc::ComputeCrc(const uint32_t *start, const uint32_t *end, uint32_t& crc) noexcept
+{
+	struct CrcResult
+	{
+		TaskHandle waitingTask;
+		uint32_t crc;
+		volatile bool done;
+		bool ok;
+	};
+
+	CrcResult result;
+	result.waitingTask = TaskBase::GetCallerTaskHandle();
+	result.done = false;
+
+	const uint32_t startTime = millis();
+	TaskBase::ClearCurrentTaskNotifyCount();
+	while (!StartCrc(start, end,
+						[](CallbackParameter cbp, bool ok, uint32_t p_crc) noexcept
+						{
+							CrcResult * const res = static_cast<CrcResult*>(cbp.vp);
+							res->ok = ok;
+							res->crc = p_crc;
+							res->done = true;
+							TaskBase::GiveFromISR(res->waitingTask);
+						},
+						CallbackParameter(&result)))
+	{
+		if (millis() - startTime > CrcWaitTimeout)
+		{
+			++dmaStartsFailed;
+			return false;
+		}
+		delay(1);											// the background scan is using the CRC unit
+	}
+
+	// If the completion is lost then stop the transfer, so that we don't wait for ever and the CRC unit is free for the next caller
+	const uint32_t crcStartTime = millis();
+	while (!result.done)
+	{
+		if (millis() - crcStartTime > CrcWaitTimeout && AbortCrc())
+		{
+			++crcTimeouts;
+			return false;
+		}
+		(void)TaskBase::Take(CrcWaitTimeout);
+	}
+	crc = result.crc;
+	return result.ok;
+}
+
+// Check the CRC of an image that holds the address of its CRC in vector M9
+bool FlashCrc::CheckImageCrc(const uint32_t *image, uint32_t linkedAddress, uint32_t maxLength) noexcept
+{
+	const uint32_t crcOffset = image[7] - linkedAddress;			// vector M9 gives the address of the CRC
+	if (crcOffset < MinImageLength || crcOffset > maxLength - 4 || (crcOffset & 3) != 0)
+	{
+		return false;
+	}
+	uint32_t crc;
+	return ComputeCrc(image, image + crcOffset/4, crc) && crc == image[crcOffset/4];
+}
+
+// Run the background scan of the images in flash. This starts the checks but doesn't wait for them, so the main task is not held up.
+void FlashCrc::Spin() noexcept
+{
+	if (scanResultAvailable)
+	{
+		ImageCheck& ic = imageChecks[(unsigned int)imageBeingScanned];
+		ic.lastOk = scanResultOk && scanCrc == scanExpectedCrc;
+		++ic.checksDone;
+		if (!ic.lastOk)
+		{
+			++ic.checksFailed;
+		}
+		imageBeingScanned = ScanImage::numImages;
+		scanResultAvailable = false;
+	}
+
+	if (imageBeingScanned != ScanImage::numImages || millis() - lastScanTime < ((firstScanDone) ? ScanInterval : FirstScanDelay))
+	{
+		return;
+	}
+
+	const uint32_t *start, *end;
+	if (nextImageToScan == ScanImage::bootloader)
+	{
+		// There is only a separate bootloader if the firmware doesn't start at the beginning of flash
+		const uint32_t * const bootloader = reinterpret_cast<const uint32_t*>(FLASH_ADDR);
+		const uint32_t crcAddress = bootloader[7];
+		const uint32_t bootloaderSize = reinterpret_cast<uint32_t>(&_sfixed) - FLASH_ADDR;
+		if (bootloaderSize == 0 || crcAddress < FLASH_ADDR + MinImageLength || crcAddress > FLASH_ADDR + bootloaderSize - 4)
+		{
+			nextImageToScan = ScanImage::firmware;
+			return;
+		}
+		start = bootloader;
+		end = reinterpret_cast<const uint32_t*>(crcAddress);
+	}
+	else
+	{
+		start = &_sfixed;
+		end = &_firmware_crc;
+	}
+
+	scanExpectedCrc = *end;
+	imageBeingScanned = nextImageToScan;
+	if (StartCrc(start, end,
+					[](CallbackParameter cbp, bool ok, uint32_t crc) noexcept
+					{
+						scanResultOk = ok;
+						scanCrc = crc;
+						scanResultAvailable = true;
+					},
+					CallbackParameter(nullptr)))
+	{
+		if (nextImageToScan == ScanImage::firmware)
+		{
+			lastScanTime = millis();
+			firstScanDone = true;
+			nextImageToScan = ScanImage::bootloader;
+		}
+		else
+		{
+			nextImageToScan = ScanImage::firmware;
+		}
+	}
+	else
+	{
+		imageBeingScanned = ScanImage::numImages;			// the CRC unit is busy, so try again next time
+	}
+}
+
+void FlashCrc::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcat("Flash CRC checks:");
+	const char *const names[] = { "bootloader", "firmware" };
+	for (unsigned int i = 0; i < (unsigned int)ScanImage::numImages; ++i)
+	{
+		const ImageCheck& ic = imageChecks[i];
+		reply.catf(" %s %s %" PRIu32 "/%" PRIu32 ",",
+					names[i], (ic.checksDone == 0) ? "n/a" : (ic.lastOk) ? "ok" : "BAD", ic.checksFailed, ic.checksDone);
+	}
+	reply.catf(" busy timeouts %" PRIu32 ", completion timeouts %" PRIu32, dmaStartsFailed, crcTimeouts);
+}
+
+// End
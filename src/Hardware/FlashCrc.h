@@ -0,0 +1,32 @@
+/*
+ * FlashCrc.h
+ *
+ *  CRC32 calculation using the DMAC CRC unit fed by a DMA channel, so that the CPU is free while the CRC is computed.
+ *  Also a background scan that periodically checks the CRCs of the bootloader and firmware images held in flash.
+ */
+
+#ifndef SRC_HARDWARE_FLASHCRC_H_
+#define SRC_HARDWARE_FLASHCRC_H_
+
+#include <RepRapFirmware.h>
+
+namespace FlashCrc
+{
+	typedef void (*CompletionCallback)(CallbackParameter cbp, bool ok, uint32_t crc) noexcept;
+
+	void Init() noexcept;
+
+	// Start computing the CRC of a dword-aligned block of memory, returning false if the CRC unit is busy. The callback is called from the DMA interrupt.
+	bool StartCrc(const uint32_t *start, const uint32_t *end, CompletionCallback callback, CallbackParameter cbp) noexcept;
+
+	// Compute the CRC of a dword-aligned block of memory. The calling task sleeps while the DMA runs. Returns false if the CRC unit was busy or the CRC didn't complete in time.
+	bool ComputeCrc(const uint32_t *start, const uint32_t *end, uint32_t& crc) noexcept;
+
+	// Check the CRC of an image that holds the address of its CRC in vector M9. The image may be a copy in RAM of one linked to run at linkedAddress.
+	bool CheckImageCrc(const uint32_t *image, uint32_t linkedAddress, uint32_t maxLength) noexcept;
+
+	void Spin() noexcept;								// called by the main task to run the background flash scan
+	void Diagnostics(const StringRef& reply) noexcept;
+}
+
+#endif /* SRC_HARDWARE_FLASHCRC_H_ */
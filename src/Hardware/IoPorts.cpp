@@ -134,6 +134,11 @@ void IoPort::WriteDigital(bool high) const
 	}
 }
 
+FastDigitalOutput IoPort::GetFastDigitalOutput() const noexcept
+{
+	return (IsValid()) ? FastDigitalOutput(pin, totalInvert) : FastDigitalOutput();
+}
+
 bool IoPort::ReadDigital() const
 {
 	if (IsValid())
@@ -177,6 +182,59 @@ void IoPort::DetachInterrupt() const
 	}
 }
 
+// Enable or disable the EIC majority filter or the debouncer on the external interrupt attached to the pin. The filter only rejects glitches lasting a few clock cycles.
+// The debouncer only exists on the SAME5x. It requires the input to be stable for about 1.5ms, so it delays reporting changes by that much.
+// Return false if the pin has no external interrupt or the processor can't do what was asked.
+bool IoPort::SetInterruptFilter(bool filter, bool debounce) const noexcept
+{
+	if (!IsValid() || isSharedInput)
+	{
+		return false;
+	}
+	const ExintNumber exint = PinTable[pin].exintNumber;
+	if (exint == Nx)
+	{
+		return false;
+	}
+#if SAMC21
+	if (debounce)
+	{
+		return false;
+	}
+#endif
+
+	// The EIC configuration registers are enable-protected, so we must disable the EIC briefly. Pending edges are not lost.
+	const unsigned int exintNum = (unsigned int)exint;
+	const uint32_t filterBit = EIC_CONFIG_FILTEN0 << (4 * (exintNum & 7));
+	const irqflags_t flags = IrqSave();
+	EIC->CTRLA.bit.ENABLE = 0;
+	while (EIC->SYNCBUSY.bit.ENABLE) { }
+	if (filter && !debounce)									// the filter and the debouncer can't be used together
+	{
+		EIC->CONFIG[exintNum >> 3].reg |= filterBit;
+	}
+	else
+	{
+		EIC->CONFIG[exintNum >> 3].reg &= ~filterBit;
+	}
+#if SAME5x
+	if (debounce)
+	{
+		// Sample the debounced inputs at 32768/16 Hz using the low power oscillator and require 3 consecutive equal samples
+		EIC->DPRESCALER.reg = EIC_DPRESCALER_TICKON | EIC_DPRESCALER_PRESCALER0(3) | EIC_DPRESCALER_PRESCALER1(3);
+		EIC->DEBOUNCEN.reg |= 1ul << exintNum;
+	}
+	else
+	{
+		EIC->DEBOUNCEN.reg &= ~(1ul << exintNum);
+	}
+#endif
+	EIC->CTRLA.bit.ENABLE = 1;
+	while (EIC->SYNCBUSY.bit.ENABLE) { }
+	IrqRestore(flags);
+	return true;
+}
+
 bool IoPort::SetAnalogCallback(AnalogInCallbackFunction fn, CallbackParameter cbp, uint32_t ticksPerCall)
 {
 	return AnalogIn::SetCallback(PinToAdcChannel(pin), fn, cbp, ticksPerCall, false);
@@ -541,6 +599,25 @@ void IoPort::AppendPinName(const StringRef& str, bool includeBoardAddress) const
 	AnalogOut::Write(p, pwm, frequency);
 }
 
+// Members of class FastDigitalOutput
+uint32_t FastDigitalOutput::dummyReg;
+
+FastDigitalOutput::FastDigitalOutput(Pin p, bool invert) noexcept
+{
+	if (p == NoPin)
+	{
+		setReg = clearReg = &dummyReg;
+		mask = 0;
+	}
+	else
+	{
+		PortGroup& group = PORT->Group[p >> 5];
+		setReg = (invert) ? &group.OUTCLR.reg : &group.OUTSET.reg;
+		clearReg = (invert) ? &group.OUTSET.reg : &group.OUTCLR.reg;
+		mask = 1ul << (p & 31);
+	}
+}
+
 // Members of class PwmPort
 PwmPort::PwmPort()
 {
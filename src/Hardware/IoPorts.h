@@ -42,6 +42,26 @@ enum class PinUsedBy : uint8_t
 	sdCard
 };
 
+// A digital output that can be written in a couple of instructions, because the PORT register addresses and the bit mask are computed when it is set up.
+// Inversion is handled by swapping the set and clear registers. Until it is set up, writes go to a dummy variable.
+class FastDigitalOutput
+{
+public:
+	FastDigitalOutput() noexcept : setReg(&dummyReg), clearReg(&dummyReg), mask(0) { }
+	FastDigitalOutput(Pin p, bool invert) noexcept;
+
+	void Write(bool high) const noexcept { *((high) ? setReg : clearReg) = mask; }
+	void SetHigh() const noexcept { *setReg = mask; }
+	void SetLow() const noexcept { *clearReg = mask; }
+
+private:
+	volatile uint32_t *setReg;								// the register that sets the output logically high, which is OUTCLR if the output is inverted
+	volatile uint32_t *clearReg;							// the register that sets the output logically low
+	uint32_t mask;
+
+	static uint32_t dummyReg;
+};
+
 // Class to represent a port
 class IoPort
 {
@@ -66,11 +86,13 @@ public:
 	bool UseAlternateConfig() const { return alternateConfig; }
 
 	void WriteDigital(bool high) const;
+	FastDigitalOutput GetFastDigitalOutput() const noexcept;	// get a handle for writing this port quickly, which stays valid until the port is released or its inversion changes
 	bool ReadDigital() const;
 	uint16_t ReadAnalog() const;
 
 	bool AttachInterrupt(StandardCallbackFunction callback, InterruptMode mode, CallbackParameter param) const;
 	void DetachInterrupt() const;
+	bool SetInterruptFilter(bool filter, bool debounce) const noexcept;
 	bool SetAnalogCallback(AnalogInCallbackFunction fn, CallbackParameter cbp, uint32_t ticksPerCall);
 
 	// Initialise static data
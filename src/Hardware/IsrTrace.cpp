@@ -0,0 +1,57 @@
+/*
+ * IsrTrace.cpp
+ */
+
+#include "IsrTrace.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+namespace IsrTrace
+{
+	uint32_t ring[RingSize] = { 0 };
+	volatile size_t nextIndex = 0;
+
+	static TaskHandle_t lastTaskSeen = nullptr;
+}
+
+// Record the task that the tick interrupted, if it is not the one we saw at the previous tick. This tells us which tasks were running at 1ms resolution
+// without needing a hook in the scheduler.
+void IsrTrace::RecordRunningTask() noexcept
+{
+	const TaskHandle_t currentTask = xTaskGetCurrentTaskHandle();
+	if (currentTask != lastTaskSeen)
+	{
+		lastTaskSeen = currentTask;
+		Record(TaskEntry, StepTimer::GetTimerTicks(), (currentTask == nullptr) ? '?' : (uint8_t)pcTaskGetName(currentTask)[0]);
+	}
+}
+
+// Copy the most recent entries, oldest first. Called by the crash handler with interrupts disabled.
+void IsrTrace::CopyRecent(uint32_t *dst, size_t count) noexcept
+{
+	size_t i = (nextIndex - count) & (RingSize - 1);
+	while (count != 0)
+	{
+		*dst++ = ring[i];
+		i = (i + 1) & (RingSize - 1);
+		--count;
+	}
+}
+
+// Append an entry in the form exception@time+duration, or task initial@time. Times are in microseconds modulo 87ms.
+void IsrTrace::AppendEntry(const StringRef& reply, uint32_t entry) noexcept
+{
+	const uint32_t exceptionNumber = entry >> 24;
+	const uint32_t time = StepTimer::TicksToIntegerMicroseconds(((entry >> 12) & 0x0FFF) << 4);
+	if (exceptionNumber == TaskEntry)
+	{
+		reply.catf(" %c@%" PRIu32, (char)(entry & 0xFF), time);
+	}
+	else
+	{
+		reply.catf(" %" PRIu32 "@%" PRIu32 "+%" PRIu32, exceptionNumber, time, StepTimer::TicksToIntegerMicroseconds(entry & 0x0FFF));
+	}
+}
+
+// End
@@ -0,0 +1,46 @@
+/*
+ * IsrTrace.h
+ *
+ *  A small always-on ring of recent interrupt start times and durations, and of the tasks seen running at each tick.
+ *  The crash handler copies the most recent entries into the software reset data, so that after a watchdog reset we can see what was using the CPU.
+ */
+
+#ifndef SRC_HARDWARE_ISRTRACE_H_
+#define SRC_HARDWARE_ISRTRACE_H_
+
+#include <RepRapFirmware.h>
+#include <Movement/StepTimer.h>
+
+// Each entry is packed into 32 bits:
+//  bits 31-24	exception number of the interrupt (16 + IRQ number), or 0 for a change of running task
+//  bits 23-12	start time in units of 16 step clocks, modulo 4096
+//  bits 11-0	duration of the interrupt in step clocks, saturating at 4095; or for a task entry, the first character of the task name
+namespace IsrTrace
+{
+	constexpr size_t RingSize = 16;								// must be a power of 2
+	constexpr uint32_t TaskEntry = 0;
+
+	extern uint32_t ring[RingSize];
+	extern volatile size_t nextIndex;
+
+	// Record an entry. If a higher priority interrupt records one at the same time then one of them may be lost, which doesn't matter for diagnostics.
+	inline __attribute__((always_inline)) void Record(uint32_t exceptionNumber, StepTimer::Ticks startTime, uint32_t lowBits) noexcept
+	{
+		const size_t i = nextIndex;
+		nextIndex = (i + 1) & (RingSize - 1);
+		ring[i] = (exceptionNumber << 24) | (((startTime >> 4) & 0x0FFF) << 12) | lowBits;
+	}
+
+	// Record an interrupt that started at startTime and is about to return
+	inline __attribute__((always_inline)) void RecordInterrupt(StepTimer::Ticks startTime) noexcept
+	{
+		const uint32_t duration = StepTimer::GetTimerTicks() - startTime;
+		Record(__get_IPSR() & 0xFF, startTime, (duration < 0x0FFF) ? duration : 0x0FFF);
+	}
+
+	void RecordRunningTask() noexcept;							// called from the tick interrupt
+	void CopyRecent(uint32_t *dst, size_t count) noexcept;		// copy the most recent entries, oldest first
+	void AppendEntry(const StringRef& reply, uint32_t entry) noexcept;
+}
+
+#endif /* SRC_HARDWARE_ISRTRACE_H_ */
@@ -196,6 +196,11 @@ bool LIS3DH:: StartCollecting(uint8_t axes) noexcept
 	pinMode(int1Pin, INPUT_PULLUP);
 
 	totalNumRead = 0;
+	readPending = false;
+	pendingBuffer = 0;
+	ticksWaiting = numOverflows = 0;
+	maxFifoLevel = 0;
+	collectionStartTime = StepTimer::GetTimerTicks();
 
 	// Before we enable data collection, check that the interrupt line is low
 	delayMicroseconds(5);
@@ -209,22 +214,41 @@ bool LIS3DH:: StartCollecting(uint8_t axes) noexcept
 	return ok && attachInterrupt(int1Pin, Int1Interrupt, InterruptMode::rising, CallbackParameter(this));
 }
 
-// Collect some 8-bit data from the FIFO, suspending until the data is available
+// Collect some data from the FIFO, suspending until the data is available.
+// We return the data from the read that we started on the previous call, and start the next read before returning.
+// So the caller packs and sends one batch while the next one is being read by DMA, instead of the two being done one after the other.
 unsigned int LIS3DH::CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept
 {
-	// Wait until we have some data
+	// Finish the read we started last time
+	unsigned int numCollected = 0;
+	if (readPending)
+	{
+		readPending = false;
+		if (FinishTransfer(Lis3dI2CTimeout))
+		{
+			numCollected = pendingNumRead;
+			*collectedData = reinterpret_cast<const uint16_t*>(fifoBuffers[pendingBuffer]);
+			overflowed = pendingOverflowed;
+			dataRate = pendingDataRate;
+		}
+		pendingBuffer ^= 1;
+	}
+
+	// Wait until we have some more data
+	const uint32_t startedWaiting = StepTimer::GetTimerTicks();
 	taskWaiting = TaskBase::GetCallerTaskHandle();
 	while (!digitalRead(int1Pin))
 	{
 		TaskBase::Take();
 	}
 	taskWaiting = nullptr;
+	ticksWaiting += StepTimer::GetTimerTicks() - startedWaiting;
 
 	// Get the fifo status to see how much data we can read and whether the fifo overflowed
 	uint8_t fifoStatus;
 	if (!ReadRegister(LisRegister::FifoSource, fifoStatus))
 	{
-		return 0;
+		return numCollected;
 	}
 
 	uint8_t numToRead = fifoStatus & 0x1F;
@@ -232,31 +256,63 @@ unsigned int LIS3DH::CollectData(const uint16_t **collectedData, uint16_t &dataR
 	{
 		numToRead = 32;
 	}
+	if (numToRead > maxFifoLevel)
+	{
+		maxFifoLevel = numToRead;
+	}
 
 	if (numToRead != 0)
 	{
-		// Read the data
+		// Start reading the data into the buffer we are not returning
 		// When the auto-increment bit is set in the register number, after reading register 0x2D it wraps back to 0x28
 		// The datasheet doesn't mention this but ST app note AN3308 does
-		if (!ReadRegisters(LisRegister::OutXL, 6 * numToRead))
+		pendingOverflowed = (fifoStatus & 0x40) != 0;
+		if (pendingOverflowed)
 		{
-			return 0;
+			++numOverflows;
 		}
-
-		*collectedData = reinterpret_cast<const uint16_t*>(dataBuffer);
-		overflowed = (fifoStatus & 0x40) != 0;
-		dataRate = (totalNumRead == 0) ? 0 : (totalNumRead * (uint64_t)StepTimer::StepClockRate)/(lastInterruptTime - firstInterruptTime);
+		const uint32_t interruptInterval = lastInterruptTime - firstInterruptTime;
+		pendingDataRate = (totalNumRead == 0 || interruptInterval == 0) ? 0 : (totalNumRead * (uint64_t)StepTimer::StepClockRate)/interruptInterval;	// report 0 until we have data from more than one interrupt
+		pendingNumRead = numToRead;
 		totalNumRead += numToRead;
+		const uint8_t regAddr = (is3DSH) ? (uint8_t)LisRegister::OutXL : (uint8_t)LisRegister::OutXL | 0x80;
+		readPending = true;
+		(void)StartTransfer(regAddr, fifoBuffers[pendingBuffer], 1, 6 * numToRead, Lis3dI2CTimeout);		// if this fails then so will FinishTransfer
 	}
-	return numToRead;
+	return numCollected;
 }
 
 // Stop collecting data
 void LIS3DH::StopCollecting() noexcept
 {
+	if (readPending)
+	{
+		(void)FinishTransfer(Lis3dI2CTimeout);
+		readPending = false;
+	}
 	WriteRegister(LisRegister::Ctrl_0x20, 0);
 }
 
+// Estimate the step clock time at which a sample was taken. We know roughly when the FIFO reached the interrupt level for the first time, and the samples are evenly spaced from then.
+// This must only be called after CollectData has returned some data.
+uint32_t LIS3DH::GetSampleTime(uint32_t sampleNumber, uint16_t dataRate) const noexcept
+{
+	return firstInterruptTime + (int32_t)(((int64_t)sampleNumber - (FifoInterruptLevel - 1)) * (int64_t)StepTimer::StepClockRate/dataRate);
+}
+
+// Report how busy we were during the last data collection. The highest sampling rate we can sustain without overflow is roughly the actual rate divided by the busy fraction.
+void LIS3DH::AppendCollectionStats(const StringRef& reply) noexcept
+{
+	if (totalNumRead != 0 && lastInterruptTime != firstInterruptTime)
+	{
+		const uint32_t elapsed = lastInterruptTime - collectionStartTime;
+		const unsigned int busyPercent = (elapsed > ticksWaiting) ? (unsigned int)(((uint64_t)(elapsed - ticksWaiting) * 100u)/elapsed) : 0;
+		reply.catf(", last run %" PRIu32 " samples at %" PRIu32 "Hz, busy %u%%, max FIFO level %u, overflows %" PRIu32,
+					totalNumRead, (uint32_t)((totalNumRead * (uint64_t)StepTimer::StepClockRate)/(lastInterruptTime - firstInterruptTime)),
+					busyPercent, maxFifoLevel, numOverflows);
+	}
+}
+
 bool LIS3DH::ReadRegisters(LisRegister reg, size_t numToRead) noexcept
 {
 	// On the LIS3DH, bit 6 of the first byte must be set to 1 to auto-increment the address when doing reading multiple registers
@@ -13,38 +13,44 @@
 #if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
 
 #include "SharedI2CClient.h"
+#include "Accelerometer.h"
 
-class LIS3DH : public SharedI2CClient
+class LIS3DH : public SharedI2CClient, public Accelerometer
 {
 public:
 	LIS3DH(SharedI2CMaster& dev, Pin p_int1Pin) noexcept;
 
 	// Do a quick test to check whether the accelerometer is present, returning true if it is
-	bool CheckPresent() noexcept;
+	bool CheckPresent() noexcept override;
 
 	// Return the type name of the accelerometer. Only valid after checkPresent returns true.
-	const char *GetTypeName() const noexcept;
+	const char *GetTypeName() const noexcept override;
 
 	// Configure the accelerometer to collect at or near the requested sampling rate and the requested resolution in bits.
-	bool Configure(uint16_t& samplingRate, uint8_t& resolution) noexcept;
+	bool Configure(uint16_t& samplingRate, uint8_t& resolution) noexcept override;
 
 	// Start collecting data
-	bool StartCollecting(uint8_t axes) noexcept;
+	bool StartCollecting(uint8_t axes) noexcept override;
 
-	// Collect some data from the FIFO, suspending until the data is available
-	unsigned int CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept;
+	// Collect some data from the FIFO, suspending until the data is available.
+	// The data returned is from the previous FIFO read, and the next read is in progress when this returns, so the caller can process the data while it is being read.
+	unsigned int CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept override;
 
 	// Stop collecting data
-	void StopCollecting() noexcept;
+	void StopCollecting() noexcept override;
+
+	// Estimate the step clock time at which a sample was taken, given its number counting from zero when we started collecting and the sampling rate
+	uint32_t GetSampleTime(uint32_t sampleNumber, uint16_t dataRate) const noexcept override;
 
 	// Get a status byte
-	uint8_t ReadStatus() noexcept;
+	uint8_t ReadStatus() noexcept override;
 
 	// Used by the ISR
 	void Int1Isr() noexcept;
 
 	// Used by diagnostics
-	bool HasInterruptError() const noexcept { return interruptError; }
+	bool HasInterruptError() const noexcept override { return interruptError; }
+	void AppendCollectionStats(const StringRef& reply) noexcept override;
 
 private:
 	enum class LisRegister : uint8_t
@@ -72,7 +78,22 @@ private:
 	uint8_t currentAxis;
 	uint8_t ctrlReg_0x20;
 	Pin int1Pin;
-	alignas(2) uint8_t dataBuffer[6 * 32];
+
+	// FIFO reads are double buffered
+	bool readPending;										// true if we have started reading the FIFO into fifoBuffers[pendingBuffer]
+	bool pendingOverflowed;									// whether the FIFO had overflowed when we started that read
+	uint8_t pendingBuffer;
+	uint8_t pendingNumRead;
+	uint16_t pendingDataRate;
+
+	// Statistics for the last data collection run, used to find the highest sampling rate we can sustain
+	uint32_t collectionStartTime;
+	uint32_t ticksWaiting;									// step clocks spent waiting for the FIFO to reach the watermark
+	uint32_t numOverflows;
+	uint8_t maxFifoLevel;
+
+	alignas(2) uint8_t dataBuffer[6];
+	alignas(2) uint8_t fifoBuffers[2][6 * 32];
 };
 
 #endif
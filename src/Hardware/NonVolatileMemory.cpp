@@ -14,66 +14,225 @@
 #if SAMC21
 # include <Flash.h>
 constexpr uint32_t RWW_ADDR = FLASH_ADDR + 0x00400000;
+
+// The RWW EEPROM area on the SAMC21G18 is 8K bytes. We use the first 1K for pages 0 and 1 and the next 4K for their journals.
+// Page 2 was added later, so it is followed by its own journal after those to leave the existing data where it was.
+constexpr uint32_t NvmPageSize = 512;
+constexpr uint32_t NumOriginalNvmPages = 2;
+constexpr uint32_t NumNvmPages = 3;
+constexpr uint32_t JournalSize = 2048;									// the size of the journal for each page, a whole number of flash rows
+constexpr uint32_t NumJournalRecords = JournalSize/64;
+constexpr uint32_t JournalStartOffset = NumOriginalNvmPages * NvmPageSize;
+constexpr uint32_t LaterPagesStartOffset = JournalStartOffset + NumOriginalNvmPages * JournalSize;
+constexpr uint32_t FlashWritePageSize = 64;
+
+static_assert(NumJournalRecords <= 255);
+static_assert(LaterPagesStartOffset + (NumNvmPages - NumOriginalNvmPages) * (NvmPageSize + JournalSize) <= 8192);
 #endif
 
-NonVolatileMemory::NonVolatileMemory(NvmPage whichPage) noexcept : state(NvmState::notRead), page(whichPage)
-{
-}
+#if SAME5x
+static_assert((unsigned int)NvmPage::maintenance * 512 + 512 <= 4096);	// the SmartEEPROM is configured for 4K bytes
+#endif
 
-void NonVolatileMemory::EnsureRead() noexcept
+// Get the address of the flash or EEPROM that holds a page
+static inline uint32_t GetPageAddress(NvmPage page) noexcept
 {
-	if (state == NvmState::notRead)
-	{
 #if SAME5x
-		memcpyu32(reinterpret_cast<uint32_t *>(&buffer), reinterpret_cast<const uint32_t *>(SEEPROM_ADDR + (512 * (unsigned int)page)), sizeof(buffer)/sizeof(uint32_t));
+	return SEEPROM_ADDR + (512 * (unsigned int)page);
 #elif SAMC21
-		memcpyu32(reinterpret_cast<uint32_t *>(&buffer), reinterpret_cast<const uint32_t *>(RWW_ADDR + (512 * (unsigned int)page)), sizeof(buffer)/sizeof(uint32_t));
+	return ((unsigned int)page < NumOriginalNvmPages) ? RWW_ADDR + (NvmPageSize * (unsigned int)page)
+		: RWW_ADDR + LaterPagesStartOffset + (NvmPageSize + JournalSize) * ((unsigned int)page - NumOriginalNvmPages);
 #else
 # error Unsupported processor
 #endif
+}
+
+#if SAMC21
+
+// Get the address of the journal for a page
+static inline uint32_t GetJournalAddress(NvmPage page) noexcept
+{
+	return ((unsigned int)page < NumOriginalNvmPages) ? RWW_ADDR + JournalStartOffset + JournalSize * (unsigned int)page
+		: GetPageAddress(page) + NvmPageSize;
+}
+
+#endif
+
+NonVolatileMemory::NonVolatileMemory(NvmPage whichPage) noexcept : dirtyStart(sizeof(NVM)), dirtyEnd(0), state(NvmState::notRead), page(whichPage)
+{
+}
+
+void NonVolatileMemory::EnsureRead() noexcept
+{
+	if (state == NvmState::notRead)
+	{
+		memcpyu32(reinterpret_cast<uint32_t *>(&buffer), reinterpret_cast<const uint32_t *>(GetPageAddress(page)), sizeof(buffer)/sizeof(uint32_t));
 		if (buffer.commonPage.magic != GetMagicValue())
 		{
 //			debugPrintf("Invalid user area\n");
 			memset(&buffer, 0xFF, sizeof(buffer));
 			buffer.commonPage.magic =GetMagicValue();
-			state = NvmState::eraseAndWriteNeeded;
+			state = NvmState::formatNeeded;
+#if SAMC21
+			journalRecordsUsed = NumJournalRecords;					// the journal may hold records for the old contents, so make sure we compact
+#endif
 		}
 		else
 		{
 			state = NvmState::clean;
+#if SAMC21
+			ReplayJournal();
+#endif
 //			debugPrintf("user area valid\n");
 		}
 	}
 }
 
+// Record that part of the buffer has changed
+void NonVolatileMemory::MarkDirty(const void *start, size_t length, bool eraseNeeded) noexcept
+{
+	const size_t startOffset = reinterpret_cast<const uint8_t*>(start) - reinterpret_cast<const uint8_t*>(&buffer);
+	dirtyStart = min<size_t>(dirtyStart, startOffset);
+	dirtyEnd = max<size_t>(dirtyEnd, startOffset + length);
+	const NvmState newState = (eraseNeeded) ? NvmState::eraseAndWriteNeeded : NvmState::writeNeeded;
+	if (state < newState)
+	{
+		state = newState;
+	}
+}
+
 void NonVolatileMemory::EnsureWritten() noexcept
 {
 #if SAME5x
 	if (state >= NvmState::writeNeeded)
 	{
-		// No need to erase on the SAME5x because the EEPROM emulation manages it
+		// No need to erase on the SAME5x because the EEPROM emulation manages it, but we only write the dwords that have changed to reduce the wear
+		if (state == NvmState::formatNeeded)
+		{
+			dirtyStart = 0;
+			dirtyEnd = sizeof(buffer);
+		}
+		const size_t firstDword = dirtyStart/sizeof(uint32_t);
+		const size_t endDword = (dirtyEnd + (sizeof(uint32_t) - 1))/sizeof(uint32_t);
         while (NVMCTRL->SEESTAT.bit.BUSY) { }
-        memcpyu32(reinterpret_cast<uint32_t*>(SEEPROM_ADDR + (512 * (unsigned int)page)), reinterpret_cast<const uint32_t*>(&buffer), sizeof(buffer)/sizeof(uint32_t));
+        memcpyu32(reinterpret_cast<uint32_t*>(GetPageAddress(page)) + firstDword, reinterpret_cast<const uint32_t*>(&buffer) + firstDword, endDword - firstDword);
 		state = NvmState::clean;
         while (NVMCTRL->SEESTAT.bit.BUSY) { }
 	}
 #elif SAMC21
-	if (state == NvmState::eraseAndWriteNeeded)
+	if (state == NvmState::writeNeeded && journalRecordsUsed == 0)
 	{
-		Flash::RwwErase(RWW_ADDR + (512 * (unsigned int)page), 512);
-		state = NvmState::writeNeeded;
+		// We are only changing 1 bits to 0 and there are no journal records that would override the page, so we can write just the changed flash pages in place
+		const uint32_t writeStart = dirtyStart & ~(FlashWritePageSize - 1);
+		const uint32_t writeEnd = (dirtyEnd + (FlashWritePageSize - 1)) & ~(FlashWritePageSize - 1);
+		Flash::RwwWrite(GetPageAddress(page) + writeStart, writeEnd - writeStart, reinterpret_cast<const uint8_t*>(&buffer) + writeStart);
+		state = NvmState::clean;
 	}
-
-	if (state == NvmState::writeNeeded)
+	else if (state >= NvmState::writeNeeded)
 	{
-		Flash::RwwWrite(RWW_ADDR + (512 * (unsigned int)page), 512, (uint8_t*)&buffer);
+		if (state == NvmState::formatNeeded || !AppendToJournal())
+		{
+			Compact();
+		}
 		state = NvmState::clean;
 	}
 #else
 # error Unsupported processor
 #endif
+	dirtyStart = sizeof(buffer);
+	dirtyEnd = 0;
 }
 
+#if SAMC21
+
+uint8_t NonVolatileMemory::JournalRecord::ComputeCheck() const noexcept
+{
+	uint8_t check = (uint8_t)offset ^ (uint8_t)(offset >> 8) ^ length ^ 0x5A;
+	for (size_t i = 0; i < length && i < MaxDataLength; ++i)
+	{
+		check = (uint8_t)((check << 1) | (check >> 7)) ^ data[i];
+	}
+	return check;
+}
+
+bool NonVolatileMemory::JournalRecord::IsValid() const noexcept
+{
+	return length != 0 && length <= MaxDataLength && offset + length <= sizeof(NVM) && check == ComputeCheck();
+}
+
+bool NonVolatileMemory::JournalRecord::IsErased() const noexcept
+{
+	const uint32_t *p = reinterpret_cast<const uint32_t*>(this);
+	for (size_t i = 0; i < sizeof(JournalRecord)/sizeof(uint32_t); ++i)
+	{
+		if (p[i] != 0xFFFFFFFF)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Apply the journal records to the buffer in the order they were written, and find where the next one goes
+void NonVolatileMemory::ReplayJournal() noexcept
+{
+	const JournalRecord *records = reinterpret_cast<const JournalRecord*>(GetJournalAddress(page));
+	journalRecordsUsed = 0;
+	while (journalRecordsUsed < NumJournalRecords)
+	{
+		const JournalRecord& rec = records[journalRecordsUsed];
+		if (!rec.IsValid())
+		{
+			if (!rec.IsErased())
+			{
+				// We were interrupted while writing this record, so we can't append to the journal any more until we compact it
+				journalRecordsUsed = NumJournalRecords;
+			}
+			break;
+		}
+		memcpy(reinterpret_cast<uint8_t*>(&buffer) + rec.offset, rec.data, rec.length);
+		++journalRecordsUsed;
+	}
+}
+
+// Write the dirty range to the journal, returning false if there isn't room for it
+bool NonVolatileMemory::AppendToJournal() noexcept
+{
+	const size_t length = dirtyEnd - dirtyStart;
+	const size_t recordsNeeded = (length + (JournalRecord::MaxDataLength - 1))/JournalRecord::MaxDataLength;
+	if (journalRecordsUsed + recordsNeeded > NumJournalRecords)
+	{
+		return false;
+	}
+
+	const uint32_t journalAddress = GetJournalAddress(page);
+	JournalRecord rec;
+	size_t offset = dirtyStart;
+	while (offset < dirtyEnd)
+	{
+		memset(&rec, 0xFF, sizeof(rec));
+		rec.offset = offset;
+		rec.length = min<size_t>(dirtyEnd - offset, JournalRecord::MaxDataLength);
+		memcpy(rec.data, reinterpret_cast<const uint8_t*>(&buffer) + offset, rec.length);
+		rec.check = rec.ComputeCheck();
+		Flash::RwwWrite(journalAddress + journalRecordsUsed * sizeof(JournalRecord), sizeof(JournalRecord), reinterpret_cast<const uint8_t*>(&rec));
+		++journalRecordsUsed;
+		offset += rec.length;
+	}
+	return true;
+}
+
+// Erase the journal and the page, then write the whole buffer to the page
+void NonVolatileMemory::Compact() noexcept
+{
+	Flash::RwwErase(GetJournalAddress(page), JournalSize);
+	Flash::RwwErase(GetPageAddress(page), 512);
+	Flash::RwwWrite(GetPageAddress(page), 512, (uint8_t*)&buffer);
+	journalRecordsUsed = 0;
+}
+
+#endif
+
 SoftwareResetData* NonVolatileMemory::GetLastWrittenResetData(unsigned int &slot) noexcept
 {
 	EnsureRead();
@@ -96,10 +255,7 @@ SoftwareResetData* NonVolatileMemory::AllocateResetDataSlot() noexcept
 	{
 		if (buffer.commonPage.resetData[i].IsVacant())
 		{
-			if (state == NvmState::clean)			// need this test because state may already be EraseAndWriteNeeded after EnsureRead
-			{
-				state = NvmState::writeNeeded;		// assume the caller will write to the allocated slot
-			}
+			MarkDirty(&buffer.commonPage.resetData[i], sizeof(SoftwareResetData), false);		// assume the caller will write to the allocated slot
 			return &buffer.commonPage.resetData[i];
 		}
 	}
@@ -109,7 +265,7 @@ SoftwareResetData* NonVolatileMemory::AllocateResetDataSlot() noexcept
 	{
 		buffer.commonPage.resetData[i].Clear();
 	}
-	state = NvmState::eraseAndWriteNeeded;
+	MarkDirty(buffer.commonPage.resetData, sizeof(buffer.commonPage.resetData), true);
 	return &buffer.commonPage.resetData[0];
 }
 
@@ -150,14 +306,7 @@ void NonVolatileMemory::SetThermistorCalibration(unsigned int inputNumber, int8_
 		{
 			// If we are only changing 1 bits to 0 then we don't need to erase
 			calibArray[inputNumber] = newVal;
-			if ((newVal & ~oldVal) != 0)
-			{
-				state = NvmState::eraseAndWriteNeeded;
-			}
-			else if (state == NvmState::clean)
-			{
-				state = NvmState::writeNeeded;
-			}
+			MarkDirty(&calibArray[inputNumber], sizeof(uint8_t), (newVal & ~oldVal) != 0);
 		}
 	}
 }
@@ -191,14 +340,8 @@ void NonVolatileMemory::SetClosedLoopLUTHarmonicValue(float* harmonicArray, size
 		harmonicArray[harmonic] = value;
 
 		// If we are only changing 1s to 0s then we don't need to erase
-		if (hasBeenWrittenBefore)
-		{
-			state = NvmState::eraseAndWriteNeeded;
-		}
-		else
-		{
-			state = NvmState::writeNeeded;
-		}
+		MarkDirty(&buffer.closedLoopPage, sizeof(uint32_t), false);								// the magic value and the neverWritten flag
+		MarkDirty(&harmonicArray[harmonic], sizeof(float), hasBeenWrittenBefore);
 	}
 }
 
@@ -212,4 +355,42 @@ void NonVolatileMemory::SetClosedLoopLUTHarmonicMagnitude(size_t harmonic, float
 	SetClosedLoopLUTHarmonicValue(buffer.closedLoopPage.absEncoderLUTHarmonicMagnitudes, harmonic, value);
 }
 
+void NonVolatileMemory::GetMaintenanceCounters(MaintenanceCounters& counters) noexcept
+{
+	EnsureRead();
+	if (buffer.maintenancePage.counters.numSaves == 0xFFFFFFFF)
+	{
+		memset(&counters, 0, sizeof(counters));						// the counters have never been written
+	}
+	else
+	{
+		counters = buffer.maintenancePage.counters;
+	}
+}
+
+void NonVolatileMemory::SetMaintenanceCounters(const MaintenanceCounters& counters) noexcept
+{
+	EnsureRead();
+	uint8_t * const oldBytes = reinterpret_cast<uint8_t*>(&buffer.maintenancePage.counters);
+	const uint8_t * const newBytes = reinterpret_cast<const uint8_t*>(&counters);
+
+	// Only mark the bytes that have changed as dirty, to keep the journal records few on the SAMC21
+	size_t first = sizeof(MaintenanceCounters), last = 0;
+	bool eraseNeeded = false;
+	for (size_t i = 0; i < sizeof(MaintenanceCounters); ++i)
+	{
+		if (oldBytes[i] != newBytes[i])
+		{
+			first = min<size_t>(first, i);
+			last = i;
+			eraseNeeded = eraseNeeded || (newBytes[i] & ~oldBytes[i]) != 0;
+			oldBytes[i] = newBytes[i];
+		}
+	}
+	if (first <= last)
+	{
+		MarkDirty(oldBytes + first, last + 1 - first, eraseNeeded);
+	}
+}
+
 // End
@@ -13,9 +13,45 @@
 
 // This class manages nonvolatile settings that are specific to the board, and the software reset data that is stored by the crash handler.
 // On most Duets there is a 512-byte User Page that we use for this.
-// The SAMC21 and SAME5x processors already store various data in the user page, however both those processor families support EEPROM emulation so we use 512 bytes of that instead.
+// The SAMC21 and SAME5x processors already store various data in the user page, however both those processor families support EEPROM emulation so we use 512 bytes of that for each page instead.
+// Changes are coalesced into a single dirty range which is all that EnsureWritten writes.
+// On the SAME5x the SmartEEPROM does its own wear levelling. On the SAMC21 we append changes that would need an erase to a journal for that page,
+// which is replayed when the page is read. The page and its journal are only erased when the journal is full, when we compact it into the page.
 
-enum class NvmPage : uint8_t { common, closedLoop };
+enum class NvmPage : uint8_t { common, closedLoop, maintenance };
+
+// Maintenance counters that persist over a reset. Erased counters read as zero.
+struct MaintenanceCounters
+{
+	static constexpr unsigned int MaxDrivers = 8;
+	static constexpr unsigned int MaxHeaters = 8;
+	static constexpr unsigned int MaxFans = 8;
+
+	struct DriverCounters
+	{
+		uint64_t travelMicrons;										// distance travelled in either direction
+		uint64_t movingMillis;										// time spent in moves that stepped this driver
+	};
+
+	struct HeaterCounters
+	{
+		uint32_t onSeconds;											// time with a nonzero average PWM
+		uint32_t fullPowerSeconds;									// the integral of the average PWM over time, so the average duty is fullPowerSeconds/onSeconds
+	};
+
+	struct FanCounters
+	{
+		uint32_t runSeconds;										// time with a nonzero PWM
+		uint16_t baselineRpm;										// the average speed at full PWM when first measured, or zero if not yet known
+		uint16_t recentRpm;											// the average speed at full PWM when last measured, or zero if not yet known
+	};
+
+	uint32_t numSaves;
+	uint32_t spare;
+	DriverCounters drivers[MaxDrivers];
+	HeaterCounters heaters[MaxHeaters];
+	FanCounters fans[MaxFans];
+};
 
 class NonVolatileMemory
 {
@@ -36,12 +72,20 @@ public:
 	float* GetClosedLoopLUTHarmonicMagnitudes() noexcept pre(page == NvmPage::closedLoop);
 	void SetClosedLoopLUTHarmonicAngle(size_t harmonic, float value) noexcept pre(page == NvmPage::closedLoop);
 	void SetClosedLoopLUTHarmonicMagnitude(size_t harmonic, float value) noexcept pre(page == NvmPage::closedLoop);
+	void GetMaintenanceCounters(MaintenanceCounters& counters) noexcept pre(page == NvmPage::maintenance);
+	void SetMaintenanceCounters(const MaintenanceCounters& counters) noexcept pre(page == NvmPage::maintenance);
 
 private:
 	void EnsureRead() noexcept;
 	int8_t GetThermistorCalibration(unsigned int inputNumber, uint8_t *calibArray) noexcept pre(page == NvmPage::common);
 	void SetThermistorCalibration(unsigned int inputNumber, int8_t val, uint8_t *calibArray) noexcept pre(page == NvmPage::common);
 	void SetClosedLoopLUTHarmonicValue(float* harmonicArray, size_t harmonic, float value) noexcept pre(page == NvmPage::closedLoop);
+	void MarkDirty(const void *start, size_t length, bool eraseNeeded) noexcept;
+#if SAMC21
+	void ReplayJournal() noexcept;
+	bool AppendToJournal() noexcept;
+	void Compact() noexcept;
+#endif
 
 	// In the following structs, the magic value must always be the first 2 bytes
 	struct CommonPage
@@ -72,21 +116,55 @@ private:
 		uint8_t spare[508 - 8*MaxHarmonics];
 	};
 
+	struct MaintenancePage
+	{
+		uint16_t magic;
+		uint16_t spare0[3];											// pad to 8-byte alignment for the 64-bit counters
+		MaintenanceCounters counters;
+		uint8_t spare[504 - sizeof(MaintenanceCounters)];
+	};
+
 	union NVM
 	{
 		CommonPage commonPage;
 		ClosedLoopPage closedLoopPage;
+		MaintenancePage maintenancePage;
 	};
 
 	static_assert(sizeof(NVM) == 512);
 
 	uint32_t GetMagicValue() const noexcept { return 0x41E5 + (unsigned int)page + ((unsigned int)page << 8); }
 
-	enum class NvmState : uint8_t { notRead, clean, writeNeeded, eraseAndWriteNeeded };
+	// writeNeeded means the dirty range only changes 1 bits to 0, eraseAndWriteNeeded means it changes some 0 bits to 1, formatNeeded means the page in flash wasn't valid
+	enum class NvmState : uint8_t { notRead, clean, writeNeeded, eraseAndWriteNeeded, formatNeeded };
+
+#if SAMC21
+	// Each journal record occupies one flash page so that it can be written without disturbing its neighbours
+	struct JournalRecord
+	{
+		static constexpr unsigned int MaxDataLength = 60;
+
+		uint16_t offset;											// offset of the data in the page
+		uint8_t length;												// number of data bytes, 1 to MaxDataLength
+		uint8_t check;												// check byte so that we can recognise a partially written record
+		uint8_t data[MaxDataLength];
+
+		uint8_t ComputeCheck() const noexcept;
+		bool IsValid() const noexcept;
+		bool IsErased() const noexcept;
+	};
+
+	static_assert(sizeof(JournalRecord) == 64);
+#endif
 
 	alignas(4) NVM buffer;
+	uint16_t dirtyStart;											// offset of the first byte in the buffer that has changed since it was read or written
+	uint16_t dirtyEnd;												// offset just past the last byte that has changed
 	NvmState state;
 	NvmPage page;
+#if SAMC21
+	uint8_t journalRecordsUsed;										// number of journal records already written, or NumJournalRecords if the journal is unusable
+#endif
 };
 
 #endif /* SRC_HARDWARE_NONVOLATILEMEMORY_H_ */
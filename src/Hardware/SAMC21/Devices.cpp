@@ -7,6 +7,7 @@
 
 #include <Hardware/Devices.h>
 #include <TaskPriorities.h>
+#include <TaskStackSizes.h>
 
 #if SAMC21
 
@@ -14,7 +15,6 @@
 #include <AnalogOut.h>
 
 // Analog input support
-constexpr size_t AnalogInTaskStackWords = 200;				// was 120 but we got a stack overflow
 static Task<AnalogInTaskStackWords> analogInTask;
 
 # ifdef SAMMYC21
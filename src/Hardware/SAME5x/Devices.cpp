@@ -12,9 +12,9 @@
 #include <AnalogIn.h>
 #include <AnalogOut.h>
 #include <TaskPriorities.h>
+#include <TaskStackSizes.h>
 
 // Analog input support
-constexpr size_t AnalogInTaskStackWords = 300;
 static Task<AnalogInTaskStackWords> analogInTask;
 
 #if defined(EXP3HC)
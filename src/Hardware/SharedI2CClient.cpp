@@ -21,6 +21,28 @@ bool SharedI2CClient::Transfer(uint8_t firstByte, uint8_t *buffer, size_t numToW
 	return ret;
 }
 
+bool SharedI2CClient::StartTransfer(uint8_t firstByte, uint8_t *buffer, size_t numToWrite, size_t numToRead, uint32_t timeout) noexcept
+{
+	busOwned = device.Take(timeout);
+	if (busOwned)
+	{
+		device.StartTransfer(address, firstByte, buffer, numToWrite, numToRead);
+	}
+	return busOwned;
+}
+
+bool SharedI2CClient::FinishTransfer(uint32_t timeout) noexcept
+{
+	if (!busOwned)
+	{
+		return false;
+	}
+	const bool ret = device.FinishTransfer(timeout);
+	device.Release();
+	busOwned = false;
+	return ret;
+}
+
 #endif
 
 // End
@@ -21,9 +21,14 @@ public:
 	void SetAddress(uint16_t addr) noexcept { address = addr; }
 	bool Transfer(uint8_t firstByte, uint8_t *buffer, size_t numToWrite, size_t numToRead, uint32_t timeout) noexcept;
 
+	// Start a transfer without waiting for it to complete. We keep ownership of the bus until FinishTransfer is called, which must be done even if this returns false.
+	bool StartTransfer(uint8_t firstByte, uint8_t *buffer, size_t numToWrite, size_t numToRead, uint32_t timeout) noexcept;
+	bool FinishTransfer(uint32_t timeout) noexcept;
+
 private:
 	SharedI2CMaster& device;
 	uint16_t address;
+	bool busOwned = false;
 };
 
 #endif
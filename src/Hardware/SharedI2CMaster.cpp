@@ -21,7 +21,7 @@ constexpr uint32_t DefaultSharedI2CClockFrequency = 400000;
 constexpr uint32_t I2CTimeoutTicks = 100;
 
 SharedI2CMaster::SharedI2CMaster(uint8_t sercomNum) noexcept
-	: hardware(Serial::Sercoms[sercomNum]), taskWaiting(nullptr), busErrors(0), naks(0), otherErrors(0), state(I2cState::idle)
+	: hardware(Serial::Sercoms[sercomNum]), taskWaiting(nullptr), busErrors(0), naks(0), otherErrors(0), dmaReads(0), sercomNumber(sercomNum), useDma(false), state(I2cState::idle)
 {
 	Serial::EnableSercomClock(sercomNum);
 
@@ -48,23 +48,7 @@ SharedI2CMaster::SharedI2CMaster(uint8_t sercomNum) noexcept
 	hri_sercomi2cm_write_BAUD_reg(hardware, SERCOM_I2CM_BAUD_BAUD(Serial::SercomFastGclkFreq/(2 * DefaultSharedI2CClockFrequency) - 1));
 	hri_sercomi2cm_write_DBGCTRL_reg(hardware, SERCOM_I2CM_DBGCTRL_DBGSTOP);			// baud rate generator is stopped when CPU halted by debugger
 
-#if 0	// if using DMA
-	// Set up the DMA descriptors
-	// We use separate write-back descriptors, so we only need to set this up once, but it must be in SRAM
-	DmacSetBtctrl(I2CRxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
-								| DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_STEPSEL_DST | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacSetSourceAddress(I2CRxDmaChannel, &(hardware->I2CM.DATA.reg));
-	DmacSetDestinationAddress(I2CRxDmaChannel, rcvData);
-	DmacSetDataLength(I2CRxDmaChannel, ARRAY_SIZE(rcvData));
-
-	DmacSetBtctrl(I2CTxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
-								| DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacSetSourceAddress(I2CTxDmaChannel, sendData);
-	DmacSetDestinationAddress(I2CTxDmaChannel, &(hardware->I2CM.DATA.reg));
-	DmacSetDataLength(I2CTxDmaChannel, ARRAY_SIZE(sendData));
-
-	DmacSetInterruptCallbacks(I2CRxDmaChannel, RxDmaCompleteCallback, nullptr, 0U);
-#endif
+	DmacManager::SetInterruptCallback(DmacChanI2CRx, RxDmaCompleteCallback, CallbackParameter(this));
 
 	const IRQn irqn = Serial::GetSercomIRQn(sercomNum);
 	NVIC_SetPriority(irqn, NvicPriorityI2C);
@@ -129,17 +113,25 @@ bool SharedI2CMaster::Transfer(uint16_t address, uint8_t firstByte, uint8_t *buf
 
 void SharedI2CMaster::Diagnostics(const StringRef& reply) noexcept
 {
-	reply.lcatf("I2C bus errors %u, naks %u, other errors %u", busErrors, naks, otherErrors);
-	busErrors = naks = otherErrors = 0;
+	reply.lcatf("I2C bus errors %u, naks %u, other errors %u, DMA reads %u", busErrors, naks, otherErrors, dmaReads);
+	busErrors = naks = otherErrors = dmaReads = 0;
 }
 
 bool SharedI2CMaster::InternalTransfer(uint16_t address, uint8_t firstByte, uint8_t *buffer, size_t numToWrite, size_t numToRead) noexcept
+{
+	StartTransfer(address, firstByte, buffer, numToWrite, numToRead);
+	return WaitForCompletion(I2CTimeoutTicks);
+}
+
+// Start a transfer and return without waiting for it to complete. The buffer must remain valid until FinishTransfer has been called.
+void SharedI2CMaster::StartTransfer(uint16_t address, uint8_t firstByte, uint8_t *buffer, size_t numToWrite, size_t numToRead) noexcept
 {
 	currentAddress = address << 1;											// SERCOM uses the bottom bit as the Read flag
 	firstByteToWrite = firstByte;
 	transferBuffer = buffer;
 	numLeftToRead = numToRead;
 	numLeftToWrite = numToWrite;
+	useDma = numToRead >= MinDmaReadLength && numToRead <= MaxDmaReadLength && currentAddress < 0x100;
 	hardware->I2CM.INTFLAG.reg = 0xFF;										// clear all flag bits
 	hardware->I2CM.STATUS.reg = SERCOM_I2CM_STATUS_BUSERR | SERCOM_I2CM_STATUS_RXNACK | SERCOM_I2CM_STATUS_ARBLOST;		// clear all status bits
 	hardware->I2CM.CTRLB.reg = SERCOM_I2CM_CTRLB_SMEN;						// make sure the ACKACT bit is clear
@@ -164,21 +156,108 @@ bool SharedI2CMaster::InternalTransfer(uint16_t address, uint8_t firstByte, uint
 	}
 	else
 	{
-		state = I2cState::sendingAddressForRead;
-		hardware->I2CM.ADDR.reg = currentAddress | 0x0001;
-		while (hardware->I2CM.SYNCBUSY.bit.SYSOP) { }
-		hardware->I2CM.INTENSET.reg = SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB;
+		StartRead();
+	}
+}
+
+// Wait for a transfer started by StartTransfer to complete, returning true if it succeeded. If it failed, re-initialise the SERCOM ready for the next transfer.
+bool SharedI2CMaster::FinishTransfer(uint32_t timeout) noexcept
+{
+	if (WaitForCompletion(timeout))
+	{
+		return true;
+	}
+	Disable();
+	Enable();
+	return false;
+}
+
+// Wait for the current transfer to complete, returning true if it succeeded.
+// The calling task may have been notified for other reasons while the transfer was in progress, so we check the state rather than relying on the notification.
+bool SharedI2CMaster::WaitForCompletion(uint32_t timeout) noexcept
+{
+	const uint32_t startedWaiting = millis();
+	while (state != I2cState::idle && state != I2cState::protocolError)
+	{
+		const uint32_t waited = millis() - startedWaiting;
+		if (waited >= timeout || !TaskBase::Take(timeout - waited))
+		{
+			break;
+		}
 	}
 
-	TaskBase::Take(I2CTimeoutTicks);
 	if (state == I2cState::idle)
 	{
 		return true;
 	}
+	hardware->I2CM.INTENCLR.reg = 0xFF;
+	StopDma();
+	taskWaiting = nullptr;
 	state = I2cState::idle;
 	return false;
 }
 
+// Send the address for reading with a 7-bit address. If we are using DMA, set up the DMA first and tell the SERCOM how many bytes to read,
+// so that it acknowledges all but the last byte and then sends NAK and stop without needing an interrupt per byte.
+void SharedI2CMaster::StartRead() noexcept
+{
+	if (useDma)
+	{
+		DmacManager::DisableChannel(DmacChanI2CRx);
+		DmacManager::SetBtctrl(DmacChanI2CRx, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
+									| DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_STEPSEL_DST | DMAC_BTCTRL_STEPSIZE_X1);
+		DmacManager::SetSourceAddress(DmacChanI2CRx, &(hardware->I2CM.DATA.reg));
+		DmacManager::SetDestinationAddress(DmacChanI2CRx, transferBuffer);
+		DmacManager::SetDataLength(DmacChanI2CRx, numLeftToRead);
+		DmacManager::SetTriggerSourceSercomRx(DmacChanI2CRx, sercomNumber);
+		DmacManager::EnableCompletedInterrupt(DmacChanI2CRx);
+		DmacManager::EnableChannel(DmacChanI2CRx, DmacPrioI2CRx);
+
+		state = I2cState::readingDma;
+		hardware->I2CM.ADDR.reg = currentAddress | 0x0001 | SERCOM_I2CM_ADDR_LENEN | SERCOM_I2CM_ADDR_LEN(numLeftToRead);
+		while (hardware->I2CM.SYNCBUSY.bit.SYSOP) { }
+		hardware->I2CM.INTENSET.reg = SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_ERROR;		// MB is only set in read mode if the address was not acknowledged
+	}
+	else
+	{
+		state = I2cState::sendingAddressForRead;
+		hardware->I2CM.ADDR.reg = currentAddress | 0x0001;
+		while (hardware->I2CM.SYNCBUSY.bit.SYSOP) { }
+		hardware->I2CM.INTENSET.reg = SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB;
+	}
+}
+
+// Abandon any DMA read in progress
+void SharedI2CMaster::StopDma() noexcept
+{
+	if (useDma)
+	{
+		DmacManager::DisableCompletedInterrupt(DmacChanI2CRx);
+		DmacManager::DisableChannel(DmacChanI2CRx);
+	}
+}
+
+// Called from the DMA interrupt when all the data has been read
+/*static*/ void SharedI2CMaster::RxDmaCompleteCallback(CallbackParameter cbp, DmaCallbackReason reason) noexcept
+{
+	SharedI2CMaster * const dev = static_cast<SharedI2CMaster*>(cbp.vp);
+	if (dev->state == I2cState::readingDma)
+	{
+		dev->hardware->I2CM.INTENCLR.reg = 0xFF;
+		if (reason == DmaCallbackReason::complete)
+		{
+			++dev->dmaReads;
+			dev->state = I2cState::idle;
+			TaskBase::GiveFromISR(dev->taskWaiting);
+			dev->taskWaiting = nullptr;
+		}
+		else
+		{
+			dev->ProtocolError();
+		}
+	}
+}
+
 void SharedI2CMaster::ProtocolError() noexcept
 {
 	hardware->I2CM.INTFLAG.reg = 0xFF;
@@ -197,6 +276,7 @@ void SharedI2CMaster::ProtocolError() noexcept
 		++otherErrors;
 	}
 	hardware->I2CM.CTRLB.reg = SERCOM_I2CM_CTRLB_SMEN | SERCOM_I2CM_CTRLB_CMD(0x03);			// send stop command, get off bus
+	StopDma();
 	state = I2cState::protocolError;
 	TaskBase::GiveFromISR(taskWaiting);
 	taskWaiting = nullptr;
@@ -253,10 +333,7 @@ void SharedI2CMaster::Interrupt() noexcept
 			}
 			else
 			{
-				hardware->I2CM.ADDR.reg = currentAddress | 0x0001;
-				state = I2cState::sendingAddressForRead;
-				while (hardware->I2CM.SYNCBUSY.bit.SYSOP) { }
-				hardware->I2CM.INTENSET.reg = SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB;
+				StartRead();
 			}
 		}
 		else
@@ -279,6 +356,11 @@ void SharedI2CMaster::Interrupt() noexcept
 		}
 		break;
 
+	case I2cState::readingDma:
+		// The DMA reads the data, so the only interrupts we get are for errors, including the address not being acknowledged
+		ProtocolError();
+		break;
+
 	case I2cState::sendingAddressForRead:
 		state = I2cState::reading;
 		// no break
@@ -13,6 +13,7 @@
 #if SUPPORT_I2C_SENSORS
 
 #include <RTOSIface/RTOSIface.h>
+#include <DmacManager.h>
 
 class SharedI2CMaster
 {
@@ -22,6 +23,10 @@ public:
 	void SetClockFrequency(uint32_t freq) const noexcept;
 	bool Transfer(uint16_t address, uint8_t firstByte, uint8_t *buffer, size_t numToWrite, size_t numToRead) noexcept;
 
+	// Start a transfer and return without waiting for it to complete, so that the caller can do other work meanwhile. The caller must own the bus and must call FinishTransfer before using it again.
+	void StartTransfer(uint16_t address, uint8_t firstByte, uint8_t *buffer, size_t numToWrite, size_t numToRead) noexcept;
+	bool FinishTransfer(uint32_t timeout) noexcept;
+
 	bool Take(uint32_t timeout) noexcept { return mutex.Take(timeout); }		// get ownership of this SPI, return true if successful
 	void Release() noexcept { mutex.Release(); }
 
@@ -32,13 +37,21 @@ public:
 private:
 	enum class I2cState : uint8_t
 	{
-		idle = 0, sendingAddressForWrite, writing, sendingTenBitAddressForRead, sendingAddressForRead, reading, protocolError
+		idle = 0, sendingAddressForWrite, writing, sendingTenBitAddressForRead, sendingAddressForRead, reading, readingDma, protocolError
 	};
 
+	static constexpr size_t MinDmaReadLength = 8;			// shorter reads are done by interrupts because setting up the DMA takes longer than a few byte interrupts
+	static constexpr size_t MaxDmaReadLength = 255;			// the most that the SERCOM can count in ADDR.LEN
+
 	void Enable() const noexcept;
 	void Disable() const noexcept;
 	bool InternalTransfer(uint16_t address, uint8_t firstByte, uint8_t *buffer, size_t numToWrite, size_t numToRead) noexcept;
 	void ProtocolError()  noexcept;
+	void StartRead() noexcept;
+	bool WaitForCompletion(uint32_t timeout) noexcept;
+	void StopDma() noexcept;
+
+	static void RxDmaCompleteCallback(CallbackParameter cbp, DmaCallbackReason reason) noexcept;
 
 	Sercom * const hardware;
 	TaskHandle taskWaiting;
@@ -48,7 +61,10 @@ private:
 	size_t numLeftToRead, numLeftToWrite;
 	uint16_t currentAddress;
 	unsigned int busErrors, naks, otherErrors;
+	unsigned int dmaReads;
 	uint8_t firstByteToWrite;
+	uint8_t sercomNumber;
+	bool useDma;											// true if we are reading the data by DMA in this transfer
 	volatile I2cState state;
 };
 
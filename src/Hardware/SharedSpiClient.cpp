@@ -29,18 +29,26 @@ bool SharedSpiClient::Select(uint32_t timeout) const
 	if (ok)
 	{
 		device.SetClockFrequencyAndMode(clockFrequency, mode);
-		IoPort::WriteDigital(csPin, csActivePolarity);
+		csOutput.SetHigh();
 	}
 	return ok;
 }
 
 void SharedSpiClient::Deselect() const
 {
-	IoPort::WriteDigital(csPin, !csActivePolarity);
+	csOutput.SetLow();
 	device.Disable();
 	device.Release();
 }
 
+// Deselect the device briefly to start a new transaction, keeping ownership of the SPI so that another client can't get in between
+void SharedSpiClient::Reselect() const noexcept
+{
+	csOutput.SetLow();
+	delayMicroseconds(1);
+	csOutput.SetHigh();
+}
+
 bool SharedSpiClient::TransceivePacket(const uint8_t* tx_data, uint8_t* rx_data, size_t len) const
 {
 	return device.TransceivePacket(tx_data, rx_data, len);
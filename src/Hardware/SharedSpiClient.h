@@ -13,6 +13,7 @@
 #if SUPPORT_SPI_SENSORS || SUPPORT_CLOSED_LOOP || defined(ATEIO)
 
 #include "SharedSpiDevice.h"
+#include "IoPorts.h"
 
 class SharedSpiClient
 {
@@ -22,13 +23,24 @@ public:
 	void InitMaster();
 	bool Select(uint32_t timeout) const;												// get SPI ownership and select the device, return true if successful
 	void Deselect() const;
+	void Reselect() const noexcept;														// deselect the device briefly without giving up SPI ownership
 	bool TransceivePacket(const uint8_t *tx_data, uint8_t *rx_data, size_t len) const;
-	void SetCsPin(Pin p) { csPin = p; }
+#if SUPPORT_SPI_SENSORS
+	bool TransceivePacketDma(const uint8_t *tx_data, uint8_t *rx_data, size_t len, uint32_t timeout) const noexcept
+		{ return device.TransceivePacketDma(tx_data, rx_data, len, timeout); }
+#endif
+#if SUPPORT_CLOSED_LOOP
+	void StartDmaTransfer(const uint8_t *tx_data, uint8_t *rx_data, size_t len, DmaCallbackFunction callback, CallbackParameter cbParam) const noexcept
+		{ device.StartDmaTransfer(tx_data, rx_data, len, callback, cbParam); }
+	void StopDmaTransfer() const noexcept { device.StopDmaTransfer(); }
+#endif
+	void SetCsPin(Pin p) { csPin = p; csOutput = FastDigitalOutput(p, !csActivePolarity); }
 
 private:
 	SharedSpiDevice& device;
 	uint32_t clockFrequency;
 	Pin csPin;
+	FastDigitalOutput csOutput;															// logically high when the device is selected
 	SpiMode mode;
 	bool csActivePolarity;
 };
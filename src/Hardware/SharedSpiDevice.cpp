@@ -12,6 +12,7 @@
 #include "IoPorts.h"
 #include "DmacManager.h"
 #include "Serial.h"
+#include <Movement/StepTimer.h>
 
 #if SAME5x
 # include <hri_sercom_e54.h>
@@ -24,7 +25,7 @@ constexpr uint32_t SpiTimeout = 10000;
 
 // SharedSpiDevice members
 
-SharedSpiDevice::SharedSpiDevice(uint8_t sercomNum, uint32_t dataInPad) noexcept : hardware(Serial::Sercoms[sercomNum])
+SharedSpiDevice::SharedSpiDevice(uint8_t sercomNum, uint32_t dataInPad) noexcept : hardware(Serial::Sercoms[sercomNum]), sercomNumber(sercomNum)
 {
 	Serial::EnableSercomClock(sercomNum);
 
@@ -55,24 +56,6 @@ SharedSpiDevice::SharedSpiDevice(uint8_t sercomNum, uint32_t dataInPad) noexcept
 	hri_sercomspi_write_BAUD_reg(hardware, SERCOM_SPI_BAUD_BAUD(Serial::SercomFastGclkFreq/(2 * DefaultSharedSpiClockFrequency) - 1));
 	hri_sercomspi_write_DBGCTRL_reg(hardware, SERCOM_I2CM_DBGCTRL_DBGSTOP);		// baud rate generator is stopped when CPU halted by debugger
 
-#if 0	// if using DMA
-	// Set up the DMA descriptors
-	// We use separate write-back descriptors, so we only need to set this up once, but it must be in SRAM
-	DmacSetBtctrl(SspiRxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
-								| DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_STEPSEL_DST | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacSetSourceAddress(SspiRxDmaChannel, &(hardware->SPI.DATA.reg));
-	DmacSetDestinationAddress(SspiRxDmaChannel, rcvData);
-	DmacSetDataLength(SspiRxDmaChannel, ARRAY_SIZE(rcvData));
-
-	DmacSetBtctrl(SspiTxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
-								| DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacSetSourceAddress(SspiTxDmaChannel, sendData);
-	DmacSetDestinationAddress(SspiTxDmaChannel, &(hardware->SPI.DATA.reg));
-	DmacSetDataLength(SspiTxDmaChannel, ARRAY_SIZE(sendData));
-
-	DmacSetInterruptCallbacks(SspiRxDmaChannel, RxDmaCompleteCallback, nullptr, 0U);
-#endif
-
 	hardware->SPI.CTRLB.bit.RXEN = 1;
 
 	mutex.Create("SPI");
@@ -194,6 +177,125 @@ bool SharedSpiDevice::TransceivePacket(const uint8_t* tx_data, uint8_t* rx_data,
 	return true;	// success
 }
 
+#if SUPPORT_CLOSED_LOOP || SUPPORT_SPI_SENSORS
+
+// Start a transfer using DMA and return without waiting for it to complete. The callback is called from the DMA interrupt when the transfer has finished.
+// The caller must own the device and must not start another transfer or call TransceivePacket until the callback has been called or StopDmaTransfer has been called.
+void SharedSpiDevice::StartDmaTransfer(const uint8_t *tx_data, uint8_t *rx_data, size_t len, DmaCallbackFunction callback, CallbackParameter cbParam) const noexcept
+{
+	DmacManager::DisableChannel(DmacChanSspiRx);
+	DmacManager::DisableChannel(DmacChanSspiTx);
+
+	// Discard any received data left over from a previous transfer, otherwise the receive DMA would start with it
+	while (hardware->SPI.INTFLAG.bit.RXC)
+	{
+		(void)hardware->SPI.DATA.reg;
+	}
+
+	DmacManager::SetBtctrl(DmacChanSspiRx, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
+								| DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_STEPSEL_DST | DMAC_BTCTRL_STEPSIZE_X1);
+	DmacManager::SetSourceAddress(DmacChanSspiRx, &(hardware->SPI.DATA.reg));
+	DmacManager::SetDestinationAddress(DmacChanSspiRx, rx_data);
+	DmacManager::SetDataLength(DmacChanSspiRx, len);
+	DmacManager::SetTriggerSourceSercomRx(DmacChanSspiRx, sercomNumber);
+
+	DmacManager::SetBtctrl(DmacChanSspiTx, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
+								| DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_STEPSIZE_X1);
+	DmacManager::SetSourceAddress(DmacChanSspiTx, tx_data);
+	DmacManager::SetDestinationAddress(DmacChanSspiTx, &(hardware->SPI.DATA.reg));
+	DmacManager::SetDataLength(DmacChanSspiTx, len);
+	DmacManager::SetTriggerSourceSercomTx(DmacChanSspiTx, sercomNumber);
+
+	DmacManager::SetInterruptCallback(DmacChanSspiRx, callback, cbParam);
+	DmacManager::EnableCompletedInterrupt(DmacChanSspiRx);
+	DmacManager::EnableChannel(DmacChanSspiRx, DmacPrioSspiRx);
+	DmacManager::EnableChannel(DmacChanSspiTx, DmacPrioSspiTx);
+}
+
+// Abandon a DMA transfer, e.g. because it didn't complete in time
+void SharedSpiDevice::StopDmaTransfer() const noexcept
+{
+	DmacManager::DisableCompletedInterrupt(DmacChanSspiRx);
+	DmacManager::DisableChannel(DmacChanSspiTx);
+	DmacManager::DisableChannel(DmacChanSspiRx);
+}
+
+#endif
+
+#if SUPPORT_SPI_SENSORS
+
+// Transfer a packet using DMA. The calling task sleeps until the transfer has finished instead of polling the SERCOM for each byte.
+// The caller must own the device. If tx_data is null then we send 0xFF bytes.
+bool SharedSpiDevice::TransceivePacketDma(const uint8_t *tx_data, uint8_t *rx_data, size_t len, uint32_t timeout) const noexcept
+{
+	static const uint8_t AllOnes[MaxDmaPacketLength] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+	dmaFinished = dmaSucceeded = false;
+	dmaWaitingTask = TaskBase::GetCallerTaskHandle();
+	dmaStartTime = StepTimer::GetTimerTicks();
+	StartDmaTransfer((tx_data == nullptr) ? AllOnes : tx_data, rx_data, len, DmaCompleteCallback, CallbackParameter(const_cast<SharedSpiDevice*>(this)));
+
+	// Our task may also be woken for other reasons, so keep waiting until the transfer has finished. If we were woken by something else, pass the notification on to ourselves when we have done.
+	const uint32_t startedWaiting = millis();
+	bool otherWakeup = false;
+	while (!dmaFinished)
+	{
+		const uint32_t waited = millis() - startedWaiting;
+		if (waited >= timeout || !TaskBase::Take(timeout - waited))
+		{
+			break;
+		}
+		otherWakeup = otherWakeup || !dmaFinished;
+	}
+
+	if (!dmaFinished)
+	{
+		StopDmaTransfer();
+	}
+	dmaWaitingTask = nullptr;
+	if (otherWakeup)
+	{
+		TaskBase::GetCallerTaskHandle()->Give();
+	}
+	return dmaSucceeded;
+}
+
+// Report how many DMA transfers we have done and how long they took, which is the time that the calling tasks would previously have spent polling the SERCOM
+void SharedSpiDevice::Diagnostics(const StringRef& reply) const noexcept
+{
+	const uint32_t num = numDmaTransfers;
+	reply.lcatf("SPI DMA transfers %" PRIu32, num);
+	if (num != 0)
+	{
+		reply.catf(", CPU time saved per transfer avg %" PRIu32 "us max %" PRIu32 "us",
+					StepTimer::TicksToIntegerMicroseconds(dmaTotalTicks/num), StepTimer::TicksToIntegerMicroseconds(dmaMaxTicks));
+	}
+	numDmaTransfers = 0;
+	dmaTotalTicks = dmaMaxTicks = 0;
+}
+
+// Called from the DMA interrupt when a transfer started by TransceivePacketDma has finished
+/*static*/ void SharedSpiDevice::DmaCompleteCallback(CallbackParameter cbp, DmaCallbackReason reason) noexcept
+{
+	const SharedSpiDevice * const dev = static_cast<const SharedSpiDevice*>(cbp.vp);
+	dev->dmaSucceeded = (reason == DmaCallbackReason::complete);
+	const uint32_t duration = StepTimer::GetTimerTicks() - dev->dmaStartTime;
+	dev->dmaTotalTicks += duration;
+	if (duration > dev->dmaMaxTicks)
+	{
+		dev->dmaMaxTicks = duration;
+	}
+	++dev->numDmaTransfers;
+	dev->dmaFinished = true;
+	const TaskHandle t = dev->dmaWaitingTask;
+	if (t != nullptr)
+	{
+		t->GiveFromISR();
+	}
+}
+
+#endif
+
 #endif
 
 // End
@@ -17,6 +17,10 @@
 
 #include <RTOSIface/RTOSIface.h>
 
+#if SUPPORT_CLOSED_LOOP || SUPPORT_SPI_SENSORS
+# include <DmacManager.h>
+#endif
+
 enum class SpiMode : uint8_t
 {
 	mode0 = 0, mode1, mode2, mode3
@@ -33,14 +37,39 @@ public:
 	bool Take(uint32_t timeout) noexcept { return mutex.Take(timeout); }					// get ownership of this SPI, return true if successful
 	void Release() noexcept { mutex.Release(); }
 
+#if SUPPORT_CLOSED_LOOP || SUPPORT_SPI_SENSORS
+	void StartDmaTransfer(const uint8_t *tx_data, uint8_t *rx_data, size_t len, DmaCallbackFunction callback, CallbackParameter cbParam) const noexcept;
+	void StopDmaTransfer() const noexcept;
+#endif
+
+#if SUPPORT_SPI_SENSORS
+	static constexpr size_t MaxDmaPacketLength = 8;
+	bool TransceivePacketDma(const uint8_t *tx_data, uint8_t *rx_data, size_t len, uint32_t timeout) const noexcept
+		pre(len <= MaxDmaPacketLength);
+	void Diagnostics(const StringRef& reply) const noexcept;
+#endif
+
 private:
 	void Enable() const;
 	bool waitForTxReady() const noexcept;
 	bool waitForTxEmpty() const noexcept;
 	bool waitForRxReady() const noexcept;
 
+#if SUPPORT_SPI_SENSORS
+	static void DmaCompleteCallback(CallbackParameter cbp, DmaCallbackReason reason) noexcept;
+
+	mutable volatile TaskHandle dmaWaitingTask = nullptr;						// the task waiting in TransceivePacketDma
+	mutable volatile bool dmaFinished;
+	mutable volatile bool dmaSucceeded;
+	mutable uint32_t dmaStartTime;
+	mutable uint32_t numDmaTransfers = 0;
+	mutable uint32_t dmaTotalTicks = 0;
+	mutable uint32_t dmaMaxTicks = 0;
+#endif
+
 	Sercom * const hardware;
 	Mutex mutex;
+	uint8_t sercomNumber;
 };
 
 #endif
@@ -9,6 +9,7 @@
 #include <Tasks.h>
 #include <Platform.h>
 #include <General/Portability.h>
+#include <Hardware/IsrTrace.h>
 #include <ctime>
 
 extern uint32_t _estack;			// defined in the linker script
@@ -88,6 +89,8 @@ void SoftwareResetData::Populate(uint16_t reason, const uint32_t *stk) noexcept
 	const TaskHandle_t currentTask = xTaskGetCurrentTaskHandle();
 	taskName = (currentTask == nullptr) ? 0x656e6f6e : LoadLE32(pcTaskGetName(currentTask));
 
+	IsrTrace::CopyRecent(isrTrace, ARRAY_SIZE(isrTrace));
+
 	sp = reinterpret_cast<uint32_t>(stk);
 	if (stk == nullptr)
 	{
@@ -184,6 +187,15 @@ void SoftwareResetData::PrintPart2(const StringRef& reply) const noexcept
 			reply.catf(" %08" PRIx32, stval);
 		}
 	}
+
+	reply.lcat("Recent interrupts (exception@us+us) and tasks (initial@us):");
+	for (uint32_t entry : isrTrace)
+	{
+		if (entry != 0)
+		{
+			IsrTrace::AppendEntry(reply, entry);
+		}
+	}
 }
 
 // End
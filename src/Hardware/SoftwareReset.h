@@ -61,8 +61,9 @@ struct SoftwareResetData
 	uint32_t stackOffset;						// how many spare words of stack the running task has
 	uint32_t stackMarkerValid : 1,				// true if the stack low marker wasn't overwritten
 			 spare : 31;						// unused at present
-	// The stack length is set to 27 words because that is the most we can print in a single message using our 256-byte format buffer
-	uint32_t stack[27];							// stack when the exception occurred, with the link register and program counter at the bottom
+	// The stack and ISR trace together are 27 words so that the struct fits in the 3 slots of the NVM page
+	uint32_t stack[21];							// stack when the exception occurred, with the link register and program counter at the bottom
+	uint32_t isrTrace[6];						// the most recent interrupt and running task entries from IsrTrace, oldest first
 
 	bool IsVacant() const noexcept;				// return true if this struct can be written without erasing it first
 	bool IsValid() const noexcept { return magic == magicValue; }
@@ -71,7 +72,7 @@ struct SoftwareResetData
 	void PrintPart1(unsigned int slot, const StringRef& reply) const noexcept;
 	void PrintPart2(const StringRef& reply) const noexcept;
 
-	static constexpr uint16_t versionValue = 9;		// increment this whenever this struct changes
+	static constexpr uint16_t versionValue = 10;		// increment this whenever this struct changes
 	static constexpr uint16_t magicValue = 0x7D00 | versionValue;	// value we use to recognise that all the flash data has been written
 
 	static const char *const ReasonText[];
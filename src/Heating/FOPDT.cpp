@@ -45,11 +45,7 @@ bool FopDt::SetParameters(const CanMessageHeaterModelNewNew& msg, float temperat
 		{
 			SetRawPidParameters(msg.kP, msg.recipTi, msg.tD);
 		}
-		else
-		{
-			CalcPidConstants(100.0);
-
-		}
+		CalcPidConstants(100.0);					// this also calculates the derived constants if the PID parameters were overridden
 		enabled = true;
 		return true;
 	}
@@ -117,6 +113,8 @@ void FopDt::SetRawPidParameters(float p_kP, float p_recipTi, float p_tD)
 	loadChangeParams.kP = setpointChangeParams.kP = p_kP;
 	loadChangeParams.recipTi = setpointChangeParams.recipTi = p_recipTi;
 	loadChangeParams.tD = setpointChangeParams.tD = p_tD;
+	loadChangeParams.CalcProducts();
+	setpointChangeParams.CalcProducts();
 	pidParametersOverridden = true;
 }
 
@@ -152,6 +150,7 @@ void FopDt::SetRawPidParameters(float p_kP, float p_recipTi, float p_tD)
 
 void FopDt::CalcPidConstants(float targetTemperature) noexcept
 {
+	recipHeatingRate = 1.0/heatingRate;
 	if (!pidParametersOverridden)
 	{
 		// Calculate the cooling rate per degC at this temperature. We assume the fan is at 20% speed.
@@ -164,6 +163,8 @@ void FopDt::CalcPidConstants(float targetTemperature) noexcept
 		setpointChangeParams.kP = 0.7/(heatingRate * deadTime);
 		setpointChangeParams.recipTi = powf(averageCoolingRatePerDegC, 0.5)/powf(deadTime, 0.5);			// Ti = timeConstant^0.5 * deadTime^0.5
 		setpointChangeParams.tD = deadTime * 0.7;
+		loadChangeParams.CalcProducts();
+		setpointChangeParams.CalcProducts();
 	}
 }
 
@@ -179,7 +180,7 @@ float FopDt::CorrectPwmForVoltage(float requiredPwm, float actualVoltage) const
 
 float FopDt::GetPwmCorrectionForFan(float temperatureRise, float fanPwmChange) const noexcept
 {
-	return temperatureRise * 0.01 * fanCoolingRate * fanPwmChange / heatingRate;
+	return temperatureRise * 0.01 * fanCoolingRate * fanPwmChange * recipHeatingRate;
 }
 
 // Calculate the expected cooling rate for a given temperature rise above ambient
@@ -200,7 +201,7 @@ float FopDt::GetNetHeatingRate(float temperatureRise, float fanPwm, float heater
 // Get an estimate of the heater PWM required to maintain a specified temperature
 float FopDt::EstimateRequiredPwm(float temperatureRise, float fanPwm) const noexcept
 {
-	return GetCoolingRate(temperatureRise, fanPwm)/heatingRate;
+	return GetCoolingRate(temperatureRise, fanPwm) * recipHeatingRate;
 }
 
 /*static*/ float FopDt::EstimateMaxTemperatureRise(float hr, float cr, float cre) noexcept
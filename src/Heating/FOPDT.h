@@ -22,6 +22,9 @@ struct PidParameters
 	float kP;			// controller (not model) gain
 	float recipTi;		// reciprocal of controller integral time
 	float tD;			// controller differential time
+	float kPrecipTi;	// kP * recipTi, precalculated so that the heater control loop only has to multiply
+
+	void CalcProducts() noexcept { kPrecipTi = kP * recipTi; }
 };
 
 // This is how PID parameters are given in M301 commands
@@ -47,6 +50,7 @@ public:
 
 	// Stored parameters
 	float GetDeadTime() const noexcept { return deadTime; }
+	float GetHeatingRate() const noexcept { return heatingRate; }
 	float GetMaxPwm() const noexcept { return maxPwm; }
 	bool UsePid() const noexcept { return usePid; }
 	bool IsInverted() const noexcept { return inverted; }
@@ -74,6 +78,7 @@ private:
 	static float EstimateMaxTemperatureRise(float hr, float cr, float cre) noexcept;
 
 	float heatingRate;						// the rate at which the heater heats up at full PWM with no cooling
+	float recipHeatingRate;					// the reciprocal of heatingRate, calculated by CalcPidConstants
 	float basicCoolingRate;					// the rate at which the heater cools down when it is 100C above ambient and the fan is off
 	float fanCoolingRate;					// the additional cooling rate at 100C above ambient with the fan on at full PWM
 	float coolingRateExponent;				// how the basic cooling rate varies with temperature difference
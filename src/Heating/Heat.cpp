@@ -22,13 +22,16 @@ Licence: GPL
 #include "Heater.h"
 #include <Platform.h>
 #include <TaskPriorities.h>
+#include <TaskStackSizes.h>
 #include "Sensors/TemperatureSensor.h"
 #include "Sensors/RemoteSensor.h"
+#include <Movement/StepTimer.h>
 #include <CanMessageGenericParser.h>
 #include <CanMessageBuffer.h>
 #include <CanMessageGenericTables.h>
 #include <CAN/CanInterface.h>
 #include <Fans/FansManager.h>
+#include <DeadlineMonitor.h>
 
 #if SUPPORT_DHT_SENSOR
 # include "Sensors/DhtSensor.h"
@@ -42,22 +45,12 @@ Licence: GPL
 # include <Movement/StepperDrivers/TMC51xx.h>
 #endif
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 # include <CommandProcessing/AccelerometerHandler.h>
 #endif
 
 #include "Tasks.h"
 
-// The task stack size must be large enough for calls to debugPrintf when a heater fault occurs.
-// Currently (2020-12-03) it needs at least 144 words when handling a heater fault, if debugPrintf calls vuprintf but the underlying putchar function throws the character away.
-// We now avoid calling vuprintf from debugPrintf unless this is a debug build
-
-#ifdef DEBUG
-constexpr uint32_t HeaterTaskStackWords = 230;					// task stack size in dwords
-#else
-constexpr uint32_t HeaterTaskStackWords = 200;					// task stack size in dwords
-#endif
-
 static Task<HeaterTaskStackWords> *heaterTask;
 
 namespace Heat
@@ -65,7 +58,7 @@ namespace Heat
 	// Private members
 	static Heater* heaters[MaxHeaters];							// A PID controller for each heater
 
-	static TemperatureSensor * volatile sensorsRoot = nullptr;	// The sensor list, which must be maintained in sensor number order because the Heat task assumes that
+	static TemperatureSensor *sensorsByNumber[MaxSensors];		// The sensors indexed by sensor number, so that walking this array visits them in sensor number order
 
 	static float extrusionMinTemp;								// Minimum temperature to allow regular extrusion
 	static float retractionMinTemp;								// Minimum temperature to allow regular retraction
@@ -79,7 +72,42 @@ namespace Heat
 	static uint32_t lastSensorsBroadcastWhen = 0;				// for diagnostics
 	static unsigned int lastSensorsFound = 0;					// for diagnostics
 	static uint32_t heatTaskLoopTime = 0;						// for diagnostics
-	static unsigned int sensorOrderingErrors = 0;				// for diagnostics
+
+	// The main board treats a remote sensor reading as timed out 2 seconds after it arrives, so we must report each sensor more often than that
+	constexpr uint32_t MaxSensorReportInterval = 1000;
+	static float sensorReportThreshold = 0.0;					// only broadcast a sensor temperature if it changed by more than this, or 0 to broadcast all sensors every time
+	static uint32_t sensorReportMaxInterval = MaxSensorReportInterval;	// the maximum interval between broadcasts of a sensor when sensorReportThreshold is nonzero
+
+	// The Heat task runs on a tick of this many milliseconds. Regular broadcasts happen every BroadcastTicks ticks and each heater is spun at its own multiple of the tick.
+	constexpr uint32_t HeatTaskTickMillis = Heater::MinSampleIntervalMillis;
+	constexpr uint32_t BroadcastTicks = HeatSampleIntervalMillis/HeatTaskTickMillis;
+	static_assert(BroadcastTicks * HeatTaskTickMillis == HeatSampleIntervalMillis);
+
+	// The readings of all the sensors, taken by the Heat task each time it polls them, so that heaters and fans can get them without locking or searching the sensors list
+	struct SensorSnapshot
+	{
+		float temperature;
+		TemperatureError err;
+	};
+
+	constexpr uint32_t MaxSnapshotAge = 2000;					// if the Heat task hasn't updated the snapshots for this long then they are not to be trusted
+	static SensorSnapshot sensorSnapshots[MaxSensors];
+	static volatile uint32_t whenSnapshotsUpdated = 0;
+
+	// Heater power budgeting. A heater is included in the budget only if we know its resistance, because we need that to calculate its power from the supply voltage.
+	static float heaterResistances[MaxHeaters] = { 0.0 };		// the resistance of each heater in ohms, or 0 if not known
+	static float requestedHeaterPowers[MaxHeaters] = { 0.0 };	// the power in watts that each heater wants at the PWM it most recently requested
+	static float heaterPowerBudget = 0.0;						// the total power in watts that the heaters may take, or 0 if unlimited
+	static float heaterPowerScale = 1.0;						// the factor by which we most recently scaled down the PWM to stay within the budget
+
+	// Coordinated zone heating. Heaters in the same zone group share a coupled model and their power is allocated so that the zones heat up together.
+	constexpr float ZoneMaxLead = 10.0;							// a zone this many degC ahead of the furthest behind zone in its group gets no power while heating up
+	constexpr uint32_t ZoneReportTimeout = 2 * Heater::MaxSampleIntervalMillis;	// a zone that hasn't reported for this long is left out of its group
+	static uint8_t heaterZoneGroups[MaxHeaters] = { 0 };		// the zone group of each heater, or 0 if it is controlled independently
+	static float heaterZoneCouplings[MaxHeaters] = { 0.0 };		// the rate in degC/sec per degC of difference at which each heater gains heat from the rest of its group
+	static float zoneTemperatures[MaxHeaters];					// the temperature that each heater in a zone group most recently reported
+	static float zoneErrors[MaxHeaters];						// the temperature error that each heater in a zone group most recently reported
+	static uint32_t zoneReportMillis[MaxHeaters];				// when each heater in a zone group most recently reported
 
 	static uint8_t newDriverFaultState = 0;
 	static uint8_t newHeaterFaultState = 0;
@@ -90,57 +118,62 @@ namespace Heat
 		return ReadLockedPointer<Heater>(locker, (heater < 0 || heater >= (int)MaxHeaters) ? nullptr : heaters[heater]);
 	}
 
+	// Tell the heaters that a sensor has been deleted or replaced, so that they set up their fast cutoff in the new one.
+	// Must not be called with the sensors lock write-locked, because heaters lock the heaters lock before the sensors lock.
+	static void SensorChanged(unsigned int sn) noexcept
+	{
+		ReadLocker lock(heatersLock);
+		for (Heater *h : heaters)
+		{
+			if (h != nullptr)
+			{
+				h->SensorChanged(sn);
+			}
+		}
+	}
+
+	// Take the latest reading of a sensor and store it in its snapshot. Called only by the Heat task.
+	static void UpdateSnapshot(TemperatureSensor *ts, float& temperature, TemperatureError& err) noexcept
+	{
+		err = ts->GetLatestTemperature(temperature);
+		const unsigned int sn = ts->GetSensorNumber();
+		if (sn < MaxSensors)
+		{
+			AtomicCriticalSectionLocker lock;						// so that other tasks don't see a torn snapshot
+			sensorSnapshots[sn].temperature = temperature;
+			sensorSnapshots[sn].err = err;
+		}
+	}
+
 	// Delete a sensor, if there is one. Must write-lock the sensors lock before calling this.
 	static void DeleteSensor(unsigned int sn)
 	{
-		TemperatureSensor *currentSensor = sensorsRoot;
-		TemperatureSensor *lastSensor = nullptr;
-
-		while (currentSensor != nullptr)
+		if (sn < MaxSensors)
 		{
-			if (currentSensor->GetSensorNumber() == sn)
 			{
-				TemperatureSensor *sensorToDelete = currentSensor;
-				currentSensor = currentSensor->GetNext();
-				if (lastSensor == nullptr)
-				{
-					sensorsRoot = currentSensor;
-				}
-				else
-				{
-					lastSensor->SetNext(currentSensor);
-				}
-				delete sensorToDelete;
-				break;
+				AtomicCriticalSectionLocker lock;
+				sensorSnapshots[sn].temperature = BadErrorTemperature;
+				sensorSnapshots[sn].err = TemperatureError::unknownSensor;
 			}
 
-			lastSensor = currentSensor;
-			currentSensor = currentSensor->GetNext();
+			TemperatureSensor * const sensorToDelete = sensorsByNumber[sn];
+			sensorsByNumber[sn] = nullptr;
+			delete sensorToDelete;
 		}
 	}
 
 	// Insert a sensor. Must write-lock the sensors lock before calling this.
 	static void InsertSensor(TemperatureSensor *newSensor)
 	{
-		TemperatureSensor *prev = nullptr;
-		TemperatureSensor *ts = sensorsRoot;
-		for (;;)
+		const unsigned int sn = newSensor->GetSensorNumber();
+		if (sn < MaxSensors)
 		{
-			if (ts == nullptr || ts->GetSensorNumber() > newSensor->GetSensorNumber())
-			{
-				newSensor->SetNext(ts);
-				if (prev == nullptr)
-				{
-					sensorsRoot = newSensor;
-				}
-				else
-				{
-					prev->SetNext(newSensor);
-				}
-				break;
-			}
-			prev = ts;
-			ts = ts->GetNext();
+			delete sensorsByNumber[sn];				// in case there was already a sensor with this number
+			sensorsByNumber[sn] = newSensor;
+		}
+		else
+		{
+			delete newSensor;
 		}
 	}
 
@@ -150,6 +183,74 @@ namespace Heat
 		return GCodeResult::error;
 	}
 
+	// Return true if the heater is due to be spun in this Heat task tick
+	static inline bool IsHeaterDue(const Heater *h, uint32_t tick) noexcept
+	{
+		return tick % (h->GetSampleInterval()/HeatTaskTickMillis) == 0;
+	}
+
+	// Get the next tick after this one in which the Heat task has something to do
+	static uint32_t GetNextTick(uint32_t tick) noexcept
+	{
+		uint32_t nextTick = (tick/BroadcastTicks + 1) * BroadcastTicks;
+		ReadLocker lock(heatersLock);
+		for (const Heater *h : heaters)
+		{
+			if (h != nullptr)
+			{
+				const uint32_t heaterTicks = h->GetSampleInterval()/HeatTaskTickMillis;
+				nextTick = min<uint32_t>(nextTick, (tick/heaterTicks + 1) * heaterTicks);
+			}
+		}
+		return nextTick;
+	}
+
+	// Poll the sensors used by the heaters that are due in this tick, then spin those heaters. Called on ticks in which we don't do the regular broadcasts.
+	static void SpinDueHeaters(uint32_t tick) noexcept
+	{
+		SensorsBitmap sensorsToPoll;
+		{
+			ReadLocker lock(heatersLock);
+			for (const Heater *h : heaters)
+			{
+				if (h != nullptr && IsHeaterDue(h, tick))
+				{
+					h->AddSensorsUsed(sensorsToPoll);
+				}
+			}
+		}
+
+		if (sensorsToPoll.IsEmpty())
+		{
+			return;
+		}
+
+		{
+			ReadLocker lock(sensorsLock);
+			sensorsToPoll.Iterate([](unsigned int sn, unsigned int)
+									{
+										TemperatureSensor * const currentSensor = sensorsByNumber[sn];
+										if (currentSensor != nullptr)
+										{
+											currentSensor->Poll();
+											float temperature;
+											TemperatureError err;
+											UpdateSnapshot(currentSensor, temperature, err);
+										}
+									}
+								 );
+		}
+
+		ReadLocker lock(heatersLock);
+		for (Heater *h : heaters)
+		{
+			if (h != nullptr && IsHeaterDue(h, tick))
+			{
+				h->Spin();
+			}
+		}
+	}
+
 	// Broadcast our heater statuses
 	static void SendHeatersStatus(CanMessageBuffer& buf)
 	{
@@ -177,9 +278,238 @@ namespace Heat
 		if (heatersFound != 0)
 		{
 			buf.dataLength = msg->GetActualDataLength(heatersFound);
-			CanInterface::Send(&buf);
+			CanInterface::SendQueued(buf);
+		}
+	}
+}
+
+// Set when to broadcast sensor temperatures. A threshold of zero means broadcast every sensor every time.
+GCodeResult Heat::SetSensorReporting(float threshold, uint32_t maxInterval, const StringRef& reply) noexcept
+{
+	sensorReportThreshold = max<float>(threshold, 0.0);
+	sensorReportMaxInterval = (maxInterval == 0 || maxInterval > MaxSensorReportInterval) ? MaxSensorReportInterval : maxInterval;
+	if (sensorReportThreshold > 0.0)
+	{
+		reply.printf("Broadcasting sensor temperatures when they change by more than %.1fC or at least every %" PRIu32 "ms", (double)sensorReportThreshold, sensorReportMaxInterval);
+	}
+	else
+	{
+		reply.copy("Broadcasting all sensor temperatures every time");
+	}
+	return GCodeResult::ok;
+}
+
+// Set the length of the ADC averaging filter used by a sensor, or report it if the length is zero
+GCodeResult Heat::SetSensorFilterLength(unsigned int sensorNum, uint32_t length, const StringRef& reply) noexcept
+{
+	const auto ts = FindSensor(sensorNum);
+	if (ts.IsNull())
+	{
+		reply.printf("Board %u does not have sensor %u", CanInterface::GetCanAddress(), sensorNum);
+		return GCodeResult::error;
+	}
+	return ts->SetFilterLength(length, reply);
+}
+
+// Add a point to the piecewise linear calibration table of a sensor, or clear the table
+GCodeResult Heat::SetSensorCalibrationPoint(unsigned int sensorNum, uint32_t inputPpm, int32_t milliDegrees, const StringRef& reply) noexcept
+{
+	const auto ts = FindSensor(sensorNum);
+	if (ts.IsNull())
+	{
+		reply.printf("Board %u does not have sensor %u", CanInterface::GetCanAddress(), sensorNum);
+		return GCodeResult::error;
+	}
+	return ts->SetCalibrationPoint(inputPpm, milliDegrees, reply);
+}
+
+// Set how often a heater is spun, or report it if the interval is zero
+GCodeResult Heat::SetHeaterSampleInterval(unsigned int heater, uint32_t interval, const StringRef& reply) noexcept
+{
+	const auto h = FindHeater(heater);
+	if (h.IsNull())
+	{
+		return UnknownHeater(heater, reply);
+	}
+
+	if (interval != 0)
+	{
+		const GCodeResult rslt = h->SetSampleInterval(interval, reply);
+		if (rslt != GCodeResult::ok)
+		{
+			return rslt;
 		}
 	}
+	reply.printf("Heater %u sample interval %" PRIu32 "ms", heater, h->GetSampleInterval());
+	return GCodeResult::ok;
+}
+
+// Select model predictive control for a heater with a horizon in milliseconds, or its normal control mode if the horizon is zero
+GCodeResult Heat::SetHeaterMpcHorizon(unsigned int heater, uint32_t horizon, const StringRef& reply) noexcept
+{
+	const auto h = FindHeater(heater);
+	return (h.IsNull()) ? UnknownHeater(heater, reply) : h->SetMpcHorizon(horizon, reply);
+}
+
+// Set when heater tuning stops early because the cycles agree
+GCodeResult Heat::SetTuningConvergence(unsigned int minCycles, uint32_t tolerance, const StringRef& reply) noexcept
+{
+	return LocalHeater::ConfigureTuningConvergence(minCycles, tolerance, reply);
+}
+
+// Set the resistance of a heater so that it is included in the power budget, or report it if the resistance is zero
+GCodeResult Heat::SetHeaterResistance(unsigned int heater, uint32_t milliohms, const StringRef& reply) noexcept
+{
+	const auto h = FindHeater(heater);
+	if (h.IsNull())
+	{
+		return UnknownHeater(heater, reply);
+	}
+
+	if (milliohms != 0)
+	{
+		heaterResistances[heater] = (float)milliohms * 0.001;
+	}
+
+	if (heaterResistances[heater] > 0.0)
+	{
+		reply.printf("Heater %u resistance %.2f ohms", heater, (double)heaterResistances[heater]);
+	}
+	else
+	{
+		reply.printf("Heater %u resistance not set, so it is not included in the power budget", heater);
+	}
+	return GCodeResult::ok;
+}
+
+// Limit the total power that the heaters whose resistances we know may take, or remove the limit if watts is zero
+GCodeResult Heat::SetHeaterPowerBudget(uint32_t watts, const StringRef& reply) noexcept
+{
+#if HAS_VOLTAGE_MONITOR
+	heaterPowerBudget = (float)watts;
+	heaterPowerScale = 1.0;
+	if (watts == 0)
+	{
+		reply.copy("Heater power is not limited");
+	}
+	else
+	{
+		reply.printf("Heater power limited to %" PRIu32 "W", watts);
+	}
+	return GCodeResult::ok;
+#else
+	reply.copy("Heater power budgeting is not supported by this board because it does not monitor the supply voltage");
+	return GCodeResult::error;
+#endif
+}
+
+// Record the PWM that a heater wants and return the PWM that it may use. Called by the heater whenever it sets its output, which may be from the ADC task.
+// If the heaters would take more than the budget between them, each heater's PWM is scaled down in proportion.
+// Heaters are spun at different times, so the total may exceed the budget until the other heaters next set their outputs.
+float Heat::LimitHeaterPwm(unsigned int heater, float pwm) noexcept
+{
+#if HAS_VOLTAGE_MONITOR
+	if (heaterPowerBudget <= 0.0 || heater >= MaxHeaters || heaterResistances[heater] <= 0.0)
+	{
+		return pwm;
+	}
+
+	const float fullPower = fsquare(Platform::GetCurrentVinVoltage())/heaterResistances[heater];
+	AtomicCriticalSectionLocker lock;
+	requestedHeaterPowers[heater] = pwm * fullPower;
+	float totalPower = 0.0;
+	for (float p : requestedHeaterPowers)
+	{
+		totalPower += p;
+	}
+	heaterPowerScale = (totalPower > heaterPowerBudget) ? heaterPowerBudget/totalPower : 1.0;
+	return pwm * heaterPowerScale;
+#else
+	return pwm;
+#endif
+}
+
+// Put a heater in a zone group with the specified coupling in thousandths of a degC/sec per degC of difference, or control it independently if the group is zero
+GCodeResult Heat::SetHeaterZone(unsigned int heater, uint32_t group, uint32_t coupling, const StringRef& reply) noexcept
+{
+	const auto h = FindHeater(heater);
+	if (h.IsNull())
+	{
+		return UnknownHeater(heater, reply);
+	}
+	if (group > MaxHeaters)
+	{
+		reply.printf("Zone group must be between 0 and %u", (unsigned int)MaxHeaters);
+		return GCodeResult::error;
+	}
+
+	{
+		AtomicCriticalSectionLocker lock;
+		heaterZoneGroups[heater] = (uint8_t)group;
+		heaterZoneCouplings[heater] = (float)coupling * 0.001;
+		zoneReportMillis[heater] = millis() - ZoneReportTimeout;		// don't include this heater until it reports
+	}
+
+	if (group == 0)
+	{
+		reply.printf("Heater %u is controlled independently", heater);
+	}
+	else
+	{
+		reply.printf("Heater %u is in zone group %" PRIu32 " with coupling %.3f/sec, group heaters", heater, group, (double)heaterZoneCouplings[heater]);
+		for (size_t i = 0; i < MaxHeaters; ++i)
+		{
+			if (heaterZoneGroups[i] == group)
+			{
+				reply.catf(" %u", (unsigned int)i);
+			}
+		}
+	}
+	return GCodeResult::ok;
+}
+
+// Adjust the PWM that a heater in a zone group wants, given its temperature and error and its model heating rate at full PWM. Called by the heater each time it calculates its PWM.
+// The other heaters in the group feed heat into this one in proportion to the temperature difference, so we take off the PWM that would provide that heat.
+// While the group is heating up, we also hold back the zones that are ahead of the one furthest behind, so that the zones reach the target together.
+float Heat::CoordinateZonePwm(unsigned int heater, float temperature, float error, float pwm, float heatingRate) noexcept
+{
+	if (heater >= MaxHeaters || heaterZoneGroups[heater] == 0)
+	{
+		return pwm;
+	}
+
+	const uint8_t group = heaterZoneGroups[heater];
+	const uint32_t now = millis();
+	float neighbourTemperatures = 0.0;
+	unsigned int numNeighbours = 0;
+	float maxError = error;
+	{
+		AtomicCriticalSectionLocker lock;
+		zoneTemperatures[heater] = temperature;
+		zoneErrors[heater] = error;
+		zoneReportMillis[heater] = now;
+		for (size_t i = 0; i < MaxHeaters; ++i)
+		{
+			if (i != heater && heaterZoneGroups[i] == group && now - zoneReportMillis[i] < ZoneReportTimeout)
+			{
+				neighbourTemperatures += zoneTemperatures[i];
+				++numNeighbours;
+				maxError = max<float>(maxError, zoneErrors[i]);
+			}
+		}
+	}
+
+	if (numNeighbours == 0 || heatingRate <= 0.0)
+	{
+		return pwm;
+	}
+
+	pwm -= heaterZoneCouplings[heater] * (neighbourTemperatures/numNeighbours - temperature)/heatingRate;
+	if (error > TemperatureCloseEnough && maxError > error)
+	{
+		pwm *= max<float>(1.0 - (maxError - error) * (1.0/ZoneMaxLead), 0.0);
+	}
+	return max<float>(pwm, 0.0);
 }
 
 // Is the heater enabled?
@@ -200,7 +530,15 @@ void Heat::Init()
 	}
 
 	// Set up the temperature (and other) sensors
-	sensorsRoot = nullptr;
+	for (TemperatureSensor *& ts : sensorsByNumber)
+	{
+		ts = nullptr;
+	}
+	for (SensorSnapshot& ss : sensorSnapshots)
+	{
+		ss.temperature = BadErrorTemperature;
+		ss.err = TemperatureError::unknownSensor;
+	}
 
 #if SUPPORT_DHT_SENSOR
 	// Initialise static fields of the DHT sensor
@@ -229,18 +567,19 @@ void Heat::Exit()
 }
 
 // This is the task loop executed by the Heat task. This task performs the following functions:
-// - Spin the PIDs every 250ms. They must be spun at regular intervals for the I and D terms to work consistently.
+// - Spin each PID at its own sample interval, 250ms by default. They must be spun at regular intervals for the I and D terms to work consistently.
 // - Broadcast the sensor temperatures
 // - Broadcast the status of our heaters
 // - Broadcast the status of our fans
 // - Broadcast the status of our motor drivers
 [[noreturn]] void Heat::TaskLoop(void *)
 {
-	uint32_t nextWakeTime = millis();
+	uint32_t nextWakeTime = millis() + HeatSampleIntervalMillis;
+	uint32_t tickCount = 0;
+	const DeadlineMonitor::Handle deadlineHandle = DeadlineMonitor::Register("Heat", HeatTaskTickMillis * (StepTimer::StepClockRate/1000));
 	for (;;)
 	{
-		// Wait until we are woken or it's time to send another regular broadcast. If we are really unlucky, we could end up waiting for one tick too long.
-		nextWakeTime += HeatSampleIntervalMillis;
+		// Wait until we are woken or it's time to spin a heater or send another regular broadcast. If we are really unlucky, we could end up waiting for one tick too long.
 		int32_t delayTime = (int32_t)(nextWakeTime - millis());
 		if (delayTime > 0)
 		{
@@ -267,7 +606,22 @@ void Heat::Exit()
 
 		// Check whether it is time to poll sensors and PIDs and send regular messages
 		const uint32_t startTime = millis();
-		if ((int32_t)(startTime - nextWakeTime) >= 0)
+		if ((int32_t)(startTime - nextWakeTime) < 0)
+		{
+			continue;												// we were woken early to send an urgent message
+		}
+		DeadlineMonitor::Begin(deadlineHandle, StepTimer::GetTimerTicks() - (startTime - nextWakeTime) * (StepTimer::StepClockRate/1000));
+
+		const uint32_t thisTick = tickCount;
+		const uint32_t nextTick = GetNextTick(thisTick);
+		nextWakeTime += (nextTick - thisTick) * HeatTaskTickMillis;
+		tickCount = nextTick;
+
+		if (thisTick % BroadcastTicks != 0)
+		{
+			SpinDueHeaters(thisTick);								// only heaters with short sample intervals need attention in this tick
+		}
+		else
 		{
 			{
 				// Walk the sensor list and poll all sensors
@@ -275,46 +629,59 @@ void Heat::Exit()
 				CanMessageSensorTemperatures * const sensorTempsMsg = buf.SetupBroadcastMessage<CanMessageSensorTemperatures>(CanInterface::GetCanAddress());
 				sensorTempsMsg->whichSensors = 0;
 				unsigned int sensorsFound = 0;
+				SensorsBitmap localSensors;
 				{
-					unsigned int nextUnreportedSensor = 0;
 					ReadLocker lock(sensorsLock);
-					for (TemperatureSensor *currentSensor = sensorsRoot; currentSensor != nullptr; currentSensor = currentSensor->GetNext())
+					for (unsigned int sn = 0; sn < MaxSensors; ++sn)
 					{
+						TemperatureSensor * const currentSensor = sensorsByNumber[sn];
+						if (currentSensor == nullptr)
+						{
+							continue;
+						}
 						currentSensor->Poll();
-						if (currentSensor->GetBoardAddress() == CanInterface::GetCanAddress() && sensorsFound < ARRAY_SIZE(sensorTempsMsg->temperatureReports))
+						float temperature;
+						TemperatureError err;
+						UpdateSnapshot(currentSensor, temperature, err);
+						if (currentSensor->GetBoardAddress() == CanInterface::GetCanAddress())
 						{
-							const unsigned int sn = currentSensor->GetSensorNumber();
-							if (sn >= nextUnreportedSensor && sn < 64)
+							localSensors.SetBit(sn);
+
+							// We visit the sensors in increasing number order, so the order of the reports matches the order of the bits in whichSensors
+							if (sensorsFound < ARRAY_SIZE(sensorTempsMsg->temperatureReports) && sn < 64
+								&& currentSensor->IsReportDue(temperature, err, sensorReportThreshold, sensorReportMaxInterval, startTime))
 							{
 								sensorTempsMsg->whichSensors |= (uint64_t)1u << sn;
-								float temperature;
-								sensorTempsMsg->temperatureReports[sensorsFound].errorCode = (uint8_t)(currentSensor->GetLatestTemperature(temperature));
+								sensorTempsMsg->temperatureReports[sensorsFound].errorCode = (uint8_t)err;
 								sensorTempsMsg->temperatureReports[sensorsFound].SetTemperature(temperature);
 								++sensorsFound;
-								nextUnreportedSensor = sn + 1;
-							}
-							else
-							{
-								// We have a duplicate sensor number, or the sensors list is not ordered by sensor number, or the sensor number is out of range
-								// Don't send its temperature because that will mess up the relationship between the bitmap and the sensor data in the message
-								++sensorOrderingErrors;
 							}
 						}
 					}
 				}
 
-				// Spin the heaters
+				whenSnapshotsUpdated = millis();
+
+				// Spin the heaters and find out which sensors they use
+				SensorsBitmap sensorsUsed = FansManager::GetMonitoredSensors();
 				{
 					ReadLocker lock(heatersLock);
 					for (Heater *h : heaters)
 					{
 						if (h != nullptr)
 						{
-							h->Spin();
+							if (IsHeaterDue(h, thisTick))
+							{
+								h->Spin();
+							}
+							h->AddSensorsUsed(sensorsUsed);
 						}
 					}
 				}
 
+				// We only need temperature broadcasts from other boards if we use sensors that are not ours
+				CanInterface::SetSensorReportsWanted((sensorsUsed.GetRaw() & ~localSensors.GetRaw()) != 0);
+
 				// Broadcast our sensor temperatures
 				lastSensorsBroadcastWhich = sensorTempsMsg->whichSensors;	// for diagnostics
 				lastSensorsBroadcastWhen = millis();						// for diagnostics
@@ -322,7 +689,7 @@ void Heat::Exit()
 				if (sensorsFound != 0)
 				{
 					buf.dataLength = sensorTempsMsg->GetActualDataLength(sensorsFound);
-					CanInterface::Send(&buf);
+					CanInterface::SendQueued(buf);
 				}
 			}
 
@@ -336,7 +703,7 @@ void Heat::Exit()
 					if (LocalHeater::GetTuningCycleData(*msg))
 					{
 						msg->SetStandardFields(heaterBeingTuned);
-						CanInterface::Send(&buf);
+						CanInterface::SendQueued(buf);
 					}
 				}
 				else
@@ -345,6 +712,7 @@ void Heat::Exit()
 				}
 			}
 
+			// Queue our status messages. The CanSend task sends them as one burst, so this task doesn't have to wait for room in the transmit FIFO.
 			if (newHeaterFaultState == 0)
 			{
 				SendHeatersStatus(buf);						// send the status of our heaters
@@ -361,7 +729,7 @@ void Heat::Exit()
 				if (numReported != 0)
 				{
 					buf.dataLength = msg->GetActualDataLength(numReported);
-					CanInterface::Send(&buf);
+					CanInterface::SendQueued(buf);
 				}
 			}
 
@@ -397,19 +765,20 @@ void Heat::Exit()
 				boardStatusMsg->values[index++] = Platform::GetMcuTemperatures();
 				boardStatusMsg->hasMcuTemp = true;
 #endif
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 				boardStatusMsg->hasAccelerometer = AccelerometerHandler::IsPresent();
 #endif
 #if SUPPORT_CLOSED_LOOP
 				boardStatusMsg->hasClosedLoop = true;
 #endif
 				buf.dataLength = boardStatusMsg->GetActualDataLength();
-				CanInterface::Send(&buf);
+				CanInterface::SendQueued(buf);
 			}
 
 			Platform::KickHeatTaskWatchdog();				// tell Platform that we are alive
 			heatTaskLoopTime = millis() - startTime;
 		}
+		DeadlineMonitor::End(deadlineHandle);
 	}
 }
 
@@ -446,6 +815,7 @@ GCodeResult Heat::ConfigureHeater(const CanMessageGeneric& msg, const StringRef&
 		Heater *oldHeater = nullptr;
 		std::swap(oldHeater, heaters[heater]);
 		delete oldHeater;
+		requestedHeaterPowers[heater] = 0.0;
 
 		Heater *newHeater = new LocalHeater(heater);
 		const GCodeResult rslt = newHeater->ConfigurePortAndSensor(pinName.c_str(), freq, sensorNumber, reply);
@@ -492,32 +862,41 @@ GCodeResult Heat::ProcessM308(const CanMessageGeneric& msg, const StringRef& rep
 			String<StringLength50> sensorTypeName;							// StringLength20 is too short for "thermocouple-max31856"
 			if (parser.GetStringParam('P', sensorTypeName.GetRef()) && sensorTypeName.EqualsIgnoreCase(NoPinName))
 			{
-				WriteLocker lock(sensorsLock);
-				DeleteSensor(sensorNum);
+				{
+					WriteLocker lock(sensorsLock);
+					DeleteSensor(sensorNum);
+				}
+				SensorChanged(sensorNum);
 				return GCodeResult::ok;
 			}
 
 			if (parser.GetStringParam('Y', sensorTypeName.GetRef()))
 			{
-				WriteLocker lock(sensorsLock);
-
-				DeleteSensor(sensorNum);
-
-				TemperatureSensor * const newSensor = TemperatureSensor::Create(sensorNum, sensorTypeName.c_str(), reply);
-				if (newSensor == nullptr)
+				GCodeResult rslt;
 				{
-					return GCodeResult::error;
-				}
+					WriteLocker lock(sensorsLock);
 
-				const GCodeResult rslt = newSensor->Configure(parser, reply);
-				if (Succeeded(rslt))
-				{
-					InsertSensor(newSensor);
-				}
-				else
-				{
-					delete newSensor;
+					DeleteSensor(sensorNum);
+
+					TemperatureSensor * const newSensor = TemperatureSensor::Create(sensorNum, sensorTypeName.c_str(), reply);
+					if (newSensor == nullptr)
+					{
+						rslt = GCodeResult::error;
+					}
+					else
+					{
+						rslt = newSensor->Configure(parser, reply);
+						if (Succeeded(rslt))
+						{
+							InsertSensor(newSensor);
+						}
+						else
+						{
+							delete newSensor;
+						}
+					}
 				}
+				SensorChanged(sensorNum);				// the old sensor has gone even if we failed to create the new one
 				return rslt;
 			}
 
@@ -566,45 +945,71 @@ float Heat::GetLowestTemperatureLimit(int heater) noexcept
 	return (h.IsNull()) ? ABS_ZERO : h->GetLowestTemperatureLimit();
 }
 
-// Get the temperature of a sensor
+// Get the reading of a sensor that the Heat task took when it last polled it
 float Heat::GetSensorTemperature(int sensorNum, TemperatureError& err) noexcept
 {
-	const auto sensor = FindSensor(sensorNum);
-	if (sensor.IsNotNull())
+	if (sensorNum < 0 || sensorNum >= (int)MaxSensors)
+	{
+		err = TemperatureError::unknownSensor;
+		return BadErrorTemperature;
+	}
+
+	if (millis() - whenSnapshotsUpdated > MaxSnapshotAge)
 	{
-		float temp;
-		err = sensor->GetLatestTemperature(temp);
-		return temp;
+		err = TemperatureError::timeout;
+		return BadErrorTemperature;
 	}
 
-	err = TemperatureError::unknownSensor;
-	return BadErrorTemperature;
+	AtomicCriticalSectionLocker lock;
+	err = sensorSnapshots[sensorNum].err;
+	return sensorSnapshots[sensorNum].temperature;
 }
 
 void Heat::ProcessRemoteSensorsReport(CanAddress src, const CanMessageSensorTemperatures& msg) noexcept
 {
-	Bitmap<uint64_t> sensorsReported(msg.whichSensors);
-	sensorsReported.Iterate([src, &msg](unsigned int sensor, unsigned int index)
-								{
-									if (index < ARRAY_SIZE(msg.temperatureReports) && src != CanInterface::GetCanAddress())
+	if (src == CanInterface::GetCanAddress())
+	{
+		return;
+	}
+
+	// Update the sensors we already have while holding the read lock once for the whole report, and note which ones we need to create
+	const Bitmap<uint64_t> sensorsReported(msg.whichSensors);
+	Bitmap<uint64_t> sensorsToCreate;
+	{
+		ReadLocker lock(sensorsLock);
+		sensorsReported.Iterate([src, &msg, &sensorsToCreate](unsigned int sensor, unsigned int index)
 									{
-										const CanSensorReport& sr = msg.temperatureReports[index];
-										auto ts = FindSensor(sensor);
-										if (ts.IsNotNull())
+										if (index < ARRAY_SIZE(msg.temperatureReports) && sensor < MaxSensors)
 										{
-											ts->UpdateRemoteTemperature(src, sr);
+											TemperatureSensor * const ts = sensorsByNumber[sensor];
+											if (ts != nullptr)
+											{
+												ts->UpdateRemoteTemperature(src, msg.temperatureReports[index]);
+											}
+											else
+											{
+												sensorsToCreate.SetBit(sensor);
+											}
 										}
-										else
+									}
+								);
+	}
+
+	// Create RemoteSensor objects for any sensors that we haven't seen before. This happens only when a board first reports them.
+	if (!sensorsToCreate.IsEmpty())
+	{
+		WriteLocker lock(sensorsLock);
+		sensorsReported.Iterate([src, &msg, sensorsToCreate](unsigned int sensor, unsigned int index)
+									{
+										if (sensorsToCreate.IsBitSet(sensor) && sensorsByNumber[sensor] == nullptr)
 										{
-											// Create a new RemoteSensor
-											ts.Release();
 											RemoteSensor * const rs = new RemoteSensor(sensor, src);
-											rs->UpdateRemoteTemperature(src, sr);
+											rs->UpdateRemoteTemperature(src, msg.temperatureReports[index]);
 											InsertSensor(rs);
 										}
 									}
-								}
-							);
+								);
+	}
 }
 
 void Heat::SwitchOffAll()
@@ -663,19 +1068,17 @@ float Heat::GetAveragePWM(size_t heater)
 	return (h.IsNull()) ? 0.0 : h->GetAveragePWM();
 }
 
+bool Heat::IsHeaterOn(size_t heater)
+{
+	const auto h = FindHeater(heater);
+	return h.IsNotNull() && h->IsOn();
+}
+
 // Get a pointer to the temperature sensor entry, or nullptr if the heater number is bad
 ReadLockedPointer<TemperatureSensor> Heat::FindSensor(int sn)
 {
 	ReadLocker locker(sensorsLock);
-
-	for (TemperatureSensor *sensor = sensorsRoot; sensor != nullptr; sensor = sensor->GetNext())
-	{
-		if ((int)sensor->GetSensorNumber() == sn)
-		{
-			return ReadLockedPointer<TemperatureSensor>(locker, sensor);
-		}
-	}
-	return ReadLockedPointer<TemperatureSensor>(locker, nullptr);
+	return ReadLockedPointer<TemperatureSensor>(locker, (sn >= 0 && sn < (int)MaxSensors) ? sensorsByNumber[sn] : nullptr);
 }
 
 // Get a pointer to the first temperature sensor with the specified or higher number
@@ -683,11 +1086,11 @@ ReadLockedPointer<TemperatureSensor> Heat::FindSensorAtOrAbove(unsigned int sn)
 {
 	ReadLocker locker(sensorsLock);
 
-	for (TemperatureSensor *sensor = sensorsRoot; sensor != nullptr; sensor = sensor->GetNext())
+	for (; sn < MaxSensors; ++sn)
 	{
-		if (sensor->GetSensorNumber() >= sn)
+		if (sensorsByNumber[sn] != nullptr)
 		{
-			return ReadLockedPointer<TemperatureSensor>(locker, sensor);
+			return ReadLockedPointer<TemperatureSensor>(locker, sensorsByNumber[sn]);
 		}
 	}
 	return ReadLockedPointer<TemperatureSensor>(locker, nullptr);
@@ -707,9 +1110,20 @@ void Heat::SuspendHeaters(bool sus)
 
 void Heat::Diagnostics(const StringRef& reply)
 {
-	reply.lcatf("Last sensors broadcast 0x%08" PRIx64 " found %u %" PRIu32 " ticks ago, %u ordering errs, loop time %" PRIu32,
-					lastSensorsBroadcastWhich, lastSensorsFound, millis() - lastSensorsBroadcastWhen, sensorOrderingErrors, heatTaskLoopTime);
-	sensorOrderingErrors = 0;
+	reply.lcatf("Last sensors broadcast 0x%08" PRIx64 " found %u %" PRIu32 " ticks ago, loop time %" PRIu32,
+					lastSensorsBroadcastWhich, lastSensorsFound, millis() - lastSensorsBroadcastWhen, heatTaskLoopTime);
+	if (heaterPowerBudget > 0.0)
+	{
+		reply.catf(", power budget %.0fW scale %.2f", (double)heaterPowerBudget, (double)heaterPowerScale);
+	}
+	const uint32_t now = millis();
+	for (size_t i = 0; i < MaxHeaters; ++i)
+	{
+		if (heaterZoneGroups[i] != 0 && now - zoneReportMillis[i] < ZoneReportTimeout)
+		{
+			reply.catf(", heater %u zone %u error %.1fC", (unsigned int)i, heaterZoneGroups[i], (double)zoneErrors[i]);
+		}
+	}
 #if 0	// temporary to debug a board that reports bad Vssa
 	reply.catf(", Vref %u Vssa %u",
 		(unsigned int)(Platform::GetVrefFilter(0)->GetSum()/ThermistorAveragingFilter::NumAveraged()),
@@ -717,6 +1131,44 @@ void Heat::Diagnostics(const StringRef& reply)
 #endif
 }
 
+void Heat::AppendCompactDiagnostics(CompactDiagnostics& diags) noexcept
+{
+	diags.StartSection('H');
+	diags.Add(heatTaskLoopTime);
+	diags.Add(millis() - lastSensorsBroadcastWhen);
+	diags.Add((uint32_t)lastSensorsFound);
+}
+
+// Time the Poll function of each local sensor. Polling a sensor more often than usual does no harm, it just updates the reading sooner.
+GCodeResult Heat::RunSensorPollBenchmark(const StringRef& reply) noexcept
+{
+	constexpr unsigned int NumCalls = 64;
+	constexpr uint32_t CyclesPerTick = SystemCoreClockFreq/StepTimer::StepClockRate;
+
+	reply.copy("Sensor poll (cycles):");
+	bool found = false;
+	WriteLocker lock(sensorsLock);					// the heater task polls the sensors while holding a read lock, so this stops it polling them at the same time
+	for (TemperatureSensor *ts : sensorsByNumber)
+	{
+		if (ts != nullptr && ts->GetBoardAddress() == CanInterface::GetCanAddress())
+		{
+			const uint32_t startTicks = StepTimer::GetTimerTicks();
+			for (unsigned int i = 0; i < NumCalls; ++i)
+			{
+				ts->Poll();
+			}
+			const uint32_t ticks = StepTimer::GetTimerTicks() - startTicks;
+			reply.catf(" %u %s %" PRIu32 ",", ts->GetSensorNumber(), ts->GetSensorType(), (ticks * CyclesPerTick)/NumCalls);
+			found = true;
+		}
+	}
+	if (!found)
+	{
+		reply.cat(" no local sensors");
+	}
+	return GCodeResult::ok;
+}
+
 void Heat::NewDriverFault()
 {
 	newDriverFaultState = 1;
@@ -19,6 +19,7 @@
 
 class TemperatureSensor;
 class FopDt;
+class CompactDiagnostics;
 
 namespace Heat
 {
@@ -39,6 +40,18 @@ namespace Heat
 	// Methods that relate to sensors
 	float GetSensorTemperature(int sensorNum, TemperatureError& err) noexcept;	// Result is in degrees Celsius
 	void ProcessRemoteSensorsReport(CanAddress src, const CanMessageSensorTemperatures& msg) noexcept;
+	GCodeResult SetSensorReporting(float threshold, uint32_t maxInterval, const StringRef& reply) noexcept;	// Set when to broadcast sensor temperatures
+	GCodeResult SetSensorFilterLength(unsigned int sensorNum, uint32_t length, const StringRef& reply) noexcept;	// Set or report the ADC filter length of a sensor
+	GCodeResult SetSensorCalibrationPoint(unsigned int sensorNum, uint32_t inputPpm, int32_t milliDegrees, const StringRef& reply) noexcept;	// Add a point to the calibration table of a sensor
+	GCodeResult SetHeaterSampleInterval(unsigned int heater, uint32_t interval, const StringRef& reply) noexcept;	// Set or report how often a heater is spun
+	GCodeResult SetHeaterMpcHorizon(unsigned int heater, uint32_t horizon, const StringRef& reply) noexcept;		// Select model predictive or PID control for a heater
+	GCodeResult SetTuningConvergence(unsigned int minCycles, uint32_t tolerance, const StringRef& reply) noexcept;	// Set when heater tuning stops early
+	GCodeResult SetHeaterResistance(unsigned int heater, uint32_t milliohms, const StringRef& reply) noexcept;		// Set or report the resistance of a heater for power budgeting
+	GCodeResult SetHeaterPowerBudget(uint32_t watts, const StringRef& reply) noexcept;	// Set or report the total power that the heaters may take
+	float LimitHeaterPwm(unsigned int heater, float pwm) noexcept;				// Record the PWM that a heater wants and return the PWM it may use
+	GCodeResult SetHeaterZone(unsigned int heater, uint32_t group, uint32_t coupling, const StringRef& reply) noexcept;	// Put a heater in a zone group, or control it independently if the group is zero
+	float CoordinateZonePwm(unsigned int heater, float temperature, float error, float pwm, float heatingRate) noexcept;	// Adjust the PWM of a heater in a zone group
+	GCodeResult RunSensorPollBenchmark(const StringRef& reply) noexcept;		// Time the Poll function of each local sensor
 
 	// Methods that relate to a particular heater
 	float GetHighestTemperatureLimit(int heater) noexcept;
@@ -53,6 +66,9 @@ namespace Heat
 	bool IsHeaterEnabled(size_t heater)							// Is this heater enabled?
 	pre(heater < NumTotalHeaters);
 
+	bool IsHeaterOn(size_t heater)								// Is this heater switched on?
+	pre(heater < NumTotalHeaters);
+
 	int GetHeaterChannel(size_t heater);						// Return the channel used by a particular heater, or -1 if not configured
 	bool SetHeaterChannel(size_t heater, int channel);			// Set the channel used by a heater, returning true if bad heater or channel number
 	const char *GetHeaterSensorName(size_t heater);				// Get the name of the sensor for a heater, or nullptr if it hasn't been named
@@ -65,6 +81,7 @@ namespace Heat
 	inline bool IsBedOrChamberHeater(int heater) { return false; }
 
 	void Diagnostics(const StringRef& reply);
+	void AppendCompactDiagnostics(CompactDiagnostics& diags) noexcept;
 
 	void NewDriverFault();
 	void NewHeaterFault();
@@ -13,7 +13,7 @@
 Heater::Heater(unsigned int num)
 	: heaterNumber(num), sensorNumber(-1), requestedTemperature(0.0),
 	  maxTempExcursion(DefaultMaxTempExcursion), maxHeatingFaultTime(DefaultMaxHeatingFaultTime),
-	  isBedOrChamber(false)
+	  sampleIntervalMillis(HeatSampleIntervalMillis), isBedOrChamber(false)
 {
 }
 
@@ -21,6 +21,22 @@ Heater::~Heater()
 {
 }
 
+// Add the sensors that this heater and its monitors use to the bitmap
+void Heater::AddSensorsUsed(SensorsBitmap& sensors) const noexcept
+{
+	if (sensorNumber >= 0)
+	{
+		sensors.SetBit(sensorNumber);
+	}
+	for (const HeaterMonitor& m : monitors)
+	{
+		if (m.GetTrigger() != HeaterMonitorTrigger::Disabled && m.GetSensorNumber() >= 0)
+		{
+			sensors.SetBit(m.GetSensorNumber());
+		}
+	}
+}
+
 GCodeResult Heater::SetFaultDetectionParameters(float pMaxTempExcursion, float pMaxFaultTime)
 {
 	maxTempExcursion = pMaxTempExcursion;
@@ -28,12 +44,30 @@ GCodeResult Heater::SetFaultDetectionParameters(float pMaxTempExcursion, float p
 	return GCodeResult::ok;
 }
 
+// Set how often the heater is spun. Low-mass heaters respond better to frequent sampling, high-mass ones need it less often.
+GCodeResult Heater::SetSampleInterval(uint32_t interval, const StringRef& reply) noexcept
+{
+	if (interval < MinSampleIntervalMillis || interval > MaxSampleIntervalMillis || interval % MinSampleIntervalMillis != 0)
+	{
+		reply.printf("Heater sample interval must be a multiple of %" PRIu32 "ms between %" PRIu32 "ms and %" PRIu32 "ms",
+						MinSampleIntervalMillis, MinSampleIntervalMillis, MaxSampleIntervalMillis);
+		return GCodeResult::error;
+	}
+
+	// The Heat task can preempt the task that calls this, so lock it out while we change the interval and discard the samples taken at the old interval
+	TaskCriticalSectionLocker lock;
+	sampleIntervalMillis = interval;
+	SampleIntervalChanged();
+	return GCodeResult::ok;
+}
+
 GCodeResult Heater::SetHeaterMonitors(const CanMessageSetHeaterMonitors& msg, const StringRef& reply)
 {
 	for (size_t i = 0; i < min<size_t>(msg.numMonitors, MaxMonitorsPerHeater); ++i)
 	{
 		monitors[i].Set(msg.monitors[i].sensor, msg.monitors[i].limit, (HeaterMonitorAction)msg.monitors[i].action, (HeaterMonitorTrigger)msg.monitors[i].trigger);
 	}
+	MonitorsChanged();
 	return GCodeResult::ok;
 }
 
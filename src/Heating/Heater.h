@@ -24,6 +24,9 @@ class CanMessageHeaterTuningCommand;
 class Heater
 {
 public:
+	static constexpr uint32_t MinSampleIntervalMillis = 50;		// heater sample intervals must be a multiple of this, which is also the Heat task tick interval
+	static constexpr uint32_t MaxSampleIntervalMillis = 1000;
+
 	Heater(unsigned int num);
 	virtual ~Heater();
 
@@ -41,6 +44,8 @@ public:
 	virtual float GetAccumulator() const = 0;					// get the inertial term accumulator
 	virtual GCodeResult TuningCommand(const CanMessageHeaterTuningCommand& msg, const StringRef& reply) = 0;
 	virtual GCodeResult FeedForwardAdjustment(float fanPwmChange, float extrusionChange) = 0;
+	virtual GCodeResult SetMpcHorizon(uint32_t horizonMillis, const StringRef& reply) noexcept = 0;	// Select model predictive control, or PID if the horizon is zero
+	virtual void SensorChanged(unsigned int sn) noexcept = 0;	// Called when a sensor has been deleted or replaced
 
 	GCodeResult SetTemperature(const CanMessageSetHeaterTemperature& msg, const StringRef& reply);
 
@@ -55,14 +60,20 @@ public:
 	float GetHighestTemperatureLimit() const;					// Get the highest temperature limit
 	float GetLowestTemperatureLimit() const;					// Get the lowest temperature limit
 	void SetHeaterMonitoring(HeaterMonitor *h);
+	void AddSensorsUsed(SensorsBitmap& sensors) const noexcept;	// Add the sensors that this heater and its monitors use to the bitmap
 
 	const FopDt& GetModel() const { return model; }				// Get the process model
 	GCodeResult SetModel(unsigned int heater, const CanMessageHeaterModelNewNew& msg, const StringRef& reply) noexcept;
 
+	uint32_t GetSampleInterval() const noexcept { return sampleIntervalMillis; }	// Get how often we spin this heater in milliseconds
+	GCodeResult SetSampleInterval(uint32_t interval, const StringRef& reply) noexcept;
+
 	bool IsHeaterEnabled() const								// Is this heater enabled?
 		{ return model.IsEnabled(); }
 
 	bool IsTuning() const { return GetMode() >= HeaterMode::firstTuningMode; }
+	bool IsOn() const															// Is this heater being controlled or tuned, as opposed to off, suspended or faulted?
+		{ const HeaterMode m = GetMode(); return m == HeaterMode::heating || m == HeaterMode::cooling || m == HeaterMode::stable || m >= HeaterMode::firstTuningMode; }
 	uint8_t GetModeByte() const { return (uint8_t)GetMode(); }
 
 protected:
@@ -70,6 +81,8 @@ protected:
 	virtual HeaterMode GetMode() const noexcept = 0;
 	virtual GCodeResult SwitchOn(const StringRef& reply) noexcept = 0;
 	virtual GCodeResult UpdateModel(const StringRef& reply) noexcept = 0;
+	virtual void SampleIntervalChanged() noexcept = 0;			// Called when the sample interval has been changed
+	virtual void MonitorsChanged() noexcept = 0;				// Called when the heater monitors have been changed
 
 	int GetSensorNumber() const noexcept { return sensorNumber; }
 	void SetSensorNumber(int sn) noexcept { sensorNumber = sn; }
@@ -88,6 +101,7 @@ private:
 	float requestedTemperature;						// the required temperature
 	float maxTempExcursion;							// the maximum temperature excursion permitted while maintaining the setpoint
 	float maxHeatingFaultTime;						// how long a heater fault is permitted to persist before a heater fault is raised
+	uint32_t sampleIntervalMillis;					// how often the Heat task spins this heater
 	bool isBedOrChamber;							// true if this was a bed or chamber heater when it was switched on
 };
 
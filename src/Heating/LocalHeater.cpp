@@ -16,6 +16,12 @@
 // Private constants
 const uint32_t InitialTuningReadingInterval = 250;	// the initial reading interval in milliseconds
 const uint32_t TempSettleTimeout = 20000;	// how long we allow the initial temperature to settle
+const uint32_t MaxMpcHorizon = 60000;		// the maximum model predictive control horizon in milliseconds
+const size_t NumConvergenceCycles = 3;		// how many consecutive tuning cycles must agree before we consider the tuning to have converged
+const float FastHeatDeadTimes = 3.0;		// when heating up at full power for tuning, stop this many dead times of full power heating below the tuning temperature
+const float ModelResidualToleranceFactor = 0.3;	// how far the rate of temperature change may be outside the model range, as a fraction of the heating rate
+const float MinModelResidualTolerance = 0.2;	// the minimum tolerance in degC/sec, for heaters with very low heating rates
+const float ModelResidualLeakTime = 30.0;	// the time constant in seconds over which the model residual leaks away
 
 // Variables used during heater tuning
 static float tuningPwm;									// the PWM to use, 0..1
@@ -40,11 +46,22 @@ static float tuningVoltage;								// the VIN voltage with the heater on
 static uint16_t cyclesDone;
 static bool tuningCycleComplete;
 
+// Variables used to stop tuning early once the cycles agree
+static unsigned int minConvergenceCycles = 0;			// the minimum number of cycles before we stop tuning early, or 0 to leave it to the main board
+static float convergenceTolerance = 0.05;				// the fraction by which each parameter may differ from its mean over the last few cycles
+static float cycleHeatingRates[NumConvergenceCycles];
+static float cycleCoolingRates[NumConvergenceCycles];
+static uint32_t cycleDeadTimes[NumConvergenceCycles];	// dHigh + dLow, which is twice the apparent dead time
+static bool tuningConverged;
+static float fastHeatLimit;								// below this temperature we heat up at full power when tuning
+
 // Member functions and constructors
 
-LocalHeater::LocalHeater(unsigned int heaterNum) : Heater(heaterNum), mode(HeaterMode::off)
+LocalHeater::LocalHeater(unsigned int heaterNum)
+	: Heater(heaterNum), mpcHorizon(0.0), mode(HeaterMode::off), fastCutoffTripped(false), fastCutoffPending(false), fastCutoffSensorNumber(-1), fastCutoffLimit(0.0)
 {
 	LocalHeater::ResetHeater();
+	CalcSampleCoefficients();
 	SetHeater(0.0);							// set up the pin even if the heater is not enabled (for PCCB)
 
 	// Time the sensor was last sampled.  During startup, we use the current
@@ -55,6 +72,15 @@ LocalHeater::LocalHeater(unsigned int heaterNum) : Heater(heaterNum), mode(Heate
 LocalHeater::~LocalHeater()
 {
 	LocalHeater::SwitchOff();
+	if (fastCutoffSensorNumber >= 0)
+	{
+		// Make sure that the ADC task can't call us after we have gone
+		const auto sensor = Heat::FindSensor(fastCutoffSensorNumber);
+		if (sensor.IsNotNull())
+		{
+			(void)sensor->SetFastCutoff(0.0, nullptr, CallbackParameter(nullptr));
+		}
+	}
 	for (auto& port : ports)
 	{
 		port.Release();
@@ -73,12 +99,78 @@ float LocalHeater::GetAccumulator() const
 
 void LocalHeater::SetHeater(float power) const
 {
+	if (fastCutoffTripped)
+	{
+		power = 0.0;								// the ADC task has seen the temperature exceed the cutoff, so keep the heater off until the fault is reset
+	}
+	power = Heat::LimitHeaterPwm(GetHeaterNumber(), power);
 	for (auto& port : ports)
 	{
 		port.WriteAnalog(power);
 	}
 }
 
+// Called from the ADC task when our sensor exceeds the fast cutoff temperature. Turn the heater off at once and let Spin raise the fault.
+/*static*/ void LocalHeater::FastCutoffCallback(CallbackParameter cp) noexcept
+{
+	LocalHeater * const h = static_cast<LocalHeater*>(cp.vp);
+	h->fastCutoffTripped = true;
+	h->SetHeater(0.0);
+}
+
+// Set up the fast over-temperature cutoff in our sensor if it can do it and a monitor on that sensor raises a fault or switches the heater off permanently
+// when the temperature is exceeded. The cutoff is at the lowest such limit. The ADC task then switches the heater off without waiting for the Heat task.
+void LocalHeater::UpdateFastCutoff() noexcept
+{
+	fastCutoffPending = false;
+	bool wanted = false;
+	float limit = 0.0;
+	for (const HeaterMonitor& m : monitors)
+	{
+		if (   m.GetTrigger() == HeaterMonitorTrigger::TemperatureExceeded
+			&& m.GetAction() != HeaterMonitorAction::TemporarySwitchOff
+			&& m.GetSensorNumber() == GetSensorNumber()
+			&& (!wanted || m.GetTemperatureLimit() < limit)
+		   )
+		{
+			limit = m.GetTemperatureLimit();
+			wanted = true;
+		}
+	}
+
+	if (fastCutoffSensorNumber >= 0 && (fastCutoffSensorNumber != GetSensorNumber() || !wanted))
+	{
+		const auto oldSensor = Heat::FindSensor(fastCutoffSensorNumber);
+		if (oldSensor.IsNotNull())
+		{
+			(void)oldSensor->SetFastCutoff(0.0, nullptr, CallbackParameter(nullptr));
+		}
+		fastCutoffSensorNumber = -1;
+	}
+
+	if (wanted)
+	{
+		const auto sensor = Heat::FindSensor(GetSensorNumber());
+		if (sensor.IsNotNull())
+		{
+			switch (sensor->SetFastCutoff(limit, FastCutoffCallback, CallbackParameter(this)))
+			{
+			case FastCutoffResult::done:
+				fastCutoffSensorNumber = GetSensorNumber();
+				fastCutoffLimit = limit;
+				break;
+
+			case FastCutoffResult::notReady:
+				fastCutoffPending = true;				// try again on the next sample
+				break;
+
+			case FastCutoffResult::notSupported:
+				break;
+			}
+		}
+	}
+}
+
 void LocalHeater::ResetHeater()
 {
 	mode = HeaterMode::off;
@@ -89,6 +181,8 @@ void LocalHeater::ResetHeater()
 	averagePWM = lastPwm = 0.0;
 	heatingFaultCount = 0;
 	temperature = BadErrorTemperature;
+	mpcModelValid = false;
+	delayedPwm = modelResidual = 0.0;
 }
 
 // Configure the heater port and the sensor number
@@ -122,6 +216,7 @@ GCodeResult LocalHeater::ConfigurePortAndSensor(const char *portName, PwmFrequen
 		port.SetFrequency(freq);
 	}
 	SetSensorNumber(sn);
+	fastCutoffPending = true;
 	if (Heat::FindSensor(sn).IsNull())
 	{
 		reply.printf("Sensor number %u has not been defined", sn);
@@ -208,6 +303,7 @@ GCodeResult LocalHeater::SwitchOn(const StringRef& reply) noexcept
 			lastTemperatureMillis = timeSetHeating = millis();
 		}
 		heatingFaultCount = 0;
+		modelResidual = 0.0;
 		mode = newMode;
 	}
 	return GCodeResult::ok;
@@ -230,12 +326,51 @@ void LocalHeater::SwitchOff()
 // This is called when the heater model has been updated. Returns true if successful.
 GCodeResult LocalHeater::UpdateModel(const StringRef& reply)
 {
+	CalcSampleCoefficients();
 	return GCodeResult::ok;
 }
 
+// This is called when the sample interval has been changed
+void LocalHeater::SampleIntervalChanged() noexcept
+{
+	previousTemperaturesGood = 0;					// the previous temperatures were taken at the old interval
+	CalcSampleCoefficients();
+}
+
+// Calculate the constants that Spin uses. Processors without an FPU take much longer to divide floats than to multiply them,
+// and the model and PID parameters only change occasionally, so we calculate the quotients here instead of on every sample.
+void LocalHeater::CalcSampleCoefficients() noexcept
+{
+	const FopDt& model = GetModel();
+	sampleSeconds = GetSampleInterval() * MillisToSeconds;
+	derivativeFactor = 1.0/(sampleSeconds * NumPreviousTemperatures);
+	pwmAverageFactor = sampleSeconds * (1.0/HeatPwmAverageTime);
+	mpcGain = (mpcHorizon > 0.0) ? 1.0/(model.GetHeatingRate() * mpcHorizon) : 0.0;
+	mpcLagFactor = min<float>(sampleSeconds/model.GetDeadTime(), 1.0);
+	modelResidualRetainFactor = 1.0 - sampleSeconds * (1.0/ModelResidualLeakTime);
+}
+
 // This is the main heater control loop function
 void LocalHeater::Spin()
 {
+	// Deal with the fast over-temperature cutoff first
+	if (fastCutoffTripped)
+	{
+		if (mode > HeaterMode::suspended)
+		{
+			RaiseHeaterFault(HeaterFaultType::monitorTriggered, "fast cutoff at %.1f" DEGREE_SYMBOL "C", (double)fastCutoffLimit);
+		}
+		else if (mode != HeaterMode::fault)
+		{
+			fastCutoffTripped = false;					// the heater was off anyway, so just set up the cutoff again
+			fastCutoffPending = true;
+		}
+	}
+	if (fastCutoffPending)
+	{
+		UpdateFastCutoff();
+	}
+
 	// Read the temperature even if the heater is suspended or the model is not enabled
 	const TemperatureError err = ReadTemperature();
 
@@ -262,8 +397,7 @@ void LocalHeater::Spin()
 		badTemperatureCount = 0;
 		if ((previousTemperaturesGood & (1u << (NumPreviousTemperatures - 1))) != 0)
 		{
-			const float tentativeDerivative = ((float)SecondsToMillis/HeatSampleIntervalMillis) * (temperature - previousTemperatures[previousTemperatureIndex])
-							/ (float)(NumPreviousTemperatures);
+			const float tentativeDerivative = derivativeFactor * (temperature - previousTemperatures[previousTemperatureIndex]);
 			// Some sensors give occasional temperature spikes. We don't expect the temperature to increase by more than 10C/second.
 			if (fabsf(tentativeDerivative) <= 10.0)
 			{
@@ -275,7 +409,8 @@ void LocalHeater::Spin()
 		previousTemperaturesGood = (previousTemperaturesGood << 1) | 1u;
 		previousTemperatureIndex = (previousTemperatureIndex + 1) % NumPreviousTemperatures;
 
-		if (GetModel().IsEnabled())
+		const FopDt& model = GetModel();
+		if (model.IsEnabled())
 		{
 			// Get the target temperature and the error
 			const float targetTemperature = GetTargetTemperature();
@@ -293,7 +428,7 @@ void LocalHeater::Spin()
 				else
 				{
 					const uint32_t now = millis();
-					if ((float)(now - timeSetHeating) < GetModel().GetDeadTime() * SecondsToMillis * 2)		// wait for twice the dead time before we start looking at the temperature rise
+					if ((float)(now - timeSetHeating) < model.GetDeadTime() * SecondsToMillis * 2)		// wait for twice the dead time before we start looking at the temperature rise
 					{
 						// Record the temperature for when we are past the dead time
 						lastTemperatureValue = temperature;
@@ -302,9 +437,8 @@ void LocalHeater::Spin()
 					else if (gotDerivative)												// this is a check in case we just had a temperature spike
 					{
 						const float expectedRate = GetExpectedHeatingRate();
-						const float minSamplingInterval = 3.0/expectedRate;				// check the temperature if we expect a 3C rise since last time
 						const float actualInterval = (float)(now - lastTemperatureMillis) * MillisToSeconds;
-						if (actualInterval >= minSamplingInterval)
+						if (expectedRate < 0.0 || actualInterval * expectedRate >= 3.0)	// check the temperature if we expect a 3C rise since last time
 						{
 							// Check that we are heating fast enough, and if so, take another sample
 							const float expectedTemperatureRise = expectedRate * actualInterval;
@@ -313,7 +447,7 @@ void LocalHeater::Spin()
 							if (actualTemperatureRise < expectedTemperatureRise * ((IsBedOrChamber()) ? MinBedTemperatureRiseFactor : MinToolTemperatureRiseFactor))
 							{
 								++heatingFaultCount;
-								if (heatingFaultCount * HeatSampleIntervalMillis > GetMaxHeatingFaultTime() * SecondsToMillis)
+								if (heatingFaultCount * GetSampleInterval() > GetMaxHeatingFaultTime() * SecondsToMillis)
 								{
 									RaiseHeaterFault(HeaterFaultType::temperatureRisingTooSlowly,
 														"expected %.2f" DEGREE_SYMBOL "C/sec measured %.2f" DEGREE_SYMBOL "C/sec",
@@ -338,7 +472,7 @@ void LocalHeater::Spin()
 				if (fabsf(error) > GetMaxTemperatureExcursion() && temperature > MaxAmbientTemperature)
 				{
 					++heatingFaultCount;
-					if (heatingFaultCount * HeatSampleIntervalMillis > GetMaxHeatingFaultTime() * SecondsToMillis)
+					if (heatingFaultCount * GetSampleInterval() > GetMaxHeatingFaultTime() * SecondsToMillis)
 					{
 						RaiseHeaterFault(HeaterFaultType::exceededAllowedExcursion,
 											"target %.1f" DEGREE_SYMBOL "C actual %.1f" DEGREE_SYMBOL "C",
@@ -369,27 +503,45 @@ void LocalHeater::Spin()
 				break;
 			}
 
+			// Check that the temperature is changing at a rate that the model can explain. This catches heater runaway and detached sensors
+			// sooner than the checks above, because it doesn't need to wait for the heater to reach the target temperature or for the dead time.
+			if (gotDerivative && (mode == HeaterMode::heating || mode == HeaterMode::stable) && !model.IsInverted())
+			{
+				CheckModelResidual(derivative);
+			}
+
 			// Calculate the PWM
 			if (mode <= HeaterMode::suspended)
 			{
 				lastPwm = 0.0;
+				mpcModelValid = false;
 			}
 			else if (mode < HeaterMode::firstTuningMode)
 			{
 				// Performing normal temperature control
-				if (GetModel().UsePid())
+				if (mpcHorizon > 0.0 && !model.IsInverted())
+				{
+					lastPwm = CalcMpcPwm(error);
+#if HAS_VOLTAGE_MONITOR
+					if (!Heat::IsBedOrChamberHeater(GetHeaterNumber()))
+					{
+						lastPwm = model.CorrectPwmForVoltage(lastPwm, Platform::GetCurrentVinVoltage());
+					}
+#endif
+				}
+				else if (model.UsePid())
 				{
 					// Using PID mode. Determine the PID parameters to use.
 					const bool inLoadMode = (mode == HeaterMode::stable) || (fabsf(error) < 3.0);		// use standard PID when maintaining temperature
-					const PidParameters& params = GetModel().GetPidParameters(inLoadMode);
+					const PidParameters& params = model.GetPidParameters(inLoadMode);
 
 					// If the P and D terms together demand that the heater is full on or full off, disregard the I term to reduce integral windup
 					const float errorMinusDterm = error - (params.tD * derivative);
 					const float pPlusD = params.kP * errorMinusDterm;
-					const float expectedPwm = GetModel().EstimateRequiredPwm(temperature - NormalAmbientTemperature, 0.0);
-					if (pPlusD + expectedPwm > GetModel().GetMaxPwm())
+					const float expectedPwm = model.EstimateRequiredPwm(temperature - NormalAmbientTemperature, 0.0);
+					if (pPlusD + expectedPwm > model.GetMaxPwm())
 					{
-						lastPwm = GetModel().GetMaxPwm();
+						lastPwm = model.GetMaxPwm();
 						// If we are heating up, preset the I term to the expected PWM at this temperature, ready for the switch over to PID
 						if (mode == HeaterMode::heating && error > 0.0 && derivative > 0.0)
 						{
@@ -402,30 +554,33 @@ void LocalHeater::Spin()
 					}
 					else
 					{
-						iAccumulator = constrain<float>
-										(iAccumulator + (error * params.kP * params.recipTi * HeatSampleIntervalMillis * MillisToSeconds),
-											0.0, GetModel().GetMaxPwm());
-						lastPwm = constrain<float>(pPlusD + iAccumulator, 0.0, GetModel().GetMaxPwm());
+						iAccumulator = constrain<float>(iAccumulator + error * params.kPrecipTi * sampleSeconds, 0.0, model.GetMaxPwm());
+						lastPwm = constrain<float>(pPlusD + iAccumulator, 0.0, model.GetMaxPwm());
 					}
 
 #if HAS_VOLTAGE_MONITOR
 					// Scale the PID based on the current voltage vs. the calibration voltage
 					if (!Heat::IsBedOrChamberHeater(GetHeaterNumber()))
 					{
-						lastPwm = GetModel().CorrectPwmForVoltage(lastPwm, Platform::GetCurrentVinVoltage());
+						lastPwm = model.CorrectPwmForVoltage(lastPwm, Platform::GetCurrentVinVoltage());
 					}
 #endif
 				}
 				else
 				{
 					// Using bang-bang mode
-					lastPwm = (error > 0.0) ? GetModel().GetMaxPwm() : 0.0;
+					lastPwm = (error > 0.0) ? model.GetMaxPwm() : 0.0;
 				}
 
 				// Check if the generated PWM signal needs to be inverted for inverse temperature control
-				if (GetModel().IsInverted())
+				if (model.IsInverted())
 				{
-					lastPwm = GetModel().GetMaxPwm() - lastPwm;
+					lastPwm = model.GetMaxPwm() - lastPwm;
+				}
+				else
+				{
+					// If this heater is in a zone group then allow for the heat it gets from the other zones and share the power out with them
+					lastPwm = min<float>(Heat::CoordinateZonePwm(GetHeaterNumber(), temperature, error, lastPwm, model.GetHeatingRate()), model.GetMaxPwm());
 				}
 
 				// Verify that everything is operating in the required temperature range
@@ -464,8 +619,8 @@ void LocalHeater::Spin()
 
 		// Set the heater power and update the average PWM
 		SetHeater(lastPwm);
-		constexpr float avgFactor = HeatSampleIntervalMillis/(HeatPwmAverageTime * SecondsToMillis);
-		averagePWM = (averagePWM * (1.0 - avgFactor)) + (lastPwm * avgFactor);
+		averagePWM += (lastPwm - averagePWM) * pwmAverageFactor;
+		delayedPwm += (lastPwm - delayedPwm) * mpcLagFactor;
 
 		// For temperature sensors which do not require frequent sampling and averaging,
 		// their temperature is read here and error/safety handling performed.  However,
@@ -487,6 +642,11 @@ void LocalHeater::ResetFault()
 		mode = HeaterMode::off;
 		SwitchOff();
 	}
+	if (fastCutoffTripped)
+	{
+		fastCutoffTripped = false;
+		fastCutoffPending = true;						// the ADC task only calls the cutoff function once, so set it up again
+	}
 }
 
 float LocalHeater::GetAveragePWM() const
@@ -519,8 +679,20 @@ GCodeResult LocalHeater::TuningCommand(const CanMessageHeaterTuningCommand& msg,
 		tuningPwm = msg.pwm;
 		tuningPeakTempDrop = msg.peakTempDrop;
 		timeSetHeating = millis();
-		tuningCycleComplete = false;
+		tuningCycleComplete = tuningConverged = false;
 		cyclesDone = 0;
+
+		// If we already have a model for this heater then we can heat up at full power until we get close to the tuning temperature.
+		// The cycles themselves must all be done at the requested PWM, otherwise the results would be wrong.
+		fastHeatLimit = -BadErrorTemperature;
+		if (GetModel().IsEnabled() && tuningPwm < GetModel().GetMaxPwm())
+		{
+			const float fullPowerRate = GetModel().GetNetHeatingRate(tuningHighTemp - NormalAmbientTemperature, 0.0, GetModel().GetMaxPwm());
+			if (fullPowerRate > 0.0)
+			{
+				fastHeatLimit = tuningHighTemp - fullPowerRate * GetModel().GetDeadTime() * FastHeatDeadTimes;
+			}
+		}
 		mode = HeaterMode::tuning1;
 	}
 	else
@@ -530,6 +702,28 @@ GCodeResult LocalHeater::TuningCommand(const CanMessageHeaterTuningCommand& msg,
 	return GCodeResult::ok;
 }
 
+// Compare the measured rate of temperature change with the range that the model predicts for the PWM we applied a dead time ago.
+// We don't know the fan PWM, so the range runs from the rate with the fan off to the rate with the fan at full speed.
+// Any rate outside that range by more than the tolerance adds to the model residual, which leaks away slowly so that only a persistent mismatch raises a fault.
+void LocalHeater::CheckModelResidual(float derivative) noexcept
+{
+	const FopDt& model = GetModel();
+	const float temperatureRise = temperature - NormalAmbientTemperature;
+	const float tolerance = max<float>(model.GetHeatingRate() * ModelResidualToleranceFactor, MinModelResidualTolerance);
+	const float maxRate = model.GetNetHeatingRate(temperatureRise, 0.0, delayedPwm) + tolerance;
+	const float minRate = model.GetNetHeatingRate(temperatureRise, 1.0, delayedPwm) - tolerance;
+	const float excess = (derivative > maxRate) ? derivative - maxRate
+							: (derivative < minRate) ? derivative - minRate
+								: 0.0;
+	modelResidual = modelResidual * modelResidualRetainFactor + excess * sampleSeconds;
+	if (fabsf(modelResidual) > GetMaxTemperatureExcursion())
+	{
+		RaiseHeaterFault((modelResidual > 0.0) ? HeaterFaultType::exceededAllowedExcursion : HeaterFaultType::temperatureRisingTooSlowly,
+							"model expected %.2f to %.2f" DEGREE_SYMBOL "C/sec measured %.2f" DEGREE_SYMBOL "C/sec",
+								(double)(minRate + tolerance), (double)(maxRate - tolerance), (double)derivative);
+	}
+}
+
 // Adjust heater power for fan PWM or extrusion change
 GCodeResult LocalHeater::FeedForwardAdjustment(float fanPwmChange, float extrusionChange) noexcept
 {
@@ -542,6 +736,118 @@ GCodeResult LocalHeater::FeedForwardAdjustment(float fanPwmChange, float extrusi
 	return GCodeResult::ok;
 }
 
+// Calculate the PWM using model predictive control. The model predicts the temperature that the measured one will reach once the dead time has passed,
+// which is a Smith predictor with the dead time approximated by a first order lag so that we need no PWM history. We choose the PWM that the model
+// says will take that temperature to the target over the horizon if held constant, plus a slow integral term to correct for errors in the model.
+float LocalHeater::CalcMpcPwm(float error) noexcept
+{
+	const FopDt& model = GetModel();
+	if (!mpcModelValid)
+	{
+		mpcModelTemperature = mpcDelayedModelTemperature = temperature;
+		iAccumulator = 0.0;
+		mpcModelValid = true;
+	}
+	else
+	{
+		// Advance the model using the PWM we applied since the last sample, then let the delayed temperature follow it
+		mpcModelTemperature += model.GetNetHeatingRate(mpcModelTemperature - NormalAmbientTemperature, 0.0, lastPwm) * sampleSeconds;
+		mpcDelayedModelTemperature += (mpcModelTemperature - mpcDelayedModelTemperature) * mpcLagFactor;
+
+		// Pull both model temperatures towards the measured temperature without changing the predicted effect of the PWM already applied
+		const float drift = (temperature - mpcDelayedModelTemperature) * mpcLagFactor;
+		mpcModelTemperature += drift;
+		mpcDelayedModelTemperature += drift;
+	}
+
+	const float predictedTemperature = temperature + mpcModelTemperature - mpcDelayedModelTemperature;
+	const float pwm = (error + temperature - predictedTemperature) * mpcGain
+						+ model.EstimateRequiredPwm(predictedTemperature - NormalAmbientTemperature, 0.0)
+						+ iAccumulator;
+	if (pwm >= model.GetMaxPwm())
+	{
+		return model.GetMaxPwm();
+	}
+	if (pwm <= 0.0)
+	{
+		return 0.0;
+	}
+
+	// Only integrate when the output isn't saturated, to avoid windup. Use the same integral time as the PID controller.
+	const PidParameters& params = model.GetPidParameters(true);
+	iAccumulator = constrain<float>(iAccumulator + error * params.kPrecipTi * sampleSeconds, -model.GetMaxPwm(), model.GetMaxPwm());
+	return pwm;
+}
+
+// Select model predictive control with the specified horizon, or PID if it is zero
+GCodeResult LocalHeater::SetMpcHorizon(uint32_t horizonMillis, const StringRef& reply) noexcept
+{
+	if (horizonMillis != 0 && (horizonMillis < GetSampleInterval() || horizonMillis > MaxMpcHorizon))
+	{
+		reply.printf("MPC horizon must be between %" PRIu32 "ms and %" PRIu32 "ms", GetSampleInterval(), MaxMpcHorizon);
+		return GCodeResult::error;
+	}
+
+	{
+		// The integral term means different things to PID and MPC, so start again with it
+		TaskCriticalSectionLocker lock;
+		mpcHorizon = horizonMillis * MillisToSeconds;
+		mpcModelValid = false;
+		iAccumulator = 0.0;
+		CalcSampleCoefficients();
+	}
+
+	if (mpcHorizon > 0.0)
+	{
+		reply.printf("Heater %u using model predictive control with horizon %.2fs", GetHeaterNumber(), (double)mpcHorizon);
+		if (GetModel().IsInverted())
+		{
+			reply.cat(", but the heater is inverted so it will use PID");
+		}
+	}
+	else
+	{
+		reply.printf("Heater %u using %s control", GetHeaterNumber(), (GetModel().UsePid()) ? "PID" : "bang-bang");
+	}
+	return GCodeResult::ok;
+}
+
+// Record the results of a tuning cycle and see whether the last few cycles agree closely enough for further cycles to be pointless
+static void RecordTuningCycle() noexcept
+{
+	const size_t slot = cyclesDone % NumConvergenceCycles;
+	cycleHeatingRates[slot] = heatingRate;
+	cycleCoolingRates[slot] = coolingRate;
+	cycleDeadTimes[slot] = dHigh + dLow;
+	if (minConvergenceCycles == 0 || cyclesDone + 1u < max<unsigned int>(minConvergenceCycles, NumConvergenceCycles))
+	{
+		return;
+	}
+
+	float heatingMean = 0.0, coolingMean = 0.0, deadTimeMean = 0.0;
+	for (size_t i = 0; i < NumConvergenceCycles; ++i)
+	{
+		heatingMean += cycleHeatingRates[i];
+		coolingMean += cycleCoolingRates[i];
+		deadTimeMean += (float)cycleDeadTimes[i];
+	}
+	heatingMean *= 1.0/NumConvergenceCycles;
+	coolingMean *= 1.0/NumConvergenceCycles;
+	deadTimeMean *= 1.0/NumConvergenceCycles;
+
+	for (size_t i = 0; i < NumConvergenceCycles; ++i)
+	{
+		if (   fabsf(cycleHeatingRates[i] - heatingMean) > heatingMean * convergenceTolerance
+			|| fabsf(cycleCoolingRates[i] - coolingMean) > coolingMean * convergenceTolerance
+			|| fabsf((float)cycleDeadTimes[i] - deadTimeMean) > deadTimeMean * convergenceTolerance
+		   )
+		{
+			return;
+		}
+	}
+	tuningConverged = true;
+}
+
 // This is called on each temperature sample when auto tuning
 // It must set lastPWM to the required PWM, unless it is the same as last time.
 void LocalHeater::DoTuningStep()
@@ -561,11 +867,15 @@ void LocalHeater::DoTuningStep()
 		}
 		else
 		{
-			lastPwm = tuningPwm;
+			lastPwm = (temperature < fastHeatLimit) ? GetModel().GetMaxPwm() : tuningPwm;
 		}
 		return;
 
 	case HeaterMode::tuning2:		// Heater is off, record the peak temperature and time
+		if (tuningConverged && !tuningCycleComplete)
+		{
+			break;													// we have sent the report of the last cycle we need, so finish
+		}
 		if (temperature >= peakTemp)
 		{
 			peakTemp = afterPeakTemp = temperature;
@@ -614,6 +924,7 @@ void LocalHeater::DoTuningStep()
 			peakTemp = afterPeakTemp = temperature;
 			lastPwm = 0.0;										// turn heater off
 			mode = HeaterMode::tuning2;
+			RecordTuningCycle();
 			++cyclesDone;
 			tuningCycleComplete = true;
 		}
@@ -652,6 +963,27 @@ void LocalHeater::Suspend(bool sus)
 	}
 }
 
+// Set when tuning stops early because the cycles agree. minCycles is the minimum number of cycles, or 0 to run as many cycles as the main board asks for.
+// The tolerance is in tenths of a percent.
+/*static*/ GCodeResult LocalHeater::ConfigureTuningConvergence(unsigned int minCycles, uint32_t tolerance, const StringRef& reply) noexcept
+{
+	if (tolerance != 0)
+	{
+		convergenceTolerance = (float)tolerance * 0.001;
+	}
+	minConvergenceCycles = minCycles;
+	if (minConvergenceCycles == 0)
+	{
+		reply.copy("Heater tuning runs until the main board stops it");
+	}
+	else
+	{
+		reply.printf("Heater tuning stops after at least %u cycles when the last %u agree within %.1f%%",
+						max<unsigned int>(minConvergenceCycles, NumConvergenceCycles), (unsigned int)NumConvergenceCycles, (double)(convergenceTolerance * 100.0));
+	}
+	return GCodeResult::ok;
+}
+
 // Get a heater tuning cycle report, if we have one. Caller must fill in the heater number.
 /*static*/ bool LocalHeater::GetTuningCycleData(CanMessageHeaterTuningReport& msg)
 {
@@ -40,20 +40,31 @@ public:
 	void Suspend(bool sus) override;				// Suspend the heater to conserve power or while doing Z probing
 	GCodeResult TuningCommand(const CanMessageHeaterTuningCommand& msg, const StringRef& reply) override;
 	GCodeResult FeedForwardAdjustment(float fanPwmChange, float extrusionChange) noexcept override;
+	GCodeResult SetMpcHorizon(uint32_t horizonMillis, const StringRef& reply) noexcept override;
+	void SensorChanged(unsigned int sn) noexcept override { if ((int)sn == GetSensorNumber()) { fastCutoffPending = true; } }	// a new sensor doesn't have our fast cutoff set up
 
 	static bool GetTuningCycleData(CanMessageHeaterTuningReport& msg);	// get a heater tuning cycle report, if we have one
+	static GCodeResult ConfigureTuningConvergence(unsigned int minCycles, uint32_t tolerance, const StringRef& reply) noexcept;	// set when to stop tuning early
 
 protected:
 	void ResetHeater() noexcept override;
 	HeaterMode GetMode() const noexcept override { return mode; }
 	GCodeResult SwitchOn(const StringRef& reply) noexcept override;		// Turn the heater on and set the mode
 	GCodeResult UpdateModel(const StringRef& reply) noexcept override;	// Called when the heater model has been changed
+	void SampleIntervalChanged() noexcept override;
+	void MonitorsChanged() noexcept override { fastCutoffPending = true; }
 
 private:
 	void SetHeater(float power) const;				// Power is a fraction in [0,1]
 	TemperatureError ReadTemperature();				// Read and store the temperature of this heater
 	void DoTuningStep();							// Called on each temperature sample when auto tuning
 	float GetExpectedHeatingRate() const;			// Get the minimum heating rate we expect
+	float CalcMpcPwm(float error) noexcept;			// Calculate the PWM using model predictive control
+	void CalcSampleCoefficients() noexcept;			// Calculate the constants that Spin uses, so that it needs no divisions
+	void UpdateFastCutoff() noexcept;				// Set up or cancel the fast over-temperature cutoff in our sensor
+	void CheckModelResidual(float derivative) noexcept;	// Check the measured rate of temperature change against the model
+
+	static void FastCutoffCallback(CallbackParameter cp) noexcept;	// Called from the ADC task when the fast cutoff temperature is exceeded
 	void RaiseHeaterFault(HeaterFaultType type, const char *format, ...) noexcept;
 
 	PwmPort ports[MaxPortsPerHeater];				// The port(s) that drive the heater
@@ -63,6 +74,19 @@ private:
 	float iAccumulator;								// The integral LocalHeater component
 	float lastPwm;									// The last PWM value we output, before scaling by kS
 	float averagePWM;								// The running average of the PWM, after scaling.
+	float mpcHorizon;								// The model predictive control horizon in seconds, or 0 to use PID
+
+	// Constants calculated by CalcSampleCoefficients when the sample interval or model changes
+	float sampleSeconds;							// The sample interval in seconds
+	float derivativeFactor;							// Converts the temperature change over NumPreviousTemperatures samples to degC/sec
+	float pwmAverageFactor;							// The weight of each new sample in averagePWM
+	float mpcGain;									// The MPC PWM per degC of predicted error
+	float mpcLagFactor;								// The fraction of the difference the delayed MPC model temperature follows in each sample
+	float mpcModelTemperature;						// The temperature the model predicts once the dead time has passed
+	float mpcDelayedModelTemperature;				// The model temperature delayed by the dead time
+	float modelResidualRetainFactor;				// How much of the model residual is left after each sample
+	float delayedPwm;								// The PWM we applied delayed by the dead time, approximated by a first order lag
+	float modelResidual;							// The temperature change in degC that the model can't explain, leaking away over time
 	float lastTemperatureValue;								// the last temperature we recorded while heating up
 	uint32_t lastTemperatureMillis;							// when we recorded the last temperature
 	uint32_t timeSetHeating;						// When we turned on the heater
@@ -73,6 +97,11 @@ private:
 	uint8_t previousTemperaturesGood;				// Bitmap indicating which previous temperature were good readings
 	HeaterMode mode;								// Current state of the heater
 	uint8_t badTemperatureCount;					// Count of sequential dud readings
+	bool mpcModelValid;								// True if the MPC model temperatures have been initialised
+	volatile bool fastCutoffTripped;				// Set by the ADC task when our sensor exceeds the fast cutoff temperature
+	bool fastCutoffPending;							// True if we need to set up the fast cutoff again
+	int8_t fastCutoffSensorNumber;					// The sensor that has our fast cutoff set up, or -1 if none
+	float fastCutoffLimit;							// The fast cutoff temperature
 
 	static_assert(sizeof(previousTemperaturesGood) * 8 >= NumPreviousTemperatures, "too few bits in previousTemperaturesGood");
 };
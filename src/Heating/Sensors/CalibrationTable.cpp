@@ -0,0 +1,107 @@
+/*
+ * CalibrationTable.cpp
+ */
+
+#include "CalibrationTable.h"
+#include <RTOSIface/RTOSIface.h>
+
+void CalibrationTable::Compile(float fullScaleReading) noexcept
+{
+	const float readingPerPpm = fullScaleReading/(float)FullScalePpm;
+	for (size_t i = 0; i < numPoints; ++i)
+	{
+		breakpoints[i] = (float)inputs[i] * readingPerPpm;
+	}
+	for (size_t i = 0; i + 1 < numPoints; ++i)
+	{
+		slopes[i] = (temperatures[i + 1] - temperatures[i])/(breakpoints[i + 1] - breakpoints[i]);
+		intercepts[i] = temperatures[i] - slopes[i] * breakpoints[i];
+	}
+}
+
+float CalibrationTable::Convert(float reading) const noexcept
+{
+	size_t segment = 0;
+	while (segment + 2 < numPoints && reading > breakpoints[segment + 1])
+	{
+		++segment;
+	}
+	return slopes[segment] * reading + intercepts[segment];
+}
+
+void CalibrationTable::AppendPoints(const StringRef& reply) const noexcept
+{
+	for (size_t i = 0; i < numPoints; ++i)
+	{
+		reply.catf(" %.2f%%:%.1fC", (double)((float)inputs[i] * (100.0/FullScalePpm)), (double)temperatures[i]);
+	}
+}
+
+bool CalibrationTable::AddPoint(uint32_t inputPpm, float temperature) noexcept
+{
+	size_t i = 0;
+	while (i < numPoints && inputs[i] < inputPpm)
+	{
+		++i;
+	}
+	if (i == numPoints || inputs[i] != inputPpm)
+	{
+		if (numPoints == MaxPoints)
+		{
+			return false;
+		}
+		for (size_t j = numPoints; j > i; --j)
+		{
+			inputs[j] = inputs[j - 1];
+			temperatures[j] = temperatures[j - 1];
+		}
+		++numPoints;
+		inputs[i] = inputPpm;
+	}
+	temperatures[i] = temperature;
+	return true;
+}
+
+/*static*/ GCodeResult CalibrationTable::SetPoint(CalibrationTable *& table, float fullScaleReading, unsigned int sensorNum, uint32_t inputPpm, int32_t milliDegrees, const StringRef& reply) noexcept
+{
+	CalibrationTable *newTable = nullptr;
+	if (inputPpm != ClearTable)
+	{
+		if (inputPpm > FullScalePpm)
+		{
+			reply.printf("Calibration input must not exceed %" PRIu32 " ppm of full scale", FullScalePpm);
+			return GCodeResult::error;
+		}
+		newTable = (table == nullptr) ? new CalibrationTable : new CalibrationTable(*table);
+		if (!newTable->AddPoint(inputPpm, (float)milliDegrees * 0.001))
+		{
+			delete newTable;
+			reply.printf("Sensor %u calibration table is full", sensorNum);
+			return GCodeResult::error;
+		}
+		newTable->Compile(fullScaleReading);
+	}
+
+	{
+		TaskCriticalSectionLocker lock;
+		std::swap(table, newTable);
+	}
+	delete newTable;
+
+	reply.printf("Sensor %u calibration", sensorNum);
+	if (table == nullptr)
+	{
+		reply.cat(" uses the straight line from the M308 parameters");
+	}
+	else
+	{
+		table->AppendPoints(reply);
+		if (!table->IsUsable())
+		{
+			reply.cat(", needs at least 2 points");
+		}
+	}
+	return GCodeResult::ok;
+}
+
+// End
@@ -0,0 +1,42 @@
+/*
+ * CalibrationTable.h
+ *
+ *  Piecewise linear calibration of a sensor reading to temperature. The points are given as fractions of the full scale reading,
+ *  and are compiled into a slope and intercept for each segment so that converting a reading needs no divisions.
+ */
+
+#ifndef SRC_HEATING_SENSORS_CALIBRATIONTABLE_H_
+#define SRC_HEATING_SENSORS_CALIBRATIONTABLE_H_
+
+#include <RepRapFirmware.h>
+
+class CalibrationTable
+{
+public:
+	static constexpr size_t MaxPoints = 8;
+	static constexpr uint32_t FullScalePpm = 1000000;			// calibration inputs are in parts per million of the full scale reading
+	static constexpr uint32_t ClearTable = 0xFFFFFFFF;			// passing this as the input clears the table
+
+	CalibrationTable() noexcept : numPoints(0) { }
+
+	bool IsUsable() const noexcept { return numPoints >= 2; }
+	void Compile(float fullScaleReading) noexcept;				// calculate the segments for readings in the range 0 to fullScaleReading
+	float Convert(float reading) const noexcept;				// convert a reading to temperature, extrapolating the end segments if necessary
+	void AppendPoints(const StringRef& reply) const noexcept;
+
+	// Add a point to the table of a sensor, creating the table if necessary, or delete the table if inputPpm is ClearTable.
+	// The table is replaced by an updated and compiled copy, so that the Heat task can carry on using it while we do this.
+	static GCodeResult SetPoint(CalibrationTable *& table, float fullScaleReading, unsigned int sensorNum, uint32_t inputPpm, int32_t milliDegrees, const StringRef& reply) noexcept;
+
+private:
+	bool AddPoint(uint32_t inputPpm, float temperature) noexcept;	// add or replace a point, returning false if the table is full
+
+	size_t numPoints;
+	uint32_t inputs[MaxPoints];									// in increasing order
+	float temperatures[MaxPoints];
+	float breakpoints[MaxPoints];								// the readings corresponding to the inputs
+	float slopes[MaxPoints - 1];
+	float intercepts[MaxPoints - 1];
+};
+
+#endif /* SRC_HEATING_SENSORS_CALIBRATIONTABLE_H_ */
@@ -20,11 +20,31 @@ const SpiMode MCP3204_SpiMode = SpiMode::mode0;
 // Define the minimum interval between readings
 const uint32_t MinimumReadInterval = 100;		// minimum interval between reads, in milliseconds
 
+CurrentLoopTemperatureSensor *CurrentLoopTemperatureSensor::sensorList = nullptr;
+
 CurrentLoopTemperatureSensor::CurrentLoopTemperatureSensor(unsigned int sensorNum)
 	: SpiTemperatureSensor(sensorNum, "Current Loop", MCP3204_SpiMode, MCP3204_Frequency),
-	  tempAt4mA(DefaultTempAt4mA), tempAt20mA(DefaultTempAt20mA), chipChannel(DefaultChipChannel), isDifferential(false)
+	  tempAt4mA(DefaultTempAt4mA), tempAt20mA(DefaultTempAt20mA), chipChannel(DefaultChipChannel), isDifferential(false),
+	  calibration(nullptr), batchTemperature(BadErrorTemperature), whenBatchRead(0), batchResult(TemperatureError::notReady), batchReadingPending(false)
 {
 	CalcDerivedParameters();
+
+	// Sensors are created and deleted with the sensors list write-locked, so the Heat task isn't polling them while we change the list
+	nextSensor = sensorList;
+	sensorList = this;
+}
+
+CurrentLoopTemperatureSensor::~CurrentLoopTemperatureSensor()
+{
+	for (CurrentLoopTemperatureSensor **pp = &sensorList; *pp != nullptr; pp = &((*pp)->nextSensor))
+	{
+		if (*pp == this)
+		{
+			*pp = nextSensor;
+			break;
+		}
+	}
+	delete calibration;
 }
 
 // Configure this temperature sensor
@@ -65,21 +85,88 @@ GCodeResult CurrentLoopTemperatureSensor::Configure(const CanMessageGenericParse
 	{
 		CopyBasicDetails(reply);
 		reply.catf(", temperature range %.1f to %.1fC", (double)tempAt4mA, (double)tempAt20mA);
+		if (calibration != nullptr && calibration->IsUsable())
+		{
+			reply.cat(", calibration");
+			calibration->AppendPoints(reply);
+		}
 	}
 	return GCodeResult::ok;
 }
 
+// If another sensor on the same ADC chip read our channel for us recently then use that reading, else read all the channels in use on the chip together
 void CurrentLoopTemperatureSensor::Poll()
 {
-	float t;
-	const TemperatureError rslt = TryGetLinearAdcTemperature(t);
-	SetResult(t, rslt);
+	if (batchReadingPending && millis() - whenBatchRead < MaxBatchReadingAge)
+	{
+		batchReadingPending = false;
+		SetResult(batchTemperature, batchResult);
+	}
+	else
+	{
+		ReadBatch();
+	}
+}
+
+// Read our channel and the channels of the other current loop sensors that share our chip select pin, in a single ownership of the SPI bus
+void CurrentLoopTemperatureSensor::ReadBatch() noexcept
+{
+	CurrentLoopTemperatureSensor *batch[MaxBatchSize];
+	uint8_t adcData[3 * MaxBatchSize];
+	size_t batchSize = 0;
+	batch[batchSize++] = this;
+	const Pin csPin = port.GetPin();
+	if (csPin != NoPin)
+	{
+		for (CurrentLoopTemperatureSensor *s = sensorList; s != nullptr && batchSize < MaxBatchSize; s = s->nextSensor)
+		{
+			if (s != this && s->port.GetPin() == csPin)
+			{
+				batch[batchSize++] = s;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < batchSize; ++i)
+	{
+		adcData[3 * i] = batch[i]->GetChannelByte();
+		adcData[3 * i + 1] = adcData[3 * i + 2] = 0;
+	}
+
+	uint32_t rawVals[MaxBatchSize];
+	const TemperatureError rslt = DoSpiTransactions(adcData, 3, batchSize, rawVals);
+	const uint32_t now = millis();
+	for (size_t i = 0; i < batchSize; ++i)
+	{
+		float t = BadErrorTemperature;
+		const TemperatureError err = (rslt == TemperatureError::success) ? batch[i]->ConvertRawValue(rawVals[i], t) : rslt;
+		if (i == 0)
+		{
+			SetResult(t, err);
+		}
+		else
+		{
+			batch[i]->batchTemperature = t;
+			batch[i]->batchResult = err;
+			batch[i]->whenBatchRead = now;
+			batch[i]->batchReadingPending = true;
+		}
+	}
 }
 
 void CurrentLoopTemperatureSensor::CalcDerivedParameters()
 {
 	minLinearAdcTemp = tempAt4mA - 0.25 * (tempAt20mA - tempAt4mA);
-	linearAdcDegCPerCount = (tempAt20mA - minLinearAdcTemp) / 4096.0;
+	linearAdcDegCPerCount = (tempAt20mA - minLinearAdcTemp) / (float)AdcFullScale;
+	if (calibration != nullptr)
+	{
+		calibration->Compile((float)AdcFullScale);
+	}
+}
+
+GCodeResult CurrentLoopTemperatureSensor::SetCalibrationPoint(uint32_t inputPpm, int32_t milliDegrees, const StringRef& reply) noexcept
+{
+	return CalibrationTable::SetPoint(calibration, (float)AdcFullScale, GetSensorNumber(), inputPpm, milliDegrees, reply);
 }
 
 // Try to get a temperature reading from the linear ADC by doing an SPI transaction
@@ -109,25 +196,14 @@ TemperatureError CurrentLoopTemperatureSensor::TryGetLinearAdcTemperature(float&
 	 * These values represent clocks 1 to 5.
 	 */
 
-	const uint8_t channelByte = ((isDifferential) ? 0x80 : 0xC0) | (chipChannel * 0x08);
-	static const uint8_t adcData[] = { channelByte, 0x00, 0x00 };
+	const uint8_t adcData[] = { GetChannelByte(), 0x00, 0x00 };
 	uint32_t rawVal;
 	TemperatureError rslt = DoSpiTransaction(adcData, 3, rawVal);
 	//debugPrintf("ADC data %u\n", rawVal);
 
 	if (rslt == TemperatureError::success)
 	{
-		const uint32_t adcVal1 = (rawVal >> 5) & ((1 << 13) - 1);
-		const uint32_t adcVal2 = ((rawVal & 1) << 5) | ((rawVal & 2) << 3) | ((rawVal & 4) << 1) | ((rawVal & 8) >> 1) | ((rawVal & 16) >> 3) | ((rawVal & 32) >> 5);
-		if (adcVal1 >= 4096 || adcVal2 != (adcVal1 & ((1 << 6) - 1)))
-		{
-			t = BadErrorTemperature;
-			rslt = TemperatureError::badResponse;
-		}
-		else
-		{
-			t = minLinearAdcTemp + (linearAdcDegCPerCount * (float)adcVal1);
-		}
+		rslt = ConvertRawValue(rawVal, t);
 	}
 	else
 	{
@@ -136,6 +212,21 @@ TemperatureError CurrentLoopTemperatureSensor::TryGetLinearAdcTemperature(float&
 	return rslt;
 }
 
+// Check the 24 bits we received from the ADC and convert them to temperature
+TemperatureError CurrentLoopTemperatureSensor::ConvertRawValue(uint32_t rawVal, float& t) const noexcept
+{
+	const uint32_t adcVal1 = (rawVal >> 5) & ((1 << 13) - 1);
+	const uint32_t adcVal2 = ((rawVal & 1) << 5) | ((rawVal & 2) << 3) | ((rawVal & 4) << 1) | ((rawVal & 8) >> 1) | ((rawVal & 16) >> 3) | ((rawVal & 32) >> 5);
+	if (adcVal1 >= AdcFullScale || adcVal2 != (adcVal1 & ((1 << 6) - 1)))
+	{
+		t = BadErrorTemperature;
+		return TemperatureError::badResponse;
+	}
+
+	t = (calibration != nullptr && calibration->IsUsable()) ? calibration->Convert((float)adcVal1) : minLinearAdcTemp + (linearAdcDegCPerCount * (float)adcVal1);
+	return TemperatureError::success;
+}
+
 #endif
 
 // End
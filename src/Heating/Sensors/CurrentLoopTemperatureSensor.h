@@ -9,6 +9,7 @@
 #define SRC_HEATING_LINEARADCTEMPERATURESENSOR_H_
 
 #include "SpiTemperatureSensor.h"
+#include "CalibrationTable.h"
 
 #if SUPPORT_SPI_SENSORS
 
@@ -16,14 +17,23 @@ class CurrentLoopTemperatureSensor : public SpiTemperatureSensor
 {
 public:
 	CurrentLoopTemperatureSensor(unsigned int sensorNum);
+	~CurrentLoopTemperatureSensor();
 	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) override;
+	GCodeResult SetCalibrationPoint(uint32_t inputPpm, int32_t milliDegrees, const StringRef& reply) noexcept override;
 
 	static constexpr const char *TypeName = "currentloop";
 
 	void Poll() override;
 
 private:
+	static constexpr size_t MaxBatchSize = 8;					// the MCP3208 has 8 channels
+	static constexpr uint32_t MaxBatchReadingAge = 50;			// how long a reading taken for another sensor on the same chip remains usable, in milliseconds
+	static constexpr uint32_t AdcFullScale = 4096;
+
 	TemperatureError TryGetLinearAdcTemperature(float& t);
+	void ReadBatch() noexcept;
+	uint8_t GetChannelByte() const noexcept { return ((isDifferential) ? 0x80 : 0xC0) | (chipChannel * 0x08); }
+	TemperatureError ConvertRawValue(uint32_t rawVal, float& t) const noexcept;
 	void CalcDerivedParameters();
 
 	// Configurable parameters
@@ -32,6 +42,16 @@ private:
 
 	// Derived parameters
 	float minLinearAdcTemp, linearAdcDegCPerCount;
+	CalibrationTable *calibration;								// piecewise linear calibration, or nullptr to use the straight line from tempAt4mA to tempAt20mA
+
+	// Readings taken by another sensor on the same ADC chip on our behalf
+	CurrentLoopTemperatureSensor *nextSensor;
+	float batchTemperature;
+	uint32_t whenBatchRead;
+	TemperatureError batchResult;
+	bool batchReadingPending;
+
+	static CurrentLoopTemperatureSensor *sensorList;			// all current loop sensors, so that we can read the ones that share an ADC chip together
 
 	static constexpr float DefaultTempAt4mA = 385.0;
 	static constexpr float DefaultTempAt20mA = 1600.0;
@@ -17,11 +17,16 @@ static constexpr int32_t UnfilteredAdcRange = 1u << AnalogIn::AdcBits;						// T
 static constexpr int32_t FilteredAdcRange = 1u << (AnalogIn::AdcBits + AdcOversampleBits);	// The readings we pass in should be in range 0..(AdcRange - 1)
 
 LinearAnalogSensor::LinearAnalogSensor(unsigned int sensorNum)
-	: SensorWithPort(sensorNum, "Linear analog"), lowTemp(DefaultLowTemp), highTemp(DefaultHighTemp), filtered(true), adcFilterChannel(-1)
+	: SensorWithPort(sensorNum, "Linear analog"), lowTemp(DefaultLowTemp), highTemp(DefaultHighTemp), filtered(true), adcFilterChannel(-1), calibration(nullptr)
 {
 	CalcDerivedParameters();
 }
 
+LinearAnalogSensor::~LinearAnalogSensor()
+{
+	delete calibration;
+}
+
 GCodeResult LinearAnalogSensor::Configure(const CanMessageGenericParser& parser, const StringRef& reply)
 {
 	bool seen = false;
@@ -66,6 +71,11 @@ GCodeResult LinearAnalogSensor::Configure(const CanMessageGenericParser& parser,
 	{
 		CopyBasicDetails(reply);
 		reply.catf(", %sfiltered, range %.1f to %.1f", (filtered) ? "" : "un", (double)lowTemp, (double)highTemp);
+		if (calibration != nullptr && calibration->IsUsable())
+		{
+			reply.cat(", calibration");
+			calibration->AppendPoints(reply);
+		}
 	}
 	return GCodeResult::ok;
 }
@@ -79,7 +89,7 @@ void LinearAnalogSensor::Poll()
 		if (tempFilter->IsValid())
 		{
 			const int32_t averagedTempReading = tempFilter->GetSum()/(tempFilter->NumAveraged() >> AdcOversampleBits);
-			SetResult((averagedTempReading * linearIncreasePerCount) + lowTemp, TemperatureError::success);
+			SetResult(ConvertReading(averagedTempReading), TemperatureError::success);
 		}
 		else
 		{
@@ -89,7 +99,7 @@ void LinearAnalogSensor::Poll()
 	else
 #endif
 	{
-		SetResult((port.ReadAnalog() * linearIncreasePerCount) + lowTemp, TemperatureError::success);
+		SetResult(ConvertReading(port.ReadAnalog()), TemperatureError::success);
 	}
 }
 
@@ -106,6 +116,20 @@ void LinearAnalogSensor::CalcDerivedParameters()
 	filtered = false;
 #endif
 	linearIncreasePerCount = (highTemp - lowTemp)/((filtered) ? FilteredAdcRange : UnfilteredAdcRange);
+	if (calibration != nullptr)
+	{
+		calibration->Compile((filtered) ? FilteredAdcRange : UnfilteredAdcRange);
+	}
+}
+
+float LinearAnalogSensor::ConvertReading(int32_t reading) const noexcept
+{
+	return (calibration != nullptr && calibration->IsUsable()) ? calibration->Convert((float)reading) : (reading * linearIncreasePerCount) + lowTemp;
+}
+
+GCodeResult LinearAnalogSensor::SetCalibrationPoint(uint32_t inputPpm, int32_t milliDegrees, const StringRef& reply) noexcept
+{
+	return CalibrationTable::SetPoint(calibration, (filtered) ? FilteredAdcRange : UnfilteredAdcRange, GetSensorNumber(), inputPpm, milliDegrees, reply);
 }
 
 // End
@@ -9,14 +9,17 @@
 #define SRC_HEATING_SENSORS_LINEARANALOGSENSOR_H_
 
 #include "SensorWithPort.h"
+#include "CalibrationTable.h"
 
 // We now support linear analog sensors even if thermistors are not supported, for the ATE IOMB
 class LinearAnalogSensor : public SensorWithPort
 {
 public:
 	LinearAnalogSensor(unsigned int sensorNum);
+	~LinearAnalogSensor();
 
 	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) override;
+	GCodeResult SetCalibrationPoint(uint32_t inputPpm, int32_t milliDegrees, const StringRef& reply) noexcept override;
 
 	static constexpr const char *TypeName = "linearanalog";
 
@@ -24,6 +27,7 @@ public:
 
 private:
 	void CalcDerivedParameters();
+	float ConvertReading(int32_t reading) const noexcept;
 
 	// Configurable parameters
 	float lowTemp, highTemp;
@@ -32,6 +36,7 @@ private:
 	// Derived parameters
 	int adcFilterChannel;
 	float linearIncreasePerCount;
+	CalibrationTable *calibration;				// piecewise linear calibration, or nullptr to use the straight line from lowTemp to highTemp
 
 	static constexpr float DefaultLowTemp = 0.0;
 	static constexpr float DefaultHighTemp = 100.0;
@@ -20,6 +20,12 @@ RemoteSensor::RemoteSensor(unsigned int sensorNum, CanAddress pBoardAddress) noe
 
 void RemoteSensor::UpdateRemoteTemperature(CanAddress src, const CanSensorReport& report) noexcept
 {
+	// If the sensor number has been reassigned to a sensor on a different board then accept reports from the new board once the old one has stopped reporting it
+	if (src != boardAddress && millis() - GetLastReadingTime() > RemoteTemperatureTimeoutMillis)
+	{
+		boardAddress = src;
+	}
+
 	if (src == boardAddress)
 	{
 		SetResult(report.GetTemperature(), (TemperatureError)report.errorCode);
@@ -28,9 +28,11 @@ void SpiTemperatureSensor::InitSpi()
 	device.InitMaster();
 }
 
-// Send and receive 1 to 8 bytes of data and return the result as a single 32-bit word
+// Send and receive 1 to 8 bytes of data and return the result as a single 32-bit word.
+// We use DMA so that the Heat task sleeps during the transfer instead of waiting for each byte, leaving the CPU free for other tasks.
 TemperatureError SpiTemperatureSensor::DoSpiTransaction(const uint8_t dataOut[], size_t nbytes, uint32_t& rslt) const
 {
+	constexpr uint32_t SpiTransferTimeoutMillis = 2;
 	if (!device.Select(10))
 	{
 		return TemperatureError::busBusy;
@@ -38,7 +40,7 @@ TemperatureError SpiTemperatureSensor::DoSpiTransaction(const uint8_t dataOut[],
 
 	delayMicroseconds(1);
 	uint8_t rawBytes[8];
-	const bool ok = device.TransceivePacket(dataOut, rawBytes, nbytes);
+	const bool ok = device.TransceivePacketDma(dataOut, rawBytes, nbytes, SpiTransferTimeoutMillis);
 	delayMicroseconds(1);
 
 	device.Deselect();
@@ -59,6 +61,49 @@ TemperatureError SpiTemperatureSensor::DoSpiTransaction(const uint8_t dataOut[],
 	return TemperatureError::success;
 }
 
+// Do several transactions of 1 to 4 bytes each in a single ownership of the SPI, deselecting the device between them.
+// dataOut holds the data for each transaction in turn. This saves the cost of getting the SPI and setting it up for each transaction.
+TemperatureError SpiTemperatureSensor::DoSpiTransactions(const uint8_t dataOut[], size_t nbytes, size_t numTransactions, uint32_t rslts[]) const
+{
+	constexpr uint32_t SpiTransferTimeoutMillis = 2;
+	if (!device.Select(10))
+	{
+		return TemperatureError::busBusy;
+	}
+
+	uint8_t rawBytes[4 * 8];
+	bool ok = true;
+	for (size_t i = 0; i < numTransactions && ok; ++i)
+	{
+		if (i != 0)
+		{
+			device.Reselect();
+		}
+		delayMicroseconds(1);
+		ok = device.TransceivePacketDma(dataOut + i * nbytes, rawBytes + i * nbytes, nbytes, SpiTransferTimeoutMillis);
+		delayMicroseconds(1);
+	}
+
+	device.Deselect();
+	delayMicroseconds(1);
+
+	if (!ok)
+	{
+		return TemperatureError::timeout;
+	}
+
+	for (size_t i = 0; i < numTransactions; ++i)
+	{
+		uint32_t rslt = 0;
+		for (size_t j = 0; j < nbytes; ++j)
+		{
+			rslt = (rslt << 8) | rawBytes[i * nbytes + j];
+		}
+		rslts[i] = rslt;
+	}
+	return TemperatureError::success;
+}
+
 #endif
 
 // End
@@ -23,6 +23,8 @@ protected:
 	void InitSpi();
 	TemperatureError DoSpiTransaction(const uint8_t dataOut[], size_t nbytes, uint32_t& rslt) const
 		pre(nbytes <= 8);
+	TemperatureError DoSpiTransactions(const uint8_t dataOut[], size_t nbytes, size_t numTransactions, uint32_t rslts[]) const
+		pre(nbytes <= 4; numTransactions <= 8);
 
 	SharedSpiClient device;
 };
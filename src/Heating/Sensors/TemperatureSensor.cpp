@@ -20,10 +20,12 @@
 #endif
 
 #include "CAN/CanInterface.h"
+#include <Movement/StepTimer.h>
 
 // Constructor
 TemperatureSensor::TemperatureSensor(unsigned int sensorNum, const char *t)
-	: next(nullptr), sensorNumber(sensorNum), sensorType(t), whenLastRead(0), lastResult(TemperatureError::notReady), lastRealError(TemperatureError::success) {}
+	: sensorNumber(sensorNum), sensorType(t), whenLastRead(0), lastResult(TemperatureError::notReady), lastRealError(TemperatureError::success),
+	  lastReportedTemperature(BadErrorTemperature), whenLastReported(0), lastReportedError(TemperatureError::notReady) {}
 
 // Virtual destructor
 TemperatureSensor::~TemperatureSensor()
@@ -46,6 +48,21 @@ TemperatureError TemperatureSensor::GetLatestTemperature(float& t)
 	return lastResult;
 }
 
+// Decide whether to include this reading in the next temperature broadcast. If threshold is zero we always report it,
+// otherwise only if the result code has changed, the temperature has changed by more than threshold, or we haven't reported it for maxInterval milliseconds.
+bool TemperatureSensor::IsReportDue(float t, TemperatureError err, float threshold, uint32_t maxInterval, uint32_t now) noexcept
+{
+	if (threshold > 0.0 && err == lastReportedError && now - whenLastReported < maxInterval && fabsf(t - lastReportedTemperature) <= threshold)
+	{
+		return false;
+	}
+
+	lastReportedTemperature = t;
+	lastReportedError = err;
+	whenLastReported = now;
+	return true;
+}
+
 // Default implementation of Configure, for sensors that have no configurable parameters
 GCodeResult TemperatureSensor::Configure(const CanMessageGenericParser& parser, const StringRef& reply)
 {
@@ -93,6 +110,18 @@ void TemperatureSensor::UpdateRemoteTemperature(CanAddress src, const CanSensorR
 	// Nothing to do here. This function is overridden in class RemoteSensor.
 }
 
+GCodeResult TemperatureSensor::SetFilterLength(uint32_t length, const StringRef& reply) noexcept
+{
+	reply.printf("Sensor %u does not use a filtered ADC input", sensorNumber);
+	return GCodeResult::error;
+}
+
+GCodeResult TemperatureSensor::SetCalibrationPoint(uint32_t inputPpm, int32_t milliDegrees, const StringRef& reply) noexcept
+{
+	reply.printf("Sensor %u does not support calibration tables", sensorNumber);
+	return GCodeResult::error;
+}
+
 // Factory method
 TemperatureSensor *TemperatureSensor::Create(unsigned int sensorNum, const char *typeName, const StringRef& reply)
 {
@@ -176,7 +205,7 @@ TemperatureSensor *TemperatureSensor::Create(unsigned int sensorNum, const char
 const float CelsiusMin = -100.0;					// starting temperature of the temp table below
 const float CelsiusInterval = 10.0;
 
-static const uint16_t tempTable[] =
+static constexpr uint16_t tempTable[] =
 {
 	6026,  6430,  6833,  7233,  7633,  8031,  8427,  8822,  9216,  9609,
 	10000, 10390, 10779, 11167, 11554, 11940, 12324, 12708, 13090, 13471,
@@ -190,9 +219,10 @@ static const uint16_t tempTable[] =
 	37570, 37868, 38165, 38460, 38755, 39048
 };
 
-const size_t NumTempTableEntries = sizeof(tempTable)/sizeof(tempTable[0]);
+constexpr size_t NumTempTableEntries = sizeof(tempTable)/sizeof(tempTable[0]);
 
-/*static*/ TemperatureError TemperatureSensor::GetPT100Temperature(float& t, uint16_t ohmsx100)
+// The original conversion, which does a binary search of the above table. We now keep this only to check and time the faster conversion below.
+static TemperatureError GetPT100TemperatureBySearch(float& t, uint16_t ohmsx100) noexcept
 {
 
 	// Formally-verified binary search routine, adapted from one of the eCv examples
@@ -236,4 +266,94 @@ const size_t NumTempTableEntries = sizeof(tempTable)/sizeof(tempTable[0]);
 	return TemperatureError::success;
 }
 
+// Temperatures at uniform steps of 2.56 ohms, so that we can index the table directly instead of searching it.
+// Entry n is (T + 110) * 64 where T is the temperature in C at a resistance of (n + UniformTableFirstIndex) * 2.56 ohms,
+// calculated from the Callendar-Van Dusen equation. Linear interpolation between entries is accurate to 0.02C.
+constexpr unsigned int UniformTableShift = 8;		// ohmsx100 is shifted right this many bits to get the table index
+constexpr unsigned int UniformTableFirstIndex = 23;	// the first entry is for 58.88 ohms
+constexpr float UniformTableOffset = 110.0;
+constexpr float UniformTableScale = 1.0/(64.0 * (float)(1u << UniformTableShift));
+
+static const uint16_t uniformTempTable[] =
+{
+	  423,   827,  1232,  1639,  2047,  2455,  2865,  3276,  3688,  4100,  4514,  4928,
+	 5344,  5760,  6177,  6595,  7014,  7433,  7854,  8275,  8697,  9120,  9544,  9968,
+	10393, 10820, 11247, 11675, 12104, 12533, 12964, 13395, 13828, 14261, 14695, 15130,
+	15566, 16003, 16440, 16879, 17319, 17759, 18201, 18643, 19087, 19531, 19976, 20423,
+	20870, 21318, 21768, 22218, 22669, 23122, 23575, 24029, 24485, 24941, 25399, 25857,
+	26317, 26778, 27240, 27702, 28166, 28631, 29098, 29565, 30033, 30503, 30974, 31446,
+	31919, 32393, 32868, 33345, 33823, 34302, 34782, 35263, 35746, 36230, 36715, 37201,
+	37689, 38178, 38668, 39160, 39653, 40147, 40642, 41139, 41637, 42137, 42638, 43140,
+	43644, 44149, 44656, 45164, 45673, 46184, 46697, 47211, 47726, 48243, 48762, 49282,
+	49803, 50326, 50851, 51377, 51905, 52435, 52966, 53499, 54034, 54570, 55108, 55647,
+	56189, 56732, 57277, 57824, 58372, 58923, 59475, 60029, 60585, 61143, 61702
+};
+
+static_assert((tempTable[0] >> UniformTableShift) >= UniformTableFirstIndex);
+static_assert((tempTable[NumTempTableEntries - 1] >> UniformTableShift) + 1 - UniformTableFirstIndex < ARRAY_SIZE(uniformTempTable));
+
+/*static*/ TemperatureError TemperatureSensor::GetPT100Temperature(float& t, uint16_t ohmsx100)
+{
+	// Keep the same limits that we used when we searched tempTable
+	if (ohmsx100 <= tempTable[0])
+	{
+		t = BadErrorTemperature;
+		return TemperatureError::shortCircuit;
+	}
+
+	if (ohmsx100 > tempTable[NumTempTableEntries - 1])
+	{
+		t = BadErrorTemperature;
+		return TemperatureError::openCircuit;
+	}
+
+	// Interpolate in integer arithmetic so that the only floating point operations are one conversion, one multiply and one subtract
+	const unsigned int index = (ohmsx100 >> UniformTableShift) - UniformTableFirstIndex;
+	const int32_t fraction = ohmsx100 & ((1u << UniformTableShift) - 1);
+	const int32_t lower = uniformTempTable[index];
+	const int32_t upper = uniformTempTable[index + 1];
+	t = (float)((lower << UniformTableShift) + (upper - lower) * fraction) * UniformTableScale - UniformTableOffset;
+	return TemperatureError::success;
+}
+
+/*static*/ GCodeResult TemperatureSensor::RunPT100Benchmark(const StringRef& reply) noexcept
+{
+	constexpr unsigned int NumCalls = 1024;
+	constexpr uint16_t FirstReading = 6030;
+	constexpr uint16_t ReadingStep = 32;			// so that the readings cover the whole table
+	volatile float sink;							// stop the compiler optimising the calls away
+	float t;
+
+	uint32_t startTicks = StepTimer::GetTimerTicks();
+	for (unsigned int i = 0; i < NumCalls; ++i)
+	{
+		(void)GetPT100TemperatureBySearch(t, FirstReading + i * ReadingStep);
+		sink = t;
+	}
+	const uint32_t searchTicks = StepTimer::GetTimerTicks() - startTicks;
+
+	startTicks = StepTimer::GetTimerTicks();
+	for (unsigned int i = 0; i < NumCalls; ++i)
+	{
+		(void)GetPT100Temperature(t, FirstReading + i * ReadingStep);
+		sink = t;
+	}
+	const uint32_t indexedTicks = StepTimer::GetTimerTicks() - startTicks;
+	(void)sink;
+
+	float maxDifference = 0.0;
+	for (unsigned int i = 0; i < NumCalls; ++i)
+	{
+		float t1, t2;
+		(void)GetPT100TemperatureBySearch(t1, FirstReading + i * ReadingStep);
+		(void)GetPT100Temperature(t2, FirstReading + i * ReadingStep);
+		maxDifference = max<float>(maxDifference, fabsf(t1 - t2));
+	}
+
+	constexpr uint32_t CyclesPerTick = SystemCoreClockFreq/StepTimer::StepClockRate;
+	reply.printf("PT100 conversion: search %" PRIu32 " cycles, indexed %" PRIu32 " cycles, including loop overhead, max difference %.3fC",
+					(searchTicks * CyclesPerTick)/NumCalls, (indexedTicks * CyclesPerTick)/NumCalls, (double)maxDifference);
+	return GCodeResult::ok;
+}
+
 // End
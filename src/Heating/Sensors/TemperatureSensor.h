@@ -9,6 +9,16 @@
 class CanMessageGenericParser;
 class CanSensorReport;
 
+// The result of asking a sensor to set up a fast over-temperature cutoff
+enum class FastCutoffResult : uint8_t
+{
+	done = 0,						// the cutoff has been set up or cancelled
+	notSupported,					// this sensor can't do it
+	notReady						// try again later
+};
+
+typedef void (*FastCutoffFunction)(CallbackParameter cp) noexcept;
+
 class TemperatureSensor
 {
 public:
@@ -31,12 +41,27 @@ public:
 	// Update the temperature, if it is a remote sensor. Overridden in class RemoteSensor.
 	virtual void UpdateRemoteTemperature(CanAddress src, const CanSensorReport& report) noexcept;
 
+	// Arrange for fn to be called from the ADC task as soon as the temperature exceeds the limit, or cancel that if fn is null. Overridden by sensors that can do this.
+	virtual FastCutoffResult SetFastCutoff(float limit, FastCutoffFunction fn, CallbackParameter cp) noexcept { return FastCutoffResult::notSupported; }
+
+	// Set or report the length of the ADC averaging filter. Overridden by sensors that use a filtered ADC input.
+	virtual GCodeResult SetFilterLength(uint32_t length, const StringRef& reply) noexcept;
+
+	// Add a point to the piecewise linear calibration table, or clear the table. Overridden by sensors that support calibration tables.
+	virtual GCodeResult SetCalibrationPoint(uint32_t inputPpm, int32_t milliDegrees, const StringRef& reply) noexcept;
+
 	// Get the latest temperature reading
 	TemperatureError GetLatestTemperature(float& t);
 
 	// Get the most recent reading without checking for timeout
 	float GetStoredReading() const noexcept { return lastTemperature; }
 
+	// Get the millis() time of the most recent reading
+	uint32_t GetLastReadingTime() const noexcept { return whenLastRead; }
+
+	// Decide whether to include a reading in the next temperature broadcast, and if so record it as reported
+	bool IsReportDue(float t, TemperatureError err, float threshold, uint32_t maxInterval, uint32_t now) noexcept;
+
 	// Return the sensor type
 	const char *GetSensorType() const { return sensorType; }
 
@@ -49,13 +74,12 @@ public:
 	// Copy the basic details to the reply buffer
 	void CopyBasicDetails(const StringRef& reply) const noexcept;
 
-	// Get/set the next sensor in the linked list
-	TemperatureSensor *GetNext() const { return next; }
-	void SetNext(TemperatureSensor *n) { next = n; }
-
 	// Factory method
 	static TemperatureSensor *Create(unsigned int sensorNum, const char *typeName, const StringRef& reply);
 
+	// Time the PT100 resistance to temperature conversion and compare it with the binary search that it replaced
+	static GCodeResult RunPT100Benchmark(const StringRef& reply) noexcept;
+
 protected:
 	void SetResult(float t, TemperatureError rslt);
 	void SetResult(TemperatureError rslt);
@@ -65,12 +89,14 @@ protected:
 private:
 	static constexpr uint32_t TemperatureReadingTimeout = 2000;			// any reading older than this number of milliseconds is considered unreliable
 
-	TemperatureSensor *next;
 	unsigned int sensorNumber;					// the number of this sensor
 	const char * const sensorType;
 	volatile float lastTemperature;
 	volatile uint32_t whenLastRead;
 	volatile TemperatureError lastResult, lastRealError;
+	float lastReportedTemperature;				// the temperature we last broadcast
+	uint32_t whenLastReported;					// the millis tick count when we last broadcast it
+	TemperatureError lastReportedError;			// the result code we last broadcast
 };
 
 #endif // TEMPERATURESENSOR_H
@@ -29,11 +29,20 @@
 Thermistor::Thermistor(unsigned int sensorNum, bool p_isPT1000)
 	: SensorWithPort(sensorNum, (p_isPT1000) ? "PT1000" : "Thermistor"), adcFilterChannel(-1),
 	  r25(DefaultThermistorR25), beta(DefaultThermistorBeta), shC(DefaultThermistorC), seriesR(DefaultThermistorSeriesR),
-	  isPT1000(p_isPT1000), adcLowOffset(0), adcHighOffset(0)
+	  isPT1000(p_isPT1000), adcLowOffset(0), adcHighOffset(0), temperatureTable((p_isPT1000) ? nullptr : new int16_t[TableEntries]), fastCutoffFunction(nullptr)
 {
 	CalcDerivedParameters();
 }
 
+Thermistor::~Thermistor()
+{
+	delete[] temperatureTable;
+	if (adcFilterChannel >= 0)
+	{
+		Platform::SetThermistorCutoff(adcFilterChannel, 0, false, nullptr, CallbackParameter(nullptr));
+	}
+}
+
 // Get the ADC reading
 int32_t Thermistor::GetRawReading(bool& valid) const noexcept
 {
@@ -64,6 +73,10 @@ GCodeResult Thermistor::Configure(const CanMessageGenericParser& parser, const S
 		// We changed the port, so clear the ADC corrections and set up the ADC filter if there is one
 		adcLowOffset = adcHighOffset = 0;
 
+		if (adcFilterChannel >= 0)
+		{
+			Platform::SetThermistorCutoff(adcFilterChannel, 0, false, nullptr, CallbackParameter(nullptr));	// cancel any cutoff on the old channel
+		}
 		adcFilterChannel = Platform::GetAveragingFilterIndex(port);
 		if (adcFilterChannel >= 0)
 		{
@@ -205,7 +218,14 @@ GCodeResult Thermistor::Configure(const CanMessageGenericParser& parser, const S
 		changed = true;
 	}
 
-	if (!changed)
+	if (changed)
+	{
+		if (fastCutoffFunction != nullptr)
+		{
+			(void)ArmFastCutoff();									// the ADC reading at the cutoff temperature will have changed
+		}
+	}
+	else
 	{
 		CopyBasicDetails(reply);
 		if (isPT1000)
@@ -223,6 +243,92 @@ GCodeResult Thermistor::Configure(const CanMessageGenericParser& parser, const S
 	return GCodeResult::ok;
 }
 
+// Set up the cutoff. It's only useful if we have a filtered ADC channel, because only those are read independently of the Heat task.
+FastCutoffResult Thermistor::SetFastCutoff(float limit, FastCutoffFunction fn, CallbackParameter cp) noexcept
+{
+	fastCutoffFunction = fn;
+	fastCutoffParam = cp;
+	fastCutoffLimit = limit;
+	return ArmFastCutoff();
+}
+
+// Set the length of the averaging filter on our ADC channel, or report it if length is zero.
+// A short filter gives less delay for fast heaters such as hot ends, a long one gives a steadier reading for beds and chambers.
+GCodeResult Thermistor::SetFilterLength(uint32_t length, const StringRef& reply) noexcept
+{
+	if (adcFilterChannel < 0)
+	{
+		return TemperatureSensor::SetFilterLength(length, reply);
+	}
+
+	ThermistorAveragingFilter * const filter = Platform::GetAdcFilter(adcFilterChannel);
+	if (length != 0)
+	{
+		(void)filter->SetLength(length);			// the filter sum keeps the same scale, so the fast cutoff limit doesn't change
+	}
+	reply.printf("Sensor %u ADC filter length %" PRIu32 " readings", GetSensorNumber(), filter->GetLength());
+	return GCodeResult::ok;
+}
+
+// Work out the ADC filter sum for the cutoff temperature by inverting the calculation in Poll, so that the ADC task only has to compare integers
+FastCutoffResult Thermistor::ArmFastCutoff() noexcept
+{
+	if (adcFilterChannel < 0)
+	{
+		return FastCutoffResult::notSupported;
+	}
+
+	if (fastCutoffFunction == nullptr)
+	{
+		Platform::SetThermistorCutoff(adcFilterChannel, 0, false, nullptr, CallbackParameter(nullptr));
+		return FastCutoffResult::done;
+	}
+
+#if HAS_VREF_MONITOR
+	const volatile ThermistorAveragingFilter * const vrefFilter = Platform::GetVrefFilter(adcFilterChannel);
+	const volatile ThermistorAveragingFilter * const vssaFilter = Platform::GetVssaFilter(adcFilterChannel);			// this one may be null on SAMC21 tool boards
+	if (!vrefFilter->IsValid() || (vssaFilter != nullptr && !vssaFilter->IsValid()))
+	{
+		return FastCutoffResult::notReady;
+	}
+	const int32_t rawAveragedVssaReading = (vssaFilter == nullptr) ? 0 : vssaFilter->GetSum()/(vssaFilter->NumAveraged() >> AdcOversampleBits);
+	const int32_t rawAveragedVrefReading = vrefFilter->GetSum()/(vrefFilter->NumAveraged() >> AdcOversampleBits);
+	const float averagedVssaReading = (float)(rawAveragedVssaReading + (adcLowOffset * (1 << (AnalogIn::AdcBits - 12 + AdcOversampleBits - 1))));
+	const float averagedVrefReading = (float)(rawAveragedVrefReading + (adcHighOffset * (1 << (AnalogIn::AdcBits - 12 + AdcOversampleBits - 1))));
+#else
+	const float averagedVssaReading = (float)adcLowOffset;
+	const float averagedVrefReading = (float)(OversampledAdcRange + adcHighOffset);
+#endif
+
+	// Find the sensor resistance at the cutoff temperature
+	float resistance;
+	if (isPT1000)
+	{
+		resistance = 1000.0 * (1.0 + fastCutoffLimit * (3.9083e-3 - 5.775e-7 * fastCutoffLimit));		// Callendar-Van Dusen equation above 0C
+	}
+	else
+	{
+		// Solve the Steinhart-Hart equation for ln(R). The first estimate is exact if C is zero, otherwise a few Newton-Raphson steps are plenty.
+		const float recipT = 1.0/(fastCutoffLimit - ABS_ZERO);
+		float logResistance = (recipT - shA)/shB;
+		if (shC != 0.0)
+		{
+			for (unsigned int i = 0; i < 3; ++i)
+			{
+				logResistance -= (shA + shB * logResistance + shC * logResistance * logResistance * logResistance - recipT)/(shB + 3.0 * shC * logResistance * logResistance);
+			}
+		}
+		resistance = expf(logResistance);
+	}
+
+	const float averagedTempReading = averagedVssaReading + (averagedVrefReading - averagedVssaReading) * resistance/(resistance + seriesR);
+	const uint32_t limitSum = (uint32_t)lrintf(max<float>(averagedTempReading, 0.0) * (float)(ThermistorAveragingFilter::NumAveraged() >> AdcOversampleBits));
+
+	// A thermistor's resistance falls as the temperature rises, a PT1000's rises
+	Platform::SetThermistorCutoff(adcFilterChannel, limitSum, !isPT1000, fastCutoffFunction, fastCutoffParam);
+	return FastCutoffResult::done;
+}
+
 // Get the temperature
 void Thermistor::Poll()
 {
@@ -300,9 +406,7 @@ void Thermistor::Poll()
 				else
 				{
 					// Else it's a thermistor
-					const float logResistance = logf(resistance);
-					const float recipT = shA + shB * logResistance + shC * logResistance * logResistance * logResistance;
-					const float temp = (recipT > 0.0) ? (1.0/recipT) + ABS_ZERO : BadErrorTemperature;
+					const float temp = CalcTemperature(resistance);
 
 					// It's hard to distinguish between an open circuit and a cold high-resistance thermistor.
 					// So we treat a temperature below -5C as an open circuit, unless we are using a low-resistance thermistor. The E3D thermistor has a resistance of about 470k @ -5C.
@@ -326,12 +430,54 @@ void Thermistor::Poll()
 	}
 }
 
-// Calculate shA and shB from the other parameters
+// Calculate the temperature of a thermistor from its resistance, using the table if the resistance is in its range
+float Thermistor::CalcTemperature(float resistance) const noexcept
+{
+	// The exponent and mantissa bits of a positive float increase with its value, so the top bits give the table index
+	constexpr unsigned int FractionBits = 23 - TableMantissaBits;			// the number of mantissa bits below those used for the table index
+	constexpr unsigned int InterpolationBits = 12;							// how many of those we use to interpolate
+	constexpr uint32_t FirstIndexBits = (uint32_t)(127 + TableMinExponent) << TableMantissaBits;
+	static_assert(3 * ((int64_t)INT16_MAX << InterpolationBits) <= INT32_MAX);	// so that the interpolation can't overflow
+
+	uint32_t bits;
+	memcpy(&bits, &resistance, sizeof(bits));
+	const uint32_t index = (bits >> FractionBits) - FirstIndexBits;			// wraps round to a large number if the resistance is below the table
+	if (temperatureTable != nullptr && index < TableEntries - 1)
+	{
+		const int32_t lower = temperatureTable[index];
+		const int32_t upper = temperatureTable[index + 1];
+		if (lower != BadTableEntry && upper != BadTableEntry)
+		{
+			const int32_t fraction = (bits & ((1u << FractionBits) - 1)) >> (FractionBits - InterpolationBits);
+			return (float)(lower * (1 << InterpolationBits) + (upper - lower) * fraction) * (1.0/(TableScale * (float)(1u << InterpolationBits)));
+		}
+	}
+
+	const float logResistance = logf(resistance);
+	const float recipT = shA + shB * logResistance + shC * logResistance * logResistance * logResistance;
+	return (recipT > 0.0) ? (1.0/recipT) + ABS_ZERO : BadErrorTemperature;
+}
+
+// Calculate shA and shB from the other parameters, then the temperature table
 void Thermistor::CalcDerivedParameters()
 {
 	shB = 1.0/beta;
 	const float lnR25 = logf(r25);
 	shA = 1.0/(25.0 - ABS_ZERO) - shB * lnR25 - shC * lnR25 * lnR25 * lnR25;
+
+	if (temperatureTable != nullptr)
+	{
+		for (unsigned int i = 0; i < TableEntries; ++i)
+		{
+			const float resistance = ldexpf(1.0 + (float)(i & ((1u << TableMantissaBits) - 1)) * (1.0/(float)(1u << TableMantissaBits)),
+											TableMinExponent + (int)(i >> TableMantissaBits));
+			const float logResistance = logf(resistance);
+			const float recipT = shA + shB * logResistance + shC * logResistance * logResistance * logResistance;
+			temperatureTable[i] = (recipT > 0.0)
+									? (int16_t)lrintf(constrain<float>(((1.0/recipT) + ABS_ZERO) * TableScale, (float)(BadTableEntry + 1), (float)INT16_MAX))
+										: BadTableEntry;
+		}
+	}
 }
 
 #endif	//SUPPORT_THERMISTORS
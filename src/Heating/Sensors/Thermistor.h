@@ -24,6 +24,7 @@ class Thermistor : public SensorWithPort
 {
 public:
 	Thermistor(unsigned int sensorNum, bool p_isPT1000);					// create an instance with default values
+	~Thermistor();
 
 	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) override; // configure the sensor from M308 parameters
 
@@ -31,13 +32,17 @@ public:
 	static constexpr const char *TypeNamePT1000 = "pt1000";
 
 	void Poll() override;
+	FastCutoffResult SetFastCutoff(float limit, FastCutoffFunction fn, CallbackParameter cp) noexcept override;
+	GCodeResult SetFilterLength(uint32_t length, const StringRef& reply) noexcept override;
 
 private:
 	// For the theory behind ADC oversampling, see http://www.atmel.com/Images/doc8003.pdf
 	static constexpr unsigned int AdcOversampleBits = 2;					// we use 2-bit oversampling
 
-	void CalcDerivedParameters();											// calculate shA and shB
+	void CalcDerivedParameters();											// calculate shA, shB and the temperature table
+	float CalcTemperature(float resistance) const noexcept;					// calculate the temperature of a thermistor from its resistance
 	int32_t GetRawReading(bool& valid) const noexcept;						// get the ADC reading
+	FastCutoffResult ArmFastCutoff() noexcept;								// calculate the ADC filter sum for the fast cutoff and give it to Platform
 
 	// The following are configurable parameters
 	int adcFilterChannel;
@@ -48,6 +53,21 @@ private:
 	// The following are derived from the configurable parameters
 	float shA, shB;															// derived parameters
 
+	// To avoid calculating a logarithm on every poll, we tabulate the thermistor temperature against resistance at 16 points per octave of resistance.
+	// The table is indexed by the exponent and the top mantissa bits of the resistance as a float, so finding the entry needs only shifts.
+	static constexpr unsigned int TableMantissaBits = 4;					// the table has 2^TableMantissaBits entries per octave
+	static constexpr int TableMinExponent = 5;								// the lowest resistance in the table is 2^5 = 32 ohms
+	static constexpr int TableMaxExponent = 21;								// the highest resistance in the table is 2^21 = 2M ohms
+	static constexpr unsigned int TableEntries = ((TableMaxExponent - TableMinExponent) << TableMantissaBits) + 1;
+	static constexpr float TableScale = 32.0;								// table entries are the temperature in units of 1/32C
+	static constexpr int16_t BadTableEntry = INT16_MIN;						// table entry for a resistance that the Steinhart-Hart equation gives no temperature for
+	int16_t *temperatureTable;												// the table, or nullptr if this is a PT1000 sensor
+
+	// Fast over-temperature cutoff, kept so that we can recalculate it when the parameters change
+	FastCutoffFunction fastCutoffFunction;									// the function to call when the limit is exceeded, or nullptr if none
+	CallbackParameter fastCutoffParam;
+	float fastCutoffLimit;
+
 	static constexpr int32_t OversampledAdcRange = 1u << (AnalogIn::AdcBits + AdcOversampleBits);	// The readings we pass in should be in range 0..(AdcRange - 1)
 };
 
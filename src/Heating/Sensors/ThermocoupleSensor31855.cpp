@@ -41,6 +41,10 @@
 //    01 -- SCG fault; reads 1 if the thermocouple is shorted to ground
 //    00 --  OC fault; reads 1 if the thermocouple is not connected (open)
 
+// The MAX31855 assumes that the Type K EMF is proportional to temperature, which is out by several degrees at high temperatures.
+// So we recover the measured EMF from the reported temperatures, add the EMF at the cold junction temperature and convert the total using the NIST polynomials.
+// The cold junction temperature changes slowly, so we only recalculate its EMF occasionally.
+
 // For purposes of setting bit transfer widths and timings, we need to use a
 // Peripheral Channel Select (PCS).  Use channel #3 as it is unlikely to be
 // used by anything else as the Arduino Due leaves pin 78 unconnected.
@@ -51,6 +55,7 @@
 
 #include "Platform.h"
 #include "CanMessageFormats.h"
+#include "TypeKThermocouple.h"
 
 const uint32_t MAX31855_Frequency = 4000000;	// maximum for MAX31855 is 5MHz
 
@@ -62,9 +67,11 @@ const SpiMode MAX31855_SpiMode = SpiMode::mode0;
 
 // Define the minimum interval between readings
 const uint32_t MinimumReadInterval = 100;		// minimum interval between reads, in milliseconds
+const uint32_t ColdJunctionUpdateInterval = 2000;	// how often we recalculate the cold junction EMF, in milliseconds
 
 ThermocoupleSensor31855::ThermocoupleSensor31855(unsigned int sensorNum)
-	: SpiTemperatureSensor(sensorNum, "Thermocouple (MAX31855)", MAX31855_SpiMode, MAX31855_Frequency)
+	: SpiTemperatureSensor(sensorNum, "Thermocouple (MAX31855)", MAX31855_SpiMode, MAX31855_Frequency),
+	  coldJunctionTemperature(0.0), coldJunctionMillivolts(0.0), whenColdJunctionUpdated(0), coldJunctionValid(false)
 {
 }
 
@@ -144,11 +151,20 @@ void ThermocoupleSensor31855::Poll()
 		}
 		else
 		{
-			rawVal >>= 18;							// shift the 14-bit temperature data to the bottom of the word
-			rawVal |= (0 - (rawVal & 0x2000));		// sign-extend the sign bit
+			const float reportedTemperature = (float)((int32_t)rawVal >> 18) * 0.25;	// 14-bit signed temperature in units of 1/4C
+
+			const uint32_t now = millis();
+			if (!coldJunctionValid || now - whenColdJunctionUpdated >= ColdJunctionUpdateInterval)
+			{
+				coldJunctionTemperature = (float)((int32_t)(rawVal << 16) >> 20) * 0.0625;	// 12-bit signed temperature in units of 1/16C
+				coldJunctionMillivolts = TypeKThermocouple::TemperatureToMillivolts(coldJunctionTemperature);
+				whenColdJunctionUpdated = now;
+				coldJunctionValid = true;
+			}
 
-			// And convert to from units of 1/4C to 1C
-			SetResult((float)(0.25 * (float)(int32_t)rawVal), TemperatureError::success);
+			float temperature;
+			const float millivolts = (reportedTemperature - coldJunctionTemperature) * TypeKThermocouple::NominalSeebeckCoefficient + coldJunctionMillivolts;
+			SetResult((TypeKThermocouple::MillivoltsToTemperature(millivolts, temperature)) ? temperature : reportedTemperature, TemperatureError::success);
 		}
 	}
 }
@@ -21,6 +21,12 @@ public:
 	static constexpr const char *TypeName = "thermocouplemax31855";
 
 	void Poll() override;
+
+private:
+	float coldJunctionTemperature;			// the cold junction temperature that coldJunctionMillivolts was calculated for
+	float coldJunctionMillivolts;			// the Type K EMF at the cold junction temperature
+	uint32_t whenColdJunctionUpdated;		// when we last calculated coldJunctionMillivolts
+	bool coldJunctionValid;					// true if coldJunctionMillivolts has been calculated
 };
 
 #endif
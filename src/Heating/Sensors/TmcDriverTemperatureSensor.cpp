@@ -11,7 +11,7 @@
 #if HAS_SMART_DRIVERS
 
 TmcDriverTemperatureSensor::TmcDriverTemperatureSensor(unsigned int sensorNum)
-	: TemperatureSensor(sensorNum, "TMC temperature warnings")
+	: TemperatureSensor(sensorNum, "TMC estimated temperature")
 {
 }
 
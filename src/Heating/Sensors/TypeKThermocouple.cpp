@@ -0,0 +1,79 @@
+/*
+ * TypeKThermocouple.cpp
+ */
+
+#include "TypeKThermocouple.h"
+
+// Evaluate a polynomial with the coefficients in increasing order of power
+template<size_t N> static inline float EvaluatePolynomial(const float (&coefficients)[N], float x) noexcept
+{
+	float result = coefficients[N - 1];
+	for (size_t i = N - 1; i != 0; )
+	{
+		--i;
+		result = result * x + coefficients[i];
+	}
+	return result;
+}
+
+// Reference function coefficients, giving EMF in mV from temperature in degC
+static const float EmfBelowZero[] =
+{
+	0.0, 0.394501280250e-01, 0.236223735980e-04, -0.328589067840e-06, -0.499048287770e-08, -0.675090591730e-10,
+	-0.574103274280e-12, -0.310888728940e-14, -0.104516093650e-16, -0.198892668780e-19, -0.163226974860e-22
+};
+
+static const float EmfAboveZero[] =
+{
+	-0.176004136860e-01, 0.389212049750e-01, 0.185587700320e-04, -0.994575928740e-07, 0.318409457190e-09,
+	-0.560728448890e-12, 0.560750590590e-15, -0.320207200030e-18, 0.971511471520e-22, -0.121047212750e-25
+};
+
+constexpr float EmfExpA0 = 0.118597600000e+00;
+constexpr float EmfExpA1 = -0.118343200000e-03;
+constexpr float EmfExpA2 = 0.126968600000e+03;
+
+// Inverse function coefficients, giving temperature in degC from EMF in mV
+constexpr float MinMillivolts = -5.891;
+constexpr float MidMillivolts = 20.644;
+constexpr float MaxMillivolts = 54.886;
+
+static const float TemperatureBelowZero[] =
+{
+	0.0, 2.5173462e+01, -1.1662878e+00, -1.0833638e+00, -8.9773540e-01, -3.7342377e-01, -8.6632643e-02, -1.0450598e-02, -5.1920577e-04
+};
+
+static const float TemperatureBelow500[] =
+{
+	0.0, 2.508355e+01, 7.860106e-02, -2.503131e-01, 8.315270e-02, -1.228034e-02, 9.804036e-04, -4.413030e-05, 1.057734e-06, -1.052755e-08
+};
+
+static const float TemperatureAbove500[] =
+{
+	-1.318058e+02, 4.830222e+01, -1.646031e+00, 5.464731e-02, -9.650715e-04, 8.802193e-06, -3.110810e-08
+};
+
+// Return the EMF in mV of a Type K thermocouple with its hot junction at the specified temperature and its cold junction at 0C
+float TypeKThermocouple::TemperatureToMillivolts(float temperature) noexcept
+{
+	if (temperature < 0.0)
+	{
+		return EvaluatePolynomial(EmfBelowZero, temperature);
+	}
+	return EvaluatePolynomial(EmfAboveZero, temperature) + EmfExpA0 * expf(EmfExpA1 * fsquare(temperature - EmfExpA2));
+}
+
+// Convert the EMF in mV of a Type K thermocouple with its cold junction at 0C to temperature, returning false if it is out of range
+bool TypeKThermocouple::MillivoltsToTemperature(float millivolts, float& temperature) noexcept
+{
+	if (millivolts < MinMillivolts || millivolts > MaxMillivolts)
+	{
+		return false;
+	}
+	temperature = (millivolts < 0.0) ? EvaluatePolynomial(TemperatureBelowZero, millivolts)
+					: (millivolts < MidMillivolts) ? EvaluatePolynomial(TemperatureBelow500, millivolts)
+						: EvaluatePolynomial(TemperatureAbove500, millivolts);
+	return true;
+}
+
+// End
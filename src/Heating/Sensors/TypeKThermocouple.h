@@ -0,0 +1,20 @@
+/*
+ * TypeKThermocouple.h
+ *
+ *  NIST ITS-90 polynomials for converting between Type K thermocouple EMF and temperature
+ */
+
+#ifndef SRC_HEATING_SENSORS_TYPEKTHERMOCOUPLE_H_
+#define SRC_HEATING_SENSORS_TYPEKTHERMOCOUPLE_H_
+
+#include <RepRapFirmware.h>
+
+namespace TypeKThermocouple
+{
+	constexpr float NominalSeebeckCoefficient = 0.041276;	// mV per degC, the linear approximation that the MAX31855 uses
+
+	float TemperatureToMillivolts(float temperature) noexcept;					// valid from -270C to 1372C
+	bool MillivoltsToTemperature(float millivolts, float& temperature) noexcept;	// returns false if the EMF is outside the range -200C to 1372C
+}
+
+#endif /* SRC_HEATING_SENSORS_TYPEKTHERMOCOUPLE_H_ */
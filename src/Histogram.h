@@ -0,0 +1,46 @@
+/*
+ * Histogram.h
+ */
+
+#ifndef SRC_HISTOGRAM_H_
+#define SRC_HISTOGRAM_H_
+
+#include "RepRapFirmware.h"
+
+// Class to count how many times a value fell into each of a number of equal width buckets.
+// The bucket width is a power of 2 so that recording a value is fast enough to be done in an ISR. The last bucket also counts all values too large for the others.
+template<size_t NumBuckets, unsigned int BucketWidthShift> class Histogram
+{
+public:
+	Histogram() noexcept { Clear(); }
+
+	void Clear() noexcept
+	{
+		for (uint32_t& c : counts)
+		{
+			c = 0;
+		}
+	}
+
+	void Record(uint32_t val) noexcept
+	{
+		const uint32_t bucket = val >> BucketWidthShift;
+		++counts[(bucket < NumBuckets) ? bucket : NumBuckets - 1];
+	}
+
+	// Append the counts to a new line of the reply and clear them
+	void AppendAndClear(const StringRef& reply, const char *name, const char *units) noexcept
+	{
+		reply.lcatf("%s (%u%s per bucket):", name, 1u << BucketWidthShift, units);
+		for (uint32_t& c : counts)
+		{
+			reply.catf(" %" PRIu32, c);
+			c = 0;
+		}
+	}
+
+private:
+	uint32_t counts[NumBuckets];
+};
+
+#endif /* SRC_HISTOGRAM_H_ */
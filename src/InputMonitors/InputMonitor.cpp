@@ -11,10 +11,22 @@
 #include <Hardware/IoPorts.h>
 #include <CAN/CanInterface.h>
 #include <CanMessageBuffer.h>
+#include <Movement/StepTimer.h>
+
+#if SUPPORT_DRIVERS
+# include <Movement/Move.h>
+#endif
+
+constexpr uint32_t SoftwareDebounceTicks = (StepTimer::StepClockRate * 3)/2000;	// how long we ignore edges after a state change when debouncing in software, about the same as the EIC debouncer
 
 InputMonitor * volatile InputMonitor::monitorsList = nullptr;
 InputMonitor * volatile InputMonitor::freeList = nullptr;
 ReadWriteLock InputMonitor::listLock;
+uint32_t InputMonitor::numChangesSent = 0;
+uint32_t InputMonitor::totalReportingDelay = 0;
+uint32_t InputMonitor::maxReportingDelay = 0;
+uint32_t InputMonitor::numFramesSent = 0;
+uint32_t InputMonitor::aggregationWindow = 0;
 
 bool InputMonitor::Activate() noexcept
 {
@@ -27,7 +39,13 @@ bool InputMonitor::Activate() noexcept
 			const irqflags_t flags = IrqSave();
 			ok = port.AttachInterrupt(CommonDigitalPortInterrupt, InterruptMode::change, CallbackParameter(this));
 			state = port.ReadDigital();
+			whenLastEdge = StepTimer::GetTimerTicks() - SoftwareDebounceTicks;
+			recheckDue = false;
 			IrqRestore(flags);
+			if (filter != InputFilter::none)
+			{
+				(void)ApplyFilter();						// attaching the interrupt may have reset the EIC filter settings
+			}
 		}
 		else
 		{
@@ -69,31 +87,100 @@ uint16_t InputMonitor::GetAnalogValue() const noexcept
 				: 0;
 }
 
+// Record a change of state, timestamped by the step clock. Called from an ISR.
+void InputMonitor::RecordStateChange(bool newState) noexcept
+{
+	const uint32_t now = StepTimer::GetTimerTicks();
+	state = newState;
+	if (active)
+	{
+#if SUPPORT_DRIVERS
+		// If this input is an endstop or probe for local drivers then stop them now, provided that the executing move was scheduled after the stop was armed.
+		// The main board will still tell us to stop them when it receives the state change.
+		if (newState && driversToStop != 0 && moveInstance->StopDriversAndGetPositions(driversToStop, firstMoveToStop, stopPositions))
+		{
+			stoppedDrivers = driversToStop;
+			driversToStop = 0;						// the stop has fired, so disarm it
+			haveStopPositions = true;
+		}
+#endif
+		unsigned int index = numPendingChanges;
+		if (index == MaxPendingChanges)
+		{
+			--index;								// no room, so replace the last change we recorded
+		}
+		else
+		{
+			numPendingChanges = index + 1;
+		}
+		changeTimes[index] = now;
+		if (newState)
+		{
+			changeStates |= 1u << index;
+		}
+		else
+		{
+			changeStates &= ~(1u << index);
+		}
+		sendDue = true;
+		CanInterface::WakeAsyncSenderFromIsr();
+	}
+}
+
 void InputMonitor::DigitalInterrupt() noexcept
 {
+	// When debouncing in software we report the first edge immediately, then ignore edges until the input has had time to settle and read it again then
+	if (softwareDebounce && StepTimer::GetTimerTicks() - whenLastEdge < SoftwareDebounceTicks)
+	{
+		recheckDue = true;
+		CanInterface::WakeAsyncSenderFromIsr();
+		return;
+	}
+
 	const bool newState = port.ReadDigital();
 	if (newState != state)
 	{
-		state = newState;
-		if (active)
-		{
-			sendDue = true;
-			CanInterface::WakeAsyncSenderFromIsr();
-		}
+		whenLastEdge = StepTimer::GetTimerTicks();
+		RecordStateChange(newState);
+	}
+}
+
+// Set up the EIC filter or debouncer for a digital input, falling back to debouncing in software if the hardware can't do it.
+// Return false if a glitch filter was requested but the pin doesn't have one.
+bool InputMonitor::ApplyFilter() noexcept
+{
+	softwareDebounce = false;
+	if (threshold == 0 && !port.SetInterruptFilter(filter == InputFilter::glitch, filter == InputFilter::debounce))
+	{
+		softwareDebounce = (filter == InputFilter::debounce);
+		return filter != InputFilter::glitch;
 	}
+	return true;
 }
 
+const char *InputMonitor::GetFilterName() const noexcept
+{
+	return (filter == InputFilter::glitch) ? "glitch filter"
+			: (filter == InputFilter::none) ? "no filter"
+				: (softwareDebounce) ? "software debounce"
+					: "hardware debounce";
+}
+
+// Set the window for an analog input. The hysteresis is split either side of the threshold, so with zero hysteresis the behaviour is a simple comparison with the threshold.
+void InputMonitor::SetWindow() noexcept
+{
+	const uint16_t below = hysteresis/2;
+	const uint16_t above = hysteresis - below;
+	windowLow = (threshold > below) ? threshold - below : 1;
+	windowHigh = (threshold < 0xFFFF - above) ? threshold + above : 0xFFFF;
+}
+
+// Process an analog reading. Like the ADC window comparator, we only compare the reading with the one window limit that the current state makes relevant.
 void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 {
-	const bool newState = reading >= threshold;
-	if (newState != state)
+	if ((state) ? reading < windowLow : reading >= windowHigh)
 	{
-		state = newState;
-		if (active)
-		{
-			sendDue = true;
-			CanInterface::WakeAsyncSenderFromIsr();
-		}
+		RecordStateChange(!state);
 	}
 }
 
@@ -132,6 +219,11 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 		if (current->handle == hndl)
 		{
 			current->Deactivate();
+			if (current->filter != InputFilter::none)
+			{
+				current->filter = InputFilter::none;
+				(void)current->ApplyFilter();			// don't leave the EIC filtering the pin for its next user
+			}
 			current->port.Release();
 			if (prev == nullptr)
 			{
@@ -175,7 +267,18 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 	newMonitor->state = false;
 	newMonitor->minInterval = msg.minInterval;
 	newMonitor->threshold = msg.threshold;
+	newMonitor->hysteresis = 0;
+	newMonitor->SetWindow();
+	newMonitor->filter = InputFilter::none;
+	newMonitor->softwareDebounce = false;
+	newMonitor->recheckDue = false;
 	newMonitor->sendDue = false;
+	newMonitor->numPendingChanges = 0;
+#if SUPPORT_DRIVERS
+	newMonitor->driversToStop = newMonitor->stoppedDrivers = 0;
+	newMonitor->firstMoveToStop = 0;
+	newMonitor->haveStopPositions = false;
+#endif
 	String<StringLength50> pinName;
 	pinName.copy(msg.pinName, msg.GetMaxPinNameLength(dataLength));
 	if (newMonitor->port.AssignPort(pinName.c_str(), reply, PinUsedBy::endstop, (msg.threshold == 0) ? PinAccess::read : PinAccess::readAnalog))
@@ -234,11 +337,19 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 	case CanMessageChangeInputMonitor::actionReturnPinName:
 		m->port.AppendPinName(reply);
 		reply.catf(", min interval %ums", m->minInterval);
+		if (m->filter != InputFilter::none)
+		{
+			reply.catf(", %s", m->GetFilterName());
+		}
+#if SUPPORT_DRIVERS
+		m->AppendLocalStopDetails(reply);
+#endif
 		rslt = GCodeResult::ok;
 		break;
 
 	case CanMessageChangeInputMonitor::actionChangeThreshold:
 		m->threshold = msg.param;
+		m->SetWindow();
 		rslt = GCodeResult::ok;
 		break;
 
@@ -257,7 +368,8 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 	return rslt;
 }
 
-// Check the input monitors and add any pending ones to the message
+// Check the input monitors and add any pending ones to the message.
+// Each monitor may contribute several entries, one for each state change since we last sent it, in the order in which they happened.
 // Return the number of ticks before we should be woken again, or TaskBase::TimeoutUnlimited if we shouldn't be work until an input changes state
 /*static*/ uint32_t InputMonitor::AddStateChanges(CanMessageInputChanged *msg) noexcept
 {
@@ -265,26 +377,114 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 	ReadLocker lock(listLock);
 
 	const uint32_t now = millis();
+	if (aggregationWindow != 0)
+	{
+		// Hold the changes back until the oldest one that we could send has waited for the aggregation window, so that a burst of changes goes in one message
+		bool haveChange = false;
+		uint32_t oldestAge = 0;
+		const uint32_t ticksNow = StepTimer::GetTimerTicks();
+		for (InputMonitor *p = monitorsList; p != nullptr; p = p->next)
+		{
+			if (p->sendDue && p->numPendingChanges != 0 && now - p->whenLastSent >= p->minInterval)
+			{
+				const uint32_t age = ticksNow - p->changeTimes[0];
+				haveChange = true;
+				if (age > oldestAge)
+				{
+					oldestAge = age;
+				}
+			}
+		}
+		if (haveChange && oldestAge < aggregationWindow)
+		{
+			// Round the time to wait up to a whole number of ticks, and check the other monitors when we wake up
+			return max<uint32_t>((((aggregationWindow - oldestAge) * 1000u) + StepTimer::StepClockRate - 1)/StepTimer::StepClockRate, 1);
+		}
+	}
+
 	for (InputMonitor *p = monitorsList; p != nullptr; p = p->next)
 	{
+		if (p->recheckDue)
+		{
+			// We ignored an edge while debouncing this input in software, so read it again once it has had time to settle
+			if (StepTimer::GetTimerTicks() - p->whenLastEdge >= SoftwareDebounceTicks)
+			{
+				InterruptCriticalSectionLocker ilock;
+				p->recheckDue = false;
+				const bool newState = p->port.ReadDigital();
+				if (newState != p->state)
+				{
+					p->whenLastEdge = StepTimer::GetTimerTicks();
+					p->RecordStateChange(newState);
+				}
+			}
+			else
+			{
+				timeToWait = 1;
+			}
+		}
+
 		if (p->sendDue)
 		{
 			const uint32_t age = now - p->whenLastSent;
 			if (age >= p->minInterval)
 			{
+				// Take a copy of the pending changes
+				uint32_t times[MaxPendingChanges];
+				uint8_t states;
+				unsigned int numChanges;
 				bool monitorState;
 				{
 					InterruptCriticalSectionLocker ilock;
 					p->sendDue = false;
 					monitorState = p->state;
+					numChanges = p->numPendingChanges;
+					states = p->changeStates;
+					memcpy(times, p->changeTimes, numChanges * sizeof(times[0]));
+					p->numPendingChanges = 0;
 				}
 
-				if (msg->AddEntry(p->handle, monitorState))
+				if (numChanges == 0)
+				{
+					// We shouldn't get here because sendDue is only set when a change is recorded, but if we do then send the current state
+					numChanges = 1;
+					states = (monitorState) ? 1 : 0;
+					times[0] = StepTimer::GetTimerTicks();
+				}
+
+				unsigned int numAdded = 0;
+				while (numAdded < numChanges && msg->AddEntry(p->handle, (states & (1u << numAdded)) != 0))
+				{
+					++numAdded;
+				}
+
+				const uint32_t sendTime = StepTimer::GetTimerTicks();
+				for (unsigned int i = 0; i < numAdded; ++i)
+				{
+					const uint32_t reportingDelay = sendTime - times[i];
+					++numChangesSent;
+					totalReportingDelay += reportingDelay;
+					if (reportingDelay > maxReportingDelay)
+					{
+						maxReportingDelay = reportingDelay;
+					}
+				}
+
+				if (numAdded != 0)
 				{
 					p->whenLastSent = now;
 				}
-				else
+
+				if (numAdded < numChanges)
 				{
+					// The message is full, so put back the changes we couldn't send. Any new changes recorded since we took the copy go after them.
+					InterruptCriticalSectionLocker ilock;
+					const unsigned int numLeft = numChanges - numAdded;
+					const unsigned int numNew = min<unsigned int>(p->numPendingChanges, MaxPendingChanges - numLeft);
+					memmove(p->changeTimes + numLeft, p->changeTimes, numNew * sizeof(times[0]));
+					p->changeStates = (uint8_t)((states >> numAdded) & ((1u << numLeft) - 1)) | (uint8_t)((p->changeStates & ((1u << numNew) - 1)) << numLeft);
+					memcpy(p->changeTimes, times + numAdded, numLeft * sizeof(times[0]));
+					p->numPendingChanges = numLeft + numNew;
 					p->sendDue = true;
 					return 1;
 				}
@@ -300,9 +500,186 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 			}
 		}
 	}
+
+	if (msg->numHandles != 0)
+	{
+		++numFramesSent;
+	}
 	return timeToWait;
 }
 
+// Report how long it takes us to send state changes. This includes any delay imposed by the minimum interval between reports.
+/*static*/ void InputMonitor::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Input state changes sent %" PRIu32 " in %" PRIu32 " messages", numChangesSent, numFramesSent);
+	if (numChangesSent != 0)
+	{
+		reply.catf(", delay mean %" PRIu32 "us max %" PRIu32 "us",
+					(uint32_t)(((uint64_t)totalReportingDelay * 1000000u)/((uint64_t)numChangesSent * StepTimer::StepClockRate)),
+					(uint32_t)(((uint64_t)maxReportingDelay * 1000000u)/StepTimer::StepClockRate));
+	}
+	if (aggregationWindow != 0)
+	{
+		reply.catf(", aggregation window %" PRIu32 "ms", (aggregationWindow * 1000u)/StepTimer::StepClockRate);
+	}
+	numChangesSent = totalReportingDelay = maxReportingDelay = numFramesSent = 0;
+}
+
+// Set how long to hold back a state change so that other changes that happen soon after it are sent in the same message.
+// This delays reporting the first change in a burst, so it is zero by default.
+/*static*/ GCodeResult InputMonitor::SetAggregationWindow(uint32_t millisecs, const StringRef& reply) noexcept
+{
+	constexpr uint32_t MaxAggregationWindow = 20;
+	if (millisecs > MaxAggregationWindow)
+	{
+		reply.printf("Aggregation window must not exceed %" PRIu32 "ms", MaxAggregationWindow);
+		return GCodeResult::error;
+	}
+	aggregationWindow = (millisecs * StepTimer::StepClockRate)/1000u;
+	reply.printf("Input state change aggregation window %" PRIu32 "ms", millisecs);
+	return GCodeResult::ok;
+}
+
+// Set the hysteresis of an analog input monitor in ADC counts, so that noise on a reading close to the threshold doesn't cause lots of state changes
+/*static*/ GCodeResult InputMonitor::SetHysteresis(uint16_t hndl, uint32_t p_hysteresis, const StringRef& reply) noexcept
+{
+	auto m = Find(hndl);
+	if (m.IsNull())
+	{
+		reply.printf("Board %u does not have input handle %04x", CanInterface::GetCanAddress(), hndl);
+		return GCodeResult::error;
+	}
+	if (m->threshold == 0)
+	{
+		reply.printf("Input handle %04x is not an analog input", hndl);
+		return GCodeResult::error;
+	}
+
+	m->hysteresis = (uint16_t)min<uint32_t>(p_hysteresis, 0xFFFF);
+	m->SetWindow();
+	reply.printf("Input handle %04x threshold %u hysteresis %u", hndl, m->threshold, m->hysteresis);
+	return GCodeResult::ok;
+}
+
+// Set the filtering of a digital input monitor: 0 = none, 1 = EIC glitch filter, 2 = debounce, in hardware if possible
+/*static*/ GCodeResult InputMonitor::SetFilter(uint16_t hndl, uint32_t p_filter, const StringRef& reply) noexcept
+{
+	auto m = Find(hndl);
+	if (m.IsNull())
+	{
+		reply.printf("Board %u does not have input handle %04x", CanInterface::GetCanAddress(), hndl);
+		return GCodeResult::error;
+	}
+	if (m->threshold != 0)
+	{
+		reply.printf("Input handle %04x is not a digital input", hndl);
+		return GCodeResult::error;
+	}
+	if (p_filter > (uint32_t)InputFilter::debounce)
+	{
+		reply.copy("Filter must be 0 (none), 1 (glitch filter) or 2 (debounce)");
+		return GCodeResult::error;
+	}
+
+	m->filter = (InputFilter)p_filter;
+	if (!m->ApplyFilter())
+	{
+		m->filter = InputFilter::none;
+		reply.printf("Input handle %04x pin has no hardware filter", hndl);
+		return GCodeResult::error;
+	}
+	reply.printf("Input handle %04x %s", hndl, m->GetFilterName());
+	return GCodeResult::ok;
+}
+
+#if SUPPORT_DRIVERS
+
+void InputMonitor::AppendLocalStopDetails(const StringRef& reply) const noexcept
+{
+	if (driversToStop != 0)
+	{
+		reply.catf(", stops local drivers %04x in moves from %" PRIu32, driversToStop, firstMoveToStop);
+	}
+	if (haveStopPositions)
+	{
+		reply.catf(", stopped local drivers %04x at", stoppedDrivers);
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			if (stoppedDrivers & (1u << driver))
+			{
+				reply.catf(" %u:%" PRIi32, driver, stopPositions[driver]);
+			}
+		}
+	}
+}
+
+// Arm an input monitor to stop the specified local drivers directly when it next triggers during a move scheduled from now on, or disarm it if drivers is zero.
+// This saves the CAN round trip to the main board and back when homing or probing with an endstop or probe connected to the same board as the motors.
+/*static*/ GCodeResult InputMonitor::SetLocalStop(uint16_t hndl, uint32_t drivers, const StringRef& reply) noexcept
+{
+	if (drivers >= (1u << NumDrivers))
+	{
+		reply.printf("Board %u has only %u drivers", CanInterface::GetCanAddress(), NumDrivers);
+		return GCodeResult::error;
+	}
+
+	auto m = Find(hndl);
+	if (m.IsNull())
+	{
+		reply.printf("Board %u does not have input handle %04x", CanInterface::GetCanAddress(), hndl);
+		return GCodeResult::error;
+	}
+
+	{
+		AtomicCriticalSectionLocker lock;
+		m->driversToStop = (uint16_t)drivers;
+		m->firstMoveToStop = moveInstance->GetScheduledMoves();
+		m->haveStopPositions = false;
+	}
+	reply.printf("Input handle %04x", hndl);
+	if (drivers == 0)
+	{
+		reply.cat(" does not stop any local drivers");
+	}
+	else
+	{
+		m->AppendLocalStopDetails(reply);
+	}
+	return GCodeResult::ok;
+}
+
+/*static*/ bool InputMonitor::GetState(uint16_t hndl, bool& state) noexcept
+{
+	auto m = Find(hndl);
+	if (m.IsNull())
+	{
+		return false;
+	}
+	state = m->state;
+	return true;
+}
+
+// If the input has stopped the local drivers since we last called this, copy the positions at which they stopped and return true
+/*static*/ bool InputMonitor::TakeLocalStopPositions(uint16_t hndl, int32_t positions[NumDrivers]) noexcept
+{
+	auto m = Find(hndl);
+	if (m.IsNull())
+	{
+		return false;
+	}
+
+	AtomicCriticalSectionLocker lock;
+	if (!m->haveStopPositions)
+	{
+		return false;
+	}
+	memcpy(positions, m->stopPositions, sizeof(m->stopPositions));
+	m->haveStopPositions = false;
+	return true;
+}
+
+#endif
+
 // Read the specified inputs. The incoming message is a CanMessageReadInputsRequest. We return a CanMessageReadInputsReply in the same buffer.
 /*static*/ void InputMonitor::ReadInputs(CanMessageBuffer *buf) noexcept
 {
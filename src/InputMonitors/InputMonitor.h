@@ -29,16 +29,34 @@ public:
 
 	static uint32_t AddStateChanges(CanMessageInputChanged *msg) noexcept;
 	static void ReadInputs(CanMessageBuffer *buf) noexcept;
+	static void Diagnostics(const StringRef& reply) noexcept;
+	static GCodeResult SetHysteresis(uint16_t hndl, uint32_t p_hysteresis, const StringRef& reply) noexcept;
+	static GCodeResult SetFilter(uint16_t hndl, uint32_t p_filter, const StringRef& reply) noexcept;
+	static GCodeResult SetAggregationWindow(uint32_t millisecs, const StringRef& reply) noexcept;
+#if SUPPORT_DRIVERS
+	static GCodeResult SetLocalStop(uint16_t hndl, uint32_t drivers, const StringRef& reply) noexcept;
+	static bool GetState(uint16_t hndl, bool& state) noexcept;						// get the current state of an input, returning false if there is no such handle
+	static bool TakeLocalStopPositions(uint16_t hndl, int32_t positions[NumDrivers]) noexcept;	// get the positions at which the input last stopped the local drivers, if it has done so since we last asked
+#endif
 
 	static void CommonDigitalPortInterrupt(CallbackParameter cbp) noexcept;
 	static void CommonAnalogPortInterrupt(CallbackParameter cbp, uint16_t reading) noexcept;
 
 private:
+	enum class InputFilter : uint8_t { none = 0, glitch, debounce };
+
 	bool Activate() noexcept;
 	void Deactivate() noexcept;
 	void DigitalInterrupt() noexcept;
 	void AnalogInterrupt(uint16_t reading) noexcept;
 	uint16_t GetAnalogValue() const noexcept;
+	void RecordStateChange(bool newState) noexcept;
+	void SetWindow() noexcept;
+	bool ApplyFilter() noexcept;
+	const char *GetFilterName() const noexcept;
+#if SUPPORT_DRIVERS
+	void AppendLocalStopDetails(const StringRef& reply) const noexcept;
+#endif
 
 	static bool Delete(uint16_t hndl) noexcept;
 	static ReadLockedPointer<InputMonitor> Find(uint16_t hndl) noexcept;
@@ -49,10 +67,41 @@ private:
 	uint16_t handle;
 	uint16_t minInterval;
 	uint16_t threshold;
+	uint16_t hysteresis;							// for analog inputs, how far on the other side of the threshold the reading must be for the state to change back
+	volatile uint16_t windowLow;					// for analog inputs, the state changes to false when the reading falls below this
+	volatile uint16_t windowHigh;					// for analog inputs, the state changes to true when the reading reaches this
+	uint32_t whenLastEdge;							// step clock time of the last state change, used when debouncing in software
+	InputFilter filter;
+	bool softwareDebounce;							// true if we are debouncing in software because the EIC can't do it for this pin
+	volatile bool recheckDue;						// true if we ignored an edge while debouncing in software, so we must read the input again when the debounce time ends
 	bool active;
 	volatile bool state;
 	volatile bool sendDue;
 
+	// State changes not yet sent, so that we report every transition in order even if an input changes state more than once before we can send it
+	static constexpr size_t MaxPendingChanges = 4;
+	uint32_t changeTimes[MaxPendingChanges];		// step clock times of the changes
+	uint8_t changeStates;							// bit N is the new state of change N
+	volatile uint8_t numPendingChanges;
+
+#if SUPPORT_DRIVERS
+	// Local drivers to stop as soon as this input is triggered, without waiting for the main board to tell us to.
+	// Only moves scheduled after the stop was armed are stopped, and the stop disarms itself when it fires.
+	volatile uint16_t driversToStop;
+	uint16_t stoppedDrivers;						// the drivers that the stop positions are for
+	uint32_t firstMoveToStop;						// the number of the first move that the stop applies to
+	volatile bool haveStopPositions;
+	int32_t stopPositions[NumDrivers];				// machine positions in steps at which the drivers stopped when the input last triggered
+#endif
+
+	// Statistics of the delay between a state change and sending it
+	static uint32_t numChangesSent;
+	static uint32_t totalReportingDelay;			// in step clocks
+	static uint32_t maxReportingDelay;
+	static uint32_t numFramesSent;
+
+	static uint32_t aggregationWindow;				// how long in step clocks to hold a state change back so that other changes can be sent in the same message
+
 	static InputMonitor * volatile monitorsList;
 	static InputMonitor * volatile freeList;
 
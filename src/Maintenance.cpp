@@ -0,0 +1,301 @@
+/*
+ * Maintenance.cpp
+ */
+
+#include "Maintenance.h"
+#include "Platform.h"
+#include <Hardware/NonVolatileMemory.h>
+#include <Heating/Heat.h>
+#include <Fans/FansManager.h>
+#include <CommandProcessing/CompactDiagnostics.h>
+
+#if SUPPORT_DRIVERS
+# include <Movement/Move.h>
+# include <Movement/StepRateProfiler.h>
+# include <Movement/StepTimer.h>
+#endif
+
+namespace Maintenance
+{
+	constexpr uint32_t SampleIntervalMillis = 1000;
+	constexpr uint32_t SaveIntervalMillis = 60 * 60 * 1000;			// how often we save the counters
+	constexpr float FullSpeedPwm = 0.99;								// the PWM at or above which we use the fan speed to look for wear
+	constexpr uint32_t MinFullSpeedSamples = 60;						// how many seconds a fan must run at full speed between saves for us to update its recent speed
+	constexpr unsigned int NumHeaters = (MaxHeaters < MaintenanceCounters::MaxHeaters) ? MaxHeaters : MaintenanceCounters::MaxHeaters;
+	constexpr unsigned int NumFans = (MaxFans < MaintenanceCounters::MaxFans) ? MaxFans : MaintenanceCounters::MaxFans;
+
+	static MaintenanceCounters savedCounters;							// the counters as last read or saved
+	static bool loaded = false;
+	static uint32_t lastSampleMillis;
+	static uint32_t lastSaveMillis;
+
+#if SUPPORT_DRIVERS
+	static_assert(NumDrivers <= MaintenanceCounters::MaxDrivers);
+	constexpr uint32_t StepClocksPerMilli = StepTimer::StepClockRate/1000;
+
+	static uint64_t savedTravelSteps[NumDrivers] = { 0 };				// the step totals that are included in savedCounters
+	static uint64_t savedMovingClocks[NumDrivers] = { 0 };
+#endif
+
+	// The amounts accumulated since the counters were last saved
+	static uint32_t unsavedHeaterOnSeconds[NumHeaters] = { 0 };
+	static float unsavedHeaterFullPowerSeconds[NumHeaters] = { 0.0 };
+	static uint32_t unsavedFanRunSeconds[NumFans] = { 0 };
+	static uint32_t fullSpeedRpmTotals[NumFans] = { 0 };
+	static uint32_t fullSpeedSamples[NumFans] = { 0 };
+
+	static void Sample() noexcept;
+	static void AddUnsaved(MaintenanceCounters& counters, bool commit) noexcept;
+	static void Save() noexcept;
+	static void GetCurrentCounters(MaintenanceCounters& counters) noexcept;
+}
+
+// Add the amounts accumulated since the last save to the counters. If 'commit' is true then the counters are about to be saved, so clear those amounts.
+void Maintenance::AddUnsaved(MaintenanceCounters& counters, bool commit) noexcept
+{
+#if SUPPORT_DRIVERS
+	int64_t netSteps[NumDrivers];
+	uint64_t travelSteps[NumDrivers];
+	moveInstance->GetStepTotals(netSteps, travelSteps);
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		MaintenanceCounters::DriverCounters& dc = counters.drivers[driver];
+		dc.travelMicrons += (uint64_t)((double)(travelSteps[driver] - savedTravelSteps[driver]) * 1000.0/(double)Platform::DriveStepsPerUnit(driver));
+		const uint64_t newMillis = (StepRateProfiler::GetTotalMovingClocks(driver) - savedMovingClocks[driver])/StepClocksPerMilli;
+		dc.movingMillis += newMillis;
+		if (commit)
+		{
+			savedTravelSteps[driver] = travelSteps[driver];
+			savedMovingClocks[driver] += newMillis * StepClocksPerMilli;		// keep the part millisecond for next time
+		}
+	}
+#endif
+
+	for (size_t heater = 0; heater < NumHeaters; ++heater)
+	{
+		MaintenanceCounters::HeaterCounters& hc = counters.heaters[heater];
+		const uint32_t fullPowerSeconds = (uint32_t)unsavedHeaterFullPowerSeconds[heater];
+		hc.onSeconds += unsavedHeaterOnSeconds[heater];
+		hc.fullPowerSeconds += fullPowerSeconds;
+		if (commit)
+		{
+			unsavedHeaterOnSeconds[heater] = 0;
+			unsavedHeaterFullPowerSeconds[heater] -= (float)fullPowerSeconds;
+		}
+	}
+
+	for (size_t fan = 0; fan < NumFans; ++fan)
+	{
+		MaintenanceCounters::FanCounters& fc = counters.fans[fan];
+		fc.runSeconds += unsavedFanRunSeconds[fan];
+		if (fullSpeedSamples[fan] >= MinFullSpeedSamples)
+		{
+			fc.recentRpm = (uint16_t)min<uint32_t>(fullSpeedRpmTotals[fan]/fullSpeedSamples[fan], UINT16_MAX);
+			if (fc.baselineRpm == 0)
+			{
+				fc.baselineRpm = fc.recentRpm;
+			}
+		}
+		if (commit)
+		{
+			unsavedFanRunSeconds[fan] = 0;
+			if (fullSpeedSamples[fan] >= MinFullSpeedSamples)
+			{
+				fullSpeedRpmTotals[fan] = fullSpeedSamples[fan] = 0;
+			}
+		}
+	}
+}
+
+void Maintenance::GetCurrentCounters(MaintenanceCounters& counters) noexcept
+{
+	counters = savedCounters;
+	AddUnsaved(counters, false);
+}
+
+void Maintenance::Save() noexcept
+{
+	AddUnsaved(savedCounters, true);
+	++savedCounters.numSaves;
+	NonVolatileMemory mem(NvmPage::maintenance);
+	mem.SetMaintenanceCounters(savedCounters);
+	mem.EnsureWritten();
+	lastSaveMillis = millis();
+}
+
+// Record one second of use of the heaters and fans
+void Maintenance::Sample() noexcept
+{
+	for (size_t heater = 0; heater < NumHeaters; ++heater)
+	{
+		// Go by the heater mode, because the average PWM takes a while to decay after the heater is switched off
+		if (Heat::IsHeaterOn(heater))
+		{
+			++unsavedHeaterOnSeconds[heater];
+			unsavedHeaterFullPowerSeconds[heater] += Heat::GetAveragePWM(heater);
+		}
+	}
+
+	for (size_t fan = 0; fan < NumFans; ++fan)
+	{
+		float pwm;
+		int32_t rpm;
+		if (FansManager::GetFanState(fan, pwm, rpm) && pwm > 0.0)
+		{
+			++unsavedFanRunSeconds[fan];
+			if (pwm >= FullSpeedPwm && rpm > 0)
+			{
+				fullSpeedRpmTotals[fan] += (uint32_t)rpm;
+				++fullSpeedSamples[fan];
+			}
+		}
+	}
+}
+
+void Maintenance::Spin() noexcept
+{
+	const uint32_t now = millis();
+	if (!loaded)
+	{
+		NonVolatileMemory mem(NvmPage::maintenance);
+		mem.GetMaintenanceCounters(savedCounters);
+		lastSampleMillis = lastSaveMillis = now;
+		loaded = true;
+	}
+	else if (now - lastSampleMillis >= SampleIntervalMillis)
+	{
+		// If we were held up for a long time, only count one sample rather than catching up, because the heaters and fans may have changed
+		lastSampleMillis = (now - lastSampleMillis >= 2 * SampleIntervalMillis) ? now : lastSampleMillis + SampleIntervalMillis;
+		Sample();
+		if (now - lastSaveMillis >= SaveIntervalMillis)
+		{
+			Save();
+		}
+	}
+}
+
+GCodeResult Maintenance::Command(unsigned int action, uint32_t fansBitmap, const StringRef& reply) noexcept
+{
+	if (!loaded)
+	{
+		reply.copy("Maintenance counters not loaded yet");
+		return GCodeResult::error;
+	}
+
+	if (action == 2)
+	{
+		for (size_t fan = 0; fan < NumFans; ++fan)
+		{
+			if (fansBitmap & (1u << fan))
+			{
+				savedCounters.fans[fan].baselineRpm = savedCounters.fans[fan].recentRpm = 0;
+				fullSpeedRpmTotals[fan] = fullSpeedSamples[fan] = 0;
+			}
+		}
+	}
+	if (action != 0)
+	{
+		Save();
+	}
+
+	MaintenanceCounters counters;
+	GetCurrentCounters(counters);
+	reply.printf("Maintenance counters, saved %" PRIu32 " times:", counters.numSaves);
+#if SUPPORT_DRIVERS
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		reply.lcatf("Driver %u: travelled %.1fm, moving %.1fh",
+					driver, (double)counters.drivers[driver].travelMicrons * 1.0e-6, (double)counters.drivers[driver].movingMillis * (1.0/3600000.0));
+	}
+#endif
+	for (size_t heater = 0; heater < NumHeaters; ++heater)
+	{
+		const MaintenanceCounters::HeaterCounters& hc = counters.heaters[heater];
+		if (hc.onSeconds != 0)
+		{
+			reply.lcatf("Heater %u: on %.1fh, average duty %" PRIu32 "%%",
+						heater, (double)hc.onSeconds * (1.0/3600.0), (uint32_t)(((uint64_t)hc.fullPowerSeconds * 100u)/hc.onSeconds));
+		}
+	}
+	for (size_t fan = 0; fan < NumFans; ++fan)
+	{
+		const MaintenanceCounters::FanCounters& fc = counters.fans[fan];
+		if (fc.runSeconds != 0)
+		{
+			reply.lcatf("Fan %u: run %.1fh", fan, (double)fc.runSeconds * (1.0/3600.0));
+			if (fc.baselineRpm != 0)
+			{
+				reply.catf(", full speed %uRPM when new, %uRPM recently (%d%%)",
+							fc.baselineRpm, fc.recentRpm, (int)(((int32_t)fc.recentRpm - (int32_t)fc.baselineRpm) * 100)/(int)fc.baselineRpm);
+			}
+		}
+	}
+	return GCodeResult::ok;
+}
+
+// Append the number of saves, then for each driver a compound field of the metres travelled and the seconds moving,
+// then a bitmap of the heaters that have been used followed by a compound field of the seconds on and the average duty in tenths of a percent for each of them,
+// then a bitmap of the fans that have been used followed by a compound field of the seconds run, the baseline full speed RPM and the recent full speed RPM for each of them.
+void Maintenance::AppendCompactDiagnostics(CompactDiagnostics& diags) noexcept
+{
+	MaintenanceCounters counters;
+	if (loaded)
+	{
+		GetCurrentCounters(counters);
+	}
+	else
+	{
+		memset(&counters, 0, sizeof(counters));
+	}
+
+	diags.StartSection('W');
+	diags.Add(counters.numSaves);
+#if SUPPORT_DRIVERS
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		diags.Add((uint32_t)(counters.drivers[driver].travelMicrons/1000000u));
+		diags.AddPart((uint32_t)(counters.drivers[driver].movingMillis/1000u));
+	}
+#endif
+
+	uint32_t heatersUsed = 0;
+	for (size_t heater = 0; heater < NumHeaters; ++heater)
+	{
+		if (counters.heaters[heater].onSeconds != 0)
+		{
+			heatersUsed |= 1u << heater;
+		}
+	}
+	diags.Add(heatersUsed);
+	for (size_t heater = 0; heater < NumHeaters; ++heater)
+	{
+		const MaintenanceCounters::HeaterCounters& hc = counters.heaters[heater];
+		if (hc.onSeconds != 0)
+		{
+			diags.Add(hc.onSeconds);
+			diags.AddPart((uint32_t)(((uint64_t)hc.fullPowerSeconds * 1000u)/hc.onSeconds));
+		}
+	}
+
+	uint32_t fansUsed = 0;
+	for (size_t fan = 0; fan < NumFans; ++fan)
+	{
+		if (counters.fans[fan].runSeconds != 0)
+		{
+			fansUsed |= 1u << fan;
+		}
+	}
+	diags.Add(fansUsed);
+	for (size_t fan = 0; fan < NumFans; ++fan)
+	{
+		const MaintenanceCounters::FanCounters& fc = counters.fans[fan];
+		if (fc.runSeconds != 0)
+		{
+			diags.Add(fc.runSeconds);
+			diags.AddPart(fc.baselineRpm);
+			diags.AddPart(fc.recentRpm);
+		}
+	}
+}
+
+// End
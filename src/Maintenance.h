@@ -0,0 +1,27 @@
+/*
+ * Maintenance.h
+ *
+ *  Odometer and duty counters for the motors, heaters and fans on this board, which persist over a reset so that they can be used to schedule maintenance.
+ *  Heaters and fans are counted by their numbers, so only those numbered below the MaintenanceCounters limits are counted.
+ *  The counters are accumulated in RAM and saved to non-volatile memory once an hour to limit the wear, so up to an hour of use is lost when the power is removed.
+ */
+
+#ifndef SRC_MAINTENANCE_H_
+#define SRC_MAINTENANCE_H_
+
+#include <RepRapFirmware.h>
+
+class CompactDiagnostics;
+
+namespace Maintenance
+{
+	// Sample the heaters and fans once a second and save the counters when they are due
+	void Spin() noexcept;
+
+	// Report the counters. If action is 1 then save them first, if it is 2 then forget the baseline speeds of the fans in fansBitmap so that they are measured again.
+	GCodeResult Command(unsigned int action, uint32_t fansBitmap, const StringRef& reply) noexcept;
+
+	void AppendCompactDiagnostics(CompactDiagnostics& diags) noexcept;
+}
+
+#endif /* SRC_MAINTENANCE_H_ */
@@ -13,9 +13,14 @@
 #include "Move.h"
 #include "Kinematics/LinearDeltaKinematics.h"		// for DELTA_AXES
 #include "CanMessageFormats.h"
+#include "Math/Isqrt.h"
 #include <CAN/CanInterface.h>
 #include <limits>
 
+#if SUPPORT_ACCELEROMETERS
+# include <CommandProcessing/AccelerometerHandler.h>
+#endif
+
 #ifdef DUET_NG
 # define DDA_MOVE_DEBUG	(0)
 #else
@@ -85,6 +90,7 @@ static size_t savedMovePointer = 0;
 #endif
 
 unsigned int DDA::stepErrors = 0;
+uint32_t DDA::stepErrorReasonCounts[(size_t)StepErrorReason::numReasons] = { 0 };
 uint32_t DDA::maxTicksOverdue = 0;
 uint32_t DDA::maxOverdueIncrement = 0;
 
@@ -93,11 +99,25 @@ uint32_t DDA::stepsDone[NumDrivers];
 
 DDA::DDA(DDA* n) : next(n), prev(nullptr), state(empty)
 {
+	// Check that the fields used by the step ISR are still packed together at the start
+	static_assert(offsetof(DDA, afterPrepare) + sizeof(afterPrepare) <= HotFieldsSize);
+#if SINGLE_DRIVER
+	static_assert(offsetof(DDA, ddms) <= HotFieldsSize);
+	static_assert(offsetof(DDA, ddms) % alignof(DriveMovement) == 0);
+#else
+	static_assert(offsetof(DDA, pddms) + sizeof(pddms) <= HotFieldsSize);
+#endif
+	static_assert(offsetof(DDA, endPoint) > offsetof(DDA, afterPrepare));
+
 	for (size_t i = 0; i < NumDrivers; ++i)
 	{
 		endPoint[i] = 0;
+#if SINGLE_DRIVER
 		ddms[i].state = DMState::idle;
 		ddms[i].drive = i;
+#else
+		pddms[i] = nullptr;
+#endif
 	}
 }
 
@@ -113,6 +133,35 @@ pre(state == executing || state == frozen || state == completed)
 
 #if !SINGLE_DRIVER
 
+# if USE_DM_SCAN
+
+// Add the specified drive to the set of drives that need steps
+inline void DDA::InsertDM(DriveMovement *dm)
+{
+	scannedDMs |= 1u << dm->drive;
+	if (activeDMs == nullptr || dm->nextStepTime < activeDMs->nextStepTime)
+	{
+		activeDMs = dm;
+	}
+}
+
+// Set activeDMs to the drive in the set that needs a step soonest
+inline void DDA::FindFirstDM() noexcept
+{
+	DriveMovement *first = nullptr;
+	for (uint32_t dms = scannedDMs; dms != 0; dms &= dms - 1)
+	{
+		DriveMovement * const dm = pddms[__builtin_ctz(dms)];
+		if (first == nullptr || dm->nextStepTime < first->nextStepTime)
+		{
+			first = dm;
+		}
+	}
+	activeDMs = first;
+}
+
+# else
+
 // Insert the specified drive into the step list, in step time order.
 // We insert the drive before any existing entries with the same step time for best performance. Now that we generate step pulses
 // for multiple motors simultaneously, there is no need to preserve round-robin order.
@@ -127,10 +176,26 @@ inline void DDA::InsertDM(DriveMovement *dm)
 	*dmp = dm;
 }
 
+# endif
+
+// Calculate the next step time of a DM in the step list and copy it to any drivers that are following it
+inline void DDA::CalcNextStepTimes(DriveMovement& dm) noexcept
+{
+	(void)dm.CalcNextStepTime(*this);
+	for (uint32_t followers = dm.followers; followers != 0; followers &= followers - 1)
+	{
+		pddms[__builtin_ctz(followers)]->CopyStepsFrom(dm);
+	}
+}
+
 // Remove this drive from the list of drives with steps due
 // Called from the step ISR only.
 void DDA::RemoveDM(size_t drive)
 {
+# if USE_DM_SCAN
+	scannedDMs &= ~(1u << drive);
+	FindFirstDM();
+# else
 	DriveMovement **dmp = &activeDMs;
 	while (*dmp != nullptr)
 	{
@@ -142,6 +207,20 @@ void DDA::RemoveDM(size_t drive)
 		}
 		dmp = &(dm->nextDM);
 	}
+# endif
+}
+
+// Return all our DMs to the pool. Called only when the DDA is not executing.
+void DDA::ReleaseDMs() noexcept
+{
+	for (DriveMovement*& dm : pddms)
+	{
+		if (dm != nullptr)
+		{
+			DriveMovement::Release(dm);
+			dm = nullptr;
+		}
+	}
 }
 
 #endif
@@ -171,7 +250,11 @@ void DDA::DebugPrintAll() const
 	DebugPrint();
 	for (size_t axis = 0; axis < NumDrivers; ++axis)
 	{
-		ddms[axis].DebugPrint("ABCDEF"[axis]);
+		const DriveMovement * const dm = FindDM(axis);
+		if (dm != nullptr)
+		{
+			dm->DebugPrint("ABCDEF"[axis]);
+		}
 	}
 }
 
@@ -179,45 +262,120 @@ void DDA::DebugPrintAll() const
 void DDA::Init()
 {
 	state = empty;
+#if SINGLE_DRIVER
 	for (DriveMovement& ddm : ddms)
 	{
 		ddm.state = DMState::idle;
 	}
+#else
+	ReleaseDMs();
+#endif
+}
+
+// Do the calculations for a move that depend only on its CAN message, so that the move task can do them before there is a free DDA for the move
+/*static*/ void DDA::PlanMove(const CanMessageMovementLinear& msg, MovePlan& plan) noexcept
+{
+	// Calculate the speeds and accelerations assuming unit movement length
+	plan.clocksNeeded = msg.accelerationClocks + msg.steadyClocks + msg.decelClocks;
+	plan.topSpeed = 2.0/(2 * msg.steadyClocks + (msg.initialSpeedFraction + 1.0) * msg.accelerationClocks + (msg.finalSpeedFraction + 1.0) * msg.decelClocks);
+	plan.startSpeed = plan.topSpeed * msg.initialSpeedFraction;
+	plan.endSpeed = plan.topSpeed * msg.finalSpeedFraction;
+
+	plan.acceleration = (msg.accelerationClocks == 0) ? 1.0 : (plan.topSpeed * (1.0 - msg.initialSpeedFraction))/msg.accelerationClocks;
+	plan.deceleration = (msg.decelClocks == 0) ? 1.0 : (plan.topSpeed * (1.0 - msg.finalSpeedFraction))/msg.decelClocks;
+
+	// Calculate the distances as a fraction of the total movement length
+	plan.accelDistance = (msg.accelerationClocks == 0) ? 0.0
+							: (msg.accelerationClocks == plan.clocksNeeded) ? 1.0
+								: plan.topSpeed * (1.0 + msg.initialSpeedFraction) * msg.accelerationClocks * 0.5;
+	plan.decelDistance = (msg.decelClocks == 0) ? 0.0
+							: (msg.decelClocks == plan.clocksNeeded) ? 1.0
+								: plan.topSpeed * (1.0 + msg.finalSpeedFraction) * msg.decelClocks * 0.5;
+
+	// We must avoid getting negative distance in the following calculation because it messes up the calculation of twoDistanceToStopTimesCsquaredDivD in DriveMovement:Prepare
+	// The conditional code in calculating decelDistance should achieve that
+	plan.params.decelStartDistance = 1.0 - plan.decelDistance;
+	plan.startSpeedTimesCdivA = (uint32_t)roundU32(plan.startSpeed/plan.acceleration);
+#if DM_USE_FPU
+	plan.params.fTopSpeedTimesCdivD = plan.topSpeed/plan.deceleration;
+	plan.topSpeedTimesCdivDPlusDecelStartClocks = (uint32_t)plan.params.fTopSpeedTimesCdivD + msg.accelerationClocks + msg.steadyClocks;
+#else
+	plan.params.topSpeedTimesCdivD = (uint32_t)roundU32(plan.topSpeed/plan.deceleration);
+	plan.topSpeedTimesCdivDPlusDecelStartClocks = plan.params.topSpeedTimesCdivD + msg.accelerationClocks + msg.steadyClocks;
+#endif
+	plan.extraAccelerationClocks = msg.accelerationClocks - roundS32(plan.accelDistance/plan.topSpeed);
 }
 
-// Set up a real move. Return true if it represents real movement, else false.
-// Return true if it is a real move
-bool DDA::Init(const CanMessageMovementLinear& msg)
+// Set up a real move from its CAN message and the plan that PlanMove made from it. Return true if it represents real movement, else false.
+// enableDrives is false when we are preparing the move only to benchmark it
+bool DDA::Init(const CanMessageMovementLinear& msg, const MovePlan& plan, bool enableDrives)
 {
 	// 0. Initialise the endpoints, which are used for diagnostic purposes, and set up the DriveMovement objects
 	bool realMove = false;
 
+#if !SINGLE_DRIVER
+	ReleaseDMs();										// in case this DDA was used for benchmarking and not freed
+#endif
+
+	// We need the top speed now to work out whether to reduce the microstepping
+	topSpeed = plan.topSpeed;
+
 	const size_t numDrivers = min<size_t>(msg.numDrivers, NumDrivers);
+#if SUPPORT_MICROSTEP_REDUCTION
+	int32_t steps[NumDrivers];							// the steps for each drive after any microstep reduction, used to match up followers
+	uint8_t microstepReductions[NumDrivers];
+#endif
 	for (size_t drive = 0; drive < NumDrivers; drive++)
 	{
 		endPoint[drive] = prev->endPoint[drive];		// the steps for this move will be added later
-		DriveMovement& dm = ddms[drive];
-
-#if !SINGLE_DRIVER
-		dm.nextDM = nullptr;
-#endif
-		const int32_t delta = (drive < numDrivers) ? msg.perDrive[drive].steps : 0;
-		if (delta != 0)
+#if SUPPORT_MICROSTEP_REDUCTION
+		int32_t delta = (drive < numDrivers) ? msg.perDrive[drive].steps : 0;
+		microstepReductions[drive] = 0;
+		if (delta != 0 && enableDrives && (msg.pressureAdvanceDrives & (1u << drive)) == 0)
 		{
-			realMove = true;
-			dm.totalSteps = labs(delta);				// for now this is the number of net steps, but gets adjusted later if there is a reverse in direction
-			dm.direction = (delta >= 0);				// for now this is the direction of net movement, but gets adjusted later if it is a delta movement
-			stepsRequested[drive] += labs(delta);
-			dm.state = DMState::moving;
+			microstepReductions[drive] = moveInstance->AdjustStepsForMicrostepReduction(drive, delta, topSpeed * (float)labs(delta), msg.whenToExecute);
 		}
-		else
+		steps[drive] = delta;
+#else
+		const int32_t delta = (drive < numDrivers) ? msg.perDrive[drive].steps : 0;
+#endif
+#if SINGLE_DRIVER
+		DriveMovement& dm = ddms[drive];
+		if (delta == 0)
 		{
 			// Set up the steps so that GetStepsTaken will return zero
 			dm.totalSteps = 0;
 			dm.nextStep = 0;
 			dm.reverseStartStep = 1;
 			dm.state = DMState::idle;
+# if SUPPORT_MICROSTEP_REDUCTION
+			dm.microstepReduction = 0;
+# endif
+			continue;
+		}
+#else
+		if (delta == 0)
+		{
+			continue;									// drives without a DM report zero steps taken
 		}
+		DriveMovement * const pdm = DriveMovement::Allocate(drive);
+		if (pdm == nullptr)
+		{
+			// The caller should have checked that there were enough free DMs, so this should not happen
+			ReleaseDMs();
+			return false;
+		}
+		pddms[drive] = pdm;
+		DriveMovement& dm = *pdm;
+#endif
+		realMove = true;
+		dm.totalSteps = labs(delta);					// for now this is the number of net steps, but gets adjusted later if there is a reverse in direction
+		dm.direction = (delta >= 0);					// for now this is the direction of net movement, but gets adjusted later if it is a delta movement
+#if SUPPORT_MICROSTEP_REDUCTION
+		dm.microstepReduction = microstepReductions[drive];
+#endif
+		stepsRequested[drive] += labs(delta);
+		dm.state = DMState::moving;
 	}
 
 	// 2. Throw it away if there's no real movement.
@@ -226,53 +384,72 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 		return false;
 	}
 
+#if !SINGLE_DRIVER
+	// 2a. Drivers without pressure advance that have the same number of steps as an earlier one, for example multiple Z leadscrew motors, will be prepared identically.
+	// So let them follow the earlier one in the step ISR instead of calculating their own step times.
+	uint32_t followingDrivers = 0;
+	for (size_t drive = 1; drive < numDrivers; ++drive)
+	{
+		if (pddms[drive] != nullptr && (msg.pressureAdvanceDrives & (1u << drive)) == 0)
+		{
+			for (size_t leader = 0; leader < drive; ++leader)
+			{
+				if (   pddms[leader] != nullptr && (followingDrivers & (1u << leader)) == 0 && (msg.pressureAdvanceDrives & (1u << leader)) == 0
+#if SUPPORT_MICROSTEP_REDUCTION
+					&& steps[leader] == steps[drive] && microstepReductions[leader] == microstepReductions[drive]
+#else
+					&& msg.perDrive[leader].steps == msg.perDrive[drive].steps
+#endif
+				   )
+				{
+					pddms[leader]->followers |= 1u << drive;
+					followingDrivers |= 1u << drive;
+					break;
+				}
+			}
+		}
+	}
+#endif
+
 	// 3. Store some values
 	afterPrepare.moveStartTime = msg.whenToExecute;
-	clocksNeeded = msg.accelerationClocks + msg.steadyClocks + msg.decelClocks;
+	clocksNeeded = plan.clocksNeeded;
 	flags.isPrintingMove = (msg.pressureAdvanceDrives != 0);
 	flags.hadHiccup = false;
 	flags.goingSlow = false;
-
-	// Calculate the speeds and accelerations assuming unit movement length
-	topSpeed = 2.0/(2 * msg.steadyClocks + (msg.initialSpeedFraction + 1.0) * msg.accelerationClocks + (msg.finalSpeedFraction + 1.0) * msg.decelClocks);
-	startSpeed = topSpeed * msg.initialSpeedFraction;
-	endSpeed = topSpeed * msg.finalSpeedFraction;
-
-	acceleration = (msg.accelerationClocks == 0) ? 1.0 : (topSpeed * (1.0 - msg.initialSpeedFraction))/msg.accelerationClocks;
-	deceleration = (msg.decelClocks == 0) ? 1.0 : (topSpeed * (1.0 - msg.finalSpeedFraction))/msg.decelClocks;
-
-	// Calculate the distances as a fraction of the total movement length
-	accelDistance = (msg.accelerationClocks == 0) ? 0.0
-						: (msg.accelerationClocks == clocksNeeded) ? 1.0
-							: topSpeed * (1.0 + msg.initialSpeedFraction) * msg.accelerationClocks * 0.5;
-	decelDistance = (msg.decelClocks == 0) ? 0.0
-						: (msg.decelClocks == clocksNeeded) ? 1.0
-							: topSpeed * (1.0 + msg.finalSpeedFraction) * msg.decelClocks * 0.5;
-
-	PrepParams params;
-	// We must avoid getting negative distance in the following calculation because it messes up the calculation of twoDistanceToStopTimesCsquaredDivD in DriveMovement:Prepare
-	// The conditional code in calculating decelDistance should achieve that
-	params.decelStartDistance = 1.0 - decelDistance;
-	afterPrepare.startSpeedTimesCdivA = (uint32_t)roundU32(startSpeed/acceleration);
-#if DM_USE_FPU
-	params.fTopSpeedTimesCdivD = topSpeed/deceleration;
-	afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks = (uint32_t)params.fTopSpeedTimesCdivD + msg.accelerationClocks + msg.steadyClocks;
-#else
-	params.topSpeedTimesCdivD = (uint32_t)roundU32(topSpeed/deceleration);
-	afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks = params.topSpeedTimesCdivD + msg.accelerationClocks + msg.steadyClocks;
-#endif
-	afterPrepare.extraAccelerationClocks = msg.accelerationClocks - roundS32(accelDistance/topSpeed);
+	flags.directionChangePending = false;
+	flags.motionCalculated = false;
+	flags.stopping = false;
+
+	startSpeed = plan.startSpeed;
+	endSpeed = plan.endSpeed;
+	acceleration = plan.acceleration;
+	deceleration = plan.deceleration;
+	accelDistance = plan.accelDistance;
+	decelDistance = plan.decelDistance;
+
+	const PrepParams& params = plan.params;
+	afterPrepare.startSpeedTimesCdivA = plan.startSpeedTimesCdivA;
+	afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks = plan.topSpeedTimesCdivDPlusDecelStartClocks;
+	afterPrepare.extraAccelerationClocks = plan.extraAccelerationClocks;
 
 #if !SINGLE_DRIVER
 	activeDMs = nullptr;
+# if USE_DM_SCAN
+	scannedDMs = 0;
+# endif
 #endif
 
 	for (size_t drive = 0; drive < numDrivers; ++drive)
 	{
-		DriveMovement& dm = ddms[drive];
-		if (dm.state == DMState::moving)
+		DriveMovement * const pdm = FindDM(drive);
+		if (pdm != nullptr && pdm->state == DMState::moving)
 		{
-			Platform::EnableDrive(drive);
+			DriveMovement& dm = *pdm;
+			if (enableDrives)
+			{
+				Platform::EnableDrive(drive);
+			}
 			if ((msg.pressureAdvanceDrives & (1u << drive)) != 0)
 			{
 				// If there is any extruder jerk in this move, in theory that means we need to instantly extrude or retract some amount of filament.
@@ -308,7 +485,11 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 				}
 			}
 
+#if SUPPORT_MICROSTEP_REDUCTION
+			const uint32_t netSteps = ((dm.reverseStartStep < dm.totalSteps) ? (2 * dm.reverseStartStep) - dm.totalSteps : dm.totalSteps) << dm.microstepReduction;
+#else
 			const uint32_t netSteps = (dm.reverseStartStep < dm.totalSteps) ? (2 * dm.reverseStartStep) - dm.totalSteps : dm.totalSteps;
+#endif
 			if (dm.direction)
 			{
 				endPoint[drive] += netSteps;
@@ -322,6 +503,7 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 			dm.nextStep = 0;
 			dm.nextStepTime = 0;
 			dm.stepInterval = 999999;							// initialise to a large value so that we will calculate the time for just one step
+			dm.minStepInterval = UINT32_MAX;
 			dm.stepsTillRecalc = 0;							// so that we don't skip the calculation
 
 			const bool stepsToDo = dm.CalcNextStepTime(*this);
@@ -329,7 +511,10 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 			{
 				dm.directionChanged = false;
 #if !SINGLE_DRIVER
-				InsertDM(&dm);
+				if ((followingDrivers & (1u << drive)) == 0)
+				{
+					InsertDM(&dm);
+				}
 #endif
 			}
 			else
@@ -362,6 +547,11 @@ void DDA::Start(uint32_t tim)
 	const int32_t ticksOverdue = (int32_t)(tim - afterPrepare.moveStartTime);
 	if (ticksOverdue > 0)
 	{
+		if ((uint32_t)ticksOverdue > StepErrorLateThreshold)
+		{
+			CountStepErrorReason(StepErrorReason::lateStart);
+		}
+
 		// Record the maximum overdue time
 		if ((uint32_t)ticksOverdue > maxTicksOverdue)
 		{
@@ -380,20 +570,35 @@ void DDA::Start(uint32_t tim)
 	}
 	state = executing;
 
+#if SUPPORT_ACCELEROMETERS
+	AccelerometerHandler::MoveStarting(afterPrepare.moveStartTime);
+#endif
+
 #if SINGLE_DRIVER
 	if (ddms[0].state == DMState::moving)
 	{
-		Platform::SetDirection(ddms[0].direction);
+# if SUPPORT_CLOSED_LOOP
+		// In closed loop mode the control loop calculates the target position of a Cartesian move without pressure advance from the time since it started,
+		// so we don't need any step interrupts for it. GetStepsTaken calculates the steps from the time until the move completes.
+		if (ClosedLoop::GetClosedLoopEnabled() && !ddms[0].IsDeltaMovement() && ddms[0].reverseStartStep > ddms[0].totalSteps && ddms[0].mp.cart.compensationClocks == 0)
+		{
+			flags.motionCalculated = true;
+			ddms[0].state = DMState::idle;
+		}
+		else
+# endif
+		{
+			Platform::SetDirection(ddms[0].direction);
+		}
 	}
 #else
 	if (activeDMs != nullptr)
 	{
-		for (size_t i = 0; i < NumDrivers; ++i)
+		for (const DriveMovement *dm : pddms)
 		{
-			DriveMovement& dm = ddms[i];
-			if (dm.state == DMState::moving)
+			if (dm != nullptr && dm->state == DMState::moving)
 			{
-				Platform::SetDirection(dm.drive, dm.direction);
+				Platform::SetDirection(dm->drive, dm->direction);
 			}
 		}
 	}
@@ -406,6 +611,9 @@ uint32_t DDA::lastStepHighTime = 0;
 uint32_t DDA::lastStepLowTime = 0;
 #endif
 uint32_t DDA::lastDirChangeTime = 0;
+#if SINGLE_DRIVER && SUPPORT_SLOW_DRIVERS
+uint32_t DDA::directionChangeTime = 0;
+#endif
 
 #if SINGLE_DRIVER
 
@@ -415,6 +623,17 @@ uint32_t DDA::lastDirChangeTime = 0;
 // This may occasionally get called prematurely, so it must check that a step is actually due before generating one.
 void DDA::StepDrivers(uint32_t now)
 {
+# if SUPPORT_SLOW_DRIVERS
+	// If we deferred a direction change until the hold time of the previous step expired, do it now.
+	// We were woken up for it, so SetDirection won't need to wait unless the interrupt came slightly early.
+	if (flags.directionChangePending)
+	{
+		flags.directionChangePending = false;
+		Platform::SetDirection(ddms[0].direction);
+		now = StepTimer::GetTimerTicks();
+	}
+# endif
+
 	// Determine whether the driver is due for stepping, overdue, or will be due very shortly
 	if (ddms[0].state == DMState::moving && (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval >= ddms[0].nextStepTime)	// if the next step is due
 	{
@@ -457,14 +676,17 @@ void DDA::StepDrivers(uint32_t now)
 			hasMoreSteps = ddms[0].CalcNextStepTime(*this);
 # else
 #  if SUPPORT_CLOSED_LOOP
-			ClosedLoop::TakeStep();											//TODO remove this when in closed loop mode and ClosedLoop calls GetCurrentMotion instead of relying on TakeStep
+			// In closed loop mode we only get here for moves that the control loop can't calculate positions for, and it gets the position from the steps taken
 			if (ClosedLoop::GetClosedLoopEnabled())
 			{
-				hasMoreSteps = ddms[0].CalcNextStepTime(*this);				//TODO remove this when we refactor the code to not generate step interrupts when in closed loop mode
+				hasMoreSteps = ddms[0].CalcNextStepTime(*this);
 			}
 			else
 #  endif
 			{
+#  if SUPPORT_CLOSED_LOOP
+				ClosedLoop::TakeStep();										// keep the closed loop target position up to date in open loop mode
+#  endif
 				Platform::StepDriverHigh();									// generate the step
 				hasMoreSteps = ddms[0].CalcNextStepTime(*this);
 				Platform::StepDriverLow();									// set the step pin low
@@ -476,7 +698,22 @@ void DDA::StepDrivers(uint32_t now)
 		if (hasMoreSteps && ddms[0].directionChanged)
 		{
 			ddms[0].directionChanged = false;
-			Platform::SetDirection(ddms[0].direction);
+# if SUPPORT_SLOW_DRIVERS
+			if (Platform::IsSlowDriver())
+			{
+				// Don't wait here for the DIR hold time to expire. Schedule an interrupt for then, which will normally be well before the next step is due.
+#  if USE_TC_FOR_STEP
+				directionChangeTime = lastStepHighTime + Platform::GetSlowDriverDirHoldFromLeadingEdgeClocks();
+#  else
+				directionChangeTime = lastStepLowTime + Platform::GetSlowDriverDirHoldFromTrailingEdgeClocks();
+#  endif
+				flags.directionChangePending = true;
+			}
+			else
+# endif
+			{
+				Platform::SetDirection(ddms[0].direction);
+			}
 		}
 	}
 
@@ -487,6 +724,88 @@ void DDA::StepDrivers(uint32_t now)
 	}
 }
 
+#elif USE_DM_SCAN
+
+// This is called by the interrupt service routine to execute steps.
+// This version scans all the drives that need steps instead of keeping them in step time order, which saves re-inserting them in a list when there are many drives.
+// This must be as fast as possible, because it determines the maximum movement speed.
+// This may occasionally get called prematurely, so it must check that a step is actually due before generating one.
+void DDA::StepDrivers(uint32_t now)
+{
+	// Determine which drivers are due for stepping, overdue, or will be due very shortly
+	uint32_t driversMap = 0, dmsStepping = 0;
+	const uint32_t elapsedTime = (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval;
+	for (uint32_t dms = scannedDMs; dms != 0; dms &= dms - 1)
+	{
+		const size_t drive = __builtin_ctz(dms);
+		const DriveMovement& dm = *pddms[drive];
+		if (elapsedTime >= dm.nextStepTime)							// if the next step is due
+		{
+			dmsStepping |= 1u << drive;
+			driversMap |= (1u << drive) | dm.followers;
+			++stepsDone[drive];
+			for (uint32_t followers = dm.followers; followers != 0; followers &= followers - 1)
+			{
+				++stepsDone[__builtin_ctz(followers)];
+			}
+		}
+	}
+	const uint32_t driversStepping = Platform::GetDriversBitmapFor(driversMap);
+
+# if SUPPORT_SLOW_DRIVERS
+	if ((driversStepping & Platform::GetSlowDriversBitmap().GetRaw()) != 0)	// if using any slow drivers
+	{
+		uint32_t lastStepPulseTime = lastStepLowTime;
+		while (now - lastStepPulseTime < Platform::GetSlowDriverStepLowClocks() || now - lastDirChangeTime < Platform::GetSlowDriverDirSetupClocks())
+		{
+			now = StepTimer::GetTimerTicks();
+		}
+		Platform::StepDriversHigh(driversStepping);					// set the step pins high
+		lastStepPulseTime = StepTimer::GetTimerTicks();
+
+		for (uint32_t dms = dmsStepping; dms != 0; dms &= dms - 1)
+		{
+			CalcNextStepTimes(*pddms[__builtin_ctz(dms)]);			// calculate next step times
+		}
+
+		while (StepTimer::GetTimerTicks() - lastStepPulseTime < Platform::GetSlowDriverStepHighClocks()) {}
+		Platform::StepDriversLow();									// set all step pins low
+		lastStepLowTime = StepTimer::GetTimerTicks();
+	}
+	else
+# endif
+	{
+		Platform::StepDriversHigh(driversStepping);					// set the step pins high
+		for (uint32_t dms = dmsStepping; dms != 0; dms &= dms - 1)
+		{
+			CalcNextStepTimes(*pddms[__builtin_ctz(dms)]);			// calculate next step times
+		}
+		Platform::StepDriversLow();									// set all step pins low
+	}
+
+	// Drop the drives that have finished, update the direction pins where necessary, and find the drive that is due next
+	for (uint32_t dms = dmsStepping; dms != 0; dms &= dms - 1)
+	{
+		DriveMovement& dm = *pddms[__builtin_ctz(dms)];
+		if (dm.state != DMState::moving)
+		{
+			scannedDMs &= ~(1u << dm.drive);
+		}
+		else if (dm.directionChanged)
+		{
+			dm.directionChanged = false;
+			Platform::SetDirection(dm.drive, dm.direction);
+		}
+	}
+	FindFirstDM();
+
+	// If there are no more steps to do and the time for the move has nearly expired, flag the move as complete
+	if (activeDMs == nullptr && StepTimer::GetTimerTicks() - afterPrepare.moveStartTime + WakeupTime >= clocksNeeded)
+	{
+		state = completed;
+	}
+}
+
 #else
 
 // This is called by the interrupt service routine to execute steps.
@@ -497,15 +816,20 @@ void DDA::StepDrivers(uint32_t now)
 {
 	// 1. There is no step 1.
 	// 2. Determine which drivers are due for stepping, overdue, or will be due very shortly
-	uint32_t driversStepping = 0;
+	uint32_t driversMap = 0;
 	DriveMovement* dm = activeDMs;
 	const uint32_t elapsedTime = (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval;
 	while (dm != nullptr && elapsedTime >= dm->nextStepTime)		// if the next step is due
 	{
-		driversStepping |= Platform::GetDriversBitmap(dm->drive);
+		driversMap |= (1u << dm->drive) | dm->followers;
 		++stepsDone[dm->drive];
+		for (uint32_t followers = dm->followers; followers != 0; followers &= followers - 1)
+		{
+			++stepsDone[__builtin_ctz(followers)];
+		}
 		dm = dm->nextDM;
 	}
+	const uint32_t driversStepping = Platform::GetDriversBitmapFor(driversMap);
 
 # if SUPPORT_SLOW_DRIVERS
 	if ((driversStepping & Platform::GetSlowDriversBitmap().GetRaw()) != 0)	// if using any slow drivers
@@ -520,7 +844,7 @@ void DDA::StepDrivers(uint32_t now)
 
 		for (DriveMovement *dm2 = activeDMs; dm2 != dm; dm2 = dm2->nextDM)
 		{
-			(void)dm2->CalcNextStepTime(*this);						// calculate next step times
+			CalcNextStepTimes(*dm2);								// calculate next step times
 		}
 
 		while (StepTimer::GetTimerTicks() - lastStepPulseTime < Platform::GetSlowDriverStepHighClocks()) {}
@@ -533,7 +857,7 @@ void DDA::StepDrivers(uint32_t now)
 		Platform::StepDriversHigh(driversStepping);					// set the step pins high
 		for (DriveMovement *dm2 = activeDMs; dm2 != dm; dm2 = dm2->nextDM)
 		{
-			(void)dm2->CalcNextStepTime(*this);						// calculate next step times
+			CalcNextStepTimes(*dm2);								// calculate next step times
 		}
 		Platform::StepDriversLow();									// set all step pins low
 	}
@@ -565,18 +889,161 @@ void DDA::StepDrivers(uint32_t now)
 
 #endif
 
+// Return the fraction of the move that should have been completed at the specified time, also the speed and acceleration in move fraction per step clock
+float DDA::GetCalculatedMotion(uint32_t now, float& speed, float& accel) const noexcept
+{
+	const float t = (float)constrain<int32_t>((int32_t)(now - afterPrepare.moveStartTime), 0, (int32_t)clocksNeeded);
+	const float accelClocks = (topSpeed - startSpeed)/acceleration;
+	const float decelStartClocks = (float)clocksNeeded - (topSpeed - endSpeed)/deceleration;
+	if (t < accelClocks)
+	{
+		speed = startSpeed + acceleration * t;
+		accel = acceleration;
+		return (startSpeed + speed) * 0.5 * t;
+	}
+	if (t < decelStartClocks)
+	{
+		speed = topSpeed;
+		accel = 0.0;
+		return accelDistance + topSpeed * (t - accelClocks);
+	}
+	const float decelTime = t - decelStartClocks;
+	speed = topSpeed - deceleration * decelTime;
+	accel = -deceleration;
+	return (1.0 - decelDistance) + (topSpeed + speed) * 0.5 * decelTime;
+}
+
+// Return the step rate at the specified time of the drive that is moving fastest, in steps per step clock
+float DDA::GetCurrentStepRate(uint32_t now) const noexcept
+{
+	float speed, accel;
+	(void)GetCalculatedMotion(now, speed, accel);
+	uint32_t maxSteps = 0;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		const DriveMovement * const dm = FindDM(drive);
+		if (dm != nullptr && dm->state == DMState::moving && dm->totalSteps > maxSteps)
+		{
+			maxSteps = dm->totalSteps;
+		}
+	}
+	return speed * (float)maxSteps;
+}
+
+#if SUPPORT_CLOSED_LOOP
+
+// Return the net steps that a drive whose position is calculated from the time should have taken so far, in its actual microsteps
+int32_t DDA::GetCalculatedNetSteps(const DriveMovement& dm) const noexcept
+{
+	float speed, accel;
+	const int32_t steps = (int32_t)lrintf(GetCalculatedMotion(StepTimer::GetTimerTicks(), speed, accel) * (float)dm.totalSteps);
+	return (dm.direction) ? steps : -steps;
+}
+
+// This is called by CurrentMoveCompleted with interrupts disabled. The move may be flagged complete slightly before its time is up, so record all its steps as taken.
+void DDA::CompleteCalculatedMotion() noexcept
+{
+	if (flags.motionCalculated)
+	{
+		DriveMovement& dm = *FindDM(0);
+		dm.nextStep = dm.totalSteps + 1;
+		flags.motionCalculated = false;
+	}
+}
+
+// This is called on the current DDA with interrupts disabled, to report the current position in full steps, the speed in full steps/sec and the acceleration in full steps/sec^2
+// netMicrostepsTaken is the position in microsteps at the start of this move
+void DDA::GetCurrentMotion(MotionParameters& mParams, int32_t netMicrostepsTaken, int microstepShift) const noexcept
+{
+	const DriveMovement& dm = *FindDM(0);
+	if (flags.motionCalculated)
+	{
+		float speed, accel;
+		const float fraction = GetCalculatedMotion(StepTimer::GetTimerTicks(), speed, accel);
+		const float netSteps = (dm.direction) ? (float)dm.totalSteps : -(float)dm.totalSteps;
+		constexpr float ClocksPerSecond = (float)StepTimer::StepClockRate;
+		mParams.position = ldexp((float)netMicrostepsTaken + fraction * netSteps, microstepShift);
+		mParams.speed = ldexp(speed * netSteps * ClocksPerSecond, microstepShift);
+		mParams.acceleration = ldexp(accel * netSteps * ClocksPerSecond * ClocksPerSecond, microstepShift);
+	}
+	else
+	{
+		dm.GetCurrentMotion(mParams, netMicrostepsTaken, microstepShift);
+	}
+}
+
+#endif
+
+// Calculate the times of all the steps in this move without generating any step pulses, returning the number of steps calculated.
+// This is used only to benchmark the step time calculations. The DDA must not be in the DDA ring.
+uint32_t DDA::CalcAllStepTimes() noexcept
+{
+	uint32_t stepsCalculated = 0;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		DriveMovement * const dm = FindDM(drive);
+		while (dm != nullptr && dm->state == DMState::moving)
+		{
+			(void)dm->CalcNextStepTime(*this);
+			++stepsCalculated;
+		}
+	}
+	state = completed;
+	return stepsCalculated;
+}
+
 // Stop a drive and re-calculate the corresponding endpoint. Return the number of net steps taken.
 // For extruder drivers, we need to be able to calculate how much of the extrusion was completed after calling this.
 void DDA::StopDrive(size_t drive)
 {
-	DriveMovement& dm = ddms[drive];
+	DriveMovement * const pdm = FindDM(drive);
+	if (pdm == nullptr)
+	{
+		return;								// this drive isn't moving in this move
+	}
+	DriveMovement& dm = *pdm;
+#if SUPPORT_CLOSED_LOOP
+	if (flags.motionCalculated)
+	{
+		// Driver 0 isn't generating steps, so record how far the move had got so that GetStepsTaken returns the right value
+		float speed, accel;
+		dm.nextStep = (uint32_t)lrintf(GetCalculatedMotion(StepTimer::GetTimerTicks(), speed, accel) * (float)dm.totalSteps) + 1;
+		flags.motionCalculated = false;
+		state = completed;
+		return;
+	}
+#endif
 	if (dm.state == DMState::moving)
 	{
 		dm.state = DMState::idle;
 #if SINGLE_DRIVER
 		state = completed;
 #else
-		RemoveDM(drive);
+		if (dm.followers != 0)
+		{
+			// Other drivers are following this one, so the first of them takes over the calculation for the rest
+			DriveMovement& newLeader = *pddms[__builtin_ctz(dm.followers)];
+			newLeader.followers = dm.followers & ~(1u << newLeader.drive);
+			dm.followers = 0;
+			RemoveDM(drive);
+			if (newLeader.state == DMState::moving)
+			{
+				InsertDM(&newLeader);
+			}
+		}
+		else
+		{
+			// If this driver is following another one, stop following it
+			for (DriveMovement *ddm : pddms)
+			{
+				if (ddm != nullptr)
+				{
+					ddm->followers &= ~(1u << drive);
+				}
+			}
+			RemoveDM(drive);
+		}
+
 		if (activeDMs == nullptr)
 		{
 			state = completed;
@@ -599,6 +1066,88 @@ void DDA::StopDrivers(uint16_t whichDrives)
 	}
 }
 
+// Instead of stopping the drivers instantly, change the rest of the move so that it decelerates to rest from the current speed at the move's deceleration.
+// Called with interrupts disabled on the executing DDA. All the drivers in the move must be in whichDrives, because they share the same time profile.
+// Return false if we can't do it, in which case the caller should stop the drivers instantly instead.
+// The move ends further along than it was when we were called, so GetNetStepsPlanned gives the position at which each drive will come to rest.
+bool DDA::StopDriversDecelerating(uint16_t whichDrives) noexcept
+{
+	if (state != executing || flags.motionCalculated)
+	{
+		return false;
+	}
+	if (flags.stopping)
+	{
+		return true;										// the move is already decelerating to rest
+	}
+
+	// We handle only Cartesian drives without pressure advance. Those are the ones that we stop for endstops, probes and filament monitors.
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		const DriveMovement * const dm = FindDM(drive);
+		if (dm != nullptr && dm->state == DMState::moving
+			&& ((whichDrives & (1u << drive)) == 0 || dm->IsDeltaMovement() || dm->reverseStartStep <= dm->totalSteps || dm->mp.cart.compensationClocks != 0))
+		{
+			return false;
+		}
+	}
+
+	// Use the move's deceleration if it has a deceleration phase that slows it down, else its acceleration.
+	// PlanMove sets the deceleration to 1.0 if there is no deceleration phase, and to zero if the move doesn't slow down during it.
+	const float decel = (decelDistance > 0.0 && deceleration > 0.0) ? deceleration
+						: (accelDistance > 0.0 && acceleration > 0.0) ? acceleration
+							: 0.0;
+	if (decel <= 0.0)
+	{
+		return false;
+	}
+
+	const uint32_t now = StepTimer::GetTimerTicks();
+	const uint32_t timeSoFar = constrain<int32_t>((int32_t)(now - afterPrepare.moveStartTime), 0, (int32_t)clocksNeeded);
+	float speed, accel;
+	const float fractionDone = GetCalculatedMotion(now, speed, accel);
+	const float speedTimesCdivD = speed/decel;
+	const float stopFraction = fractionDone + speed * speedTimesCdivD * 0.5;
+
+	// Deceleration from the current speed has the same form as the normal deceleration phase, starting now at fractionDone and speed instead of at decelStartDistance and topSpeed
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		DriveMovement * const dm = FindDM(drive);
+		if (dm != nullptr && dm->state == DMState::moving)
+		{
+			// The deceleration constants are per step of the original move, so calculate them before we reduce totalSteps
+#if DM_USE_FPU
+			dm->fTwoCsquaredTimesMmPerStepDivD = (float)((double)2.0/((double)dm->totalSteps * (double)decel));
+			dm->fTwoDistanceToStopTimesCsquaredDivD = fsquare(speedTimesCdivD) + (fractionDone * 2)/decel;
+#else
+			dm->twoCsquaredTimesMmPerStepDivD = roundU64(2.0/((float)dm->totalSteps * decel));
+			dm->twoDistanceToStopTimesCsquaredDivD = isquare64(roundU32(speedTimesCdivD)) + roundU64((fractionDone * 2)/decel);
+#endif
+			// Any steps in the current double/quad/octal step batch have already been calculated, so we must still do them
+			const uint32_t newTotalSteps = max<uint32_t>((uint32_t)(stopFraction * (float)dm->totalSteps), dm->nextStep + dm->stepsTillRecalc);
+			if (newTotalSteps < dm->totalSteps)
+			{
+				dm->totalSteps = newTotalSteps;
+			}
+			dm->mp.cart.accelStopStep = dm->mp.cart.decelStartStep = dm->nextStep;
+		}
+	}
+
+	afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks = timeSoFar + roundU32(speedTimesCdivD);
+	if (afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks < clocksNeeded)
+	{
+		clocksNeeded = afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks;
+	}
+
+	// Make the rest of the speed profile describe the stop, so that GetCalculatedMotion and anything that looks at the end speed see the new motion
+	topSpeed = speed;
+	endSpeed = 0.0;
+	deceleration = decel;
+	decelDistance = 1.0 - fractionDone;
+	flags.stopping = true;
+	return true;
+}
+
 bool DDA::HasStepError() const
 {
 #if 0	//debug
@@ -610,7 +1159,7 @@ bool DDA::HasStepError() const
 
 	for (size_t drive = 0; drive < NumDrivers; ++drive)
 	{
-		if (ddms[drive].state == DMState::stepError)
+		if (HasStepError(drive))
 		{
 			return true;
 		}
@@ -625,6 +1174,20 @@ unsigned int DDA::GetAndClearStepErrors() noexcept
 	return ret;
 }
 
+// Append the step error counts by reason to a new line of the reply and clear them
+void DDA::AppendAndClearStepErrorReasons(const StringRef& reply) noexcept
+{
+	static constexpr const char *ReasonNames[] = { "late steps", "step time not increasing", "overshoot", "reverse mismatch", "late starts" };
+	static_assert(ARRAY_SIZE(ReasonNames) == (size_t)StepErrorReason::numReasons);
+
+	reply.lcat("Step errors by reason:");
+	for (size_t i = 0; i < (size_t)StepErrorReason::numReasons; ++i)
+	{
+		reply.catf("%s%s %" PRIu32, (i == 0) ? " " : ", ", ReasonNames[i], stepErrorReasonCounts[i]);
+		stepErrorReasonCounts[i] = 0;
+	}
+}
+
 uint32_t DDA::GetAndClearMaxTicksOverdue() noexcept
 {
 	const uint32_t ret = maxTicksOverdue;
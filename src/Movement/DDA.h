@@ -35,6 +35,23 @@ public:
 		completed			// move has been completed or aborted
 	};
 
+	// The results of the calculations for a move that depend only on its CAN message
+	struct MovePlan
+	{
+		PrepParams params;
+		float topSpeed;
+		float startSpeed;
+		float endSpeed;
+		float acceleration;
+		float deceleration;
+		float accelDistance;
+		float decelDistance;
+		uint32_t clocksNeeded;
+		uint32_t startSpeedTimesCdivA;
+		uint32_t topSpeedTimesCdivDPlusDecelStartClocks;
+		int32_t extraAccelerationClocks;
+	};
+
 	DDA(DDA* n) noexcept;
 
 	void* operator new(size_t count) { return Tasks::AllocPermanent(count); }
@@ -43,51 +60,76 @@ public:
 	void operator delete(void* ptr, std::align_val_t align) noexcept {}
 
 	void Init() noexcept;														// Set up initial positions for machine startup
-	bool Init(const CanMessageMovementLinear& msg) noexcept SPEED_CRITICAL;		// Set up a move from a CAN message
+	static void PlanMove(const CanMessageMovementLinear& msg, MovePlan& plan) noexcept SPEED_CRITICAL;	// Do the calculations for a move that don't need a DDA
+	bool Init(const CanMessageMovementLinear& msg, const MovePlan& plan, bool enableDrives = true) noexcept SPEED_CRITICAL;	// Set up a move from a CAN message and its plan
 	void Start(uint32_t tim) noexcept SPEED_CRITICAL;							// Start executing the DDA, i.e. move the move.
-	void StepDrivers(uint32_t now) noexcept SPEED_CRITICAL;						// Take one step of the DDA, called by timed interrupt.
-	bool ScheduleNextStepInterrupt(StepTimer& timer) const noexcept SPEED_CRITICAL;		// Schedule the next interrupt, returning true if we can't because it is already due
+	void StepDrivers(uint32_t now) noexcept ISR_CRITICAL;						// Take one step of the DDA, called by timed interrupt.
+	bool ScheduleNextStepInterrupt(StepTimer& timer) const noexcept ISR_CRITICAL;		// Schedule the next interrupt, returning true if we can't because it is already due
+	bool IsNextStepDue(uint32_t now) const noexcept ISR_CRITICAL;				// Return true if the next step is due so soon that we should generate it without scheduling an interrupt
+	uint32_t GetNextInterruptTime() const noexcept { return WhenNextInterruptDue() + afterPrepare.moveStartTime; }	// Return the step clock time when the next interrupt is due
 
 	void SetNext(DDA *n) noexcept { next = n; }
 	void SetPrevious(DDA *p) noexcept { prev = p; }
 	void Complete() noexcept { state = completed; }
 	void Free() noexcept;
 	bool HasStepError() const noexcept;
+	bool HasStepError(size_t drive) const noexcept;
 	bool IsPrintingMove() const noexcept { return flags.isPrintingMove; }
 
 	DDAState GetState() const noexcept { return state; }
 	DDA* GetNext() const noexcept { return next; }
 	DDA* GetPrevious() const noexcept { return prev; }
 	int32_t GetTimeLeft() const noexcept;
-	void InsertHiccup(uint32_t now) noexcept;
+	uint32_t InsertHiccup(uint32_t now, uint32_t hiccupTime) noexcept;
 
 	// Filament monitor support
 	int32_t GetStepsTaken(size_t drive) const noexcept;
+	uint32_t GetStepsGenerated(size_t drive, uint32_t& minStepInterval) const noexcept;	// get the step pulses generated and the shortest step interval, for the step rate profiler
 
 	void StopDrivers(uint16_t whichDrives) noexcept;
+	bool StopDriversDecelerating(uint16_t whichDrives) noexcept;		// bring the move to rest at its deceleration, returning false if we can't
+	int32_t GetNetStepsPlanned(size_t drive) const noexcept;			// get the net steps that this move will have taken when it finishes
+	float GetCurrentStepRate(uint32_t now) const noexcept;			// get the step rate of the fastest drive at the specified time, in steps per step clock
 
 	uint32_t GetClocksNeeded() const noexcept { return clocksNeeded; }
 	uint32_t GetMoveFinishTime() const noexcept { return afterPrepare.moveStartTime + clocksNeeded; }
 
 	int32_t GetPosition(size_t driver) const noexcept { return endPoint[driver]; }
 
-#if HAS_SMART_DRIVERS
-	uint32_t GetStepInterval(size_t axis, uint32_t microstepShift) const noexcept;	// Get the current full step interval for this axis or extruder
-#endif
-
 #if SUPPORT_CLOSED_LOOP
 	void GetCurrentMotion(MotionParameters& mParams, int32_t netMicrostepsTaken, int microstepShift) const noexcept;
+	void CompleteCalculatedMotion() noexcept;							// record that a move whose position was calculated from the time has taken all its steps
 #endif
 
+	uint32_t CalcAllStepTimes() noexcept;										// calculate all the step times without stepping any motors, for benchmarking
+
 	void DebugPrint() const noexcept;												// print the DDA only
 	void DebugPrintAll() const noexcept;												// print the DDA and active DMs
 
+	static unsigned int GetStepErrors() noexcept { return stepErrors; }
+	static uint32_t GetMaxTicksOverdue() noexcept { return maxTicksOverdue; }
 	static unsigned int GetAndClearStepErrors() noexcept;
 	static uint32_t GetAndClearMaxTicksOverdue() noexcept;
 	static uint32_t GetAndClearMaxOverdueIncrement() noexcept;
 
 	static void RecordStepError() noexcept { ++stepErrors; }
 
+	// Reasons for step errors and for timing faults that may cause them, counted separately so that we can tell CPU overload from bad moves
+	enum class StepErrorReason : uint8_t
+	{
+		lateStep = 0,						// the step interrupt ran more than StepErrorLateThreshold after the step was due
+		stepTimeNotIncreasing,				// a calculated step time was no later than the previous one
+		overshoot,							// a step other than the last two was calculated to be due after the end of the move
+		reverseMismatch,					// the reverse phase or delta calculation needed a negative distance or square root argument
+		lateStart,							// a move started more than StepErrorLateThreshold after its scheduled time
+		numReasons
+	};
+
+	static void CountStepErrorReason(StepErrorReason reason) noexcept { ++stepErrorReasonCounts[(size_t)reason]; }
+	static void AppendAndClearStepErrorReasons(const StringRef& reply) noexcept;
+
+	static constexpr uint32_t StepErrorLateThreshold = (100 * StepTimer::StepClockRate)/1000000;	// how late a step or move start must be for us to count it
+
 	// Note on the following constant:
 	// If we calculate the step interval on every clock, we reach a point where the calculation time exceeds the step interval.
 	// The worst case is pure Z movement on a delta. On a Mini Kossel with 80 steps/mm with this firmware running on a Duet (84MHx SAM3X8 processor),
@@ -98,12 +140,14 @@ public:
 #if SAMC21
 	static constexpr uint32_t MinCalcIntervalDelta = (100 * StepTimer::StepClockRate)/1000000; 		// the smallest sensible interval between calculations (40us) in step timer clocks
 	static constexpr uint32_t MinCalcIntervalCartesian = (100 * StepTimer::StepClockRate)/1000000;	// same as delta for now, but could be lower
-	static constexpr uint32_t HiccupTime = (50 * StepTimer::StepClockRate)/1000000;					// how long we hiccup for
+	static constexpr uint32_t MinHiccupTime = (20 * StepTimer::StepClockRate)/1000000;				// how long we hiccup for the first time in a move
+	static constexpr uint32_t MaxHiccupTime = (160 * StepTimer::StepClockRate)/1000000;				// the longest we let the hiccup time grow to
 	static constexpr uint32_t MaxStepInterruptTime = (80 * StepTimer::StepClockRate)/1000000;		// the maximum time we spend looping in the ISR in step clocks
 #elif SAME5x
 	static constexpr uint32_t MinCalcIntervalDelta = (50 * StepTimer::StepClockRate)/1000000; 		// the smallest sensible interval between calculations (40us) in step timer clocks
 	static constexpr uint32_t MinCalcIntervalCartesian = (50 * StepTimer::StepClockRate)/1000000;	// same as delta for now, but could be lower
-	static constexpr uint32_t HiccupTime = (40 * StepTimer::StepClockRate)/1000000;					// how long we hiccup for
+	static constexpr uint32_t MinHiccupTime = (16 * StepTimer::StepClockRate)/1000000;				// how long we hiccup for the first time in a move
+	static constexpr uint32_t MaxHiccupTime = (128 * StepTimer::StepClockRate)/1000000;				// the longest we let the hiccup time grow to
 	static constexpr uint32_t MaxStepInterruptTime = (80 * StepTimer::StepClockRate)/1000000;		// the maximum time we spend looping in the ISR in step clocks
 #endif
 	static constexpr uint32_t WakeupTime = (100 * StepTimer::StepClockRate)/1000000;				// stop resting 100us before the move is due to end
@@ -116,20 +160,36 @@ public:
 	static uint32_t lastStepLowTime;									// when we last completed a step pulse to a slow driver
 #endif
 	static uint32_t lastDirChangeTime;									// when we last change the DIR signal to a slow driver
+#if SINGLE_DRIVER && SUPPORT_SLOW_DRIVERS
+	static uint32_t directionChangeTime;								// when the DIR hold time of the last step to a slow driver expires, if a direction change is pending
+#endif
 
 	static uint32_t stepsRequested[NumDrivers], stepsDone[NumDrivers];
 
 private:
 	void StopDrive(size_t drive) noexcept;								// stop movement of a drive and recalculate the endpoint
+	DriveMovement *FindDM(size_t drive) const noexcept;					// return the DM for a drive, or nullptr if it has no DM in this move
 	uint32_t WhenNextInterruptDue() const noexcept;						// return when the next interrupt is due relative to the move start time
 
 #if !SINGLE_DRIVER
-	void InsertDM(DriveMovement *dm) noexcept SPEED_CRITICAL;
+	void ReleaseDMs() noexcept;											// return all our DMs to the pool
+	void InsertDM(DriveMovement *dm) noexcept ISR_CRITICAL;
 	void RemoveDM(size_t drive) noexcept;
+	void CalcNextStepTimes(DriveMovement& dm) noexcept ISR_CRITICAL;	// calculate the next step for a DM and any drivers following it
+# if USE_DM_SCAN
+	void FindFirstDM() noexcept ISR_CRITICAL;						// set activeDMs to the DM that needs a step soonest
+# endif
+#endif
+
+	float GetCalculatedMotion(uint32_t now, float& speed, float& accel) const noexcept;	// get the fraction of the move done at the specified time, and the speed and acceleration
+#if SUPPORT_CLOSED_LOOP
+	int32_t GetCalculatedNetSteps(const DriveMovement& dm) const noexcept;	// get the net steps taken so far by a drive whose position is calculated from the time
 #endif
 
 	void DebugPrintVector(const char *name, const float *vec, size_t len) const noexcept;
 
+	// The fields that the step ISR reads on every step or every step calculation come first, so that they share as few cache lines as possible.
+	// The fields that are only used when preparing the move follow the DMs.
     DDA *next;								// The next one in the ring
 	DDA *prev;								// The previous one in the ring
 
@@ -141,23 +201,14 @@ private:
 		{
 			uint16_t isPrintingMove : 1,	// True if this is a printing move and any of our extruders is moving
 					 goingSlow : 1,			// True if we have slowed the movement because the Z probe is approaching its threshold
-					 hadHiccup : 1;			// True if we had a hiccup while executing this move
+					 hadHiccup : 1,			// True if we had a hiccup while executing this move
+					 directionChangePending : 1,	// True if we must change the direction of a slow driver at directionChangeTime before its next step
+					 motionCalculated : 1,	// True if driver 0 is in closed loop mode and its position is calculated from the time instead of by generating steps
+					 stopping : 1;			// True if StopDriversDecelerating has already changed the move to decelerate to rest
 		} flags;
 		uint16_t all;						// so that we can print all the flags at once for debugging
 	};
 
-	int32_t endPoint[NumDrivers];  			// Machine coordinates in steps of the endpoint
-
-	float acceleration;						// The acceleration to use
-	float deceleration;						// The deceleration to use
-
-    // These vary depending on how we connect the move with its predecessor and successor, but remain constant while the move is being executed
-	float startSpeed;
-	float endSpeed;
-	float topSpeed;
-	float accelDistance;
-	float decelDistance;
-
 	uint32_t clocksNeeded;
 
 	// Values that are not set or accessed before Prepare is called
@@ -177,13 +228,39 @@ private:
 #endif
 	} afterPrepare;
 
-#if !SINGLE_DRIVER
+#if SINGLE_DRIVER
+    DriveMovement ddms[NumDrivers];			// These describe the state of each drive movement
+#else
+# if USE_DM_SCAN
+    DriveMovement* activeDMs;				// the contained DM that needs a step soonest, or nullptr if none
+    uint32_t scannedDMs;					// bitmap of the contained DMs that need steps, not including drivers that are following another one
+# else
     DriveMovement* activeDMs;				// list of contained DMs that need steps, in step time order
+# endif
+    DriveMovement *pddms[NumDrivers];		// The DMs for the drives that move in this move, taken from the pool, or nullptr for drives that don't move
 #endif
 
-    DriveMovement ddms[NumDrivers];			// These describe the state of each drive movement
+	// The remaining fields are used when preparing the move and for reporting, but not by the step ISR
+	int32_t endPoint[NumDrivers];  			// Machine coordinates in steps of the endpoint
+
+	float acceleration;						// The acceleration to use
+	float deceleration;						// The deceleration to use
+
+    // These vary depending on how we connect the move with its predecessor and successor, but remain constant while the move is being executed
+	float startSpeed;
+	float endSpeed;
+	float topSpeed;
+	float accelDistance;
+	float decelDistance;
+
+#if SINGLE_DRIVER
+	static constexpr size_t HotFieldsSize = 48;	// the step ISR fields of the DDA itself must fit in this many bytes, which is three 16-byte cache lines
+#else
+	static constexpr size_t HotFieldsSize = 64;	// the step ISR fields of the DDA including pddms must fit in this many bytes, which is four 16-byte cache lines
+#endif
 
 	static unsigned int stepErrors;
+	static uint32_t stepErrorReasonCounts[(size_t)StepErrorReason::numReasons];
 	static uint32_t maxTicksOverdue;
 	static uint32_t maxOverdueIncrement;
 };
@@ -191,6 +268,17 @@ private:
 // Return when the next interrupt is due relative to the move start time
 inline uint32_t DDA::WhenNextInterruptDue() const noexcept
 {
+#if SINGLE_DRIVER && SUPPORT_SLOW_DRIVERS
+	if (flags.directionChangePending)
+	{
+		// Wake up to change the direction when the hold time expires, so that StepDrivers doesn't have to wait for it
+		const uint32_t dirChangeDue = directionChangeTime - afterPrepare.moveStartTime;
+		if ((int32_t)(dirChangeDue - ddms[0].nextStepTime) < 0)
+		{
+			return dirChangeDue;
+		}
+	}
+#endif
 	return
 #if SINGLE_DRIVER
 			(ddms[0].state == DMState::moving) ? ddms[0].nextStepTime
@@ -212,8 +300,14 @@ inline bool DDA::ScheduleNextStepInterrupt(StepTimer& timer) const noexcept
 	return false;
 }
 
-// Insert a hiccup long enough to guarantee that we will exit the ISR
-inline void DDA::InsertHiccup(uint32_t now) noexcept
+// Return true if the next step is due within the minimum interrupt interval, so that StepDrivers will generate it if we call it now
+inline bool DDA::IsNextStepDue(uint32_t now) const noexcept
+{
+	return state == executing && (int32_t)(WhenNextInterruptDue() + afterPrepare.moveStartTime - now) < (int32_t)StepTimer::MinInterruptInterval;
+}
+
+// Insert a hiccup by delaying the rest of the move so that the next step is due hiccupTime after now. Return the number of clocks by which the move was delayed.
+inline uint32_t DDA::InsertHiccup(uint32_t now, uint32_t hiccupTime) noexcept
 {
 	const uint32_t ticksDueAfterStart =
 #if SINGLE_DRIVER
@@ -223,41 +317,83 @@ inline void DDA::InsertHiccup(uint32_t now) noexcept
 #endif
 										: (clocksNeeded > DDA::WakeupTime) ? clocksNeeded - DDA::WakeupTime
 											: 0;
-	afterPrepare.moveStartTime = now + DDA::HiccupTime - ticksDueAfterStart;
+	const uint32_t oldStartTime = afterPrepare.moveStartTime;
+	afterPrepare.moveStartTime = now + hiccupTime - ticksDueAfterStart;
+	flags.hadHiccup = true;
+	return afterPrepare.moveStartTime - oldStartTime;
 }
 
-// Return the number of net steps already taken in this move by a particular drive
-inline int32_t DDA::GetStepsTaken(size_t drive) const
+// Return the DM for a drive, or nullptr if it has no DM in this move
+inline DriveMovement *DDA::FindDM(size_t drive) const noexcept
 {
-	return ddms[drive].GetNetStepsTaken();
+#if SINGLE_DRIVER
+	return const_cast<DriveMovement*>(&ddms[drive]);
+#else
+	return pddms[drive];
+#endif
 }
 
-// Free up this DDA
-inline void DDA::Free()
+// Return the number of net steps already taken in this move by a particular drive
+inline int32_t DDA::GetStepsTaken(size_t drive) const
 {
-	state = empty;
+	const DriveMovement * const dm = FindDM(drive);
+	if (dm == nullptr)
+	{
+		return 0;
+	}
+#if SUPPORT_CLOSED_LOOP
+	const int32_t netSteps = (flags.motionCalculated) ? GetCalculatedNetSteps(*dm) : dm->GetNetStepsTaken();
+#else
+	const int32_t netSteps = dm->GetNetStepsTaken();
+#endif
+#if SUPPORT_MICROSTEP_REDUCTION
+	return netSteps * (1 << dm->microstepReduction);					// report the steps in configured microsteps
+#else
+	return netSteps;
+#endif
 }
 
-#if HAS_SMART_DRIVERS
-
-// Get the current full step interval for this axis or extruder
-inline uint32_t DDA::GetStepInterval(size_t axis, uint32_t microstepShift) const noexcept
+// Return the number of step pulses generated for this drive so far and the shortest step interval between them, in the driver's actual microsteps
+inline uint32_t DDA::GetStepsGenerated(size_t drive, uint32_t& minStepInterval) const noexcept
 {
-	const DriveMovement& dm = ddms[axis];
-	return dm.state == DMState::moving ? dm.GetStepInterval(microstepShift) : 0;
+	const DriveMovement * const dm = FindDM(drive);
+	if (dm == nullptr || dm->nextStep == 0)
+	{
+		return 0;
+	}
+	minStepInterval = dm->minStepInterval;
+	return dm->nextStep - 1;
 }
 
+inline int32_t DDA::GetNetStepsPlanned(size_t drive) const noexcept
+{
+	const DriveMovement * const dm = FindDM(drive);
+	if (dm == nullptr)
+	{
+		return 0;
+	}
+	const int32_t netSteps = (dm->direction) ? (int32_t)dm->totalSteps : -(int32_t)dm->totalSteps;
+#if SUPPORT_MICROSTEP_REDUCTION
+	return netSteps * (1 << dm->microstepReduction);
+#else
+	return netSteps;
 #endif
+}
 
-#if SUPPORT_CLOSED_LOOP
-
-// Get the current position, speed and acceleration
-inline void DDA::GetCurrentMotion(MotionParameters& mParams, int32_t netMicrostepsTaken, int microstepShift) const noexcept
+inline bool DDA::HasStepError(size_t drive) const noexcept
 {
-	return ddms[0].GetCurrentMotion(mParams, netMicrostepsTaken, microstepShift);
+	const DriveMovement * const dm = FindDM(drive);
+	return dm != nullptr && dm->state == DMState::stepError;
 }
 
+// Free up this DDA, returning its DMs to the pool
+inline void DDA::Free()
+{
+#if !SINGLE_DRIVER
+	ReleaseDMs();
 #endif
+	state = empty;
+}
 
 #endif	// SUPPORT_DRIVERS
 
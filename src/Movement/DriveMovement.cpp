@@ -19,6 +19,94 @@
 
 #include "StepTimer.h"
 #include "Platform.h"
+#include <RTOSIface/RTOSIface.h>
+
+#if !DM_USE_FPU
+uint32_t DriveMovement::steadyFastPathSteps = 0;
+#endif
+
+#if HAS_SMART_DRIVERS
+
+volatile uint32_t DriveMovement::publishedStepIntervals[NumDrivers] = { 0 };
+
+// Publish the step interval we just calculated, unless we are preparing the move rather than executing it
+inline void DriveMovement::PublishStepInterval(const DDA &dda) noexcept
+{
+	if (dda.state == DDA::executing)
+	{
+# if SUPPORT_MICROSTEP_REDUCTION
+		publishedStepIntervals[drive] = min<uint32_t>(stepInterval, PublishedIntervalMask) | ((uint32_t)microstepReduction << PublishedReductionShift);
+# else
+		publishedStepIntervals[drive] = stepInterval;
+# endif
+	}
+}
+
+#endif
+
+#if !SINGLE_DRIVER
+
+// DriveMovement pool management.
+// DMs are taken from the pool when a move is prepared and returned when the DDA is freed. Both happen in tasks, but the move benchmark doesn't own the DDA add mutex, so we disable interrupts briefly.
+DriveMovement *DriveMovement::freeList = nullptr;
+unsigned int DriveMovement::numFree = 0;
+unsigned int DriveMovement::minFree = 0;
+
+/*static*/ void DriveMovement::AddToPool(unsigned int num) noexcept
+{
+	while (num != 0)
+	{
+		DriveMovement * const dm = new DriveMovement;
+		dm->state = DMState::idle;
+		AtomicCriticalSectionLocker lock;
+		dm->nextDM = freeList;
+		freeList = dm;
+		++numFree;
+		++minFree;
+		--num;
+	}
+}
+
+/*static*/ DriveMovement *DriveMovement::Allocate(size_t drive) noexcept
+{
+	DriveMovement *dm;
+	{
+		AtomicCriticalSectionLocker lock;
+		dm = freeList;
+		if (dm == nullptr)
+		{
+			return nullptr;
+		}
+		freeList = dm->nextDM;
+		--numFree;
+		if (numFree < minFree)
+		{
+			minFree = numFree;
+		}
+	}
+	dm->drive = drive;
+	dm->nextDM = nullptr;
+	dm->followers = 0;
+	return dm;
+}
+
+/*static*/ void DriveMovement::Release(DriveMovement *item) noexcept
+{
+	item->state = DMState::idle;
+	AtomicCriticalSectionLocker lock;
+	item->nextDM = freeList;
+	freeList = item;
+	++numFree;
+}
+
+/*static*/ unsigned int DriveMovement::GetAndClearMinFree() noexcept
+{
+	const unsigned int ret = minFree;
+	minFree = numFree;
+	return ret;
+}
+
+#endif
 
 // Prepare this DM for a Cartesian axis move
 void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& params)
@@ -29,13 +117,19 @@ void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& param
 	fTwoCsquaredTimesMmPerStepDivA = (float)((double)2.0/((double)totalSteps * (double)dda.acceleration));
 	fTwoCsquaredTimesMmPerStepDivD = (float)((double)2.0/((double)totalSteps * (double)dda.deceleration));
 #else
-	twoCsquaredTimesMmPerStepDivA = roundU64((double)2.0/((double)totalSteps * (double)dda.acceleration));
-	twoCsquaredTimesMmPerStepDivD = roundU64((double)2.0/((double)totalSteps * (double)dda.deceleration));
+	// Without an FPU, double precision arithmetic is much slower than single precision. The accelerations are only single precision anyway.
+	twoCsquaredTimesMmPerStepDivA = roundU64(2.0/((float)totalSteps * dda.acceleration));
+	twoCsquaredTimesMmPerStepDivD = roundU64(2.0/((float)totalSteps * dda.deceleration));
 #endif
 
 	// Acceleration phase parameters
 	mp.cart.accelStopStep = (uint32_t)(dda.accelDistance * totalSteps) + 1;
 	mp.cart.compensationClocks = mp.cart.accelCompensationClocks = 0;
+#if DM_USE_FPU
+	mp.cart.fAdjustedStartSpeedTimesCdivASquared = fsquare((float)dda.afterPrepare.startSpeedTimesCdivA);
+#else
+	mp.cart.adjustedStartSpeedTimesCdivASquared = isquare64(dda.afterPrepare.startSpeedTimesCdivA);
+#endif
 
 	// Constant speed phase parameters
 #if DM_USE_FPU
@@ -77,6 +171,8 @@ void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& param
 #if SUPPORT_DELTA_MOVEMENT
 
 // Prepare this DM for a Delta axis move
+// Note: DDA::Init doesn't call this at present. The main board splits delta moves into segments and sends each tower's steps as a linear move,
+// so on expansion boards delta towers are stepped by CalcNextStepTimeCartesianFull. Optimise that function first if delta Z moves cause hiccups.
 //TODO convert this to normalised coordinates like we did for Cartesian drives
 void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 {
@@ -193,6 +289,14 @@ void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 // Prepare this DM for an extruder move. The caller has already checked that pressure advance is enabled.
 void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, float speedChange)
 {
+#if HAS_SMART_DRIVERS
+	// Raise the extruder current while accelerating if the extrusion rate will be high
+	if (direction && dda.accelDistance > 0.0)
+	{
+		Platform::ScheduleCurrentBoost(drive, dda.topSpeed * (float)totalSteps, dda.afterPrepare.moveStartTime, (uint32_t)((dda.topSpeed - dda.startSpeed)/dda.acceleration));
+	}
+#endif
+
 	// Calculate the pressure advance parameters
 	const float compensationClocks = Platform::GetPressureAdvanceClocks(drive);
 	if (compensationClocks < 1.0)
@@ -203,6 +307,11 @@ void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, fl
 	isDeltaMovement = false;
 
 	mp.cart.compensationClocks = roundU32(compensationClocks);
+#if DM_USE_FPU
+	mp.cart.fAdjustedStartSpeedTimesCdivASquared = fsquare((float)(dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks));
+#else
+	mp.cart.adjustedStartSpeedTimesCdivASquared = isquare64(dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks);
+#endif
 
 	// Recalculate the net total step count to allow for compensation. It may be negative.
 	const int32_t extraSteps = (dda.endSpeed - dda.startSpeed) * compensationClocks * totalSteps;
@@ -217,8 +326,9 @@ void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, fl
 	fTwoCsquaredTimesMmPerStepDivA = (double)2.0/((double)totalSteps * (double)dda.acceleration);
 	fTwoCsquaredTimesMmPerStepDivD = (double)2.0/((double)totalSteps * (double)dda.deceleration);
 #else
-	twoCsquaredTimesMmPerStepDivA = roundU64((double)2.0/((double)totalSteps * (double)dda.acceleration));
-	twoCsquaredTimesMmPerStepDivD = roundU64((double)2.0/((double)totalSteps * (double)dda.deceleration));
+	// Use single precision for the same reason as in PrepareCartesianAxis
+	twoCsquaredTimesMmPerStepDivA = roundU64(2.0/((float)totalSteps * dda.acceleration));
+	twoCsquaredTimesMmPerStepDivD = roundU64(2.0/((float)totalSteps * dda.deceleration));
 #endif
 
 	// Constant speed phase parameters
@@ -394,26 +504,40 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 		// acceleration phase
 #if DM_USE_FPU
 		const float adjustedStartSpeedTimesCdivA = (float)(dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks);
-		nextCalcStepTime = (uint32_t)(fastSqrtf(fsquare(adjustedStartSpeedTimesCdivA) + (fTwoCsquaredTimesMmPerStepDivA * nextCalcStep)) - adjustedStartSpeedTimesCdivA);
+		nextCalcStepTime = (uint32_t)(fastSqrtf(mp.cart.fAdjustedStartSpeedTimesCdivASquared + (fTwoCsquaredTimesMmPerStepDivA * nextCalcStep)) - adjustedStartSpeedTimesCdivA);
 #else
 		const uint32_t adjustedStartSpeedTimesCdivA = dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks;
-		nextCalcStepTime = isqrt64(isquare64(adjustedStartSpeedTimesCdivA) + (twoCsquaredTimesMmPerStepDivA * nextCalcStep)) - adjustedStartSpeedTimesCdivA;
+		nextCalcStepTime = isqrt64(mp.cart.adjustedStartSpeedTimesCdivASquared + (twoCsquaredTimesMmPerStepDivA * nextCalcStep)) - adjustedStartSpeedTimesCdivA;
 #endif
 	}
 	else if (nextCalcStep < mp.cart.decelStartStep)
 	{
 		// steady speed phase
-		nextCalcStepTime =
 #if DM_USE_FPU
-					(uint32_t)(  (int32_t)(fMmPerStepTimesCdivtopSpeed * nextCalcStep)
-							   + dda.afterPrepare.extraAccelerationClocks
-							   - (int32_t)mp.cart.accelCompensationClocks
-							  );
+		nextCalcStepTime = (uint32_t)(  (int32_t)(fMmPerStepTimesCdivtopSpeed * nextCalcStep)
+									  + dda.afterPrepare.extraAccelerationClocks
+									  - (int32_t)mp.cart.accelCompensationClocks
+									 );
 #else
-					(uint32_t)(  (int32_t)(((uint64_t)mmPerStepTimesCKdivtopSpeed * nextCalcStep)/K1)
-							   + dda.afterPrepare.extraAccelerationClocks
-							   - (int32_t)mp.cart.accelCompensationClocks
-							  );
+		if (nextStep > mp.cart.accelStopStep)
+		{
+			// The previous step was also in the steady speed phase, so nextStepTime is its exact time and we can just add the step interval to it.
+			// We need the fractional part of the previous step time, which depends only on the low bits of the product, so a 32-bit multiply is good enough.
+			// Split the interval into whole and fractional clocks to avoid overflow.
+			const uint32_t stepsToAdd = nextCalcStep - (nextStep - 1);
+			const uint32_t prevFraction = (mmPerStepTimesCKdivtopSpeed * (nextStep - 1)) & (K1 - 1);
+			nextCalcStepTime = nextStepTime
+								+ (mmPerStepTimesCKdivtopSpeed/K1) * stepsToAdd
+								+ (prevFraction + (mmPerStepTimesCKdivtopSpeed & (K1 - 1)) * stepsToAdd)/K1;
+			steadyFastPathSteps += stepsToAdd;
+		}
+		else
+		{
+			nextCalcStepTime = (uint32_t)(  (int32_t)(((uint64_t)mmPerStepTimesCKdivtopSpeed * nextCalcStep)/K1)
+										  + dda.afterPrepare.extraAccelerationClocks
+										  - (int32_t)mp.cart.accelCompensationClocks
+										 );
+		}
 #endif
 	}
 	else if (nextCalcStep < reverseStartStep)
@@ -443,18 +567,49 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 			directionChanged = true;
 		}
 		const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.compensationClocks;
-		nextCalcStepTime = adjustedTopSpeedTimesCdivDPlusDecelStartClocks
 #if DM_USE_FPU
-							+ (uint32_t)(fastSqrtf((fTwoCsquaredTimesMmPerStepDivD * nextCalcStep) - mp.cart.fFourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD));
+		const float temp = (fTwoCsquaredTimesMmPerStepDivD * nextCalcStep) - mp.cart.fFourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD;
+		if (temp < 0.0)
+#else
+		const int64_t temp = (int64_t)(twoCsquaredTimesMmPerStepDivD * nextCalcStep) - mp.cart.fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD;
+		if (temp < 0)
+#endif
+		{
+			// The reverse phase was calculated to start before the point at which the decelerating extruder would actually stop
+			DDA::CountStepErrorReason(DDA::StepErrorReason::reverseMismatch);
+			nextCalcStepTime = adjustedTopSpeedTimesCdivDPlusDecelStartClocks;
+		}
+		else
+		{
+			nextCalcStepTime = adjustedTopSpeedTimesCdivDPlusDecelStartClocks
+#if DM_USE_FPU
+								+ (uint32_t)fastSqrtf(temp);
 #else
-							+ isqrt64((int64_t)(twoCsquaredTimesMmPerStepDivD * nextCalcStep) - mp.cart.fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD);
+								+ isqrt64(temp);
 #endif
+		}
 	}
 
 	// When crossing between movement phases with high microstepping, due to rounding errors the next step may appear to be due before the last one
-	stepInterval = (nextCalcStepTime > nextStepTime)
-					? (nextCalcStepTime - nextStepTime) >> shiftFactor	// calculate the time per step, ready for next time
-					: 0;
+	if (nextCalcStepTime > nextStepTime)
+	{
+		stepInterval = (nextCalcStepTime - nextStepTime) >> shiftFactor;	// calculate the time per step, ready for next time
+		if (stepInterval < minStepInterval)
+		{
+			minStepInterval = stepInterval;
+		}
+	}
+	else
+	{
+		stepInterval = 0;
+		if (nextStep > 1)
+		{
+			DDA::CountStepErrorReason(DDA::StepErrorReason::stepTimeNotIncreasing);
+		}
+	}
+#if HAS_SMART_DRIVERS
+	PublishStepInterval(dda);
+#endif
 #if USE_EVEN_STEPS
 	nextStepTime = nextCalcStepTime - (stepsTillRecalc * stepInterval);
 #else
@@ -476,7 +631,11 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 			// We don't expect any step except the last to be late
 			state = DMState::stepError;
 			stepInterval = 10000000 + nextStepTime;				// so we can tell what happened in the debug print
+#if HAS_SMART_DRIVERS
+			publishedStepIntervals[drive] = 0;
+#endif
 			DDA::RecordStepError();
+			DDA::CountStepErrorReason(DDA::StepErrorReason::overshoot);
 			return false;
 		}
 	}
@@ -570,6 +729,8 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 	{
 		state = DMState::stepError;
 		nextStep += 1000000;						// so that we can tell what happened in the debug print
+		DDA::RecordStepError();
+		DDA::CountStepErrorReason(DDA::StepErrorReason::reverseMismatch);
 		return false;
 	}
 
@@ -617,9 +778,25 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 #endif
 
 	// When crossing between movement phases with high microstepping, due to rounding errors the next step may appear to be due before the last one.
-	stepInterval = (nextCalcStepTime > nextStepTime)
-					? (nextCalcStepTime - nextStepTime) >> shiftFactor	// calculate the time per step, ready for next time
-					: 0;
+	if (nextCalcStepTime > nextStepTime)
+	{
+		stepInterval = (nextCalcStepTime - nextStepTime) >> shiftFactor;	// calculate the time per step, ready for next time
+		if (stepInterval < minStepInterval)
+		{
+			minStepInterval = stepInterval;
+		}
+	}
+	else
+	{
+		stepInterval = 0;
+		if (nextStep > 1)
+		{
+			DDA::CountStepErrorReason(DDA::StepErrorReason::stepTimeNotIncreasing);
+		}
+	}
+#if HAS_SMART_DRIVERS
+	PublishStepInterval(dda);
+#endif
 #if USE_EVEN_STEPS
 	nextStepTime = nextCalcStepTime - (stepsTillRecalc * stepInterval);
 #else
@@ -641,6 +818,11 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 			// We don't expect any steps except the last two to be late
 			state = DMState::stepError;
 			stepInterval = 10000000 + nextStepTime;		// so we can tell what happened in the debug print
+#if HAS_SMART_DRIVERS
+			publishedStepIntervals[drive] = 0;
+#endif
+			DDA::RecordStepError();
+			DDA::CountStepErrorReason(DDA::StepErrorReason::overshoot);
 			return false;
 		}
 	}
@@ -649,6 +831,17 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 
 #endif
 
+#if !DM_USE_FPU
+
+uint32_t DriveMovement::GetAndClearSteadyFastPathSteps() noexcept
+{
+	const uint32_t ret = steadyFastPathSteps;
+	steadyFastPathSteps = 0;
+	return ret;
+}
+
+#endif
+
 #endif	// SUPPORT_DRIVERS
 
 // End
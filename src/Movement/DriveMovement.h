@@ -9,6 +9,7 @@
 #define DRIVEMOVEMENT_H_
 
 #include "RepRapFirmware.h"
+#include <Tasks.h>
 
 #if SUPPORT_DRIVERS
 
@@ -17,9 +18,9 @@
 // Struct to pass data back to the ClosedLoop module
 struct MotionParameters
 {
-	float position;
-	float speed;
-	float acceleration;
+	float position;								// in full steps
+	float speed;								// in full steps per second
+	float acceleration;							// in full steps per second squared
 };
 
 #endif
@@ -138,9 +139,26 @@ class DriveMovement
 public:
 	friend class DDA;
 
-	DriveMovement() { };
+	DriveMovement() noexcept
+	{
+		// Check that the fields used on every step are still packed together at the start
+		static_assert(offsetof(DriveMovement, reverseStartStep) + sizeof(reverseStartStep) <= HotFieldsSize);
+		static_assert(offsetof(DriveMovement, nextStepTime) % sizeof(uint32_t) == 0);
+	}
 
-	bool CalcNextStepTime(const DDA &dda) SPEED_CRITICAL;
+#if !SINGLE_DRIVER
+	void* operator new(size_t count) { return Tasks::AllocPermanent(count); }
+	void operator delete(void* ptr) noexcept {}
+
+	// Pool management. Only multi-driver boards use the pool, because a DDA for a single driver board always needs its one DM.
+	static void AddToPool(unsigned int num) noexcept;				// allocate more DMs and add them to the pool
+	static DriveMovement *Allocate(size_t drive) noexcept;			// take a DM from the pool, returning nullptr if it is empty
+	static void Release(DriveMovement *item) noexcept;				// return a DM to the pool
+	static unsigned int NumFree() noexcept { return numFree; }
+	static unsigned int GetAndClearMinFree() noexcept;
+#endif
+
+	bool CalcNextStepTime(const DDA &dda) ISR_CRITICAL;
 	void PrepareCartesianAxis(const DDA& dda, const PrepParams& params) SPEED_CRITICAL;
 	void PrepareDeltaAxis(const DDA& dda, const PrepParams& params) SPEED_CRITICAL;
 	void PrepareExtruder(const DDA& dda, const PrepParams& params, float speedChange) SPEED_CRITICAL;
@@ -150,29 +168,59 @@ public:
 	bool IsDeltaMovement() const { return isDeltaMovement; }
 
 #if HAS_SMART_DRIVERS
-	uint32_t GetStepInterval(uint32_t msShift) const;	// Get the current full step interval for this axis or extruder
+	static uint32_t GetStepInterval(size_t drive, uint32_t microstepShift) noexcept;	// Get the current full step interval for this axis or extruder, or 0 if it is not moving
+	static void ClearStepIntervals() noexcept;
 #endif
 
 #if SUPPORT_CLOSED_LOOP
 	void GetCurrentMotion(MotionParameters& mParams, int32_t netMicrostepsTaken, int microstepShift) const noexcept;
 #endif
 
+#if !DM_USE_FPU
+	static uint32_t GetAndClearSteadyFastPathSteps() noexcept;
+#endif
+
+#if !SINGLE_DRIVER
+	void CopyStepsFrom(const DriveMovement& leader) noexcept ISR_CRITICAL;
+#endif
+
 private:
-	bool CalcNextStepTimeCartesianFull(const DDA &dda) SPEED_CRITICAL;
+	bool CalcNextStepTimeCartesianFull(const DDA &dda) ISR_CRITICAL;
+#if HAS_SMART_DRIVERS
+	void PublishStepInterval(const DDA &dda) noexcept ISR_CRITICAL;
+#endif
 #if SUPPORT_DELTA_MOVEMENT
-	bool CalcNextStepTimeDeltaFull(const DDA &dda) SPEED_CRITICAL;
+	bool CalcNextStepTimeDeltaFull(const DDA &dda) ISR_CRITICAL;
 #endif
 
+#if !SINGLE_DRIVER
 	static DriveMovement *freeList;
-	static int numFree;
-	static int minFree;
+	static unsigned int numFree;
+	static unsigned int minFree;
+#endif
+#if !DM_USE_FPU
+	static uint32_t steadyFastPathSteps;				// how many steps were calculated incrementally during the steady speed phase
+#endif
+#if HAS_SMART_DRIVERS
+	// The step ISR publishes the step interval of each drive whenever it recalculates it, so that the smart drivers can poll it without looking at the DDA being executed.
+	// With microstep reduction the reduction is in the top 4 bits and the interval between the reduced microsteps in the rest.
+	static volatile uint32_t publishedStepIntervals[NumDrivers];
+	static constexpr unsigned int PublishedReductionShift = 28;
+	static constexpr uint32_t PublishedIntervalMask = (1u << PublishedReductionShift) - 1;
+#endif
 
 	// Parameters common to Cartesian, delta and extruder moves
+	// The fields that the step ISR and the fast path of CalcNextStepTime use on every step come first, so that they occupy as few cache lines as possible
 
 #if !SINGLE_DRIVER
-	DriveMovement *nextDM;								// link to next DM that needs a step
+	DriveMovement *nextDM;								// link to next DM that needs a step, or the next free DM when this one is in the pool
 #endif
 
+	uint32_t nextStepTime;								// how many clocks after the start of this move the next step is due
+	uint32_t stepInterval;								// how many clocks between steps
+	uint32_t nextStep;									// number of steps already done
+	uint32_t totalSteps;								// total number of steps for this move
+
 	DMState state;										// whether this is active or not
 	uint8_t drive;										// the drive that this DM controls
 	uint8_t direction : 1,								// true=forwards, false=backwards
@@ -180,13 +228,15 @@ private:
 			isDeltaMovement : 1;						// true if this motor is executing a delta tower move
 	uint8_t stepsTillRecalc;							// how soon we need to recalculate
 
-	uint32_t totalSteps;								// total number of steps for this move
-
-	// These values change as the step is executed, except for reverseStartStep
-	uint32_t nextStep;									// number of steps already done
+	// These values are used when we do a full step time calculation. reverseStartStep doesn't change during the move.
 	uint32_t reverseStartStep;							// the step number for which we need to reverse direction due to pressure advance or delta movement
-	uint32_t nextStepTime;								// how many clocks after the start of this move the next step is due
-	uint32_t stepInterval;								// how many clocks between steps
+#if !SINGLE_DRIVER
+	uint8_t followers;									// bitmap of other drivers doing identical moves that copy our step times instead of calculating their own
+#endif
+#if SUPPORT_MICROSTEP_REDUCTION
+	uint8_t microstepReduction;							// how many powers of 2 the microstepping of the driver is reduced by during this move
+#endif
+	uint32_t minStepInterval;							// the shortest step interval calculated so far in this move, for the step rate profiler
 
 #if DM_USE_FPU
 	float fMmPerStepTimesCdivtopSpeed;
@@ -194,7 +244,7 @@ private:
 	uint32_t mmPerStepTimesCKdivtopSpeed;
 #endif
 
-	// At this point we are 64-bit aligned
+	// The compiler pads here if necessary so that the 64-bit values are 64-bit aligned
 	// The following only needs to be stored per-drive if we are supporting pressure advance
 #if DM_USE_FPU
 	float fTwoDistanceToStopTimesCsquaredDivD;
@@ -225,6 +275,11 @@ private:
 			uint32_t decelStartStep;					// the first step number at which we are decelerating
 			uint32_t compensationClocks;				// the pressure advance time in clocks
 			uint32_t accelCompensationClocks;			// compensationClocks * (1 - startSpeed/topSpeed)
+#if DM_USE_FPU
+			float fAdjustedStartSpeedTimesCdivASquared;	// (startSpeedTimesCdivA + compensationClocks)^2, which is constant during the move
+#else
+			uint64_t adjustedStartSpeedTimesCdivASquared;	// (startSpeedTimesCdivA + compensationClocks)^2, which is constant during the move
+#endif
 		} cart;
 
 #if SUPPORT_DELTA_MOVEMENT
@@ -254,6 +309,7 @@ private:
 	} mp;
 
 	static constexpr uint32_t NoStepTime = 0xFFFFFFFF;	// value to indicate that no further steps are needed when calculating the next step time
+	static constexpr size_t HotFieldsSize = 32;			// the fields used on every step must fit in this many bytes, which is two 16-byte cache lines
 
 #if !DM_USE_FPU
 	static constexpr uint32_t K1 = 1024;				// a power of 2 used to multiply the value mmPerStepTimesCdivtopSpeed to reduce rounding errors
@@ -287,9 +343,29 @@ inline bool DriveMovement::CalcNextStepTime(const DDA &dda)
 	}
 
 	state = DMState::idle;
+#if HAS_SMART_DRIVERS
+	publishedStepIntervals[drive] = 0;
+#endif
 	return false;
 }
 
+#if !SINGLE_DRIVER
+
+// Copy the step state of the DM that this one is following. Both were prepared from identical parameters, so this is all that differs.
+inline void DriveMovement::CopyStepsFrom(const DriveMovement& leader) noexcept
+{
+	state = leader.state;
+	nextStep = leader.nextStep;
+	nextStepTime = leader.nextStepTime;
+	stepInterval = leader.stepInterval;
+	stepsTillRecalc = leader.stepsTillRecalc;
+#if HAS_SMART_DRIVERS
+	publishedStepIntervals[drive] = publishedStepIntervals[leader.drive];
+#endif
+}
+
+#endif
+
 // Return the number of net steps left for the move in the forwards direction.
 // We have already taken nextSteps - 1 steps, unless nextStep is zero.
 inline int32_t DriveMovement::GetNetStepsLeft() const
@@ -329,12 +405,24 @@ inline int32_t DriveMovement::GetNetStepsTaken() const
 
 #if HAS_SMART_DRIVERS
 
-// Get the current full step interval for this axis or extruder
-inline uint32_t DriveMovement::GetStepInterval(uint32_t microstepShift) const
+// Get the current full step interval for this axis or extruder, or 0 if it is not moving. This only reads the value that the step ISR last published.
+inline uint32_t DriveMovement::GetStepInterval(size_t drive, uint32_t microstepShift) noexcept
 {
-	return ((nextStep >> microstepShift) != 0)		// if at least 1 full step done
-		? stepInterval << microstepShift			// return the interval between steps converted to full steps
-			: 0;
+	const uint32_t published = publishedStepIntervals[drive];
+# if SUPPORT_MICROSTEP_REDUCTION
+	return (published & PublishedIntervalMask) << (microstepShift - (published >> PublishedReductionShift));
+# else
+	return published << microstepShift;
+# endif
+}
+
+// Forget the published step intervals. Called when a move completes, because the drivers that were stopped early or stepped in error don't clear their own.
+inline void DriveMovement::ClearStepIntervals() noexcept
+{
+	for (volatile uint32_t& interval : publishedStepIntervals)
+	{
+		interval = 0;
+	}
 }
 
 #endif
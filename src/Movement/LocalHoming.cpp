@@ -0,0 +1,262 @@
+/*
+ * LocalHoming.cpp
+ */
+
+#include "LocalHoming.h"
+
+#if SUPPORT_DRIVERS
+
+#include "Move.h"
+#include <InputMonitors/InputMonitor.h>
+#include <CAN/CanInterface.h>
+#include <CanMessageFormats.h>
+
+constexpr float LocalHomingRampTime = 0.02;				// how long the homing moves take to reach speed and to slow down at the end
+
+namespace LocalHoming
+{
+	enum class HomingState : uint8_t { idle = 0, fastApproach, backingOff, slowApproach, done, failed };
+
+	static const char *const StateNames[] = { "idle", "fast approach", "backing off", "slow approach", "done", "failed" };
+
+	static HomingState state = HomingState::idle;
+	static uint16_t drivers = 0;						// bitmap of the drivers to move
+	static uint16_t fastSpeed = 0;						// steps/sec
+	static uint16_t slowSpeed = 0;						// steps/sec
+	static uint32_t backoffSteps = 0;
+	static uint16_t inputHandle;
+	static int32_t maxTravel;							// the signed distance to move at most in the fast approach
+	static int32_t triggerPositions[NumDrivers];		// the machine positions in steps at which the input triggered in the slow approach
+	static String<StringLength50> failureReason;
+
+	static void Fail(const char *reason) noexcept;
+	static bool StartMove(int32_t steps, uint32_t speed) noexcept;
+	static void StartBackingOff() noexcept;
+	static void SetLocalStop(uint32_t driversToStop) noexcept;
+}
+
+void LocalHoming::Fail(const char *reason) noexcept
+{
+	failureReason.copy(reason);
+	state = HomingState::failed;
+	SetLocalStop(0);
+}
+
+// Make the input stop the drivers we are homing, or stop doing so
+void LocalHoming::SetLocalStop(uint32_t driversToStop) noexcept
+{
+	String<StringLength100> scratch;
+	(void)InputMonitor::SetLocalStop(inputHandle, driversToStop, scratch.GetRef());
+}
+
+// Queue a move of all the homing drivers, returning false and setting the failed state if we can't
+bool LocalHoming::StartMove(int32_t steps, uint32_t speed) noexcept
+{
+	CanMessageMovementLinear msg;
+	msg.numDrivers = NumDrivers;
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		msg.perDrive[driver].steps = (drivers & (1u << driver)) ? steps : 0;
+	}
+	Move::SetLocalMoveProfile(msg, (float)labs(steps), (float)speed, (float)speed/LocalHomingRampTime);
+
+	String<StringLength100> reply;
+	uint32_t startDelay;
+	if (moveInstance->AddLocalMove(msg, startDelay, reply.GetRef()) != GCodeResult::ok)
+	{
+		Fail(reply.c_str());
+		return false;
+	}
+	return true;
+}
+
+void LocalHoming::StartBackingOff() noexcept
+{
+	if (StartMove((maxTravel < 0) ? (int32_t)backoffSteps : -(int32_t)backoffSteps, fastSpeed))
+	{
+		state = HomingState::backingOff;
+	}
+}
+
+GCodeResult LocalHoming::Configure(uint32_t p_drivers, uint32_t speeds, uint32_t p_backoffSteps, const StringRef& reply) noexcept
+{
+	if (state == HomingState::fastApproach || state == HomingState::backingOff || state == HomingState::slowApproach)
+	{
+		reply.copy("Cannot change the local homing parameters while homing");
+		return GCodeResult::error;
+	}
+	if (p_drivers == 0 || p_drivers >= (1u << NumDrivers))
+	{
+		reply.printf("Board %u has only %u drivers", CanInterface::GetCanAddress(), NumDrivers);
+		return GCodeResult::error;
+	}
+	if ((speeds & 0xFFFF) == 0 || (speeds >> 16) == 0 || p_backoffSteps == 0)
+	{
+		reply.copy("Homing speeds and back-off distance must be greater than zero");
+		return GCodeResult::error;
+	}
+
+	drivers = (uint16_t)p_drivers;
+	fastSpeed = (uint16_t)speeds;
+	slowSpeed = (uint16_t)(speeds >> 16);
+	backoffSteps = p_backoffSteps;
+	reply.printf("Local homing drivers %04x, fast %u steps/sec, slow %u steps/sec, back off %" PRIu32 " steps", drivers, fastSpeed, slowSpeed, backoffSteps);
+	return GCodeResult::ok;
+}
+
+GCodeResult LocalHoming::Start(uint16_t hndl, int32_t p_maxTravel, const StringRef& reply) noexcept
+{
+	if (drivers == 0)
+	{
+		reply.copy("Local homing has not been configured");
+		return GCodeResult::error;
+	}
+	if (state == HomingState::fastApproach || state == HomingState::backingOff || state == HomingState::slowApproach)
+	{
+		reply.copy("Already homing");
+		return GCodeResult::error;
+	}
+	if (!moveInstance->IsIdle())
+	{
+		reply.copy("Cannot start local homing while moves are pending");
+		return GCodeResult::error;
+	}
+	if (p_maxTravel == 0)
+	{
+		reply.copy("Homing distance must not be zero");
+		return GCodeResult::error;
+	}
+
+	bool triggered;
+	if (!InputMonitor::GetState(hndl, triggered))
+	{
+		reply.printf("Board %u does not have input handle %04x", CanInterface::GetCanAddress(), hndl);
+		return GCodeResult::error;
+	}
+
+	inputHandle = hndl;
+	maxTravel = p_maxTravel;
+	failureReason.Clear();
+
+	// If the input is already triggered then we can skip the fast approach. The local stop applies only to the moves scheduled after we arm it, so arm it just before each approach.
+	if (triggered)
+	{
+		StartBackingOff();
+	}
+	else
+	{
+		SetLocalStop(drivers);
+		if (StartMove(maxTravel, fastSpeed))
+		{
+			state = HomingState::fastApproach;
+		}
+	}
+
+	if (state == HomingState::failed)
+	{
+		reply.printf("Local homing failed: %s", failureReason.c_str());
+		return GCodeResult::error;
+	}
+	reply.printf("Local homing started, %s", StateNames[(unsigned int)state]);
+	return GCodeResult::ok;
+}
+
+GCodeResult LocalHoming::Report(bool abort, const StringRef& reply) noexcept
+{
+	if (abort && (state == HomingState::fastApproach || state == HomingState::backingOff || state == HomingState::slowApproach))
+	{
+		moveInstance->StopDrivers(drivers);
+		Fail("aborted");
+	}
+
+	reply.printf("Local homing %s", StateNames[(unsigned int)state]);
+	if (state == HomingState::failed)
+	{
+		reply.catf(": %s", failureReason.c_str());
+	}
+	else if (state == HomingState::done)
+	{
+		reply.cat(", triggered at");
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			if (drivers & (1u << driver))
+			{
+				reply.catf(" %u:%" PRIi32, driver, triggerPositions[driver]);
+			}
+		}
+	}
+	return GCodeResult::ok;
+}
+
+bool LocalHoming::IsActive() noexcept
+{
+	return state == HomingState::fastApproach || state == HomingState::backingOff || state == HomingState::slowApproach;
+}
+
+// Advance the homing sequence. The input monitor stops the drivers when it triggers, so we only need to notice that and start the next move.
+void LocalHoming::Spin() noexcept
+{
+	switch (state)
+	{
+	case HomingState::fastApproach:
+		{
+			// Check for idle before checking for the trigger, because stopping the drivers when the input triggers completes the move
+			const bool idle = moveInstance->IsIdle();
+			int32_t positions[NumDrivers];
+			if (InputMonitor::TakeLocalStopPositions(inputHandle, positions))
+			{
+				StartBackingOff();
+			}
+			else if (idle)
+			{
+				Fail("input did not trigger");
+			}
+		}
+		break;
+
+	case HomingState::backingOff:
+		if (moveInstance->IsIdle())
+		{
+			bool triggered;
+			if (!InputMonitor::GetState(inputHandle, triggered))
+			{
+				Fail("input deleted");
+			}
+			else if (triggered)
+			{
+				Fail("input still triggered after backing off");
+			}
+			else
+			{
+				SetLocalStop(drivers);						// the stop disarmed itself when it fired in the fast approach
+				if (StartMove((maxTravel < 0) ? -2 * (int32_t)backoffSteps : 2 * (int32_t)backoffSteps, slowSpeed))
+				{
+					state = HomingState::slowApproach;
+				}
+			}
+		}
+		break;
+
+	case HomingState::slowApproach:
+		{
+			const bool idle = moveInstance->IsIdle();
+			if (InputMonitor::TakeLocalStopPositions(inputHandle, triggerPositions))
+			{
+				state = HomingState::done;
+				SetLocalStop(0);
+			}
+			else if (idle)
+			{
+				Fail("input did not trigger on the slow approach");
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+#endif	// SUPPORT_DRIVERS
+
+// End
@@ -0,0 +1,32 @@
+/*
+ * LocalHoming.h
+ *
+ *  Homing and probing moves generated by this board: move until an input triggers, back off, then re-approach slowly and record the trigger position.
+ *  The input stops the drivers directly, so the CAN latency to the main board and back doesn't affect the repeatability.
+ */
+
+#ifndef SRC_MOVEMENT_LOCALHOMING_H_
+#define SRC_MOVEMENT_LOCALHOMING_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_DRIVERS
+
+namespace LocalHoming
+{
+	// Set the drivers to move, the fast and slow speeds in steps/sec in the low and high 16 bits of speeds, and the back-off distance in steps
+	GCodeResult Configure(uint32_t drivers, uint32_t speeds, uint32_t backoffSteps, const StringRef& reply) noexcept;
+
+	// Start homing towards the input with handle hndl, moving at most maxTravel steps. The sign of maxTravel gives the direction.
+	GCodeResult Start(uint16_t hndl, int32_t maxTravel, const StringRef& reply) noexcept;
+
+	// Report the progress or result of homing, optionally aborting it first
+	GCodeResult Report(bool abort, const StringRef& reply) noexcept;
+
+	void Spin() noexcept;								// called by the main task to advance the homing sequence
+	bool IsActive() noexcept;							// return true if a homing sequence is in progress
+}
+
+#endif	// SUPPORT_DRIVERS
+
+#endif /* SRC_MOVEMENT_LOCALHOMING_H_ */
@@ -38,23 +38,27 @@
 #if SUPPORT_DRIVERS
 
 #include "StepTimer.h"
+#include "StepTrace.h"
 #include "Platform.h"
 #include <CAN/CanInterface.h>
 #include <CanMessageFormats.h>
 #include <CanMessageBuffer.h>
 #include <TaskPriorities.h>
+#include <TaskStackSizes.h>
+#include <CommandProcessing/CompactDiagnostics.h>
+#include "StepRateProfiler.h"
 
 #if HAS_SMART_DRIVERS
 # include "StepperDrivers/TMC51xx.h"
 # include "StepperDrivers/TMC22xx.h"
 #endif
 
-#if 1	//debug
-unsigned int moveCompleteTimeoutErrs;
-unsigned int getCanMoveTimeoutErrs;
-#endif
-
-constexpr size_t MoveTaskStackWords = 200;
+constexpr uint32_t MinCapacitySteps = 10000;							// how many steps we must have timed before we estimate the max step rate
+constexpr uint32_t MaxCapacitySteps = 1u << 20;							// when we have timed this many steps, we halve the totals so that the estimate follows recent moves
+constexpr float LocalRetractAcceleration = 3000.0;						// the acceleration in mm/sec^2 of local retract and unretract moves
+constexpr uint32_t LocalMoveLeadTicks = StepTimer::StepClockRate/100;	// how long after we prepare a local move that we start it if no moves are queued
+constexpr uint32_t MaxTotalsReadTestDuration = 1000;					// the longest time in milliseconds that TestTotalExtrusionReads may tie up the CAN command task
+constexpr unsigned int MaxMergedMoves = 4;								// the most queued moves we merge into one, because the position error can grow by the merge tolerance at each junction
 static Task<MoveTaskStackWords> *moveTask;
 
 extern "C" [[noreturn]] void MoveLoop(void * param) noexcept
@@ -63,7 +67,15 @@ extern "C" [[noreturn]] void MoveLoop(void * param) noexcept
 }
 
 Move::Move()
-	: currentDda(nullptr), extrudersPrinting(false), taskWaitingForMoveToComplete(nullptr), scheduledMoves(0), completedMoves(0), numHiccups(0)
+	: currentDda(nullptr), ddaRingLength(DdaRingLength), accumulatorsSeq(0), numTotalsReadRetries(0), extrudersPrinting(false), taskWaitingForMoveToComplete(nullptr), scheduledMoves(0), completedMoves(0), numQueuedMoves(0), numDirectMoves(0), numPlannedAheadMoves(0), numHiccups(0), numBatchedSteps(0),
+	  hiccupTime(DDA::MinHiccupTime), currentMoveHiccupClocks(0), totalHiccupClocks(0), maxHiccupClocksPerMove(0), stepIsrClocks(0), capacityIsrClocks(0), capacitySteps(0),
+	  queuedMovesEndTime(0), lastMovePreparedTime(0), lowQueueWarningClocks(0), minQueuedClocks(UINT32_MAX), numLowQueueWarnings(0), lowQueueWarningArmed(true),
+	  retraction(), numLocalRetractions(0),
+	  deceleratingStops(false), numDeceleratingStops(0), numInstantStops(0), lastStopRestPositions(),
+	  mergeTolerance(0.0), numMergedMoves(0)
+#if SUPPORT_MICROSTEP_REDUCTION
+	, microstepReductionRate(0), numMicrostepChanges(0)
+#endif
 #if SUPPORT_CLOSED_LOOP
 	, netMicrostepsTaken(0), driver0MicrostepShift(-4)					// default to x16 microstepping
 #endif
@@ -81,12 +93,22 @@ Move::Move()
 	}
 	ddaRingAddPointer->SetNext(dda);
 	dda->SetPrevious(ddaRingAddPointer);
+#if !SINGLE_DRIVER
+	DriveMovement::AddToPool(DdaRingLength * DmPoolDmsPerDda);
+#endif
 
-	timer.SetCallback(Move::TimerCallback, CallbackParameter(this));
+	timer.SetCallback(Move::TimerCallback, CallbackParameter(this), "move");
 
 	for (size_t i = 0; i < NumDrivers; ++i)
 	{
 		movementAccumulators[i] = 0;
+		netStepTotals[i] = 0;
+		travelStepTotals[i] = 0;
+#if SUPPORT_MICROSTEP_REDUCTION
+		lastMoveWithSteps[i] = 0;
+		microstepResidues[i] = 0;
+		microstepReductions[i] = 0;
+#endif
 	}
 }
 
@@ -103,6 +125,7 @@ void Move::Init()
 
 	currentDda = nullptr;
 	maxPrepareTime = 0;
+	ddaAddMutex.Create("DDAadd");
 
 	moveTask = new Task<MoveTaskStackWords>;
 	moveTask->Create(MoveLoop, "Move", this, TaskPriority::MovePriority);
@@ -158,114 +181,726 @@ inline void Move::StartNextMove(DDA *cdda, uint32_t startTime)
 {
 	while (true)
 	{
-		for (;;)
+		// Wait for a move to arrive that the CAN receiver task couldn't prepare immediately, then prepare all the queued moves
+		CanMessageBuffer *buf = CanInterface::GetCanMove(TaskBase::TimeoutUnlimited);
+		while (buf != nullptr)
 		{
-			// Recycle the DDAs for completed moves, checking for DDA errors to print if Move debug is enabled
-			while (ddaRingCheckPointer->GetState() == DDA::completed)
+			// If merging is enabled, append the following moves that are already queued to this one while they continue it
+			unsigned int numMoves = 1;
+			CanMessageBuffer *nextBuf = nullptr;
+			if (mergeTolerance > 0.0)
 			{
-				// Check for step errors and record/print them if we have any, before we lose the DMs
-				if (ddaRingCheckPointer->HasStepError())
+				nextBuf = CanInterface::GetCanMove(0);
+				while (nextBuf != nullptr && numMoves < MaxMergedMoves && TryMergeMove(buf->msg.moveLinear, nextBuf->msg.moveLinear))
 				{
-					if (Platform::Debug(moduleMove))
-					{
-						ddaRingCheckPointer->DebugPrintAll();
-					}
-					Platform::LogError(ErrorCode::BadMove);
+					CanInterface::FreeBuffer(nextBuf, CanBufferClass::motion);
+					++numMoves;
+					nextBuf = CanInterface::GetCanMove(0);
 				}
-
-				// Now release the DMs and check for underrun
-				ddaRingCheckPointer->Free();
-				ddaRingCheckPointer = ddaRingCheckPointer->GetNext();
 			}
 
-			// If we have a free slot for a new move, quit this loop
-			if (ddaRingAddPointer->GetState() == DDA::empty)
-			{
-				break;
-			}
+			// Do the calculations that don't need a DDA straight away, so that if the ring is full they overlap with the execution of the earlier moves
+			DDA::MovePlan plan;
+			DDA::PlanMove(buf->msg.moveLinear, plan);
 
-			// Wait for a move to complete
+			bool ringFull;
+			bool plannedAhead = false;
+			do
 			{
-				AtomicCriticalSectionLocker lock;
+				{
+					MutexLocker lock(ddaAddMutex);
+					RecycleDdas();
+					ringFull = !CanPrepareMove(buf->msg.moveLinear);
+					if (!ringFull)
+					{
+						PrepareMove(buf->msg.moveLinear, plan);
+						numQueuedMoves -= numMoves;
+						numMergedMoves += numMoves - 1;
+					}
+				}
 
-				if (ddaRingCheckPointer->GetState() == DDA::completed)
+				if (ringFull)
 				{
-					continue;
+					// The ring is full or we have run out of DMs, so wait for the step ISR to tell us that a move has completed, then try again with the same move
+					if (!plannedAhead)
+					{
+						++numPlannedAheadMoves;
+						plannedAhead = true;
+					}
+					{
+						AtomicCriticalSectionLocker lock;
+
+						if (ddaRingCheckPointer->GetState() == DDA::completed)
+						{
+							continue;
+						}
+						taskWaitingForMoveToComplete = TaskBase::GetCallerTaskHandle();
+					}
+					TaskBase::Take();
 				}
-				taskWaitingForMoveToComplete = TaskBase::GetCallerTaskHandle();
+			} while (ringFull);
+
+			CanInterface::FreeBuffer(buf, CanBufferClass::motion);
+			buf = (nextBuf != nullptr) ? nextBuf : CanInterface::GetCanMove(0);
+		}
+	}
+}
+
+// Merge the next queued move into this one if together they can be executed as a single move without moving any driver's position at the junction by more than mergeTolerance steps.
+// This requires the first move to end at its top speed and the next to start at that speed, immediately after the first one.
+// The merged move has the acceleration of the first move, the steady phases of both and the deceleration of the next, so its step totals are exactly those of both moves.
+// The merged move follows the same speed profile as the two moves did, so each driver's position error varies linearly with distance along the move and is greatest at the junction.
+bool Move::TryMergeMove(CanMessageMovementLinear& msg, const CanMessageMovementLinear& nextMsg) const noexcept
+{
+	const uint32_t clocks = msg.accelerationClocks + msg.steadyClocks + msg.decelClocks;
+	if (   nextMsg.whenToExecute != msg.whenToExecute + clocks
+		|| msg.decelClocks != 0 || msg.finalSpeedFraction != 1.0
+		|| nextMsg.accelerationClocks != 0 || nextMsg.initialSpeedFraction != 1.0
+		|| nextMsg.numDrivers != msg.numDrivers || nextMsg.pressureAdvanceDrives != msg.pressureAdvanceDrives
+	   )
+	{
+		return false;
+	}
+
+	// Work out the distance of each move in units of the top speed, which must be the same for both moves
+	const float distance = msg.steadyClocks + (msg.initialSpeedFraction + 1.0) * msg.accelerationClocks * 0.5;
+	const float nextDistance = nextMsg.steadyClocks + (nextMsg.finalSpeedFraction + 1.0) * nextMsg.decelClocks * 0.5;
+	const float junctionFraction = distance/(distance + nextDistance);
+	const size_t numDrivers = min<size_t>(msg.numDrivers, NumDrivers);
+	for (size_t drive = 0; drive < numDrivers; ++drive)
+	{
+		const int32_t steps = msg.perDrive[drive].steps;
+		const int32_t totalSteps = steps + nextMsg.perDrive[drive].steps;
+		if (fabsf((float)totalSteps * junctionFraction - (float)steps) > mergeTolerance)
+		{
+			return false;
+		}
+	}
+
+	for (size_t drive = 0; drive < numDrivers; ++drive)
+	{
+		msg.perDrive[drive].steps += nextMsg.perDrive[drive].steps;
+	}
+	msg.steadyClocks += nextMsg.steadyClocks;
+	msg.decelClocks = nextMsg.decelClocks;
+	msg.finalSpeedFraction = nextMsg.finalSpeedFraction;
+	return true;
+}
+
+GCodeResult Move::ConfigureMoveMerging(uint32_t toleranceHundredths, const StringRef& reply) noexcept
+{
+	mergeTolerance = (float)toleranceHundredths * 0.01;
+	if (toleranceHundredths == 0)
+	{
+		reply.printf("Move merging disabled, %" PRIu32 " moves merged so far", numMergedMoves);
+	}
+	else
+	{
+		reply.printf("Merging up to %u queued moves that continue each other within %.2f steps, %" PRIu32 " moves merged so far", MaxMergedMoves, (double)mergeTolerance, numMergedMoves);
+	}
+	return GCodeResult::ok;
+}
+
+// Prepare a move that has just been received, if no earlier moves are still queued and there is a free DDA. Called by the CAN receiver task.
+// Otherwise count the move as queued and return false, in which case the caller must queue the message for the move task.
+bool Move::TryPrepareMoveDirect(const CanMessageMovementLinear& msg) noexcept
+{
+	MutexLocker lock(ddaAddMutex);
+	if (numQueuedMoves == 0)
+	{
+		RecycleDdas();
+		if (CanPrepareMove(msg))
+		{
+			DDA::MovePlan plan;
+			DDA::PlanMove(msg, plan);
+			PrepareMove(msg, plan);
+			++numDirectMoves;
+			return true;
+		}
+	}
+	++numQueuedMoves;
+	return false;
+}
+
+// Release the DDAs for completed moves, checking for DDA errors to print if Move debug is enabled. Caller must own ddaAddMutex.
+void Move::RecycleDdas() noexcept
+{
+	while (ddaRingCheckPointer->GetState() == DDA::completed)
+	{
+		// Check for step errors and record/print them if we have any, before we lose the DMs
+		if (ddaRingCheckPointer->HasStepError())
+		{
+			if (Platform::Debug(moduleMove))
+			{
+				ddaRingCheckPointer->DebugPrintAll();
 			}
-#if 1	//debug
-			if (!TaskBase::Take(2000) && ddaRingCheckPointer->GetState() == DDA::completed)
+			Platform::LogError(ErrorCode::BadMove);
+			for (size_t driver = 0; driver < NumDrivers; ++driver)
 			{
-				++moveCompleteTimeoutErrs;
+				if (ddaRingCheckPointer->HasStepError(driver))
+				{
+					StepTrace::RecordStepError(*ddaRingCheckPointer, driver);
+				}
 			}
+		}
+
+		// Now release the DMs and check for underrun
+		ddaRingCheckPointer->Free();
+		ddaRingCheckPointer = ddaRingCheckPointer->GetNext();
+	}
+}
+
+// Return true if there is a free DDA and enough free DMs for the move. Caller must own ddaAddMutex.
+bool Move::CanPrepareMove(const CanMessageMovementLinear& msg) const noexcept
+{
+	if (ddaRingAddPointer->GetState() != DDA::empty)
+	{
+		return false;
+	}
+#if SINGLE_DRIVER
+	return true;
 #else
-			TaskBase::Take();
+	unsigned int dmsNeeded = 0;
+	const size_t numDrivers = min<size_t>(msg.numDrivers, NumDrivers);
+	for (size_t drive = 0; drive < numDrivers; ++drive)
+	{
+		if (msg.perDrive[drive].steps != 0)
+		{
+			++dmsNeeded;
+		}
+	}
+	return DriveMovement::NumFree() >= dmsNeeded;
 #endif
-		};
+}
+
+// Prepare a move in the DDA at the add pointer, which must be empty, and start it if no move is executing. Caller must own ddaAddMutex.
+void Move::PrepareMove(const CanMessageMovementLinear& msg, const DDA::MovePlan& plan) noexcept
+{
+	MicrosecondsTimer prepareTimer;
+
+	// Record how much motion we had left when this move arrived. We don't count the start of a print or a move after the machine has been idle.
+	const uint32_t now = StepTimer::GetTimerTicks();
+	const int32_t queuedClocks = (int32_t)(queuedMovesEndTime - now);
+	if (queuedClocks > 0 && (uint32_t)queuedClocks < minQueuedClocks && Platform::IsPrinting())
+	{
+		minQueuedClocks = queuedClocks;
+	}
+	lastMovePreparedTime = now;
+
+	if (ddaRingAddPointer->Init(msg, plan))
+	{
+		ddaRingAddPointer = ddaRingAddPointer->GetNext();
+		scheduledMoves++;
+		queuedMovesEndTime = msg.whenToExecute + msg.accelerationClocks + msg.steadyClocks + msg.decelClocks;
+	}
+	const uint32_t elapsedTime = prepareTimer.Read();
+	prepareTimeHistogram.Record(elapsedTime);
+	if (elapsedTime > maxPrepareTime)
+	{
+		maxPrepareTime = elapsedTime;
+	}
 
-		// Get another move and add it to the ring
-#if 1	//debug
-		CanMessageBuffer *buf;
-		for (;;)
+	// See whether we need to kick off a move
+	if (currentDda == nullptr)
+	{
+		// No DDA is executing, so start executing a new one if possible
+		DDA * const cdda = ddaRingGetPointer;									// capture volatile variable
+		if (cdda->GetState() == DDA::frozen)
 		{
-			buf = CanInterface::GetCanMove(2000);
-			if (buf != nullptr)
+			IrqDisable();
+			StartNextMove(cdda, StepTimer::GetTimerTicks());
+			if (cdda->ScheduleNextStepInterrupt(timer))
 			{
-				break;
-			}
-			buf = CanInterface::GetCanMove(0);
-			if (buf != nullptr)
-			{
-				++getCanMoveTimeoutErrs;
-				break;
+				Interrupt();
 			}
+			IrqEnable();
+		}
+	}
+}
+
+void Move::Diagnostics(const StringRef& reply)
+{
+	reply.catf("Moves scheduled %" PRIu32 ", direct %" PRIu32 ", planned ahead %" PRIu32 ", completed %" PRIu32 ", in progress %d, hiccups %" PRIu32 ", batched %" PRIu32 ", step errors %u, maxPrep %" PRIu32 ", maxOverdue %" PRIu32 ", maxInc %" PRIu32,
+					scheduledMoves, numDirectMoves, numPlannedAheadMoves, completedMoves, (int)(currentDda != nullptr), numHiccups, numBatchedSteps, DDA::GetAndClearStepErrors(), maxPrepareTime, DDA::GetAndClearMaxTicksOverdue(), DDA::GetAndClearMaxOverdueIncrement());
+	numHiccups = numBatchedSteps = numDirectMoves = numPlannedAheadMoves = 0;
+	maxPrepareTime = 0;
+	reply.catf(", hiccup delay %.1fms, max per move %" PRIu32 "us",
+					(double)(StepTimer::TicksToFloatMicroseconds(totalHiccupClocks) * 0.001), StepTimer::TicksToIntegerMicroseconds(maxHiccupClocksPerMove));
+	totalHiccupClocks = maxHiccupClocksPerMove = 0;
+	reply.catf(", DDAs %u of %u bytes, totals read retries %" PRIu32, ddaRingLength, sizeof(DDA), numTotalsReadRetries);
+	numTotalsReadRetries = 0;
+#if !SINGLE_DRIVER
+	reply.catf(", DMs free %u min %u", DriveMovement::NumFree(), DriveMovement::GetAndClearMinFree());
+#endif
+
+	// Report our motion capacity and how much of it we are using, so that the main board can be told to plan for it
+	{
+		const uint32_t maxStepRate = GetMaxSustainableStepRate();
+		const unsigned int isrLoad = Tasks::GetStepIsrCpuPermille(1);
+		reply.lcatf("Capacity: max step rate ");
+		if (maxStepRate == 0)
+		{
+			reply.cat("unknown");
+		}
+		else
+		{
+			reply.catf("%" PRIu32 " (%" PRIu32 " per driver)", maxStepRate, maxStepRate/NumDrivers);
+		}
+		reply.catf(", step ISR load %u.%u%%, DDAs queued %" PRIu32 "/%u", isrLoad/10, isrLoad % 10, scheduledMoves - completedMoves, ddaRingLength);
+		int32_t minAdvance, maxAdvance;
+		if (CanInterface::GetMotionAdvance(minAdvance, maxAdvance))
+		{
+			reply.catf(", min advance %" PRIu32 "ms", (uint32_t)max<int32_t>(minAdvance, 0)/(StepTimer::StepClockRate/1000));
 		}
+		if (minQueuedClocks != UINT32_MAX)
+		{
+			reply.catf(", min queued %" PRIu32 "ms", minQueuedClocks/(StepTimer::StepClockRate/1000));
+			minQueuedClocks = UINT32_MAX;
+		}
+		reply.catf(", low queue warnings %" PRIu32 ", local retractions %" PRIu32, numLowQueueWarnings, numLocalRetractions);
+		numLowQueueWarnings = numLocalRetractions = 0;
+	}
+#if !DM_USE_FPU
+	reply.catf(", fastSteady %" PRIu32, DriveMovement::GetAndClearSteadyFastPathSteps());
+#endif
+#if SUPPORT_MICROSTEP_REDUCTION
+	if (microstepReductionRate != 0)
+	{
+		reply.catf(", microstep changes %" PRIu32 ", reductions", numMicrostepChanges);
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			reply.catf(" %u", 1u << microstepReductions[driver]);
+		}
+		numMicrostepChanges = 0;
+	}
+#endif
+	StepRateProfiler::Diagnostics(reply);
+}
+
+// Append the move counters to the compact diagnostics. The counters that M122 clears are reported as they are since M122 was last run.
+void Move::AppendCompactDiagnostics(CompactDiagnostics& diags) const noexcept
+{
+	diags.StartSection('M');
+	diags.Add(scheduledMoves);
+	diags.Add((uint32_t)completedMoves);
+	diags.Add((uint32_t)(currentDda != nullptr));
+	diags.Add(numHiccups);
+	diags.Add((uint32_t)DDA::GetStepErrors());
+	diags.Add(maxPrepareTime);
+	diags.Add(DDA::GetMaxTicksOverdue());
+	diags.Add(StepTimer::TicksToIntegerMicroseconds(totalHiccupClocks));
+	diags.Add((uint32_t)ddaRingLength);
+
+	// Motion capacity: max sustainable total step rate (0 if unknown), step ISR load over 10 seconds in permille, DDAs queued, min advance in step clocks (0 if unknown)
+	diags.StartSection('Q');
+	diags.Add(GetMaxSustainableStepRate());
+	diags.Add((uint32_t)Tasks::GetStepIsrCpuPermille(1));
+	diags.Add(scheduledMoves - completedMoves);
+	int32_t minAdvance, maxAdvance;
+	diags.Add((CanInterface::GetMotionAdvance(minAdvance, maxAdvance)) ? minAdvance : (int32_t)0);
+	diags.Add(numLowQueueWarnings);
+
+	StepRateProfiler::AppendCompactDiagnostics(diags);
+	AppendStepTotals(diags);
+}
+
+GCodeResult Move::ConfigureLowQueueWarning(uint32_t millisQueued, const StringRef& reply) noexcept
+{
+	lowQueueWarningClocks = millisQueued * (StepTimer::StepClockRate/1000);
+	lowQueueWarningArmed = true;
+	if (millisQueued == 0)
+	{
+		reply.copy("Low motion queue warnings disabled");
+	}
+	else
+	{
+		reply.printf("Warning when less than %" PRIu32 "ms of motion is queued", millisQueued);
+	}
+	return GCodeResult::ok;
+}
+
+static void RaiseLowQueueEvent(const char *format, ...) noexcept
+{
+	va_list vargs;
+	va_start(vargs, format);
+	CanInterface::RaiseEvent(EventType::driver_warning, 0, 0, format, vargs);
+	va_end(vargs);
+}
+
+// Check whether the motion queue is about to run dry while we are printing. Called by the main task.
+// When a print finishes, the queue runs out after the last move arrived. So we only warn if moves are still arriving, which means that the main board isn't keeping up.
+void Move::CheckMotionQueue() noexcept
+{
+	if (lowQueueWarningClocks == 0)
+	{
+		return;
+	}
+
+	const uint32_t now = StepTimer::GetTimerTicks();
+	const int32_t queuedClocks = (int32_t)(queuedMovesEndTime - now);
+	if (!lowQueueWarningArmed)
+	{
+		if (queuedClocks > (int32_t)(2 * lowQueueWarningClocks))
+		{
+			lowQueueWarningArmed = true;								// the queue has recovered, so we may warn again
+		}
+	}
+	else if (   queuedClocks > 0 && (uint32_t)queuedClocks < lowQueueWarningClocks
+			 && now - lastMovePreparedTime < lowQueueWarningClocks
+			 && Platform::IsPrinting()
+			)
+	{
+		lowQueueWarningArmed = false;
+		++numLowQueueWarnings;
+		RaiseLowQueueEvent("motion queue low, %" PRIu32 "ms queued", (uint32_t)queuedClocks/(StepTimer::StepClockRate/1000));
+	}
+}
+
+// Estimate the total steps per second we can generate from the measured step ISR time per step, allowing the ISR up to half the CPU time.
+// The ISR time includes the per-interrupt overhead, so the estimate is conservative when several drivers step together.
+uint32_t Move::GetMaxSustainableStepRate() const noexcept
+{
+	uint32_t clocks, steps;
+	{
+		AtomicCriticalSectionLocker lock;
+		clocks = capacityIsrClocks;
+		steps = capacitySteps;
+	}
+	return (steps < MinCapacitySteps || clocks == 0) ? 0 : (uint32_t)(((uint64_t)steps * (StepTimer::StepClockRate/2))/clocks);
+}
+
+uint32_t Move::GetAndClearStepIsrClocks() noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	const uint32_t ret = stepIsrClocks;
+	stepIsrClocks = 0;
+	return ret;
+}
+
+void Move::TimingDiagnostics(const StringRef& reply) noexcept
+{
+	prepareTimeHistogram.AppendAndClear(reply, "Prepare time", "us");
+	isrTimeHistogram.AppendAndClear(reply, "Step ISR time", " clocks");
+	stepLatenessHistogram.AppendAndClear(reply, "Step ISR lateness", " clocks");
+	DDA::AppendAndClearStepErrorReasons(reply);
+}
+
+// Increase the number of DDAs in the ring, or report it if numDdas is zero.
+// DDAs are allocated permanently, so we can't reduce the number again.
+GCodeResult Move::SetDdaRingLength(unsigned int numDdas, const StringRef& reply) noexcept
+{
+	if (numDdas == 0)
+	{
+		reply.printf("DDA ring length %u, %u bytes per DDA, never used RAM %d", ddaRingLength, sizeof(DDA), Tasks::GetNeverUsedRam());
+		return GCodeResult::ok;
+	}
+
+	if (numDdas < ddaRingLength)
+	{
+		reply.printf("DDA ring length is already %u and can't be reduced", ddaRingLength);
+		return GCodeResult::error;
+	}
+
+	if (numDdas > MaxDdaRingLength)
+	{
+		reply.printf("DDA ring length must not exceed %u", MaxDdaRingLength);
+		return GCodeResult::error;
+	}
+
+	const unsigned int numToAdd = numDdas - ddaRingLength;
+	if (numToAdd != 0)
+	{
+		// DDAs left over from a previous attempt that found the ring full, linked by their next pointers. We can't free them, so we use them first.
+		static DDA *spareDdas = nullptr;
+		static unsigned int numSpareDdas = 0;
+
+		const unsigned int numToAllocate = (numToAdd > numSpareDdas) ? numToAdd - numSpareDdas : 0;
+#if SINGLE_DRIVER
+		const size_t bytesNeeded = numToAllocate * sizeof(DDA);
 #else
-		CanMessageBuffer *buf = CanInterface::GetCanMove(TaskBase::TimeoutUnlimited);
+		const size_t bytesNeeded = numToAllocate * sizeof(DDA) + numToAdd * DmPoolDmsPerDda * sizeof(DriveMovement);		// we add DMs to the pool too
 #endif
-		MicrosecondsTimer prepareTimer;
-		if (ddaRingAddPointer->Init(buf->msg.moveLinear))
+		if (!Tasks::CanAllocate(bytesNeeded))
+		{
+			reply.printf("Insufficient RAM to add %u DDAs, ring length is still %u", numToAdd, ddaRingLength);
+			return GCodeResult::error;
+		}
+
+		for (unsigned int i = 0; i < numToAllocate; ++i)
+		{
+			DDA * const dda = new DDA(spareDdas);
+			dda->Init();
+			spareDdas = dda;
+			++numSpareDdas;
+		}
+
+		// Take just the number of DDAs we need from the front of the spare chain, leaving the rest for next time
+		DDA * const first = spareDdas;
+		DDA *last = first;
+		for (unsigned int i = 1; i < numToAdd; ++i)
+		{
+			DDA * const next = last->GetNext();
+			next->SetPrevious(last);
+			last = next;
+		}
+
+		// Link the chain in after the add pointer if that DDA is still empty.
+		// Neither the move task nor the step ISR follows the next pointer of an empty DDA, so this is safe even if moves are pending.
+		MutexLocker lock(ddaAddMutex);
+
+		DDA * const insertAfter = ddaRingAddPointer;
+		if (insertAfter->GetState() != DDA::empty)
+		{
+			// The ring is full. The DDAs stay in the spare chain for next time.
+			reply.printf("DDA ring is full, try again when fewer moves are pending. Ring length is still %u", ddaRingLength);
+			return GCodeResult::error;
+		}
+		spareDdas = last->GetNext();
+		numSpareDdas -= numToAdd;
+
+		DDA * const insertBefore = insertAfter->GetNext();
+		first->SetPrevious(insertAfter);
+		last->SetNext(insertBefore);
+		insertBefore->SetPrevious(last);
+		insertAfter->SetNext(first);
+		ddaRingLength += numToAdd;
+#if !SINGLE_DRIVER
+		DriveMovement::AddToPool(numToAdd * DmPoolDmsPerDda);
+#endif
+	}
+
+	reply.printf("DDA ring length %u", ddaRingLength);
+	return GCodeResult::ok;
+}
+
+// Benchmark support
+// Each benchmark move is prepared using a DDA that is not in the DDA ring and without enabling the drivers, then its step times are calculated.
+// Delta moves are not included because DDA::Init doesn't prepare delta axes on expansion boards.
+struct BenchmarkMove
+{
+	const char *name;
+	int32_t steps;
+	uint32_t accelerationClocks, steadyClocks, decelClocks;
+	float initialSpeedFraction, finalSpeedFraction;
+	float pressureAdvance;															// in seconds, or zero if this is not an extruder move
+};
+
+static constexpr BenchmarkMove BenchmarkMoves[] =
+{
+	{ "Cartesian long",	8000,	StepTimer::StepClockRate/10,	StepTimer::StepClockRate/5,	StepTimer::StepClockRate/10,	0.0,	0.0,	0.0		},
+	{ "Cartesian short",	16,		StepTimer::StepClockRate/1000,	0,							StepTimer::StepClockRate/1000,	0.5,	0.5,	0.0		},
+	{ "Extruder PA",		2000,	StepTimer::StepClockRate/20,	StepTimer::StepClockRate/10,	StepTimer::StepClockRate/20,	0.2,	0.2,	0.05	},
+};
+
+constexpr unsigned int BenchmarkIterations = 4;
+
+// Run the benchmark moves and report the average prepare time and the step calculation time per step
+GCodeResult Move::RunBenchmark(const StringRef& reply) noexcept
+{
+	if (!IsIdle())
+	{
+		reply.copy("Cannot run the move benchmark while moves are pending");
+		return GCodeResult::error;
+	}
+
+	static DDA *benchmarkDda = nullptr;
+	if (benchmarkDda == nullptr)
+	{
+		benchmarkDda = new DDA(nullptr);
+		benchmarkDda->SetPrevious(benchmarkDda);
+	}
+
+	// Preparing moves adds to the requested step counts, so save them and restore them afterwards
+	uint32_t savedStepsRequested[NumDrivers];
+	memcpy(savedStepsRequested, DDA::stepsRequested, sizeof(savedStepsRequested));
+	const float savedPressureAdvance = Platform::GetPressureAdvanceClocks(0)/(float)StepTimer::StepClockRate;
+
+	reply.copy((ISR_CODE_IN_RAM) ? "Move benchmark, step code in RAM:" : "Move benchmark, step code in flash:");
+	for (const BenchmarkMove& bm : BenchmarkMoves)
+	{
+		CanMessageMovementLinear msg;
+		msg.whenToExecute = 0;
+		msg.accelerationClocks = bm.accelerationClocks;
+		msg.steadyClocks = bm.steadyClocks;
+		msg.decelClocks = bm.decelClocks;
+		msg.initialSpeedFraction = bm.initialSpeedFraction;
+		msg.finalSpeedFraction = bm.finalSpeedFraction;
+		msg.numDrivers = NumDrivers;
+		msg.pressureAdvanceDrives = (bm.pressureAdvance != 0.0) ? 1u : 0u;
+		msg.seq = 0;
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
 		{
-			ddaRingAddPointer = ddaRingAddPointer->GetNext();
-			scheduledMoves++;
+			msg.perDrive[driver].steps = (driver == 0) ? bm.steps : 0;
 		}
-		const uint32_t elapsedTime = prepareTimer.Read();
-		if (elapsedTime > Move::maxPrepareTime)
+		Platform::SetPressureAdvance(0, bm.pressureAdvance);
+
+		uint32_t prepareTicks = 0, calcTicks = 0, stepsCalculated = 0;
+		for (unsigned int i = 0; i < BenchmarkIterations; ++i)
 		{
-			Move::maxPrepareTime = elapsedTime;
+			const uint32_t startTicks = StepTimer::GetTimerTicks();
+			DDA::MovePlan plan;
+			DDA::PlanMove(msg, plan);
+			(void)benchmarkDda->Init(msg, plan, false);
+			const uint32_t preparedTicks = StepTimer::GetTimerTicks();
+			stepsCalculated += benchmarkDda->CalcAllStepTimes();
+			calcTicks += StepTimer::GetTimerTicks() - preparedTicks;
+			prepareTicks += preparedTicks - startTicks;
 		}
 
-		CanMessageBuffer::Free(buf);
+		const uint32_t cyclesPerStep = (stepsCalculated == 0) ? 0 : (uint32_t)(((uint64_t)calcTicks * (SystemCoreClock/StepTimer::StepClockRate))/stepsCalculated);
+		reply.lcatf("%s: prepare %.1fus, %" PRIu32 " steps, %" PRIu32 " cycles/step",
+					bm.name, (double)((float)(prepareTicks * (1'000'000/BenchmarkIterations))/(float)StepTimer::StepClockRate), stepsCalculated/BenchmarkIterations, cyclesPerStep);
+	}
+
+	Platform::SetPressureAdvance(0, savedPressureAdvance);
+	memcpy(DDA::stepsRequested, savedStepsRequested, sizeof(savedStepsRequested));
+	return GCodeResult::ok;
+}
+
+// Set the local firmware retraction parameters of a driver.
+// The speed in mm/min is in the low 16 bits of speedAndExtra and the extra unretract distance in microns is in the high 16 bits.
+GCodeResult Move::ConfigureRetraction(size_t driver, uint32_t lengthMicrons, uint32_t speedAndExtra, const StringRef& reply) noexcept
+{
+	if (driver >= NumDrivers)
+	{
+		reply.copy("Driver number out of range");
+		return GCodeResult::error;
+	}
+
+	RetractionParameters& rp = retraction[driver];
+	if (lengthMicrons == 0)
+	{
+		rp.length = 0.0;
+		reply.printf("Local retraction disabled on driver %u", driver);
+		return GCodeResult::ok;
+	}
+
+	const uint32_t speedMmPerMin = speedAndExtra & 0xFFFF;
+	if (speedMmPerMin == 0)
+	{
+		reply.copy("Retract speed must be greater than zero");
+		return GCodeResult::error;
+	}
+
+	rp.length = lengthMicrons * 0.001;
+	rp.speed = speedMmPerMin * (1.0/60.0);
+	rp.extraPrime = (speedAndExtra >> 16) * 0.001;
+	rp.retracted = false;
+	reply.printf("Driver %u local retraction %.2fmm at %.1fmm/sec, extra unretract %.2fmm",
+					driver, (double)rp.length, (double)rp.speed, (double)rp.extraPrime);
+	return GCodeResult::ok;
+}
 
-		// See whether we need to kick off a move
-		if (currentDda == nullptr)
+// Retract or unretract the drivers that have local retraction configured and are not already in that state.
+// The move starts when the queued moves have finished. The main board must allow for the time that it takes, because it doesn't know about it when it schedules the next move.
+GCodeResult Move::DoLocalRetraction(bool retract, const StringRef& reply) noexcept
+{
+	CanMessageMovementLinear msg;
+	msg.numDrivers = NumDrivers;
+	msg.pressureAdvanceDrives = 0;
+	msg.seq = 0;
+	msg.initialSpeedFraction = msg.finalSpeedFraction = 0.0;
+	msg.accelerationClocks = msg.steadyClocks = msg.decelClocks = 0;
+
+	// If several drivers move, the one that takes the longest sets the profile and the others move in proportion
+	bool anyMoving = false;
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		msg.perDrive[driver].steps = 0;
+		const RetractionParameters& rp = retraction[driver];
+		if (rp.length > 0.0 && rp.retracted != retract)
 		{
-			// No DDA is executing, so start executing a new one if possible
-			DDA * const cdda = ddaRingGetPointer;										// capture volatile variable
-			if (cdda->GetState() == DDA::frozen)
+			const float distance = (retract) ? rp.length : rp.length + rp.extraPrime;
+			const int32_t steps = lrintf(distance * Platform::DriveStepsPerUnit(driver));
+			if (steps != 0)
 			{
-				IrqDisable();
-				StartNextMove(cdda, StepTimer::GetTimerTicks());
-				if (cdda->ScheduleNextStepInterrupt(timer))
+				msg.perDrive[driver].steps = (retract) ? -steps : steps;
+				anyMoving = true;
+				CanMessageMovementLinear driverMsg;
+				SetLocalMoveProfile(driverMsg, distance, rp.speed, LocalRetractAcceleration);
+				if (driverMsg.accelerationClocks + driverMsg.steadyClocks + driverMsg.decelClocks > msg.accelerationClocks + msg.steadyClocks + msg.decelClocks)
 				{
-					Interrupt();
+					msg.accelerationClocks = driverMsg.accelerationClocks;
+					msg.steadyClocks = driverMsg.steadyClocks;
+					msg.decelClocks = driverMsg.decelClocks;
 				}
-				IrqEnable();
 			}
 		}
 	}
+
+	if (!anyMoving)
+	{
+		reply.copy((retract) ? "No drivers to retract" : "No drivers to unretract");
+		return GCodeResult::ok;
+	}
+
+	uint32_t startDelay;
+	const GCodeResult rslt = AddLocalMove(msg, startDelay, reply);
+	if (rslt != GCodeResult::ok)
+	{
+		return rslt;
+	}
+
+	for (RetractionParameters& rp : retraction)
+	{
+		if (rp.length > 0.0)
+		{
+			rp.retracted = retract;
+		}
+	}
+	++numLocalRetractions;
+	reply.printf("%s in %" PRIu32 "ms, taking %" PRIu32 "ms", (retract) ? "Retracting" : "Unretracting",
+					startDelay/(StepTimer::StepClockRate/1000), (msg.accelerationClocks + msg.steadyClocks + msg.decelClocks)/(StepTimer::StepClockRate/1000));
+	return GCodeResult::ok;
 }
 
-void Move::Diagnostics(const StringRef& reply)
+// Set the timing of a move generated by this board that starts and ends at rest. The distance, speed and acceleration may be in any consistent units, e.g. mm or steps.
+// We use a trapezoidal profile if there is room to reach the requested speed, else a triangular one. The caller must set up the rest of the message.
+/*static*/ void Move::SetLocalMoveProfile(CanMessageMovementLinear& msg, float distance, float speed, float acceleration) noexcept
 {
-	reply.catf("Moves scheduled %" PRIu32 ", completed %" PRIu32 ", in progress %d, hiccups %" PRIu32 ", step errors %u, maxPrep %" PRIu32 ", maxOverdue %" PRIu32 ", maxInc %" PRIu32,
-					scheduledMoves, completedMoves, (int)(currentDda != nullptr), numHiccups, DDA::GetAndClearStepErrors(), maxPrepareTime, DDA::GetAndClearMaxTicksOverdue(), DDA::GetAndClearMaxOverdueIncrement());
-	numHiccups = 0;
-	maxPrepareTime = 0;
-#if 1	//debug
-	reply.catf(", mcErrs %u, gcmErrs %u", moveCompleteTimeoutErrs, getCanMoveTimeoutErrs);
-#endif
+	float accelTime, steadyTime;
+	if (distance * acceleration >= fsquare(speed))
+	{
+		accelTime = speed/acceleration;
+		steadyTime = distance/speed - accelTime;
+	}
+	else
+	{
+		accelTime = fastSqrtf(distance/acceleration);
+		steadyTime = 0.0;
+	}
+	msg.accelerationClocks = msg.decelClocks = (uint32_t)(accelTime * (float)StepTimer::StepClockRate);
+	msg.steadyClocks = (uint32_t)(steadyTime * (float)StepTimer::StepClockRate);
+	msg.initialSpeedFraction = msg.finalSpeedFraction = 0.0;
+	msg.pressureAdvanceDrives = 0;
+	msg.seq = 0;
+}
+
+// Queue a move generated by this board. It starts when the queued moves have finished, or after a short delay if there are none.
+// The caller must have set up everything except whenToExecute. On success, startDelay is set to how long from now the move will start.
+GCodeResult Move::AddLocalMove(CanMessageMovementLinear& msg, uint32_t& startDelay, const StringRef& reply) noexcept
+{
+	MutexLocker lock(ddaAddMutex);
+	if (numQueuedMoves != 0)
+	{
+		reply.copy("Cannot add a local move while moves are waiting to be prepared");
+		return GCodeResult::error;
+	}
+	RecycleDdas();
+	if (!CanPrepareMove(msg))
+	{
+		reply.copy("No free DDA for the local move");
+		return GCodeResult::error;
+	}
+
+	const uint32_t now = StepTimer::GetTimerTicks();
+	const uint32_t earliestStartTime = now + LocalMoveLeadTicks;
+	msg.whenToExecute = ((int32_t)(queuedMovesEndTime - earliestStartTime) > 0) ? queuedMovesEndTime : earliestStartTime;
+	startDelay = msg.whenToExecute - now;
+	DDA::MovePlan plan;
+	DDA::PlanMove(msg, plan);
+	PrepareMove(msg, plan);
+	return GCodeResult::ok;
 }
 
 # if 0
@@ -307,9 +942,15 @@ void Move::CurrentMoveCompleted()
 		DDA *const cdda = currentDda;				// capture volatile variable
 		AtomicCriticalSectionLocker lock;			// disable interrupts while we are updating the move accumulators, until we set currentDda to null
 #if SINGLE_DRIVER
+# if SUPPORT_CLOSED_LOOP
+		cdda->CompleteCalculatedMotion();
+# endif
 		const int32_t stepsTaken = cdda->GetStepsTaken(0);
 		movementAccumulators[0] += stepsTaken;
 		lastMoveStepsTaken[0] = stepsTaken;
+		netStepTotals[0] += stepsTaken;
+		travelStepTotals[0] += labs(stepsTaken);
+		capacitySteps += labs(stepsTaken);
 # if SUPPORT_CLOSED_LOOP
 		netMicrostepsTaken += stepsTaken;
 # endif
@@ -319,13 +960,47 @@ void Move::CurrentMoveCompleted()
 			const int32_t stepsTaken = cdda->GetStepsTaken(driver);
 			lastMoveStepsTaken[driver] = stepsTaken;
 			movementAccumulators[driver] += stepsTaken;
+			netStepTotals[driver] += stepsTaken;
+			travelStepTotals[driver] += labs(stepsTaken);
+			capacitySteps += labs(stepsTaken);
 		}
+#endif
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			uint32_t minStepInterval = 0;
+			const uint32_t stepsGenerated = cdda->GetStepsGenerated(driver, minStepInterval);
+			StepRateProfiler::RecordMove(driver, stepsGenerated, minStepInterval, cdda->GetClocksNeeded());
+		}
+#if HAS_SMART_DRIVERS
+		DriveMovement::ClearStepIntervals();
 #endif
 		currentDda = nullptr;
+		accumulatorsSeq = accumulatorsSeq + 1;		// tell GetTotalExtrusion that it may have read inconsistent values
+	}
+
+	if (capacitySteps >= MaxCapacitySteps)
+	{
+		capacitySteps /= 2;
+		capacityIsrClocks /= 2;
 	}
 	ddaRingGetPointer = ddaRingGetPointer->GetNext();
 	completedMoves++;
 
+	// Record how much time this move lost to hiccups. If it needed none then the ISR is recovering, so reduce the hiccup time we will use next time.
+	if (currentMoveHiccupClocks != 0)
+	{
+		totalHiccupClocks += currentMoveHiccupClocks;
+		if (currentMoveHiccupClocks > maxHiccupClocksPerMove)
+		{
+			maxHiccupClocksPerMove = currentMoveHiccupClocks;
+		}
+		currentMoveHiccupClocks = 0;
+	}
+	else if (hiccupTime > DDA::MinHiccupTime)
+	{
+		hiccupTime = max<uint32_t>(hiccupTime/2, DDA::MinHiccupTime);
+	}
+
 	TaskBase * const waitingTask = taskWaitingForMoveToComplete;
 	if (waitingTask != nullptr)
 	{
@@ -339,6 +1014,59 @@ int32_t Move::GetPosition(size_t driver) const
 	return ddaRingAddPointer->GetPrevious()->GetPosition(driver);
 }
 
+// Get the current step rate of the fastest drive in the executing move in steps per step clock, or zero if no move is executing. May be called from an ISR.
+float Move::GetCurrentStepRate() const noexcept
+{
+	AtomicCriticalSectionLocker lock;				// stop the current move completing while we read it
+	const DDA * const cdda = currentDda;			// capture volatile variable
+	return (cdda == nullptr || cdda->GetState() != DDA::executing) ? 0.0 : cdda->GetCurrentStepRate(StepTimer::GetTimerTicks());
+}
+
+// Get the step clock time at which the executing move will finish, or if none is executing then when the next queued move will start.
+// Return false if there is no move executing or waiting to start.
+bool Move::GetNextMoveBoundary(uint32_t& when) const noexcept
+{
+	AtomicCriticalSectionLocker lock;				// stop the current move completing while we read it
+	const DDA *cdda = currentDda;					// capture volatile variable
+	if (cdda != nullptr)
+	{
+		when = cdda->GetMoveFinishTime();
+		return true;
+	}
+	cdda = ddaRingGetPointer;
+	if (cdda->GetState() == DDA::frozen)
+	{
+		when = cdda->GetMoveFinishTime() - cdda->GetClocksNeeded();
+		return true;
+	}
+	return false;
+}
+
+// Stop some of the drivers in the executing move, decelerating the move to rest if that is enabled and possible, else instantly.
+// Must be called with base priority greater than or equal to the step interrupt, to avoid a race with the step ISR.
+void Move::StopCurrentMove(DDA *cdda, uint16_t whichDrives) noexcept
+{
+#if SUPPORT_MICROSTEP_REDUCTION
+	ClearMicrostepResidues(whichDrives);			// the main board takes the stopped position as the new position, so the residues no longer apply
+#endif
+	if (deceleratingStops && cdda->StopDriversDecelerating(whichDrives))
+	{
+		++numDeceleratingStops;
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			lastStopRestPositions[driver] = cdda->GetPrevious()->GetPosition(driver) + cdda->GetNetStepsPlanned(driver);
+		}
+		return;
+	}
+
+	cdda->StopDrivers(whichDrives);
+	++numInstantStops;
+	if (cdda->GetState() == DDA::completed)
+	{
+		CurrentMoveCompleted();						// tell the DDA ring that the current move is complete
+	}
+}
+
 // Stop some or all of the moving drivers
 void Move::StopDrivers(uint16_t whichDrives)
 {
@@ -352,11 +1080,41 @@ void Move::StopDrivers(uint16_t whichDrives)
 	DDA *const cdda = currentDda;					// capture volatile
 	if (cdda != nullptr)
 	{
-		cdda->StopDrivers(whichDrives);
-		if (cdda->GetState() == DDA::completed)
+		StopCurrentMove(cdda, whichDrives);
+	}
+#if SAME5x
+	RestoreBasePriority(oldPrio);
+#elif SAMC21
+	IrqRestore(flags);
+#else
+# error Unsupported processor
+#endif
+}
+
+// Stop some of the moving drivers because a local input has triggered, and record the machine position in steps of each one when the input triggered.
+// If decelerating stops are enabled, the drivers come to rest a little further on. This may be called from an ISR. Return true if it stopped them.
+bool Move::StopDriversAndGetPositions(uint16_t whichDrives, uint32_t firstMoveToStop, int32_t positions[NumDrivers]) noexcept
+{
+#if SAME5x
+	const uint32_t oldPrio = ChangeBasePriority(NvicPriorityStep);
+#elif SAMC21
+	const irqflags_t flags = IrqSave();
+#else
+# error Unsupported processor
+#endif
+	bool stopped = false;
+	DDA *const cdda = currentDda;					// capture volatile
+	if (cdda != nullptr && cdda->GetState() == DDA::executing && (int32_t)(completedMoves - firstMoveToStop) >= 0)	// the executing move is number completedMoves
+	{
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
 		{
-			CurrentMoveCompleted();					// tell the DDA ring that the current move is complete
+			if (whichDrives & (1u << driver))
+			{
+				positions[driver] = cdda->GetPrevious()->GetPosition(driver) + cdda->GetStepsTaken(driver);
+			}
 		}
+		StopCurrentMove(cdda, whichDrives);
+		stopped = true;
 	}
 #if SAME5x
 	RestoreBasePriority(oldPrio);
@@ -365,20 +1123,149 @@ void Move::StopDrivers(uint16_t whichDrives)
 #else
 # error Unsupported processor
 #endif
+	return stopped;
+}
+
+GCodeResult Move::ConfigureDeceleratingStops(bool enable, const StringRef& reply) noexcept
+{
+	deceleratingStops = enable;
+	reply.printf("Stops %s, %" PRIu32 " decelerating and %" PRIu32 " instant so far", (enable) ? "decelerate to rest" : "are instant", numDeceleratingStops, numInstantStops);
+	if (numDeceleratingStops != 0)
+	{
+		reply.cat(", last came to rest at");
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			reply.catf(" %" PRIi32, lastStopRestPositions[driver]);
+		}
+	}
+	return GCodeResult::ok;
 }
 
 // Filament monitor support
-// Get the accumulated extruder motor steps taken by an extruder since the last call. Used by the filament monitoring code.
-// Returns the number of motor steps moves since the last call, and isPrinting is true unless we are currently executing an extruding but non-printing move
-int32_t Move::GetAccumulatedExtrusion(size_t driver, bool& isPrinting) noexcept
+// Get the total motor steps commanded for a driver since startup, including the steps taken so far in the current move. Callers compute the extrusion from the difference between two totals.
+// Also set isPrinting true unless we are currently executing an extruding but non-printing move.
+// This doesn't disable interrupts, so that several filament monitors polling it don't delay the step interrupt.
+// CurrentMoveCompleted updates movementAccumulators and currentDda together with interrupts disabled and then increments accumulatorsSeq,
+// so if accumulatorsSeq changes while we are reading then we may have read inconsistent values and we read them again.
+int32_t Move::GetTotalExtrusion(size_t driver, bool& isPrinting) const noexcept
 {
-	AtomicCriticalSectionLocker lock;
-	const int32_t ret = movementAccumulators[driver];
-	const DDA * const cdda = currentDda;						// capture volatile variable
-	const int32_t adjustment = (cdda == nullptr) ? 0 : cdda->GetStepsTaken(driver);
-	movementAccumulators[driver] = -adjustment;
-	isPrinting = extrudersPrinting;
-	return ret + adjustment;
+	while (true)
+	{
+		const uint32_t seq = accumulatorsSeq;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		const int32_t completedSteps = movementAccumulators[driver];
+		const DDA * const cdda = currentDda;						// capture volatile variable
+		const int32_t stepsTaken = (cdda == nullptr) ? 0 : cdda->GetStepsTaken(driver);
+		const bool printing = extrudersPrinting;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		if (accumulatorsSeq == seq)
+		{
+			isPrinting = printing;
+			return completedSteps + stepsTaken;
+		}
+		numTotalsReadRetries = numTotalsReadRetries + 1;
+	}
+}
+
+// Read the total extrusion of a driver repeatedly for the specified number of milliseconds, checking each value against totals read with interrupts disabled just before and just after it.
+// If the driver is moving then some reads race the step ISR completing a move. A torn read would count the steps of that move twice or not at all, which puts it outside the two reference totals.
+// A direction reversal between the reference reads could also do that, but the reads are only a few microseconds apart so it is rare.
+GCodeResult Move::TestTotalExtrusionReads(size_t driver, uint32_t duration, const StringRef& reply) const noexcept
+{
+	if (driver >= NumDrivers)
+	{
+		reply.copy("Driver number out of range");
+		return GCodeResult::error;
+	}
+	if (duration == 0 || duration > MaxTotalsReadTestDuration)
+	{
+		reply.printf("Duration must be between 1 and %" PRIu32 "ms", MaxTotalsReadTestDuration);
+		return GCodeResult::error;
+	}
+
+	auto referenceTotal = [this, driver]() noexcept -> int32_t
+		{
+			AtomicCriticalSectionLocker lock;
+			const DDA * const cdda = currentDda;				// capture volatile variable
+			return movementAccumulators[driver] + ((cdda == nullptr) ? 0 : cdda->GetStepsTaken(driver));
+		};
+
+	const uint32_t startRetries = numTotalsReadRetries;
+	const uint32_t startCompletedMoves = completedMoves;
+	uint32_t numReads = 0, numBadReads = 0;
+	const uint32_t startTime = millis();
+	do
+	{
+		const int32_t before = referenceTotal();
+		bool isPrinting;
+		const int32_t total = GetTotalExtrusion(driver, isPrinting);
+		const int32_t after = referenceTotal();
+		if (total < min<int32_t>(before, after) || total > max<int32_t>(before, after))
+		{
+			++numBadReads;
+		}
+		++numReads;
+	} while (millis() - startTime < duration);
+
+	reply.printf("%" PRIu32 " reads of driver %u totals during %" PRIu32 " completed moves, %" PRIu32 " retried, %" PRIu32 " out of range",
+					numReads, driver, completedMoves - startCompletedMoves, numTotalsReadRetries - startRetries, numBadReads);
+	return (numBadReads == 0) ? GCodeResult::ok : GCodeResult::warning;
+}
+
+// Get the 64-bit step totals of all drivers including the steps taken so far in the current move, using accumulatorsSeq in the same way as GetTotalExtrusion
+// so that the totals of all drivers are from the same instant
+void Move::GetStepTotals(int64_t netSteps[NumDrivers], uint64_t travelSteps[NumDrivers]) const noexcept
+{
+	while (true)
+	{
+		const uint32_t seq = accumulatorsSeq;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		const DDA * const cdda = currentDda;						// capture volatile variable
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			const int32_t stepsTaken = (cdda == nullptr) ? 0 : cdda->GetStepsTaken(driver);
+			netSteps[driver] = netStepTotals[driver] + stepsTaken;
+			travelSteps[driver] = travelStepTotals[driver] + labs(stepsTaken);
+		}
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		if (accumulatorsSeq == seq)
+		{
+			return;
+		}
+		numTotalsReadRetries = numTotalsReadRetries + 1;
+	}
+}
+
+// Report the step totals and the distances they correspond to
+GCodeResult Move::ReportStepTotals(const StringRef& reply) const noexcept
+{
+	int64_t netSteps[NumDrivers];
+	uint64_t travelSteps[NumDrivers];
+	GetStepTotals(netSteps, travelSteps);
+	reply.copy("Step totals (net, travelled):");
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		const double stepsPerMm = (double)Platform::DriveStepsPerUnit(driver);
+		reply.catf("%s %u: %" PRIi64 " (%.1fmm), %" PRIu64 " (%.1fmm)",
+					(driver == 0) ? "" : ",", driver, netSteps[driver], (double)netSteps[driver]/stepsPerMm, travelSteps[driver], (double)travelSteps[driver]/stepsPerMm);
+	}
+	return GCodeResult::ok;
+}
+
+// Append the step totals to the compact diagnostics, each as a compound field of the high and low words of the net steps and then of the steps travelled
+void Move::AppendStepTotals(CompactDiagnostics& diags) const noexcept
+{
+	int64_t netSteps[NumDrivers];
+	uint64_t travelSteps[NumDrivers];
+	GetStepTotals(netSteps, travelSteps);
+	diags.StartSection('P');
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		diags.Add((uint32_t)((uint64_t)netSteps[driver] >> 32));
+		diags.AddPart((uint32_t)netSteps[driver]);
+		diags.AddPart((uint32_t)(travelSteps[driver] >> 32));
+		diags.AddPart((uint32_t)travelSteps[driver]);
+	}
 }
 
 // For debugging
@@ -396,16 +1283,32 @@ void Move::Interrupt()
 {
 	const uint32_t isrStartTime = StepTimer::GetTimerTicks();
 	uint32_t now = isrStartTime;
+
+	// Record how late we are for the step that caused this interrupt
+	{
+		const DDA * const cdda = currentDda;						// capture volatile variable
+		if (cdda != nullptr)
+		{
+			const int32_t ticksLate = (int32_t)(isrStartTime - cdda->GetNextInterruptTime());
+			stepLatenessHistogram.Record((ticksLate > 0) ? (uint32_t)ticksLate : 0);
+			if (ticksLate > (int32_t)DDA::StepErrorLateThreshold)
+			{
+				DDA::CountStepErrorReason(DDA::StepErrorReason::lateStep);
+			}
+		}
+	}
+
 	for (;;)
 	{
 		// Generate a step for the current move
 		DDA* cdda = currentDda;										// capture volatile variable
 		if (cdda == nullptr)
 		{
-			return;													// no current  move, so no steps needed
+			break;													// no current  move, so no steps needed
 		}
 
 		cdda->StepDrivers(now);
+		StepTrace::Record(now, *cdda);
 		if (cdda->GetState() == DDA::completed)
 		{
 			const uint32_t finishTime = cdda->GetMoveFinishTime();	// calculate when this move should finish
@@ -415,35 +1318,48 @@ void Move::Interrupt()
 			cdda = ddaRingGetPointer;
 			if (cdda->GetState() != DDA::frozen)
 			{
-				return;
+				break;
 			}
 
 			StartNextMove(cdda, finishTime);
 		}
 
-		// Schedule a callback at the time when the next step is due, and quit unless it is due immediately
-		if (!cdda->ScheduleNextStepInterrupt(timer))
+		// If the next step is due immediately then generate it without going through the step timer, which saves scheduling and cancelling a callback for every step.
+		// Otherwise schedule a callback at the time when the next step is due, and quit unless it turns out to be due immediately after all.
+		now = StepTimer::GetTimerTicks();
+		if (cdda->IsNextStepDue(now))
 		{
-			return;
+			++numBatchedSteps;
+		}
+		else
+		{
+			if (!cdda->ScheduleNextStepInterrupt(timer))
+			{
+				break;
+			}
+			now = StepTimer::GetTimerTicks();
 		}
 
 		// The next step is due immediately. Check whether we have been in this ISR for too long already and need to take a break
-		//TODO avoid the next read of the step timer, the last one read by ScheduleNextStepInterrupt will do
-		now = StepTimer::GetTimerTicks();
 		if (now - isrStartTime >= DDA::MaxStepInterruptTime)
 		{
 			// Force a break by updating the move start time.
-			// If the inserted hiccup is too short then it won't help. So we double the hiccup time on each iteration.
+			// If the inserted hiccup is too short then it won't help. So we double the hiccup time each time we need another one during the same move.
 			++numHiccups;
-			cdda->InsertHiccup(now);
+			currentMoveHiccupClocks += cdda->InsertHiccup(now, hiccupTime);
+			hiccupTime = min<uint32_t>(hiccupTime * 2, DDA::MaxHiccupTime);
 
 			// Reschedule the next step interrupt. This time it should succeed if the hiccup time was long enough.
 			if (!cdda->ScheduleNextStepInterrupt(timer))
 			{
-				return;
+				break;
 			}
 		}
 	}
+
+	isrTimeHistogram.Record(now - isrStartTime);				// the last time we read the step clock is close enough to the end time
+	stepIsrClocks += now - isrStartTime;
+	capacityIsrClocks += now - isrStartTime;
 }
 
 // For debugging
@@ -461,6 +1377,14 @@ void Move::DebugPrintCdda() const noexcept
 bool Move::SetMicrostepping(size_t driver, unsigned int microsteps, bool interpolate) noexcept
 {
 	const bool ret = SmartDrivers::SetMicrostepping(driver, microsteps, interpolate);
+# if SUPPORT_MICROSTEP_REDUCTION
+	if (ret)
+	{
+		// The driver no longer reduces the microstepping, and any residue was in the old microsteps
+		microstepReductions[driver] = 0;
+		microstepResidues[driver] = 0;
+	}
+# endif
 # if SUPPORT_CLOSED_LOOP
 	if (ret && driver == 0)
 	{
@@ -472,6 +1396,108 @@ bool Move::SetMicrostepping(size_t driver, unsigned int microsteps, bool interpo
 
 #endif
 
+#if SUPPORT_MICROSTEP_REDUCTION
+
+// Automatic microstep reduction.
+// When a move would step a driver faster than microstepReductionRate, we reduce the microstepping of that driver by a power of 2 so that it needs fewer steps.
+// With microstep interpolation enabled the driver still moves the motor smoothly, but the step ISR has far less work to do.
+// The main board sends the steps in configured microsteps, so we track the difference between the commanded position and the actual one in microstepResidues
+// and include it in the next move of the driver. The positions that we report and store in the DDA endpoints are the actual ones in configured microsteps.
+// The driver takes a few milliseconds to receive the new microstep resolution, so we only change it when the driver has no steps queued and the move that needs the change
+// isn't due to start for a while. Otherwise we keep the current reduction, which at worst means that a slow move uses coarser microstepping than it needs.
+constexpr unsigned int MinReducedMicrostepShift = 4;						// we never reduce the microstepping below x16
+constexpr uint32_t MinMicrostepChangeLeadTicks = StepTimer::StepClockRate/50;	// we need at least 20ms to send the new microstepping to the driver
+
+GCodeResult Move::ConfigureMicrostepReduction(uint32_t stepRate, const StringRef& reply) noexcept
+{
+	microstepReductionRate = stepRate;
+	if (stepRate == 0)
+	{
+		reply.copy("Automatic microstep reduction disabled");
+	}
+	else
+	{
+		reply.printf("Microstepping reduced above %" PRIu32 " microsteps/sec", stepRate);
+	}
+	return GCodeResult::ok;
+}
+
+// Adjust the number of steps in a move for the microstep reduction that we will use for it, and return the reduction as a power of 2.
+// On entry, steps is the number of steps requested by the main board in configured microsteps and peakStepsPerClock is the peak step rate of the move in those microsteps.
+// Called by DDA::Init when preparing a move for execution. The caller must own ddaAddMutex.
+unsigned int Move::AdjustStepsForMicrostepReduction(size_t driver, int32_t& steps, float peakStepsPerClock, uint32_t whenToExecute) noexcept
+{
+	unsigned int reduction = microstepReductions[driver];
+	bool interpolate = false;
+	const unsigned int microstepShift = __builtin_ctz(SmartDrivers::GetMicrostepping(driver, interpolate));
+	if ((microstepReductionRate != 0 || reduction != 0) && interpolate && microstepShift > MinReducedMicrostepShift)
+	{
+		// Work out how much we would like to reduce the microstepping by
+		unsigned int wantedReduction = 0;
+		if (microstepReductionRate != 0)
+		{
+			float stepRate = peakStepsPerClock * (float)StepTimer::StepClockRate;
+			while (wantedReduction < microstepShift - MinReducedMicrostepShift && stepRate > (float)microstepReductionRate)
+			{
+				stepRate *= 0.5;
+				++wantedReduction;
+			}
+
+			// Don't return to finer microstepping until the step rate has fallen to half the rate at which we reduced it, to avoid changing it too often
+			if (wantedReduction < reduction && stepRate > ldexpf((float)microstepReductionRate, (int)(reduction - wantedReduction) - 2))
+			{
+				wantedReduction = reduction;
+			}
+		}
+
+		if (   wantedReduction != reduction
+			&& (int32_t)(completedMoves - lastMoveWithSteps[driver]) >= 0						// if the driver has no steps queued
+			&& (int32_t)(whenToExecute - StepTimer::GetTimerTicks()) >= (int32_t)MinMicrostepChangeLeadTicks
+		   )
+		{
+			reduction = wantedReduction;
+			microstepReductions[driver] = reduction;
+			SmartDrivers::SetMicrostepReduction(driver, reduction);
+			++numMicrostepChanges;
+		}
+	}
+
+	// Convert the steps to reduced microsteps, rounding to nearest and keeping the remainder for next time
+	const int32_t wantedSteps = steps + microstepResidues[driver];
+	if (reduction == 0)
+	{
+		steps = wantedSteps;
+		microstepResidues[driver] = 0;
+	}
+	else
+	{
+		const int32_t reducedSteps = (wantedSteps + (1 << (reduction - 1))) >> reduction;
+		microstepResidues[driver] = wantedSteps - reducedSteps * (1 << reduction);
+		steps = reducedSteps;
+	}
+
+	if (steps != 0)
+	{
+		lastMoveWithSteps[driver] = scheduledMoves + 1;											// the caller increments scheduledMoves when it adds this move
+	}
+	return reduction;
+}
+
+// Forget the difference between the commanded and actual positions of some drivers.
+// Called when they are stopped or their positions are reverted, because the main board then resets its idea of their positions to the ones we report.
+void Move::ClearMicrostepResidues(uint16_t whichDrives) noexcept
+{
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		if (whichDrives & (1u << driver))
+		{
+			microstepResidues[driver] = 0;
+		}
+	}
+}
+
+#endif
+
 #endif	//SUPPORT_DRIVERS
 
 // End
@@ -14,11 +14,24 @@
 
 #include "DDA.h"								// needed because of our inline functions
 #include "Kinematics/Kinematics.h"
+#include <Histogram.h>
+#include <RTOSIface/RTOSIface.h>
 
 // Define the number of DDAs
-const unsigned int DdaRingLength = 50;
+const unsigned int DdaRingLength = 50;											// the number of DDAs we start with
+const unsigned int MaxDdaRingLength = 200;											// the number of DDAs we may be asked to increase that to
+
+#if !SINGLE_DRIVER
+// DDAs take DriveMovement objects from a shared pool for just the drivers that move. Most moves on a multi-driver board use one or two drivers,
+// so we provide two per DDA, or fewer if the board has fewer drivers. When the pool runs out, new moves wait for earlier ones to complete.
+# ifndef DM_POOL_DMS_PER_DDA
+#  define DM_POOL_DMS_PER_DDA	((NumDrivers < 2) ? NumDrivers : 2)
+# endif
+constexpr unsigned int DmPoolDmsPerDda = DM_POOL_DMS_PER_DDA;
+#endif
 
 struct CanMessageStopMovement;
+class CompactDiagnostics;
 
 /**
  * This is the master movement class.  It controls all movement in the machine.
@@ -30,10 +43,26 @@ public:
 	void Init() noexcept;															// Start me up
 	void Exit() noexcept;															// Shut down
 	void Diagnostics(const StringRef& reply) noexcept;								// Report useful stuff
-
-	void Interrupt() noexcept SPEED_CRITICAL;										// Timer callback for step generation
+	void TimingDiagnostics(const StringRef& reply) noexcept;						// Report the prepare and step interrupt timing histograms
+	void AppendCompactDiagnostics(CompactDiagnostics& diags) const noexcept;		// Append the move counters to the compact diagnostics without clearing them
+	uint32_t GetAndClearStepIsrClocks() noexcept;									// Get the total time spent in the step ISR since the last call
+	uint32_t GetMaxSustainableStepRate() const noexcept;							// Estimate the total steps per second we can generate, or 0 if we don't know yet
+	GCodeResult ConfigureLowQueueWarning(uint32_t millisQueued, const StringRef& reply) noexcept;	// Warn when the queued motion falls below this time, or never if it is zero
+	void CheckMotionQueue() noexcept;												// Raise an event if the queued motion is running out while moves are still arriving
+	GCodeResult RunBenchmark(const StringRef& reply) noexcept;						// Time the move preparation and step calculation code
+	GCodeResult SetDdaRingLength(unsigned int numDdas, const StringRef& reply) noexcept;	// Increase the number of DDAs, or report it if numDdas is zero
+	GCodeResult ConfigureRetraction(size_t driver, uint32_t lengthMicrons, uint32_t speedAndExtra, const StringRef& reply) noexcept;	// Set the local firmware retraction parameters of a driver
+	GCodeResult DoLocalRetraction(bool retract, const StringRef& reply) noexcept;	// Retract or unretract the configured drivers when the queued moves have finished
+	GCodeResult AddLocalMove(CanMessageMovementLinear& msg, uint32_t& startDelay, const StringRef& reply) noexcept;	// Queue a move generated by this board to start when the queued moves have finished
+	static void SetLocalMoveProfile(CanMessageMovementLinear& msg, float distance, float speed, float acceleration) noexcept;	// Set the timing of a local move from its speed and acceleration
+
+	void Interrupt() noexcept ISR_CRITICAL;										// Timer callback for step generation
 	void StopDrivers(uint16_t whichDrives) noexcept;
-	void CurrentMoveCompleted() noexcept SPEED_CRITICAL;							// Signal that the current move has just been completed
+	bool StopDriversAndGetPositions(uint16_t whichDrives, uint32_t firstMoveToStop, int32_t positions[NumDrivers]) noexcept;	// Stop the drivers if the executing move is firstMoveToStop or later
+	GCodeResult ConfigureDeceleratingStops(bool enable, const StringRef& reply) noexcept;	// Make stops decelerate the move to rest instead of stopping it instantly
+	GCodeResult ConfigureMoveMerging(uint32_t toleranceHundredths, const StringRef& reply) noexcept;	// Merge queued moves that continue each other within this many hundredths of a step, or never if it is zero
+	void CurrentMoveCompleted() noexcept ISR_CRITICAL;							// Signal that the current move has just been completed
+	bool TryPrepareMoveDirect(const CanMessageMovementLinear& msg) noexcept;		// Prepare a just-received move unless it must be queued for the move task
 
 #if SUPPORT_DELTA_MOVEMENT
 	// Kinematics and related functions
@@ -49,11 +78,18 @@ public:
 	void PrintCurrentDda() const noexcept;											// For debugging
 
 	void ResetMoveCounters() noexcept { scheduledMoves = completedMoves = 0; }
+	uint32_t GetCompletedMoves() const noexcept { return completedMoves; }
+	uint32_t GetScheduledMoves() const noexcept { return scheduledMoves; }
+	uint32_t GetNumHiccups() const noexcept { return numHiccups; }					// Get the number of hiccups since M122 last reported them
+	float GetCurrentStepRate() const noexcept;										// Get the step rate of the fastest drive in the executing move in steps per step clock, or zero if there is none
+	bool GetNextMoveBoundary(uint32_t& when) const noexcept;						// Get when the executing move finishes or the next move starts, returning false if there are no moves
+	bool IsIdle() const noexcept { return currentDda == nullptr && ddaRingGetPointer == ddaRingAddPointer; }	// true if no move is executing or queued
 
 	int32_t GetPosition(size_t driver) const noexcept;
 
 	// Filament monitor support
-	int32_t GetAccumulatedExtrusion(size_t driver, bool& isPrinting) noexcept;		// Return and reset the accumulated commanded extrusion amount
+	int32_t GetTotalExtrusion(size_t driver, bool& isPrinting) const noexcept;		// Return the total commanded motor steps of a driver, without disabling interrupts
+	GCodeResult TestTotalExtrusionReads(size_t driver, uint32_t duration, const StringRef& reply) const noexcept;	// Check that GetTotalExtrusion doesn't return torn values when it races the step ISR
 	uint32_t ExtruderPrintingSince() const noexcept { return extrudersPrintingSince; }	// When we started doing normal moves after the most recent extruder-only move
 
 #if HAS_SMART_DRIVERS
@@ -61,6 +97,12 @@ public:
 	bool SetMicrostepping(size_t driver, unsigned int microsteps, bool interpolate) noexcept;
 #endif
 
+#if SUPPORT_MICROSTEP_REDUCTION
+	GCodeResult ConfigureMicrostepReduction(uint32_t stepRate, const StringRef& reply) noexcept;	// Reduce the microstepping above this step rate, or never if it is zero
+	unsigned int AdjustStepsForMicrostepReduction(size_t driver, int32_t& steps, float peakStepsPerClock, uint32_t whenToExecute) noexcept;
+	void ClearMicrostepResidues(uint16_t whichDrives) noexcept;					// Forget the residues of these drivers because the main board will reset their positions
+#endif
+
 	void DebugPrintCdda() const noexcept;											// for debugging
 
 	[[noreturn]] void TaskLoop() noexcept;
@@ -70,33 +112,100 @@ public:
 #endif
 
 	const volatile int32_t *GetLastMoveStepsTaken() const noexcept { return lastMoveStepsTaken; }
+	void GetStepTotals(int64_t netSteps[NumDrivers], uint64_t travelSteps[NumDrivers]) const noexcept;	// Get a consistent snapshot of the 64-bit step totals of all drivers
+	GCodeResult ReportStepTotals(const StringRef& reply) const noexcept;
+	void AppendStepTotals(CompactDiagnostics& diags) const noexcept;
 
 private:
 	bool DDARingAdd() noexcept;														// Add a processed look-ahead entry to the DDA ring
 	DDA* DDARingGet() noexcept;														// Get the next DDA ring entry to be run
 	void StartNextMove(DDA *cdda, uint32_t startTime) noexcept;						// Start a move
+	void RecycleDdas() noexcept;													// Release the DDAs of completed moves
+	void PrepareMove(const CanMessageMovementLinear& msg, const DDA::MovePlan& plan) noexcept;	// Prepare a move in the DDA at the add pointer and start it if nothing is executing
+	bool CanPrepareMove(const CanMessageMovementLinear& msg) const noexcept;		// Return true if there is a free DDA and enough free DMs for the move
+	bool TryMergeMove(CanMessageMovementLinear& msg, const CanMessageMovementLinear& nextMsg) const noexcept;	// Append the next move to this one if they can be executed as a single move
+	void StopCurrentMove(DDA *cdda, uint16_t whichDrives) noexcept;				// Stop the drivers in the executing move, decelerating if enabled. Interrupts must be disabled.
 
 	// Variables that are in the DDARing class in RepRapFirmware (we have only one DDARing so they are here)
 	DDA* volatile currentDda;
 	DDA* ddaRingAddPointer;
 	DDA* volatile ddaRingGetPointer;
 	DDA* ddaRingCheckPointer;
+	unsigned int ddaRingLength;														// the number of DDAs in the ring
 
 	StepTimer timer;
 	volatile int32_t lastMoveStepsTaken[NumDrivers];								// how many steps were taken in the last move we did
-	volatile int32_t movementAccumulators[NumDrivers]; 								// Accumulated motor steps
+	volatile int32_t movementAccumulators[NumDrivers]; 								// Accumulated motor steps of completed moves, only ever added to
+	volatile uint32_t accumulatorsSeq;												// incremented whenever CurrentMoveCompleted updates movementAccumulators and currentDda
+	mutable volatile uint32_t numTotalsReadRetries;									// how many times a reader of the step totals had to read them again because a move completed
+	int64_t netStepTotals[NumDrivers];												// 64-bit versions of movementAccumulators, which don't wrap on long-running machines
+	uint64_t travelStepTotals[NumDrivers];											// the sum of the net steps of each completed move regardless of direction, for odometers
 	volatile uint32_t extrudersPrintingSince;										// The milliseconds clock time when extrudersPrinting was set to true
 	volatile bool extrudersPrinting;												// Set whenever an extruder starts a printing move, cleared by a non-printing extruder move
 	TaskBase * volatile taskWaitingForMoveToComplete;
+	Mutex ddaAddMutex;																// owned by whichever task is adding a move to the ring or recycling completed DDAs
 	// End DDARing variables
 
 	Kinematics *kinematics;															// What kinematics we are using
 
 	uint32_t scheduledMoves;														// Move counters for the code queue
 	volatile uint32_t completedMoves;												// This one is modified by an ISR, hence volatile
+	unsigned int numQueuedMoves;													// How many moves are queued for the move task, protected by ddaAddMutex
+	uint32_t numDirectMoves;														// How many moves the CAN receiver task prepared without queuing them
+	uint32_t numPlannedAheadMoves;													// How many moves the move task planned while waiting for a free DDA
 	uint32_t numHiccups;															// How many times we delayed an interrupt to avoid using too much CPU time in interrupts
+	uint32_t numBatchedSteps;														// How many times we generated the next step without scheduling an interrupt
+	uint32_t hiccupTime;															// How long the next hiccup will be, in step clocks
+	uint32_t currentMoveHiccupClocks;												// How much the current move has been delayed by hiccups
+	uint32_t totalHiccupClocks;														// How much time all moves have lost to hiccups since we last reported it
+	uint32_t maxHiccupClocksPerMove;												// The most time any single move lost to hiccups since we last reported it
 	uint32_t maxPrepareTime;
 
+	Histogram<8, 4> prepareTimeHistogram;											// DDA::Init time in microseconds
+	Histogram<8, 3> isrTimeHistogram;												// step interrupt duration in step clocks
+	volatile uint32_t stepIsrClocks;												// total step interrupt time since the CPU usage was last sampled
+	volatile uint32_t capacityIsrClocks;											// step interrupt time used to estimate how fast we can generate steps
+	volatile uint32_t capacitySteps;												// the steps taken in capacityIsrClocks
+
+	// Motion queue underrun prediction
+	uint32_t queuedMovesEndTime;													// when the last move we prepared will finish
+	uint32_t lastMovePreparedTime;													// the step clock when we last prepared a move
+	uint32_t lowQueueWarningClocks;													// warn when the queued motion falls below this, or never if it is zero
+	uint32_t minQueuedClocks;														// the least motion we had queued when a move arrived while printing
+	uint32_t numLowQueueWarnings;													// how many low queue warnings we have raised
+	bool lowQueueWarningArmed;														// true if we may raise a low queue warning
+
+	// Local firmware retraction
+	struct RetractionParameters
+	{
+		float length;																// how far to retract in mm, or zero if retraction is not configured
+		float speed;																// the retract and unretract speed in mm/sec
+		float extraPrime;															// the extra distance to unretract in mm
+		bool retracted;																// true if we have retracted and not yet unretracted
+	};
+
+	RetractionParameters retraction[NumDrivers];
+	uint32_t numLocalRetractions;													// how many local retract and unretract moves we have done
+
+	// Decelerating stops
+	bool deceleratingStops;															// true if stops should decelerate the move to rest instead of stopping it instantly
+	uint32_t numDeceleratingStops;													// how many stops we decelerated
+	uint32_t numInstantStops;														// how many stops we did instantly, including ones where we couldn't decelerate
+	int32_t lastStopRestPositions[NumDrivers];										// where the drivers came to rest after the last decelerating stop
+
+	// Merging of queued moves that continue each other, e.g. the short collinear segments of a dense mesh
+	float mergeTolerance;															// the most that merging may move a junction between moves in steps, or 0 to disable merging
+	uint32_t numMergedMoves;														// how many moves have been merged into the move before them
+	Histogram<8, 2> stepLatenessHistogram;											// how late the step interrupt started in step clocks
+
+#if SUPPORT_MICROSTEP_REDUCTION
+	uint32_t microstepReductionRate;												// the step rate in configured microsteps above which we reduce the microstepping, or 0 if we never do
+	uint32_t numMicrostepChanges;													// how many times we have changed the microstep reduction of a driver
+	uint32_t lastMoveWithSteps[NumDrivers];											// the scheduled move number of the last move that stepped each driver
+	int32_t microstepResidues[NumDrivers];											// for each driver, the commanded position minus the actual position in configured microsteps
+	uint8_t microstepReductions[NumDrivers];										// how many powers of 2 the microstepping of each driver is reduced by
+#endif
+
 #if SUPPORT_CLOSED_LOOP
 # if SINGLE_DRIVER
 	int32_t netMicrostepsTaken;														// the net microsteps taken not counting any move that is in progress
@@ -112,11 +221,10 @@ private:
 #if HAS_SMART_DRIVERS
 
 // Get the current step interval for this axis or extruder, or 0 if it is not moving
-// This is called from the stepper drivers SPI interface ISR
+// This is called from the stepper drivers SPI interface ISR, so it only reads the interval that the step ISR published rather than looking at the current DDA
 inline uint32_t Move::GetStepInterval(size_t axis, uint32_t microstepShift) const noexcept
 {
-	const DDA * const cdda = currentDda;		// capture volatile variable
-	return (cdda != nullptr) ? cdda->GetStepInterval(axis, microstepShift) : 0;
+	return DriveMovement::GetStepInterval(axis, microstepShift);
 }
 
 #endif
@@ -0,0 +1,135 @@
+/*
+ * StepRateProfiler.cpp
+ */
+
+#include "StepRateProfiler.h"
+
+#if SUPPORT_DRIVERS
+
+#include "DDA.h"
+#include "StepTimer.h"
+#include <CommandProcessing/CompactDiagnostics.h>
+
+namespace StepRateProfiler
+{
+	constexpr uint32_t IntervalMillis = 60000;
+
+	struct DriverStepRates
+	{
+		uint32_t numMoves;									// how many moves had steps for this driver
+		uint32_t numMultiStepMoves;							// how many of those moves needed double, quad or octal stepping
+		uint32_t totalSteps;
+		uint32_t movingClocks;								// the total duration of those moves
+		uint32_t minStepInterval;							// the shortest step interval in any of those moves in step clocks, or zero if there were none
+
+		void Clear() noexcept { numMoves = numMultiStepMoves = totalSteps = movingClocks = minStepInterval = 0; }
+		uint32_t GetPeakStepRate() const noexcept { return (minStepInterval == 0) ? 0 : StepTimer::StepClockRate/minStepInterval; }
+		uint32_t GetAverageStepRate() const noexcept { return (movingClocks == 0) ? 0 : (uint32_t)(((uint64_t)totalSteps * StepTimer::StepClockRate)/movingClocks); }
+	};
+
+	// The step ISR updates 'current'. Spin copies it to 'lastInterval' and clears it with interrupts disabled.
+	static DriverStepRates current[NumDrivers];
+	static DriverStepRates lastInterval[NumDrivers];
+	static uint64_t totalMovingClocks[NumDrivers] = { 0 };		// the moving time of each driver in all completed intervals
+	static uint32_t intervalStartMillis = 0;
+	static bool haveLastInterval = false;
+
+	// The step rate above which CalcNextStepTime calculates the step times of more than one step at a time
+	constexpr uint32_t MultiStepRate = StepTimer::StepClockRate/DDA::MinCalcIntervalCartesian;
+}
+
+void StepRateProfiler::RecordMove(size_t driver, uint32_t steps, uint32_t minStepInterval, uint32_t moveClocks) noexcept
+{
+	if (steps != 0)
+	{
+		DriverStepRates& r = current[driver];
+		++r.numMoves;
+		r.totalSteps += steps;
+		r.movingClocks += moveClocks;
+		if (minStepInterval < DDA::MinCalcIntervalCartesian)
+		{
+			++r.numMultiStepMoves;
+		}
+		if (minStepInterval == 0)
+		{
+			minStepInterval = 1;							// CalcNextStepTime sets the interval to zero if rounding errors made a step time not increase
+		}
+		if (minStepInterval != UINT32_MAX && (r.minStepInterval == 0 || minStepInterval < r.minStepInterval))	// followers of another DM don't calculate their own intervals
+		{
+			r.minStepInterval = minStepInterval;
+		}
+	}
+}
+
+void StepRateProfiler::Spin() noexcept
+{
+	const uint32_t now = millis();
+	if (now - intervalStartMillis >= IntervalMillis)
+	{
+		AtomicCriticalSectionLocker lock;
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			lastInterval[driver] = current[driver];
+			totalMovingClocks[driver] += current[driver].movingClocks;
+			current[driver].Clear();
+		}
+		intervalStartMillis = now;
+		haveLastInterval = true;
+	}
+}
+
+uint64_t StepRateProfiler::GetTotalMovingClocks(size_t driver) noexcept
+{
+	return totalMovingClocks[driver];
+}
+
+// Report the last complete minute, with the peak rate as a percentage of the rate at which we have to calculate more than one step at a time
+void StepRateProfiler::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Step rates in last minute (multi-step above %" PRIu32 ", ISR loop limit %" PRIu32 "us):",
+				MultiStepRate, StepTimer::TicksToIntegerMicroseconds(DDA::MaxStepInterruptTime));
+	if (!haveLastInterval)
+	{
+		reply.cat(" not available yet");
+		return;
+	}
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		const DriverStepRates& r = lastInterval[driver];
+		const uint32_t peak = r.GetPeakStepRate();
+		reply.catf("%s %u: peak %" PRIu32 " (%" PRIu32 "%%) avg %" PRIu32 " moves %" PRIu32 " multi %" PRIu32,
+					(driver == 0) ? "" : ",", driver, peak, (peak * 100u)/MultiStepRate, r.GetAverageStepRate(), r.numMoves, r.numMultiStepMoves);
+	}
+}
+
+// Append one compound field per driver: peak steps/sec, average steps/sec while moving, moves, multi-stepped moves, shortest step interval in step clocks.
+// All are zero until the first minute has been completed.
+void StepRateProfiler::AppendCompactDiagnostics(CompactDiagnostics& diags) noexcept
+{
+	diags.StartSection('S');
+	diags.Add(MultiStepRate);
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		const DriverStepRates& r = lastInterval[driver];
+		if (haveLastInterval)
+		{
+			diags.Add(r.GetPeakStepRate());
+			diags.AddPart(r.GetAverageStepRate());
+			diags.AddPart(r.numMoves);
+			diags.AddPart(r.numMultiStepMoves);
+			diags.AddPart(r.minStepInterval);
+		}
+		else
+		{
+			diags.Add((uint32_t)0);
+			diags.AddPart(0);
+			diags.AddPart(0);
+			diags.AddPart(0);
+			diags.AddPart(0);
+		}
+	}
+}
+
+#endif	// SUPPORT_DRIVERS
+
+// End
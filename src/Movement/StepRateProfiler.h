@@ -0,0 +1,34 @@
+/*
+ * StepRateProfiler.h
+ *
+ *  Records the peak and average step rate that each driver reaches in each move, aggregated over one-minute intervals,
+ *  so that we can see which drivers are approaching the step rate limits of the step ISR.
+ */
+
+#ifndef SRC_MOVEMENT_STEPRATEPROFILER_H_
+#define SRC_MOVEMENT_STEPRATEPROFILER_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_DRIVERS
+
+class CompactDiagnostics;
+
+namespace StepRateProfiler
+{
+	// Record a completed move of one driver. Called from the step ISR, so it must be quick.
+	void RecordMove(size_t driver, uint32_t steps, uint32_t minStepInterval, uint32_t moveClocks) noexcept;
+
+	// Start a new interval when the current one has lasted a minute
+	void Spin() noexcept;
+
+	// Get the total time in step clocks that a driver has spent in moves, up to the end of the last complete interval
+	uint64_t GetTotalMovingClocks(size_t driver) noexcept;
+
+	void Diagnostics(const StringRef& reply) noexcept;
+	void AppendCompactDiagnostics(CompactDiagnostics& diags) noexcept;
+}
+
+#endif
+
+#endif /* SRC_MOVEMENT_STEPRATEPROFILER_H_ */
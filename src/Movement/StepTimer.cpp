@@ -10,6 +10,7 @@
 #include <RTOSIface/RTOSIface.h>
 #include <CanMessageFormats.h>
 #include <CAN/CanInterface.h>
+#include <Hardware/IsrTrace.h>
 
 #if SAME5x
 # include <hri_tc_e54.h>
@@ -18,6 +19,7 @@
 #endif
 
 StepTimer * volatile StepTimer::pendingList = nullptr;
+StepTimer *StepTimer::registeredTimers = nullptr;
 volatile uint32_t StepTimer::localTimeOffset = 0;
 volatile uint32_t StepTimer::whenLastSynced;
 uint32_t StepTimer::prevMasterTime;												// the previous master time received
@@ -29,6 +31,13 @@ uint32_t StepTimer::peakReceiveDelay = 0;
 volatile unsigned int StepTimer::syncCount = 0;
 unsigned int StepTimer::numJitterResyncs = 0;
 unsigned int StepTimer::numTimeoutResyncs = 0;
+uint32_t StepTimer::lastOffsetLocalTime;
+uint32_t StepTimer::lastMeasurementLocalTime;
+float StepTimer::driftUncertainty = 0.0;
+unsigned int StepTimer::numLockedSyncs = 0;
+volatile uint32_t StepTimer::holdoverInterval = StepTimer::MinSyncInterval;
+float StepTimer::offsetFraction = 0.0;
+float StepTimer::driftPerClock = 0.0;
 
 void StepTimer::Init()
 {
@@ -65,10 +74,12 @@ void StepTimer::Init()
 	{
 		// Check that we received a sync message recently
 		const uint32_t wls = whenLastSynced;						// capture whenLastSynced before we call millis in case we get interrupted
-		if (millis() - wls > MinSyncInterval)
+		if (millis() - wls > holdoverInterval)
 		{
 			syncCount = 0;
 			++numTimeoutResyncs;
+			numLockedSyncs = 0;
+			holdoverInterval = MinSyncInterval;
 		}
 	}
 	return syncCount == MaxSyncCount;
@@ -84,6 +95,9 @@ void StepTimer::Init()
 		timeStampNow = CanInterface::GetTimeStampCounter();
 	}
 
+	// Both ends of the sync exchange are already hardware-timestamped: the main board measures its transmit delay from its Tx event FIFO and sends it to us
+	// in the next message as lastTimeAcknowledgeDelay, and we measure our receive delay from the Rx time stamp. We don't transmit anything in the exchange,
+	// so there is no Tx event time stamp we could use. The only remaining software timing is the pairing of the step clock and time stamp counter above.
 	// The time stamp counter runs at the CAN normal bit rate, but the step clock runs at 48MHz/64. Calculate the delay to in step clocks.
 	// Datasheet suggests that on the SAMC21 only 15 bits of timestamp counter are readable, but Microchip confirmed this is a documentation error (case 00625843)
 	const uint32_t timeStampDelay = ((uint32_t)((timeStampNow - timeStamp) & 0xFFFF) * CanInterface::GetTimeStampPeriod()) >> 6;	// timestamp counter is 16 bits
@@ -111,20 +125,59 @@ void StepTimer::Init()
 		const uint32_t correctedMasterTime = oldMasterTime + msg.lastTimeAcknowledgeDelay;
 		const uint32_t newOffset = oldLocalTime - correctedMasterTime;
 
-		//TODO convert this to a PLL, but note that there could be a constant offset if the clocks run at slightly different speeds
+		// Track the master clock using a phase and frequency locked loop, so that measurement noise is filtered out and the offset follows any difference in clock speeds.
+		// ExtrapolateOffset may have brought the offset up to date after the time of this measurement, so the time since then may be negative.
 		const uint32_t oldOffset = localTimeOffset;
-		localTimeOffset = newOffset;
-		const int32_t diff = (int32_t)(newOffset - oldOffset);
+		const int32_t timeSinceOffsetUpdated = (int32_t)(oldLocalTime - lastOffsetLocalTime);
+		const uint32_t interval = oldLocalTime - lastMeasurementLocalTime;
+		lastOffsetLocalTime = lastMeasurementLocalTime = oldLocalTime;
+		int32_t diff;
+		if (locSyncCount == 1 || interval == 0)
+		{
+			// This is our first measurement since we started syncing, so just take it
+			localTimeOffset = newOffset;
+			offsetFraction = 0.0;
+			diff = 0;
+			numLockedSyncs = 0;
+		}
+		else
+		{
+			const float predictedOffsetChange = (driftPerClock * (float)timeSinceOffsetUpdated) + offsetFraction;
+			const float phaseError = (float)(int32_t)(newOffset - oldOffset) - predictedOffsetChange;
+			driftPerClock = constrain<float>(driftPerClock + (PllFrequencyGain * phaseError)/(float)interval, -MaxClockDrift, MaxClockDrift);
+			driftUncertainty += DriftUncertaintyGain * (fabsf(phaseError)/(float)interval - driftUncertainty);
+			const float offsetChange = predictedOffsetChange + ((locSyncCount == MaxSyncCount) ? PllPhaseGain : 1.0) * phaseError;	// while acquiring sync, apply the whole correction
+			const int32_t wholeOffsetChange = lrintf(offsetChange);
+			offsetFraction = offsetChange - (float)wholeOffsetChange;
+			localTimeOffset = oldOffset + wholeOffsetChange;
+			diff = lrintf(phaseError);								// the residual jitter after allowing for the clock drift
+		}
+
 		if ((uint32_t)labs(diff) > MaxSyncJitter && locSyncCount > 1)
 		{
 			syncCount = 0;
 			++numJitterResyncs;
+			numLockedSyncs = 0;
+			holdoverInterval = MinSyncInterval;
 		}
 		else
 		{
 			whenLastSynced = millis();
 			if (locSyncCount == MaxSyncCount)
 			{
+				// Once the jitter has been low for a while, allow gaps between syncs as long as we expect the offset to stay within MaxHoldoverError
+				if ((uint32_t)labs(diff) > MaxLockedJitter)
+				{
+					numLockedSyncs = 0;
+				}
+				else if (numLockedSyncs < MinLockedSyncs)
+				{
+					++numLockedSyncs;
+				}
+				holdoverInterval = (numLockedSyncs < MinLockedSyncs) ? MinSyncInterval
+									: (driftUncertainty * (float)MaxHoldoverInterval * (float)(StepClockRate/1000) <= MaxHoldoverError) ? MaxHoldoverInterval
+										: max<uint32_t>((uint32_t)(MaxHoldoverError/(driftUncertainty * (float)(StepClockRate/1000))), MinSyncInterval);
+
 				if (!gotJitter)
 				{
 					peakPosJitter = peakNegJitter = diff;
@@ -156,6 +209,26 @@ void StepTimer::Init()
 	}
 }
 
+// Apply the clock drift to the local time offset, so that while we are synced the offset follows the master clock between sync messages. Called from the CanClock task when no sync message has arrived recently.
+/*static*/ void StepTimer::ExtrapolateOffset() noexcept
+{
+	if (syncCount == MaxSyncCount)
+	{
+		const uint32_t now = GetTimerTicks();
+		const float offsetChange = driftPerClock * (float)(int32_t)(now - lastOffsetLocalTime) + offsetFraction;
+		const int32_t wholeOffsetChange = lrintf(offsetChange);
+		offsetFraction = offsetChange - (float)wholeOffsetChange;
+		localTimeOffset = localTimeOffset + wholeOffsetChange;
+		lastOffsetLocalTime = now;
+	}
+}
+
+// Return how long we can go without a sync message and remain synced, or zero if we are not synced. This tells the main board how good our clock is.
+/*static*/ uint32_t StepTimer::GetHoldoverMillis() noexcept
+{
+	return (IsSynced()) ? holdoverInterval : 0;
+}
+
 // Schedule an interrupt at the specified clock count, or return true if that time is imminent or has passed already.
 // On entry, interrupts must be disabled or the base priority must be <= step interrupt priority.
 inline bool StepTimer::ScheduleTimerInterrupt(uint32_t tim)
@@ -188,11 +261,24 @@ void StepTimer::DisableTimerInterrupt()
 	StepTimer * tmr = pendingList;
 	if (tmr != nullptr)
 	{
+		const Ticks now = GetTimerTicks();							// we read the clock once only, so callbacks we run after the first one are a little later than we record
 		for (;;)
 		{
 			StepTimer * const nextTimer = tmr->next;
 			pendingList = nextTimer;								// remove it from the pending list
 
+			// Record how late the callback is. We may be called slightly early, in which case we count it as on time.
+			const int32_t lateness = (int32_t)(now - tmr->whenDue);
+			if (lateness > 0)
+			{
+				tmr->totalLateness += (uint32_t)lateness;
+				if ((uint32_t)lateness > tmr->maxLateness)
+				{
+					tmr->maxLateness = (uint32_t)lateness;
+				}
+			}
+			++tmr->numCallbacks;
+
 			tmr->active = false;
 			tmr->callback(tmr->cbParam);							// execute its callback. This may schedule another callback and hence change the pending list.
 
@@ -211,10 +297,11 @@ void StepTimer::DisableTimerInterrupt()
 }
 
 // Step pulse timer interrupt
-extern "C" void STEP_TC_HANDLER() SPEED_CRITICAL;
+extern "C" void STEP_TC_HANDLER() ISR_CRITICAL;
 
 void STEP_TC_HANDLER()
 {
+	const StepTimer::Ticks startTime = StepTimer::GetTimerTicks();
 	uint8_t tcsr = StepTc->INTFLAG.reg;								// read the status register, which clears the status bits
 	tcsr &= StepTc->INTENSET.reg;									// select only enabled interrupts
 
@@ -227,17 +314,22 @@ void STEP_TC_HANDLER()
 #endif
 		StepTimer::Interrupt();										// this will re-enable the interrupt if necessary
 	}
+	IsrTrace::RecordInterrupt(startTime);
 }
 
-StepTimer::StepTimer() : next(nullptr), callback(nullptr), active(false)
+StepTimer::StepTimer() : next(nullptr), callback(nullptr), active(false), name(nullptr), numCallbacks(0), totalLateness(0), maxLateness(0)
 {
+	AtomicCriticalSectionLocker lock;
+	nextRegistered = registeredTimers;
+	registeredTimers = this;
 }
 
 // Set up the callback function and parameter
-void StepTimer::SetCallback(TimerCallbackFunction cb, CallbackParameter param)
+void StepTimer::SetCallback(TimerCallbackFunction cb, CallbackParameter param, const char *p_name)
 {
 	callback = cb;
 	cbParam = param;
+	name = p_name;
 }
 
 // Schedule a callback at a particular tick count, returning true if it was not scheduled because it is already due or imminent.
@@ -327,7 +419,9 @@ void StepTimer::CancelCallback()
 
 /*static*/ void StepTimer::Diagnostics(const StringRef& reply)
 {
-	reply.lcatf("Peak sync jitter %" PRIi32 "/%" PRIi32 ", peak Rx sync delay %" PRIu32 ", resyncs %u/%u, ", peakNegJitter, peakPosJitter, peakReceiveDelay, numTimeoutResyncs, numJitterResyncs);
+	reply.lcatf("Peak sync jitter %" PRIi32 "/%" PRIi32 ", clock drift %.2fppm +/-%.3fppm, %s, holdover %" PRIu32 "ms, peak Rx sync delay %" PRIu32 ", resyncs %u/%u, ",
+					peakNegJitter, peakPosJitter, (double)(driftPerClock * 1.0e6), (double)(driftUncertainty * 1.0e6), (numLockedSyncs == MinLockedSyncs) ? "locked" : "not locked",
+					GetHoldoverMillis(), peakReceiveDelay, numTimeoutResyncs, numJitterResyncs);
 	gotJitter = false;
 	numTimeoutResyncs = numJitterResyncs = 0;
 	peakReceiveDelay = 0;
@@ -347,6 +441,24 @@ void StepTimer::CancelCallback()
 			reply.cat(", CC0 mismatch!!");
 		}
 	}
+
+	// Report the lateness of the callbacks of each timer that has been used
+	for (StepTimer *st = registeredTimers; st != nullptr; st = st->nextRegistered)
+	{
+		if (st->name != nullptr)
+		{
+			uint32_t num, total, max;
+			{
+				AtomicCriticalSectionLocker lock;
+				num = st->numCallbacks;
+				total = st->totalLateness;
+				max = st->maxLateness;
+				st->numCallbacks = st->totalLateness = st->maxLateness = 0;
+			}
+			reply.lcatf("Timer %s: callbacks %" PRIu32 ", lateness mean %.1f max %" PRIu32 " ticks",
+						st->name, num, (num == 0) ? 0.0 : (double)total/num, max);
+		}
+	}
 }
 
 // Function called by FreeRTOS to read the timer
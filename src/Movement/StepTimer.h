@@ -22,14 +22,14 @@ public:
 
 	StepTimer();
 
-	// Set up the callback function and parameter
-	void SetCallback(TimerCallbackFunction cb, CallbackParameter param);
+	// Set up the callback function and parameter, and the name we report the lateness statistics under
+	void SetCallback(TimerCallbackFunction cb, CallbackParameter param, const char *p_name);
 
 	// Schedule a callback at a particular tick count, returning true if it was not scheduled because it is already due or imminent
 	bool ScheduleCallback(Ticks when);
 
 	// As ScheduleCallback but base priority >= NvicPriorityStep when called
-	bool ScheduleCallbackFromIsr(Ticks when);
+	bool ScheduleCallbackFromIsr(Ticks when) ISR_CRITICAL;
 
 	// Cancel any scheduled callbacks
 	void CancelCallback();
@@ -55,7 +55,7 @@ public:
 	static float TicksToFloatMicroseconds(uint32_t n) { return (float)n * (1000000.0f/StepClockRate); }
 
 	// ISR called from StepTimer. May sometimes get called prematurely.
-	static void Interrupt() SPEED_CRITICAL;
+	static void Interrupt() ISR_CRITICAL;
 
 	static uint32_t GetLocalTimeOffset() { return localTimeOffset; }
 	static void ProcessTimeSyncMessage(const CanMessageTimeSync& msg, size_t msgLen, uint16_t timeStamp) noexcept;
@@ -64,6 +64,8 @@ public:
 	static uint32_t GetMasterTime() { return ConvertToMasterTime(GetTimerTicks()); }
 
 	static bool IsSynced();
+	static void ExtrapolateOffset() noexcept;
+	static uint32_t GetHoldoverMillis() noexcept;
 
 	static void Diagnostics(const StringRef& reply);
 
@@ -71,10 +73,12 @@ public:
 	static constexpr uint64_t StepClockRateSquared = (uint64_t)StepClockRate * StepClockRate;
 	static constexpr float StepClocksToMillis = 1000.0/(float)StepClockRate;
 	static constexpr uint32_t MinInterruptInterval = 6;							// about 8us. Needs to be long enough for StepTimer::ScheduleTimerInterrupt to work during DMA.
-	static constexpr uint32_t MinSyncInterval = 2000;							// maximum interval in milliseconds between sync messages for us to remain synced
+	static constexpr uint32_t MinSyncInterval = 2000;							// maximum interval in milliseconds between sync messages for us to remain synced when the clock is not locked
 																				// increased from 1000 because of workaround we added for bad Tx time stamps on SAME70
+	static constexpr uint32_t MaxHoldoverInterval = 20000;						// maximum interval in milliseconds between sync messages for us to remain synced when the clock is locked
+	static constexpr uint32_t HoldoverUpdateInterval = 50;						// how often in milliseconds we apply the clock drift to the offset when no sync message arrives
 private:
-	static bool ScheduleTimerInterrupt(uint32_t tim) SPEED_CRITICAL;			// schedule an interrupt at the specified clock count, or return true if it has passed already
+	static bool ScheduleTimerInterrupt(uint32_t tim) ISR_CRITICAL;			// schedule an interrupt at the specified clock count, or return true if it has passed already
 
 	StepTimer *next;
 	Ticks whenDue;
@@ -82,18 +86,41 @@ private:
 	CallbackParameter cbParam;
 	volatile bool active;
 
+	// Lateness statistics, reset when they are reported
+	StepTimer *nextRegistered;													// link in the list of all timers, used to report the statistics
+	const char *name;
+	uint32_t numCallbacks;
+	uint32_t totalLateness;														// the sum of the callback latenesses in ticks
+	uint32_t maxLateness;														// the worst callback lateness in ticks
+
 	static StepTimer * volatile pendingList;									// list of pending callbacks, soonest first
+	static StepTimer *registeredTimers;											// list of all timers
 	static volatile uint32_t localTimeOffset;									// local time minus master time
 	static volatile uint32_t whenLastSynced;									// the millis tick count when we last synced
 	static uint32_t prevMasterTime;												// the previous master time received
 	static uint32_t prevLocalTime;												// the previous local time when the master time was received, corrected for receive processing delay
-	static int32_t peakPosJitter, peakNegJitter;								// the max and min corrections we made to local time offset while synced
+	static int32_t peakPosJitter, peakNegJitter;								// the max and min residual phase errors of the sync loop while synced
 	static bool gotJitter;														// true if we have recorded the jitter
 	static uint32_t peakReceiveDelay;											// the maximum receive delay we measured by using the receive time stamp
 	static volatile unsigned int syncCount;										// the number of messages we have received since starting sync
 	static unsigned int numJitterResyncs, numTimeoutResyncs;
+	static uint32_t lastOffsetLocalTime;										// the local time at which localTimeOffset plus offsetFraction was last brought up to date
+	static uint32_t lastMeasurementLocalTime;									// the local time of the sync measurement we last used to update the offset
+	static float driftUncertainty;												// smoothed magnitude of the drift corrections, i.e. how well we know the drift
+	static unsigned int numLockedSyncs;											// how many consecutive syncs have had low jitter, saturating at MinLockedSyncs
+	static volatile uint32_t holdoverInterval;									// how long in milliseconds we may go without a sync message and remain synced
+	static float offsetFraction;												// the fractional part of the local time offset
+	static float driftPerClock;													// how much the local time offset changes per local step clock, i.e. the clock drift
+
+	static constexpr float PllPhaseGain = 0.25;									// proportion of the phase error we correct at each sync when synced
+	static constexpr float PllFrequencyGain = 0.0625;							// proportion of the phase error we use to correct the drift at each sync
+	static constexpr float MaxClockDrift = 0.001;								// 1000ppm, more than any crystal or ceramic resonator should be out
 
 	static constexpr uint32_t MaxSyncJitter = StepClockRate/100;				// 10ms
+	static constexpr uint32_t MaxLockedJitter = StepClockRate/10000;			// 100us, the clock is locked when the jitter has been below this for MinLockedSyncs syncs
+	static constexpr unsigned int MinLockedSyncs = 16;
+	static constexpr float MaxHoldoverError = (float)(StepClockRate/10000);		// the most we let the offset drift from the truth, at our estimate of the drift uncertainty, before we need a sync
+	static constexpr float DriftUncertaintyGain = 0.125;						// smoothing factor for driftUncertainty
 	static constexpr unsigned int MaxSyncCount = 10;
 };
 
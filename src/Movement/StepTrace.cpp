@@ -0,0 +1,119 @@
+/*
+ * StepTrace.cpp
+ */
+
+#include "StepTrace.h"
+
+#if SUPPORT_DRIVERS
+
+#include <Tasks.h>
+
+constexpr uint32_t DefaultNumRecords = 256;
+constexpr size_t MaxRecordTextLength = 40;							// enough for one record printed by Report
+
+namespace StepTrace
+{
+	unsigned int decimation = 0;
+	unsigned int interruptsTillSample = 0;
+}
+
+static StepTraceRecord *traceBuffer = nullptr;
+static uint32_t traceBufferSize = 0;
+static uint32_t writeIndex = 0;										// where the next record goes in traceBuffer
+static volatile uint32_t numRecorded = 0;							// how many records we have written since we started tracing
+
+static inline void AddRecord(uint32_t now, size_t driver, int32_t position, uint8_t flags) noexcept
+{
+	StepTraceRecord& r = traceBuffer[writeIndex];
+	r.time = now;
+	r.position = position;
+	r.driver = driver;
+	r.flags = flags;
+	if (++writeIndex == traceBufferSize)
+	{
+		writeIndex = 0;
+	}
+	numRecorded = numRecorded + 1;
+}
+
+// Stop tracing if decimation is zero, else start tracing into a buffer of numRecords records, or the existing buffer if numRecords is zero
+GCodeResult StepTrace::Configure(unsigned int newDecimation, uint32_t numRecords, const StringRef& reply) noexcept
+{
+	decimation = 0;													// stop the ISR adding records
+	if (newDecimation == 0)
+	{
+		reply.printf("Step tracing is off, %" PRIu32 " records taken, buffer size %" PRIu32, numRecorded, traceBufferSize);
+		return GCodeResult::ok;
+	}
+
+	if (numRecords == 0)
+	{
+		numRecords = (traceBufferSize != 0) ? traceBufferSize : DefaultNumRecords;
+	}
+
+	if (numRecords != traceBufferSize)
+	{
+		delete[] traceBuffer;
+		traceBuffer = nullptr;
+		traceBufferSize = 0;
+		if (!Tasks::CanAllocate(numRecords * sizeof(StepTraceRecord)))
+		{
+			reply.printf("Insufficient RAM for %" PRIu32 " trace records of %u bytes each", numRecords, sizeof(StepTraceRecord));
+			return GCodeResult::error;
+		}
+		traceBuffer = new StepTraceRecord[numRecords];
+		traceBufferSize = numRecords;
+	}
+
+	writeIndex = 0;
+	numRecorded = 0;
+	interruptsTillSample = newDecimation;
+	decimation = newDecimation;										// do this last because it enables the ISR to add records
+	reply.printf("Step tracing every %u step interrupts into %" PRIu32 " records", newDecimation, traceBufferSize);
+	return GCodeResult::ok;
+}
+
+// Append as many records as will fit to the reply, starting at firstRecord or the oldest one we still have if that is later.
+// Stop tracing before calling this, otherwise the records may be overwritten while they are being reported.
+GCodeResult StepTrace::Report(uint32_t firstRecord, const StringRef& reply) noexcept
+{
+	const uint32_t total = numRecorded;								// capture volatile variable
+	const uint32_t oldest = (total > traceBufferSize) ? total - traceBufferSize : 0;
+	uint32_t n = max<uint32_t>(firstRecord, oldest);
+	reply.printf("Step trace records %" PRIu32 " to %" PRIu32 " available, time/driver/position:", oldest, total);
+	while (n < total && reply.strlen() + MaxRecordTextLength < reply.Capacity())
+	{
+		StepTraceRecord r;
+		{
+			AtomicCriticalSectionLocker lock;
+			r = traceBuffer[n % traceBufferSize];
+		}
+		reply.lcatf("%" PRIu32 " %" PRIu32 " %u %" PRIi32 "%s", n, r.time, r.driver, r.position, (r.flags & StepTraceRecord::StepErrorFlag) ? " step error" : "");
+		++n;
+	}
+	return GCodeResult::ok;
+}
+
+// Record the position of each driver. Called from the step ISR.
+void StepTrace::AddSamples(uint32_t now, const DDA& dda) noexcept
+{
+	const DDA * const prev = dda.GetPrevious();
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		AddRecord(now, driver, prev->GetPosition(driver) + dda.GetStepsTaken(driver), 0);
+	}
+}
+
+// Record that a completed move had a step error on the specified driver. Called from the move task.
+void StepTrace::RecordStepError(const DDA& dda, size_t driver) noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	if (decimation != 0)
+	{
+		AddRecord(StepTimer::GetTimerTicks(), driver, dda.GetPosition(driver), StepTraceRecord::StepErrorFlag);
+	}
+}
+
+#endif	// SUPPORT_DRIVERS
+
+// End
@@ -0,0 +1,50 @@
+/*
+ * StepTrace.h
+ */
+
+#ifndef SRC_MOVEMENT_STEPTRACE_H_
+#define SRC_MOVEMENT_STEPTRACE_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_DRIVERS
+
+#include "DDA.h"
+
+// One sample of the position of a driver, or a record of a move that had a step error
+struct StepTraceRecord
+{
+	static constexpr uint8_t StepErrorFlag = 0x01;	// flag bit to say that this record marks a move that had a step error on this driver
+
+	uint32_t time;									// the step clock when the sample was taken
+	int32_t position;								// the net step position of the driver
+	uint8_t driver;
+	uint8_t flags;
+};
+
+// Ring buffer of driver positions sampled by the step ISR, so that step errors can be diagnosed after the event under normal load
+namespace StepTrace
+{
+	GCodeResult Configure(unsigned int decimation, uint32_t numRecords, const StringRef& reply) noexcept;	// start or stop tracing, or report the status
+	GCodeResult Report(uint32_t firstRecord, const StringRef& reply) noexcept;		// append as many records as will fit to the reply, starting at the one specified
+	void RecordStepError(const DDA& dda, size_t driver) noexcept;					// record that a completed move had a step error
+
+	void AddSamples(uint32_t now, const DDA& dda) noexcept SPEED_CRITICAL;		// called from Record when a sample is due
+
+	extern unsigned int decimation;					// how many step interrupts we take one sample in, or 0 if not tracing
+	extern unsigned int interruptsTillSample;
+
+	// Called from the step ISR after each call to StepDrivers
+	inline void Record(uint32_t now, const DDA& dda) noexcept
+	{
+		if (decimation != 0 && --interruptsTillSample == 0)
+		{
+			interruptsTillSample = decimation;
+			AddSamples(now, dda);
+		}
+	}
+}
+
+#endif	// SUPPORT_DRIVERS
+
+#endif /* SRC_MOVEMENT_STEPTRACE_H_ */
@@ -40,6 +40,7 @@
 
 #include <RTOSIface/RTOSIface.h>
 #include <TaskPriorities.h>
+#include <TaskStackSizes.h>
 #include <Movement/Move.h>
 #include <Movement/StepTimer.h>
 #include <Cache.h>
@@ -63,7 +64,6 @@ constexpr float MinimumOpenLoadMotorCurrent = 500;			// minimum current in mA fo
 constexpr uint32_t DefaultMicrosteppingShift = 4;			// x16 microstepping
 constexpr bool DefaultInterpolation = true;					// interpolation enabled
 constexpr uint32_t DefaultTpwmthrsReg = 2000;				// low values (high changeover speed) give horrible jerk at the changeover from stealthChop to spreadCycle
-constexpr size_t TmcTaskStackWords = 100;					// 100 is sufficient unless we use debugPrintf in the code executed by the TMC task
 
 constexpr uint16_t DriverNotPresentTimeouts = 20;
 
@@ -290,6 +290,8 @@ constexpr uint32_t TMC_RR_OPW_143 = 1u << 9;	// temperature threshold exceeded
 constexpr uint32_t TMC_RR_OPW_150 = 1u << 10;	// temperature threshold exceeded
 constexpr uint32_t TMC_RR_OPW_157 = 1u << 11;	// temperature threshold exceeded
 constexpr uint32_t TMC_RR_TEMPBITS = 15u << 8;	// all temperature threshold bits
+constexpr unsigned int TMC_RR_CSACTUAL_SHIFT = 16;	// actual motor current scaling
+constexpr uint32_t TMC_RR_CSACTUAL_MASK = 31u << TMC_RR_CSACTUAL_SHIFT;
 
 constexpr uint32_t TMC_RR_RESERVED = (15u << 12) | (0x01FF << 21);	// reserved bits
 constexpr uint32_t TMC_RR_SG = 1u << 12;		// this is a reserved bit, which we use to signal a stall
@@ -423,6 +425,9 @@ public:
 	void WriteAll() noexcept;
 	bool SetMicrostepping(uint32_t shift, bool interpolate) noexcept;
 	unsigned int GetMicrostepping(bool& interpolation) const noexcept;
+#if SUPPORT_MICROSTEP_REDUCTION
+	void SetMicrostepReduction(uint32_t reduction) noexcept;
+#endif
 	bool SetDriverMode(unsigned int mode) noexcept;
 	DriverMode GetDriverMode() const noexcept;
 	void SetCurrent(float current) noexcept;
@@ -448,6 +453,7 @@ public:
 
 	float GetStandstillCurrentPercent() const noexcept;
 	void SetStandstillCurrentPercent(float percent) noexcept;
+	float GetActualCurrent() const noexcept;
 
 	bool DriverAssumedPresent() const noexcept { return numWrites != 0 || numTimeouts < DriverNotPresentTimeouts; }
 
@@ -562,6 +568,9 @@ private:
 
 	uint32_t axisNumber;									// the axis number of this driver as used to index the DriveMovements in the DDA
 	uint32_t microstepShiftFactor;							// how much we need to shift 1 left by to get the current microstepping
+#if SUPPORT_MICROSTEP_REDUCTION
+	uint32_t microstepReduction;							// how much the microstepping is reduced below the configured value at high step rates
+#endif
 	float motorCurrent;										// the configured motor current in mA
 	uint32_t maxOpenLoadStepInterval;						// the maximum step pulse interval for which we consider open load detection to be reliable
 
@@ -644,6 +653,32 @@ static DmaCallbackReason dmaFinishedReason;
 static bool dmaFinished;
 #endif
 
+#if TMC22xx_SINGLE_DRIVER
+
+// The TMC22xx can't handle back-to-back transactions, and its UART resets itself after the bus has been idle for 63 bit times.
+// Waiting for one tick to pass makes the turnaround time much longer than that, so we use a step timer to wake up the TMC task after the minimum idle time.
+constexpr uint32_t TurnaroundBitTimes = 64;
+constexpr StepTimer::Ticks TurnaroundTicks = (TurnaroundBitTimes * StepTimer::StepClockRate + DriversBaudRate - 1)/DriversBaudRate;
+
+static StepTimer turnaroundTimer;
+
+static void TurnaroundTimerCallback(CallbackParameter) noexcept
+{
+	tmcTask->GiveFromISR();
+}
+
+// Wait until the driver is ready for the next transaction
+static void WaitForTurnaround() noexcept
+{
+	TaskBase::ClearCurrentTaskNotifyCount();
+	if (!turnaroundTimer.ScheduleCallback(StepTimer::GetTimerTicks() + TurnaroundTicks))
+	{
+		(void)TaskBase::Take(2);					// the timeout is just in case the callback gets lost
+	}
+}
+
+#endif
+
 // To write a register, we send one 8-byte packet to write it, then a 4-byte packet to ask for the IFCOUNT register, then we receive an 8-byte packet containing IFCOUNT.
 // This is the message we send - volatile because we care about when it is written, and dword-aligned so that we can use 32-bit mode on the SAME5x
 alignas(4) volatile uint8_t TmcDriverState::sendData[12] =
@@ -1056,10 +1091,26 @@ void TmcDriverState::SetStandstillCurrentPercent(float percent) noexcept
 	UpdateCurrent();
 }
 
+// Get the motor current that the driver is actually using in mA, from the CS_ACTUAL field of the most recent DRV_STATUS reading.
+// This includes the effect of standstill current reduction.
+float TmcDriverState::GetActualCurrent() const noexcept
+{
+	if (!enabled)
+	{
+		return 0.0;
+	}
+	const uint32_t iRun = (writeRegisters[WriteIholdIrun] & IHOLDIRUN_IRUN_MASK) >> IHOLDIRUN_IRUN_SHIFT;
+	const uint32_t csActual = (readRegisters[ReadDrvStat] & TMC_RR_CSACTUAL_MASK) >> TMC_RR_CSACTUAL_SHIFT;
+	return (motorCurrent * (csActual + 1))/(iRun + 1);
+}
+
 // Set the microstepping and microstep interpolation. The desired microstepping is (1 << shift).
 bool TmcDriverState::SetMicrostepping(uint32_t shift, bool interpolate) noexcept
 {
 	microstepShiftFactor = shift;
+#if SUPPORT_MICROSTEP_REDUCTION
+	microstepReduction = 0;
+#endif
 	configuredChopConfReg = (configuredChopConfReg & ~(CHOPCONF_MRES_MASK | CHOPCONF_INTPOL)) | ((8 - shift) << CHOPCONF_MRES_SHIFT);
 	if (interpolate)
 	{
@@ -1069,6 +1120,18 @@ bool TmcDriverState::SetMicrostepping(uint32_t shift, bool interpolate) noexcept
 	return true;
 }
 
+#if SUPPORT_MICROSTEP_REDUCTION
+
+// Reduce the microstepping to (1 << (microstepShiftFactor - reduction)) without changing the configured microstepping
+void TmcDriverState::SetMicrostepReduction(uint32_t reduction) noexcept
+{
+	microstepReduction = min<uint32_t>(reduction, microstepShiftFactor);
+	configuredChopConfReg = (configuredChopConfReg & ~CHOPCONF_MRES_MASK) | ((8 - microstepShiftFactor + microstepReduction) << CHOPCONF_MRES_SHIFT);
+	UpdateChopConfRegister();
+}
+
+#endif
+
 // Get microstepping or chopper control register
 unsigned int TmcDriverState::GetMicrostepping(bool& interpolation) const noexcept
 {
@@ -1644,7 +1707,7 @@ bool DoTransaction(size_t driverNumber)
 	{
 		currentDriver->UartTmcHandler();
 #if TMC22xx_SINGLE_DRIVER
-		delay(2);						// TMC22xx can't handle back-to-back reads, so we need a short delay
+		WaitForTurnaround();			// TMC22xx can't handle back-to-back reads, so we need a short delay
 #endif
 		return true;
 	}
@@ -1654,7 +1717,7 @@ bool DoTransaction(size_t driverNumber)
 		// DMA error, or DMA complete and DMA error
 		currentDriver->DmaError();
 #if TMC22xx_SINGLE_DRIVER
-		delay(2);						// TMC22xx can't handle back-to-back reads, so we need a short delay
+		WaitForTurnaround();			// TMC22xx can't handle back-to-back reads, so we need a short delay
 #endif
 	}
 #endif
@@ -1945,6 +2008,9 @@ void SmartDrivers::Init() noexcept
 	}
 
 	driversState = DriversState::noPower;
+#if TMC22xx_SINGLE_DRIVER
+	turnaroundTimer.SetCallback(TurnaroundTimerCallback, CallbackParameter(nullptr), "turnaround");
+#endif
 	tmcTask = new Task<TmcTaskStackWords>;
 	tmcTask->Create(TmcLoop, "TMC", nullptr, TaskPriority::TmcOpenLoop);
 }
@@ -2026,6 +2092,19 @@ unsigned int SmartDrivers::GetMicrostepping(size_t drive, bool& interpolation) n
 	return (drive < GetNumTmcDrivers()) ? driverStates[drive].GetMicrostepping(interpolation) : 1;
 }
 
+#if SUPPORT_MICROSTEP_REDUCTION
+
+// Reduce the microstepping below the configured value by a power of 2 while the step rate is high
+void SmartDrivers::SetMicrostepReduction(size_t drive, unsigned int reduction) noexcept
+{
+	if (drive < GetNumTmcDrivers())
+	{
+		driverStates[drive].SetMicrostepReduction(reduction);
+	}
+}
+
+#endif
+
 bool SmartDrivers::SetDriverMode(size_t driver, unsigned int mode) noexcept
 {
 	return driver < GetNumTmcDrivers() && driverStates[driver].SetDriverMode(mode);
@@ -2115,6 +2194,11 @@ float SmartDrivers::GetStandstillCurrentPercent(size_t drive) noexcept
 	return (drive < GetNumTmcDrivers()) ? driverStates[drive].GetStandstillCurrentPercent() : 0.0;
 }
 
+float SmartDrivers::GetActualCurrent(size_t drive) noexcept
+{
+	return (drive < GetNumTmcDrivers()) ? driverStates[drive].GetActualCurrent() : 0.0;
+}
+
 void SmartDrivers::SetStandstillCurrentPercent(size_t drive, float percent) noexcept
 {
 	if (drive < GetNumTmcDrivers())
@@ -30,6 +30,9 @@ namespace SmartDrivers
 	void EnableDrive(size_t drive, bool en) noexcept;
 	bool SetMicrostepping(size_t drive, unsigned int microsteps, bool interpolation) noexcept;
 	unsigned int GetMicrostepping(size_t drive, bool& interpolation) noexcept;
+#if SUPPORT_MICROSTEP_REDUCTION
+	void SetMicrostepReduction(size_t driver, unsigned int reduction) noexcept;
+#endif
 	bool SetDriverMode(size_t driver, unsigned int mode) noexcept;
 	DriverMode GetDriverMode(size_t driver) noexcept;
 	void Spin(bool powered) noexcept;
@@ -40,6 +43,7 @@ namespace SmartDrivers
 	void AppendStallConfig(size_t driver, const StringRef& reply) noexcept;
 	void AppendDriverStatus(size_t drive, const StringRef& reply) noexcept;
 	float GetStandstillCurrentPercent(size_t drive) noexcept;
+	float GetActualCurrent(size_t drive) noexcept;
 	void SetStandstillCurrentPercent(size_t drive, float percent) noexcept;
 	bool SetRegister(size_t driver, SmartDriverRegister reg, uint32_t regVal) noexcept;
 	uint32_t GetRegister(size_t driver, SmartDriverRegister reg) noexcept;
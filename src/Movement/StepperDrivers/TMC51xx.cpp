@@ -16,6 +16,8 @@
 #include <Movement/Move.h>
 #include <DmacManager.h>
 #include <TaskPriorities.h>
+#include <TaskStackSizes.h>
+#include <DeadlineMonitor.h>
 #include <General/Portability.h>
 
 #if SUPPORT_CLOSED_LOOP
@@ -65,9 +67,7 @@ constexpr uint32_t DefaultThigh = 200;
 constexpr uint32_t DefaultTmcClockSpeed = 12000000;			// the default rate at which the TMC driver is clocked internally
 
 #if SUPPORT_CLOSED_LOOP
-constexpr size_t TmcTaskStackWords = 430;					// we need extra stack to handle closed loop tuning and writing to NVM
-#else
-constexpr size_t TmcTaskStackWords = 140;					// with 100 stack words, deckingman's M122 on the main board after a major axis shift showed just 10 words left
+constexpr unsigned int XDirectFramesPerNormalFrame = 3;		// when the coil currents are being updated every frame, how many XDIRECT frames we send between other register writes and status reads
 #endif
 
 #if TMC_TYPE == 5130
@@ -89,7 +89,16 @@ const uint32_t DriversSpiClockFrequency = 1000000;			// 1MHz SPI clock
 #else
 const uint32_t DriversSpiClockFrequency = 500000;			// 500kHz SPI clock
 #endif
-const uint32_t TransferTimeout = 2;							// any transfer should complete within 2 ticks @ 1ms/tick
+
+// On the SERCOM builds we can send several frames to the drivers in one transfer, chaining them in the DMA complete interrupt, so that the TMC task is woken only once per transfer
+#if TMC51xx_USES_SERCOM
+const size_t MaxFramesPerTransfer = 4;
+constexpr uint32_t FrameCsHighClocks = NanoSecondsToClocks(500);	// the drivers need CS to be high for at least one clock cycle of their 12MHz clock between frames
+#else
+const size_t MaxFramesPerTransfer = 1;
+#endif
+const uint32_t TransferTimeout = 3;							// any transfer should complete within 3 ticks @ 1ms/tick
+const uint32_t StandstillPollInterval = 2;					// when no motor is moving and there is nothing to write, wait this many ticks between transfers
 
 // GCONF register (0x00, RW)
 constexpr uint8_t REGNUM_GCONF = 0x00;
@@ -259,11 +268,22 @@ constexpr uint32_t DefaultChopConfReg = (1 << CHOPCONF_TBL_SHIFT) | (3 << CHOPCO
 #endif
 
 constexpr uint8_t REGNUM_COOLCONF = 0x6D;
+constexpr uint32_t COOLCONF_SEMIN_SHIFT = 0;
+constexpr uint32_t COOLCONF_SEMIN_MASK = 15 << COOLCONF_SEMIN_SHIFT;	// current is increased if SG_RESULT < SEMIN * 32, coolStep is off if zero
+constexpr uint32_t COOLCONF_SEUP_SHIFT = 5;
+constexpr uint32_t COOLCONF_SEUP_MASK = 3 << COOLCONF_SEUP_SHIFT;	// current increment per SG_RESULT reading below the threshold: 1, 2, 4 or 8
+constexpr uint32_t COOLCONF_SEMAX_SHIFT = 8;
+constexpr uint32_t COOLCONF_SEMAX_MASK = 15 << COOLCONF_SEMAX_SHIFT;	// current is reduced if SG_RESULT >= (SEMIN + SEMAX + 1) * 32
+constexpr uint32_t COOLCONF_SEDN_SHIFT = 13;
+constexpr uint32_t COOLCONF_SEDN_MASK = 3 << COOLCONF_SEDN_SHIFT;	// current is reduced by one for every 32, 8, 2 or 1 SG_RESULT readings above the threshold
+constexpr uint32_t COOLCONF_SEIMIN = 1 << 15;				// set to allow the current to fall to 1/4 of IRUN instead of 1/2
+constexpr uint32_t COOLCONF_ADAPTIVE_MASK = COOLCONF_SEMIN_MASK | COOLCONF_SEUP_MASK | COOLCONF_SEMAX_MASK | COOLCONF_SEDN_MASK | COOLCONF_SEIMIN;
 constexpr uint32_t COOLCONF_SGFILT = 1 << 24;				// set to update stallGuard status every 4 full steps instead of every full step
 constexpr uint32_t COOLCONF_SGT_SHIFT = 16;
 constexpr uint32_t COOLCONF_SGT_MASK = 127 << COOLCONF_SGT_SHIFT;	// stallguard threshold (signed)
 
 constexpr uint32_t DefaultCoolConfReg = 0;
+constexpr unsigned int DefaultAdaptiveCurrentLowLoad = 128;	// the default SG_RESULT below which adaptive current raises the current
 
 // DRV_STATUS register
 constexpr uint8_t REGNUM_DRV_STATUS = 0x6F;
@@ -275,6 +295,8 @@ constexpr uint32_t TMC_RR_OLA = 1 << 29;				// open load A
 constexpr uint32_t TMC_RR_OLB = 1 << 30;				// open load B
 constexpr uint32_t TMC_RR_STST = 1 << 31;				// standstill detected
 constexpr uint32_t TMC_RR_SGRESULT = 0x3FF;				// 10-bit stallGuard2 result
+constexpr unsigned int TMC_RR_CSACTUAL_SHIFT = 16;			// actual motor current scaling
+constexpr uint32_t TMC_RR_CSACTUAL_MASK = 0x1F << TMC_RR_CSACTUAL_SHIFT;
 
 constexpr unsigned int TMC_RR_STST_BIT_POS = 31;
 constexpr unsigned int TMC_RR_SG_BIT_POS = 24;
@@ -328,6 +350,33 @@ static DriversState driversState = DriversState::shutDown;
 //----------------------------------------------------------------------------------------------------------------------------------
 // Private types and methods
 
+// Load statistics for one move, collected from DRV_STATUS while the motor is moving
+struct MoveLoadRecord
+{
+	uint32_t moveNumber;									// the number of the move, counting from when the move counters were last reset
+	uint32_t sgTotal;
+	uint32_t csTotal;
+	uint32_t intervalTotal;									// the total of the full step intervals when we took the samples
+	uint16_t numSamples;
+	uint16_t sgMin, sgMax;
+	uint8_t csMin, csMax;
+
+	void Reset(uint32_t p_moveNumber) noexcept
+	{
+		moveNumber = p_moveNumber;
+		sgTotal = csTotal = intervalTotal = 0;
+		numSamples = 0;
+		sgMin = 0xFFFF;
+		sgMax = 0;
+		csMin = 0xFF;
+		csMax = 0;
+	}
+};
+
+constexpr size_t NumMoveLoadRecords = 8;					// how many move load records we keep for each driver
+constexpr size_t MaxLoadRecordTextLength = 50;				// enough for one record printed by ReportLoad
+static volatile unsigned int loadRecordDecimation = 0;				// we record the load of one move in this many, or 0 if not recording
+
 class TmcDriverState
 {
 public:
@@ -335,21 +384,31 @@ public:
 	void WriteAll() noexcept;
 	bool SetMicrostepping(uint32_t shift, bool interpolate) noexcept;
 	unsigned int GetMicrostepping(bool& interpolation) const noexcept;
+#if SUPPORT_MICROSTEP_REDUCTION
+	void SetMicrostepReduction(uint32_t reduction) noexcept;
+#endif
 #if SUPPORT_CLOSED_LOOP
 	unsigned int GetMicrostepShift() const noexcept { return microstepShiftFactor; }
 	uint16_t GetMicrostepPosition() const noexcept { return readRegisters[ReadMsCnt] & 1023; }
+	void SetXDirect(uint32_t regVal) noexcept;				// set the coil currents, only called from the TMC task
 #endif
 	bool SetDriverMode(unsigned int mode) noexcept;
 	DriverMode GetDriverMode() const noexcept;
 	void SetCurrent(float current) noexcept;
 	void Enable(bool en) noexcept;
 	bool UpdatePending() const noexcept { return (registersToUpdate | newRegistersToUpdate) != 0; }
+	bool IsMoving() const noexcept { return moving; }
+	void DirectionChanged() noexcept { msCntDirection = 0; }		// MSCNT now changes the other way when the commanded position increases, so learn the direction again
 	void SetStallDetectThreshold(int sgThreshold) noexcept;
 	void SetStallDetectFilter(bool sgFilter) noexcept;
 	void SetStallMinimumStepsPerSecond(unsigned int stepsPerSecond) noexcept;
+	void SetAdaptiveCurrent(unsigned int minPercent, unsigned int sgLowLoad) noexcept;
+	void AppendAdaptiveCurrent(const StringRef& reply) const noexcept;
 	StandardDriverStatus GetStatus(bool accumulated, bool clearAccumulated) noexcept;
 	void AppendStallConfig(const StringRef& reply) const noexcept;
 	void AppendDriverStatus(const StringRef& reply, bool clearGlobalStats) noexcept;
+	void ResetLoadRecords() noexcept;
+	void ReportLoad(const StringRef& reply) noexcept;
 
 	bool SetRegister(SmartDriverRegister reg, uint32_t regVal) noexcept;
 	uint32_t GetRegister(SmartDriverRegister reg) const noexcept;
@@ -358,11 +417,12 @@ public:
 
 	float GetStandstillCurrentPercent() const noexcept;
 	void SetStandstillCurrentPercent(float percent) noexcept;
+	float GetActualCurrent() const noexcept;
 
 	static void TransferTimedOut() noexcept { ++numTimeouts; }
 
-	void GetSpiCommand(uint8_t *sendDataBlock) noexcept;
-	void TransferSucceeded(const uint8_t *rcvDataBlock) noexcept;
+	void GetSpiCommand(uint8_t *sendDataBlock, size_t frame) noexcept;
+	void TransferSucceeded(const uint8_t *rcvDataBlock, size_t frame) noexcept;
 	void TransferFailed() noexcept;
 
 private:
@@ -376,6 +436,9 @@ private:
 		minSgLoadRegister = 9999;							// values read from the driver are in the range 0 to 1023, so 9999 indicates that it hasn't been read
 	}
 
+	void RecordLoad(uint32_t drvStatus, uint32_t interval) noexcept;
+	void CheckMicrostepCounter(uint32_t msCnt) noexcept;
+
 	// Write register numbers are in priority order, most urgent first, in same order as WriteRegNumbers
 	static constexpr unsigned int WriteGConf = 0;			// microstepping and direct mode
 	static constexpr unsigned int WriteIholdIrun = 1;		// current setting
@@ -415,6 +478,11 @@ private:
 	static constexpr unsigned int ReadPwmAuto = 4;
 	static constexpr unsigned int ReadSpecial = NumReadRegisters;
 
+	// The orders in which we read the registers. DRV_STATUS has the stall and load data and MSCNT is used to check for lost steps,
+	// so when the motor is moving we read them more often than the others.
+	static constexpr uint8_t MovingReadSequence[] = { ReadDrvStat, ReadMsCnt, ReadDrvStat, ReadGStat, ReadDrvStat, ReadMsCnt, ReadDrvStat, ReadPwmScale, ReadDrvStat, ReadMsCnt, ReadDrvStat, ReadPwmAuto };
+	static constexpr uint8_t StandstillReadSequence[] = { ReadGStat, ReadDrvStat, ReadMsCnt, ReadPwmScale, ReadPwmAuto };
+
 	static constexpr uint8_t NoRegIndex = 0xFF;				// this means no register updated, or no register requested
 
 	volatile uint32_t writeRegisters[NumWriteRegisters + 1];	// the values we want the TMC22xx writable registers to have
@@ -429,19 +497,43 @@ private:
 	DriversBitmap driverBit;								// a bitmap containing just this driver number
 	uint32_t axisNumber;									// the axis number of this driver as used to index the DriveMovements in the DDA
 	uint32_t microstepShiftFactor;							// how much we need to shift 1 left by to get the current microstepping
+#if SUPPORT_MICROSTEP_REDUCTION
+	uint32_t microstepReduction;							// how much the microstepping is reduced below the configured value at high step rates
+#endif
 	uint32_t motorCurrent;									// the configured motor current in mA
 
 	uint16_t minSgLoadRegister;								// the minimum value of the StallGuard bits we read
+	MoveLoadRecord currentMoveLoad;							// the load statistics for the move in progress
+	MoveLoadRecord moveLoadRecords[NumMoveLoadRecords];		// ring buffer of load statistics for completed moves
+	size_t numMoveLoadRecords;								// how many records in moveLoadRecords are waiting to be reported
+	size_t moveLoadRecordIndex;								// where the next record goes in moveLoadRecords
+
+	// Step loss detection. When no moves are executing we compare the change in MSCNT with the change in the commanded position.
+	int32_t microstepCheckPosition;							// the commanded position in microsteps when we last checked MSCNT
+	uint32_t msCntRequestMoveCount;							// the number of completed moves when we last asked to read MSCNT
+	uint32_t numMicrostepErrors;							// how many times MSCNT didn't agree with the commanded position
+	int32_t lastMicrostepError;								// the most recent error in 1/256 microsteps, positive if the driver took more steps than we commanded
+	uint16_t microstepCheckMsCnt;							// MSCNT when we last checked it
+	int8_t msCntDirection;									// +1 or -1 if we know which way MSCNT changes when the commanded position increases, else 0
+	bool microstepCheckValid;								// true if microstepCheckPosition and microstepCheckMsCnt are valid
 	uint16_t numReads, numWrites;							// how many successful reads and writes we had
 	static uint16_t numTimeouts;							// how many times a transfer timed out
 
 	uint16_t standstillCurrentFraction;						// divide this by 256 to get the motor current standstill fraction
-	uint8_t regIndexBeingUpdated;							// which register we are sending
-	uint8_t regIndexRequested;								// the register we asked to read in the previous transaction, or 0xFF
+	uint32_t registersBeingSent;							// bitmap of register indices that we are writing in the current transfer
+	uint8_t regIndexBeingUpdated[MaxFramesPerTransfer];		// which register we are sending in each frame of the current transfer
+	uint8_t regIndexRead[MaxFramesPerTransfer];				// which register we asked to read in each frame of the current transfer, or 0xFF
+	uint8_t regIndexRequested;								// the register we asked to read most recently
+	uint8_t readSequenceIndex;								// where we are in MovingReadSequence or StandstillReadSequence
 	uint8_t previousRegIndexRequested;						// the register we asked to read in the previous transaction, or 0xFF
 	volatile uint8_t specialReadRegisterNumber;
 	volatile uint8_t specialWriteRegisterNumber;
 	bool enabled;											// true if driver is enabled
+	bool moving;											// true if the motor was moving when we last had a response from the driver
+#if SUPPORT_CLOSED_LOOP
+	bool xDirectPending;									// true if SetXDirect has been called since we last sent the coil currents
+	uint8_t xDirectFramesTillNormalFrame;					// how many more XDIRECT frames we can send before we must send a normal one
+#endif
 };
 
 const uint8_t TmcDriverState::WriteRegNumbers[NumWriteRegisters] =
@@ -510,9 +602,27 @@ pre(!driversPowered)
 		readRegisters[i] = 0;
 	}
 	accumulatedDriveStatus = 0;
-
-	regIndexBeingUpdated = regIndexRequested = previousRegIndexRequested = NoRegIndex;
+	numMoveLoadRecords = moveLoadRecordIndex = 0;
+	currentMoveLoad.Reset(0);
+	microstepCheckValid = false;
+	msCntDirection = 0;
+	numMicrostepErrors = 0;
+	lastMicrostepError = 0;
+	msCntRequestMoveCount = 0;
+
+	for (size_t frame = 0; frame < MaxFramesPerTransfer; ++frame)
+	{
+		regIndexBeingUpdated[frame] = regIndexRead[frame] = NoRegIndex;
+	}
+	regIndexRequested = previousRegIndexRequested = NoRegIndex;
+	registersBeingSent = 0;
+	readSequenceIndex = 0;
+	moving = false;
 	numReads = numWrites = 0;
+#if SUPPORT_CLOSED_LOOP
+	xDirectPending = false;
+	xDirectFramesTillNormalFrame = XDirectFramesPerNormalFrame;
+#endif
 }
 
 // Set a register value and flag it for updating
@@ -539,6 +649,7 @@ void TmcDriverState::SetStallDetectThreshold(int sgThreshold) noexcept
 inline void TmcDriverState::WriteAll() noexcept
 {
 	newRegistersToUpdate = (1u << NumWriteRegisters) - 1;
+	microstepCheckValid = false;										// the drivers may have been reset, which clears MSCNT
 }
 
 float TmcDriverState::GetStandstillCurrentPercent() const noexcept
@@ -552,10 +663,27 @@ void TmcDriverState::SetStandstillCurrentPercent(float percent) noexcept
 	UpdateCurrent();
 }
 
+// Get the motor current that the driver is actually using in mA, from the CS_ACTUAL field of the most recent DRV_STATUS reading.
+// This includes the effect of standstill current reduction and coolStep.
+float TmcDriverState::GetActualCurrent() const noexcept
+{
+	if (!enabled)
+	{
+		return 0.0;
+	}
+	const uint32_t iRun = (writeRegisters[WriteIholdIrun] & IHOLDIRUN_IRUN_MASK) >> IHOLDIRUN_IRUN_SHIFT;
+	const uint32_t csActual = (readRegisters[ReadDrvStat] & TMC_RR_CSACTUAL_MASK) >> TMC_RR_CSACTUAL_SHIFT;
+	return (float)(motorCurrent * (csActual + 1))/(float)(iRun + 1);
+}
+
 // Set the microstepping and microstep interpolation. The desired microstepping is (1 << shift).
 bool TmcDriverState::SetMicrostepping(uint32_t shift, bool interpolate) noexcept
 {
 	microstepShiftFactor = shift;
+#if SUPPORT_MICROSTEP_REDUCTION
+	microstepReduction = 0;
+#endif
+	microstepCheckValid = false;										// MSCNT changes by a different amount per step now
 	configuredChopConfReg = (configuredChopConfReg & ~(CHOPCONF_MRES_MASK | CHOPCONF_INTPOL)) | ((8 - shift) << CHOPCONF_MRES_SHIFT);
 	if (interpolate)
 	{
@@ -565,6 +693,19 @@ bool TmcDriverState::SetMicrostepping(uint32_t shift, bool interpolate) noexcept
 	return true;
 }
 
+#if SUPPORT_MICROSTEP_REDUCTION
+
+// Reduce the microstepping to (1 << (microstepShiftFactor - reduction)) without changing the configured microstepping
+void TmcDriverState::SetMicrostepReduction(uint32_t reduction) noexcept
+{
+	microstepReduction = min<uint32_t>(reduction, microstepShiftFactor);
+	microstepCheckValid = false;										// MSCNT changes by a different amount per step now
+	configuredChopConfReg = (configuredChopConfReg & ~CHOPCONF_MRES_MASK) | ((8 - microstepShiftFactor + microstepReduction) << CHOPCONF_MRES_SHIFT);
+	UpdateChopConfRegister();
+}
+
+#endif
+
 // Get microstepping or chopper control register
 unsigned int TmcDriverState::GetMicrostepping(bool& interpolation) const noexcept
 {
@@ -889,6 +1030,11 @@ void TmcDriverState::AppendDriverStatus(const StringRef& reply, bool clearGlobal
 	ResetLoadRegisters();
 
 	reply.catf(", mspos %u, reads %u, writes %u timeouts %u", (unsigned int)(readRegisters[ReadMsCnt] & 1023), numReads, numWrites, numTimeouts);
+	if (numMicrostepErrors != 0)
+	{
+		reply.catf(", mspos errors %" PRIu32 " last %" PRIi32 "/256", numMicrostepErrors, lastMicrostepError);
+		numMicrostepErrors = 0;
+	}
 	numReads = numWrites = 0;
 	if (clearGlobalStats)
 	{
@@ -915,6 +1061,48 @@ void TmcDriverState::SetStallMinimumStepsPerSecond(unsigned int stepsPerSecond)
 	UpdateRegister(WriteTcoolthrs, (GetTmcClockSpeed() + (128 * stepsPerSecond))/(256 * stepsPerSecond));
 }
 
+// Use coolStep to scale the motor current according to the load measured by stallGuard, or turn it off if minPercent is zero.
+// The current rises quickly when SG_RESULT falls below sgLowLoad and falls slowly when it is above twice that, down to 25% or 50% of the configured current.
+void TmcDriverState::SetAdaptiveCurrent(unsigned int minPercent, unsigned int sgLowLoad) noexcept
+{
+	uint32_t coolConf = writeRegisters[WriteCoolConf] & ~COOLCONF_ADAPTIVE_MASK;
+	if (minPercent != 0)
+	{
+		const uint32_t semin = constrain<unsigned int>((sgLowLoad + 16)/32, 1, 15);
+		coolConf |= (semin << COOLCONF_SEMIN_SHIFT) | (semin << COOLCONF_SEMAX_SHIFT)	// use a hysteresis band as wide as the threshold
+				  | (3 << COOLCONF_SEUP_SHIFT)						// raise the current in the largest increments
+				  | (0 << COOLCONF_SEDN_SHIFT)						// lower it by one for every 32 stallGuard readings
+				  | ((minPercent < 50) ? COOLCONF_SEIMIN : 0);
+	}
+	writeRegisters[WriteCoolConf] = coolConf;
+	newRegistersToUpdate |= 1u << WriteCoolConf;
+}
+
+void TmcDriverState::AppendAdaptiveCurrent(const StringRef& reply) const noexcept
+{
+	const uint32_t coolConf = writeRegisters[WriteCoolConf];
+	const uint32_t semin = (coolConf & COOLCONF_SEMIN_MASK) >> COOLCONF_SEMIN_SHIFT;
+	if (semin == 0)
+	{
+		reply.cat("adaptive current off");
+	}
+	else
+	{
+		const uint32_t semax = (coolConf & COOLCONF_SEMAX_MASK) >> COOLCONF_SEMAX_SHIFT;
+		reply.catf("adaptive current down to %u%%, raised below SG %" PRIu32 " and lowered above SG %" PRIu32 ", actual %.0fmA",
+					((coolConf & COOLCONF_SEIMIN) != 0) ? 25 : 50, semin * 32, (semin + semax + 1) * 32, (double)GetActualCurrent());
+		const DriverMode mode = GetDriverMode();
+		if (mode != DriverMode::spreadCycle && mode != DriverMode::constantOffTime
+#if TMC_TYPE == 5130
+			&& mode != DriverMode::randomOffTime
+#endif
+		   )
+		{
+			reply.catf(" (inactive in %s mode)", TranslateDriverMode(mode));
+		}
+	}
+}
+
 void TmcDriverState::AppendStallConfig(const StringRef& reply) const noexcept
 {
 	const bool filtered = ((writeRegisters[WriteCoolConf] & COOLCONF_SGFILT) != 0);
@@ -932,33 +1120,82 @@ void TmcDriverState::AppendStallConfig(const StringRef& reply) const noexcept
 				threshold, ((filtered) ? "on" : "off"), fullstepsPerSecond, (double)speed1, tcoolthrs, (double)speed2);
 }
 
+#if SUPPORT_CLOSED_LOOP
+
+// Set the coil currents. Closed loop control calls this on every control loop iteration, so instead of queuing the XDIRECT register with the others
+// we send it directly from GetSpiCommand, which is called from the same task.
+void TmcDriverState::SetXDirect(uint32_t regVal) noexcept
+{
+	writeRegisters[Write2160XDirect] = regVal;
+	xDirectPending = true;
+}
+
+#endif
+
+// Set up the command to send in the specified frame of the next transfer. This is called for each frame in turn before the transfer starts.
 // In the following, only byte accesses to sendDataBlock are allowed, because accesses to non-cacheable memory must be aligned
-void TmcDriverState::GetSpiCommand(uint8_t *sendDataBlock) noexcept
+void TmcDriverState::GetSpiCommand(uint8_t *sendDataBlock, size_t frame) noexcept
 {
+#if SUPPORT_CLOSED_LOOP
+	// Fast path for closed loop control. Send just the coil currents on most frames, but send a normal frame often enough to keep the other registers
+	// up to date and the status current. The result of a status read comes back in the following frame, which is normally an XDIRECT frame.
+	if (xDirectPending)
+	{
+		if (xDirectFramesTillNormalFrame != 0)
+		{
+			--xDirectFramesTillNormalFrame;
+			xDirectPending = false;
+			regIndexBeingUpdated[frame] = Write2160XDirect;
+			regIndexRead[frame] = NoRegIndex;
+			sendDataBlock[0] = REGNUM_2160_X_DIRECT | 0x80;
+			StoreBE32(sendDataBlock + 1, writeRegisters[Write2160XDirect]);
+			return;
+		}
+		xDirectFramesTillNormalFrame = XDirectFramesPerNormalFrame;		// send a normal frame this time and keep the coil currents for the next one
+	}
+#endif
+
 	// Find which register to send. The common case is when no registers need to be updated.
+	// Pick up new register values only at the start of a transfer, so that a register can't be changed while an earlier frame of the same transfer is writing it.
+	if (frame == 0)
 	{
 		TaskCriticalSectionLocker lock;
 		registersToUpdate |= newRegistersToUpdate;
 		newRegistersToUpdate = 0;
+		registersBeingSent = 0;
 	}
 
-	if (registersToUpdate == 0)
+	const uint32_t registersToSend = registersToUpdate & ~registersBeingSent;
+	if (registersToSend == 0)
 	{
-		// Read a register
-		regIndexBeingUpdated = NoRegIndex;
-		if (regIndexRequested >= ReadSpecial)
+		// Read a register. If a special register read has been requested then do that next, otherwise read the next one in the sequence for the motion state.
+		regIndexBeingUpdated[frame] = NoRegIndex;
+		if (specialReadRegisterNumber < 0x80 && regIndexRequested != ReadSpecial)
+		{
+			regIndexRequested = ReadSpecial;
+		}
+		else if (moving)
 		{
-			regIndexRequested = 0;
+			if (++readSequenceIndex >= ARRAY_SIZE(MovingReadSequence))
+			{
+				readSequenceIndex = 0;
+			}
+			regIndexRequested = MovingReadSequence[readSequenceIndex];
 		}
 		else
 		{
-			++regIndexRequested;
-			if (regIndexRequested == ReadSpecial && specialReadRegisterNumber >= 0x80)
+			if (++readSequenceIndex >= ARRAY_SIZE(StandstillReadSequence))
 			{
-				regIndexRequested = 0;
+				readSequenceIndex = 0;
 			}
+			regIndexRequested = StandstillReadSequence[readSequenceIndex];
 		}
 
+		regIndexRead[frame] = regIndexRequested;
+		if (regIndexRequested == ReadMsCnt)
+		{
+			msCntRequestMoveCount = GetMoveInstance().GetCompletedMoves();
+		}
 		sendDataBlock[0] = (regIndexRequested == ReadSpecial) ? specialReadRegisterNumber : ReadRegNumbers[regIndexRequested];
 		sendDataBlock[1] = 0;
 		sendDataBlock[2] = 0;
@@ -968,24 +1205,28 @@ void TmcDriverState::GetSpiCommand(uint8_t *sendDataBlock) noexcept
 	else
 	{
 		// Write a register
-		const size_t regNum = LowestSetBit(registersToUpdate);
-		regIndexBeingUpdated = regNum;
+		const size_t regNum = LowestSetBit(registersToSend);
+		regIndexBeingUpdated[frame] = regNum;
+		regIndexRead[frame] = NoRegIndex;
+		registersBeingSent |= 1u << regNum;
 		sendDataBlock[0] = ((regNum == WriteSpecial) ? specialWriteRegisterNumber : WriteRegNumbers[regNum]) | 0x80;
 		StoreBE32(sendDataBlock + 1, writeRegisters[regNum]);
 	}
 }
 
-void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock) noexcept
+// Process the response to the specified frame of the transfer. This is called for each frame in turn after the transfer has completed.
+void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock, size_t frame) noexcept
 {
 	// If we wrote a register, mark it up to date
-	if (regIndexBeingUpdated <= NumWriteRegisters)
+	if (regIndexBeingUpdated[frame] <= NumWriteRegisters)
 	{
-		registersToUpdate &= ~(1u << regIndexBeingUpdated);
+		registersToUpdate &= ~(1u << regIndexBeingUpdated[frame]);
 		++numWrites;
 	}
 
 	// Get the full step interval, we will need it later
 	const uint32_t interval = GetMoveInstance().GetStepInterval(axisNumber, microstepShiftFactor);		// get the full step interval
+	moving = interval != 0 || (readRegisters[ReadDrvStat] & TMC_RR_STST) == 0;
 
 	// If we read a register, update our copy
 	if (previousRegIndexRequested <= NumReadRegisters)
@@ -1004,6 +1245,11 @@ void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock) noexcept
 				}
 			}
 
+			if (loadRecordDecimation != 0)
+			{
+				RecordLoad(regVal, interval);
+			}
+
 			if ((regVal & (TMC_RR_OLA | TMC_RR_OLB)) != 0)
 			{
 				if (   (regVal & TMC_RR_STST) != 0
@@ -1029,6 +1275,10 @@ void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock) noexcept
 			{
 				specialReadRegisterNumber = 0xFE;
 			}
+			else if (previousRegIndexRequested == ReadMsCnt)
+			{
+				CheckMicrostepCounter(regVal & 1023);
+			}
 		}
 	}
 
@@ -1046,12 +1296,138 @@ void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock) noexcept
 		readRegisters[ReadDrvStat] &= ~TMC_RR_SG;
 	}
 
-	previousRegIndexRequested = (regIndexBeingUpdated == NoRegIndex) ? regIndexRequested : NoRegIndex;
+	previousRegIndexRequested = regIndexRead[frame];
+}
+
+// Add a DRV_STATUS sample to the load statistics of the current move. When a move has completed, save its statistics if we are recording that move.
+void TmcDriverState::RecordLoad(uint32_t drvStatus, uint32_t interval) noexcept
+{
+	const uint32_t movesCompleted = GetMoveInstance().GetCompletedMoves();
+	if (movesCompleted != currentMoveLoad.moveNumber)
+	{
+		const unsigned int decimation = loadRecordDecimation;		// capture volatile variable
+		if (currentMoveLoad.numSamples != 0 && decimation != 0 && currentMoveLoad.moveNumber % decimation == 0)
+		{
+			AtomicCriticalSectionLocker lock;
+			moveLoadRecords[moveLoadRecordIndex] = currentMoveLoad;
+			moveLoadRecordIndex = (moveLoadRecordIndex + 1) % NumMoveLoadRecords;
+			if (numMoveLoadRecords < NumMoveLoadRecords)
+			{
+				++numMoveLoadRecords;
+			}
+		}
+		currentMoveLoad.Reset(movesCompleted);
+	}
+
+	if (interval != 0 && (drvStatus & TMC_RR_STST) == 0 && currentMoveLoad.numSamples != 0xFFFF)
+	{
+		const uint16_t sgResult = drvStatus & TMC_RR_SGRESULT;
+		const uint8_t csActual = (drvStatus & TMC_RR_CSACTUAL_MASK) >> TMC_RR_CSACTUAL_SHIFT;
+		++currentMoveLoad.numSamples;
+		currentMoveLoad.sgTotal += sgResult;
+		currentMoveLoad.csTotal += csActual;
+		currentMoveLoad.intervalTotal += interval;
+		currentMoveLoad.sgMin = min<uint16_t>(currentMoveLoad.sgMin, sgResult);
+		currentMoveLoad.sgMax = max<uint16_t>(currentMoveLoad.sgMax, sgResult);
+		currentMoveLoad.csMin = min<uint8_t>(currentMoveLoad.csMin, csActual);
+		currentMoveLoad.csMax = max<uint8_t>(currentMoveLoad.csMax, csActual);
+	}
+}
+
+// Check the microstep counter against the commanded position, to detect step pulses that the driver missed or extra ones caused by noise.
+// We can only do this when no move is executing, otherwise we don't know which position the counter corresponds to.
+void TmcDriverState::CheckMicrostepCounter(uint32_t msCnt) noexcept
+{
+	if (   driversState != DriversState::ready
+#if TMC_TYPE == 2160
+		|| GetDriverMode() == DriverMode::direct						// in closed loop mode the coil currents are set directly, so MSCNT isn't updated
+#endif
+	   )
+	{
+		microstepCheckValid = false;
+		return;
+	}
+
+	const Move& move = GetMoveInstance();
+	if (!move.IsIdle() || move.GetCompletedMoves() != msCntRequestMoveCount)
+	{
+		return;															// a move is executing or it completed after we asked for MSCNT
+	}
+
+	const int32_t position = move.GetPosition(axisNumber);
+	if (microstepCheckValid && position != microstepCheckPosition)
+	{
+		// MSCNT counts 1024 per electrical cycle. Work out how far it should have moved in either direction and compare it with how far it did move.
+		const uint32_t commandedChange = ((uint32_t)(position - microstepCheckPosition) << (8 - microstepShiftFactor)) & 1023;
+		const uint32_t actualChange = (msCnt - microstepCheckMsCnt) & 1023;
+		const int32_t forwardError = (int32_t)((actualChange - commandedChange + 512) & 1023) - 512;
+		const int32_t reverseError = (int32_t)((actualChange + commandedChange + 512) & 1023) - 512;
+		if (msCntDirection == 0)
+		{
+			// We don't know which way the driver counts yet, so learn it from the first move that matches exactly one direction
+			if (forwardError == 0 && reverseError != 0)
+			{
+				msCntDirection = 1;
+			}
+			else if (reverseError == 0 && forwardError != 0)
+			{
+				msCntDirection = -1;
+			}
+		}
+		else
+		{
+			const int32_t error = (msCntDirection > 0) ? forwardError : -reverseError;
+			if (error != 0)
+			{
+				++numMicrostepErrors;
+				lastMicrostepError = error;
+			}
+		}
+	}
+	else if (microstepCheckValid && msCnt != microstepCheckMsCnt)
+	{
+		// The counter moved while we weren't commanding any steps
+		++numMicrostepErrors;
+		lastMicrostepError = (int32_t)(((msCnt - microstepCheckMsCnt + 512) & 1023) - 512) * ((msCntDirection < 0) ? -1 : 1);
+	}
+
+	microstepCheckPosition = position;
+	microstepCheckMsCnt = msCnt;
+	microstepCheckValid = true;
+}
+
+// Discard the load statistics we have collected
+void TmcDriverState::ResetLoadRecords() noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	numMoveLoadRecords = moveLoadRecordIndex = 0;
+	currentMoveLoad.Reset(GetMoveInstance().GetCompletedMoves());
+}
+
+// Append as many of the saved move load records as will fit to the reply, oldest first, and remove them
+void TmcDriverState::ReportLoad(const StringRef& reply) noexcept
+{
+	for (;;)
+	{
+		MoveLoadRecord r;
+		{
+			AtomicCriticalSectionLocker lock;
+			if (numMoveLoadRecords == 0 || reply.strlen() + MaxLoadRecordTextLength >= reply.Capacity())
+			{
+				break;
+			}
+			r = moveLoadRecords[(moveLoadRecordIndex + NumMoveLoadRecords - numMoveLoadRecords) % NumMoveLoadRecords];
+			--numMoveLoadRecords;
+		}
+		reply.lcatf("%" PRIu32 ": %u %" PRIu32 " %u, %u %" PRIu32 " %u, %" PRIu32,
+					r.moveNumber, r.sgMin, r.sgTotal/r.numSamples, r.sgMax, r.csMin, r.csTotal/r.numSamples, r.csMax, r.intervalTotal/r.numSamples);
+	}
 }
 
 void TmcDriverState::TransferFailed() noexcept
 {
 	regIndexRequested = previousRegIndexRequested = NoRegIndex;
+	registersBeingSent = 0;
 }
 
 // State structures for all drivers
@@ -1061,10 +1437,53 @@ static TmcDriverState driverStates[MaxSmartDrivers];
 static Task<TmcTaskStackWords> tmcTask;
 
 // Access to these DMA buffers must be correctly aligned
-static volatile uint8_t sendData[5 * MaxSmartDrivers];
-static volatile uint8_t rcvData[5 * MaxSmartDrivers];
+static volatile uint8_t sendData[MaxFramesPerTransfer][5 * MaxSmartDrivers];
+static volatile uint8_t rcvData[MaxFramesPerTransfer][5 * MaxSmartDrivers];
 
 static volatile DmaCallbackReason dmaFinishedReason;
+static size_t numFramesInTransfer = 1;						// how many frames we are sending in the current transfer
+static volatile size_t currentFrame;						// the frame that the DMAC is currently sending
+
+#if SUPPORT_CLOSED_LOOP
+constexpr unsigned int MinControlLoopRate = 1000;			// the lowest fixed closed loop control rate we allow, in Hz
+constexpr unsigned int MaxControlLoopRate = 20000;			// the highest fixed closed loop control rate we allow, in Hz
+
+// When closed loop control runs at a fixed rate, this timer wakes up the TMC task when the next control loop iteration is due
+static StepTimer controlLoopTimer;
+static volatile uint32_t controlLoopInterval = 0;					// the control loop interval in step clocks, or 0 to run the control loop once per SPI transfer
+static StepTimer::Ticks whenControlLoopDue;
+
+static void ControlLoopTimerCallback(CallbackParameter) noexcept
+{
+	tmcTask.GiveFromISR();
+}
+
+// If the control loop runs at a fixed rate, wait until the next iteration is due. Return the time at which it was due.
+static StepTimer::Ticks WaitForControlLoopDue() noexcept
+{
+	const uint32_t interval = controlLoopInterval;			// capture volatile variable
+	if (interval != 0)
+	{
+		whenControlLoopDue += interval;
+		const StepTimer::Ticks due = whenControlLoopDue;
+		const StepTimer::Ticks now = StepTimer::GetTimerTicks();
+		if ((int32_t)(whenControlLoopDue - now) <= 0 || (int32_t)(whenControlLoopDue - now) > (int32_t)interval)
+		{
+			whenControlLoopDue = now;						// we have fallen behind or the rate has changed, so restart the schedule rather than trying to catch up
+		}
+		else
+		{
+			TaskBase::ClearCurrentTaskNotifyCount();
+			if (!controlLoopTimer.ScheduleCallback(whenControlLoopDue))
+			{
+				(void)TaskBase::Take(2);					// the timeout is just in case the callback gets lost
+			}
+		}
+		return due;
+	}
+	return StepTimer::GetTimerTicks();
+}
+#endif
 
 #if DEBUG_DRIVER_TIMEOUT
 static uint8_t lastFailureStatus;
@@ -1135,9 +1554,9 @@ static void SetupDMA() noexcept
 						| XDMAC_CC_SAM_FIXED_AM
 						| XDMAC_CC_DAM_INCREMENTED_AM
 						| XDMAC_CC_PERID(TMC51xx_DmaRxPerid);
-		p_cfg.mbr_ubc = ARRAY_SIZE(rcvData);
+		p_cfg.mbr_ubc = ARRAY_SIZE(rcvData[0]);
 		p_cfg.mbr_sa = reinterpret_cast<uint32_t>(&(USART_TMC51xx->US_RHR));
-		p_cfg.mbr_da = reinterpret_cast<uint32_t>(rcvData);
+		p_cfg.mbr_da = reinterpret_cast<uint32_t>(rcvData[0]);
 		xdmac_configure_transfer(XDMAC, DmacChanTmcRx, &p_cfg);
 	}
 
@@ -1155,8 +1574,8 @@ static void SetupDMA() noexcept
 						| XDMAC_CC_SAM_INCREMENTED_AM
 						| XDMAC_CC_DAM_FIXED_AM
 						| XDMAC_CC_PERID(TMC51xx_DmaTxPerid);
-		p_cfg.mbr_ubc = ARRAY_SIZE(sendData);
-		p_cfg.mbr_sa = reinterpret_cast<uint32_t>(sendData);
+		p_cfg.mbr_ubc = ARRAY_SIZE(sendData[0]);
+		p_cfg.mbr_sa = reinterpret_cast<uint32_t>(sendData[0]);
 		p_cfg.mbr_da = reinterpret_cast<uint32_t>(&(USART_TMC51xx->US_THR));
 		xdmac_configure_transfer(XDMAC, DmacChanTmcTx, &p_cfg);
 	}
@@ -1164,14 +1583,24 @@ static void SetupDMA() noexcept
 #elif SAME5x || SAMC21
 	DmacManager::DisableChannel(DmacChanTmcRx);
 	DmacManager::DisableChannel(DmacChanTmcTx);
+# if TMC51xx_USES_SERCOM
+	if (MaxFramesPerTransfer > 1)
+	{
+		// The DMA complete callback may have left the descriptors pointing to a later frame
+		DmacManager::SetDestinationAddress(DmacChanTmcRx, rcvData[0]);
+		DmacManager::SetDataLength(DmacChanTmcRx, ARRAY_SIZE(rcvData[0]));
+		DmacManager::SetSourceAddress(DmacChanTmcTx, sendData[0]);
+		DmacManager::SetDataLength(DmacChanTmcTx, ARRAY_SIZE(sendData[0]));
+	}
+# endif
 #else
 	spiPdc->PERIPH_PTCR = (PERIPH_PTCR_RXTDIS | PERIPH_PTCR_TXTDIS);		// disable the PDC
 
-	spiPdc->PERIPH_TPR = reinterpret_cast<uint32_t>(sendData);
-	spiPdc->PERIPH_TCR = ARRAY_SIZE(sendData);
+	spiPdc->PERIPH_TPR = reinterpret_cast<uint32_t>(sendData[0]);
+	spiPdc->PERIPH_TCR = ARRAY_SIZE(sendData[0]);
 
-	spiPdc->PERIPH_RPR = reinterpret_cast<uint32_t>(rcvData);
-	spiPdc->PERIPH_RCR = ARRAY_SIZE(rcvData);
+	spiPdc->PERIPH_RPR = reinterpret_cast<uint32_t>(rcvData[0]);
+	spiPdc->PERIPH_RCR = ARRAY_SIZE(rcvData[0]);
 #endif
 }
 
@@ -1260,14 +1689,40 @@ void RxDmaCompleteCallback(CallbackParameter param, DmaCallbackReason reason) no
 #if SAME70
 	xdmac_channel_disable_interrupt(XDMAC, DmacChanTmcRx, 0xFFFFFFFF);
 #endif
-	dmaFinishedReason = reason;
 	fastDigitalWriteHigh(GlobalTmc51xxCSPin);			// set CS high
+#if TMC51xx_USES_SERCOM
+	// If there are more frames in this transfer, start the next one instead of waking up the TMC task. The drivers act on the datagrams when CS goes high.
+	const size_t frame = currentFrame + 1;
+	if (reason == DmaCallbackReason::complete && frame < numFramesInTransfer)
+	{
+		const uint32_t csHighStartedAt = GetCurrentCycles();
+		currentFrame = frame;
+		DisableDma();
+		DmacManager::SetDestinationAddress(DmacChanTmcRx, rcvData[frame]);
+		DmacManager::SetDataLength(DmacChanTmcRx, ARRAY_SIZE(rcvData[frame]));
+		DmacManager::SetSourceAddress(DmacChanTmcTx, sendData[frame]);
+		DmacManager::SetDataLength(DmacChanTmcTx, ARRAY_SIZE(sendData[frame]));
+		DelayCycles(csHighStartedAt, FrameCsHighClocks);
+
+		// Use the same sequence as TmcLoop, because enabling DMA while SPI is enabled sometimes results in timeouts
+		fastDigitalWriteLow(GlobalTmc51xxCSPin);		// set CS low
+		ResetSpi();
+		EnableDma();
+		EnableSpi();
+		return;
+	}
+#endif
+	dmaFinishedReason = reason;
 	tmcTask.GiveFromISR();
 }
 
 extern "C" [[noreturn]] void TmcLoop(void *) noexcept
 {
 	bool timedOut = true;
+#if SUPPORT_CLOSED_LOOP
+	const DeadlineMonitor::Handle deadlineHandle = DeadlineMonitor::Register("Control loop", 0);
+	uint32_t monitoredInterval = 0;
+#endif
 	for (;;)
 	{
 		if (driversState == DriversState::noPower)
@@ -1286,12 +1741,15 @@ extern "C" [[noreturn]] void TmcLoop(void *) noexcept
 			}
 			else if (!timedOut)
 			{
-				// Handle the read response - data comes out of the drivers in reverse driver order
-				const volatile uint8_t *readPtr = rcvData + 5 * numTmc51xxDrivers;
-				for (size_t drive = 0; drive < numTmc51xxDrivers; ++drive)
+				// Handle the read responses - data comes out of the drivers in reverse driver order
+				for (size_t frame = 0; frame < numFramesInTransfer; ++frame)
 				{
-					readPtr -= 5;
-					driverStates[drive].TransferSucceeded(const_cast<const uint8_t*>(readPtr));
+					const volatile uint8_t *readPtr = rcvData[frame] + 5 * numTmc51xxDrivers;
+					for (size_t drive = 0; drive < numTmc51xxDrivers; ++drive)
+					{
+						readPtr -= 5;
+						driverStates[drive].TransferSucceeded(const_cast<const uint8_t*>(readPtr), frame);
+					}
 				}
 
 				if (driversState == DriversState::initialising)
@@ -1316,15 +1774,46 @@ extern "C" [[noreturn]] void TmcLoop(void *) noexcept
 			}
 
 #if SUPPORT_CLOSED_LOOP
+			const StepTimer::Ticks controlLoopDue = WaitForControlLoopDue();
+			if (controlLoopInterval != monitoredInterval)
+			{
+				monitoredInterval = controlLoopInterval;
+				DeadlineMonitor::SetPeriod(deadlineHandle, monitoredInterval);		// a period of zero stops it checking when the control loop runs once per transfer
+			}
+			DeadlineMonitor::Begin(deadlineHandle, controlLoopDue);
 			ClosedLoop::ControlLoop();	// Allow closed-loop to set the motor currents before we write
+			DeadlineMonitor::End(deadlineHandle);
+			if (!ClosedLoop::GetClosedLoopEnabled())
 #endif
+			{
+				// If no motor is moving and there is nothing to write then the register values are changing only slowly, so poll the drivers less often
+				bool idle = (driversState == DriversState::ready);
+				for (size_t i = 0; idle && i < numTmc51xxDrivers; ++i)
+				{
+					idle = !driverStates[i].IsMoving() && !driverStates[i].UpdatePending();
+				}
+				if (idle)
+				{
+					delay(StandstillPollInterval);
+				}
+			}
 			// Set up data to write. Driver 0 is the first in the SPI chain so we must write them in reverse order.
-			volatile uint8_t *writeBufPtr = sendData + 5 * numTmc51xxDrivers;
-			for (size_t i = 0; i < numTmc51xxDrivers; ++i)
+			// When closed loop control is running we need the results of every frame, so send just one. Otherwise send several frames per transfer.
+#if SUPPORT_CLOSED_LOOP
+			numFramesInTransfer = (ClosedLoop::GetClosedLoopEnabled()) ? 1 : MaxFramesPerTransfer;
+#else
+			numFramesInTransfer = MaxFramesPerTransfer;
+#endif
+			for (size_t frame = 0; frame < numFramesInTransfer; ++frame)
 			{
-				writeBufPtr -= 5;
-				driverStates[i].GetSpiCommand(const_cast<uint8_t*>(writeBufPtr));
+				volatile uint8_t *writeBufPtr = sendData[frame] + 5 * numTmc51xxDrivers;
+				for (size_t i = 0; i < numTmc51xxDrivers; ++i)
+				{
+					writeBufPtr -= 5;
+					driverStates[i].GetSpiCommand(const_cast<uint8_t*>(writeBufPtr), frame);
+				}
 			}
+			currentFrame = 0;
 
 			// Kick off a transfer.
 			// On the SAME5x the only way I have found to get reliable transfers and no timeouts is to disable SPI, enable DMA, and then enable SPI.
@@ -1440,15 +1929,15 @@ void SmartDrivers::Init() noexcept
 	DmacManager::SetBtctrl(DmacChanTmcRx, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
 								| DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_STEPSEL_DST | DMAC_BTCTRL_STEPSIZE_X1);
 	DmacManager::SetSourceAddress(DmacChanTmcRx, &(SERCOM_TMC51xx->SPI.DATA.reg));
-	DmacManager::SetDestinationAddress(DmacChanTmcRx, rcvData);
-	DmacManager::SetDataLength(DmacChanTmcRx, ARRAY_SIZE(rcvData));
+	DmacManager::SetDestinationAddress(DmacChanTmcRx, rcvData[0]);
+	DmacManager::SetDataLength(DmacChanTmcRx, ARRAY_SIZE(rcvData[0]));
 	DmacManager::SetTriggerSourceSercomRx(DmacChanTmcRx, SERCOM_TMC51xx_NUMBER);
 
 	DmacManager::SetBtctrl(DmacChanTmcTx, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
 								| DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacManager::SetSourceAddress(DmacChanTmcTx, sendData);
+	DmacManager::SetSourceAddress(DmacChanTmcTx, sendData[0]);
 	DmacManager::SetDestinationAddress(DmacChanTmcTx, &(SERCOM_TMC51xx->SPI.DATA.reg));
-	DmacManager::SetDataLength(DmacChanTmcTx, ARRAY_SIZE(sendData));
+	DmacManager::SetDataLength(DmacChanTmcTx, ARRAY_SIZE(sendData[0]));
 	DmacManager::SetTriggerSourceSercomTx(DmacChanTmcTx, SERCOM_TMC51xx_NUMBER);
 
 	DmacManager::SetInterruptCallback(DmacChanTmcRx, RxDmaCompleteCallback, CallbackParameter(0U));
@@ -1565,6 +2054,28 @@ unsigned int SmartDrivers::GetMicrostepping(size_t driver, bool& interpolation)
 	return 1;
 }
 
+// Tell the driver that the direction of motion for a given position change has been reversed
+void SmartDrivers::DirectionChanged(size_t driver) noexcept
+{
+	if (driver < numTmc51xxDrivers)
+	{
+		driverStates[driver].DirectionChanged();
+	}
+}
+
+#if SUPPORT_MICROSTEP_REDUCTION
+
+// Reduce the microstepping below the configured value by a power of 2 while the step rate is high
+void SmartDrivers::SetMicrostepReduction(size_t driver, unsigned int reduction) noexcept
+{
+	if (driver < numTmc51xxDrivers)
+	{
+		driverStates[driver].SetMicrostepReduction(reduction);
+	}
+}
+
+#endif
+
 #if SUPPORT_CLOSED_LOOP
 
 // Get the amount we have to shift 1 left by to get the microstepping
@@ -1660,6 +2171,57 @@ void SmartDrivers::AppendStallConfig(size_t driver, const StringRef& reply) noex
 	}
 }
 
+// Configure adaptive current for a driver and report it. In closed loop mode the control loop already scales the current with the load, so this only affects open loop operation.
+GCodeResult SmartDrivers::ConfigureAdaptiveCurrent(size_t driver, unsigned int minPercent, unsigned int sgLowLoad, const StringRef& reply) noexcept
+{
+	if (driver >= numTmc51xxDrivers)
+	{
+		reply.printf("Driver %u does not exist", (unsigned int)driver);
+		return GCodeResult::error;
+	}
+	if (minPercent != 0 && minPercent != 25 && minPercent != 50)
+	{
+		reply.copy("Adaptive current minimum must be 25% or 50%, or 0 to turn it off");
+		return GCodeResult::error;
+	}
+
+	driverStates[driver].SetAdaptiveCurrent(minPercent, (sgLowLoad == 0) ? DefaultAdaptiveCurrentLowLoad : sgLowLoad);
+	reply.printf("Driver %u ", (unsigned int)driver);
+	driverStates[driver].AppendAdaptiveCurrent(reply);
+	return GCodeResult::ok;
+}
+
+// Record the load of one move in every 'decimation' moves for each driver, or stop recording if decimation is zero, and report the records we already have.
+// SG_RESULT and CS_ACTUAL are read from DRV_STATUS while the motor is moving, so that rising friction can be detected from the trend in the load.
+GCodeResult SmartDrivers::ConfigureLoadRecording(unsigned int decimation, const StringRef& reply) noexcept
+{
+	reply.printf("Load per move (SG min avg max, CS min avg max, full step interval)");
+	for (size_t driver = 0; driver < numTmc51xxDrivers; ++driver)
+	{
+		reply.lcatf("Driver %u:", (unsigned int)driver);
+		driverStates[driver].ReportLoad(reply);
+	}
+
+	if (decimation != loadRecordDecimation)
+	{
+		loadRecordDecimation = 0;									// stop the TMC task recording while we reset the records
+		for (size_t driver = 0; driver < numTmc51xxDrivers; ++driver)
+		{
+			driverStates[driver].ResetLoadRecords();
+		}
+		loadRecordDecimation = decimation;
+	}
+	if (decimation == 0)
+	{
+		reply.lcat("Load recording is off");
+	}
+	else
+	{
+		reply.lcatf("Recording the load of one move in %u", decimation);
+	}
+	return GCodeResult::ok;
+}
+
 void SmartDrivers::AppendDriverStatus(size_t driver, const StringRef& reply) noexcept
 {
 	if (driver < numTmc51xxDrivers)
@@ -1681,6 +2243,11 @@ float SmartDrivers::GetStandstillCurrentPercent(size_t driver) noexcept
 	return (driver < numTmc51xxDrivers) ? driverStates[driver].GetStandstillCurrentPercent() : 0.0;
 }
 
+float SmartDrivers::GetActualCurrent(size_t driver) noexcept
+{
+	return (driver < numTmc51xxDrivers) ? driverStates[driver].GetActualCurrent() : 0.0;
+}
+
 void SmartDrivers::SetStandstillCurrentPercent(size_t driver, float percent) noexcept
 {
 	if (driver < numTmc51xxDrivers)
@@ -1691,6 +2258,13 @@ void SmartDrivers::SetStandstillCurrentPercent(size_t driver, float percent) noe
 
 bool SmartDrivers::SetRegister(size_t driver, SmartDriverRegister reg, uint32_t regVal) noexcept
 {
+#if SUPPORT_CLOSED_LOOP
+	if (reg == SmartDriverRegister::xDirect && driver < numTmc51xxDrivers)
+	{
+		driverStates[driver].SetXDirect(regVal);		// use the fast path
+		return true;
+	}
+#endif
 	return (driver < numTmc51xxDrivers) && driverStates[driver].SetRegister(reg, regVal);
 }
 
@@ -1734,6 +2308,35 @@ StandardDriverStatus SmartDrivers::GetStatus(size_t driver, bool accumulated, bo
 	return rslt;
 }
 
+#if SUPPORT_CLOSED_LOOP
+
+// Run the closed loop control loop at a fixed rate in Hz, or once per SPI transfer if the rate is zero
+GCodeResult SmartDrivers::SetControlLoopRate(unsigned int rate, const StringRef& reply) noexcept
+{
+	if (rate != 0)
+	{
+		if (rate < MinControlLoopRate || rate > MaxControlLoopRate)
+		{
+			reply.printf("Control loop rate must be zero or between %u and %uHz", MinControlLoopRate, MaxControlLoopRate);
+			return GCodeResult::error;
+		}
+		controlLoopTimer.SetCallback(ControlLoopTimerCallback, CallbackParameter(nullptr), "control loop");
+	}
+	controlLoopInterval = (rate == 0) ? 0 : StepTimer::StepClockRate/rate;
+	if (rate == 0)
+	{
+		controlLoopTimer.CancelCallback();
+		reply.copy("Control loop runs once per driver SPI transfer");
+	}
+	else
+	{
+		reply.printf("Control loop runs at %uHz", rate);
+	}
+	return GCodeResult::ok;
+}
+
+#endif
+
 #endif
 
 // End
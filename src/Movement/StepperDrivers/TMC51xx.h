@@ -25,10 +25,15 @@ namespace SmartDrivers
 	void EnableDrive(size_t driver, bool en) noexcept;
 	bool SetMicrostepping(size_t drive, unsigned int microsteps, bool interpolation) noexcept;
 	unsigned int GetMicrostepping(size_t drive, bool& interpolation) noexcept;
+	void DirectionChanged(size_t driver) noexcept;
+#if SUPPORT_MICROSTEP_REDUCTION
+	void SetMicrostepReduction(size_t driver, unsigned int reduction) noexcept;
+#endif
 #if SUPPORT_CLOSED_LOOP
 	unsigned int GetMicrostepShift(size_t driver) noexcept;
 	uint16_t GetMicrostepPosition(size_t driver) noexcept;
 	void SetTmcExternalClock(uint32_t frequency) noexcept;
+	GCodeResult SetControlLoopRate(unsigned int rate, const StringRef& reply) noexcept;
 #endif
 	bool SetDriverMode(size_t driver, unsigned int mode) noexcept;
 	DriverMode GetDriverMode(size_t driver) noexcept;
@@ -37,7 +42,10 @@ namespace SmartDrivers
 	void SetStallMinimumStepsPerSecond(size_t driver, unsigned int stepsPerSecond) noexcept;
 	void AppendStallConfig(size_t driver, const StringRef& reply) noexcept;
 	void AppendDriverStatus(size_t driver, const StringRef& reply) noexcept;
+	GCodeResult ConfigureLoadRecording(unsigned int decimation, const StringRef& reply) noexcept;
+	GCodeResult ConfigureAdaptiveCurrent(size_t driver, unsigned int minPercent, unsigned int sgLowLoad, const StringRef& reply) noexcept;
 	float GetStandstillCurrentPercent(size_t driver) noexcept;
+	float GetActualCurrent(size_t driver) noexcept;
 	void SetStandstillCurrentPercent(size_t driver, float percent) noexcept;
 	bool SetRegister(size_t driver, SmartDriverRegister reg, uint32_t regVal) noexcept;
 	uint32_t GetRegister(size_t driver, SmartDriverRegister reg) noexcept;
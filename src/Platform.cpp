@@ -11,24 +11,34 @@
 #include <AnalogIn.h>
 #include <AnalogOut.h>
 #include <Movement/Move.h>
+#include <Movement/LocalHoming.h>
+#include <Movement/StepRateProfiler.h>
 #include "Movement/StepperDrivers/TMC51xx.h"
 #include "Movement/StepperDrivers/TMC22xx.h"
 #include "AdcAveragingFilter.h"
 #include "Movement/StepTimer.h"
+#include "Movement/StepTrace.h"
 #include <CAN/CanInterface.h>
+#include <CAN/MotionLoadGenerator.h>
 #include <CanMessageBuffer.h>
 #include "Tasks.h"
 #include "Heating/Heat.h"
 #include "Heating/Sensors/TemperatureSensor.h"
 #include "Fans/FansManager.h"
+#include <FilamentMonitors/FilamentMonitor.h>
+#include <GPIO/GpioPorts.h>
+#include <InputMonitors/InputMonitor.h>
+#include <CommandProcessing/CompactDiagnostics.h>
 #include <CanMessageFormats.h>
 #include <CanMessageGenericTables.h>
 #include <CanMessageGenericParser.h>
 #include <Hardware/Devices.h>
+#include <Hardware/FlashCrc.h>
+#include <Maintenance.h>
 #include <Math/Isqrt.h>
 #include <Version.h>
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 # include <CommandProcessing/AccelerometerHandler.h>
 #endif
 
@@ -83,6 +93,9 @@ static volatile uint32_t whenDeferredCommandRequested;
 static uint32_t realTime = 0;
 static bool deliberateError = false;
 
+static uint32_t whenStartupStageDone[(unsigned int)StartupStage::numStages] = { 0 };
+static const char * const StartupStageNames[(unsigned int)StartupStage::numStages] = { "CAN", "heaters", "movement", "peripherals" };
+
 namespace Platform
 {
 	static uint32_t errorCodeBits = 0;
@@ -133,8 +146,21 @@ namespace Platform
 # endif
 
 # if !SINGLE_DRIVER
-	uint32_t driveDriverBits[NumDrivers];
-	uint32_t allDriverBits = 0;
+	// StepDriversHigh and StepDriversLow drive all the step pins that are due with one write to StepPio, so that their pulses start and end together.
+	// That only works if the board has all its step pins on the same port.
+	static constexpr bool AllStepPinsOnOnePort() noexcept
+	{
+		for (Pin p : StepPins)
+		{
+			if ((p >> 5) != (StepPins[0] >> 5))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static_assert(AllStepPinsOnOnePort(), "All step pins must be on the same port as StepPio");
 # endif
 
 	static bool directions[NumDrivers];
@@ -150,6 +176,28 @@ namespace Platform
 	static float pressureAdvanceClocks[NumDrivers];
 	static float idleCurrentFactor[NumDrivers];
 
+#if HAS_SMART_DRIVERS
+	// Extruder current boost during the acceleration phase of fast extrusion moves.
+	// DDA::Init queues the acceleration windows when it prepares a move and Spin switches the boost on and off as the windows come and go.
+	struct CurrentBoostWindow
+	{
+		uint32_t startTime;
+		uint32_t endTime;
+	};
+
+	constexpr size_t NumCurrentBoostWindows = 8;													// must be a power of 2 because the queue indices wrap
+	constexpr uint32_t CurrentBoostLeadTicks = (2 * StepTimer::StepClockRate)/1000;				// allow for the time it takes the new current to reach the driver
+
+	static float currentBoostFactor[NumDrivers];													// 1.0 when boosting is disabled
+	static float currentBoostMinStepsPerClock[NumDrivers];										// the peak extrusion rate at or above which we boost
+	static CurrentBoostWindow currentBoostWindows[NumDrivers][NumCurrentBoostWindows];
+	static volatile uint8_t currentBoostWindowsAdded[NumDrivers];
+	static volatile uint8_t currentBoostWindowsTaken[NumDrivers];
+	static bool driverCurrentBoosted[NumDrivers];
+	static uint32_t numCurrentBoosts[NumDrivers];
+	static uint32_t numCurrentBoostWindowsDropped[NumDrivers];
+#endif
+
 	static void InternalEnableDrive(size_t driver);
 	static void InternalDisableDrive(size_t driver);
 	static void InternalSetDriverIdle(size_t driver);
@@ -166,12 +214,19 @@ namespace Platform
 #if HAS_VOLTAGE_MONITOR
 	static volatile uint16_t currentVin, highestVin, lowestVin;
 //	static uint16_t lastUnderVoltageValue, lastOverVoltageValue;
-	static uint32_t numUnderVoltageEvents, previousUnderVoltageEvents;
+	static volatile uint32_t numUnderVoltageEvents;
+	static uint32_t previousUnderVoltageEvents;
 	static volatile uint32_t numOverVoltageEvents, previousOverVoltageEvents;
+	static volatile bool driversPowered = false;					// cleared by Spin or by the tick ISR when the supply voltage is too low for the drivers
+	static uint32_t vinUnderVoltageSum;								// the VIN filter sum below which we turn the drivers off, precomputed for the tick ISR
+
+	constexpr float DriverPowerOnVoltage = 10.5;
+	constexpr float DriverPowerOffVoltage = 10.0;
 #endif
 
 #if HAS_12V_MONITOR
 	static volatile uint16_t currentV12, highestV12, lowestV12;
+	static uint32_t v12UnderVoltageSum;								// the V12 filter sum below which we turn the drivers off, precomputed for the tick ISR
 #endif
 
 	static MinCurMax mcuTemperature;
@@ -185,6 +240,17 @@ namespace Platform
 
 #if SUPPORT_THERMISTORS
 	static ThermistorAveragingFilter thermistorFilters[NumThermistorFilters];
+
+	// Over-temperature cutoffs checked each time a thermistor filter receives a reading, so that they don't depend on the Heat task running
+	struct ThermistorCutoff
+	{
+		void (*volatile function)(CallbackParameter) noexcept;	// the function to call when the limit is passed, or nullptr if not checking
+		CallbackParameter param;
+		uint32_t limitSum;
+		bool tripWhenBelow;
+	};
+
+	static ThermistorCutoff thermistorCutoffs[NumThermistorFilters];
 #endif
 
 #if HAS_VOLTAGE_MONITOR
@@ -209,6 +275,22 @@ namespace Platform
 	static uint8_t nextDriveToPoll;
 	static StandardDriverStatus lastEventStatus[NumDrivers];			// the status which we last reported as an event
 	static MillisTimer openLoadTimers[NumDrivers];
+
+	// Driver temperature estimation. The drivers only tell us when they pass the warning and shutdown temperatures, so we estimate the temperature
+	// in between from the motor current using a first order thermal model, and correct the model whenever it disagrees with the temperature flags.
+	constexpr float DriverWarningTemperature = 120.0;					// the temperature at which the drivers set the otpw flag
+	constexpr float DriverShutdownTemperature = 150.0;					// the temperature at which the drivers set the ot flag
+	constexpr float DriverThermalTimeConstant = 60.0;					// seconds
+	constexpr float DefaultDriverTemperatureRisePerAmpSquared = 5.0;
+	constexpr float MinDriverTemperatureRisePerAmpSquared = 0.5;
+	constexpr float MaxDriverTemperatureRisePerAmpSquared = 50.0;
+	constexpr float DefaultDriverAmbientTemperature = 25.0;			// used until we have read the MCU temperature
+
+	static float driverTemperatureRises[MaxSmartDrivers];				// how far above ambient temperature we estimate each driver to be
+	static float driverTemperatureRisePerAmpSquared[MaxSmartDrivers];	// the steady state temperature rise of each driver per A^2 of motor current
+	static uint32_t whenDriverTemperatureUpdated[MaxSmartDrivers];
+
+	static void UpdateDriverTemperatureEstimate(size_t driver, StandardDriverStatus stat) noexcept;
 # else
 	static bool driverIsEnabled[NumDrivers] = { false };
 # endif
@@ -236,6 +318,11 @@ namespace Platform
 # endif
 	}
 
+	inline uint16_t VinVoltageToAdcReading(float voltage) noexcept
+	{
+		return (uint16_t)(voltage/AdcReadingToVinVoltage(1));
+	}
+
 #endif
 
 #if HAS_12V_MONITOR
@@ -255,7 +342,44 @@ namespace Platform
 #if HAS_SMART_DRIVERS
 	static void UpdateMotorCurrent(size_t driver) noexcept
 	{
-		SmartDrivers::SetCurrent(driver, (driverAtIdleCurrent[driver]) ? motorCurrents[driver] * idleCurrentFactor[driver] : motorCurrents[driver]);
+		SmartDrivers::SetCurrent(driver, (driverAtIdleCurrent[driver]) ? motorCurrents[driver] * idleCurrentFactor[driver]
+										: (driverCurrentBoosted[driver]) ? motorCurrents[driver] * currentBoostFactor[driver]
+											: motorCurrents[driver]);
+	}
+
+	// Retire the extruder current boost windows that have ended and switch the boost on or off if necessary
+	static void UpdateCurrentBoosts() noexcept
+	{
+		const uint32_t now = StepTimer::GetTimerTicks();
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			bool boost = false;
+			uint8_t taken = currentBoostWindowsTaken[driver];
+			while (taken != currentBoostWindowsAdded[driver])
+			{
+				const CurrentBoostWindow& window = currentBoostWindows[driver][taken % NumCurrentBoostWindows];
+				if ((int32_t)(now - window.endTime) < 0)
+				{
+					boost = (int32_t)(now + CurrentBoostLeadTicks - window.startTime) >= 0;
+					break;
+				}
+				++taken;
+			}
+			currentBoostWindowsTaken[driver] = taken;
+
+			if (boost != driverCurrentBoosted[driver])
+			{
+				driverCurrentBoosted[driver] = boost;
+				if (boost)
+				{
+					++numCurrentBoosts[driver];
+				}
+				if (!driverAtIdleCurrent[driver])
+				{
+					UpdateMotorCurrent(driver);
+				}
+			}
+		}
 	}
 #endif
 
@@ -473,16 +597,33 @@ namespace Platform
 	}
 
 #if SUPPORT_THERMISTORS
+	// ADC callback that feeds a reading into a thermistor filter and then checks the over-temperature cutoff for that filter
+	static void ThermistorReadingCallback(CallbackParameter cp, uint16_t val) noexcept
+	{
+		ThermistorCutoff& cutoff = *static_cast<ThermistorCutoff*>(cp.vp);
+		ThermistorAveragingFilter& filter = thermistorFilters[&cutoff - thermistorCutoffs];
+		filter.ProcessReading(val);
+
+		const auto fn = cutoff.function;							// capture volatile variable
+		if (fn != nullptr && filter.IsValid()
+			&& ((cutoff.tripWhenBelow) ? filter.GetSum() < cutoff.limitSum : filter.GetSum() > cutoff.limitSum))
+		{
+			cutoff.function = nullptr;								// trip only once
+			fn(cutoff.param);
+		}
+	}
+
 	static void SetupThermistorFilter(Pin pin, size_t filterIndex, bool useAlternateAdc)
 	{
 		thermistorFilters[filterIndex].Init(0);
+		thermistorCutoffs[filterIndex].function = nullptr;
 		IoPort::SetPinMode(pin, PinMode::AIN);
 #if SAMC21
 		const AdcInput adcChan = (useAlternateAdc) ? PinToSdAdcChannel(pin) : PinToAdcChannel(pin);
 #else
 		const AdcInput adcChan = PinToAdcChannel(pin);
 #endif
-		AnalogIn::EnableChannel(adcChan, thermistorFilters[filterIndex].CallbackFeedIntoFilter, CallbackParameter(&thermistorFilters[filterIndex]), 1, useAlternateAdc);
+		AnalogIn::EnableChannel(adcChan, ThermistorReadingCallback, CallbackParameter(&thermistorCutoffs[filterIndex]), 1, useAlternateAdc);
 	}
 #endif
 
@@ -515,6 +656,7 @@ namespace Platform
 		lowestVin = 65535;
 		numUnderVoltageEvents = previousUnderVoltageEvents = numOverVoltageEvents = previousOverVoltageEvents = 0;
 
+		vinUnderVoltageSum = (uint32_t)VinVoltageToAdcReading(DriverPowerOffVoltage) * VinReadingsAveraged;
 		vinFilter.Init(0);
 		IoPort::SetPinMode(VinMonitorPin, AIN);
 		AnalogIn::EnableChannel(PinToAdcChannel(VinMonitorPin), vinFilter.CallbackFeedIntoFilter, CallbackParameter(&vinFilter), 1, false);
@@ -522,6 +664,9 @@ namespace Platform
 	}
 
 	static void InitLeds();
+#if HAS_VOLTAGE_MONITOR
+	static void RecordUnderVoltage() noexcept;
+#endif
 }	// end namespace Platform
 
 // LED management
@@ -596,6 +741,7 @@ void Platform::Init()
 #endif
 
 	InitLeds();
+	FlashCrc::Init();
 
 #if SUPPORT_CLOSED_LOOP
 	ClosedLoop::Init();
@@ -672,6 +818,7 @@ void Platform::Init()
 	currentV12 = highestV12 = 0;
 	lowestV12 = 65535;
 
+	v12UnderVoltageSum = (uint32_t)V12VoltageToAdcReading(DriverPowerOffVoltage) * VinReadingsAveraged;
 	v12Filter.Init(0);
 	IoPort::SetPinMode(V12MonitorPin, AIN);
 	AnalogIn::EnableChannel(PinToAdcChannel(V12MonitorPin), v12Filter.CallbackFeedIntoFilter, CallbackParameter(&v12Filter), 1, false);
@@ -729,6 +876,12 @@ void Platform::Init()
 	SmartDrivers::Init();
 	temperatureShutdownDrivers.Clear();
 	temperatureWarningDrivers.Clear();
+	for (size_t i = 0; i < MaxSmartDrivers; ++i)
+	{
+		driverTemperatureRises[i] = 0.0;
+		driverTemperatureRisePerAmpSquared[i] = DefaultDriverTemperatureRisePerAmpSquared;
+		whenDriverTemperatureUpdated[i] = millis();
+	}
 # endif
 
 	for (size_t i = 0; i < NumDrivers; ++i)
@@ -831,16 +984,18 @@ void Platform::Init()
 #  endif
 # endif
 
-# if !SINGLE_DRIVER
-		const uint32_t driverBit = 1u << (StepPins[i] & 31);
-		driveDriverBits[i] = driverBit;
-		allDriverBits |= driverBit;
-# endif
 		stepsPerMm[i] = DefaultStepsPerMm;
 		directions[i] = true;
 		driverAtIdleCurrent[i] = false;
 		idleCurrentFactor[i] = 0.3;
 		motorCurrents[i] = 0.0;
+#if HAS_SMART_DRIVERS
+		currentBoostFactor[i] = 1.0;
+		currentBoostMinStepsPerClock[i] = 0.0;
+		currentBoostWindowsAdded[i] = currentBoostWindowsTaken[i] = 0;
+		driverCurrentBoosted[i] = false;
+		numCurrentBoosts[i] = numCurrentBoostWindowsDropped[i] = 0;
+#endif
 		pressureAdvanceClocks[i] = 0.0;
 		driverStates[i] = DriverStateControl(DriverStateControl::driverDisabled);
 		// We can't set microstepping here because moveInstance hasn't been created yet
@@ -882,7 +1037,22 @@ void Platform::Init()
 
 	InitialiseInterrupts();
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+	CanInterface::Init(GetCanAddress(), UseAlternateCanPins, true);
+	lastPollTime = millis();
+
+	// Announce ourselves straight away, so that the main board can discover us while we finish initialising. The heater task repeats the announcement until it is acknowledged.
+	// Commands that arrive before we have finished are queued until the main task starts processing them.
+	{
+		CanMessageBuffer buf(nullptr);
+		(void)CanInterface::SendAnnounce(&buf);
+	}
+	SetStartupStageDone(StartupStage::can);
+}
+
+// Initialise the peripherals that nothing else needs at startup and that may take a while to probe. Called by the main task after the other tasks have been started.
+void Platform::InitDeferred()
+{
+#if SUPPORT_ACCELEROMETERS
 # ifdef TOOL1LC
 	if (boardVariant != 0)
 # endif
@@ -891,14 +1061,20 @@ void Platform::Init()
 	}
 #endif
 
-	CanInterface::Init(GetCanAddress(), UseAlternateCanPins, true);
-	lastPollTime = millis();
+	SetStartupStageDone(StartupStage::peripherals);
+}
+
+// Record how long after reset a stage of startup finished
+void Platform::SetStartupStageDone(StartupStage stage) noexcept
+{
+	whenStartupStageDone[(unsigned int)stage] = millis();
 }
 
 // Perform minimal initialisation prior to updating the bootloader
 void Platform::InitMinimal()
 {
 	InitLeds();
+	FlashCrc::Init();
 	InitVinMonitor();
 	InitialiseInterrupts();
 	CanInterface::Init(GetCanAddress(), UseAlternateCanPins, false);
@@ -906,10 +1082,6 @@ void Platform::InitMinimal()
 
 void Platform::Spin()
 {
-#if HAS_VOLTAGE_MONITOR || HAS_12V_MONITOR
-	static bool powered = false;
-#endif
-
 	if (deferredCommand != DeferredCommand::none && millis() - whenDeferredCommandRequested > 200)
 	{
 		switch (deferredCommand)
@@ -958,6 +1130,15 @@ void Platform::Spin()
 	}
 
 	SpinMinimal();				// update the activity LED and currentVin
+	FlashCrc::Spin();			// check the images in flash from time to time
+	CanInterface::Spin();		// monitor the CAN bus errors
+	MotionLoadGenerator::Spin();
+#if SUPPORT_DRIVERS
+	moveInstance->CheckMotionQueue();
+	LocalHoming::Spin();
+	StepRateProfiler::Spin();
+#endif
+	Maintenance::Spin();		// must be called after StepRateProfiler::Spin so that it sees the latest moving times
 
 #if HAS_VOLTAGE_MONITOR
 	const float voltsVin = GetCurrentVinVoltage();
@@ -978,29 +1159,29 @@ void Platform::Spin()
 	}
 
 	const float volts12 = (currentV12 * V12MonitorVoltageRange)/(1u << AnalogIn::AdcBits);
-	if (!powered && voltsVin >= 10.5 && volts12 >= 10.5)
+	if (!driversPowered && voltsVin >= DriverPowerOnVoltage && volts12 >= DriverPowerOnVoltage)
 	{
-		powered = true;
+		driversPowered = true;
 	}
-	else if (powered && (voltsVin < 10.0 || volts12 < 10.0))
+	else if (driversPowered && (voltsVin < DriverPowerOffVoltage || volts12 < DriverPowerOffVoltage))
 	{
-		powered = false;
-		++numUnderVoltageEvents;
+		RecordUnderVoltage();
 	}
 #elif HAS_VOLTAGE_MONITOR
 
-	if (!powered && voltsVin >= 10.5)
+	if (!driversPowered && voltsVin >= DriverPowerOnVoltage)
 	{
-		powered = true;
+		driversPowered = true;
 	}
-	else if (powered && voltsVin < 10.0)
+	else if (driversPowered && voltsVin < DriverPowerOffVoltage)
 	{
-		powered = false;
+		RecordUnderVoltage();
 	}
 #endif
 
 #if HAS_SMART_DRIVERS
-	SmartDrivers::Spin(powered);
+	UpdateCurrentBoosts();
+	SmartDrivers::Spin(driversPowered);
 
 	// Check one TMC driver for warnings and errors
 	if (enableValues[nextDriveToPoll] >= 0)				// don't poll driver if it is flagged "no poll"
@@ -1025,6 +1206,7 @@ void Platform::Spin()
 			}
 			temperatureShutdownDrivers &= ~mask;
 		}
+		UpdateDriverTemperatureEstimate(nextDriveToPoll, stat);
 
 		// Deal with the open load bits
 		// The driver often produces a transient open-load error, especially in stealthchop mode, so we require the condition to persist before we report it.
@@ -1213,8 +1395,8 @@ void Platform::Spin()
 				moveInstance->Diagnostics(reply.GetRef());
 				debugPrintf("%s\n", reply.c_str());
 				//moveInstance->DebugPrintCdda();
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
-				debugPrintf("LIS3DH detected: %s", AccelerometerHandler::IsPresent() ? "yes" : "no");
+#if SUPPORT_ACCELEROMETERS
+				debugPrintf("Accelerometer detected: %s", AccelerometerHandler::IsPresent() ? "yes" : "no");
 #endif
 			}
 		}
@@ -1222,6 +1404,20 @@ void Platform::Spin()
 	}
 }
 
+// Return true if the main task has nothing to do until a command arrives or its next periodic check is due, so that it can wait instead of polling
+bool Platform::IsIdle() noexcept
+{
+	return deferredCommand == DeferredCommand::none
+#if SUPPORT_DRIVERS
+		&& moveInstance->IsIdle() && !LocalHoming::IsActive()
+#endif
+#if SUPPORT_CAN_RECORDER
+		&& !CanInterface::IsReplaying()
+#endif
+		&& !MotionLoadGenerator::IsRunning()
+		;
+}
+
 void Platform::SpinMinimal()
 {
 	if (millis() - whenLastCanMessageProcessed > ActLedFlashTime)
@@ -1269,6 +1465,16 @@ ThermistorAveragingFilter *Platform::GetAdcFilter(unsigned int filterNumber)
 	return &thermistorFilters[filterNumber];
 }
 
+void Platform::SetThermistorCutoff(unsigned int filterNumber, uint32_t limitSum, bool tripWhenBelow, void (*fn)(CallbackParameter) noexcept, CallbackParameter cp) noexcept
+{
+	ThermistorCutoff& cutoff = thermistorCutoffs[filterNumber];
+	cutoff.function = nullptr;										// stop the ADC task using the old parameters while we change them
+	cutoff.param = cp;
+	cutoff.limitSum = limitSum;
+	cutoff.tripWhenBelow = tripWhenBelow;
+	cutoff.function = fn;
+}
+
 #endif
 
 #if HAS_VREF_MONITOR
@@ -1540,6 +1746,12 @@ void Platform::SetDirectionValue(size_t drive, bool dVal)
 {
 	if (drive < NumDrivers)
 	{
+#if SUPPORT_TMC51xx || SUPPORT_TMC2160
+		if (dVal != directions[drive])
+		{
+			SmartDrivers::DirectionChanged(drive);
+		}
+#endif
 		directions[drive] = dVal;
 	}
 }
@@ -1551,15 +1763,21 @@ bool Platform::GetDirectionValue(size_t driver)
 
 #if SINGLE_DRIVER
 
-void Platform::SetDirection(bool direction)
+// Return the level of the direction pin that makes the motor move in the requested direction
+bool Platform::GetDirectionPinLevel(bool direction)
 {
 # if DIFFERENTIAL_STEPPER_OUTPUTS || ACTIVE_HIGH_DIR
 	// Active high direction signal
-	const bool d = (direction) ? directions[0] : !directions[0];
+	return (direction) ? directions[0] : !directions[0];
 # else
 	// Active low direction signal
-	const bool d = (direction) ? !directions[0] : directions[0];
+	return (direction) ? !directions[0] : directions[0];
 # endif
+}
+
+void Platform::SetDirection(bool direction)
+{
+	const bool d = GetDirectionPinLevel(direction);
 
 # if SUPPORT_CLOSED_LOOP
 	ClosedLoop::SetStepDirection(d);
@@ -1826,13 +2044,121 @@ void Platform::SetMotorCurrent(size_t driver, float current)
 	UpdateMotorCurrent(driver);
 }
 
-// TMC driver temperatures
+// Configure the extruder current boost for a driver. The peak extrusion rate is in steps/sec.
+GCodeResult Platform::ConfigureCurrentBoost(size_t driver, uint32_t boostPercent, uint32_t minStepsPerSecond, const StringRef& reply)
+{
+	if (driver >= NumDrivers)
+	{
+		reply.printf("Driver number %u.%u out of range", CanInterface::GetCanAddress(), driver);
+		return GCodeResult::error;
+	}
+	if (boostPercent != 0)
+	{
+		if (boostPercent < 100 || boostPercent > 200)
+		{
+			reply.copy("Boost percentage must be between 100 and 200, or 0 for off");
+			return GCodeResult::error;
+		}
+		if (minStepsPerSecond == 0)
+		{
+			reply.copy("Minimum extrusion rate must be greater than zero");
+			return GCodeResult::error;
+		}
+		currentBoostMinStepsPerClock[driver] = (float)minStepsPerSecond/(float)StepTimer::StepClockRate;
+	}
+
+	currentBoostFactor[driver] = (boostPercent == 0) ? 1.0 : (float)boostPercent * 0.01;
+	if (currentBoostFactor[driver] <= 1.0)
+	{
+		reply.printf("Driver %u.%u current boost is off", CanInterface::GetCanAddress(), driver);
+	}
+	else
+	{
+		reply.printf("Driver %u.%u current boosted to %" PRIu32 "%% while accelerating to %" PRIu32 " steps/sec or faster",
+						CanInterface::GetCanAddress(), driver, boostPercent, (uint32_t)(currentBoostMinStepsPerClock[driver] * StepTimer::StepClockRate));
+	}
+	reply.catf(", %" PRIu32 " boosts, %" PRIu32 " windows dropped", numCurrentBoosts[driver], numCurrentBoostWindowsDropped[driver]);
+	numCurrentBoosts[driver] = numCurrentBoostWindowsDropped[driver] = 0;
+	return GCodeResult::ok;
+}
+
+// Queue a current boost for the acceleration phase of an extruder move if its peak extrusion rate is high enough.
+// Called by DriveMovement::PrepareExtruder, so the caller owns ddaAddMutex.
+void Platform::ScheduleCurrentBoost(size_t driver, float peakStepsPerClock, uint32_t accelStartTime, uint32_t accelClocks)
+{
+	if (currentBoostFactor[driver] > 1.0 && accelClocks != 0 && peakStepsPerClock >= currentBoostMinStepsPerClock[driver])
+	{
+		const uint8_t added = currentBoostWindowsAdded[driver];
+		if ((uint8_t)(added - currentBoostWindowsTaken[driver]) >= NumCurrentBoostWindows)
+		{
+			++numCurrentBoostWindowsDropped[driver];
+		}
+		else
+		{
+			CurrentBoostWindow& window = currentBoostWindows[driver][added % NumCurrentBoostWindows];
+			window.startTime = accelStartTime;
+			window.endTime = accelStartTime + accelClocks;
+			currentBoostWindowsAdded[driver] = added + 1;
+		}
+	}
+}
+
+// Update the temperature estimate for a driver after reading its status.
+// The otpw and ot flags tell us when the true temperature has passed two known points, so if the estimate disagrees with them then we correct both the estimate and the thermal gain.
+static void Platform::UpdateDriverTemperatureEstimate(size_t driver, StandardDriverStatus stat) noexcept
+{
+	const uint32_t now = millis();
+	const float dt = (float)(now - whenDriverTemperatureUpdated[driver]) * 0.001;
+	whenDriverTemperatureUpdated[driver] = now;
+
+	const float amps = SmartDrivers::GetActualCurrent(driver) * 0.001;
+	const float steadyStateRise = driverTemperatureRisePerAmpSquared[driver] * fsquare(amps);
+	float& rise = driverTemperatureRises[driver];
+	rise += (steadyStateRise - rise) * min<float>(dt * (1.0/DriverThermalTimeConstant), 1.0);
+
+	const float ambient = (mcuTemperature.maximum >= mcuTemperature.minimum) ? mcuTemperature.current : DefaultDriverAmbientTemperature;
+	float correctedRise = rise;
+	if (stat.ot)
+	{
+		correctedRise = max<float>(rise, DriverShutdownTemperature - ambient);
+	}
+	else if (stat.otpw)
+	{
+		correctedRise = constrain<float>(rise, DriverWarningTemperature - ambient, DriverShutdownTemperature - ambient);
+	}
+	else
+	{
+		correctedRise = min<float>(rise, DriverWarningTemperature - ambient);
+	}
+	correctedRise = max<float>(correctedRise, 0.0);
+
+	if (correctedRise != rise)
+	{
+		if (rise > 1.0)
+		{
+			driverTemperatureRisePerAmpSquared[driver] = constrain<float>(driverTemperatureRisePerAmpSquared[driver] * (correctedRise/rise),
+																			MinDriverTemperatureRisePerAmpSquared, MaxDriverTemperatureRisePerAmpSquared);
+		}
+		rise = correctedRise;
+	}
+}
+
+// Get the estimated temperature of one TMC driver
+float Platform::GetTmcDriverTemperature(size_t driver)
+{
+	const float ambient = (mcuTemperature.maximum >= mcuTemperature.minimum) ? mcuTemperature.current : DefaultDriverAmbientTemperature;
+	return (driver < MaxSmartDrivers) ? ambient + driverTemperatureRises[driver] : 0.0;
+}
+
+// TMC driver temperatures. Return the highest estimated temperature, so that a fan can be turned on before the drivers issue a temperature warning.
 float Platform::GetTmcDriversTemperature()
 {
-	const DriversBitmap mask = DriversBitmap::MakeLowestNBits(MaxSmartDrivers);
-	return (temperatureShutdownDrivers.Intersects(mask)) ? 150.0
-			: (temperatureWarningDrivers.Intersects(mask)) ? 100.0
-				: 0.0;
+	float highest = 0.0;
+	for (size_t driver = 0; driver < MaxSmartDrivers; ++driver)
+	{
+		highest = max<float>(highest, GetTmcDriverTemperature(driver));
+	}
+	return highest;
 }
 
 #  if HAS_STALL_DETECT
@@ -1913,7 +2239,22 @@ void Platform::SendDriversStatus(CanMessageBuffer& buf)
 	}
 # endif
 	buf.dataLength = msg->GetActualDataLength();
-	CanInterface::Send(&buf);
+	CanInterface::SendQueued(buf);
+}
+
+#endif
+
+#if HAS_VOLTAGE_MONITOR
+
+// Flag that the drivers are not powered and count the event. This is called by Spin and by the tick ISR, so it must not count the same event twice.
+static void Platform::RecordUnderVoltage() noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	if (driversPowered)
+	{
+		driversPowered = false;
+		numUnderVoltageEvents = numUnderVoltageEvents + 1;
+	}
 }
 
 #endif
@@ -1921,6 +2262,22 @@ void Platform::SendDriversStatus(CanMessageBuffer& buf)
 void Platform::Tick() noexcept
 {
 	++heatTaskIdleTicks;
+
+#if HAS_SMART_DRIVERS && HAS_VOLTAGE_MONITOR
+	// Check the supply voltages on every tick so that we can disable the drivers before they fault, instead of waiting for Spin to run.
+	// We compare the raw filter sums with precomputed thresholds to keep this fast.
+	if (   driversPowered
+		&& (   (vinFilter.IsValid() && vinFilter.GetSum() < vinUnderVoltageSum)
+# if HAS_12V_MONITOR
+			|| (v12Filter.IsValid() && v12Filter.GetSum() < v12UnderVoltageSum)
+# endif
+		   )
+	   )
+	{
+		SmartDrivers::TurnDriversOff();
+		RecordUnderVoltage();
+	}
+#endif
 }
 
 void Platform::StartFirmwareUpdate()
@@ -1970,6 +2327,110 @@ static uint32_t TimedSqrt(uint64_t arg, uint32_t& timeAcc) noexcept
 	return ret;
 }
 
+// Show the square root calculation time. Caution: may disable interrupt for several tens of microseconds.
+static GCodeResult RunSqrtBenchmark(const StringRef& reply) noexcept
+{
+	bool ok1 = true;
+	uint32_t tim1 = 0;
+	constexpr uint32_t iterations = 100;				// use a value that divides into one million
+	for (uint32_t i = 0; i < iterations; ++i)
+	{
+		const uint32_t num1 = 0x7fffffff - (67 * i);
+		const uint64_t sq = (uint64_t)num1 * num1;
+		const uint32_t num1a = TimedSqrt(sq, tim1);
+		if (num1a != num1)
+		{
+			ok1 = false;
+		}
+	}
+
+	bool ok2 = true;
+	uint32_t tim2 = 0;
+	for (uint32_t i = 0; i < iterations; ++i)
+	{
+		const uint32_t num2 = 0x0000ffff - (67 * i);
+		const uint64_t sq = (uint64_t)num2 * num2;
+		const uint32_t num2a = TimedSqrt(sq, tim2);
+		if (num2a != num2)
+		{
+			ok2 = false;
+		}
+	}
+
+	bool ok3 = true;
+	uint32_t tim3 = 0;
+	float val = 10000.0;
+	for (unsigned int i = 0; i < iterations; ++i)
+	{
+		IrqDisable();
+		asm volatile("":::"memory");
+		uint32_t now1 = SysTick->VAL;
+		const float nval = fastSqrtf(val);
+		uint32_t now2 = SysTick->VAL;
+		asm volatile("":::"memory");
+		IrqEnable();
+		now1 &= 0x00FFFFFF;
+		now2 &= 0x00FFFFFF;
+		tim3 += ((now1 > now2) ? now1 : now1 + (SysTick->LOAD & 0x00FFFFFF) + 1) - now2;
+		if (nval != sqrtf(val))
+		{
+			ok3 = false;
+		}
+		val = nval;
+	}
+	reply.printf("Square roots: 62-bit %.2fus %s, 32-bit %.2fus %s, float %.2fus %s",
+				(double)((float)(tim1 * (1'000'000/iterations))/SystemCoreClockFreq), (ok1) ? "ok" : "ERROR",
+					(double)((float)(tim2 * (1'000'000/iterations))/SystemCoreClockFreq), (ok2) ? "ok" : "ERROR",
+						(double)((float)(tim3 * (1'000'000/iterations))/SystemCoreClock), (ok3) ? "ok" : "ERROR");
+	return (ok1 && ok2 && ok3) ? GCodeResult::ok : GCodeResult::error;
+}
+
+// The benchmark suite, so that we can compare the timing of the critical code in different firmware releases on the same hardware
+typedef GCodeResult (*BenchmarkFunction)(const StringRef& reply) noexcept;
+
+static constexpr BenchmarkFunction Benchmarks[] =
+{
+	RunSqrtBenchmark,
+#if SUPPORT_DRIVERS
+	[](const StringRef& reply) noexcept { return moveInstance->RunBenchmark(reply); },
+#endif
+#if SUPPORT_CLOSED_LOOP
+	ClosedLoop::RunTrigonometryBenchmark,
+	ClosedLoop::ReportControlLoopTiming,
+#endif
+	TemperatureSensor::RunPT100Benchmark,
+	Heat::RunSensorPollBenchmark,
+};
+
+// Run benchmark number 'which' of the suite, or all of them if 'which' is zero
+static GCodeResult RunBenchmarkSuite(unsigned int which, const StringRef& reply) noexcept
+{
+	if (which > ARRAY_SIZE(Benchmarks))
+	{
+		reply.printf("Benchmark number must be 0 to %u", (unsigned int)ARRAY_SIZE(Benchmarks));
+		return GCodeResult::error;
+	}
+
+	if (which != 0)
+	{
+		return Benchmarks[which - 1](reply);
+	}
+
+	reply.printf(BOARD_TYPE_NAME " " VERSION " at %" PRIu32 "MHz", SystemCoreClock/1'000'000);
+	GCodeResult rslt = GCodeResult::ok;
+	String<StringLength256> result;
+	for (BenchmarkFunction fn : Benchmarks)
+	{
+		result.Clear();
+		if (fn(result.GetRef()) != GCodeResult::ok)
+		{
+			rslt = GCodeResult::warning;
+		}
+		reply.lcat(result.c_str());
+	}
+	return rslt;
+}
+
 GCodeResult Platform::DoDiagnosticTest(const CanMessageDiagnosticTest& msg, const StringRef& reply)
 {
 	if ((uint16_t)~msg.invertedTestType != msg.testType)
@@ -1981,61 +2442,7 @@ GCodeResult Platform::DoDiagnosticTest(const CanMessageDiagnosticTest& msg, cons
 	switch (msg.testType)
 	{
 	case 102:		// Show the square root calculation time. Caution: may disable interrupt for several tens of microseconds.
-		{
-			bool ok1 = true;
-			uint32_t tim1 = 0;
-			constexpr uint32_t iterations = 100;				// use a value that divides into one million
-			for (uint32_t i = 0; i < iterations; ++i)
-			{
-				const uint32_t num1 = 0x7fffffff - (67 * i);
-				const uint64_t sq = (uint64_t)num1 * num1;
-				const uint32_t num1a = TimedSqrt(sq, tim1);
-				if (num1a != num1)
-				{
-					ok1 = false;
-				}
-			}
-
-			bool ok2 = true;
-			uint32_t tim2 = 0;
-			for (uint32_t i = 0; i < iterations; ++i)
-			{
-				const uint32_t num2 = 0x0000ffff - (67 * i);
-				const uint64_t sq = (uint64_t)num2 * num2;
-				const uint32_t num2a = TimedSqrt(sq, tim2);
-				if (num2a != num2)
-				{
-					ok2 = false;
-				}
-			}
-
-			bool ok3 = true;
-			uint32_t tim3 = 0;
-			float val = 10000.0;
-			for (unsigned int i = 0; i < iterations; ++i)
-			{
-				IrqDisable();
-				asm volatile("":::"memory");
-				uint32_t now1 = SysTick->VAL;
-				const float nval = fastSqrtf(val);
-				uint32_t now2 = SysTick->VAL;
-				asm volatile("":::"memory");
-				IrqEnable();
-				now1 &= 0x00FFFFFF;
-				now2 &= 0x00FFFFFF;
-				tim3 += ((now1 > now2) ? now1 : now1 + (SysTick->LOAD & 0x00FFFFFF) + 1) - now2;
-				if (nval != sqrtf(val))
-				{
-					ok3 = false;
-				}
-				val = nval;
-			}
-			reply.printf("Square roots: 62-bit %.2fus %s, 32-bit %.2fus %s, float %.2fus %s",
-						(double)((float)(tim1 * (1'000'000/iterations))/SystemCoreClockFreq), (ok1) ? "ok" : "ERROR",
-							(double)((float)(tim2 * (1'000'000/iterations))/SystemCoreClockFreq), (ok2) ? "ok" : "ERROR",
-								(double)((float)(tim3 * (1'000'000/iterations))/SystemCoreClock), (ok3) ? "ok" : "ERROR");
-			return (ok1 && ok2 && ok3) ? GCodeResult::ok : GCodeResult::error;
-		}
+		return RunSqrtBenchmark(reply);
 
 	case 108:
 		{
@@ -2077,6 +2484,220 @@ GCodeResult Platform::DoDiagnosticTest(const CanMessageDiagnosticTest& msg, cons
 		}
 		return GCodeResult::ok;
 
+#if SUPPORT_DRIVERS
+	case 109:		// Time the move preparation and step calculation code. Run this only when the machine is idle.
+		return moveInstance->RunBenchmark(reply);
+
+	case 110:		// Increase the number of DDAs to the value of param16, or report the number and size of them if param16 is zero
+		return moveInstance->SetDdaRingLength(msg.param16, reply);
+
+	case 111:		// Trace driver positions every param16 step interrupts into a buffer of param32[0] records, or stop tracing if param16 is zero
+		return StepTrace::Configure(msg.param16, msg.param32[0], reply);
+
+	case 112:		// Report the step trace records starting at record number param32[0]
+		return StepTrace::Report(msg.param32[0], reply);
+#endif
+
+	case 113:		// Broadcast sensor temperatures only when they change by more than param16 tenths of a degree or param32[0] milliseconds have passed, or always if param16 is zero
+		return Heat::SetSensorReporting((float)msg.param16 * 0.1, msg.param32[0], reply);
+
+#if SUPPORT_CLOSED_LOOP
+	case 114:		// Run the closed loop control loop at a fixed rate of param16 Hz, or once per driver SPI transfer if param16 is zero
+		return SmartDrivers::SetControlLoopRate(msg.param16, reply);
+
+	case 115:		// Time the sine/cosine calculations used by closed loop control
+		return ClosedLoop::RunTrigonometryBenchmark(reply);
+
+	case 116:		// Select the closed loop velocity estimator param16 and report how long each estimator takes
+		return ClosedLoop::SetVelocityEstimator(msg.param16, reply);
+
+	case 117:		// Try to recover from closed loop stalls locally for up to param16 milliseconds accelerating at param32[0] full steps/sec^2 before reporting them, or report them at once if param16 is zero
+		return ClosedLoop::ConfigureStallRecovery(msg.param16, msg.param32[0], reply);
+#endif
+
+#if SUPPORT_TMC51xx || SUPPORT_TMC2160
+	case 118:		// Record the load of one move in every param16 moves for each driver and report the records we have, or stop recording if param16 is zero
+		return SmartDrivers::ConfigureLoadRecording(msg.param16, reply);
+#endif
+
+	case 119:		// Spin heater param16 every param32[0] milliseconds, or report its sample interval if param32[0] is zero
+		return Heat::SetHeaterSampleInterval(msg.param16, msg.param32[0], reply);
+
+	case 120:		// Control heater param16 using model predictive control with a horizon of param32[0] milliseconds, or its normal control mode if param32[0] is zero
+		return Heat::SetHeaterMpcHorizon(msg.param16, msg.param32[0], reply);
+
+	case 121:		// Stop heater tuning after at least param16 cycles once the last few agree within param32[0] tenths of a percent, or leave it to the main board if param16 is zero
+		return Heat::SetTuningConvergence(msg.param16, msg.param32[0], reply);
+
+	case 122:		// Set the resistance of heater param16 to param32[0] milliohms for power budgeting, or report it if param32[0] is zero
+		return Heat::SetHeaterResistance(msg.param16, msg.param32[0], reply);
+
+	case 123:		// Limit the total power of the heaters whose resistances are set to param32[0] watts, or remove the limit if param32[0] is zero
+		return Heat::SetHeaterPowerBudget(msg.param32[0], reply);
+
+	case 124:		// Time the PT100 resistance to temperature conversion
+		return TemperatureSensor::RunPT100Benchmark(reply);
+
+	case 125:		// Set the ADC averaging filter of sensor param16 to param32[0] readings, or report it if param32[0] is zero
+		return Heat::SetSensorFilterLength(msg.param16, msg.param32[0], reply);
+
+	case 126:		// Control the speed of fan param16 using its tacho so that full PWM corresponds to param32[0] RPM, or use open loop PWM if param32[0] is zero
+		return FansManager::SetFanFullSpeedRpm(msg.param16, msg.param32[0], reply);
+
+	case 127:		// Report fans only when their PWM changes, their speed changes by more than param16 RPM or param32[0] milliseconds have passed, or always if param16 is zero
+		return FansManager::SetFansReporting(msg.param16, msg.param32[0], reply);
+
+#if SUPPORT_DRIVERS
+	case 128:		// Compare the movement measured by the filament monitor on driver param16 with the commanded extrusion delayed by the estimated sensor lag if param32[0] is 1, or without delay if it is 0
+		return FilamentMonitor::SetTimeAlignedMode(msg.param16, msg.param32[0] != 0, reply);
+
+	case 129:		// Let the filament monitor on driver param16 apply pressure advance from its lag estimate up to param32[0] milliseconds, or only report it if param32[0] is zero
+		return FilamentMonitor::SetPressureAdvanceFeedback(msg.param16, (float)msg.param32[0] * 0.001, reply);
+
+	case 130:		// Send the filament monitor status every param32[0] milliseconds when it hasn't changed, or report the interval if param32[0] is zero
+		return FilamentMonitor::SetStatusInterval(msg.param32[0], reply);
+#endif
+
+#if SUPPORT_ACCELEROMETERS
+	case 131:		// Analyse the spectrum of accelerometer captures from param16 to param32[0] Hz, or report the last analysis and stop analysing if param32[0] is zero
+		return AccelerometerHandler::ConfigureAnalysis(msg.param16, msg.param32[0], reply);
+
+	case 132:		// Start accelerometer captures at the start of the first move due at or after master time param32[0] (or the next move if it is zero) if param16 is 1, or immediately if param16 is 0
+		return AccelerometerHandler::ConfigureMoveTrigger(msg.param16 != 0, msg.param32[0], reply);
+
+	case 133:		// Monitor vibration between accelerometer captures and raise an event if the RMS exceeds param16 or the peak exceeds param32[0] milli-g, or stop monitoring if both are zero
+		return AccelerometerHandler::ConfigureMonitoring(msg.param16, msg.param32[0], reply);
+#endif
+
+#if SUPPORT_DRIVERS
+	case 134:		// Make input monitor handle param16 stop the local drivers in bitmap param32[0] as soon as it triggers, or stop doing so if param32[0] is zero
+		return InputMonitor::SetLocalStop(msg.param16, msg.param32[0], reply);
+#endif
+
+	case 135:		// Set the hysteresis of analog input monitor handle param16 to param32[0] ADC counts
+		return InputMonitor::SetHysteresis(msg.param16, msg.param32[0], reply);
+
+	case 136:		// Report the compact machine-readable diagnostics, without clearing the counters that M122 reports
+		{
+			CompactDiagnostics diags(reply);
+			Tasks::AppendCompactDiagnostics(diags);
+#if SUPPORT_DRIVERS
+			moveInstance->AppendCompactDiagnostics(diags);
+#endif
+			CanInterface::AppendCompactDiagnostics(diags);
+			Heat::AppendCompactDiagnostics(diags);
+			Maintenance::AppendCompactDiagnostics(diags);
+		}
+		return GCodeResult::ok;
+
+	case 137:		// Report the worst-case stack use of each task and the stack size to configure with param16 words of margin, or a default margin if param16 is zero
+		return Tasks::ReportStackUsage(msg.param16, reply);
+
+	case 138:		// Run benchmark param16 of the benchmark suite, or all of them if param16 is zero. Run this only when the machine is idle.
+		return RunBenchmarkSuite(msg.param16, reply);
+
+#if SUPPORT_MICROSTEP_REDUCTION
+	case 139:		// Reduce the microstepping of drivers with interpolation enabled when their step rate exceeds param32[0] microsteps/sec, or never if param32[0] is zero
+		return moveInstance->ConfigureMicrostepReduction(msg.param32[0], reply);
+#endif
+
+#if SUPPORT_DRIVERS
+	case 140:		// Raise a warning event when printing and less than param32[0] milliseconds of motion is queued while moves are still arriving, or never if param32[0] is zero
+		return moveInstance->ConfigureLowQueueWarning(msg.param32[0], reply);
+
+	case 141:		// Set local firmware retraction of driver param16 to param32[0] microns at the speed in mm/min in the low 16 bits of param32[1], plus the extra unretract in microns in the high 16 bits
+		return moveInstance->ConfigureRetraction(msg.param16, msg.param32[0], msg.param32[1], reply);
+
+	case 142:		// Retract the drivers configured by test 141 if param16 is zero, else unretract them, when the queued moves have finished
+		return moveInstance->DoLocalRetraction(msg.param16 == 0, reply);
+
+	case 143:		// Set local homing to move the drivers in bitmap param16 at the fast and slow speeds in steps/sec in the low and high 16 bits of param32[0], backing off param32[1] steps
+		return LocalHoming::Configure(msg.param16, msg.param32[0], msg.param32[1], reply);
+
+	case 144:		// Start local homing towards input monitor handle param16, moving at most (int32_t)param32[0] steps in the direction of its sign
+		return LocalHoming::Start(msg.param16, (int32_t)msg.param32[0], reply);
+
+	case 145:		// Report the progress or result of local homing, aborting it first if param16 is nonzero
+		return LocalHoming::Report(msg.param16 != 0, reply);
+
+	case 146:		// Make stop requests and local endstop stops decelerate the move to rest if param16 is nonzero, else stop the drivers instantly
+		return moveInstance->ConfigureDeceleratingStops(msg.param16 != 0, reply);
+
+	case 147:		// Apply writes to GPIO port param16 at the next move boundary if param32[0] is nonzero, else as soon as they arrive
+		return GpioPorts::ConfigureMotionSync(msg.param16, msg.param32[0] != 0, reply);
+
+	case 148:		// Make the PWM of GPIO port param16 follow the speed of the executing move with full PWM at param32[1] steps/sec, updating it param32[0] times per second, or stop doing so if param32[0] is zero
+		return GpioPorts::ConfigureVelocityPwm(msg.param16, msg.param32[0], msg.param32[1], reply);
+#endif
+
+	case 149:		// Set the filtering of digital input monitor handle param16: param32[0] = 0 for none, 1 for the EIC glitch filter, 2 to debounce it (in hardware on the SAME5x)
+		return InputMonitor::SetFilter(msg.param16, msg.param32[0], reply);
+
+	case 150:		// Hold back input state changes for param32[0] milliseconds so that a burst of changes is sent in one message, or send them immediately if it is zero
+		return InputMonitor::SetAggregationWindow(msg.param32[0], reply);
+
+#if SUPPORT_CLOSED_LOOP
+	case 151:		// Use cascaded closed loop control with the position loop running every param16 control loops, gain param32[0]/1000 steps/sec per step of error and speed correction limit param32[1] steps/sec, or the single PID controller if param16 is zero
+		return ClosedLoop::ConfigurePositionLoop(msg.param16, msg.param32[0], msg.param32[1], reply);
+
+	case 152:		// Set the cascaded closed loop velocity loop gains P and I to param32[0]/1000 and param32[1]/1000, with integral limit param16 (default if zero)
+		return ClosedLoop::ConfigureVelocityLoop(msg.param16, msg.param32[0], msg.param32[1], reply);
+
+	case 153:		// Set the M569.5 A3 capture trigger to param16 (0 none, 1 error above param32[0]/1000 steps, 2 stall, 3 pre-stall, 4 completed move count param32[0]) keeping param32[1] samples from before it
+		return ClosedLoop::ConfigureCaptureTrigger(msg.param16, msg.param32[0], msg.param32[1], reply);
+#endif
+
+#if SUPPORT_TMC51xx || SUPPORT_TMC2160
+	case 154:		// Scale the current of driver param16 with the stallGuard load down to param32[0] percent (25 or 50, or 0 for off), raising it when SG_RESULT falls below param32[1] (default if zero)
+		return SmartDrivers::ConfigureAdaptiveCurrent(msg.param16, msg.param32[0], msg.param32[1], reply);
+#endif
+
+	case 155:		// Switch to CAN-FD data phase speed param32[0] kbps, reverting unless confirmed within param32[1] ms (default if zero), or report the bus error statistics if param32[0] is zero
+		return CanInterface::TrialTiming(msg.param32[0], msg.param32[1], reply);
+
+	case 156:		// Keep the trial CAN data phase speed until reset (it can't be saved, so param16 nonzero gives a warning)
+		return CanInterface::ConfirmTrialTiming(msg.param16 != 0, reply);
+
+	case 157:		// Put heater param16 in zone group param32[0] with coupling param32[1]/1000 degC/sec per degC, or control it independently if param32[0] is zero
+		return Heat::SetHeaterZone(msg.param16, msg.param32[0], msg.param32[1], reply);
+
+	case 158:		// Add a calibration point mapping param32[0] ppm of ADC full scale to (int32_t)param32[1] millidegrees to sensor param16, or clear its table if param32[0] is 0xFFFFFFFF
+		return Heat::SetSensorCalibrationPoint(msg.param16, msg.param32[0], (int32_t)msg.param32[1], reply);
+
+#if SUPPORT_DRIVERS
+	case 159:		// Make the filament monitor on driver param16 discard measurements below image quality param32[0] and give full weight from param32[1], or weight them all equally if param32[1] is zero (the default)
+		return FilamentMonitor::SetMeasurementQualityWeighting(msg.param16, msg.param32[0], msg.param32[1], reply);
+#endif
+
+#if SUPPORT_DRIVERS && HAS_SMART_DRIVERS
+	case 160:		// Boost the current of extruder driver param16 to param32[0] percent (0 for off) while accelerating moves that reach param32[1] steps/sec
+		return ConfigureCurrentBoost(msg.param16, msg.param32[0], msg.param32[1], reply);
+#endif
+
+#if SUPPORT_CAN_RECORDER
+	case 161:		// Record received moves if param16 is 1, replay the recording at its original timing if param16 is 2, or stop and report the recording and the last replay results if param16 is 0
+		return CanInterface::ConfigureRecorder(msg.param16, reply);
+#endif
+
+	case 162:		// Send param16 ms movement segments of param32[1] steps to the boards in bitmap param32[0] posing as the ATE master, or stop and report if param16 is zero
+		return MotionLoadGenerator::Configure(msg.param16, msg.param32[0], (int32_t)msg.param32[1], reply);
+
+#if SUPPORT_DRIVERS
+	case 163:		// Report the 64-bit net and travelled step totals of each driver and the distances they correspond to
+		return moveInstance->ReportStepTotals(reply);
+#endif
+
+	case 164:		// Report the maintenance counters, saving them first if param16 is 1, or forgetting the full speed RPM of the fans in bitmap param32[0] and saving if param16 is 2
+		return Maintenance::Command(msg.param16, msg.param32[0], reply);
+
+#if SUPPORT_DRIVERS
+	case 165:		// Merge queued moves that continue each other if doing so moves no driver more than param32[0] hundredths of a step from its path, or stop merging if param32[0] is zero
+		return moveInstance->ConfigureMoveMerging(msg.param32[0], reply);
+
+	case 166:		// Check that reading the total extrusion of driver param16 without disabling interrupts never returns a torn value, reading it repeatedly for param32[0] milliseconds
+		return moveInstance->TestTotalExtrusionReads(msg.param16, msg.param32[0], reply);
+#endif
+
 #if SAME5x
 	case 500:												// report write buffer
 		reply.printf("Write buffer is %s", (SCnSCB->ACTLR & SCnSCB_ACTLR_DISDEFWBUF_Msk) ? "disabled" : "enabled");
@@ -2161,6 +2782,11 @@ float Platform::GetCurrentVinVoltage() noexcept
 	return AdcReadingToVinVoltage(currentVin);
 }
 
+uint32_t Platform::GetNumUnderVoltageEvents() noexcept
+{
+	return numUnderVoltageEvents;
+}
+
 #endif
 
 #if HAS_12V_MONITOR
@@ -2219,6 +2845,13 @@ void Platform::AppendDiagnostics(const StringRef& reply) noexcept
 		reply.lcat("All averaging filters OK");
 	}
 #endif
+
+	reply.lcat("Startup stages done at (ms):");
+	for (unsigned int i = 0; i < (unsigned int)StartupStage::numStages; ++i)
+	{
+		reply.catf(" %s %" PRIu32, StartupStageNames[i], whenStartupStageDone[i]);
+	}
+	FlashCrc::Diagnostics(reply);
 }
 
 #ifdef TOOL1LC
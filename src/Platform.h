@@ -85,6 +85,16 @@ enum class ErrorCode : uint32_t
 
 class IoPort;
 
+// Stages of startup. The board announces itself as soon as CAN is running, then initialises the rest while the main board is discovering it.
+enum class StartupStage : uint8_t
+{
+	can = 0,				// CAN running and first announcement sent
+	heaters,				// heater task running
+	movement,				// move task running
+	peripherals,			// deferred peripherals such as the accelerometer probed
+	numStages
+};
+
 namespace Platform
 {
 #if SUPPORT_DRIVERS
@@ -92,8 +102,39 @@ namespace Platform
 # if SINGLE_DRIVER
 	constexpr uint32_t DriverBit = 1u << (StepPins[0] & 31);
 # else
-	extern uint32_t driveDriverBits[NumDrivers];
-	extern uint32_t allDriverBits;
+	// The step port bits are derived from StepPins at compile time, so the step ISR reads them from flash constants instead of RAM tables
+	// and the compiler can fold them for the number of drivers on this board. Because the number of drivers is small we also tabulate
+	// the port bits for every combination of drivers, so that the ISR can convert a bitmap of drivers to port bits with a single lookup.
+	static_assert(NumDrivers <= 4, "Too many drivers for the step bits table");
+
+	struct StepBitTables
+	{
+		constexpr StepBitTables() noexcept : driverBits{}, bitsForDrivers{}, allDriverBits(0)
+		{
+			for (size_t i = 0; i < NumDrivers; ++i)
+			{
+				driverBits[i] = 1u << (StepPins[i] & 31);
+				allDriverBits |= driverBits[i];
+			}
+			for (size_t drivers = 0; drivers < (1u << NumDrivers); ++drivers)
+			{
+				for (size_t i = 0; i < NumDrivers; ++i)
+				{
+					if (drivers & (1u << i))
+					{
+						bitsForDrivers[drivers] |= driverBits[i];
+					}
+				}
+			}
+		}
+
+		uint32_t driverBits[NumDrivers];
+		uint32_t bitsForDrivers[1u << NumDrivers];
+		uint32_t allDriverBits;
+	};
+
+	constexpr StepBitTables stepBitTables;
+	constexpr uint32_t allDriverBits = stepBitTables.allDriverBits;
 # endif
 
 # if SUPPORT_SLOW_DRIVERS
@@ -143,9 +184,12 @@ namespace Platform
 	extern bool isPrinting;
 
 	void Init();
+	void InitDeferred();
 	void InitMinimal();
+	void SetStartupStageDone(StartupStage stage) noexcept;
 	void Spin();
 	void SpinMinimal();
+	bool IsIdle() noexcept;
 
 	inline bool IsPrinting() { return isPrinting; }
 	inline void SetPrinting(bool b) { isPrinting = b; }
@@ -202,12 +246,14 @@ namespace Platform
 #  endif
 	}
 
-	inline uint32_t GetDriversBitmap(size_t driver) { return driveDriverBits[driver]; } 		// Get the step bit for this driver
+	inline constexpr uint32_t GetDriversBitmap(size_t driver) { return stepBitTables.driverBits[driver]; } 		// Get the step bit for this driver
+	inline constexpr uint32_t GetDriversBitmapFor(uint32_t drivers) { return stepBitTables.bitsForDrivers[drivers]; }	// Get the step bits for a bitmap of drivers
 # endif
 
 	inline unsigned int GetProhibitedExtruderMovements(unsigned int extrusions, unsigned int retractions) { return 0; }
 # if SINGLE_DRIVER
 	void SetDirection(bool direction);
+	bool GetDirectionPinLevel(bool direction);
 # else
 	void SetDirection(size_t driver, bool direction);
 # endif
@@ -227,6 +273,9 @@ namespace Platform
 
 # if HAS_SMART_DRIVERS
 	void SetMotorCurrent(size_t driver, float current);		//TODO avoid the int->float->int conversion
+	GCodeResult ConfigureCurrentBoost(size_t driver, uint32_t boostPercent, uint32_t minStepsPerSecond, const StringRef& reply);
+	void ScheduleCurrentBoost(size_t driver, float peakStepsPerClock, uint32_t accelStartTime, uint32_t accelClocks);
+	float GetTmcDriverTemperature(size_t driver);
 	float GetTmcDriversTemperature();
 #  if HAS_STALL_DETECT
 	void SetOrResetEventOnStall(DriversBitmap drivers, bool enable) noexcept;
@@ -247,6 +296,9 @@ namespace Platform
 	int GetAveragingFilterIndex(const IoPort&);
 	ThermistorAveragingFilter *GetAdcFilter(unsigned int filterNumber);
 
+	// Call a function from the ADC task once if the sum of an ADC filter goes beyond a limit, or stop checking it if the function is null
+	void SetThermistorCutoff(unsigned int filterNumber, uint32_t limitSum, bool tripWhenBelow, void (*fn)(CallbackParameter) noexcept, CallbackParameter cp) noexcept;
+
 # if HAS_VREF_MONITOR
 	ThermistorAveragingFilter *GetVssaFilter(unsigned int filterNumber);
 	ThermistorAveragingFilter *GetVrefFilter(unsigned int filterNumber);
@@ -287,6 +339,7 @@ namespace Platform
 #if HAS_VOLTAGE_MONITOR
 	MinCurMax GetPowerVoltages(bool resetMinMax) noexcept;
 	float GetCurrentVinVoltage() noexcept;
+	uint32_t GetNumUnderVoltageEvents() noexcept;
 #endif
 
 #if HAS_12V_MONITOR
@@ -46,6 +46,15 @@ extern "C" void debugPrintf(const char* fmt, ...) __attribute__ ((format (printf
 
 #define SPEED_CRITICAL	__attribute__((optimize("O2")))
 
+// ISR_CRITICAL is for the functions that the step ISR executes on every step. They are optimised for speed like SPEED_CRITICAL functions,
+// and also placed in RAM if ISR_CODE_IN_RAM is set, so that they don't suffer flash wait states or stall while the flash is being written.
+// The startup code copies the .ramfunc section to RAM along with initialised data.
+#if ISR_CODE_IN_RAM
+# define ISR_CRITICAL	__attribute__((optimize("O2"), section(".ramfunc")))
+#else
+# define ISR_CRITICAL	SPEED_CRITICAL
+#endif
+
 // Classes to facilitate range-based for loops that iterate from 0 up to just below a limit
 template<class T> class SimpleRangeIterator
 {
@@ -19,7 +19,9 @@ namespace TaskPriority
 	constexpr unsigned int MovePriority = 3;
 	constexpr unsigned int Accelerometer = 3;
 	constexpr unsigned int ClosedLoopDataTransmission = 3;
+	constexpr unsigned int CanMotionReceiverPriority = 4;			// higher than CanReceiverPriority so that motion messages are not delayed by slow commands
 	constexpr unsigned int TmcClosedLoop = 4;						// priority of the TMC task when in closed loop mode
+	constexpr unsigned int CanSenderPriority = 4;					// higher than the tasks that queue messages for it, so that it empties the queue promptly
 	constexpr unsigned int CanAsyncSenderPriority = 5;
 	constexpr unsigned int CanClockPriority = 5;
 
@@ -0,0 +1,96 @@
+/*
+ * TaskStackSizes.h
+ *
+ *  Task stack sizes in dwords. A board configuration file may define any of the XXX_TASK_STACK_WORDS macros to override the default,
+ *  for example to shrink the stacks after checking the worst-case stack use reported by diagnostic test 137, so that the RAM can be used for something else.
+ */
+
+#ifndef SRC_TASKSTACKSIZES_H_
+#define SRC_TASKSTACKSIZES_H_
+
+#include <RepRapFirmware.h>
+
+#ifndef MAIN_TASK_STACK_WORDS
+# define MAIN_TASK_STACK_WORDS				850		// this seems very large; but a user had a stack overflow when it was set to 800
+#endif
+
+#ifndef IDLE_TASK_STACK_WORDS
+# define IDLE_TASK_STACK_WORDS				50		// currently we don't use the idle talk for anything, so this can be quite small
+#endif
+
+#ifndef TIMER_TASK_STACK_WORDS
+# define TIMER_TASK_STACK_WORDS				60
+#endif
+
+// The heater task stack size must be large enough for calls to debugPrintf when a heater fault occurs.
+// Currently (2020-12-03) it needs at least 144 words when handling a heater fault, if debugPrintf calls vuprintf but the underlying putchar function throws the character away.
+// We now avoid calling vuprintf from debugPrintf unless this is a debug build
+#ifndef HEATER_TASK_STACK_WORDS
+# ifdef DEBUG
+#  define HEATER_TASK_STACK_WORDS			230
+# else
+#  define HEATER_TASK_STACK_WORDS			200
+# endif
+#endif
+
+#ifndef MOVE_TASK_STACK_WORDS
+# define MOVE_TASK_STACK_WORDS				200
+#endif
+
+#ifndef TMC_TASK_STACK_WORDS
+# if (SUPPORT_TMC51xx || SUPPORT_TMC2160) && SUPPORT_CLOSED_LOOP
+#  define TMC_TASK_STACK_WORDS				430		// we need extra stack to handle closed loop tuning and writing to NVM
+# elif SUPPORT_TMC51xx || SUPPORT_TMC2160
+#  define TMC_TASK_STACK_WORDS				140		// with 100 stack words, deckingman's M122 on the main board after a major axis shift showed just 10 words left
+# else
+#  define TMC_TASK_STACK_WORDS				100		// 100 is sufficient for the TMC22xx unless we use debugPrintf in the code executed by the TMC task
+# endif
+#endif
+
+#ifndef ACCELEROMETER_TASK_STACK_WORDS
+# define ACCELEROMETER_TASK_STACK_WORDS		180		// vibration monitoring sends events from this task, which needs a CAN buffer and formatting
+#endif
+
+#ifndef ANALOG_IN_TASK_STACK_WORDS
+# if SAME5x
+#  define ANALOG_IN_TASK_STACK_WORDS		300
+# else
+#  define ANALOG_IN_TASK_STACK_WORDS		200		// was 120 but we got a stack overflow
+# endif
+#endif
+
+#ifndef CAN_CLOCK_TASK_STACK_WORDS
+# define CAN_CLOCK_TASK_STACK_WORDS			130
+#endif
+
+#ifndef CAN_RECEIVER_TASK_STACK_WORDS
+# define CAN_RECEIVER_TASK_STACK_WORDS		200		// same as the move task because both can plan and prepare a move, which needs a MovePlan on the stack; also used by the CanMotion task
+#endif
+
+#ifndef CAN_ASYNC_SENDER_TASK_STACK_WORDS
+# define CAN_ASYNC_SENDER_TASK_STACK_WORDS	100
+#endif
+
+#ifndef CAN_SENDER_TASK_STACK_WORDS
+# define CAN_SENDER_TASK_STACK_WORDS		100
+#endif
+
+#ifndef CLOSED_LOOP_TASK_STACK_WORDS
+# define CLOSED_LOOP_TASK_STACK_WORDS		200
+#endif
+
+constexpr size_t MainTaskStackWords = MAIN_TASK_STACK_WORDS;
+constexpr size_t IdleTaskStackWords = IDLE_TASK_STACK_WORDS;
+constexpr size_t TimerTaskStackWords = TIMER_TASK_STACK_WORDS;
+constexpr size_t HeaterTaskStackWords = HEATER_TASK_STACK_WORDS;
+constexpr size_t MoveTaskStackWords = MOVE_TASK_STACK_WORDS;
+constexpr size_t TmcTaskStackWords = TMC_TASK_STACK_WORDS;
+constexpr size_t AccelerometerTaskStackWords = ACCELEROMETER_TASK_STACK_WORDS;
+constexpr size_t AnalogInTaskStackWords = ANALOG_IN_TASK_STACK_WORDS;
+constexpr size_t CanClockTaskStackWords = CAN_CLOCK_TASK_STACK_WORDS;
+constexpr size_t CanReceiverTaskStackWords = CAN_RECEIVER_TASK_STACK_WORDS;
+constexpr size_t CanAsyncSenderTaskStackWords = CAN_ASYNC_SENDER_TASK_STACK_WORDS;
+constexpr size_t CanSenderTaskStackWords = CAN_SENDER_TASK_STACK_WORDS;
+constexpr size_t ClosedLoopTaskStackWords = CLOSED_LOOP_TASK_STACK_WORDS;
+
+#endif /* SRC_TASKSTACKSIZES_H_ */
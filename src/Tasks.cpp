@@ -8,6 +8,7 @@
 #include "Tasks.h"
 #include <Platform.h>
 #include <TaskPriorities.h>
+#include <TaskStackSizes.h>
 #include <Movement/Move.h>
 #include <Heating/Heat.h>
 #include <InputMonitors/InputMonitor.h>
@@ -15,10 +16,13 @@
 #include <FilamentMonitors/FilamentMonitor.h>
 #include <Hardware/Devices.h>
 #include <Hardware/NonVolatileMemory.h>
+#include <Hardware/FlashCrc.h>
+#include <Hardware/IsrTrace.h>
 #include <CanMessageBuffer.h>
 #include <CanMessageFormats.h>
 #include <Duet3Common.h>
 #include <CAN/CanInterface.h>
+#include <CommandProcessing/CompactDiagnostics.h>
 #include <Cache.h>
 #include <Flash.h>
 
@@ -48,17 +52,51 @@ constexpr uint32_t FlashBlockSize = 0x00004000;					// the erase size we assume
 #include <syscalls.h>
 
 constexpr uint32_t BlockReceiveTimeout = 2000;					// bootloader block receive timeout milliseconds
+constexpr uint32_t BootloaderChunkSize = 2048;					// the size of each separately-requested part of the bootloader
+constexpr size_t NumBootloaderChunks = FlashBlockSize/BootloaderChunkSize;
+constexpr size_t MaxOutstandingChunkRequests = 4;				// how many chunk requests we keep outstanding at once
+static_assert(FlashBlockSize % BootloaderChunkSize == 0);
+constexpr uint32_t BroadcastListenTime = 200;					// how long we listen for a broadcast bootloader stream before requesting chunks ourselves
+constexpr uint32_t BroadcastListenStagger = 10;					// extra listening time per unit of CAN address, so that boards updating together don't all request at once
 
 constexpr uint8_t memPattern = 0xA5;
+constexpr ptrdiff_t MinNeverUsedRamAfterAllocation = 2048;		// how much never-used RAM we must leave when allocating a buffer on demand, for the stacks and later small allocations
 
-constexpr unsigned int MainTaskStackWords = 850;				// this seems very large; but a user had a stack overflow when it was set to 800
+constexpr uint32_t MainTaskIdleWaitMillis = 10;					// how long the main task waits for a command when there is nothing else to do
 
 static Task<MainTaskStackWords> mainTask;
 static Mutex mallocMutex;
 static unsigned int heatTaskIdleTicks = 0;
 
+#if configUSE_TICKLESS_IDLE
+static uint32_t numTicklessSleeps = 0;							// how many times we slept for at least one tick with the tick interrupt stopped
+static uint32_t numTicksSuppressed = 0;							// how many tick interrupts we skipped by doing so
+#endif
+
+// Rolling CPU usage, sampled once a second by the main task. Usage is held in units of 0.5% to save RAM.
+// We keep the last 10 one-second samples and the last 6 ten-second averages, so that we can report the usage over the last 1, 10 and 60 seconds.
+constexpr uint32_t CpuSampleIntervalMillis = 1000;
+constexpr size_t MaxCpuTrackedTasks = 16;
+constexpr size_t NumCpuShortSamples = 10;
+constexpr size_t NumCpuLongSamples = 6;
+
+struct CpuUsageRecord
+{
+	const TaskBase *task;									// the task, or nullptr for the step ISR
+	uint8_t shortSamples[NumCpuShortSamples];
+	uint8_t longSamples[NumCpuLongSamples];
+
+	void Add(uint8_t sample, size_t shortIndex, size_t longIndex) noexcept;
+	unsigned int GetPermille(size_t numShort, size_t numLong, unsigned int window) const noexcept;
+};
+
+static CpuUsageRecord cpuUsage[MaxCpuTrackedTasks + 1];		// the last one is for the step ISR
+static size_t numCpuTrackedTasks = 0;
+static size_t cpuShortIndex = 0, cpuLongIndex = 0;			// where the next samples go
+static size_t numCpuShortSamples = 0, numCpuLongSamples = 0;	// how many valid samples we have
+static uint32_t whenCpuLastSampled = 0;
+
 // Idle task data
-constexpr unsigned int IdleTaskStackWords = 50;					// currently we don't use the idle talk for anything, so this can be quite small
 static Task<IdleTaskStackWords> idleTask;
 
 extern "C" void vApplicationGetIdleTaskMemory(StaticTask_t **ppxIdleTaskTCBBuffer, StackType_t **ppxIdleTaskStackBuffer, uint32_t *pulIdleTaskStackSize) noexcept
@@ -71,7 +109,6 @@ extern "C" void vApplicationGetIdleTaskMemory(StaticTask_t **ppxIdleTaskTCBBuffe
 #if configUSE_TIMERS
 
 // Timer task data
-constexpr unsigned int TimerTaskStackWords = 60;
 static Task<TimerTaskStackWords> timerTask;
 
 extern "C" void vApplicationGetTimerTaskMemory(StaticTask_t **ppxTimerTaskTCBBuffer, StackType_t **ppxTimerTaskStackBuffer, uint32_t *pulTimerTaskStackSize) noexcept
@@ -197,6 +234,11 @@ void *Tasks::GetNVMBuffer(const uint32_t *_ecv_array null stk) noexcept
 
 #if USE_CACHE
 	Cache::Init();
+# if SAME5x
+	// The step ISR code runs from RAM if ISR_CODE_IN_RAM is set, so the CMCC only has to serve the rest of the code and the constant tables in flash.
+	// Use all 4K of it and keep the data cache enabled, because the heater and closed loop lookup tables are in flash.
+	CMCC->CFG.reg = CMCC_CFG_CSIZESW_CONF_CSIZE_4KB;
+# endif
 	Cache::Enable();
 #endif
 
@@ -228,20 +270,25 @@ extern "C" [[noreturn]] void MainTask(void *pvParameters) noexcept
 {
 	Platform::Init();
 	Heat::Init();
+	Platform::SetStartupStageDone(StartupStage::heaters);
 	InputMonitor::Init();
 
 #if SUPPORT_DRIVERS
 	moveInstance = new Move();
 	moveInstance->Init();
 #endif
+	Platform::SetStartupStageDone(StartupStage::movement);
+
+	Platform::InitDeferred();
 
 	for (;;)
 	{
 		Platform::Spin();
-		CommandProcessor::Spin();
+		CommandProcessor::Spin((Platform::IsIdle()) ? MainTaskIdleWaitMillis : 0);
 #if SUPPORT_DRIVERS
 		FilamentMonitor::Spin();
 #endif
+		Tasks::SampleCpuUsage();
 	}
 }
 
@@ -263,27 +310,55 @@ static FirmwareFlashErrorCode RequestBootloaderBlock(uint32_t fileOffset, uint32
 }
 
 // Get a buffer of data from the host, returning true if successful
+// The bootloader is requested as a sequence of chunks with a sliding window of several requests outstanding, so that the host can be reading the next chunk
+// from its file while we are still receiving the previous one. If a request times out then we ask again for whatever is missing from the chunks we are waiting for.
+// We don't write any of it to flash until the whole bootloader has been received and its CRC checked, because a partly-written bootloader would brick the board.
+// When several boards of the same type update together the main board may broadcast the data instead of sending it to each board in turn, so we accept broadcast
+// responses as well as ones addressed to us, and we don't request chunks that have already been delivered that way. Data from a different file is caught by the CRC check.
 static FirmwareFlashErrorCode GetBootloaderBlock(uint8_t *blockBuffer)
 {
+	uint16_t chunkBytesReceived[NumBootloaderChunks];				// how many contiguous bytes we have received from the start of each chunk
+	memset(chunkBytesReceived, 0, sizeof(chunkBytesReceived));
+	size_t numChunksNeeded = NumBootloaderChunks;					// reduced when we learn the file length
+	size_t nextChunkToRequest = 0;
+	size_t firstIncompleteChunk = 0;
+
 	CanMessageBuffer buf(nullptr);
-	const FirmwareFlashErrorCode err = RequestBootloaderBlock(0, FlashBlockSize, buf);	// ask for 16K or 64K as a single block
-	if (err != FirmwareFlashErrorCode::ok)
+	const uint32_t whenStarted = millis();
+	const uint32_t listenTime = BroadcastListenTime + BroadcastListenStagger * CanInterface::GetCanAddress();
+	uint32_t whenStartedWaiting = whenStarted;
+	bool receivedAnything = false;
+	for (;;)
 	{
-		return err;
-	}
+		// Keep the window of outstanding requests full, skipping any chunks that have already been delivered by broadcast
+		while (   nextChunkToRequest < numChunksNeeded
+			   && nextChunkToRequest < firstIncompleteChunk + MaxOutstandingChunkRequests
+			   && (receivedAnything || millis() - whenStarted >= listenTime)
+			  )
+		{
+			if (chunkBytesReceived[nextChunkToRequest] == 0)
+			{
+				const FirmwareFlashErrorCode err = RequestBootloaderBlock(nextChunkToRequest * BootloaderChunkSize, BootloaderChunkSize, buf);
+				if (err != FirmwareFlashErrorCode::ok)
+				{
+					return err;
+				}
+			}
+			++nextChunkToRequest;
+		}
 
-	uint32_t whenStartedWaiting = millis();
-	uint32_t bytesReceived = 0;
-	bool done = false;
-	do
-	{
 		Platform::SpinMinimal();									// check if it's time to turn the LED off
-		const bool ok = CanInterface::GetCanMessage(&buf);
-		if (ok)
+		if (CanInterface::GetCanMessage(&buf))
 		{
-			if (buf.id.MsgType() == CanMessageType::firmwareBlockResponse)
+			if (   buf.id.MsgType() == CanMessageType::firmwareBlockResponse
+				&& (buf.id.Dst() == CanInterface::GetCanAddress() || buf.id.Dst() == CanId::BroadcastAddress)
+			   )
 			{
 				const CanMessageFirmwareUpdateResponse& response = buf.msg.firmwareUpdateResponse;
+				if (response.err != CanMessageFirmwareUpdateResponse::ErrNone && buf.id.Dst() != CanInterface::GetCanAddress())
+				{
+					continue;												// an error reply to a request from another board
+				}
 				switch (response.err)
 				{
 				case CanMessageFirmwareUpdateResponse::ErrNoFile:
@@ -296,38 +371,68 @@ static FirmwareFlashErrorCode GetBootloaderBlock(uint8_t *blockBuffer)
 					return FirmwareFlashErrorCode::hostOther;
 
 				case CanMessageFirmwareUpdateResponse::ErrNone:
-					if (response.fileOffset <= bytesReceived)
+					if (response.fileOffset < FlashBlockSize)
 					{
-						const uint32_t bufferOffset = response.fileOffset;
-						const uint32_t bytesToCopy = min<uint32_t>(FlashBlockSize - bufferOffset, response.dataLength);
-						memcpy(blockBuffer + bufferOffset, response.data, bytesToCopy);
-						if (response.fileOffset + bytesToCopy > bytesReceived)
+						const size_t chunk = response.fileOffset/BootloaderChunkSize;
+						const uint32_t chunkStart = chunk * BootloaderChunkSize;
+						if (response.fileOffset <= chunkStart + chunkBytesReceived[chunk])
 						{
-							bytesReceived = response.fileOffset + bytesToCopy;
+							const uint32_t bytesToCopy = min<uint32_t>(chunkStart + BootloaderChunkSize - response.fileOffset, response.dataLength);
+							memcpy(blockBuffer + response.fileOffset, response.data, bytesToCopy);
+							const uint32_t newChunkBytes = response.fileOffset + bytesToCopy - chunkStart;
+							if (newChunkBytes > chunkBytesReceived[chunk])
+							{
+								chunkBytesReceived[chunk] = (uint16_t)newChunkBytes;
+							}
 						}
-						if (bytesReceived == FlashBlockSize || bytesReceived >= response.fileLength)
+
+						// Once we know the file length we can tell which chunk is the last one, and pad the buffer beyond the end of the file
+						if (response.fileLength < FlashBlockSize)
 						{
-							// Reached the end of the file
-							memset(blockBuffer + bytesReceived, 0xFF, FlashBlockSize - bytesReceived);
-							done = true;
+							const size_t chunksInFile = (response.fileLength + BootloaderChunkSize - 1)/BootloaderChunkSize;
+							if (chunksInFile < numChunksNeeded)
+							{
+								numChunksNeeded = chunksInFile;
+								memset(blockBuffer + response.fileLength, 0xFF, FlashBlockSize - response.fileLength);
+							}
+							if (chunksInFile != 0 && chunksInFile - 1 == chunk && response.fileOffset + response.dataLength >= response.fileLength)
+							{
+								chunkBytesReceived[chunk] = BootloaderChunkSize;	// the last chunk is complete because the rest of it is padding
+							}
+						}
+
+						while (firstIncompleteChunk < numChunksNeeded && chunkBytesReceived[firstIncompleteChunk] == BootloaderChunkSize)
+						{
+							++firstIncompleteChunk;
+						}
+						if (firstIncompleteChunk == numChunksNeeded)
+						{
+							return FirmwareFlashErrorCode::ok;
 						}
 					}
+					receivedAnything = true;
 					whenStartedWaiting = millis();
 				}
 			}
 		}
-		else if (millis() - whenStartedWaiting > BlockReceiveTimeout)
+		else if (millis() - whenStartedWaiting > BlockReceiveTimeout + listenTime)
 		{
-			if (bytesReceived == 0)
+			if (!receivedAnything)
 			{
 				return FirmwareFlashErrorCode::blockReceiveTimeout;
 			}
-			RequestBootloaderBlock(bytesReceived, FlashBlockSize - bytesReceived, buf);			// ask for a block from the starting offset
+
+			// Ask again for whatever is missing from the chunks we have requested
+			for (size_t chunk = firstIncompleteChunk; chunk < nextChunkToRequest; ++chunk)
+			{
+				if (chunkBytesReceived[chunk] < BootloaderChunkSize)
+				{
+					RequestBootloaderBlock(chunk * BootloaderChunkSize + chunkBytesReceived[chunk], BootloaderChunkSize - chunkBytesReceived[chunk], buf);
+				}
+			}
 			whenStartedWaiting = millis();
 		}
-	} while (!done);
-
-	return FirmwareFlashErrorCode::ok;
+	}
 }
 
 static void ReportFlashError(FirmwareFlashErrorCode err)
@@ -343,44 +448,10 @@ static void ReportFlashError(FirmwareFlashErrorCode err)
 	delay(1000);
 }
 
-// Compute the CRC32 of a dword-aligned block of memory
-// This assumes the caller has exclusive use of the DMAC
-uint32_t ComputeCRC32(const uint32_t *start, const uint32_t *end)
-{
-#if SAME5x
-	DMAC->CRCCTRL.reg = DMAC_CRCCTRL_CRCBEATSIZE_WORD | DMAC_CRCCTRL_CRCSRC_DISABLE | DMAC_CRCCTRL_CRCPOLY_CRC32;	// disable the CRC unit
-#elif SAMC21
-	DMAC->CTRL.bit.CRCENABLE = 0;
-#else
-# error Unsupported processor
-#endif
-	DMAC->CRCCHKSUM.reg = 0xFFFFFFFF;
-	DMAC->CRCCTRL.reg = DMAC_CRCCTRL_CRCBEATSIZE_WORD | DMAC_CRCCTRL_CRCSRC_IO | DMAC_CRCCTRL_CRCPOLY_CRC32;
-#if SAMC21
-	DMAC->CTRL.bit.CRCENABLE = 1;
-#endif
-	while (start < end)
-	{
-		DMAC->CRCDATAIN.reg = *start++;
-		asm volatile("nop");
-		asm volatile("nop");
-	}
-
-	DMAC->CRCSTATUS.reg = DMAC_CRCSTATUS_CRCBUSY;
-	asm volatile("nop");
-	return DMAC->CRCCHKSUM.reg;
-}
-
-// Check that the bootloader we have been passed has a valid CRC
-bool CheckCRC(uint32_t *blockBuffer) noexcept
+// Check that the bootloader we have been passed has a valid CRC. The CRC is computed by DMA while this task sleeps.
+static bool CheckCRC(const uint32_t *blockBuffer) noexcept
 {
-	const uint32_t crcOffset = blockBuffer[7];						// vector M9 gives the offset of the CRC from start of file, in bytes
-	if (crcOffset < 0x2000 || crcOffset > FlashBlockSize - 4)		// if the file is shorter than 8K or longer than the buffer, error
-	{
-		return false;
-	}
-	const uint32_t expectedCRC = blockBuffer[crcOffset/4];
-	return ComputeCRC32(blockBuffer, blockBuffer + crcOffset/4) == expectedCRC;
+	return FlashCrc::CheckImageCrc(blockBuffer, FLASH_ADDR, FlashBlockSize);		// the bootloader is linked to run from the start of flash
 }
 
 // The task that runs to update the bootloader
@@ -467,6 +538,12 @@ ptrdiff_t Tasks::GetNeverUsedRam() noexcept
 	return heapLimit - heapTop;
 }
 
+// Check whether we can allocate an optional buffer or object. Call this before allocating anything large that a command asks for, so that the command fails instead of running out of RAM.
+bool Tasks::CanAllocate(size_t sz) noexcept
+{
+	return GetNeverUsedRam() - (ptrdiff_t)sz >= MinNeverUsedRamAfterAllocation;
+}
+
 // Function called by FreeRTOS and internally to reset the run-time counter and return the number of timer ticks since it was last reset
 extern "C" uint32_t TaskResetRunTimeCounter() noexcept
 {
@@ -477,14 +554,128 @@ extern "C" uint32_t TaskResetRunTimeCounter() noexcept
 	return ret;
 }
 
+void CpuUsageRecord::Add(uint8_t sample, size_t shortIndex, size_t longIndex) noexcept
+{
+	shortSamples[shortIndex] = sample;
+	if (shortIndex == NumCpuShortSamples - 1)
+	{
+		unsigned int total = 0;
+		for (uint8_t s : shortSamples)
+		{
+			total += s;
+		}
+		longSamples[longIndex] = (uint8_t)(total/NumCpuShortSamples);
+	}
+}
+
+// Get the CPU usage in tenths of a percent over the last 1 second (window 0), 10 seconds (window 1) or 60 seconds (window 2)
+unsigned int CpuUsageRecord::GetPermille(size_t numShort, size_t numLong, unsigned int window) const noexcept
+{
+	if (numShort == 0)
+	{
+		return 0;
+	}
+	const size_t lastShort = (cpuShortIndex + NumCpuShortSamples - 1) % NumCpuShortSamples;
+	if (window == 0)
+	{
+		return shortSamples[lastShort] * 5u;
+	}
+	if (window == 1 || numLong == 0)
+	{
+		unsigned int total = 0;
+		for (size_t i = 0; i < numShort; ++i)
+		{
+			total += shortSamples[(lastShort + NumCpuShortSamples - i) % NumCpuShortSamples];
+		}
+		return (total * 5u)/numShort;
+	}
+	unsigned int total = 0;
+	for (size_t i = 0; i < numLong; ++i)
+	{
+		total += longSamples[i];
+	}
+	return (total * 5u)/numLong;
+}
+
+static CpuUsageRecord *FindCpuUsageRecord(const TaskBase *t) noexcept
+{
+	for (size_t i = 0; i < numCpuTrackedTasks; ++i)
+	{
+		if (cpuUsage[i].task == t)
+		{
+			return &cpuUsage[i];
+		}
+	}
+	return nullptr;
+}
+
+static uint8_t ToCpuSample(uint32_t ticks, uint32_t interval) noexcept
+{
+	return (interval == 0) ? 0 : (uint8_t)min<uint32_t>(((uint64_t)ticks * 200u)/interval, 200u);
+}
+
+// Sample the CPU usage of each task and of the step ISR. Called frequently by the main task, but only does anything once a second.
+// This is the only place that resets the task run time counters, so reading the CPU usage doesn't disturb it.
+void Tasks::SampleCpuUsage() noexcept
+{
+	const uint32_t now = millis();
+	if (now - whenCpuLastSampled < CpuSampleIntervalMillis)
+	{
+		return;
+	}
+	whenCpuLastSampled = now;
+
+	const uint32_t timeSinceLastCall = TaskResetRunTimeCounter();
+	for (TaskBase *t = TaskBase::GetTaskList(); t != nullptr; t = t->GetNext())
+	{
+		CpuUsageRecord *rec = FindCpuUsageRecord(t);
+		if (rec == nullptr)
+		{
+			if (numCpuTrackedTasks == MaxCpuTrackedTasks)
+			{
+				continue;
+			}
+			rec = &cpuUsage[numCpuTrackedTasks++];
+			memset(rec, 0, sizeof(*rec));
+			rec->task = t;
+		}
+		ExtendedTaskStatus_t taskDetails;
+		vTaskGetExtendedInfo(t->GetFreeRTOSHandle(), &taskDetails);
+		rec->Add(ToCpuSample(taskDetails.ulRunTimeCounter, timeSinceLastCall), cpuShortIndex, cpuLongIndex);
+	}
+
+#if SUPPORT_DRIVERS
+	cpuUsage[MaxCpuTrackedTasks].Add(ToCpuSample(moveInstance->GetAndClearStepIsrClocks(), timeSinceLastCall), cpuShortIndex, cpuLongIndex);
+#endif
+
+	if (numCpuShortSamples < NumCpuShortSamples)
+	{
+		++numCpuShortSamples;
+	}
+	if (cpuShortIndex == NumCpuShortSamples - 1)
+	{
+		cpuLongIndex = (cpuLongIndex + 1) % NumCpuLongSamples;
+		if (numCpuLongSamples < NumCpuLongSamples)
+		{
+			++numCpuLongSamples;
+		}
+	}
+	cpuShortIndex = (cpuShortIndex + 1) % NumCpuShortSamples;
+}
+
+// Get the CPU usage of the step ISR in tenths of a percent
+unsigned int Tasks::GetStepIsrCpuPermille(unsigned int window) noexcept
+{
+	return cpuUsage[MaxCpuTrackedTasks].GetPermille(numCpuShortSamples, numCpuLongSamples, window);
+}
+
 void Tasks::Diagnostics(const StringRef& reply) noexcept
 {
 	// Append a memory report to a string
 	reply.lcatf("Never used RAM %d, free system stack %d words\nTasks:", GetNeverUsedRam(), GetHandlerFreeStack()/4);
 
-	// Now the per-task memory report
-	const uint32_t timeSinceLastCall = TaskResetRunTimeCounter();
-	float totalCpuPercent = 0.0;
+	// Now the per-task memory report, with the CPU usage over the last 1, 10 and 60 seconds
+	unsigned int totalCpuPermille = 0;
 	for (TaskBase *t = TaskBase::GetTaskList(); t != nullptr; t = t->GetNext())
 	{
 		ExtendedTaskStatus_t taskDetails;
@@ -534,11 +725,31 @@ void Tasks::Diagnostics(const StringRef& reply) noexcept
 			}
 		}
 
-		const float cpuPercent = (100 * (float)taskDetails.ulRunTimeCounter)/(float)timeSinceLastCall;
-		totalCpuPercent += cpuPercent;
-		reply.catf(" %s(%s%s,%.1f%%,%u)", taskDetails.pcTaskName, stateText, mutexName, (double)cpuPercent, (unsigned int)taskDetails.usStackHighWaterMark);
+		reply.catf(" %s(%s%s,", taskDetails.pcTaskName, stateText, mutexName);
+		const CpuUsageRecord * const rec = FindCpuUsageRecord(t);
+		if (rec != nullptr)
+		{
+			const unsigned int cpu1 = rec->GetPermille(numCpuShortSamples, numCpuLongSamples, 0);
+			const unsigned int cpu10 = rec->GetPermille(numCpuShortSamples, numCpuLongSamples, 1);
+			const unsigned int cpu60 = rec->GetPermille(numCpuShortSamples, numCpuLongSamples, 2);
+			totalCpuPermille += cpu1;
+			reply.catf("%u.%u/%u.%u/%u.%u%%,", cpu1/10, cpu1 % 10, cpu10/10, cpu10 % 10, cpu60/10, cpu60 % 10);
+		}
+		reply.catf("%u)", (unsigned int)taskDetails.usStackHighWaterMark);
+	}
+	reply.catf(", total %u.%u%%", totalCpuPermille/10, totalCpuPermille % 10);
+#if SUPPORT_DRIVERS
+	{
+		const CpuUsageRecord& isrRec = cpuUsage[MaxCpuTrackedTasks];
+		const unsigned int isr1 = isrRec.GetPermille(numCpuShortSamples, numCpuLongSamples, 0);
+		const unsigned int isr10 = isrRec.GetPermille(numCpuShortSamples, numCpuLongSamples, 1);
+		const unsigned int isr60 = isrRec.GetPermille(numCpuShortSamples, numCpuLongSamples, 2);
+		reply.catf(", step ISR %u.%u/%u.%u/%u.%u%%", isr1/10, isr1 % 10, isr10/10, isr10 % 10, isr60/10, isr60 % 10);
 	}
-	reply.catf(", total %.1f%%", (double)totalCpuPercent);
+#endif
+#if configUSE_TICKLESS_IDLE
+	reply.lcatf("Tickless idle: %" PRIu32 " sleeps, %" PRIu32 " ticks suppressed", numTicklessSleeps, numTicksSuppressed);
+#endif
 
 	// Show the up time and reason for the last reset
 	const uint32_t now = (uint32_t)(millis64()/1000u);		// get up time in seconds
@@ -561,6 +772,113 @@ void Tasks::Diagnostics(const StringRef& reply) noexcept
 	}
 }
 
+// The configured stack sizes of the tasks we create, so that we can work out how much of each stack has been used
+struct TaskStackSize
+{
+	const char *name;
+	size_t words;
+};
+
+static constexpr TaskStackSize taskStackSizes[] =
+{
+	{ "MAIN", MainTaskStackWords },
+	{ "IDLE", IdleTaskStackWords },
+	{ "Tmr Svc", TimerTaskStackWords },
+	{ "HEAT", HeaterTaskStackWords },
+	{ "Move", MoveTaskStackWords },
+	{ "TMC", TmcTaskStackWords },
+	{ "ACCEL", AccelerometerTaskStackWords },
+	{ "AIN", AnalogInTaskStackWords },
+	{ "CanClock", CanClockTaskStackWords },
+	{ "CanRecv", CanReceiverTaskStackWords },
+	{ "CanMotion", CanReceiverTaskStackWords },
+	{ "CanAsync", CanAsyncSenderTaskStackWords },
+	{ "CanSend", CanSenderTaskStackWords },
+	{ "CLSend", ClosedLoopTaskStackWords },
+};
+
+constexpr unsigned int DefaultStackMargin = 30;					// stack words to leave unused when suggesting a smaller stack, if no margin is given
+
+// Report the worst-case stack use of each task since startup, and the stack size we suggest given the margin.
+// Run this after putting the board through a load test, then use the XXX_TASK_STACK_WORDS macros in the board configuration file to shrink the stacks.
+GCodeResult Tasks::ReportStackUsage(unsigned int margin, const StringRef& reply) noexcept
+{
+	if (margin == 0)
+	{
+		margin = DefaultStackMargin;
+	}
+
+	reply.printf("Stack words size/used/suggested with margin %u:", margin);
+	unsigned int totalSpare = 0;
+	for (TaskBase *t = TaskBase::GetTaskList(); t != nullptr; t = t->GetNext())
+	{
+		ExtendedTaskStatus_t taskDetails;
+		vTaskGetExtendedInfo(t->GetFreeRTOSHandle(), &taskDetails);
+		const unsigned int unused = taskDetails.usStackHighWaterMark;
+		const TaskStackSize *entry = nullptr;
+		for (const TaskStackSize& tss : taskStackSizes)
+		{
+			if (strcmp(tss.name, taskDetails.pcTaskName) == 0)
+			{
+				entry = &tss;
+				break;
+			}
+		}
+
+		if (entry == nullptr)
+		{
+			reply.catf(" %s ?/?/?(%u unused)", taskDetails.pcTaskName, unused);
+		}
+		else
+		{
+			const unsigned int used = entry->words - unused;
+			const unsigned int suggested = ((used + margin + 9)/10) * 10;
+			reply.catf(" %s %u/%u/%u", taskDetails.pcTaskName, (unsigned int)entry->words, used, suggested);
+			if (suggested < entry->words)
+			{
+				totalSpare += entry->words - suggested;
+			}
+		}
+	}
+	reply.lcatf("Could save %u words", totalSpare);
+	return GCodeResult::ok;
+}
+
+// Append the up time, memory and per-task figures to the compact diagnostics.
+// Each task is reported as name,state:CPU time over the last second in tenths of a percent:stack high water mark in words:CPU time over 10 seconds:CPU time over 60 seconds.
+// The step ISR is reported at the end as a task with name ISR and state 0.
+void Tasks::AppendCompactDiagnostics(CompactDiagnostics& diags) noexcept
+{
+	diags.StartSection('R');
+	diags.Add((uint32_t)(millis64()/1000u));
+	diags.Add((uint32_t)RSTC->RCAUSE.reg);
+	diags.Add((int32_t)GetNeverUsedRam());
+	diags.Add((uint32_t)(GetHandlerFreeStack()/4));
+
+	diags.StartSection('T');
+	for (TaskBase *t = TaskBase::GetTaskList(); t != nullptr; t = t->GetNext())
+	{
+		ExtendedTaskStatus_t taskDetails;
+		vTaskGetExtendedInfo(t->GetFreeRTOSHandle(), &taskDetails);
+		const CpuUsageRecord * const rec = FindCpuUsageRecord(t);
+		diags.AddName(taskDetails.pcTaskName);
+		diags.Add((uint32_t)taskDetails.eCurrentState);
+		diags.AddPart((rec == nullptr) ? 0 : rec->GetPermille(numCpuShortSamples, numCpuLongSamples, 0));
+		diags.AddPart((uint32_t)taskDetails.usStackHighWaterMark);
+		diags.AddPart((rec == nullptr) ? 0 : rec->GetPermille(numCpuShortSamples, numCpuLongSamples, 1));
+		diags.AddPart((rec == nullptr) ? 0 : rec->GetPermille(numCpuShortSamples, numCpuLongSamples, 2));
+	}
+#if SUPPORT_DRIVERS
+	const CpuUsageRecord& isrRec = cpuUsage[MaxCpuTrackedTasks];
+	diags.AddName("ISR");
+	diags.Add((uint32_t)0);
+	diags.AddPart(isrRec.GetPermille(numCpuShortSamples, numCpuLongSamples, 0));
+	diags.AddPart(0);
+	diags.AddPart(isrRec.GetPermille(numCpuShortSamples, numCpuLongSamples, 1));
+	diags.AddPart(isrRec.GetPermille(numCpuShortSamples, numCpuLongSamples, 2));
+#endif
+}
+
 // Allocate memory permanently. Using this saves about 8 bytes per object. You must not call free() on the returned object.
 // It doesn't try to allocate from the free list maintained by malloc, only from virgin memory.
 void *Tasks::AllocPermanent(size_t sz, std::align_val_t align) noexcept
@@ -573,6 +891,7 @@ void *Tasks::AllocPermanent(size_t sz, std::align_val_t align) noexcept
 
 extern "C" void vApplicationTickHook(void) noexcept
 {
+	IsrTrace::RecordRunningTask();
 	CoreSysTick();
 	WatchdogReset();							// kick the watchdog
 	Platform::Tick();
@@ -598,6 +917,106 @@ extern "C" void vApplicationTickHook(void) noexcept
 #endif
 }
 
+#if configUSE_TICKLESS_IDLE
+
+// Tickless idle. When every task is blocked, FreeRTOS calls this instead of letting the tick interrupt wake the processor every millisecond.
+// We stop the tick, sleep until the next task is due to run or an interrupt wakes us, then tell FreeRTOS how many ticks we slept for.
+// The port's own version would stop millis() advancing and let the watchdog starve, because the tick hook isn't called for the ticks we skip.
+// Only the processor sleeps, so the step timer, CAN, ADC and DMA keep running and wake us as usual.
+static_assert(configUSE_TICKLESS_IDLE == 2, "Tickless idle must use the application-defined vPortSuppressTicksAndSleep");
+
+constexpr uint32_t CyclesPerTick = SystemCoreClockFreq/configTICK_RATE_HZ;
+constexpr uint32_t MaxSuppressedTicks = SysTick_LOAD_RELOAD_Msk/CyclesPerTick;
+constexpr uint32_t StoppedTimerCompensation = 45;				// approximate number of clock cycles that SysTick is stopped for while we reprogram it
+
+extern "C" void vPortSuppressTicksAndSleep(TickType_t expectedIdleTime) noexcept
+{
+	if (expectedIdleTime > MaxSuppressedTicks)
+	{
+		expectedIdleTime = MaxSuppressedTicks;
+	}
+
+	// Stop SysTick and work out the reload value that will wake us when the next task is due
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk;
+	uint32_t reloadValue = SysTick->VAL + (CyclesPerTick * (expectedIdleTime - 1));
+	if (reloadValue > StoppedTimerCompensation)
+	{
+		reloadValue -= StoppedTimerCompensation;
+	}
+
+	__disable_irq();
+	__DSB();
+	__ISB();
+
+	// If a task became ready or a context switch was requested since the scheduler decided to sleep, carry on with the current tick period instead
+	if (eTaskConfirmSleepModeStatus() == eAbortSleep)
+	{
+		SysTick->LOAD = SysTick->VAL;
+		SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+		SysTick->LOAD = CyclesPerTick - 1;
+		__enable_irq();
+		return;
+	}
+
+	SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;							// deep sleep would stop the clocks that the step timer and CAN use
+	SysTick->LOAD = reloadValue;
+	SysTick->VAL = 0;
+	SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+
+	__DSB();
+	__WFI();
+	__ISB();
+
+	// Let the interrupt that woke us run, then stop SysTick again while we account for the time we slept
+	__enable_irq();
+	__DSB();
+	__ISB();
+	__disable_irq();
+	__DSB();
+	__ISB();
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk;
+
+	uint32_t completeTicks;
+	if ((SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) != 0)
+	{
+		// We slept for the whole period and the tick interrupt has already counted the last tick, so restart SysTick for the rest of the current tick period
+		uint32_t calculatedLoadValue = (CyclesPerTick - 1) - (reloadValue - SysTick->VAL);
+		if (calculatedLoadValue <= StoppedTimerCompensation || calculatedLoadValue > CyclesPerTick)
+		{
+			calculatedLoadValue = CyclesPerTick - 1;
+		}
+		SysTick->LOAD = calculatedLoadValue;
+		completeTicks = expectedIdleTime - 1;
+	}
+	else
+	{
+		// Some other interrupt woke us, so work out how many whole ticks passed and restart SysTick at the end of the current one
+		const uint32_t cyclesElapsed = (expectedIdleTime * CyclesPerTick) - SysTick->VAL;
+		completeTicks = cyclesElapsed/CyclesPerTick;
+		SysTick->LOAD = ((completeTicks + 1) * CyclesPerTick) - cyclesElapsed;
+	}
+
+	SysTick->VAL = 0;
+	SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+	vTaskStepTick(completeTicks);
+	SysTick->LOAD = CyclesPerTick - 1;
+
+	// Do the work of the tick hook for the ticks we skipped, so that millis() stays in step with the tick count and the watchdog is kicked
+	for (uint32_t i = 0; i < completeTicks; ++i)
+	{
+		CoreSysTick();
+	}
+	WatchdogReset();
+	if (completeTicks != 0)
+	{
+		++numTicklessSleeps;
+		numTicksSuppressed += completeTicks;
+	}
+	__enable_irq();
+}
+
+#endif
+
 static StaticTask_t xTimerTaskTCB;
 static StackType_t uxTimerTaskStack[configTIMER_TASK_STACK_DEPTH];
 
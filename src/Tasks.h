@@ -12,13 +12,20 @@
 #include <RTOSIface/RTOSIface.h>
 #include <new>			// for std::align_val_t
 
+class CompactDiagnostics;
+
 [[noreturn]] void AppMain() noexcept;
 
 namespace Tasks
 {
 	ptrdiff_t GetNeverUsedRam() noexcept;
+	bool CanAllocate(size_t sz) noexcept;								// true if allocating sz bytes on demand would still leave enough never-used RAM
 	void *AllocPermanent(size_t sz, std::align_val_t align = (std::align_val_t)__STDCPP_DEFAULT_NEW_ALIGNMENT__) noexcept;
 	void Diagnostics(const StringRef& reply) noexcept;
+	void AppendCompactDiagnostics(CompactDiagnostics& diags) noexcept;
+	GCodeResult ReportStackUsage(unsigned int margin, const StringRef& reply) noexcept;
+	void SampleCpuUsage() noexcept;
+	unsigned int GetStepIsrCpuPermille(unsigned int window) noexcept;	// window 0, 1 or 2 selects the usage over the last 1, 10 or 60 seconds
 	uint32_t DoDivide(uint32_t a, uint32_t b) noexcept;
 	uint32_t DoMemoryRead(const uint32_t* addr) noexcept;
 	void *GetNVMBuffer(const uint32_t *_ecv_array null stk) noexcept;